@@ -153,6 +153,15 @@ class SwiftConsole(HasTraits):
     name = data[8:]
     print "VAR: %s = %d" % (name, x)
 
+  def debug_var_name_callback(self, data):
+    self.debug_var_names[ord(data[0])] = data[1:]
+
+  def debug_vars_callback(self, data):
+    for i in range(0, len(data) - 8, 9):
+      var_id, x = struct.unpack('<Bd', data[i:i+9])
+      name = self.debug_var_names.get(var_id, 'id %d' % var_id)
+      print "VAR: %s = %g" % (name, x)
+
   def __init__(self, *args, **kwargs):
     try:
       update = kwargs.pop('update')
@@ -168,6 +177,9 @@ class SwiftConsole(HasTraits):
       self.link.add_callback(ids.PRINT, self.print_message_callback)
 
       self.link.add_callback(ids.DEBUG_VAR, self.debug_var_callback)
+      self.debug_var_names = {}
+      self.link.add_callback(ids.DEBUG_VAR_NAME, self.debug_var_name_callback)
+      self.link.add_callback(ids.DEBUG_VARS, self.debug_vars_callback)
 
       settings_read_finished_functions = []
 
@@ -0,0 +1,79 @@
+#!/usr/bin/env python
+# Copyright (C) 2014 Swift Navigation Inc.
+# Contact: Fergus Noble <fergus@swift-nav.com>
+#
+# This source is subject to the license found in the file 'LICENSE' which must
+# be be distributed together with this source. All other rights reserved.
+#
+# THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+# EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+
+"""Capture the correlation trace to a file for tests/replay.
+
+Tracing is started by writing the `corr_trace` / `channel_mask` setting, to
+capture channels from when they are first acquired save the setting and
+reset the Piksi once this is running. Each MSG_CORR_TRACE payload is written
+to the file preceded by a byte giving its length, see src/corr_trace.h.
+"""
+
+import sys
+import struct
+import time
+
+import serial_link
+import sbp_piksi as ids
+
+class TraceWriter:
+
+  def __init__(self, filename):
+    self.f = open(filename, 'wb')
+    self.n_msgs = 0
+    self.n_bytes = 0
+    self.n_lost = 0
+    self.seq = None
+
+  def trace_callback(self, data):
+    seq = struct.unpack('<H', data[:2])[0]
+    if self.seq is not None and seq != (self.seq + 1) & 0xFFFF:
+      self.n_lost += (seq - self.seq - 1) & 0xFFFF
+    self.seq = seq
+    self.f.write(chr(len(data)) + data)
+    self.n_msgs += 1
+    self.n_bytes += len(data)
+
+  def close(self):
+    self.f.close()
+
+if __name__ == "__main__":
+  import argparse
+  parser = argparse.ArgumentParser(description='Capture the correlation trace.')
+  parser.add_argument('file', help='file to write the trace to.')
+  parser.add_argument('-p', '--port', default=[serial_link.DEFAULT_PORT],
+                      nargs=1, help='specify the serial port to use.')
+  parser.add_argument('-b', '--baud', default=[serial_link.DEFAULT_BAUD],
+                      nargs=1, help='specify the baud rate to use.')
+  parser.add_argument('-m', '--mask', default=None,
+                      help='channel mask to start tracing with, e.g. 0xF.')
+  args = parser.parse_args()
+
+  writer = TraceWriter(args.file)
+  link = serial_link.SerialLink(args.port[0], int(args.baud[0]))
+  link.add_callback(ids.PRINT, serial_link.default_print_callback)
+  link.add_callback(ids.CORR_TRACE, writer.trace_callback)
+
+  if args.mask is not None:
+    link.send_message(ids.SETTINGS, '%s\0%s\0%s\0' %
+                      ('corr_trace', 'channel_mask', int(args.mask, 0)))
+
+  try:
+    while True:
+      time.sleep(1)
+      print "%d messages, %.1f kB, %d lost" % (
+        writer.n_msgs, writer.n_bytes / 1024.0, writer.n_lost)
+      sys.stdout.flush()
+  except KeyboardInterrupt:
+    pass
+  finally:
+    link.close()
+    writer.close()
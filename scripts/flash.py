@@ -20,6 +20,17 @@ import new
 
 ADDRS_PER_OP = 128
 
+# Streaming programming, must match flash_callbacks.h.
+STREAM_ACK_INTERVAL = 4
+STREAM_WINDOW = 12
+# Seconds without an ack before resending from the last acked chunk.
+STREAM_TIMEOUT = 1.0
+# Seconds to wait for the device to answer a stream probe.
+STREAM_PROBE_TIMEOUT = 0.5
+
+FLASH_OK = 0
+FLASH_INVALID_SEQ = 6
+
 M25_SR_SRWD = 1 << 7
 M25_SR_BP2  = 1 << 4
 M25_SR_BP1  = 1 << 3
@@ -127,6 +138,12 @@ class Flash():
     self._read_callback_data = []
     self.link.add_callback(ids.FLASH_DONE, self._done_callback)
     self.link.add_callback(ids.FLASH_READ, self._read_callback)
+    self.link.add_callback(ids.FLASH_STREAM_ACK, self._stream_ack_callback)
+    self._read_results = {}
+    self._stream_acked = 0
+    self._stream_resend = None
+    self._stream_error = None
+    self._stream_ack_time = 0
     self.ihx_elapsed_ops = 0 # N operations finished in self.write_ihx
     self.ihx_total_ops = None # Total operations in self.write_ihx call
     if self.flash_type == "STM":
@@ -154,6 +171,7 @@ class Flash():
     self.stopped = True
     self.link.rm_callback(ids.FLASH_DONE, self._done_callback)
     self.link.rm_callback(ids.FLASH_READ, self._read_callback)
+    self.link.rm_callback(ids.FLASH_STREAM_ACK, self._stream_ack_callback)
 
   def __str__(self):
     return self.status
@@ -174,6 +192,89 @@ class Flash():
     while self._waiting_for_callback == True:
       time.sleep(0.001)
 
+  def _send_stream_chunk(self, seq, address, data):
+    msg_buf = struct.pack("B", self.flash_type_byte)
+    msg_buf += struct.pack("<H", seq)
+    msg_buf += struct.pack("<I", address)
+    msg_buf += struct.pack("B", len(data))
+    self.link.send_message(ids.FLASH_PROGRAM_STREAM, msg_buf + data)
+
+  # Check whether the device supports streaming programming by starting an
+  # empty stream, older firmware will not reply.
+  def stream_supported(self):
+    self._stream_acked = -1
+    self._stream_error = None
+    self._send_stream_chunk(0, 0, '')
+    t0 = time.time()
+    while self._stream_acked < 0 and self._stream_error is None:
+      if time.time() - t0 > STREAM_PROBE_TIMEOUT:
+        return False
+      time.sleep(0.001)
+    return self._stream_error is None
+
+  # Program a list of (address, data) chunks, keeping up to STREAM_WINDOW
+  # chunks in flight instead of waiting for each one to be written.
+  def program_stream(self, chunks, progress=None):
+    n = len(chunks)
+    self._stream_acked = 0
+    self._stream_resend = None
+    self._stream_error = None
+    self._stream_ack_time = time.time()
+    seq = 0
+    flushed = False
+    while self._stream_acked < n or not flushed:
+      if self._stream_error is not None:
+        raise Exception("Flash stream returned error (%d) after %d chunks" % \
+                        (self._stream_error, self._stream_acked))
+      if self._stream_resend is not None:
+        seq = self._stream_resend
+        self._stream_resend = None
+        flushed = False
+      if progress:
+        progress(self._stream_acked)
+      if seq < n and seq < self._stream_acked + STREAM_WINDOW:
+        self._send_stream_chunk(seq, *chunks[seq])
+        seq += 1
+      elif seq == n and not flushed:
+        self._send_stream_chunk(seq, 0, '')
+        flushed = True
+      else:
+        if time.time() - self._stream_ack_time > STREAM_TIMEOUT:
+          # Lost a chunk or an ack, go back to the last acked chunk.
+          seq = self._stream_acked
+          flushed = False
+          self._stream_ack_time = time.time()
+        time.sleep(0.001)
+
+  # Read a list of (address, length) sets, keeping up to STREAM_WINDOW reads
+  # in flight. Returns a dict of data read indexed by address.
+  def read_many(self, reqs, progress=None):
+    self._read_results = {}
+    sent = 0
+    t_last = time.time()
+    while len(self._read_results) < len(reqs):
+      if progress:
+        progress(len(self._read_results))
+      if sent < len(reqs) and sent - len(self._read_results) < STREAM_WINDOW:
+        address, length = reqs[sent]
+        msg_buf = struct.pack("B", self.flash_type_byte)
+        msg_buf += struct.pack("<I", address)
+        msg_buf += struct.pack("B", length)
+        self.link.send_message(ids.FLASH_READ, msg_buf)
+        sent += 1
+        continue
+      if time.time() - t_last > STREAM_TIMEOUT:
+        # Re-request anything that has not been answered.
+        for address, length in reqs[:sent]:
+          if address not in self._read_results:
+            msg_buf = struct.pack("B", self.flash_type_byte)
+            msg_buf += struct.pack("<I", address)
+            msg_buf += struct.pack("B", length)
+            self.link.send_message(ids.FLASH_READ, msg_buf)
+        t_last = time.time()
+      time.sleep(0.001)
+    return self._read_results
+
   def read(self, address, length):
     msg_buf = struct.pack("B", self.flash_type_byte)
     msg_buf += struct.pack("<I", address)
@@ -206,8 +307,20 @@ class Flash():
     self._read_callback_length = struct.unpack('B', data[4])[0]
     length = self._read_callback_length
     self._read_callback_data = list(struct.unpack(str(length)+'B', data[5:]))
+    self._read_results[self._read_callback_address] = self._read_callback_data
     self._waiting_for_callback = False
 
+  # Cumulative ack of a programming stream.
+  def _stream_ack_callback(self, data):
+    status, seq = struct.unpack('<BH', data)
+    self._stream_ack_time = time.time()
+    if status == FLASH_INVALID_SEQ:
+      self._stream_resend = seq
+    elif status != FLASH_OK:
+      self._stream_error = status
+    else:
+      self._stream_acked = max(self._stream_acked, seq)
+
   def write_ihx(self, ihx, stream=None, mod_print=0):
     self.ihx_total_ops = ihx_n_ops(ihx, self.addr_sector_map)
     self.ihx_elapsed_ops = 0
@@ -227,6 +340,18 @@ class Flash():
 
     # Write data to flash and validate
     start_time = time.time()
+    if self.stream_supported():
+      self._write_ihx_stream(ihx, ihx_addrs, stream)
+    else:
+      self._write_ihx_chunked(ihx, ihx_addrs, stream, mod_print)
+    self.status = self.flash_type + " Flash: Successfully programmed and " + \
+                                    "verified, total time = %d seconds" % \
+                                    int(time.time()-start_time)
+    if stream:
+      stream.write('\n\r' + self.status + '\n')
+
+  # Program and verify one chunk at a time, waiting for each reply.
+  def _write_ihx_chunked(self, ihx, ihx_addrs, stream=None, mod_print=0):
     for start, end in ihx_addrs:
       for addr in range(start, end, ADDRS_PER_OP):
         self.status = self.flash_type + " Flash: Programming address" + \
@@ -245,9 +370,34 @@ class Flash():
         self.ihx_elapsed_ops += 1
         if flash_readback != map(ord, binary):
           raise Exception('Data read from flash != Data written to flash')
-    self.status = self.flash_type + " Flash: Successfully programmed and " + \
-                                    "verified, total time = %d seconds" % \
-                                    int(time.time()-start_time)
-    if stream:
-      stream.write('\n\r' + self.status + '\n')
 
+  # Stream all chunks, then read them all back to verify.
+  def _write_ihx_stream(self, ihx, ihx_addrs, stream=None):
+    chunks = []
+    for start, end in ihx_addrs:
+      for addr in range(start, end, ADDRS_PER_OP):
+        chunks.append((addr, ihx.tobinstr(start=addr, size=ADDRS_PER_OP)))
+    base_ops = self.ihx_elapsed_ops
+
+    def progress(verb, offset):
+      last = [None]
+      def f(n):
+        if n == last[0]:
+          return
+        last[0] = n
+        self.ihx_elapsed_ops = base_ops + offset + n
+        if n < len(chunks):
+          self.status = self.flash_type + " Flash: %s address" % verb + \
+                                          " 0x%08X" % chunks[n][0]
+          if stream:
+            stream.write('\r' + self.status)
+            stream.flush()
+      return f
+
+    self.program_stream(chunks, progress("Programming", 0))
+    readback = self.read_many([(addr, ADDRS_PER_OP) for addr, _ in chunks],
+                              progress("Verifying", len(chunks)))
+    for addr, binary in chunks:
+      if readback[addr] != map(ord, binary):
+        raise Exception('Data read from flash != Data written to flash')
+    self.ihx_elapsed_ops = base_ops + 2*len(chunks)
@@ -116,6 +116,90 @@ class ObservationView(HasTraits):
       obs_data = obs_data[obs_size:]
       self.obs[prn] = (P, L, snr)
 
+    self.epoch_done()
+
+  def packed_obs_callback(self, data, sender=None):
+    if (sender is not None and
+        (self.relay ^ (sender == 0))):
+      return
+
+    # Header: gps_time_t t, u8 count, u8 seq (n_parts << 4 | part)
+    hdr_fmt = '<dHBB'
+    hdr_size = struct.calcsize(hdr_fmt)
+    tow, wn, count, seq = struct.unpack(hdr_fmt, data[:hdr_size])
+    n_parts, part = seq >> 4, seq & 0x0F
+
+    if self.packed_epoch != (count, tow, wn):
+      self.packed_epoch = (count, tow, wn)
+      self.packed_parts = set()
+      self.packed_obs = {}
+
+    # Records are either full:  u8 prn, u8 snr, u32 P, s32 L_i, u8 L_f
+    #                 or delta: u8 prn | 0x80, u8 snr, s16 dP, s32 dL
+    # with deltas relative to the record for the PRN in epoch count - 1.
+    data = data[hdr_size:]
+    while len(data) > 0:
+      prn = ord(data[0]) & 0x7F
+      if ord(data[0]) & 0x80:
+        _, snr, dP, dL = struct.unpack('<BBhi', data[:8])
+        data = data[8:]
+        ref = self.packed_refs.get(prn)
+        if ref is None or ref[0] != (count - 1) % 256:
+          self.packed_refs.pop(prn, None)
+          continue
+        P, L = ref[1] + dP, ref[2] + dL
+      else:
+        _, snr, P, L_i, L_f = struct.unpack('<BBIiB', data[:11])
+        data = data[11:]
+        L = L_i * 256 + L_f
+      self.packed_refs[prn] = (count, P, L)
+      self.packed_obs[prn] = (P * 0.02, L / 256.0,
+                              10 ** ((snr - 128) * 0.5 / 10))
+
+    self.packed_parts.add(part)
+    if len(self.packed_parts) < n_parts:
+      return
+
+    self.gps_tow = tow
+    self.gps_week = wn
+    self.t = datetime.datetime(1980, 1, 5) + \
+             datetime.timedelta(weeks=self.gps_week) + \
+             datetime.timedelta(seconds=self.gps_tow)
+    self.obs = self.packed_obs
+    self.n_obs = len(self.obs)
+    self.packed_epoch = None
+    self.epoch_done()
+
+  def compact_obs_callback(self, data, sender=None):
+    if (sender is not None and
+        (self.relay ^ (sender == 0))):
+      return
+
+    hdr_fmt = '<dH'
+    hdr_size = struct.calcsize(hdr_fmt)
+    self.gps_tow, self.gps_week = struct.unpack(hdr_fmt, data[:hdr_size])
+    self.t = datetime.datetime(1980, 1, 5) + \
+             datetime.timedelta(weeks=self.gps_week) + \
+             datetime.timedelta(seconds=self.gps_tow)
+
+    # Records: u8 prn, u8 amb, u24 P, s24 cpr, u8 lock, u8 snr
+    lms = 299792.458
+    lam = 299792458.0 / 1.57542e9
+    self.obs = {}
+    data = data[hdr_size:]
+    while len(data) >= 10:
+      prn, amb = struct.unpack('<BB', data[:2])
+      P = struct.unpack('<I', data[2:5] + '\0')[0]
+      cpr = struct.unpack('<i', '\0' + data[5:8])[0] >> 8
+      lock, snr = struct.unpack('<BB', data[8:10])
+      data = data[10:]
+      P = amb * lms + P * 0.02
+      L = (cpr * 0.0005 - P) / lam
+      self.obs[prn] = (P, L, 10 ** ((snr - 128) * 0.5 / 10))
+    self.n_obs = len(self.obs)
+    self.epoch_done()
+
+  def epoch_done(self):
     self.update_obs()
 
     if self.recording:
@@ -169,10 +253,15 @@ class ObservationView(HasTraits):
     self.relay = relay
     self.name = name
 
+    self.packed_epoch = None
+    self.packed_refs = {}
+
     self.rinex_file = None
 
     self.link = link
     self.link.add_callback(ids.NEW_OBS, self.obs_callback)
+    self.link.add_callback(ids.PACKED_OBS, self.packed_obs_callback)
+    self.link.add_callback(ids.COMPACT_OBS, self.compact_obs_callback)
 
     self.python_console_cmds = {
       'obs': self
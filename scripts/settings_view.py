@@ -147,29 +147,27 @@ class SettingsView(HasTraits):
     self.settings.clear()
     self.enumindex = 0
     self.ordering_counter = 0
-    self.link.send_message(ids.SETTINGS_READ_BY_INDEX, u16_to_str(self.enumindex))
+    self.link.send_message(ids.SETTINGS_READ_BULK, u16_to_str(self.enumindex))
 
   def _settings_save_button_fired(self):
     self.link.send_message(ids.SETTINGS_SAVE, "")
 
   ##Callbacks for receiving messages
 
-  def settings_read_by_index_callback(self, data):
-    if not data:
-      self.settings_list = []
+  def settings_read_finished(self):
+    self.settings_list = []
 
-      sections = sorted(self.settings.keys())
+    sections = sorted(self.settings.keys())
 
-      for sec in sections:
-        self.settings_list.append(SectionHeading(sec))
-        for name, setting in sorted(self.settings[sec].iteritems(), key=lambda (n, s): s.ordering):
-          self.settings_list.append(setting)
+    for sec in sections:
+      self.settings_list.append(SectionHeading(sec))
+      for name, setting in sorted(self.settings[sec].iteritems(), key=lambda (n, s): s.ordering):
+        self.settings_list.append(setting)
 
-      for cb in self.read_finished_functions:
-        GUI.invoke_later(cb)
-      return
+    for cb in self.read_finished_functions:
+      GUI.invoke_later(cb)
 
-    section, setting, value, format_type = data[2:].split('\0')[:4]
+  def settings_add(self, section, setting, value, format_type):
     self.ordering_counter += 1
 
     if format_type == '':
@@ -197,8 +195,34 @@ class SettingsView(HasTraits):
         # Unknown type, just treat is as a string
         self.settings[section][setting] = Setting(setting, section, value, link=self.link)
 
+  def settings_read_by_index_callback(self, data):
+    if not data:
+      self.settings_read_finished()
+      return
+
+    self.settings_add(*data[2:].split('\0')[:4])
+
     self.enumindex += 1
-    self.link.send_message(ids.SETTINGS_READ_BY_INDEX, u16_to_str(self.enumindex))
+    self.link.send_message(ids.SETTINGS_READ_BULK, u16_to_str(self.enumindex))
+
+  def settings_read_bulk_callback(self, data):
+    # Reply is the u16 start index, a u8 count and then count settings each
+    # as four null terminated strings. Without a count the setting at the
+    # index is too long for a bulk reply, read it on its own.
+    if len(data) < 3:
+      self.link.send_message(ids.SETTINGS_READ_BY_INDEX, u16_to_str(self.enumindex))
+      return
+    count = ord(data[2])
+    if count == 0:
+      self.settings_read_finished()
+      return
+
+    fields = data[3:].split('\0')
+    for i in range(count):
+      self.settings_add(*fields[4*i:4*i + 4])
+
+    self.enumindex += count
+    self.link.send_message(ids.SETTINGS_READ_BULK, u16_to_str(self.enumindex))
 
   def settings_read_callback(self, data):
     section, setting, value = data.split('\0')[:3]
@@ -219,6 +243,8 @@ class SettingsView(HasTraits):
     self.link.add_callback(ids.SBP_STARTUP, self.piksi_startup_callback)
     self.link.add_callback(ids.SETTINGS_READ_BY_INDEX,
         self.settings_read_by_index_callback)
+    self.link.add_callback(ids.SETTINGS_READ_BULK,
+        self.settings_read_bulk_callback)
 
     # List of functions to be executed after all settings are read.
     # No support for arguments currently.
@@ -0,0 +1,185 @@
+#!/usr/bin/env python
+# Copyright (C) 2014 Swift Navigation Inc.
+# Contact: Fergus Noble <fergus@swift-nav.com>
+#
+# This source is subject to the license found in the file 'LICENSE' which must
+# be be distributed together with this source. All other rights reserved.
+#
+# THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+# EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+
+"""Suggest thread working area sizes from measured stack use.
+
+Needs firmware built with `make STACK_PROFILE=yes`, which prints a line
+
+  STACK <thread name> <stack limit> <free bytes>
+
+for every thread and the interrupt stack every few seconds. Either capture
+them live from the Piksi, while putting it through the worst case load (e.g.
+a DGNSS reset, a large IAR hypothesis set and a full settings read), and
+stop with Ctrl-C, or pass a saved console log with --log.
+
+Each thread's stack limit is looked up in the firmware's symbols to find its
+working area, and from that the WORKING_AREA_CCM() declaration in src. The
+stack use seen is the declared size less the free bytes, the suggested size
+is that plus the margin.
+"""
+
+import glob
+import os
+import re
+import subprocess
+import sys
+import time
+
+STACK_RE = re.compile(r'STACK (.+) 0x([0-9A-Fa-f]{8}) (\d+)')
+WA_RE = re.compile(r'WORKING_AREA_CCM\(\s*(\w+)\s*,\s*([^)]+?)\s*\)')
+DEFINE_RE = re.compile(r'#define\s+(\w+)\s+(\d+)\b')
+MAIN_STACK_RE = re.compile(r'__main_stack_size__\s*=\s*(0x[0-9A-Fa-f]+|\d+)')
+
+class StackLog:
+
+  def __init__(self):
+    self.free = {}
+
+  def line(self, text):
+    m = STACK_RE.search(text)
+    if not m:
+      return
+    key = (m.group(1), int(m.group(2), 16))
+    free = int(m.group(3))
+    self.free[key] = min(free, self.free.get(key, free))
+
+  def print_callback(self, data):
+    for text in data.splitlines():
+      self.line(text)
+
+def working_areas(elf, nm):
+  """Working area symbols in the firmware, (address, size, name)."""
+  out = subprocess.check_output([nm, '-S', '--defined-only', elf])
+  areas = []
+  for l in out.splitlines():
+    f = l.split()
+    if len(f) == 4 and f[3].startswith('wa_'):
+      areas.append((int(f[0], 16), int(f[1], 16), f[3]))
+  return areas
+
+def declarations(src):
+  """WORKING_AREA_CCM() declarations in the source, name -> (where, size)."""
+  files = []
+  for root, dirs, names in os.walk(src):
+    files += [os.path.join(root, n) for n in names
+              if n.endswith('.c') or n.endswith('.h')]
+
+  defines = {}
+  decls = {}
+  for fn in files:
+    text = open(fn).read()
+    for m in DEFINE_RE.finditer(text):
+      defines[m.group(1)] = int(m.group(2))
+    for i, l in enumerate(text.splitlines()):
+      m = WA_RE.search(l)
+      if m and not l.lstrip().startswith('#define'):
+        decls[m.group(1)] = ('%s:%d' % (os.path.relpath(fn, src), i + 1),
+                             m.group(2))
+
+  for name, (where, size) in decls.items():
+    if size.isdigit():
+      decls[name] = (where, int(size))
+    else:
+      decls[name] = (where, defines.get(size))
+  return decls
+
+def main_stack_size(src):
+  for fn in glob.glob(os.path.join(src, '*.ld')):
+    m = MAIN_STACK_RE.search(open(fn).read())
+    if m:
+      return fn, int(m.group(1), 0)
+  return None, None
+
+def round_up(n, align=8):
+  return (n + align - 1) // align * align
+
+def report(log, elf, src, nm, margin):
+  areas = working_areas(elf, nm)
+  decls = declarations(src)
+
+  rows = []
+  for (thread, limit), free in sorted(log.free.items()):
+    if thread == 'irq':
+      ld, size = main_stack_size(src)
+      where = os.path.relpath(ld, src) if ld else '?'
+      symbol = '__main_stack_size__'
+    else:
+      symbol = None
+      for addr, wa_size, name in areas:
+        if addr <= limit < addr + wa_size:
+          symbol = name
+      where, size = decls.get(symbol, ('?', None))
+    if size is None:
+      rows.append((thread, symbol or '?', where, None, None, None))
+      continue
+    used = max(size - free, 0)
+    rows.append((thread, symbol, where, size, used,
+                 round_up(int(used * (1 + margin)))))
+
+  print '%-20s %-28s %-24s %7s %7s %9s' % (
+    'Thread', 'Working area', 'Declared at', 'Size', 'Used', 'Suggested')
+  saved = 0
+  for thread, symbol, where, size, used, suggested in rows:
+    if size is None:
+      print '%-20s %-28s %-24s %7s' % (thread, symbol, where, '?')
+      continue
+    print '%-20s %-28s %-24s %7d %7d %9d' % (
+      thread, symbol, where, size, used, suggested)
+    if symbol.startswith('wa_'):
+      saved += size - suggested
+  print
+  print 'Working areas at the suggested sizes free %d bytes of CCM.' % saved
+
+if __name__ == "__main__":
+  import argparse
+  parser = argparse.ArgumentParser(
+    description='Suggest thread working area sizes from measured stack use.')
+  parser.add_argument('elf', help='firmware built with STACK_PROFILE=yes.')
+  parser.add_argument('-l', '--log', default=None,
+                      help='console log to read instead of the serial port.')
+  parser.add_argument('-m', '--margin', default=0.25, type=float,
+                      help='margin over the stack use seen, default 0.25.')
+  parser.add_argument('-s', '--src', default=os.path.join(
+                        os.path.dirname(os.path.abspath(__file__)), '..', 'src'),
+                      help='firmware source directory.')
+  parser.add_argument('--nm', default='arm-none-eabi-nm',
+                      help='nm for the firmware toolchain.')
+  parser.add_argument('-p', '--port', default=None,
+                      help='serial port to capture from.')
+  parser.add_argument('-b', '--baud', default=None, type=int,
+                      help='baud rate to capture at.')
+  args = parser.parse_args()
+
+  log = StackLog()
+  if args.log:
+    for l in open(args.log):
+      log.line(l)
+  else:
+    import serial_link
+    import sbp_piksi as ids
+    link = serial_link.SerialLink(args.port or serial_link.DEFAULT_PORT,
+                                  args.baud or serial_link.DEFAULT_BAUD)
+    link.add_callback(ids.PRINT, log.print_callback)
+    try:
+      while True:
+        time.sleep(1)
+        print "%d threads seen" % len(log.free)
+        sys.stdout.flush()
+    except KeyboardInterrupt:
+      pass
+    finally:
+      link.close()
+
+  if not log.free:
+    print 'No STACK reports seen, was the firmware built with STACK_PROFILE=yes?'
+    sys.exit(1)
+
+  report(log, args.elf, os.path.abspath(args.src), args.nm, args.margin)
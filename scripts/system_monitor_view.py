@@ -24,6 +24,8 @@ import sbp_piksi as sbp_messages
 class SimpleAdapter(TabularAdapter):
     columns = [('Thread Name', 0), ('CPU %',  1), ('Stack Free',  2)]
 
+THREAD_STATE_LEN = struct.calcsize('<20sHI')
+
 class ThreadState:
   def from_binary(self, data):
     state = struct.unpack('<20sHI', data)
@@ -52,6 +54,9 @@ class SystemMonitorView(HasTraits):
   ftdi_rx = Float(0)
   ftdi_tx = Float(0)
 
+  cpu_load = Float(0)
+  load_level = Int(0)
+
   traits_view = View(
     HSplit(
       Item(
@@ -60,6 +65,12 @@ class SystemMonitorView(HasTraits):
         show_label=False, width=0.85,
       ),
       VGroup(
+        VGroup(
+          Item('cpu_load', label='CPU Load %',
+               style='readonly', format_str='%.1f'),
+          Item('load_level', label='Load Shedding', style='readonly'),
+          label='System', show_border=True,
+        ),
         VGroup(
           Item('uart_a_crc_error_count', label='CRC Errors', style='readonly'),
           Item('uart_a_tx', label='TX Buffer %',
@@ -100,6 +111,10 @@ class SystemMonitorView(HasTraits):
     th.from_binary(data)
     self.threads.append((th.name, th))
 
+  def thread_states_callback(self, data):
+    for i in range(0, len(data) - THREAD_STATE_LEN + 1, THREAD_STATE_LEN):
+      self.thread_state_callback(data[i:i+THREAD_STATE_LEN])
+
   def uart_state_callback(self, data):
     state = struct.unpack('<HBBHBBHBB', data)
     self.uart_a_crc_error_count = state[0]
@@ -109,13 +124,19 @@ class SystemMonitorView(HasTraits):
     self.ftdi_crc_error_count = state[6]
     self.ftdi_tx, self.ftdi_rx = map(lambda x: 100.0 * x / 255.0, state[7:9])
 
+  def system_load_callback(self, data):
+    load, self.load_level = struct.unpack('<HB', data)
+    self.cpu_load = load / 10.
+
   def __init__(self, link):
     super(SystemMonitorView, self).__init__()
 
     self.link = link
     self.link.add_callback(sbp_messages.SBP_HEARTBEAT, self.heartbeat_callback)
     self.link.add_callback(sbp_messages.THREAD_STATE, self.thread_state_callback)
+    self.link.add_callback(sbp_messages.THREAD_STATES, self.thread_states_callback)
     self.link.add_callback(sbp_messages.UART_STATE, self.uart_state_callback)
+    self.link.add_callback(sbp_messages.SYSTEM_LOAD, self.system_load_callback)
 
     self.python_console_cmds = {
       'mon': self
@@ -12,6 +12,7 @@
 
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <ch.h>
 
@@ -20,6 +21,8 @@
 #include "board/nap/acq_channel.h"
 #include "board/nap/nap_exti.h"
 #include "acq.h"
+#include "log.h"
+#include "timebase.h"
 #include "track.h"
 
 /** \defgroup acq Acquisition
@@ -27,146 +30,403 @@
  * acquisition channel correlations and peak detection.
  * \{ */
 
-acq_state_t acq_state;
+/** Length of the C/A code in acq code phase units. */
+#define ACQ_CP_PERIOD (1023 * NAP_ACQ_CODE_PHASE_UNITS_PER_CHIP)
 
-BinarySemaphore load_wait_sem;
-BinarySemaphore acq_wait_sem;
+acq_state_t acq_state[NAP_ACQ_MAX_CHANNELS];
 
-/** Schedule a load of samples into the acquisition channel's sample ram.
- * The load starts at the end of the next timing strobe and continues until the
- * ram is full, at which time an interrupt is raised to the STM. This interrupt
- * is cleared by clearing the load enable bit of the acquisition channel's
- * LOAD ENABLE register.
+/** Signalled each time a search finishes on any channel, see
+ * acq_wait_any_done(). */
+static SEMAPHORE_DECL(acq_any_done_sem, 0);
+
+/** Carrier frequency ranges to leave out of acquisition searches, set by the
+ * CW interference monitor. Latched by acq_start(). */
+static acq_cf_mask_t acq_cf_mask[ACQ_CF_MASK_MAX];
+static u8 acq_cf_mask_n = 0;
+
+/** Peak to mean power ratio that ends a search early, latched by
+ * acq_start(). */
+static float acq_early_snr = 0;
+
+/** Accumulation for the next search, consumed by acq_start(). */
+static acq_dwell_t *acq_next_dwell = NULL;
+
+/** Schedule a load of samples into the acquisition channels' sample rams.
+ * Every acquisition channel is loaded from the same timing strobe so they
+ * all hold the same samples and the PRNs searched against a load can be
+ * shared out between them. The load starts at the end of the next timing
+ * strobe and continues until the ram is full, at which time an interrupt is
+ * raised to the STM. This interrupt is cleared by clearing the load enable
+ * bit of the acquisition channel's LOAD ENABLE register.
  *
  * \param count The value of the NAP's internal counter at which the timing
  *              strobe is to go low.
  */
 void acq_schedule_load(u32 count)
 {
-  /* Initialise semaphore in the taken state, the calling thread can then wait
-   * for the load to complete by waiting on this semaphore. */
-  chBSemInit(&load_wait_sem, TRUE);
-
-  acq_state.state = ACQ_LOADING;
-  nap_acq_load_wr_enable_blocking();
+  for (u8 i=0; i<nap_acq_n_channels; i++) {
+    /* Initialise semaphore in the taken state, the calling thread can then
+     * wait for the load to complete by waiting on this semaphore. */
+    chBSemInit(&acq_state[i].load_sem, TRUE);
+    acq_state[i].state = ACQ_LOADING;
+    nap_acq_load_wr_enable_blocking(i);
+  }
   nap_timing_strobe(count);
 }
 
-/** Handle an acquisition load done interrupt from the NAP acquisition channel.
+/** Handle an acquisition load done interrupt from a NAP acquisition channel.
  * Clear the enable bit of the acquisition channel load register and change
  * the acquisition state to ACQ_LOADING_DONE.
+ *
+ * \param channel Acquisition channel.
  */
-void acq_service_load_done()
+void acq_service_load_done(u8 channel)
 {
-  nap_acq_load_wr_disable_blocking();
-  acq_state.state = ACQ_LOADING_DONE;
+  acq_state_t *s = &acq_state[channel];
+
+  nap_acq_load_wr_disable_blocking(channel);
+  s->state = ACQ_LOADING_DONE;
 
   /* Release semaphore to signal to waiting thread that
    * the load is complete. */
-  chBSemSignal(&load_wait_sem);
+  chBSemSignal(&s->load_sem);
 }
 
-/** Pause thread until acquisition channel sample ram loading is complete.
+/** Pause thread until every acquisition channel's sample ram load is
+ * complete.
+ *
+ * \param timeout Maximum time to wait for each channel, or TIME_INFINITE.
+ * \return true if the loads completed, false if a wait timed out.
  */
-void acq_wait_load_done()
+bool acq_wait_load_done(systime_t timeout)
 {
-  chBSemWait(&load_wait_sem);
+  for (u8 i=0; i<nap_acq_n_channels; i++)
+    if (chBSemWaitTimeout(&acq_state[i].load_sem, timeout) != RDY_OK)
+      return false;
+  return true;
 }
 
-/** Query the state of the acquisition channel sample ram loading.
- * \return 1 if loading has finished, 0 otherwise
+/** Query the state of the acquisition channels' sample ram loading.
+ * \return 1 if loading has finished on every channel, 0 otherwise
  */
 u8 acq_get_load_done()
 {
-  return (acq_state.state == ACQ_LOADING_DONE);
+  for (u8 i=0; i<nap_acq_n_channels; i++)
+    if (acq_state[i].state != ACQ_LOADING_DONE)
+      return 0;
+  return 1;
+}
+
+/** Set the carrier frequency ranges excluded from acquisition searches.
+ * Correlations in a masked range are neither considered as a peak nor
+ * counted towards the mean power, so a narrowband interferer can't produce a
+ * false coarse peak. Takes effect from the next call to acq_start().
+ *
+ * \param n    Number of ranges, at most ACQ_CF_MASK_MAX. 0 clears the mask.
+ * \param mask Array of ranges to mask.
+ */
+void acq_set_cf_mask(u8 n, const acq_cf_mask_t mask[])
+{
+  n = MIN(n, ACQ_CF_MASK_MAX);
+  chSysLock();
+  memcpy(acq_cf_mask, mask, n * sizeof(acq_cf_mask_t));
+  acq_cf_mask_n = n;
+  chSysUnlock();
+}
+
+/** Set the peak to mean power ratio above which a search stops early.
+ * A strong satellite is usually found well before the whole range has been
+ * searched, especially as the search starts at the middle of the carrier
+ * frequency range where the expected Doppler is. The ratio is checked each
+ * time a carrier freq bin has been searched in full, and if it is exceeded
+ * the remaining bins are skipped. Because the rest of the range is never
+ * looked at, a stronger peak elsewhere can be missed, so only use it for
+ * searches whose result is refined afterwards. Takes effect from the next
+ * call to acq_start() on any channel.
+ *
+ * \param snr Peak to mean power ratio, 0 to always search the whole range.
+ */
+void acq_set_early_exit(float snr)
+{
+  acq_early_snr = snr;
+}
+
+/** Make the next search one dwell of a multi-dwell search.
+ * A single search of a weak satellite gives a peak barely above the noise,
+ * and a noise peak can look just as good. Searching the same small window
+ * around the peak against several fresh sample loads and adding up the
+ * power of each search point lets the satellite's peak build up while the
+ * noise averages out, see acq_dwell_snr().
+ *
+ * Every dwell must search the same number of code phases and carrier freqs,
+ * centred on the peak propagated to that dwell's load, so that the points
+ * line up. Only applies to the next call to acq_start(), the early exit is
+ * ignored for dwells.
+ *
+ * \param d Accumulation to add the next search to.
+ */
+void acq_set_dwell(acq_dwell_t *d)
+{
+  acq_next_dwell = d;
+}
+
+/** Peak to mean power ratio of a multi-dwell search so far.
+ * The largest search point's peak power averaged over the dwells, against
+ * the mean power of a correlation. Noise averages out with more dwells so
+ * the ratio noise reaches falls, see acq_dwell_threshold().
+ */
+float acq_dwell_snr(const acq_dwell_t *d)
+{
+  if (d->count == 0 || d->n_dwells == 0)
+    return 0;
+  float best = 0;
+  for (u16 i=0; i<ACQ_DWELL_POINTS_MAX; i++)
+    best = MAX(best, d->power[i]);
+  return (best / d->n_dwells) / (d->power_acc / d->count);
+}
+
+/** Multi-dwell SNR that noise alone exceeds with a given probability.
+ * In noise the power of each correlation is exponentially distributed. A
+ * search point's peak is the largest of nap_acq_n_taps of them, which in
+ * units of the mean power has mean sum(1/k) and variance sum(1/k^2) over
+ * k = 1..nap_acq_n_taps, and acq_dwell_snr() takes the largest over the
+ * points of that averaged over the dwells. The average is approximated by
+ * a gamma distribution of the same mean and variance, whose quantile for
+ * p_fa / n_points comes from the Wilson-Hilferty transformation with the
+ * normal quantile of Abramowitz and Stegun 26.2.23. Good to a factor of
+ * about 1.5 in the probability.
+ *
+ * \param d    Multi-dwell search, after at least one dwell.
+ * \param p_fa Probability of noise reaching the threshold anywhere in the
+ *             window.
+ * \return Threshold for acq_dwell_snr().
+ */
+float acq_dwell_threshold(const acq_dwell_t *d, float p_fa)
+{
+  float mean = 0, var = 0;
+  for (u8 k=1; k<=nap_acq_n_taps; k++) {
+    mean += 1.0f / k;
+    var += 1.0f / (k*k);
+  }
+  var /= MAX(d->n_dwells, 1);
+
+  float t = sqrtf(-2 * logf(p_fa / MAX(d->n_points, 1)));
+  float z = t - (2.515517f + 0.802853f*t + 0.010328f*t*t) /
+                (1 + 1.432788f*t + 0.189269f*t*t + 0.001308f*t*t*t);
+
+  float shape = mean*mean / var;
+  float wh = 1 - 1 / (9*shape) + z / (3*sqrtf(shape));
+  return mean * wh*wh*wh;
+}
+
+/** Carrier frequency of a bin in the search order.
+ * Bins are searched from the middle of the range outwards, alternately
+ * above and below, carrying on along the longer side once the shorter side
+ * has run out.
+ *
+ * \param s Acquisition channel state.
+ * \param k Position in the search order, 0 to s->n_cf-1.
+ * \return Carrier frequency in acq units.
+ */
+/** Wrap a code phase past the end of the code back to its start. A search
+ * window may run past ACQ_CP_PERIOD, see acq_start(). */
+static u16 acq_cp_wrap(u16 cp)
+{
+  return cp % ACQ_CP_PERIOD;
+}
+
+static s16 acq_cf_order(const acq_state_t *s, u16 k)
+{
+  u16 below = s->cf_centre;
+  u16 above = s->n_cf - 1 - s->cf_centre;
+  u16 m = MIN(below, above);
+  s16 bin;
+
+  if (k <= 2*m)
+    bin = s->cf_centre + ((k & 1) ? (k+1)/2 : -(s16)(k/2));
+  else if (above > below)
+    bin = s->cf_centre + (k - m);
+  else
+    bin = s->cf_centre - (k - m);
+
+  return s->cf_min + bin*s->cf_step;
+}
+
+/** Check if a carrier frequency falls in one of the masked ranges of the
+ * current search.
+ *
+ * \param s  Acquisition channel state.
+ * \param cf Carrier frequency in acq units.
+ * \return true if correlations at this frequency should be ignored.
+ */
+static bool acq_cf_masked(const acq_state_t *s, s16 cf)
+{
+  for (u8 i=0; i<s->n_mask; i++) {
+    if (cf >= s->mask_min[i] && cf <= s->mask_max[i])
+      return true;
+  }
+  return false;
 }
 
 /** Start a non-blocking acquisition search for a PRN over a code phase / carrier frequency range.
  * Translate the passed code phase and carrier frequency float values into
  * acquisition register values. Write values for the first acquisition to the
  * channel, and then write values for the next pipelined acquisition.
+ * Carrier frequencies are searched from the middle of the range outwards, so
+ * an aided search centred on the predicted Doppler looks there first, see
+ * acq_set_early_exit().
  * Note : Minimum cf_bin_width is determined by the acq. channel carrier phase  *        register width, and is given by 1/NAP_ACQ_CARRIER_FREQ_UNTS_PER_HZ
  *
+ * \param channel  Acquisition channel to search on.
  * \param prn      PRN to search (0-31) (nap_acq_code_wr_blocking must be called prior)
- * \param cp_min   Starting code phase of the first acquisition. (chips)
- * \param cp_max   Starting code phase of the last acquisition. (chips)
+ * \param cp_min   Starting code phase of the first acquisition, may be
+ *                 negative as the code phase wraps at 1023. (chips)
+ * \param cp_max   Starting code phase of the last acquisition, may be past
+ *                 1023. (chips)
  * \param cf_min   Carrier frequency of the first acquisition. (Hz)
  * \param cf_max   Carrier frequency of the last acquisition. (Hz)
  * \param cf_bin_width Step size between each carrier frequency to search. (Hz)
  */
-void acq_start(u8 prn, float cp_min, float cp_max, float cf_min, float cf_max, float cf_bin_width)
+void acq_start(u8 channel, u8 prn, float cp_min, float cp_max, float cf_min, float cf_max, float cf_bin_width)
 {
+  acq_state_t *s = &acq_state[channel];
+
   /* Initialise semaphore in the taken state, the calling thread can then wait
    * for the acq to complete by waiting on this semaphore. */
-  chBSemInit(&acq_wait_sem, TRUE);
+  chBSemInit(&s->done_sem, TRUE);
+
+  /* The code phase is circular, a window starting below zero is the same
+   * window a code period up. The search runs through the range unwrapped
+   * and each code phase is wrapped as it is written to the NAP. */
+  if (cp_min < 0) {
+    cp_min += 1023;
+    cp_max += 1023;
+  }
 
   /* Calculate the range parameters in acq units. Explicitly expand
    * the range to the nearest multiple of the step size to make sure
    * we cover at least the specified range.
    */
-  acq_state.cf_step = cf_bin_width*NAP_ACQ_CARRIER_FREQ_UNITS_PER_HZ;
-  acq_state.cf_min = acq_state.cf_step*floor(cf_min*NAP_ACQ_CARRIER_FREQ_UNITS_PER_HZ / (float)acq_state.cf_step);
-  acq_state.cf_max = acq_state.cf_step*ceil(cf_max*NAP_ACQ_CARRIER_FREQ_UNITS_PER_HZ / (float)acq_state.cf_step);
+  s->cf_step = cf_bin_width*NAP_ACQ_CARRIER_FREQ_UNITS_PER_HZ;
+  s->cf_min = s->cf_step*floor(cf_min*NAP_ACQ_CARRIER_FREQ_UNITS_PER_HZ / (float)s->cf_step);
+  s->cf_max = s->cf_step*ceil(cf_max*NAP_ACQ_CARRIER_FREQ_UNITS_PER_HZ / (float)s->cf_step);
   /* cp_step = nap_acq_n_taps */
-  acq_state.cp_min = nap_acq_n_taps*floor(cp_min*NAP_ACQ_CODE_PHASE_UNITS_PER_CHIP / (float)nap_acq_n_taps);
-  acq_state.cp_max = nap_acq_n_taps*ceil(cp_max*NAP_ACQ_CODE_PHASE_UNITS_PER_CHIP / (float)nap_acq_n_taps);
-
+  s->cp_min = nap_acq_n_taps*floor(cp_min*NAP_ACQ_CODE_PHASE_UNITS_PER_CHIP / (float)nap_acq_n_taps);
+  s->cp_max = nap_acq_n_taps*ceil(cp_max*NAP_ACQ_CODE_PHASE_UNITS_PER_CHIP / (float)nap_acq_n_taps);
+  if (acq_next_dwell) {
+    /* Size a dwell's grid by the width of the range alone, whatever its
+     * alignment to the steps, so that every dwell's points line up. */
+    s->cf_max = s->cf_min + s->cf_step*
+      ceil((cf_max-cf_min)*NAP_ACQ_CARRIER_FREQ_UNITS_PER_HZ / (float)s->cf_step);
+    s->cp_max = s->cp_min + nap_acq_n_taps*
+      ceil((cp_max-cp_min)*NAP_ACQ_CODE_PHASE_UNITS_PER_CHIP / (float)nap_acq_n_taps);
+  }
 
   /* Initialise our acquisition state struct. */
-  acq_state.state = ACQ_RUNNING;
-  acq_state.prn = prn;
-  acq_state.best_power = 0;
-  acq_state.power_acc = 0;
-  acq_state.count = 0;
-  acq_state.carrier_freq = acq_state.cf_min;
-  acq_state.code_phase = acq_state.cp_min;
+  s->state = ACQ_RUNNING;
+  s->prn = prn;
+  s->best_power = 0;
+  s->power_acc = 0;
+  s->count = 0;
+  s->dwell = acq_next_dwell;
+  acq_next_dwell = NULL;
+  s->point = 0;
+  s->early_snr = s->dwell ? 0 : acq_early_snr;
+  s->n_cf = (s->cf_max - s->cf_min) / s->cf_step + 1;
+  if (s->dwell) {
+    s->dwell->n_dwells++;
+    u16 n_cp = (s->cp_max - s->cp_min) / nap_acq_n_taps;
+    s->dwell->n_points = MIN(s->n_cf * n_cp, ACQ_DWELL_POINTS_MAX);
+  }
+  s->cf_centre = s->n_cf / 2;
+  s->cf_idx = 0;
+  s->carrier_freq = acq_cf_order(s, 0);
+  s->code_phase = s->cp_min;
+  s->best_cf = s->carrier_freq;
+  s->best_cp = acq_cp_wrap(s->cp_min);
+
+  /* Latch the interference mask for this search, keeping only the ranges
+   * that overlap the search. */
+  acq_cf_mask_t mask[ACQ_CF_MASK_MAX];
+  chSysLock();
+  u8 n_mask = acq_cf_mask_n;
+  memcpy(mask, acq_cf_mask, n_mask * sizeof(acq_cf_mask_t));
+  chSysUnlock();
+
+  s->n_mask = 0;
+  for (u8 i=0; i<n_mask; i++) {
+    float mask_min = mask[i].cf_min*NAP_ACQ_CARRIER_FREQ_UNITS_PER_HZ;
+    float mask_max = mask[i].cf_max*NAP_ACQ_CARRIER_FREQ_UNITS_PER_HZ;
+    if (mask_max < s->cf_min || mask_min > s->cf_max)
+      continue;
+    s->mask_min[s->n_mask] = MAX(mask_min, s->cf_min);
+    s->mask_max[s->n_mask] = MIN(mask_max, s->cf_max);
+    s->n_mask++;
+  }
 
   /* Write first and second sets of acq parameters (for pipelining). */
-  nap_acq_init_wr_params_blocking(prn, acq_state.cp_min, acq_state.cf_min);
+  nap_acq_init_wr_params_blocking(channel, prn, acq_cp_wrap(s->cp_min),
+                                  s->carrier_freq);
   /* TODO: If we are only doing a single acq then write disable here. */
-  nap_acq_init_wr_params_blocking(prn, acq_state.cp_min+nap_acq_n_taps, acq_state.cf_min);
+  nap_acq_init_wr_params_blocking(channel, prn,
+                                  acq_cp_wrap(s->cp_min+nap_acq_n_taps),
+                                  s->carrier_freq);
 }
 
-/** Handle an acquisition done interrupt from the NAP acquisition channel.
- * If acq_state.state =
+/** Handle an acquisition done interrupt from a NAP acquisition channel.
+ * If the channel's state is
  *   ACQ_RUNNING :
- *     write the next set of pipelined acquisition parameters.
+ *     write the next set of pipelined acquisition parameters, or finish
+ *     early if a carrier freq bin has just been completed and the peak
+ *     is already above its early_snr.
  *   ACQ_RUNNING_FINISHING :
  *     channel is currently doing the final acquisition of the set of
  *     acquisitions, write a pipelined disable to stop the channel after this
  *     final acquisition.
  */
-void acq_service_irq()
+void acq_service_irq(u8 channel)
 {
+  acq_state_t *s = &acq_state[channel];
   u16 index_max;
   corr_t corr_max;
   acc_t acc;
 
   u64 power_max;
 
-  switch(acq_state.state)
+  switch(s->state)
   {
     default:
       /* If we get an interrupt when we are not running,
        * disable the acq channel which helpfully also
        * clears the IRQ.
        */
-      printf("!!! Acq state error? %d\n", acq_state.state);
-      nap_acq_init_wr_disable_blocking();
+      LOG_DEFERRED("!!! Acq %d state error? %d\n", channel, s->state);
+      nap_acq_init_wr_disable_blocking(channel);
       break;
 
     case ACQ_RUNNING_FINISHING:
-      nap_acq_init_wr_disable_blocking();
-      acq_state.state = ACQ_RUNNING_DONE;
+      nap_acq_init_wr_disable_blocking(channel);
+      s->state = ACQ_RUNNING_DONE;
 
       /* Release semaphore to signal to waiting thread that
        * the acquisition is complete. */
-      chBSemSignal(&acq_wait_sem);
+      chBSemSignal(&s->done_sem);
+      chSemSignal(&acq_any_done_sem);
       break;
 
     case ACQ_RUNNING:
       /* Read in correlations. */
-      nap_acq_corr_rd_blocking(&index_max, &corr_max, &acc);
+      nap_acq_corr_rd_blocking(channel, &index_max, &corr_max, &acc);
+
+      /* Last correlation of this carrier freq bin? The power accumulation for
+       * it is done below, check the peak against the mean so far which is
+       * close enough one correlation short. */
+      bool bin_done = s->code_phase >= s->cp_max - nap_acq_n_taps;
+      bool strong = bin_done && s->early_snr > 0 &&
+                    s->count > 0 &&
+                    (float)s->best_power >
+                      s->early_snr *
+                      ((float)s->power_acc / s->count);
 
       /* Write parameters for 2 cycles time for acq pipelining apart
        * from the last two cycles where we want to write disable.
@@ -178,73 +438,113 @@ void acq_service_irq()
        * time will be with the next carrier freq value and a small
        * code phase value.
        */
-      if (acq_state.code_phase < acq_state.cp_max - 2*nap_acq_n_taps) {
-        nap_acq_init_wr_params_blocking(acq_state.prn, \
-          acq_state.code_phase+2*nap_acq_n_taps, \
-          acq_state.carrier_freq);
+      if (strong) {
+        /* Found a strong peak, the correlation in flight is thrown away. */
+        nap_acq_init_wr_disable_blocking(channel);
+        s->state = ACQ_RUNNING_FINISHING;
+      } else if (s->code_phase < s->cp_max - 2*nap_acq_n_taps) {
+        nap_acq_init_wr_params_blocking(channel, s->prn, \
+          acq_cp_wrap(s->code_phase+2*nap_acq_n_taps), \
+          s->carrier_freq);
       } else {
-        if (acq_state.carrier_freq >= acq_state.cf_max && \
-            acq_state.code_phase >= (acq_state.cp_max-2*nap_acq_n_taps)) {
-          nap_acq_init_wr_disable_blocking();
-          acq_state.state = ACQ_RUNNING_FINISHING;
+        if (s->cf_idx >= s->n_cf - 1 && \
+            s->code_phase >= (s->cp_max-2*nap_acq_n_taps)) {
+          nap_acq_init_wr_disable_blocking(channel);
+          s->state = ACQ_RUNNING_FINISHING;
         } else {
-          nap_acq_init_wr_params_blocking(acq_state.prn, \
-            acq_state.cp_min + acq_state.code_phase - acq_state.cp_max + 2*nap_acq_n_taps, \
-            acq_state.carrier_freq+acq_state.cf_step);
+          nap_acq_init_wr_params_blocking(channel, s->prn, \
+            acq_cp_wrap(s->cp_min + s->code_phase - s->cp_max + 2*nap_acq_n_taps), \
+            acq_cf_order(s, s->cf_idx + 1));
         }
       }
 
-      acq_state.power_acc += acc.I + acc.Q;
-      power_max = (u64)corr_max.I*(u64)corr_max.I \
-                + (u64)corr_max.Q*(u64)corr_max.Q;
-      if (power_max > acq_state.best_power) {
-        acq_state.best_power = power_max;
-        acq_state.best_cf = acq_state.carrier_freq;
-        acq_state.best_cp = acq_state.code_phase + (nap_acq_n_taps-index_max) \
-                            % (1<<NAP_ACQ_CODE_PHASE_WIDTH);
+      /* Skip correlations at carrier freqs masked out due to interference. */
+      if (!acq_cf_masked(s, s->carrier_freq)) {
+        s->power_acc += acc.I + acc.Q;
+        power_max = (u64)corr_max.I*(u64)corr_max.I \
+                  + (u64)corr_max.Q*(u64)corr_max.Q;
+        if (power_max > s->best_power) {
+          s->best_power = power_max;
+          s->best_cf = s->carrier_freq;
+          s->best_cp = acq_cp_wrap(s->code_phase + (nap_acq_n_taps-index_max) \
+                              % (1<<NAP_ACQ_CODE_PHASE_WIDTH));
+        }
+        s->count += nap_acq_n_taps;
+        if (s->dwell && s->point < ACQ_DWELL_POINTS_MAX) {
+          s->dwell->power[s->point] += power_max;
+          s->dwell->power_acc += acc.I + acc.Q;
+          s->dwell->count += nap_acq_n_taps;
+        }
       }
-      acq_state.count += nap_acq_n_taps;
-      acq_state.code_phase += nap_acq_n_taps;
-      if (acq_state.code_phase >= acq_state.cp_max) {
-        acq_state.code_phase = acq_state.cp_min;
-        acq_state.carrier_freq += acq_state.cf_step;
+      s->point++;
+      s->code_phase += nap_acq_n_taps;
+      if (s->code_phase >= s->cp_max) {
+        s->code_phase = s->cp_min;
+        if (++s->cf_idx < s->n_cf)
+          s->carrier_freq = acq_cf_order(s, s->cf_idx);
       }
       break;
   }
 }
 
 /** Pause thread until acquisition is complete.
+ *
+ * \param channel Acquisition channel.
+ * \param timeout Maximum time to wait, or TIME_INFINITE.
+ * \return true if the acquisition completed, false if the wait timed out.
+ */
+bool acq_wait_done(u8 channel, systime_t timeout)
+{
+  return chBSemWaitTimeout(&acq_state[channel].done_sem, timeout) == RDY_OK;
+}
+
+/** Pause thread until a search finishes on any acquisition channel.
+ * Check which with acq_get_done(). A search that finished before the call
+ * and hasn't been waited for yet also ends the wait, so a true return
+ * doesn't guarantee a channel that wasn't already looked at has finished.
+ *
+ * \param timeout Maximum time to wait, or TIME_INFINITE.
+ * \return true if a search finished, false if the wait timed out.
  */
-void acq_wait_done()
+bool acq_wait_any_done(systime_t timeout)
 {
-  chBSemWait(&acq_wait_sem);
+  return chSemWaitTimeout(&acq_any_done_sem, timeout) == RDY_OK;
 }
 
 /** Query if the acquisition search has finished.
- * \return 1 if acq_state = ACQ_RUNNING_DONE, 0 otherwise
+ * \param channel Acquisition channel.
+ * \return 1 if the channel's state is ACQ_RUNNING_DONE, 0 otherwise
  */
-u8 acq_get_done()
+u8 acq_get_done(u8 channel)
 {
-  return (acq_state.state == ACQ_RUNNING_DONE);
+  return (acq_state[channel].state == ACQ_RUNNING_DONE);
 }
 
 /** Get the results of the acquisition search last performed.
  * Get the code phase, carrier frequency, and SNR of the acquisition with the
  * highest SNR of set of acquisitions last performed.
  *
+ * \param channel Acquisition channel.
  * \param cp  Code phase of the acquisition result
  * \param cf  Carrier frequency of the acquisition result
  * \param snr SNR of the acquisition result
  */
-void acq_get_results(float* cp, float* cf, float* snr)
+void acq_get_results(u8 channel, float* cp, float* cf, float* snr)
 {
-  *cp = (float)acq_state.best_cp / NAP_ACQ_CODE_PHASE_UNITS_PER_CHIP;
-  *cf = (float)acq_state.best_cf / NAP_ACQ_CARRIER_FREQ_UNITS_PER_HZ;
+  const acq_state_t *s = &acq_state[channel];
+
+  *cp = (float)s->best_cp / NAP_ACQ_CODE_PHASE_UNITS_PER_CHIP;
+  *cf = (float)s->best_cf / NAP_ACQ_CARRIER_FREQ_UNITS_PER_HZ;
   /* "SNR" estimated by peak power over mean power. */
-  *snr = (float)acq_state.best_power / (acq_state.power_acc / acq_state.count);
+  if (s->count == 0)
+    /* Whole search was masked out. */
+    *snr = 0;
+  else
+    *snr = (float)s->best_power / (s->power_acc / s->count);
 }
 
-/** Do a blocking acquisition search in two stages : coarse and fine.
+/** Do a blocking acquisition search in two stages : coarse and fine, on
+ * acquisition channel 0.
  * Do a coarse acqusition to find the approximate code phase and carrier
  * frequency, and then a more fine grained acquisition to find the code phase
  * and carrier frequency more precisely.
@@ -261,29 +561,29 @@ u32 acq_full_two_stage(u8 prn, float* cp, float* cf, float* snr)
   float coarse_carrier_freq;
   float coarse_snr;
 
-  u32 coarse_count = nap_timing_count() + 1000;
+  u32 coarse_count = timebase_now() + 1000;
   acq_schedule_load(coarse_count);
   while(!acq_get_load_done());
 
-  acq_start(prn, 0, 1023, -7000, 7000, 300);
-  while(!acq_get_done());
-  acq_get_results(&coarse_code_phase, &coarse_carrier_freq, &coarse_snr);
+  acq_start(0, prn, 0, 1023, -7000, 7000, 300);
+  while(!acq_get_done(0));
+  acq_get_results(0, &coarse_code_phase, &coarse_carrier_freq, &coarse_snr);
 
   /* Fine acq. */
-  u32 fine_count = nap_timing_count() + 2000;
+  u32 fine_count = timebase_now() + 2000;
   acq_schedule_load(fine_count);
   while(!acq_get_load_done());
 
   float fine_cp = propagate_code_phase(coarse_code_phase, coarse_carrier_freq, fine_count - coarse_count);
 
-  acq_start(prn, fine_cp-20, fine_cp+20, coarse_carrier_freq-300, coarse_carrier_freq+300, 100);
-  while(!acq_get_done());
-  acq_get_results(cp, cf, snr);
+  acq_start(0, prn, fine_cp-20, fine_cp+20, coarse_carrier_freq-300, coarse_carrier_freq+300, 100);
+  while(!acq_get_done(0));
+  acq_get_results(0, cp, cf, snr);
 
   return fine_count;
 }
 
-/** Do a blocking acquisition search.
+/** Do a blocking acquisition search on acquisition channel 0.
  * Perform an acquisition for one PRN over a defined code and doppler range.
  * Returns the code phase and carrier frequency of the largest peak in the
  * search space together with the "SNR" value for that peak defined as
@@ -303,14 +603,14 @@ u32 acq_full_two_stage(u8 prn, float* cp, float* cf, float* snr)
  */
 void do_acq(u8 prn, float cp_min, float cp_max, float cf_min, float cf_max, float cf_bin_width, float* cp, float* cf, float* snr)
 {
-  acq_start(prn, cp_min, cp_max, cf_min, cf_max, cf_bin_width);
-  while(acq_state.state == ACQ_RUNNING) {
+  acq_start(0, prn, cp_min, cp_max, cf_min, cf_max, cf_bin_width);
+  while(acq_state[0].state == ACQ_RUNNING) {
     wait_for_nap_exti();
-    acq_service_irq();
+    acq_service_irq(0);
   }
   wait_for_nap_exti();
-  acq_service_irq();
-  acq_get_results(cp, cf, snr);
+  acq_service_irq(0);
+  acq_get_results(0, cp, cf, snr);
 }
 
 /** \} */
@@ -13,11 +13,38 @@
 #ifndef SWIFTNAV_ACQ_H
 #define SWIFTNAV_ACQ_H
 
+#include <ch.h>
+
 #include <libswiftnav/common.h>
 
+#include "board/nap/acq_channel.h"
+
 /** \addtogroup acq
  * \{ */
 
+/** Maximum number of carrier frequency ranges masked out of acquisition. */
+#define ACQ_CF_MASK_MAX 8
+
+/** A carrier frequency range excluded from acquisition searches. */
+typedef struct {
+  float cf_min; /**< Lowest masked carrier freq. (Hz) */
+  float cf_max; /**< Highest masked carrier freq. (Hz) */
+} acq_cf_mask_t;
+
+/** Maximum number of search points in a multi-dwell search. */
+#define ACQ_DWELL_POINTS_MAX 64
+
+/** Non-coherent accumulation of repeated searches over the same window,
+ * see acq_set_dwell(). Zero before the first dwell. */
+typedef struct {
+  float power[ACQ_DWELL_POINTS_MAX]; /**< Summed peak power of each search
+                                          point, in search order. */
+  float power_acc;  /**< Summed power of every correlation. */
+  u32 count;        /**< Number of correlations in power_acc. */
+  u8 n_dwells;      /**< Number of dwells added so far. */
+  u16 n_points;     /**< Number of search points in each dwell. */
+} acq_dwell_t;
+
 /** Status of SwiftNAP acquisition channel. */
 typedef enum {
   ACQ_DISABLED = 0,
@@ -28,15 +55,20 @@ typedef enum {
   ACQ_RUNNING_DONE
 } acq_status_t;
 
-/** Acquisition search state. */
+/** Acquisition search state of one acquisition channel. */
 typedef struct {
   acq_status_t state; /**< Status of SwiftNAP acquisition channel. */
+  BinarySemaphore load_sem; /**< Taken until the sample ram load is done. */
+  BinarySemaphore done_sem; /**< Taken until the search is done. */
   u8 prn;             /**< C/A Code (0-31) being searched for. */
   s16 cf_step;        /**< Step size between carrier freq search points. */
   s16 cf_min;         /**< Lowest carrier freq to search. */
   s16 cf_max;         /**< Highest carrier freq to search. */
   u16 cp_min;         /**< Lowest code phase to search. */
   u16 cp_max;         /**< Highest code phase to search. */
+  u16 n_cf;           /**< Number of carrier freq bins. */
+  u16 cf_centre;      /**< Bin searched first, the middle of the range. */
+  u16 cf_idx;         /**< Position of carrier_freq in the search order. */
   s16 carrier_freq;   /**< Carrier freq of next correlation to be read. */
   u16 code_phase;     /**< Code phase of next correlation to be read. */
   u64 power_acc;      /**< Sum of powers of all acquisition set points. */
@@ -44,20 +76,34 @@ typedef struct {
   s16 best_cf;        /**< Carrier freq corresponding to highest power. */
   u16 best_cp;        /**< Code phase corresponding to highest power. */
   u32 count;          /**< Total number of acquisition points searched. */
+  acq_dwell_t *dwell; /**< Accumulation for a multi-dwell search, or NULL. */
+  u16 point;          /**< Search point of the next correlation to be read. */
+  float early_snr;    /**< Stop once the peak to mean power ratio exceeds
+                           this at the end of a carrier freq bin, 0 to
+                           always search the whole range. */
+  u8 n_mask;          /**< Number of masked carrier freq ranges. */
+  s16 mask_min[ACQ_CF_MASK_MAX]; /**< Lowest carrier freq of each masked range. */
+  s16 mask_max[ACQ_CF_MASK_MAX]; /**< Highest carrier freq of each masked range. */
 } acq_state_t;
 
 /** \} */
 
 void acq_schedule_load(u32 count);
-void acq_service_load_done(void);
-void acq_wait_load_done(void);
+void acq_service_load_done(u8 channel);
+bool acq_wait_load_done(systime_t timeout);
 u8 acq_get_load_done(void);
 
-void acq_start(u8 prn, float cp_min, float cp_max, float cf_min, float cf_max, float cf_bin_width);
-void acq_service_irq(void);
-void acq_wait_done(void);
-u8 acq_get_done(void);
-void acq_get_results(float* cp, float* cf, float* snr);
+void acq_set_cf_mask(u8 n, const acq_cf_mask_t mask[]);
+void acq_set_early_exit(float snr);
+void acq_set_dwell(acq_dwell_t *d);
+float acq_dwell_snr(const acq_dwell_t *d);
+float acq_dwell_threshold(const acq_dwell_t *d, float p_fa);
+void acq_start(u8 channel, u8 prn, float cp_min, float cp_max, float cf_min, float cf_max, float cf_bin_width);
+void acq_service_irq(u8 channel);
+bool acq_wait_done(u8 channel, systime_t timeout);
+bool acq_wait_any_done(systime_t timeout);
+u8 acq_get_done(u8 channel);
+void acq_get_results(u8 channel, float* cp, float* cf, float* snr);
 
 u32 acq_full_two_stage(u8 prn, float* cp, float* cf, float* snr);
 
@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <ch.h>
+
+#include <libswiftnav/almanac.h>
+#include <libswiftnav/ephemeris.h>
+#include <libswiftnav/gpstime.h>
+
+#include "board/nap/nap_common.h"
+#include "main.h"
+#include "agnss.h"
+#include "eph_share.h"
+#include "manage.h"
+#include "persist.h"
+#include "position.h"
+#include "sbp.h"
+#include "sbp_piksi.h"
+#include "timebase.h"
+#include "timing.h"
+
+/** \defgroup agnss Assisted start
+ * Aiding bundles streamed from the host at power on.
+ * A bundle is a MSG_AGNSS_HDR with the time, an approximate position and
+ * the receiver clock drift, each with its uncertainty, followed by the
+ * ephemerides and almanacs in MSG_AGNSS_EPH and MSG_AGNSS_ALM messages.
+ * The parts are staged until the whole bundle has arrived and then applied
+ * together: the clock state and time, a position guess, the almanacs,
+ * which with the time and position give the aided acquisition windows, and
+ * the ephemerides, which go into es under the same checks as shared ones
+ * (see eph_share_update()). Each of the ephemeris and almanac files is then
+ * saved with a single write.
+ *
+ * Only one bundle is staged at a time, a new header drops any bundle still
+ * missing parts.
+ * \{ */
+
+extern ephemeris_t es[32];
+extern Mutex es_mutex;
+extern almanac_t almanac[32];
+
+/** Bundle being received. Only used by the SBP thread. */
+static struct {
+  bool active;
+  msg_agnss_hdr_t hdr;
+  u64 hdr_tc;      /**< timebase_now() when the header arrived. */
+  u32 eph_mask;    /**< PRNs staged in agnss_eph, bit n is PRN n+1. */
+  u32 alm_mask;    /**< PRNs staged in agnss_alm. */
+} bundle;
+
+/** Staged parts, reused as the buffers the files are saved from once the
+ * bundle has been applied. */
+static ephemeris_t agnss_eph[32] _CCM;
+static almanac_t agnss_alm[32] _CCM;
+/** Set while the files are being saved from the buffers above. */
+static volatile bool agnss_eph_busy;
+static volatile bool agnss_alm_busy;
+
+/** Apply a complete bundle and save what it changed. */
+static void agnss_apply(void)
+{
+  const msg_agnss_hdr_t *h = &bundle.hdr;
+
+  /* Before the time, so the time is converted with the right period. */
+  if (h->drift_sigma > 0)
+    set_clock_drift(h->drift, h->drift_sigma);
+
+  if (h->t_sigma > 0) {
+    /* Move the time on by however long the rest of the bundle took. */
+    gps_time_t t = h->t;
+    t.tow += (timebase_now() - bundle.hdr_tc) * RX_DT_NOMINAL;
+    t = normalize_gps_time(t);
+    set_time(h->t_sigma <= AGNSS_TIME_COARSE_SIGMA ? TIME_COARSE : TIME_GUESS,
+             t);
+  }
+
+  if (h->pos_sigma > 0 && h->pos_sigma <= AGNSS_POS_SIGMA_MAX)
+    position_set_guess(h->pos_ecef, h->t);
+
+  u8 n_alm = 0;
+  for (u8 prn=0; prn<32; prn++)
+    if ((bundle.alm_mask & ((u32)1 << prn)) &&
+        manage_almanac_set(&agnss_alm[prn]))
+      n_alm++;
+
+  u8 n_eph = 0;
+  for (u8 prn=0; prn<32; prn++)
+    if ((bundle.eph_mask & ((u32)1 << prn)) &&
+        eph_share_update(prn, &agnss_eph[prn]))
+      n_eph++;
+
+  /* Anything already given up on is worth another look with the new
+   * windows. */
+  manage_acq_retry_tried();
+
+  printf("A-GNSS bundle %d applied, %d of %d ephemerides, %d almanacs\n",
+         h->id, n_eph, h->n_eph, n_alm);
+
+  if (n_eph) {
+    chMtxLock(&es_mutex);
+    memcpy(agnss_eph, es, sizeof(agnss_eph));
+    chMtxUnlock();
+    persist_write_buffer("ephem", 0, agnss_eph, sizeof(agnss_eph),
+                         &agnss_eph_busy);
+  }
+  if (n_alm) {
+    memcpy(agnss_alm, almanac, sizeof(agnss_alm));
+    persist_write_buffer("almanac", 0, agnss_alm, sizeof(agnss_alm),
+                         &agnss_alm_busy);
+  }
+}
+
+/** Apply the bundle if its last part has arrived. */
+static void agnss_check_complete(void)
+{
+  if (__builtin_popcount(bundle.eph_mask) < bundle.hdr.n_eph ||
+      __builtin_popcount(bundle.alm_mask) < bundle.hdr.n_alm)
+    return;
+
+  bundle.active = false;
+  agnss_apply();
+}
+
+static void agnss_hdr_callback(u16 sender_id, u8 len, u8 msg[], void *context)
+{
+  (void)sender_id; (void)context;
+
+  if (len != sizeof(msg_agnss_hdr_t))
+    return;
+
+  if (agnss_eph_busy || agnss_alm_busy) {
+    printf("A-GNSS bundle dropped, previous bundle still being saved\n");
+    bundle.active = false;
+    return;
+  }
+
+  memcpy(&bundle.hdr, msg, sizeof(bundle.hdr));
+  bundle.hdr_tc = timebase_now();
+  bundle.eph_mask = 0;
+  bundle.alm_mask = 0;
+  bundle.active = true;
+
+  if (bundle.hdr.n_eph > 32 || bundle.hdr.n_alm > 32) {
+    bundle.active = false;
+    return;
+  }
+
+  agnss_check_complete();
+}
+
+static void agnss_eph_callback(u16 sender_id, u8 len, u8 msg[], void *context)
+{
+  (void)sender_id; (void)context;
+
+  if (len != sizeof(msg_agnss_eph_t))
+    return;
+  msg_agnss_eph_t *m = (msg_agnss_eph_t *)msg;
+  if (!bundle.active || m->id != bundle.hdr.id || m->prn >= 32)
+    return;
+
+  memcpy(&agnss_eph[m->prn], &m->e, sizeof(ephemeris_t));
+  bundle.eph_mask |= (u32)1 << m->prn;
+  agnss_check_complete();
+}
+
+static void agnss_alm_callback(u16 sender_id, u8 len, u8 msg[], void *context)
+{
+  (void)sender_id; (void)context;
+
+  if (len != sizeof(msg_agnss_alm_t))
+    return;
+  msg_agnss_alm_t *m = (msg_agnss_alm_t *)msg;
+  if (!bundle.active || m->id != bundle.hdr.id ||
+      m->a.prn < 1 || m->a.prn > 32)
+    return;
+
+  memcpy(&agnss_alm[m->a.prn-1], &m->a, sizeof(almanac_t));
+  bundle.alm_mask |= (u32)1 << (m->a.prn-1);
+  agnss_check_complete();
+}
+
+void agnss_setup(void)
+{
+  static sbp_msg_callbacks_node_t hdr_node;
+  sbp_register_cbk(MSG_AGNSS_HDR, &agnss_hdr_callback, &hdr_node);
+  static sbp_msg_callbacks_node_t eph_node;
+  sbp_register_cbk(MSG_AGNSS_EPH, &agnss_eph_callback, &eph_node);
+  static sbp_msg_callbacks_node_t alm_node;
+  sbp_register_cbk(MSG_AGNSS_ALM, &agnss_alm_callback, &alm_node);
+}
+
+/** \} */
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef SWIFTNAV_AGNSS_H
+#define SWIFTNAV_AGNSS_H
+
+/** \addtogroup agnss
+ * \{ */
+
+/** Time uncertainty up to which a bundle's time is TIME_COARSE rather than
+ * TIME_GUESS, (s). */
+#define AGNSS_TIME_COARSE_SIGMA 1.0
+
+/** Position uncertainty above which a bundle's position isn't used, (m). */
+#define AGNSS_POS_SIGMA_MAX 100e3
+
+/** \} */
+
+void agnss_setup(void);
+
+#endif  /* SWIFTNAV_AGNSS_H */
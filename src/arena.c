@@ -0,0 +1,206 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+
+#include <string.h>
+
+#include <ch.h>
+
+#include "arena.h"
+#include "init.h"
+#include "sbp.h"
+#include "sbp_piksi.h"
+
+/** \defgroup arena Arena
+ * Static memory for heap allocations on the filter path.
+ * LAPACKE allocates and frees its work arrays on every call, so the DGNSS
+ * filters go through malloc() and free() many times an epoch. Every call to
+ * malloc(), calloc(), realloc() and free() is redirected here by the linker
+ * (`--wrap=malloc` etc., see the Makefiles). Between arena_begin() and
+ * arena_end() the calling thread's allocations come from a fixed arena of
+ * ARENA_SIZE bytes instead of the heap, first fit in a handful of blocks, so
+ * their memory is bounded and the heap doesn't fragment. Anything else, or
+ * anything the arena can't hold, falls back to the heap and is counted.
+ *
+ * Blocks may outlive arena_end() and be freed from any thread, e.g. the
+ * hypothesis pool set up when the filters are initialised.
+ * \{ */
+
+/** Arena block header, the block's memory follows it. */
+typedef struct {
+  u32 size;   /**< Size of the block without the header, (bytes). */
+  u32 used;   /**< Non-zero while allocated. */
+} arena_block_t;
+
+/** Smallest block worth splitting off the end of an allocation, (bytes). */
+#define ARENA_SPLIT_MIN 16
+
+static u8 arena[ARENA_SIZE] __attribute__((aligned(8)));
+static MUTEX_DECL(arena_mutex);
+/** Thread whose allocations come from the arena, see arena_begin(). */
+static Thread *arena_owner;
+
+static u32 arena_in_use;
+static u32 arena_high_water;
+/** Allocations made between arena_begin() and arena_end() that the arena
+ * couldn't hold. */
+static u32 arena_fallbacks;
+
+void *__real_malloc(size_t size);
+void __real_free(void *ptr);
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_malloc(size_t size);
+void __wrap_free(void *ptr);
+void *__wrap_calloc(size_t n, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+
+static arena_block_t *arena_first(void)
+{
+  return (arena_block_t *)arena;
+}
+
+static arena_block_t *arena_next(arena_block_t *b)
+{
+  arena_block_t *n = (arena_block_t *)((u8 *)(b + 1) + b->size);
+  return (u8 *)n < arena + ARENA_SIZE ? n : NULL;
+}
+
+static bool arena_contains(const void *ptr)
+{
+  return (const u8 *)ptr >= arena && (const u8 *)ptr < arena + ARENA_SIZE;
+}
+
+/** Allocate a block, first fit, joining free neighbours on the way.
+ * \return The block's memory, NULL if there is no room.
+ */
+static void *arena_alloc(size_t size)
+{
+  size = (size + 7) & ~7;
+
+  chMtxLock(&arena_mutex);
+
+  if (arena_first()->size == 0)
+    arena_first()->size = ARENA_SIZE - sizeof(arena_block_t);
+
+  void *ptr = NULL;
+  for (arena_block_t *b = arena_first(); b; b = arena_next(b)) {
+    if (b->used)
+      continue;
+    arena_block_t *n;
+    while ((n = arena_next(b)) && !n->used)
+      b->size += sizeof(arena_block_t) + n->size;
+    if (b->size < size)
+      continue;
+
+    if (b->size >= size + sizeof(arena_block_t) + ARENA_SPLIT_MIN) {
+      arena_block_t *rest = (arena_block_t *)((u8 *)(b + 1) + size);
+      rest->size = b->size - size - sizeof(arena_block_t);
+      rest->used = 0;
+      b->size = size;
+    }
+    b->used = 1;
+    arena_in_use += b->size;
+    if (arena_in_use > arena_high_water)
+      arena_high_water = arena_in_use;
+    ptr = b + 1;
+    break;
+  }
+
+  chMtxUnlock();
+  return ptr;
+}
+
+static void arena_free(void *ptr)
+{
+  arena_block_t *b = (arena_block_t *)ptr - 1;
+  chMtxLock(&arena_mutex);
+  b->used = 0;
+  arena_in_use -= b->size;
+  chMtxUnlock();
+}
+
+/** Take the calling thread's allocations from the arena until arena_end().
+ * Only one thread may use the arena at a time, the DGNSS filters call this
+ * with dgnss_lock held.
+ */
+void arena_begin(void)
+{
+  arena_owner = chThdSelf();
+}
+
+/** Return the calling thread's allocations to the heap. */
+void arena_end(void)
+{
+  arena_owner = NULL;
+}
+
+void *__wrap_malloc(size_t size)
+{
+  if (arena_owner && arena_owner == chThdSelf()) {
+    void *ptr = arena_alloc(size);
+    if (ptr)
+      return ptr;
+    arena_fallbacks++;
+  }
+  return __real_malloc(size);
+}
+
+void __wrap_free(void *ptr)
+{
+  if (arena_contains(ptr))
+    arena_free(ptr);
+  else
+    __real_free(ptr);
+}
+
+void *__wrap_calloc(size_t n, size_t size)
+{
+  void *ptr = __wrap_malloc(n * size);
+  if (ptr)
+    memset(ptr, 0, n * size);
+  return ptr;
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+  if (!arena_contains(ptr)) {
+    if (ptr || !arena_owner || arena_owner != chThdSelf())
+      return __real_realloc(ptr, size);
+    return __wrap_malloc(size);
+  }
+
+  /* Blocks don't grow in place, move it. */
+  arena_block_t *b = (arena_block_t *)ptr - 1;
+  if (size <= b->size)
+    return ptr;
+  void *new_ptr = __wrap_malloc(size);
+  if (new_ptr) {
+    memcpy(new_ptr, ptr, b->size);
+    arena_free(ptr);
+  }
+  return new_ptr;
+}
+
+/** Send the arena and heap use. */
+void arena_send_state(void)
+{
+  msg_arena_state_t msg = {
+    .size = ARENA_SIZE,
+    .in_use = arena_in_use,
+    .high_water = arena_high_water,
+    .fallbacks = arena_fallbacks,
+    .heap = heap_size(),
+  };
+  sbp_send_msg(MSG_ARENA_STATE, sizeof(msg), (u8 *)&msg);
+}
+
+/** \} */
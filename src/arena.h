@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+
+#ifndef SWIFTNAV_ARENA_H
+#define SWIFTNAV_ARENA_H
+
+#include <libswiftnav/common.h>
+
+/** \addtogroup arena
+ * \{ */
+
+/** Size of the static arena, (bytes). Sized for the LAPACKE work arrays of
+ * the DGNSS filters, see the arena state message for how much is used. */
+#ifndef ARENA_SIZE
+#define ARENA_SIZE (16 * 1024)
+#endif
+
+/** \} */
+
+void arena_begin(void);
+void arena_end(void);
+void arena_send_state(void);
+
+#endif  /* SWIFTNAV_ARENA_H */
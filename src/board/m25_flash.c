@@ -13,6 +13,8 @@
 
 #include <stdio.h>
 
+#include <ch.h>
+
 #include "../error.h"
 #include "../peripherals/spi.h"
 #include "../peripherals/usart.h"
@@ -21,6 +23,15 @@
 #include "m25_flash.h"
 #include "main.h"
 
+/** Bytes read per system lock in m25_rx_bulk(). */
+#define M25_RX_BLOCK_LEN   32
+/** Bytes read per SPI bus lock in m25_read(). */
+#define M25_READ_CHUNK_LEN 256
+/** Page programs shorter than this aren't worth setting up DMA for. */
+#define M25_DMA_MIN_LEN    16
+
+#define M25_IN_CCM(p) (((u32)(p) & 0xFFFF0000) == 0x10000000)
+
 /** \addtogroup board
  * \{ */
 
@@ -28,12 +39,30 @@
  * Interface to the M25Pxx FPGA configuration flash.
  * \{ */
 
+/** Held across every M25 operation made of several transactions, e.g.
+ * write enable, page program and write disable, by the threads that use
+ * the flash. The SPI bus is only locked per transaction, and the bus is
+ * let go while a program or erase is in progress. */
+static MUTEX_DECL(m25_mutex);
+
+/** Take the M25 operation lock, see m25_mutex. */
+void m25_lock(void)
+{
+  chMtxLock(&m25_mutex);
+}
+
+/** Release the M25 operation lock. */
+void m25_unlock(void)
+{
+  chMtxUnlock();
+}
+
 /** Send "write enable" command to the flash. */
 void m25_write_enable(void)
 {
   spi_slave_select(SPI_SLAVE_FLASH);
   spi_xfer(SPI_BUS_FLASH, M25_WREN);
-  spi_slave_deselect();
+  spi_slave_deselect(SPI_SLAVE_FLASH);
 }
 
 /** Send "write disable" command to the flash. */
@@ -41,7 +70,7 @@ void m25_write_disable(void)
 {
   spi_slave_select(SPI_SLAVE_FLASH);
   spi_xfer(SPI_BUS_FLASH, M25_WRDI);
-  spi_slave_deselect();
+  spi_slave_deselect(SPI_SLAVE_FLASH);
 }
 
 /** Read the manufacturer and device identification out of the flash.
@@ -56,7 +85,7 @@ void m25_read_id(u8 *man_id, u8 *mem_type, u8 *mem_cap)
   *man_id = (u8)spi_xfer(SPI_BUS_FLASH, 0x00);
   *mem_type = (u8)spi_xfer(SPI_BUS_FLASH, 0x00);
   *mem_cap = (u8)spi_xfer(SPI_BUS_FLASH, 0x00);
-  spi_slave_deselect();
+  spi_slave_deselect(SPI_SLAVE_FLASH);
 }
 
 /** Read the status register out of the flash.
@@ -69,7 +98,7 @@ u8 m25_read_status(void)
   spi_slave_select(SPI_SLAVE_FLASH);
   spi_xfer(SPI_BUS_FLASH, M25_RDSR);
   sr = spi_xfer(SPI_BUS_FLASH, 0x00);
-  spi_slave_deselect();
+  spi_slave_deselect(SPI_SLAVE_FLASH);
 
   return sr;
 }
@@ -83,11 +112,69 @@ void m25_write_status(u8 sr)
   spi_slave_select(SPI_SLAVE_FLASH);
   spi_xfer(SPI_BUS_FLASH, M25_WRSR);
   spi_xfer(SPI_BUS_FLASH, sr);
-  spi_slave_deselect();
+  spi_slave_deselect(SPI_SLAVE_FLASH);
+}
+
+/** Wait for a program or erase to finish.
+ * Sleeps between polls of the status register, with the SPI bus released,
+ * so that lower priority threads and the front-end can run while the flash
+ * is busy.
+ */
+static void m25_wait_ready(void)
+{
+  while (m25_read_status() & M25_SR_WIP)
+    chThdSleepMilliseconds(1);
+}
+
+/** Clock len bytes in from the selected flash.
+ * The transmit register is kept one byte ahead of the receive side so the
+ * bus doesn't idle between bytes. The system is locked for each short block
+ * as a late read would overrun the receive register.
+ */
+static void m25_rx_bulk(u8 buff[], u32 len)
+{
+  while (len > 0) {
+    u32 n = MIN(len, M25_RX_BLOCK_LEN);
+
+    chSysLock();
+    SPI_DR(SPI_BUS_FLASH) = 0;
+    for (u32 i = 0; i < n; i++) {
+      if (i + 1 < n) {
+        while (!(SPI_SR(SPI_BUS_FLASH) & SPI_SR_TXE)) ;
+        SPI_DR(SPI_BUS_FLASH) = 0;
+      }
+      while (!(SPI_SR(SPI_BUS_FLASH) & SPI_SR_RXNE)) ;
+      buff[i] = SPI_DR(SPI_BUS_FLASH);
+    }
+    chSysUnlock();
+
+    buff += n;
+    len -= n;
+  }
+}
+
+/** Read one chunk of data from flash memory with the fast read command. */
+static void m25_read_chunk(u32 addr, u8 buff[], u32 len)
+{
+  spi_slave_select(SPI_SLAVE_FLASH);
+
+  spi_xfer(SPI_BUS_FLASH, M25_FAST_READ);
+
+  spi_xfer(SPI_BUS_FLASH, (addr >> 16) & 0xFF);
+  spi_xfer(SPI_BUS_FLASH, (addr >> 8) & 0xFF);
+  spi_xfer(SPI_BUS_FLASH, addr & 0xFF);
+  /* Dummy byte. */
+  spi_xfer(SPI_BUS_FLASH, 0x00);
+
+  m25_rx_bulk(buff, len);
+
+  spi_slave_deselect(SPI_SLAVE_FLASH);
 }
 
 /** Read data from flash memory.
- * \todo Use fast read command instead of regular?
+ * Uses the fast read command. Long reads are split into M25_READ_CHUNK_LEN
+ * sized transfers and the SPI bus is released between them so that the
+ * front-end is not held off for the whole read.
  * \param addr Starting address to read from
  * \param len Number of addresses to read
  * \param buff Array to write bytes read from flash to
@@ -101,32 +188,47 @@ u8 m25_read(u32 addr, u8 buff[], u32 len)
   if (addr+len-1 > M25_MAX_ADDR)
     return FLASH_INVALID_RANGE;
 
-  spi_slave_select(SPI_SLAVE_FLASH);
-
-  spi_xfer(SPI_BUS_FLASH, M25_READ);
-
-  spi_xfer(SPI_BUS_FLASH, (addr >> 16) & 0xFF);
-  spi_xfer(SPI_BUS_FLASH, (addr >> 8) & 0xFF);
-  spi_xfer(SPI_BUS_FLASH, addr & 0xFF);
+  while (len > 0) {
+    u32 n = MIN(len, M25_READ_CHUNK_LEN);
+    m25_read_chunk(addr, buff, n);
+    addr += n;
+    buff += n;
+    len -= n;
+  }
 
-  for (u32 i = 0; i < len; i++)
-    buff[i] = spi_xfer(SPI_BUS_FLASH, 0x00);
+  return FLASH_OK;
+}
 
-  spi_slave_deselect();
+/** Read a large block of data from within one sector of the flash.
+ * Like m25_read(), the read is split into M25_READ_CHUNK_LEN sized
+ * transfers.
+ *
+ * \param addr Starting address to read from
+ * \param buff Array to write bytes read from flash to
+ * \param len  Number of addresses to read, at most M25_SECTOR_LEN
+ * \return Error code
+ */
+u8 m25_read_sector(u32 addr, u8 buff[], u32 len)
+{
+  if (addr > M25_MAX_ADDR)
+    return FLASH_INVALID_ADDR;
+  if (len == 0 || addr / M25_SECTOR_LEN != (addr + len - 1) / M25_SECTOR_LEN)
+    return FLASH_INVALID_RANGE;
 
-  return FLASH_OK;
+  return m25_read(addr, buff, len);
 }
 
 /** Program a page of the flash.
  * Programs selected bits from 1 to 0. If the write will cross a page
- * boundary, the device will hang and report an error.
+ * boundary, the device will hang and report an error. The data phase is
+ * written out by DMA.
  *
  * \param addr Starting address to write to
  * \param len  Number of addresses to write
  * \param buff Array of bytes to write to flash
  * \return Error code
  */
-u8 m25_page_program(u32 addr, u8 buff[], u8 len)
+u8 m25_page_program(u32 addr, u8 buff[], u16 len)
 {
   /* Check that address range to be written is valid. */
   if (addr > M25_MAX_ADDR)
@@ -136,8 +238,6 @@ u8 m25_page_program(u32 addr, u8 buff[], u8 len)
   if (addr>>8 < (addr+len-1)>>8)
     return FLASH_INVALID_RANGE;
 
-  u32 i;
-
   spi_slave_select(SPI_SLAVE_FLASH);
 
   spi_xfer(SPI_BUS_FLASH, M25_PP);
@@ -146,12 +246,17 @@ u8 m25_page_program(u32 addr, u8 buff[], u8 len)
   spi_xfer(SPI_BUS_FLASH, (addr >> 8) & 0xFF);
   spi_xfer(SPI_BUS_FLASH, addr & 0xFF);
 
-  for (i = 0; i < len; i++)
-    spi_xfer(SPI_BUS_FLASH, buff[i]);
+  /* DMA can't reach CCM, fall back to writing those buffers by hand. */
+  if (len >= M25_DMA_MIN_LEN && !M25_IN_CCM(buff)) {
+    spi2_tx_dma(len, buff);
+  } else {
+    for (u32 i = 0; i < len; i++)
+      spi_xfer(SPI_BUS_FLASH, buff[i]);
+  }
 
-  spi_slave_deselect();
+  spi_slave_deselect(SPI_SLAVE_FLASH);
 
-  while (m25_read_status() & M25_SR_WIP) ;
+  m25_wait_ready();
 
   return FLASH_OK;
 }
@@ -176,9 +281,9 @@ u8 m25_sector_erase(u32 addr)
   spi_xfer(SPI_BUS_FLASH, (addr >> 8) & 0xFF);
   spi_xfer(SPI_BUS_FLASH, addr & 0xFF);
 
-  spi_slave_deselect();
+  spi_slave_deselect(SPI_SLAVE_FLASH);
 
-  while (m25_read_status() & M25_SR_WIP) ;
+  m25_wait_ready();
 
   return FLASH_OK;
 }
@@ -192,9 +297,9 @@ void m25_bulk_erase(void)
 
   spi_xfer(SPI_BUS_FLASH, M25_BE);
 
-  spi_slave_deselect();
+  spi_slave_deselect(SPI_SLAVE_FLASH);
 
-  while (m25_read_status() & M25_SR_WIP) ;
+  m25_wait_ready();
 }
 
 /** \} */
@@ -38,16 +38,20 @@
 #define M25_SR_WIP  (1 << 0)  /**< Status Register: Write In Progress Bit */
 
 #define M25_MAX_ADDR 0xFFFFF
+#define M25_SECTOR_LEN 0x10000
 
 /** \} */
 
+void m25_lock(void);
+void m25_unlock(void);
 void m25_write_enable(void);
 void m25_write_disable(void);
 void m25_read_id(u8 *man_id, u8 *mem_type, u8 *mem_cap);
 u8 m25_read_status(void);
 void m25_write_status(u8 sr);
 u8 m25_read(u32 addr, u8 buff[], u32 len);
-u8 m25_page_program(u32 addr, u8 buff[], u8 len);
+u8 m25_read_sector(u32 addr, u8 buff[], u32 len);
+u8 m25_page_program(u32 addr, u8 buff[], u16 len);
 u8 m25_sector_erase(u32 addr);
 void m25_bulk_erase(void);
 
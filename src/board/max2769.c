@@ -40,7 +40,7 @@ void max2769_write(u8 addr, u32 data)
   spi_xfer(SPI_BUS_FRONTEND, (write_word >> 16) & 0xFF);
   spi_xfer(SPI_BUS_FRONTEND, (write_word >>  8) & 0xFF);
   spi_xfer(SPI_BUS_FRONTEND, (write_word >>  0) & 0xFF);
-  spi_slave_deselect();
+  spi_slave_deselect(SPI_SLAVE_FRONTEND);
 }
 
 u32 max2769_conf1;
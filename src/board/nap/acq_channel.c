@@ -11,6 +11,7 @@
  * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
  */
 
+#include "../../peripherals/spi.h"
 #include "acq_channel.h"
 #include "nap_common.h"
 
@@ -30,27 +31,34 @@
  */
 u8 nap_acq_n_taps;
 
+/** Number of acquisition channels.
+ * Number of acquisition channels that NAP configuration was built with, at
+ * most NAP_ACQ_MAX_CHANNELS. Read from configuration flash at runtime in
+ * nap_conf_rd_parameters().
+ */
+u8 nap_acq_n_channels = 1;
+
 /** Set the LOAD ENABLE bit of the NAP acquisition channel's LOAD register.
  * When the LOAD ENABLE bit is set, the acquisition channel will start loading
  * samples into its sample ram, starting at the first clock cycle after the
  * NAP's internal timing strobe goes low.
  */
-void nap_acq_load_wr_enable_blocking(void)
+void nap_acq_load_wr_enable_blocking(u8 channel)
 {
   u8 temp[1] = { 0xFF };
 
-  nap_xfer_blocking(NAP_REG_ACQ_LOAD, 1, 0, temp);
+  nap_xfer_blocking(NAP_REG_ACQ(channel, NAP_REG_ACQ_LOAD_OFFSET), 1, 0, temp);
 }
 
 /** Clear the LOAD ENABLE bit of the NAP acquisition channel's LOAD register.
  * After a load to the acquisition channel's sample ram, the LOAD ENABLE bit
  * must be cleared, or future timing strobes will cause the ram to be re-loaded.
  */
-void nap_acq_load_wr_disable_blocking(void)
+void nap_acq_load_wr_disable_blocking(u8 channel)
 {
   u8 temp[1] = { 0x00 };
 
-  nap_xfer_blocking(NAP_REG_ACQ_LOAD, 1, 0, temp);
+  nap_xfer_blocking(NAP_REG_ACQ(channel, NAP_REG_ACQ_LOAD_OFFSET), 1, 0, temp);
 }
 
 /** Pack data for writing to NAP acquisition channel INIT register.
@@ -83,16 +91,11 @@ void nap_acq_init_pack(u8 pack[], u8 prn, u16 code_phase, s16 carrier_freq)
    */
   u16 code_phase_reg_value = (code_phase + nap_acq_n_taps - 1) % (1023 * 4);
 
-  pack[0] = (1 << 5) |                    /* Acq enabled */
-            ((carrier_freq >> 7) & 0x1F); /* Carrier freq [11:7] */
-
-  pack[1] = (carrier_freq << 1) |         /* Carrier freq [6:0] */
-            (code_phase_reg_value >> 11); /* Code phase [11] */
-
-  pack[2] = code_phase_reg_value >> 3;    /* Code phase [10:3] */
-
-  pack[3] = (code_phase_reg_value << 5) | /* Code phase [2:0] */
-            (prn & 0x1F);                 /* PRN number (0..31) */
+  memset(pack, 0, NAP_ACQ_INIT_N_BYTES);
+  nap_field_set(pack, NAP_ACQ_INIT_ENABLE, 1);
+  nap_field_set(pack, NAP_ACQ_INIT_CARRIER_FREQ, carrier_freq);
+  nap_field_set(pack, NAP_ACQ_INIT_CODE_PHASE, code_phase_reg_value);
+  nap_field_set(pack, NAP_ACQ_INIT_PRN, prn);
 }
 
 /** Write acquisition parameters to NAP acquisition channel's INIT register.
@@ -110,17 +113,20 @@ void nap_acq_init_pack(u8 pack[], u8 prn, u16 code_phase, s16 carrier_freq)
  *       written, and again after the ACQ_DONE interrupt occurs to clear the
  *       interrupt.
  *
+ * \param channel      Acquisition channel, 0 to nap_acq_n_channels-1.
  * \param PRN          C/A PRN to use for the acquisition (deprecated)
  * \param code_phase   Code phase of the first correlation returned
  * \param carrier_freq Carrier frequency i.e. Doppler in acquisition units.
  */
 /* TODO : remove writing of PRN number to init register */
-void nap_acq_init_wr_params_blocking(u8 prn, u16 code_phase, s16 carrier_freq)
+void nap_acq_init_wr_params_blocking(u8 channel, u8 prn, u16 code_phase,
+                                     s16 carrier_freq)
 {
-  u8 temp[4];
+  u8 temp[NAP_ACQ_INIT_N_BYTES];
 
   nap_acq_init_pack(temp, prn, code_phase, carrier_freq);
-  nap_xfer_blocking(NAP_REG_ACQ_INIT, 4, 0, temp);
+  nap_xfer_blocking(NAP_REG_ACQ(channel, NAP_REG_ACQ_INIT_OFFSET),
+                    NAP_ACQ_INIT_N_BYTES, 0, temp);
 }
 
 /** Disable NAP acquisition channel.
@@ -129,11 +135,12 @@ void nap_acq_init_wr_params_blocking(u8 prn, u16 code_phase, s16 carrier_freq)
  * correlations, and then a second time to clear the ACQ_DONE IRQ after the
  * last correlation has finished.
  */
-void nap_acq_init_wr_disable_blocking()
+void nap_acq_init_wr_disable_blocking(u8 channel)
 {
-  u8 temp[4] = { 0, 0, 0, 0 };
+  u8 temp[NAP_ACQ_INIT_N_BYTES] = { 0, 0, 0, 0 };
 
-  nap_xfer_blocking(NAP_REG_ACQ_INIT, 4, 0, temp);
+  nap_xfer_blocking(NAP_REG_ACQ(channel, NAP_REG_ACQ_INIT_OFFSET),
+                    NAP_ACQ_INIT_N_BYTES, 0, temp);
 }
 
 /** Unpack correlations read from acquisition channel.
@@ -145,65 +152,49 @@ void nap_acq_init_wr_disable_blocking()
  */
 void nap_acq_corr_unpack(u8 packed[], u16 *index, corr_t *corr, acc_t *acc)
 {
-
-  *index = packed[0];
-
-  /* http://graphics.stanford.edu/~seander/bithacks.html#FixedSignExtend */
-
-  struct { s32 xtend : 24; } sign;
-
-  sign.xtend  = (packed[1] << 16) /* MSB */
-              | (packed[2] << 8)  /* Middle byte */
-              | (packed[3]);      /* LSB */
-
-  corr->Q = sign.xtend;  /* Sign extend! */
-
-  sign.xtend  = (packed[4] << 16) /* MSB */
-              | (packed[5] << 8)  /* Middle byte */
-              | (packed[6]);      /* LSB */
-
-  corr->I = sign.xtend;  /* Sign extend! */
-
-  acc->Q = ((u64)packed[7] << 40)
-         | ((u64)packed[8] << 32)
-         | ((u64)packed[9] << 24)
-         | ((u64)packed[10] << 16)
-         | ((u64)packed[11] << 8)
-         | ((u64)packed[12] << 0);
-
-  acc->I = ((u64)packed[13] << 40)
-         | ((u64)packed[14] << 32)
-         | ((u64)packed[15] << 24)
-         | ((u64)packed[16] << 16)
-         | ((u64)packed[17] << 8)
-         | ((u64)packed[18] << 0);
+  *index = nap_field_get_u(packed, NAP_ACQ_CORR_INDEX);
+  corr->I = nap_field_get_s(packed, NAP_ACQ_CORR_I);
+  corr->Q = nap_field_get_s(packed, NAP_ACQ_CORR_Q);
+  acc->I = nap_field_get_u64(packed, NAP_ACQ_CORR_ACC_I);
+  acc->Q = nap_field_get_u64(packed, NAP_ACQ_CORR_ACC_Q);
 }
 
 /** Read correlations from acquisition channel.
  * Must be called after the NAP IRQ register IRQ_ACQ_DONE bit goes high, before
  * the next acquisition cycle is complete.
  *
+ * \param channel Acquisition channel, 0 to nap_acq_n_channels-1.
  * \param index  Index corresponding to the maximum tap correlation.
  * \param corr   Maximum tap correlation from last cycle.
  * \param acc    Accumulation of all tap final correlations from last cycle.
  */
-void nap_acq_corr_rd_blocking(u16 *index, corr_t *corr, acc_t *acc)
+void nap_acq_corr_rd_blocking(u8 channel, u16 *index, corr_t *corr, acc_t *acc)
 {
-  u8 temp[19];
-
-  nap_xfer_blocking(NAP_REG_ACQ_CORR, 19, temp, temp);
-  nap_acq_corr_unpack(temp, index, corr, acc);
+  u8 *buff = spi_dma_buff_alloc();
+
+  if (buff) {
+    nap_xfer_inplace_blocking(NAP_REG_ACQ(channel, NAP_REG_ACQ_CORR_OFFSET),
+                              NAP_ACQ_CORR_N_BYTES, buff);
+    nap_acq_corr_unpack(buff, index, corr, acc);
+    spi_dma_buff_free(buff);
+  } else {
+    u8 temp[NAP_ACQ_CORR_N_BYTES];
+    nap_xfer_blocking(NAP_REG_ACQ(channel, NAP_REG_ACQ_CORR_OFFSET),
+                      NAP_ACQ_CORR_N_BYTES, temp, temp);
+    nap_acq_corr_unpack(temp, index, corr, acc);
+  }
 }
 
 /** Write CA code to acquisition channel's code ram.
  * CA Code for SV to be searched for must be written into channel's code ram
  * before acquisitions are started.
  *
+ * \param channel Acquisition channel, 0 to nap_acq_n_channels-1.
  * \param prn PRN number (0-31) of CA code to be written.
  */
-void nap_acq_code_wr_blocking(u8 prn)
+void nap_acq_code_wr_blocking(u8 channel, u8 prn)
 {
-  nap_xfer_blocking(NAP_REG_ACQ_CODE, 128, 0, ca_code(prn));
+  nap_xfer_blocking(NAP_REG_ACQ(channel, NAP_REG_ACQ_CODE_OFFSET), 128, 0, ca_code(prn));
 }
 
 /** \} */
@@ -18,15 +18,33 @@
 
 #include "../../main.h"
 #include "nap_common.h"
+#include "nap_regs.h"
 
 /** \addtogroup acq_channel
  * \{ */
 
-#define NAP_REG_ACQ_BASE 0x06
-#define NAP_REG_ACQ_INIT (NAP_REG_ACQ_BASE + 0x00)
-#define NAP_REG_ACQ_LOAD (NAP_REG_ACQ_BASE + 0x01)
-#define NAP_REG_ACQ_CORR (NAP_REG_ACQ_BASE + 0x02)
-#define NAP_REG_ACQ_CODE (NAP_REG_ACQ_BASE + 0x03)
+/** Most acquisition channels a NAP build can have, see
+ * NAP_ACQ_EXT_CHANNELS. */
+#if NAP_ACQ_EXT_CHANNELS
+#define NAP_ACQ_MAX_CHANNELS 4
+#else
+#define NAP_ACQ_MAX_CHANNELS 1
+#endif
+
+/** The first acquisition channel's registers follow the CW channel's, the
+ * registers of any further channels start at NAP_REG_ACQ_EXT_BASE. */
+#define NAP_REG_ACQ_BASE        0x06
+#define NAP_REG_ACQ_EXT_BASE    0xC0
+#define NAP_ACQ_N_REGS          4
+#define NAP_REG_ACQ_INIT_OFFSET 0x00
+#define NAP_REG_ACQ_LOAD_OFFSET 0x01
+#define NAP_REG_ACQ_CORR_OFFSET 0x02
+#define NAP_REG_ACQ_CODE_OFFSET 0x03
+
+/** Register address of an acquisition channel's register. */
+#define NAP_REG_ACQ(channel, offset) \
+  (((channel) == 0 ? NAP_REG_ACQ_BASE : \
+    NAP_REG_ACQ_EXT_BASE + ((channel) - 1) * NAP_ACQ_N_REGS) + (offset))
 
 #define NAP_ACQ_CODE_PHASE_WIDTH          12
 #define NAP_ACQ_CARRIER_FREQ_WIDTH        20
@@ -43,14 +61,22 @@
  */
 extern u8 nap_acq_n_taps;
 
-void nap_acq_load_wr_enable_blocking(void);
-void nap_acq_load_wr_disable_blocking(void);
+/** Number of acquisition channels.
+ * Number of acquisition channels that NAP configuration was built with, at
+ * most NAP_ACQ_MAX_CHANNELS. Read from configuration flash at runtime in
+ * nap_conf_rd_parameters().
+ */
+extern u8 nap_acq_n_channels;
+
+void nap_acq_load_wr_enable_blocking(u8 channel);
+void nap_acq_load_wr_disable_blocking(u8 channel);
 void nap_acq_init_pack(u8 pack[], u8 prn, u16 code_phase, s16 carrier_freq);
-void nap_acq_init_wr_params_blocking(u8 prn, u16 code_phase, s16 carrier_freq);
-void nap_acq_init_wr_disable_blocking(void);
+void nap_acq_init_wr_params_blocking(u8 channel, u8 prn, u16 code_phase,
+                                     s16 carrier_freq);
+void nap_acq_init_wr_disable_blocking(u8 channel);
 void nap_acq_corr_unpack(u8 packed[], u16 *index, corr_t *corr, acc_t *acc);
-void nap_acq_corr_rd_blocking(u16 *index, corr_t *corr, acc_t *acc);
-void nap_acq_code_wr_blocking(u8 prn);
+void nap_acq_corr_rd_blocking(u8 channel, u16 *index, corr_t *corr, acc_t *acc);
+void nap_acq_code_wr_blocking(u8 channel, u8 prn);
 
 #endif  /* SWIFTNAV_ACQ_CHANNEL_H */
 
@@ -53,11 +53,9 @@ void nap_cw_load_wr_disable_blocking(void)
  */
 void nap_cw_init_pack(u8 pack[], s32 carrier_freq)
 {
-  pack[0] = (1 << 3) |                      /* cw enabled */
-            ((carrier_freq >> 30) & 0x04) | /* carrier freq [sign] */
-            ((carrier_freq >> 16) & 0x03);  /* carrier freq [17:16] */
-  pack[1] = (carrier_freq >> 8) & 0xFF;     /* carrier freq [15:8] */
-  pack[2] = carrier_freq & 0xFF;            /* carrier freq [7:0] */
+  memset(pack, 0, NAP_CW_INIT_N_BYTES);
+  nap_field_set(pack, NAP_CW_INIT_ENABLE, 1);
+  nap_field_set(pack, NAP_CW_INIT_CARRIER_FREQ, carrier_freq);
 }
 
 /** Write CW parameters to NAP CW channel's INIT register.
@@ -77,10 +75,10 @@ void nap_cw_init_pack(u8 pack[], s32 carrier_freq)
  */
 void nap_cw_init_wr_params_blocking(s32 carrier_freq)
 {
-  u8 temp[3];
+  u8 temp[NAP_CW_INIT_N_BYTES];
 
   nap_cw_init_pack(temp, carrier_freq);
-  nap_xfer_blocking(NAP_REG_CW_INIT, 3, 0, temp);
+  nap_xfer_blocking(NAP_REG_CW_INIT, NAP_CW_INIT_N_BYTES, 0, temp);
 }
 
 /** Disable NAP CW channel.
@@ -91,9 +89,9 @@ void nap_cw_init_wr_params_blocking(s32 carrier_freq)
  */
 void nap_cw_init_wr_disable_blocking(void)
 {
-  u8 temp[3] = { 0, 0, 0 };
+  u8 temp[NAP_CW_INIT_N_BYTES] = { 0, 0, 0 };
 
-  nap_xfer_blocking(NAP_REG_CW_INIT, 3, 0, temp);
+  nap_xfer_blocking(NAP_REG_CW_INIT, NAP_CW_INIT_N_BYTES, 0, temp);
 }
 
 /** Unpack correlations read from CW channel.
@@ -103,21 +101,8 @@ void nap_cw_init_wr_disable_blocking(void)
  */
 void nap_cw_corr_unpack(u8 packed[], corr_t* corrs)
 {
-  /* http://graphics.stanford.edu/~seander/bithacks.html#FixedSignExtend */
-
-  struct { s32 xtend : 24; } sign;
-
-  sign.xtend  = (packed[0] << 16) /* MSB */
-              | (packed[1] << 8)  /* Middle byte */
-              | (packed[2]);      /* LSB */
-
-  corrs->Q = sign.xtend; /* Sign extend! */
-
-  sign.xtend  = (packed[3] << 16) /* MSB */
-              | (packed[4] << 8)  /* Middle byte */
-              | (packed[5]);      /* LSB */
-
-  corrs->I = sign.xtend; /* Sign extend! */
+  corrs->I = nap_field_get_s(packed, NAP_CW_CORR_I);
+  corrs->Q = nap_field_get_s(packed, NAP_CW_CORR_Q);
 }
 
 /** Read correlations from CW channel.
@@ -128,10 +113,10 @@ void nap_cw_corr_unpack(u8 packed[], corr_t* corrs)
  */
 void nap_cw_corr_rd_blocking(corr_t* corrs)
 {
-  u8 temp[6] = {0}; /* 6 u8 = 48 bits = 2*(24 bits) */
+  u8 temp[NAP_CW_CORR_N_BYTES] = {0};
 
+  nap_xfer_blocking(NAP_REG_CW_CORR, NAP_CW_CORR_N_BYTES, temp, temp);
   nap_cw_corr_unpack(temp, corrs);
-  nap_xfer_blocking(NAP_REG_CW_CORR, 6, temp, temp);
 }
 
 /** \} */
@@ -18,6 +18,7 @@
 
 #include "../../main.h"
 #include "nap_common.h"
+#include "nap_regs.h"
 
 /** \addtogroup cw_channel
  * \{ */
@@ -13,6 +13,9 @@
 
 #include <libopencm3/stm32/f4/gpio.h>
 #include <libopencm3/stm32/f4/rcc.h>
+
+#include <ch.h>
+
 #include <libswiftnav/sbp.h>
 
 #include "../../error.h"
@@ -35,12 +38,13 @@
  * functions for interacting with the SwiftNAP internal register interface.
  * \{ */
 
-/** Set up peripherals and parts of receiver related to or depended on by NAP.
- * Sets up GPIOs associated with NAP, waits for NAP to finish configuring, sets
- * up SPI, sets up MAX2769 Frontend, sets up NAP interrupt, sets up NAP
- * callbacks, gets NAP configuration parameters from FPGA flash.
+/** Start the NAP configuring.
+ * Sets up GPIOs associated with NAP, sets up SPI, sets up MAX2769 Frontend
+ * and then releases the FPGA to configure itself from the flash. The FPGA
+ * uses the SPI2 bus and provides the STM clock, so until nap_setup() returns
+ * nothing may use SPI2 or rely on the system clock frequency.
  */
-void nap_setup()
+void nap_conf_start(void)
 {
   /* Setup the FPGA conf done line. */
   RCC_AHB1ENR |= RCC_AHB1ENR_IOPCEN;
@@ -67,7 +71,15 @@ void nap_setup()
 
   /* Allow the FPGA to configure. */
   nap_conf_b_set();
+}
 
+/** Finish setting up the NAP and the parts of the receiver depended on by it.
+ * Must be called after nap_conf_start(). Waits for NAP to finish
+ * configuring, sets up SPI, switches to the NAP clock, sets up NAP interrupt,
+ * sets up NAP callbacks, gets NAP configuration parameters from FPGA flash.
+ */
+void nap_setup(void)
+{
   /* Wait for FPGA to finish configuring (uses SPI2 bus). */
   while (!(nap_conf_done())) ;
 
@@ -77,6 +89,7 @@ void nap_setup()
   /* FPGA is done using SPI2: re-initialise the SPI peripheral. */
   spi_setup();
   spi1_dma_setup();
+  spi2_dma_setup();
 
   /* Switch the STM's clock to use the Frontend clock from the NAP */
   rcc_clock_setup_hse_3v3(&hse_16_368MHz_in_130_944MHz_out_3v3);
@@ -180,22 +193,25 @@ void nap_callbacks_setup(void)
                         &nap_dna_node);
 }
 
-/** Do an SPI transfer to/from one of the NAP's internal registers.
+/** Transfers shorter than this are done by spinning on the SPI peripheral as
+ * a context switch would cost more than the transfer itself. */
+#define NAP_XFER_DMA_MIN_LEN 8
+
+/** Transfer one register's worth of data within an open SPI frame.
+ * The FPGA must already be selected.
  *
  * \param reg_id   NAP register ID.
  * \param n_bytes  Number of bytes to transfer to/from register.
- * \param data_in  Array of length n_bytes to transfer to NAP register.
- * \param data_out Array of length n_bytes to transfer NAP register data into.
+ * \param data_in  Array of length n_bytes to transfer NAP register data into.
+ * \param data_out Array of length n_bytes to transfer to NAP register.
  */
-void nap_xfer_blocking(u8 reg_id, u16 n_bytes, u8 data_in[],
-                       const u8 data_out[])
+static void nap_xfer_frame(u8 reg_id, u16 n_bytes, u8 data_in[],
+                           const u8 data_out[])
 {
-  spi_slave_select(SPI_SLAVE_FPGA);
-
   spi_xfer(SPI_BUS_FPGA, reg_id);
 
   /* Spin for shorter transfers to avoid the overhead of context switching. */
-  if (n_bytes < 8) {
+  if (n_bytes < NAP_XFER_DMA_MIN_LEN) {
     /* If data_in is NULL then discard read data. */
     if (data_in)
       for (u16 i = 0; i < n_bytes; i++)
@@ -206,7 +222,163 @@ void nap_xfer_blocking(u8 reg_id, u16 n_bytes, u8 data_in[],
   } else {
         spi1_xfer_dma(n_bytes, data_in, data_out);
   }
-  spi_slave_deselect();
+}
+
+/** Transfer one register's worth of data in place within an open SPI frame.
+ * The FPGA must already be selected.
+ *
+ * \param reg_id  NAP register ID.
+ * \param n_bytes Number of bytes to transfer to/from register.
+ * \param buff    DMA reachable array of length n_bytes, data to transfer to
+ *                the NAP register is replaced with the data read back.
+ */
+static void nap_xfer_frame_inplace(u8 reg_id, u16 n_bytes, u8 buff[])
+{
+  spi_xfer(SPI_BUS_FPGA, reg_id);
+
+  if (n_bytes < NAP_XFER_DMA_MIN_LEN) {
+    for (u16 i = 0; i < n_bytes; i++)
+      buff[i] = spi_xfer(SPI_BUS_FPGA, buff[i]);
+  } else {
+    spi1_xfer_dma_inplace(n_bytes, buff);
+  }
+}
+
+/** Do an SPI transfer to/from one of the NAP's internal registers.
+ *
+ * \param reg_id   NAP register ID.
+ * \param n_bytes  Number of bytes to transfer to/from register.
+ * \param data_in  Array of length n_bytes to transfer to NAP register.
+ * \param data_out Array of length n_bytes to transfer NAP register data into.
+ */
+void nap_xfer_blocking(u8 reg_id, u16 n_bytes, u8 data_in[],
+                       const u8 data_out[])
+{
+  spi_slave_select(SPI_SLAVE_FPGA);
+  nap_xfer_frame(reg_id, n_bytes, data_in, data_out);
+  spi_slave_deselect(SPI_SLAVE_FPGA);
+}
+
+/** Do an in place SPI transfer to/from one of the NAP's internal registers.
+ * Unlike nap_xfer_blocking() no copies are made, the buffer is handed
+ * straight to the DMA controller. Get buffers from spi_dma_buff_alloc().
+ *
+ * \param reg_id  NAP register ID.
+ * \param n_bytes Number of bytes to transfer to/from register.
+ * \param buff    DMA reachable array of length n_bytes, data to transfer to
+ *                the NAP register is replaced with the data read back.
+ */
+void nap_xfer_inplace_blocking(u8 reg_id, u16 n_bytes, u8 buff[])
+{
+  spi_slave_select(SPI_SLAVE_FPGA);
+  nap_xfer_frame_inplace(reg_id, n_bytes, buff);
+  spi_slave_deselect(SPI_SLAVE_FPGA);
+}
+
+/** Do a batch of equal length SPI transfers to/from several NAP registers.
+ * The SPI bus is only taken once for the whole batch, each register transfer
+ * gets its own nCS frame. Used to service all the pending tracking channels
+ * in one go instead of paying the bus lock overhead per channel. Transfers
+ * are done in place, see nap_xfer_inplace_blocking().
+ *
+ * \param n_xfers Number of register transfers in the batch.
+ * \param reg_ids Array of length n_xfers of NAP register IDs.
+ * \param n_bytes Number of bytes to transfer to/from each register.
+ * \param buff    DMA reachable array of length n_xfers*n_bytes, data to
+ *                transfer to the NAP registers is replaced with the data read
+ *                back.
+ */
+void nap_xfer_batch_blocking(u8 n_xfers, const u8 reg_ids[], u16 n_bytes,
+                             u8 buff[])
+{
+  spi_slave_select(SPI_SLAVE_FPGA);
+
+  for (u8 i = 0; i < n_xfers; i++) {
+    if (i > 0)
+      spi_slave_reselect(SPI_SLAVE_FPGA);
+    nap_xfer_frame_inplace(reg_ids[i], n_bytes, &buff[i * n_bytes]);
+  }
+
+  spi_slave_deselect(SPI_SLAVE_FPGA);
+}
+
+/** Do a pipelined batch of equal length SPI transfers to/from several NAP
+ * registers.
+ * Like nap_xfer_batch_blocking() but as soon as each register transfer
+ * completes the next one is started on the DMA controller and the callback
+ * is run for the completed one while the next is in flight. This overlaps
+ * processing of one register's data with the SPI transfer of the next.
+ *
+ * The callback is run from the calling thread with the SPI bus held, it
+ * must not do any SPI transfers of its own.
+ *
+ * \param n_xfers Number of register transfers in the batch.
+ * \param reg_ids Array of length n_xfers of NAP register IDs.
+ * \param n_bytes Number of bytes to transfer to/from each register.
+ * \param buff    DMA reachable array of length n_xfers*n_bytes, data to
+ *                transfer to the NAP registers is replaced with the data read
+ *                back.
+ * \param cb      Completion callback, called once for each transfer in order
+ *                with the index of the transfer and its data.
+ * \param context Pointer passed through to the callback.
+ */
+void nap_xfer_pipelined_blocking(u8 n_xfers, const u8 reg_ids[], u16 n_bytes,
+                                 u8 buff[], nap_xfer_cb_t cb, void *context)
+{
+  if (n_xfers == 0)
+    return;
+
+  spi_slave_select(SPI_SLAVE_FPGA);
+
+  if (n_bytes < NAP_XFER_DMA_MIN_LEN) {
+    /* Nothing to overlap with for polled transfers. */
+    for (u8 i = 0; i < n_xfers; i++) {
+      if (i > 0)
+        spi_slave_reselect(SPI_SLAVE_FPGA);
+      nap_xfer_frame_inplace(reg_ids[i], n_bytes, &buff[i * n_bytes]);
+      cb(i, &buff[i * n_bytes], context);
+    }
+    spi_slave_deselect(SPI_SLAVE_FPGA);
+    return;
+  }
+
+  spi_xfer(SPI_BUS_FPGA, reg_ids[0]);
+  spi1_xfer_dma_start(n_bytes, buff);
+
+  for (u8 i = 0; i < n_xfers; i++) {
+    spi1_xfer_dma_wait();
+
+    /* Get the next transfer in flight before processing this one. */
+    if (i + 1 < n_xfers) {
+      spi_slave_reselect(SPI_SLAVE_FPGA);
+      spi_xfer(SPI_BUS_FPGA, reg_ids[i + 1]);
+      spi1_xfer_dma_start(n_bytes, &buff[(i + 1) * n_bytes]);
+    }
+
+    cb(i, &buff[i * n_bytes], context);
+  }
+
+  spi_slave_deselect(SPI_SLAVE_FPGA);
+}
+
+/** Do an in place SPI transfer to/from one of the NAP's internal registers
+ * from the NAP ISR, see NAP_TRACK_IN_ISR.
+ * The transfer gets a new nCS frame of its own and is always done by
+ * spinning on the SPI peripheral, whatever its length, so it never sleeps.
+ * The bus must already be held with spi_slave_try_select_i().
+ *
+ * \param reg_id  NAP register ID.
+ * \param n_bytes Number of bytes to transfer to/from register.
+ * \param buff    Array of length n_bytes, data to transfer to the NAP
+ *                register is replaced with the data read back. Needn't be
+ *                DMA reachable.
+ */
+void nap_xfer_polled(u8 reg_id, u16 n_bytes, u8 buff[])
+{
+  spi_slave_reselect(SPI_SLAVE_FPGA);
+  spi_xfer(SPI_BUS_FPGA, reg_id);
+  for (u16 i = 0; i < n_bytes; i++)
+    buff[i] = spi_xfer(SPI_BUS_FPGA, buff[i]);
 }
 
 /** Get the current NAP internal sample clock count.
@@ -215,13 +387,18 @@ void nap_xfer_blocking(u8 reg_id, u16 n_bytes, u8 data_in[],
  * 16.368MHz sample clock frequency it rolls over approximately every 262
  * seconds.
  *
+ * The count is extended to 64 bits relative to the latest count read so far,
+ * from whichever thread, so reads that were overtaken by a read in another
+ * thread don't look like a rollover. Needs reading at least every 131 s,
+ * half the rollover period, which timebase_now() makes sure of as long as
+ * something asks the time.
+ *
  * \return NAP's internal count of sample clocks +
  *               (total number of NAP counter rollovers) * 2^32.
  */
 u64 nap_timing_count(void)
 {
-  static u32 rollover_count = 0;
-  static u32 prev_count = 0;
+  static u64 latest = 0;
 
   u8 temp[4] = { 0, 0, 0, 0 };
 
@@ -229,12 +406,13 @@ u64 nap_timing_count(void)
 
   u32 count = (temp[0] << 24) | (temp[1] << 16) | (temp[2] << 8) | temp[3];
 
-  if (count < prev_count)
-    rollover_count++;
-
-  prev_count = count;
+  chSysLock();
+  u64 tc = latest ? latest + (s32)(count - (u32)latest) : count;
+  if (tc > latest)
+    latest = tc;
+  chSysUnlock();
 
-  return (u64)count | ((u64)rollover_count << 32);
+  return tc;
 }
 
 /** Get the count of NAP's internal sample clock counter at the clock cycle the
@@ -19,6 +19,14 @@
 /** \addtogroup nap
  * \{ */
 
+/** Use the acquisition channels after the first, with their registers from
+ * NAP_REG_ACQ_EXT_BASE and IRQ bits from bit 27 down. No released NAP
+ * bitstream has them yet, so this layout is provisional. Build with
+ * -DNAP_ACQ_EXT_CHANNELS=1 only against a bitstream that has them. */
+#ifndef NAP_ACQ_EXT_CHANNELS
+#define NAP_ACQ_EXT_CHANNELS 0
+#endif
+
 /* NAP Register Addresses. */
 #define NAP_REG_IRQ                 0x00
 #define NAP_REG_ERROR               0x01
@@ -52,8 +60,12 @@ typedef struct {
   u64 Q;  /**< Quadrature correlation accumulation. */
 } acc_t;
 
+/** Callback for a completed transfer in nap_xfer_pipelined_blocking(). */
+typedef void (*nap_xfer_cb_t)(u8 index, u8 buff[], void *context);
+
 /** \} */
 
+void nap_conf_start(void);
 void nap_setup(void);
 
 u8 nap_conf_done(void);
@@ -65,6 +77,12 @@ void nap_conf_b_clear(void);
 
 void nap_xfer_blocking(u8 reg_id, u16 n_bytes, u8 data_in[],
                        const u8 data_out[]);
+void nap_xfer_inplace_blocking(u8 reg_id, u16 n_bytes, u8 buff[]);
+void nap_xfer_batch_blocking(u8 n_xfers, const u8 reg_ids[], u16 n_bytes,
+                             u8 buff[]);
+void nap_xfer_pipelined_blocking(u8 n_xfers, const u8 reg_ids[], u16 n_bytes,
+                                 u8 buff[], nap_xfer_cb_t cb, void *context);
+void nap_xfer_polled(u8 reg_id, u16 n_bytes, u8 buff[]);
 
 u32 nap_error_rd_blocking(void);
 
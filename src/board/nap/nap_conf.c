@@ -33,16 +33,18 @@
 
 /** Get NAP configuration parameters from FPGA configuration flash.
  * Gets information about the NAP configuration (number of code phase taps in
- * the acquisition channel, number of tracking channels, etc).
+ * the acquisition channel, number of tracking channels, number of
+ * acquisition channels etc).
  */
 void nap_conf_rd_parameters(void)
 {
   /* Define parameters that need to be read from FPGA configuration flash.
    * Pointers in the array should be in the same order they're stored in the
    * configuration flash. */
-  u8 * nap_parameters[2] = {
+  u8 * nap_parameters[3] = {
     &nap_acq_n_taps,
-    &nap_track_n_channels
+    &nap_track_n_channels,
+    &nap_acq_n_channels
   };
 
   /* Get parameters from FPGA configuration flash */
@@ -51,6 +53,11 @@ void nap_conf_rd_parameters(void)
 
   /* Bound number of channels with used by libswiftnav MAX_CHANNELS parameter. */
   nap_track_n_channels = MIN(nap_track_n_channels, MAX_CHANNELS);
+
+  /* Builds from before there could be more than one acquisition channel
+   * leave the flash erased. */
+  if (nap_acq_n_channels == 0 || nap_acq_n_channels > NAP_ACQ_MAX_CHANNELS)
+    nap_acq_n_channels = 1;
 }
 
 /** Return version string from NAP configuration build.
@@ -21,10 +21,19 @@
 
 #include "../../acq.h"
 #include "../../cw.h"
+#include "../../peripherals/spi.h"
+#include "../../probe.h"
 #include "../../track.h"
+#include "acq_channel.h"
 #include "nap_common.h"
 #include "track_channel.h"
 
+#if NAP_TRACK_IN_ISR && TRACK_LOOP_FILTER != TRACK_LOOP_FILTER_SP
+/* The libswiftnav loop filter works in software double precision, far too
+ * slow to run with interrupts masked. */
+#error NAP_TRACK_IN_ISR needs TRACK_LOOP_FILTER_SP
+#endif
+
 /** \addtogroup nap
  * \{ */
 
@@ -60,9 +69,72 @@ void nap_exti_setup(void)
 
 static Thread *tp = NULL;
 
+static PROBE_WAKEUP_DECL(probe_exti_latency, "nap_exti latency");
+static PROBE_DECL(probe_exti, "nap_exti");
+static PROBE_DECL(probe_acq_irq, "acq irq");
+static PROBE_DECL(probe_track_update, "tracking update");
+
+/** Error register bits other than the tracking channels' seen since the
+ * last nap_error_take(). */
+static u32 nap_error_other = 0;
+/** Cycle count the error register was last read at. */
+static u32 nap_error_t = 0;
+
+/** Account for a value read from the NAP error register.
+ * Tracking channel misses are counted against the channels along with the
+ * longest interrupt masked section since the last read, the likeliest
+ * culprit. Anything else is left for nap_error_take().
+ */
+static void nap_error_handle(u32 err)
+{
+  if (err & NAP_IRQ_TRACK_MASK) {
+    u32 masked_cycles;
+    const probe_t *masked = probe_masked_longest(nap_error_t, &masked_cycles);
+    tracking_channels_missed(err & NAP_IRQ_TRACK_MASK,
+                             masked ? masked->name : NULL, masked_cycles);
+  }
+  nap_error_other |= err & ~NAP_IRQ_TRACK_MASK;
+  nap_error_t = probe_now();
+}
+
+#if NAP_TRACK_IN_ISR
+static PROBE_DECL(probe_track_isr, "tracking update isr");
+
+/** Service the tracking channels from the NAP ISR, see NAP_TRACK_IN_ISR.
+ * The SPI bus must already be held with spi_slave_try_select_i().
+ * \return true if that was all, false if there are acquisition or CW
+ *         channels to service too, which is left to the NAP thread.
+ */
+static bool handle_nap_exti_isr(void)
+{
+  u32 t0 = probe_now();
+
+  u8 temp[4] = { 0, 0, 0, 0 };
+  nap_xfer_polled(NAP_REG_IRQ, 4, temp);
+  u32 irq = (temp[0] << 24) | (temp[1] << 16) | (temp[2] << 8) | temp[3];
+
+  if (irq & NAP_IRQ_TRACK_MASK)
+    tracking_channels_update_polled(irq & NAP_IRQ_TRACK_MASK);
+
+  if (nap_exti_count % NAP_ERROR_POLL_PERIOD == 0) {
+    nap_xfer_polled(NAP_REG_ERROR, 4, temp);
+    nap_error_handle((temp[0] << 24) | (temp[1] << 16) |
+                     (temp[2] << 8) | temp[3]);
+  }
+
+  nap_exti_count++;
+
+  probe_end(&probe_track_isr, t0);
+
+  return !(irq & ~NAP_IRQ_TRACK_MASK);
+}
+#endif
+
 /** NAP interrupt service routine.
- * Reads the IRQ register from NAP to determine what inside the NAP needs to be
- * serviced, and then calls the appropriate service routine.
+ * Wakes the NAP thread to read the IRQ register from NAP and service
+ * whatever inside the NAP needs it. With NAP_TRACK_IN_ISR the tracking
+ * channels are serviced here instead and the thread is only woken if there
+ * is anything else to service, or if it can't be done from here.
  */
 void exti1_isr(void)
 {
@@ -71,8 +143,27 @@ void exti1_isr(void)
 
   exti_reset_request(EXTI1);
 
+  bool wake = true;
+
+#if NAP_TRACK_IN_ISR
+  /* Only while the thread is idle, otherwise it may be part way through
+   * servicing the same channels. It will see the line still high and go
+   * round again. */
+  if (tp != NULL && spi_slave_try_select_i(SPI_SLAVE_FPGA)) {
+    chSysUnlockFromIsr();
+    wake = !handle_nap_exti_isr();
+    chSysLockFromIsr();
+    spi_slave_deselect_i();
+    /* The interrupt is edge triggered, if the line went high again while
+     * the channels were being serviced there won't be another one. */
+    if (GPIOA_IDR & GPIO1)
+      wake = true;
+  }
+#endif
+
   /* Wake up processing thread */
-  if (tp != NULL) {
+  if (wake && tp != NULL) {
+    probe_wakeup_isr(&probe_exti_latency, probe_now());
     chSchReadyI(tp);
     tp = NULL;
   }
@@ -83,13 +174,23 @@ void exti1_isr(void)
 
 static void handle_nap_exti(void)
 {
-  u32 irq = nap_irq_rd_blocking();
+  u32 t0 = probe_now();
+
+  probe_wakeup_resume(&probe_exti_latency);
 
-  if (irq & NAP_IRQ_ACQ_DONE)
-    acq_service_irq();
+  u32 irq = nap_irq_rd_blocking();
 
-  if (irq & NAP_IRQ_ACQ_LOAD_DONE)
-    acq_service_load_done();
+  if (irq & NAP_IRQ_ACQ_MASK) {
+    for (u8 i = 0; i < nap_acq_n_channels; i++) {
+      if (irq & NAP_IRQ_ACQ_DONE(i)) {
+        u32 t_acq = probe_now();
+        acq_service_irq(i);
+        probe_end(&probe_acq_irq, t_acq);
+      }
+      if (irq & NAP_IRQ_ACQ_LOAD_DONE(i))
+        acq_service_load_done(i);
+    }
+  }
 
   if (irq & NAP_IRQ_CW_DONE)
     cw_service_irq();
@@ -100,23 +201,19 @@ static void handle_nap_exti(void)
   /* Mask off everything but tracking irqs. */
   irq &= NAP_IRQ_TRACK_MASK;
 
-  /* Loop over tracking irq bit flags. */
-  for (u8 n = 0; n < nap_track_n_channels; n++) {
-    /* Save a bit of time by seeing if the rest of the bits
-     * are zero in one go so we don't have to loop over all
-     * of them.
-     */
-    if (!(irq >> n))
-      break;
-
-    /* Test if the nth tracking irq flag is set, if so service it. */
-    if ((irq >> n) & 1) {
-      tracking_channel_get_corrs(n);
-      tracking_channel_update(n);
-    }
+  /* Service all the pending tracking channels in one batch. */
+  if (irq) {
+    u32 t_track = probe_now();
+    tracking_channels_update(irq);
+    probe_end(&probe_track_update, t_track);
   }
 
+  if (nap_exti_count % NAP_ERROR_POLL_PERIOD == 0)
+    nap_error_handle(nap_error_rd_blocking());
+
   nap_exti_count++;
+
+  probe_end(&probe_exti, t0);
 }
 
 static msg_t nap_exti_thread(void *arg)
@@ -174,5 +271,19 @@ u32 nap_irq_rd_blocking(void)
   return (temp[0] << 24) | (temp[1] << 16) | (temp[2] << 8) | temp[3];
 }
 
-/** \} */
+/** Take the NAP error register bits, other than the tracking channels',
+ * seen since the last call. Tracking channel misses are counted by
+ * tracking_channels_missed() instead.
+ *
+ * \return Bits seen, in NAP error register layout.
+ */
+u32 nap_error_take(void)
+{
+  chSysLock();
+  u32 err = nap_error_other;
+  nap_error_other = 0;
+  chSysUnlock();
+  return err;
+}
 
+/** \} */
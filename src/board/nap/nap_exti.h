@@ -16,22 +16,53 @@
 
 #include <libswiftnav/common.h>
 
+#include "nap_common.h"
+
 #define NVIC_EXTI1_IRQ	7
 #define exti1_isr Vector5C
 
 /** \addtogroup nap
  * \{ */
 
-/* NAP IRQ register bit definitions. */
-#define NAP_IRQ_ACQ_DONE      (1 << 31)
-#define NAP_IRQ_ACQ_LOAD_DONE (1 << 30)
+/** Service the tracking channels directly in the NAP ISR instead of handing
+ * over to the NAP thread, saving two context switches every ms. Register
+ * accesses from the ISR are all polled and only made while no thread has the
+ * SPI bus, anything else falls back to the thread. Needs the single
+ * precision loop filter, TRACK_LOOP_FILTER_SP. Build with
+ * -DNAP_TRACK_IN_ISR=1 to enable. */
+#ifndef NAP_TRACK_IN_ISR
+#define NAP_TRACK_IN_ISR 0
+#endif
+
+/** Number of NAP interrupts between reads of the NAP error register. Its
+ * bits latch until read, so a tracking channel that misses more than once
+ * between reads is only counted once, see tracking_channels_missed(). */
+#ifndef NAP_ERROR_POLL_PERIOD
+#define NAP_ERROR_POLL_PERIOD 10
+#endif
+
+/* NAP IRQ register bit definitions. The first acquisition channel's bits
+ * are at the top, those of any further channels (see NAP_ACQ_EXT_CHANNELS)
+ * follow the CW channel's, down from bit 27. Without them bits 27 and below
+ * are all tracking channels'. */
+#define NAP_IRQ_ACQ_DONE(channel) \
+  ((channel) == 0 ? (1u << 31) : (1u << (27 - 2*((channel) - 1))))
+#define NAP_IRQ_ACQ_LOAD_DONE(channel) \
+  ((channel) == 0 ? (1u << 30) : (1u << (26 - 2*((channel) - 1))))
+#if NAP_ACQ_EXT_CHANNELS
+#define NAP_IRQ_ACQ_MASK      0xCFC00000
+#else
+#define NAP_IRQ_ACQ_MASK      0xC0000000
+#endif
 #define NAP_IRQ_CW_DONE       (1 << 29)
 #define NAP_IRQ_CW_LOAD_DONE  (1 << 28)
-#define NAP_IRQ_TRACK_MASK    (~(NAP_IRQ_ACQ_DONE | \
-                                 NAP_IRQ_ACQ_LOAD_DONE | \
+#define NAP_IRQ_TRACK_MASK    (~(NAP_IRQ_ACQ_MASK | \
                                  NAP_IRQ_CW_DONE | \
                                  NAP_IRQ_CW_LOAD_DONE))
 
+/* The NAP error register has the same layout as the IRQ register, a bit is
+ * set when that interrupt fired again before the last was serviced. */
+
 /** \} */
 
 void nap_exti_setup(void);
@@ -39,5 +70,6 @@ u32 last_nap_exti_count(void);
 void wait_for_nap_exti(void);
 
 u32 nap_irq_rd_blocking(void);
+u32 nap_error_take(void);
 
 #endif  /* SWIFTNAV_NAP_EXTI_H */
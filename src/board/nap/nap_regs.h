@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+
+#ifndef SWIFTNAV_NAP_REGS_H
+#define SWIFTNAV_NAP_REGS_H
+
+#include <string.h>
+
+#include <libswiftnav/common.h>
+
+/** \addtogroup nap
+ * \{ */
+
+/** \defgroup nap_regs Register Layouts
+ * Layouts of the SwiftNAP channel registers, and the codecs built from them.
+ * Every field of every register is described once here, as its register's
+ * length in bytes, the position of its lowest bit and its width, with bits
+ * numbered from the least significant bit of the register. Registers are
+ * shifted over SPI most significant byte first.
+ *
+ * nap_field_get_u() and friends take a description as their trailing
+ * arguments, e.g. `nap_field_get_s(buff, NAP_TRACK_CORR_E_I)`. Everything
+ * but the buffer is then a constant and each access compiles down to one
+ * unaligned word load, a `REV` and a `UBFX` or `SBFX` straight out of the
+ * SPI DMA buffer, rather than the byte at a time shifting and ORing of a
+ * hand written unpacker. A batched or pipelined read of several channels
+ * holds one register after another, every N_BYTES, and is decoded by the
+ * same codecs at each channel's offset.
+ *
+ * Fields of up to 25 bits can be placed anywhere, wider ones have to fit in
+ * the 32 bit window starting at the byte holding their top bit (or the last
+ * four bytes of the register), as all of the ones here do. 48 bit fields are
+ * read as two halves with nap_field_get_u64().
+ * \{ */
+
+/* Register lengths in bytes. */
+#define NAP_TRACK_INIT_N_BYTES    6
+#define NAP_TRACK_UPDATE_N_BYTES  6
+/* 2 (I or Q) * 3 (E, P or L) * 3 (24 bits / 8) + 16 bits sample count. */
+#define NAP_TRACK_CORR_N_BYTES    (2*3*3 + 2)
+#define NAP_TRACK_PHASE_N_BYTES   9
+#define NAP_ACQ_INIT_N_BYTES      4
+#define NAP_ACQ_CORR_N_BYTES      19
+#define NAP_CW_INIT_N_BYTES       3
+#define NAP_CW_CORR_N_BYTES       6
+
+/* Field descriptions: register length, lowest bit, width. */
+
+/* Track channel INIT. */
+#define NAP_TRACK_INIT_PRN            NAP_TRACK_INIT_N_BYTES, 0, 5
+#define NAP_TRACK_INIT_CARRIER_PHASE  NAP_TRACK_INIT_N_BYTES, 5, 24
+#define NAP_TRACK_INIT_CODE_PHASE     NAP_TRACK_INIT_N_BYTES, 29, 14
+
+/* Track channel UPDATE. */
+#define NAP_TRACK_UPDATE_CARRIER_FREQ    NAP_TRACK_UPDATE_N_BYTES, 0, 16
+#define NAP_TRACK_UPDATE_CODE_PHASE_RATE NAP_TRACK_UPDATE_N_BYTES, 16, 29
+
+/* Track channel CORR, signed correlations. */
+#define NAP_TRACK_CORR_E_I          NAP_TRACK_CORR_N_BYTES, 0, 24
+#define NAP_TRACK_CORR_E_Q          NAP_TRACK_CORR_N_BYTES, 24, 24
+#define NAP_TRACK_CORR_P_I          NAP_TRACK_CORR_N_BYTES, 48, 24
+#define NAP_TRACK_CORR_P_Q          NAP_TRACK_CORR_N_BYTES, 72, 24
+#define NAP_TRACK_CORR_L_I          NAP_TRACK_CORR_N_BYTES, 96, 24
+#define NAP_TRACK_CORR_L_Q          NAP_TRACK_CORR_N_BYTES, 120, 24
+#define NAP_TRACK_CORR_SAMPLE_COUNT NAP_TRACK_CORR_N_BYTES, 144, 16
+
+/* Track channel PHASE. */
+#define NAP_TRACK_PHASE_CARRIER_PHASE NAP_TRACK_PHASE_N_BYTES, 0, 24
+#define NAP_TRACK_PHASE_CODE_PHASE    NAP_TRACK_PHASE_N_BYTES, 24, 48
+
+/* Acquisition channel INIT. */
+#define NAP_ACQ_INIT_PRN           NAP_ACQ_INIT_N_BYTES, 0, 5
+#define NAP_ACQ_INIT_CODE_PHASE    NAP_ACQ_INIT_N_BYTES, 5, 12
+#define NAP_ACQ_INIT_CARRIER_FREQ  NAP_ACQ_INIT_N_BYTES, 17, 12
+#define NAP_ACQ_INIT_ENABLE        NAP_ACQ_INIT_N_BYTES, 29, 1
+
+/* Acquisition channel CORR, signed correlations and unsigned accumulations. */
+#define NAP_ACQ_CORR_ACC_I   NAP_ACQ_CORR_N_BYTES, 0, 48
+#define NAP_ACQ_CORR_ACC_Q   NAP_ACQ_CORR_N_BYTES, 48, 48
+#define NAP_ACQ_CORR_I       NAP_ACQ_CORR_N_BYTES, 96, 24
+#define NAP_ACQ_CORR_Q       NAP_ACQ_CORR_N_BYTES, 120, 24
+#define NAP_ACQ_CORR_INDEX   NAP_ACQ_CORR_N_BYTES, 144, 8
+
+/* CW channel INIT. */
+#define NAP_CW_INIT_CARRIER_FREQ  NAP_CW_INIT_N_BYTES, 0, 19
+#define NAP_CW_INIT_ENABLE        NAP_CW_INIT_N_BYTES, 19, 1
+
+/* CW channel CORR, signed correlations. */
+#define NAP_CW_CORR_I  NAP_CW_CORR_N_BYTES, 0, 24
+#define NAP_CW_CORR_Q  NAP_CW_CORR_N_BYTES, 24, 24
+
+/** Big endian load of n bytes, 1 to 4. */
+static inline u32 nap_be_load(const u8 *p, u8 n)
+{
+  if (n == 4) {
+    u32 w;
+    memcpy(&w, p, 4);
+    return __builtin_bswap32(w);
+  }
+  u32 w = 0;
+  for (u8 i = 0; i < n; i++)
+    w = (w << 8) | p[i];
+  return w;
+}
+
+/** Big endian store of the low n bytes of a word, 1 to 4. */
+static inline void nap_be_store(u8 *p, u8 n, u32 w)
+{
+  if (n == 4) {
+    w = __builtin_bswap32(w);
+    memcpy(p, &w, 4);
+    return;
+  }
+  for (u8 i = n; i > 0; i--) {
+    p[i - 1] = w;
+    w >>= 8;
+  }
+}
+
+/** Length of the window a field is accessed through, the whole of a
+ * register shorter than a word. */
+static inline u8 nap_field_win_len(u8 len)
+{
+  return MIN(len, 4);
+}
+
+/** First byte of the window a field is accessed through, the one holding its
+ * top bit unless that would run the window off the end of the register. */
+static inline u8 nap_field_win(u8 len, u8 lsb, u8 width)
+{
+  u8 top = len - 1 - (lsb + width - 1) / 8;
+  return MIN(top, len - nap_field_win_len(len));
+}
+
+/** Position of a field's lowest bit in its window. */
+static inline u8 nap_field_shift(u8 len, u8 lsb, u8 width)
+{
+  u8 win = nap_field_win(len, lsb, width);
+  return lsb - 8 * (len - win - nap_field_win_len(len));
+}
+
+/** Read an unsigned field of up to 32 bits. */
+static inline u32 nap_field_get_u(const u8 reg[], u8 len, u8 lsb, u8 width)
+{
+  u32 w = nap_be_load(&reg[nap_field_win(len, lsb, width)],
+                      nap_field_win_len(len));
+  return (w >> nap_field_shift(len, lsb, width)) & (~0u >> (32 - width));
+}
+
+/** Read a two's complement field of up to 32 bits, sign extended. */
+static inline s32 nap_field_get_s(const u8 reg[], u8 len, u8 lsb, u8 width)
+{
+  u32 w = nap_be_load(&reg[nap_field_win(len, lsb, width)],
+                      nap_field_win_len(len));
+  u8 top = 32 - nap_field_shift(len, lsb, width) - width;
+  return (s32)(w << top) >> (32 - width);
+}
+
+/** Read an unsigned field of 33 to 64 bits. */
+static inline u64 nap_field_get_u64(const u8 reg[], u8 len, u8 lsb, u8 width)
+{
+  return nap_field_get_u(reg, len, lsb, 32) |
+         (u64)nap_field_get_u(reg, len, lsb + 32, width - 32) << 32;
+}
+
+/** Write a field of up to 32 bits, leaving the rest of the register as it
+ * is. The value is truncated to the field width. */
+static inline void nap_field_set(u8 reg[], u8 len, u8 lsb, u8 width, u32 v)
+{
+  u8 win = nap_field_win(len, lsb, width);
+  u8 n = nap_field_win_len(len);
+  u8 shift = nap_field_shift(len, lsb, width);
+  u32 mask = (~0u >> (32 - width)) << shift;
+  u32 w = nap_be_load(&reg[win], n);
+  nap_be_store(&reg[win], n, (w & ~mask) | ((v << shift) & mask));
+}
+
+/** \} */
+
+/** \} */
+
+#endif  /* SWIFTNAV_NAP_REGS_H */
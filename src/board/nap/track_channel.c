@@ -11,6 +11,7 @@
  * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
  */
 
+#include "../../peripherals/spi.h"
 #include "nap_conf.h"
 #include "nap_common.h"
 #include "track_channel.h"
@@ -39,13 +40,11 @@ u8 nap_track_n_channels;
  */
 void nap_track_init_pack(u8 pack[], u8 prn, s32 carrier_phase, u16 code_phase)
 {
+  memset(pack, 0, NAP_TRACK_INIT_N_BYTES);
   /* TODO: No longer need to write PRN. */
-  pack[0] = ((code_phase << 5) >> 16) & 0x07;
-  pack[1] = (code_phase << 5) >> 8;
-  pack[2] = (((carrier_phase << 5) >> 24) & 0x1F) | (code_phase << 5);
-  pack[3] = (carrier_phase << 5) >> 16;
-  pack[4] = (carrier_phase << 5) >> 8;
-  pack[5] = (prn & 0x1F) | (carrier_phase << 5 & 0xE0);
+  nap_field_set(pack, NAP_TRACK_INIT_PRN, prn);
+  nap_field_set(pack, NAP_TRACK_INIT_CARRIER_PHASE, carrier_phase);
+  nap_field_set(pack, NAP_TRACK_INIT_CODE_PHASE, code_phase);
 }
 
 /** Write to a NAP track channel's INIT register.
@@ -65,11 +64,12 @@ void nap_track_init_pack(u8 pack[], u8 prn, s32 carrier_phase, u16 code_phase)
 void nap_track_init_wr_blocking(u8 channel, u8 prn, s32 carrier_phase,
                                 u16 code_phase)
 {
-  u8 temp[6] = { 0, 0, 0, 0, 0, 0 };
+  u8 temp[NAP_TRACK_INIT_N_BYTES] = { 0, 0, 0, 0, 0, 0 };
 
   nap_track_init_pack(temp, prn, carrier_phase, code_phase);
   nap_xfer_blocking(NAP_REG_TRACK_BASE + channel * NAP_TRACK_N_REGS
-                     + NAP_REG_TRACK_INIT_OFFSET, 6, 0, temp);
+                     + NAP_REG_TRACK_INIT_OFFSET, NAP_TRACK_INIT_N_BYTES,
+                    0, temp);
 }
 
 /** Pack data for writing to a NAP track channel's UPDATE register.
@@ -80,12 +80,9 @@ void nap_track_init_wr_blocking(u8 channel, u8 prn, s32 carrier_phase,
  */
 void nap_track_update_pack(u8 pack[], s32 carrier_freq, u32 code_phase_rate)
 {
-  pack[0] = (code_phase_rate >> 24) & 0x1F;
-  pack[1] = (code_phase_rate >> 16);
-  pack[2] = (code_phase_rate >> 8);
-  pack[3] = code_phase_rate;
-  pack[4] = (carrier_freq >> 8);
-  pack[5] = carrier_freq;
+  memset(pack, 0, NAP_TRACK_UPDATE_N_BYTES);
+  nap_field_set(pack, NAP_TRACK_UPDATE_CODE_PHASE_RATE, code_phase_rate);
+  nap_field_set(pack, NAP_TRACK_UPDATE_CARRIER_FREQ, carrier_freq);
 }
 
 /** Write to a NAP track channel's UPDATE register.
@@ -108,41 +105,105 @@ void nap_track_update_pack(u8 pack[], s32 carrier_freq, u32 code_phase_rate)
 void nap_track_update_wr_blocking(u8 channel, s32 carrier_freq,
                                   u32 code_phase_rate)
 {
-  u8 temp[6] = { 0, 0, 0, 0, 0, 0 };
+  u8 temp[NAP_TRACK_UPDATE_N_BYTES] = { 0, 0, 0, 0, 0, 0 };
 
   nap_track_update_pack(temp, carrier_freq, code_phase_rate);
   nap_xfer_blocking(NAP_REG_TRACK_BASE + channel * NAP_TRACK_N_REGS
-                     + NAP_REG_TRACK_UPDATE_OFFSET, 6, 0, temp);
+                     + NAP_REG_TRACK_UPDATE_OFFSET, NAP_TRACK_UPDATE_N_BYTES,
+                     0, temp);
 }
 
-/** Unpack data read from a NAP track channel's CORR register.
+/** Write to the UPDATE registers of several NAP track channels at once.
+ * Equivalent to calling nap_track_update_wr_blocking() for each channel but
+ * only takes the SPI bus once for the whole batch.
  *
- * \param packed       Array of u8 data read from channnel's CORR register.
- * \param sample_count Number of sample clock cycles in correlation period.
- * \param corrs        Array of E,P,L correlations from correlation period.
+ * \param n_channels      Number of channels to write.
+ * \param channels        Array of NAP track channels whose UPDATE registers
+ *                        to write.
+ * \param carrier_freq    Array of next correlation period's carrier
+ *                        frequencies, one per channel.
+ * \param code_phase_rate Array of next correlation period's code phase
+ *                        rates, one per channel.
  */
-void nap_track_corr_unpack(u8 packed[], u16* sample_count, corr_t corrs[])
+void nap_track_update_wr_batch_blocking(u8 n_channels, const u8 channels[],
+                                        const s32 carrier_freq[],
+                                        const u32 code_phase_rate[])
 {
-  /* graphics.stanford.edu/~seander/bithacks.html#FixedSignExtend */
-
-  struct { s32 xtend : 24; } sign;
+  u8 reg_ids[NAP_MAX_N_TRACK_CHANNELS];
+  u8 *buff = spi_dma_buff_alloc();
+
+  if (!buff) {
+    /* Pool exhausted, fall back to one copying transfer per channel. */
+    for (u8 i = 0; i < n_channels; i++)
+      nap_track_update_wr_blocking(channels[i], carrier_freq[i],
+                                   code_phase_rate[i]);
+    return;
+  }
 
-  *sample_count = (packed[0] << 8) | packed[1];
+  for (u8 i = 0; i < n_channels; i++) {
+    reg_ids[i] = NAP_REG_TRACK_BASE + channels[i] * NAP_TRACK_N_REGS
+                 + NAP_REG_TRACK_UPDATE_OFFSET;
+    nap_track_update_pack(&buff[i * NAP_TRACK_UPDATE_N_BYTES],
+                          carrier_freq[i], code_phase_rate[i]);
+  }
+  nap_xfer_batch_blocking(n_channels, reg_ids, NAP_TRACK_UPDATE_N_BYTES,
+                          buff);
 
-  for (u8 i = 0; i < 3; i++) {
+  spi_dma_buff_free(buff);
+}
 
-    sign.xtend  = (packed[6 * (3 - i - 1) + 2] << 16) /* MSB */
-                | (packed[6 * (3 - i - 1) + 3] << 8)  /* Middle byte */
-                | (packed[6 * (3 - i - 1) + 4]);      /* LSB */
+/** Write to a NAP track channel's UPDATE register from the NAP ISR.
+ * Like nap_track_update_wr_blocking() but polled, with the bus already held,
+ * see nap_xfer_polled().
+ *
+ * \param channel         NAP track channel whose UPDATE register to write.
+ * \param carrier_freq    Next correlation period's carrier frequency.
+ * \param code_phase_rate Next correlation period's code phase rate.
+ */
+void nap_track_update_wr_polled(u8 channel, s32 carrier_freq,
+                                u32 code_phase_rate)
+{
+  u8 temp[NAP_TRACK_UPDATE_N_BYTES];
 
-    corrs[i].Q = sign.xtend;  /* Sign extend! */
+  nap_track_update_pack(temp, carrier_freq, code_phase_rate);
+  nap_xfer_polled(NAP_REG_TRACK_BASE + channel * NAP_TRACK_N_REGS
+                  + NAP_REG_TRACK_UPDATE_OFFSET, NAP_TRACK_UPDATE_N_BYTES,
+                  temp);
+}
 
-    sign.xtend  = (packed[6 * (3 - i - 1) + 5] << 16) /* MSB */
-                | (packed[6 * (3 - i - 1) + 6] << 8)  /* Middle byte */
-                | (packed[6 * (3 - i - 1) + 7]);      /* LSB */
+/** Unpack data read from a NAP track channel's CORR register.
+ *
+ * \param packed       Array of u8 data read from channnel's CORR register.
+ * \param sample_count Number of sample clock cycles in correlation period.
+ * \param corrs        Array of E,P,L correlations from correlation period.
+ */
+void nap_track_corr_unpack(u8 packed[], u16* sample_count, corr_t corrs[])
+{
+  *sample_count = nap_field_get_u(packed, NAP_TRACK_CORR_SAMPLE_COUNT);
+  corrs[0].I = nap_field_get_s(packed, NAP_TRACK_CORR_E_I);
+  corrs[0].Q = nap_field_get_s(packed, NAP_TRACK_CORR_E_Q);
+  corrs[1].I = nap_field_get_s(packed, NAP_TRACK_CORR_P_I);
+  corrs[1].Q = nap_field_get_s(packed, NAP_TRACK_CORR_P_Q);
+  corrs[2].I = nap_field_get_s(packed, NAP_TRACK_CORR_L_I);
+  corrs[2].Q = nap_field_get_s(packed, NAP_TRACK_CORR_L_Q);
+}
 
-    corrs[i].I = sign.xtend;  /* Sign extend! */
-  }
+/** Pack correlations into the layout of a NAP track channel's CORR register,
+ * the inverse of nap_track_corr_unpack().
+ *
+ * \param packed       Array of NAP_TRACK_CORR_N_BYTES u8 to pack data into.
+ * \param sample_count Number of sample clock cycles in correlation period.
+ * \param corrs        Array of E,P,L correlations from correlation period.
+ */
+void nap_track_corr_pack(u8 packed[], u16 sample_count, const corr_t corrs[])
+{
+  nap_field_set(packed, NAP_TRACK_CORR_SAMPLE_COUNT, sample_count);
+  nap_field_set(packed, NAP_TRACK_CORR_E_I, corrs[0].I);
+  nap_field_set(packed, NAP_TRACK_CORR_E_Q, corrs[0].Q);
+  nap_field_set(packed, NAP_TRACK_CORR_P_I, corrs[1].I);
+  nap_field_set(packed, NAP_TRACK_CORR_P_Q, corrs[1].Q);
+  nap_field_set(packed, NAP_TRACK_CORR_L_I, corrs[2].I);
+  nap_field_set(packed, NAP_TRACK_CORR_L_Q, corrs[2].Q);
 }
 
 /** Read data from a NAP track channel's CORR register.
@@ -153,14 +214,104 @@ void nap_track_corr_unpack(u8 packed[], u16* sample_count, corr_t corrs[])
  */
 void nap_track_corr_rd_blocking(u8 channel, u16* sample_count, corr_t corrs[])
 {
-  /* 2 (I or Q) * 3 (E, P or L) * 3 (24 bits / 8) + 16 bits sample count. */
-  u8 temp[2*3*3 + 2];
+  u8 reg_id = NAP_REG_TRACK_BASE + channel * NAP_TRACK_N_REGS
+              + NAP_REG_TRACK_CORR_OFFSET;
+  u8 *buff = spi_dma_buff_alloc();
+
+  if (buff) {
+    nap_xfer_inplace_blocking(reg_id, NAP_TRACK_CORR_N_BYTES, buff);
+    nap_track_corr_unpack(buff, sample_count, corrs);
+    spi_dma_buff_free(buff);
+  } else {
+    u8 temp[NAP_TRACK_CORR_N_BYTES];
+    nap_xfer_blocking(reg_id, NAP_TRACK_CORR_N_BYTES, temp, temp);
+    nap_track_corr_unpack(temp, sample_count, corrs);
+  }
+}
 
-  nap_xfer_blocking(NAP_REG_TRACK_BASE + channel * NAP_TRACK_N_REGS
-                     + NAP_REG_TRACK_CORR_OFFSET, 2*3*3 + 2, temp, temp);
+/** Read data from a NAP track channel's CORR register from the NAP ISR.
+ * Like nap_track_corr_rd_blocking() but polled, with the bus already held,
+ * see nap_xfer_polled().
+ *
+ * \param channel      NAP track channel whose CORR register to read.
+ * \param sample_count Number of sample clock cycles in correlation period.
+ * \param corrs        Array of E,P,L correlations from correlation period.
+ */
+void nap_track_corr_rd_polled(u8 channel, u16* sample_count, corr_t corrs[])
+{
+  u8 temp[NAP_TRACK_CORR_N_BYTES] = {0};
+
+  nap_xfer_polled(NAP_REG_TRACK_BASE + channel * NAP_TRACK_N_REGS
+                  + NAP_REG_TRACK_CORR_OFFSET, NAP_TRACK_CORR_N_BYTES, temp);
   nap_track_corr_unpack(temp, sample_count, corrs);
 }
 
+/** Context passed through nap_xfer_pipelined_blocking(). */
+typedef struct {
+  const u8 *channels;
+  nap_track_corr_cb_t cb;
+  void *context;
+} corr_pipeline_t;
+
+static void corr_pipeline_cb(u8 index, u8 buff[], void *context)
+{
+  corr_pipeline_t *p = (corr_pipeline_t *)context;
+  u16 sample_count;
+  corr_t corrs[3];
+
+  nap_track_corr_unpack(buff, &sample_count, corrs);
+  p->cb(p->channels[index], sample_count, corrs, p->context);
+}
+
+/** Read the CORR registers of several NAP track channels, pipelined.
+ * The SPI bus is taken once for the whole set of channels. As soon as one
+ * channel's correlations have been read the read for the next channel is
+ * started and the callback is run for the completed channel while the next
+ * read is in flight, overlapping loop filter processing with SPI transfers.
+ *
+ * The callback runs with the SPI bus held so must not make any NAP register
+ * accesses itself.
+ *
+ * \param n_channels Number of channels to read.
+ * \param channels   Array of NAP track channels whose CORR registers to
+ *                   read.
+ * \param cb         Callback run for each channel, in order, with the
+ *                   sample count and E,P,L correlations read.
+ * \param context    Pointer passed through to the callback.
+ */
+void nap_track_corr_rd_pipelined_blocking(u8 n_channels, const u8 channels[],
+                                          nap_track_corr_cb_t cb,
+                                          void *context)
+{
+  u8 reg_ids[NAP_MAX_N_TRACK_CHANNELS];
+  u8 *buff = spi_dma_buff_alloc();
+
+  if (!buff) {
+    /* Pool exhausted, fall back to one copying transfer per channel. */
+    for (u8 i = 0; i < n_channels; i++) {
+      u16 sample_count;
+      corr_t corrs[3];
+      nap_track_corr_rd_blocking(channels[i], &sample_count, corrs);
+      cb(channels[i], sample_count, corrs, context);
+    }
+    return;
+  }
+
+  for (u8 i = 0; i < n_channels; i++)
+    reg_ids[i] = NAP_REG_TRACK_BASE + channels[i] * NAP_TRACK_N_REGS
+                 + NAP_REG_TRACK_CORR_OFFSET;
+
+  corr_pipeline_t p = {
+    .channels = channels,
+    .cb = cb,
+    .context = context
+  };
+  nap_xfer_pipelined_blocking(n_channels, reg_ids, NAP_TRACK_CORR_N_BYTES,
+                              buff, &corr_pipeline_cb, &p);
+
+  spi_dma_buff_free(buff);
+}
+
 /** Unpack data read from a NAP track channel's PHASE register.
  *
  * \param packed        Array of u8 data read from channnel's PHASE register.
@@ -173,22 +324,8 @@ void nap_track_corr_rd_blocking(u8 channel, u16* sample_count, corr_t corrs[])
 /* TODO : take code phase out of phase register, it's always zero */
 void nap_track_phase_unpack(u8 packed[], s32* carrier_phase, u64* code_phase)
 {
-  /* graphics.stanford.edu/~seander/bithacks.html#FixedSignExtend */
-
-  struct { s32 xtend : 24; } sign;
-
-  sign.xtend = packed[8] |
-               (packed[7] << 8) |
-               (packed[6] << 16);
-
-  *carrier_phase = sign.xtend; /* Sign extend! */
-
-  *code_phase = (u64)packed[5] |
-                ((u64)packed[4] << 8) |
-                ((u64)packed[3] << 16) |
-                ((u64)packed[2] << 24) |
-                ((u64)packed[1] << 32) |
-                ((u64)packed[0] << 40);
+  *carrier_phase = nap_field_get_s(packed, NAP_TRACK_PHASE_CARRIER_PHASE);
+  *code_phase = nap_field_get_u64(packed, NAP_TRACK_PHASE_CODE_PHASE);
 }
 
 /** Read data from a NAP track channel's PHASE register.
@@ -203,10 +340,11 @@ void nap_track_phase_unpack(u8 packed[], s32* carrier_phase, u64* code_phase)
 void nap_track_phase_rd_blocking(u8 channel, s32* carrier_phase,
                                  u64* code_phase)
 {
-  u8 temp[9] = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+  u8 temp[NAP_TRACK_PHASE_N_BYTES] = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
 
   nap_xfer_blocking(NAP_REG_TRACK_BASE + channel * NAP_TRACK_N_REGS
-                     + NAP_REG_TRACK_PHASE_OFFSET, 9, temp, temp);
+                     + NAP_REG_TRACK_PHASE_OFFSET, NAP_TRACK_PHASE_N_BYTES,
+                    temp, temp);
   nap_track_phase_unpack(temp, carrier_phase, code_phase);
 }
 
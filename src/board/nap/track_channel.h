@@ -18,6 +18,7 @@
 
 #include "../../main.h"
 #include "nap_common.h"
+#include "nap_regs.h"
 
 /** \addtogroup track_channel
  * \{ */
@@ -61,6 +62,10 @@ extern u8 nap_track_n_channels;
 #define NAP_TRACK_CODE_PHASE_UNITS_PER_CHIP       \
   ((u64)1 << NAP_TRACK_CODE_PHASE_FRACTIONAL_WIDTH)
 
+/** Callback for each channel read by nap_track_corr_rd_pipelined_blocking(). */
+typedef void (*nap_track_corr_cb_t)(u8 channel, u16 sample_count,
+                                    corr_t corrs[], void *context);
+
 /** \} */
 
 void nap_track_init_pack(u8 pack[], u8 prn, s32 carrier_phase, u16 code_phase);
@@ -69,8 +74,18 @@ void nap_track_init_wr_blocking(u8 channel, u8 prn, s32 carrier_phase,
 void nap_track_update_pack(u8 pack[], s32 carrier_freq, u32 code_phase_rate);
 void nap_track_update_wr_blocking(u8 channel, s32 carrier_freq,
                                   u32 code_phase_rate);
+void nap_track_update_wr_batch_blocking(u8 n_channels, const u8 channels[],
+                                        const s32 carrier_freq[],
+                                        const u32 code_phase_rate[]);
+void nap_track_update_wr_polled(u8 channel, s32 carrier_freq,
+                                u32 code_phase_rate);
 void nap_track_corr_unpack(u8 packed[], u16* sample_count, corr_t corrs[]);
+void nap_track_corr_pack(u8 packed[], u16 sample_count, const corr_t corrs[]);
 void nap_track_corr_rd_blocking(u8 channel, u16* sample_count, corr_t corrs[]);
+void nap_track_corr_rd_polled(u8 channel, u16* sample_count, corr_t corrs[]);
+void nap_track_corr_rd_pipelined_blocking(u8 n_channels, const u8 channels[],
+                                          nap_track_corr_cb_t cb,
+                                          void *context);
 void nap_track_phase_unpack(u8 packed[], s32* carrier_phase, u64* code_phase);
 void nap_track_phase_rd_blocking(u8 channel, s32* carrier_phase,
                                  u64* code_phase);
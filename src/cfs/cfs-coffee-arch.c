@@ -11,6 +11,9 @@
  */
 
 #include <stdio.h>
+#include <string.h>
+
+#include <ch.h>
 
 #include "cfs/cfs-coffee-arch.h"
 
@@ -23,27 +26,58 @@
  */
 
 /** Read from the Coffee filesystem area in STM flash.
+ * The aligned middle of the span is read a word at a time, with bytes at
+ * either edge read individually.
  * \param buf Pointer to a buffer where the read values will be stored.
  * \param size Number of bytes to read.
  * \param offset Offset into the filesystem area to read from.
  */
 void coffee_read(u8* buf, u32 size, u32 offset)
 {
-  for (u32 i=0; i<size; i++)
-    buf[i] = ~((u8*)(COFFEE_START+offset))[i];
+  u32 addr = COFFEE_START+offset;
+  u32 end = addr+size;
+
+  while (addr < end && (addr & 3))
+    *buf++ = ~*(u8*)addr++;
+
+  while (end - addr >= 4) {
+    u32 w = ~*(u32*)addr;
+    memcpy(buf, &w, 4);
+    buf += 4;
+    addr += 4;
+  }
+
+  while (addr < end)
+    *buf++ = ~*(u8*)addr++;
 }
 
 /** Write to the Coffee filesystem area in STM flash.
+ * The aligned middle of the span is programmed a word at a time (x32
+ * parallelism), with bytes at either edge programmed individually.
  * \param buf Pointer to a buffer containing the values to be written.
  * \param size Number of bytes to write.
  * \param offset Offset into the filesystem area to write to.
  */
 void coffee_write(u8* buf, u32 size, u32 offset)
 {
+  u32 addr = COFFEE_START+offset;
+  u32 end = addr+size;
+
   flash_unlock();
 
-  for (u32 i=0; i<size; i++)
-    flash_program_byte(COFFEE_START+offset+i, ~buf[i]);
+  while (addr < end && (addr & 3))
+    flash_program_byte(addr++, ~*buf++);
+
+  while (end - addr >= 4) {
+    u32 w;
+    memcpy(&w, buf, 4);
+    flash_program_word(addr, ~w);
+    buf += 4;
+    addr += 4;
+  }
+
+  while (addr < end)
+    flash_program_byte(addr++, ~*buf++);
 
   flash_lock();
 }
@@ -59,6 +93,21 @@ void coffee_erase(u8 sector)
   flash_lock();
 }
 
+/** Serialises access to the Coffee filesystem between threads. */
+static MUTEX_DECL(coffee_mutex);
+
+/** Take the Coffee filesystem lock, held across each public cfs_*() call. */
+void coffee_lock(void)
+{
+  chMtxLock(&coffee_mutex);
+}
+
+/** Release the Coffee filesystem lock. */
+void coffee_unlock(void)
+{
+  chMtxUnlock();
+}
+
 /** \} */
 
 /** \} */
@@ -48,6 +48,12 @@ void coffee_erase(u8 sector);
 #define COFFEE_READ(buf, size, offset)  coffee_read((u8*)buf, size, offset)
 #define COFFEE_ERASE(sector)            coffee_erase(sector)
 
+void coffee_lock(void);
+void coffee_unlock(void);
+
+#define COFFEE_LOCK()   coffee_lock()
+#define COFFEE_UNLOCK() coffee_unlock()
+
 typedef u16 coffee_page_t;
 
 int coffee_file_test(void);
@@ -92,6 +92,38 @@
 #define COFFEE_EXTENDED_WEAR_LEVELLING	1
 #endif
 
+/*
+ * Number of files kept in the RAM name index. The index maps file names
+ * to their start pages so that opening a file does not have to scan the
+ * flash. If there are more files than this, lookups of files missing from
+ * the index fall back to scanning.
+ */
+#ifndef COFFEE_NAME_INDEX_SIZE
+#define COFFEE_NAME_INDEX_SIZE	16
+#endif
+
+/*
+ * Contiguous free space, in bytes, that cfs_coffee_maintain() keeps ahead
+ * of the next allocation. While at least this much is free new files and
+ * log merges are placed without erasing anything. Sectors are left alone
+ * until the free space falls below it so that allocation keeps moving
+ * through the whole area, as COFFEE_EXTENDED_WEAR_LEVELLING intends.
+ */
+#ifndef COFFEE_GC_RESERVE
+#define COFFEE_GC_RESERVE	(64 * COFFEE_PAGE_SIZE)
+#endif
+
+/*
+ * Serialises the public cfs_*() calls, the file system is used from
+ * several threads (the persist thread's writes and idle garbage
+ * collection, the settings save, configuration reads). Each public call
+ * runs the unlocked implementation of the same name under the lock.
+ */
+#ifndef COFFEE_LOCK
+#define COFFEE_LOCK()
+#define COFFEE_UNLOCK()
+#endif
+
 #if COFFEE_START & (COFFEE_SECTOR_SIZE - 1)
 #error COFFEE_START must point to the first byte in a sector.
 #endif
@@ -114,6 +146,9 @@
 #define GC_GREEDY		0
 /* "Reluctant" garbage collection stops after erasing one sector. */
 #define GC_RELUCTANT		1
+/* "Incremental" garbage collection erases the first sector that greedy
+   collection would, and stops there. */
+#define GC_INCREMENTAL		2
 
 /* File descriptor macros. */
 #define FD_VALID(fd)					\
@@ -214,6 +249,15 @@ static struct protected_mem_t {
   coffee_page_t next_free;
   char gc_wait;
 } protected_mem;
+/* RAM index of file names to start pages, built on first use. */
+static struct name_index_entry {
+  char name[COFFEE_NAME_LENGTH];
+  coffee_page_t page;
+} name_index[COFFEE_NAME_INDEX_SIZE];
+static uint8_t name_index_count;
+static uint8_t name_index_built;
+/* Set if the index could not hold every file found. */
+static uint8_t name_index_overflow;
 static struct file * const coffee_files = protected_mem.coffee_files;
 static struct file_desc * const coffee_fd_set = protected_mem.coffee_fd_set;
 static coffee_page_t * const next_free = &protected_mem.next_free;
@@ -364,15 +408,17 @@ isolate_pages(coffee_page_t start, coffee_page_t skip_pages)
 
 }
 /*---------------------------------------------------------------------------*/
-static void
+static int
 collect_garbage(int mode)
 {
   uint16_t sector;
   struct sector_status stats;
   coffee_page_t first_page, isolation_count;
+  int erased = 0;
 
   PRINTF("Coffee: Running the file system garbage collector in %s mode\n",
-	 mode == GC_RELUCTANT ? "reluctant" : "greedy");
+	 mode == GC_RELUCTANT ? "reluctant" :
+	 mode == GC_INCREMENTAL ? "incremental" : "greedy");
   /*
    * The garbage collector erases as many sectors as possible. A sector is
    * erasable if there are only free or obsolete pages in it.
@@ -388,7 +434,7 @@ collect_garbage(int mode)
     }
 
     if((mode == GC_RELUCTANT && stats.free == 0) ||
-       (mode == GC_GREEDY && stats.obsolete > 0)) {
+       (mode != GC_RELUCTANT && stats.obsolete > 0)) {
       first_page = sector * COFFEE_PAGES_PER_SECTOR;
       if(first_page < *next_free) {
         *next_free = first_page;
@@ -400,12 +446,16 @@ collect_garbage(int mode)
 
       COFFEE_ERASE(sector);
       PRINTF("Coffee: Erased sector %d!\n", sector);
+      erased++;
 
-      if(mode == GC_RELUCTANT && isolation_count > 0) {
+      if((mode == GC_RELUCTANT && isolation_count > 0) ||
+         mode == GC_INCREMENTAL) {
         break;
       }
     }
   }
+
+  return erased;
 }
 /*---------------------------------------------------------------------------*/
 static coffee_page_t
@@ -471,6 +521,51 @@ load_file(coffee_page_t start, struct file_header *hdr)
   return file;
 }
 /*---------------------------------------------------------------------------*/
+static void
+name_index_add(const char *name, coffee_page_t page)
+{
+  if(name_index_count == COFFEE_NAME_INDEX_SIZE) {
+    name_index_overflow = 1;
+    return;
+  }
+  memset(name_index[name_index_count].name, 0, COFFEE_NAME_LENGTH);
+  strncpy(name_index[name_index_count].name, name, COFFEE_NAME_LENGTH - 1);
+  name_index[name_index_count].page = page;
+  name_index_count++;
+}
+/*---------------------------------------------------------------------------*/
+static void
+name_index_remove(coffee_page_t page)
+{
+  int i;
+
+  for(i = 0; i < name_index_count; i++) {
+    if(name_index[i].page == page) {
+      name_index[i] = name_index[--name_index_count];
+      return;
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void
+name_index_build(void)
+{
+  struct file_header hdr;
+  coffee_page_t page;
+
+  name_index_count = 0;
+  name_index_overflow = 0;
+  for(page = 0; page < COFFEE_PAGE_COUNT; page = next_file(page, &hdr)) {
+    read_header(&hdr, page);
+    if(HDR_ACTIVE(hdr) && !HDR_LOG(hdr)) {
+      name_index_add(hdr.name, page);
+    }
+  }
+  name_index_built = 1;
+  PRINTF("Coffee: Indexed %u files%s\n", (unsigned)name_index_count,
+         name_index_overflow ? ", index full" : "");
+}
+/*---------------------------------------------------------------------------*/
 static struct file *
 find_file(const char *name)
 {
@@ -490,6 +585,23 @@ find_file(const char *name)
     }
   }
   
+  /* Then look the start page up in the name index. */
+  if(!name_index_built) {
+    name_index_build();
+  }
+  for(i = 0; i < name_index_count; i++) {
+    if(strncmp(name, name_index[i].name, COFFEE_NAME_LENGTH) == 0) {
+      page = name_index[i].page;
+      read_header(&hdr, page);
+      if(HDR_ACTIVE(hdr) && !HDR_LOG(hdr) && strcmp(name, hdr.name) == 0) {
+        return load_file(page, &hdr);
+      }
+    }
+  }
+  if(!name_index_overflow) {
+    return NULL;
+  }
+
   /* Scan the flash memory sequentially otherwise. */
   for(page = 0; page < COFFEE_PAGE_COUNT; page = next_file(page, &hdr)) {
     read_header(&hdr, page);
@@ -572,6 +684,17 @@ find_contiguous_pages(coffee_page_t amount)
 }
 /*---------------------------------------------------------------------------*/
 static int
+have_contiguous_pages(coffee_page_t amount)
+{
+  /* find_contiguous_pages() moves next_free on as if the pages had been
+     allocated, put it back. */
+  coffee_page_t saved_next_free = *next_free;
+  coffee_page_t page = find_contiguous_pages(amount);
+  *next_free = saved_next_free;
+  return page != INVALID_PAGE;
+}
+/*---------------------------------------------------------------------------*/
+static int
 remove_by_page(coffee_page_t page, int remove_log, int close_fds,
                int gc_allowed __attribute__((unused)))
 {
@@ -591,6 +714,7 @@ remove_by_page(coffee_page_t page, int remove_log, int close_fds,
 
   hdr.flags |= HDR_FLAG_OBSOLETE;
   write_header(&hdr, page);
+  name_index_remove(page);
 
   *gc_wait = 0;
 
@@ -657,6 +781,9 @@ reserve(const char *name, coffee_page_t pages,
   hdr.max_pages = pages;
   hdr.flags = HDR_FLAG_ALLOCATED | flags;
   write_header(&hdr, page);
+  if(!(flags & HDR_FLAG_LOG)) {
+    name_index_add(hdr.name, page);
+  }
 
   PRINTF("Coffee: Reserved %u pages starting from %u for file %s\n",
       pages, page, name);
@@ -798,6 +925,10 @@ create_log(struct file *file, struct file_header *hdr)
 }
 #endif /* COFFEE_MICRO_LOGS */
 /*---------------------------------------------------------------------------*/
+static int cfs_open_unlocked(const char *name, int flags);
+static void cfs_close_unlocked(int fd);
+static int cfs_read_unlocked(int fd, void *buf, unsigned size);
+/*---------------------------------------------------------------------------*/
 static int
 merge_log(coffee_page_t file_page, int extend)
 {
@@ -810,7 +941,7 @@ merge_log(coffee_page_t file_page, int extend)
 
   read_header(&hdr, file_page);
 
-  fd = cfs_open(hdr.name, CFS_READ);
+  fd = cfs_open_unlocked(hdr.name, CFS_READ);
   if(fd < 0) {
     return -1;
   }
@@ -822,17 +953,17 @@ merge_log(coffee_page_t file_page, int extend)
   max_pages = hdr.max_pages << extend;
   new_file = reserve(hdr.name, max_pages, 1, 0);
   if(new_file == NULL) {
-    cfs_close(fd);
+    cfs_close_unlocked(fd);
     return -1;
   }
 
   offset = 0;
   do {
     char buf[hdr.log_record_size == 0 ? COFFEE_PAGE_SIZE : hdr.log_record_size];
-    n = cfs_read(fd, buf, sizeof(buf));
+    n = cfs_read_unlocked(fd, buf, sizeof(buf));
     if(n < 0) {
       remove_by_page(new_file->page, !REMOVE_LOG, !CLOSE_FDS, ALLOW_GC);
-      cfs_close(fd);
+      cfs_close_unlocked(fd);
       return -1;
     } else if(n > 0) {
       COFFEE_WRITE(buf, n, absolute_offset(new_file->page, offset));
@@ -850,7 +981,7 @@ merge_log(coffee_page_t file_page, int extend)
 
   if(remove_by_page(file_page, REMOVE_LOG, !CLOSE_FDS, !ALLOW_GC) < 0) {
     remove_by_page(new_file->page, !REMOVE_LOG, !CLOSE_FDS, !ALLOW_GC);
-    cfs_close(fd);
+    cfs_close_unlocked(fd);
     return -1;
   }
 
@@ -863,7 +994,7 @@ merge_log(coffee_page_t file_page, int extend)
   new_file->flags &= ~COFFEE_FILE_MODIFIED;
   new_file->end = offset;
 
-  cfs_close(fd);
+  cfs_close_unlocked(fd);
 
   return 0;
 }
@@ -994,8 +1125,8 @@ get_available_fd(void)
   return -1;
 }
 /*---------------------------------------------------------------------------*/
-int
-cfs_open(const char *name, int flags)
+static int
+cfs_open_unlocked(const char *name, int flags)
 {
   int fd;
   struct file_desc *fdp;
@@ -1030,8 +1161,8 @@ cfs_open(const char *name, int flags)
   return fd;
 }
 /*---------------------------------------------------------------------------*/
-void
-cfs_close(int fd)
+static void
+cfs_close_unlocked(int fd)
 {
   if(FD_VALID(fd)) {
     coffee_fd_set[fd].flags = COFFEE_FD_FREE;
@@ -1040,8 +1171,8 @@ cfs_close(int fd)
   }
 }
 /*---------------------------------------------------------------------------*/
-cfs_offset_t
-cfs_seek(int fd, cfs_offset_t offset, int whence)
+static cfs_offset_t
+cfs_seek_unlocked(int fd, cfs_offset_t offset, int whence)
 {
   struct file_desc *fdp;
   cfs_offset_t new_offset;
@@ -1072,8 +1203,8 @@ cfs_seek(int fd, cfs_offset_t offset, int whence)
   return fdp->offset = new_offset;
 }
 /*---------------------------------------------------------------------------*/
-int
-cfs_remove(const char *name)
+static int
+cfs_remove_unlocked(const char *name)
 {
   struct file *file;
 
@@ -1091,8 +1222,8 @@ cfs_remove(const char *name)
   return remove_by_page(file->page, REMOVE_LOG, CLOSE_FDS, ALLOW_GC);
 }
 /*---------------------------------------------------------------------------*/
-int
-cfs_read(int fd, void *buf, unsigned size)
+static int
+cfs_read_unlocked(int fd, void *buf, unsigned size)
 {
   struct file_desc *fdp;
   struct file *file;
@@ -1148,8 +1279,8 @@ cfs_read(int fd, void *buf, unsigned size)
   return size;
 }
 /*---------------------------------------------------------------------------*/
-int
-cfs_write(int fd, const void *buf, unsigned size)
+static int
+cfs_write_unlocked(int fd, const void *buf, unsigned size)
 {
   struct file_desc *fdp;
   struct file *file;
@@ -1254,8 +1385,8 @@ cfs_opendir(struct cfs_dir *dir, const char *name __attribute__((unused)))
   return 0;
 }
 /*---------------------------------------------------------------------------*/
-int
-cfs_readdir(struct cfs_dir *dir, struct cfs_dirent *record)
+static int
+cfs_readdir_unlocked(struct cfs_dir *dir, struct cfs_dirent *record)
 {
   struct file_header hdr;
   coffee_page_t page;
@@ -1286,14 +1417,23 @@ cfs_closedir(struct cfs_dir *dir __attribute__((unused)))
   return;
 }
 /*---------------------------------------------------------------------------*/
-int
-cfs_coffee_reserve(const char *name, cfs_offset_t size)
+static int
+cfs_coffee_reserve_unlocked(const char *name, cfs_offset_t size)
 {
   return reserve(name, page_count(size), 0, 0) == NULL ? -1 : 0;
 }
 /*---------------------------------------------------------------------------*/
-int
-cfs_coffee_configure_log(const char *filename, unsigned log_size,
+static int
+cfs_coffee_maintain_unlocked(void)
+{
+  if(have_contiguous_pages(page_count(COFFEE_GC_RESERVE))) {
+    return 0;
+  }
+  return collect_garbage(GC_INCREMENTAL);
+}
+/*---------------------------------------------------------------------------*/
+static int
+cfs_coffee_configure_log_unlocked(const char *filename, unsigned log_size,
 			 unsigned log_record_size)
 {
   struct file *file;
@@ -1323,8 +1463,8 @@ cfs_coffee_configure_log(const char *filename, unsigned log_size,
 }
 /*---------------------------------------------------------------------------*/
 #if COFFEE_IO_SEMANTICS
-int
-cfs_coffee_set_io_semantics(int fd, unsigned flags)
+static int
+cfs_coffee_set_io_semantics_unlocked(int fd, unsigned flags)
 {
   if(!FD_VALID(fd)) {
     return -1;
@@ -1336,8 +1476,8 @@ cfs_coffee_set_io_semantics(int fd, unsigned flags)
 }
 #endif
 /*---------------------------------------------------------------------------*/
-int
-cfs_coffee_format(void)
+static int
+cfs_coffee_format_unlocked(void)
 {
   unsigned i;
 
@@ -1352,12 +1492,136 @@ cfs_coffee_format(void)
 
   /* Formatting invalidates the file information. */
   memset(&protected_mem, 0, sizeof(protected_mem));
+  name_index_count = 0;
+  name_index_overflow = 0;
+  name_index_built = 1;
 
   PRINTF(" done!\n");
 
   return 0;
 }
 /*---------------------------------------------------------------------------*/
+int
+cfs_open(const char *name, int flags)
+{
+  int r;
+  COFFEE_LOCK();
+  r = cfs_open_unlocked(name, flags);
+  COFFEE_UNLOCK();
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+void
+cfs_close(int fd)
+{
+  COFFEE_LOCK();
+  cfs_close_unlocked(fd);
+  COFFEE_UNLOCK();
+}
+/*---------------------------------------------------------------------------*/
+cfs_offset_t
+cfs_seek(int fd, cfs_offset_t offset, int whence)
+{
+  cfs_offset_t r;
+  COFFEE_LOCK();
+  r = cfs_seek_unlocked(fd, offset, whence);
+  COFFEE_UNLOCK();
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_remove(const char *name)
+{
+  int r;
+  COFFEE_LOCK();
+  r = cfs_remove_unlocked(name);
+  COFFEE_UNLOCK();
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_read(int fd, void *buf, unsigned size)
+{
+  int r;
+  COFFEE_LOCK();
+  r = cfs_read_unlocked(fd, buf, size);
+  COFFEE_UNLOCK();
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_write(int fd, const void *buf, unsigned size)
+{
+  int r;
+  COFFEE_LOCK();
+  r = cfs_write_unlocked(fd, buf, size);
+  COFFEE_UNLOCK();
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_readdir(struct cfs_dir *dir, struct cfs_dirent *record)
+{
+  int r;
+  COFFEE_LOCK();
+  r = cfs_readdir_unlocked(dir, record);
+  COFFEE_UNLOCK();
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_reserve(const char *name, cfs_offset_t size)
+{
+  int r;
+  COFFEE_LOCK();
+  r = cfs_coffee_reserve_unlocked(name, size);
+  COFFEE_UNLOCK();
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_maintain(void)
+{
+  int r;
+  COFFEE_LOCK();
+  r = cfs_coffee_maintain_unlocked();
+  COFFEE_UNLOCK();
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_configure_log(const char *filename, unsigned log_size,
+			 unsigned log_record_size)
+{
+  int r;
+  COFFEE_LOCK();
+  r = cfs_coffee_configure_log_unlocked(filename, log_size, log_record_size);
+  COFFEE_UNLOCK();
+  return r;
+}
+/*---------------------------------------------------------------------------*/
+#if COFFEE_IO_SEMANTICS
+int
+cfs_coffee_set_io_semantics(int fd, unsigned flags)
+{
+  int r;
+  COFFEE_LOCK();
+  r = cfs_coffee_set_io_semantics_unlocked(fd, flags);
+  COFFEE_UNLOCK();
+  return r;
+}
+#endif
+/*---------------------------------------------------------------------------*/
+int
+cfs_coffee_format(void)
+{
+  int r;
+  COFFEE_LOCK();
+  r = cfs_coffee_format_unlocked();
+  COFFEE_UNLOCK();
+  return r;
+}
+/*---------------------------------------------------------------------------*/
 void *
 cfs_coffee_get_protected_mem(unsigned *size)
 {
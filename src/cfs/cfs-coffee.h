@@ -86,6 +86,20 @@
  */
 int cfs_coffee_reserve(const char *name, cfs_offset_t size);
 
+/**
+ * \brief Reclaim space ahead of demand.
+ * \return 1 if a sector was erased, 0 otherwise.
+ *
+ * Coffee normally erases sectors only once an allocation finds no free
+ * space, so the write that runs out pays for the erase. This erases at
+ * most one sector of obsolete pages if the contiguous free space has
+ * fallen below COFFEE_GC_RESERVE, and does nothing otherwise. Call it
+ * repeatedly when the file system is idle so that later writes find the
+ * space already erased. Allocation still collects garbage itself as a
+ * last resort.
+ */
+int cfs_coffee_maintain(void);
+
 /**
  * \brief Configure the on-demand log file.
  * \param file The filename.
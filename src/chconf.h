@@ -548,8 +548,16 @@ extern u64 g_ctime;
 /* Change vector table location for compatibility with the bootloader. */
 #define CORTEX_VTOR_INIT 0x08004000
 
+/* Data placement, see the memory map in STM32F405xG.ld. */
+/** CPU-only, in CCM. Not zeroed at boot. */
 #define _CCM __attribute__((section (".ccmram")))
 #define WORKING_AREA_CCM(s, n) WORKING_AREA(s, n) _CCM
+/** ISR-hot and CPU-only, in CCM. Zeroed at boot. */
+#define _HOT __attribute__((section (".ccmram.hot")))
+/** Reachable by DMA, in SRAM2. Zeroed at boot. */
+#define _DMA __attribute__((section (".dmaram")))
+/** Rarely touched, in SRAM1. Zeroed at boot. */
+#define _COLD __attribute__((section (".bss.cold")))
 
 #endif  /* _CHCONF_H_ */
 
@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <string.h>
+
+#include <ch.h>
+
+#include "board/nap/nap_exti.h"
+#include "corr_trace.h"
+#include "sbp.h"
+#include "settings.h"
+#include "track.h"
+
+/** \defgroup corr_trace Correlation trace
+ * Raw capture of the tracking loop inputs for replay off target.
+ * Every correlation read from the channels in the `corr_trace` /
+ * `channel_mask` setting is recorded, with the tracking channel inits and
+ * disables and the NAP timing count of each set of measurements, so that
+ * tests/replay can run the same tracking and measurement code over them on
+ * a host. Records are appended to a byte ring by whichever thread produces
+ * them and sent over the FTDI USART in MSG_CORR_TRACE messages by a low
+ * priority thread, if the ring fills records are dropped and counted in a
+ * CORR_TRACE_DROP record rather than holding up tracking.
+ *
+ * Each CORR_TRACE_CORR is 22 bytes, one channel at 1 kHz needs 22 kB/s so
+ * the FTDI USART at its default baud rate can carry about four channels.
+ * \{ */
+
+#define CORR_TRACE_THREAD_PRIORITY (NORMALPRIO-2)
+#define CORR_TRACE_THREAD_STACK    1024
+
+/** Channels being traced, bit n is channel n, 0 when not tracing. */
+static u32 corr_trace_mask = 0;
+
+static u8 corr_trace_buff[CORR_TRACE_BUFF_LEN] _CCM;
+/** Index of the next byte to write, only advanced with the kernel locked. */
+static volatile u32 corr_trace_head = 0;
+/** Index of the next byte to send, only advanced by the trace thread. */
+static volatile u32 corr_trace_tail = 0;
+/** Records lost since the last CORR_TRACE_DROP. */
+static u32 corr_trace_dropped = 0;
+
+/** Copy bytes into the ring at an index, wrapping at the end. */
+static void ring_write(u32 index, const u8 data[], u32 len)
+{
+  u32 i = index & (CORR_TRACE_BUFF_LEN - 1);
+  u32 n = MIN(len, CORR_TRACE_BUFF_LEN - i);
+  memcpy(&corr_trace_buff[i], data, n);
+  memcpy(corr_trace_buff, &data[n], len - n);
+}
+
+/** Copy bytes out of the ring from an index, wrapping at the end. */
+static void ring_read(u32 index, u8 data[], u32 len)
+{
+  u32 i = index & (CORR_TRACE_BUFF_LEN - 1);
+  u32 n = MIN(len, CORR_TRACE_BUFF_LEN - i);
+  memcpy(data, &corr_trace_buff[i], n);
+  memcpy(&data[n], corr_trace_buff, len - n);
+}
+
+/** Append a record to the ring, or count it as dropped if there isn't room
+ * for it and any pending CORR_TRACE_DROP. Call with the kernel locked. */
+static void corr_trace_push_locked(const u8 record[], u8 len)
+{
+  u32 n_free = CORR_TRACE_BUFF_LEN - (corr_trace_head - corr_trace_tail);
+  if (corr_trace_dropped) {
+    if (n_free < 3u + len) {
+      corr_trace_dropped++;
+      return;
+    }
+    u16 dropped = MIN(corr_trace_dropped, 0xFFFF);
+    u8 drop[3] = {CORR_TRACE_DROP, dropped & 0xFF, dropped >> 8};
+    ring_write(corr_trace_head, drop, sizeof(drop));
+    corr_trace_head += sizeof(drop);
+    corr_trace_dropped = 0;
+  } else if (n_free < len) {
+    corr_trace_dropped++;
+    return;
+  }
+  ring_write(corr_trace_head, record, len);
+  corr_trace_head += len;
+}
+
+/** Append a record to the ring from a thread. */
+static void corr_trace_push(const u8 record[], u8 len)
+{
+  chSysLock();
+  corr_trace_push_locked(record, len);
+  chSysUnlock();
+}
+
+/** Record the correlations read from a tracking channel.
+ * Called from the NAP ISR thread before the loop filters run.
+ * \param channel      Tracking channel the correlations were read from.
+ * \param sample_count Number of samples in the correlation period.
+ * \param corrs        E, P, L correlations.
+ */
+void corr_trace_corr(u8 channel, u16 sample_count, const corr_t corrs[])
+{
+  if (!(corr_trace_mask & (1 << channel)))
+    return;
+
+  u8 record[2 + NAP_TRACK_CORR_N_BYTES];
+  record[0] = CORR_TRACE_CORR;
+  record[1] = channel;
+  nap_track_corr_pack(&record[2], sample_count, corrs);
+#if NAP_TRACK_IN_ISR
+  /* Correlations are usually read in the NAP ISR, but the NAP thread still
+   * services the channels when the ISR can't get the bus. */
+  u32 ipsr;
+  __asm__ __volatile__("mrs %0, ipsr" : "=r"(ipsr));
+  if (ipsr) {
+    chSysLockFromIsr();
+    corr_trace_push_locked(record, sizeof(record));
+    chSysUnlockFromIsr();
+    return;
+  }
+#endif
+  corr_trace_push(record, sizeof(record));
+}
+
+/** Record the start of tracking on a channel.
+ * Takes the arguments of tracking_channel_init(). */
+void corr_trace_init(u8 channel, u8 prn, float carrier_freq,
+                     u32 start_sample_count)
+{
+  if (!(corr_trace_mask & (1 << channel)))
+    return;
+
+  u8 record[11];
+  record[0] = CORR_TRACE_INIT;
+  record[1] = channel;
+  record[2] = prn;
+  memcpy(&record[3], &carrier_freq, 4);
+  memcpy(&record[7], &start_sample_count, 4);
+  corr_trace_push(record, sizeof(record));
+}
+
+/** Record a tracking channel being disabled. */
+void corr_trace_disable(u8 channel)
+{
+  if (!(corr_trace_mask & (1 << channel)))
+    return;
+
+  u8 record[2] = {CORR_TRACE_DISABLE, channel};
+  corr_trace_push(record, sizeof(record));
+}
+
+/** Record the NAP timing count a set of measurements was taken at.
+ * Called from the solution thread once it has read the tracking channels,
+ * so the record follows all the correlations the measurements include. */
+void corr_trace_epoch(u64 tc)
+{
+  if (!corr_trace_mask)
+    return;
+
+  u8 record[9];
+  record[0] = CORR_TRACE_EPOCH;
+  memcpy(&record[1], &tc, 8);
+  corr_trace_push(record, sizeof(record));
+}
+
+/** Send as many whole records as fit in MSG_CORR_TRACE messages.
+ * \return false if a message couldn't be queued, try again later.
+ */
+static bool corr_trace_send(void)
+{
+  static u16 seq = 0;
+  u8 msg[255];
+
+  while (corr_trace_tail != corr_trace_head) {
+    u32 head = corr_trace_head;
+    u32 tail = corr_trace_tail;
+    u8 len = 2;
+
+    memcpy(msg, &seq, 2);
+    while (tail != head) {
+      u8 type;
+      ring_read(tail, &type, 1);
+      u8 n = corr_trace_record_len(type);
+      if (len + n > sizeof(msg))
+        break;
+      ring_read(tail, &msg[len], n);
+      len += n;
+      tail += n;
+    }
+
+    if (sbp_send_msg(MSG_CORR_TRACE, len, msg))
+      /* Leave the records in the ring, they are resent next time. */
+      return false;
+
+    corr_trace_tail = tail;
+    seq++;
+  }
+  return true;
+}
+
+static WORKING_AREA_CCM(wa_corr_trace_thread, CORR_TRACE_THREAD_STACK);
+static msg_t corr_trace_thread(void *arg)
+{
+  (void)arg;
+  chRegSetThreadName("corr trace");
+
+  while (TRUE) {
+    chThdSleepMilliseconds(CORR_TRACE_PERIOD_MS);
+    corr_trace_send();
+  }
+
+  return 0;
+}
+
+/** Start tracing once the setting has changed, the configuration the
+ * tracking loops are running with goes first in the trace. */
+static bool channel_mask_notify(struct setting *s, const char *val)
+{
+  u32 old_mask = corr_trace_mask;
+  if (!s->type->from_string(s->type->priv, s->addr, s->len, val))
+    return false;
+
+  if (corr_trace_mask && corr_trace_mask != old_mask) {
+    u8 record[7];
+    u32 mask = corr_trace_mask;
+    record[0] = CORR_TRACE_CONFIG;
+    record[1] = TRACK_LOOP_FILTER;
+    record[2] = tracking_int_ms();
+    memcpy(&record[3], &mask, 4);
+    corr_trace_push(record, sizeof(record));
+  }
+  return true;
+}
+
+/** Register the trace setting and start the thread that sends the trace. */
+void corr_trace_setup(void)
+{
+  SETTING_NOTIFY("corr_trace", "channel_mask", corr_trace_mask, TYPE_INT,
+                 channel_mask_notify);
+
+  chThdCreateStatic(wa_corr_trace_thread, sizeof(wa_corr_trace_thread),
+                    CORR_TRACE_THREAD_PRIORITY, corr_trace_thread, NULL);
+}
+
+/** \} */
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef SWIFTNAV_CORR_TRACE_H
+#define SWIFTNAV_CORR_TRACE_H
+
+#include <libswiftnav/common.h>
+#include <libswiftnav/track.h>
+
+#include "board/nap/track_channel.h"
+
+/** \addtogroup corr_trace
+ * \{ */
+
+/* Record types. Each record in a MSG_CORR_TRACE payload is its type byte
+ * followed by the fields listed, little endian and unaligned. */
+/** u8 channel, NAP CORR register contents as read, see
+ * nap_track_corr_unpack(). */
+#define CORR_TRACE_CORR    0x01
+/** u8 channel, u8 prn, float carrier_freq, u32 start_sample_count, the
+ * arguments of tracking_channel_init(). */
+#define CORR_TRACE_INIT    0x02
+/** u8 channel, tracking_channel_disable() was called. */
+#define CORR_TRACE_DISABLE 0x03
+/** u64 NAP timing count a set of measurements was taken at. */
+#define CORR_TRACE_EPOCH   0x04
+/** u16 number of records lost because the trace buffer was full. */
+#define CORR_TRACE_DROP    0x05
+/** u8 tracking loop filter, see TRACK_LOOP_FILTER, u8 track int_ms setting
+ * and u32 channel mask, sent when tracing starts. */
+#define CORR_TRACE_CONFIG  0x06
+
+/** Longest record, a CORR_TRACE_CORR. */
+#define CORR_TRACE_RECORD_MAX_LEN (2 + NAP_TRACK_CORR_N_BYTES)
+
+/** Bytes of records buffered for sending, a power of two. Enough for 20 ms
+ * of correlations from every channel. */
+#define CORR_TRACE_BUFF_LEN 8192
+
+/** How often the buffered records are sent. (ms) */
+#define CORR_TRACE_PERIOD_MS 5
+
+/** Length of a record including its type byte.
+ * \param type Record type, see CORR_TRACE_CORR etc.
+ * \return Record length, 0 if the type is unknown.
+ */
+static inline u8 corr_trace_record_len(u8 type)
+{
+  switch (type) {
+  case CORR_TRACE_CORR:    return 2 + NAP_TRACK_CORR_N_BYTES;
+  case CORR_TRACE_INIT:    return 1 + 1 + 1 + 4 + 4;
+  case CORR_TRACE_DISABLE: return 1 + 1;
+  case CORR_TRACE_EPOCH:   return 1 + 8;
+  case CORR_TRACE_DROP:    return 1 + 2;
+  case CORR_TRACE_CONFIG:  return 1 + 1 + 1 + 4;
+  default:                 return 0;
+  }
+}
+
+/* Capture files (see scripts/corr_trace_capture.py) are the MSG_CORR_TRACE
+ * payloads in the order received, each preceded by a u8 payload length. */
+
+/** \} */
+
+void corr_trace_corr(u8 channel, u16 sample_count, const corr_t corrs[]);
+void corr_trace_init(u8 channel, u8 prn, float carrier_freq,
+                     u32 start_sample_count);
+void corr_trace_disable(u8 channel);
+void corr_trace_epoch(u64 tc);
+void corr_trace_setup(void);
+
+#endif  /* SWIFTNAV_CORR_TRACE_H */
@@ -12,21 +12,182 @@
 
 #include <math.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ch.h>
 #include <libswiftnav/sbp.h>
 
 #include "board/nap/cw_channel.h"
 #include "sbp.h"
+#include "settings.h"
+#include "acq.h"
 #include "cw.h"
+#include "system_monitor.h"
 
 /** \defgroup cw CW Interference
  * Search for CW interference in raw IF sample data.
  * Searches for CW interference by scheduling CW channel correlations on
- * the SwiftNAP and (TODO) doing peak detection. These peaked can then be
+ * the SwiftNAP and doing peak detection. These peaked can then be
  * filtered out using the IIR filter onboard the SwiftNAP.
+ *
+ * A background monitor periodically sweeps the Doppler search range and
+ * masks the frequencies of any narrowband interferers it finds out of the
+ * acquisition searches.
  * \{ */
 
+#define CW_THREAD_PRIORITY (LOWPRIO+5)
+#define CW_THREAD_STACK    512
+
 cw_state_t cw_state;
 
+/** Signalled by cw_service_irq() when there are results to send, or by
+ * cw_service_load_done() and cw_service_irq() as a monitor sweep progresses. */
+static BSEMAPHORE_DECL(cw_spectrum_sem, TRUE);
+
+/** Seconds between background interference sweeps, 0 disables them. */
+static u16 cw_monitor_period = 10;
+/** Power over the sweep median at which a point is taken as interference. */
+static float cw_monitor_threshold = 10.0;
+static systime_t cw_monitor_last;
+
+/** Send any results of the current search that are ready.
+ * Full blocks of CW_SPECTRUM_BINS_PER_MSG points are sent as the search
+ * progresses and whatever is left over once it has finished.
+ */
+static void cw_send_spectrum(void)
+{
+  static msg_cw_spectrum_t msg;
+
+  while (TRUE) {
+    chSysLock();
+    u16 count = MIN(cw_state.count, SPECTRUM_LEN);
+    bool done = cw_state.state == CW_RUNNING_DONE;
+    chSysUnlock();
+
+    if (count <= cw_state.sent)
+      return;
+    u16 n = MIN(count - cw_state.sent, CW_SPECTRUM_BINS_PER_MSG);
+    if (n < CW_SPECTRUM_BINS_PER_MSG && !done)
+      return;
+
+    msg.freq_step = cw_state.freq_step / NAP_CW_FREQ_UNITS_PER_HZ;
+    msg.freq_start = (cw_state.freq_min + cw_state.sent * cw_state.freq_step)
+                     / NAP_CW_FREQ_UNITS_PER_HZ;
+    msg.index = cw_state.sent;
+    msg.n = n;
+    memcpy(msg.power, &cw_state.spectrum_power[cw_state.sent],
+           n * sizeof(msg.power[0]));
+
+    sbp_send_msg(MSG_CW_SPECTRUM,
+                 offsetof(msg_cw_spectrum_t, power) + n * sizeof(msg.power[0]),
+                 (u8 *)&msg);
+    cw_state.sent += n;
+  }
+}
+
+static int cw_power_cmp(const void *a, const void *b)
+{
+  u64 pa = *(const u64 *)a, pb = *(const u64 *)b;
+  return (pa > pb) - (pa < pb);
+}
+
+/** Find the interferers in a finished monitor sweep and update the
+ * acquisition carrier frequency mask.
+ * Points with power over `cw.monitor_threshold` times the median of the
+ * sweep are masked, together with CW_MONITOR_GUARD either side. If there are
+ * more interferers than mask ranges the interference isn't narrowband and
+ * nothing is masked.
+ */
+static void cw_monitor_update(void)
+{
+  static u64 sorted[SPECTRUM_LEN];
+  static acq_cf_mask_t mask[ACQ_CF_MASK_MAX];
+  static u8 n_mask_prev = 0;
+
+  u16 n = MIN(cw_state.count, SPECTRUM_LEN);
+  if (n == 0)
+    return;
+
+  memcpy(sorted, cw_state.spectrum_power, n * sizeof(sorted[0]));
+  qsort(sorted, n, sizeof(sorted[0]), cw_power_cmp);
+  float threshold = cw_monitor_threshold * (float)sorted[n/2];
+
+  u8 n_mask = 0;
+  for (u16 i=0; i<n && threshold > 0; i++) {
+    if ((float)cw_state.spectrum_power[i] < threshold)
+      continue;
+    float f = (float)(cw_state.freq_min + i*cw_state.freq_step)
+              / NAP_CW_FREQ_UNITS_PER_HZ;
+    if (n_mask > 0 && f - CW_MONITOR_GUARD <= mask[n_mask-1].cf_max) {
+      /* Overlaps the previous range, extend it. */
+      mask[n_mask-1].cf_max = f + CW_MONITOR_GUARD;
+      continue;
+    }
+    if (n_mask == ACQ_CF_MASK_MAX) {
+      n_mask = 0;
+      break;
+    }
+    mask[n_mask].cf_min = f - CW_MONITOR_GUARD;
+    mask[n_mask].cf_max = f + CW_MONITOR_GUARD;
+    n_mask++;
+  }
+
+  acq_set_cf_mask(n_mask, mask);
+  if (n_mask != n_mask_prev) {
+    printf("CW: %d interferer(s) masked from acquisition\n", n_mask);
+    for (u8 i=0; i<n_mask; i++)
+      printf("CW:   %+.0f to %+.0f Hz\n", mask[i].cf_min, mask[i].cf_max);
+    n_mask_prev = n_mask;
+  }
+}
+
+/** Share the next timing strobe with a background interference sweep.
+ * Called just before acq_schedule_load(), if a monitor sweep is due and the
+ * CW channel is idle its load is enabled too so the same strobe fills both
+ * sample rams. The sweep then runs on the CW channel alongside the
+ * acquisition searches without needing a strobe of its own.
+ */
+void cw_monitor_arm(void)
+{
+  if (cw_monitor_period == 0 ||
+      system_load_level() >= LOAD_LEVEL_MONITORS)
+    return;
+  if (cw_state.state != CW_DISABLED && cw_state.state != CW_RUNNING_DONE)
+    return;
+  if (chTimeNow() - cw_monitor_last < S2ST(cw_monitor_period))
+    return;
+
+  cw_monitor_last = chTimeNow();
+  cw_state.monitor = true;
+  cw_state.state = CW_LOADING;
+  nap_cw_load_wr_enable_blocking();
+}
+
+static WORKING_AREA_CCM(wa_cw_thread, CW_THREAD_STACK);
+static msg_t cw_thread(void *arg)
+{
+  (void)arg;
+  chRegSetThreadName("CW");
+
+  while (TRUE) {
+    chBSemWait(&cw_spectrum_sem);
+    if (!cw_state.monitor) {
+      cw_send_spectrum();
+    } else if (cw_state.state == CW_LOADING_DONE) {
+      cw_start(CW_MONITOR_FREQ_MIN, CW_MONITOR_FREQ_MAX, CW_MONITOR_FREQ_STEP);
+    } else if (cw_state.state == CW_RUNNING_DONE) {
+      cw_monitor_update();
+      /* Monitor sweeps aren't sent to the host. */
+      cw_state.sent = cw_state.count;
+      cw_state.monitor = false;
+    }
+  }
+
+  return 0;
+}
+
 /** Callback to start a set of CW searches.
  * Allows host to directly control CW channel searches.
  */
@@ -35,14 +196,21 @@ void cw_start_callback(u16 sender_id, u8 len, u8 msg[], void* context)
   (void)sender_id; (void)len; (void) context;
 
   cw_start_msg_t* start_msg = (cw_start_msg_t*)msg;
+  cw_state.monitor = false;
   cw_start(start_msg->freq_min, start_msg->freq_max, start_msg->freq_step);
 }
 
-/** Register CW callbacks. */
+/** Register CW callbacks and settings and start the CW thread. */
 void cw_setup()
 {
+  SETTING("cw", "monitor_period", cw_monitor_period, TYPE_INT);
+  SETTING("cw", "monitor_threshold", cw_monitor_threshold, TYPE_FLOAT);
+
   static sbp_msg_callbacks_node_t cw_start_callback_node;
   sbp_register_cbk(MSG_CW_START, &cw_start_callback, &cw_start_callback_node);
+
+  chThdCreateStatic(wa_cw_thread, sizeof(wa_cw_thread),
+                    CW_THREAD_PRIORITY, cw_thread, NULL);
 }
 
 /** Schedule a load of samples into the CW channel's sample ram.
@@ -69,6 +237,10 @@ void cw_service_load_done()
 {
   nap_cw_load_wr_disable_blocking();
   cw_state.state = CW_LOADING_DONE;
+
+  /* Have the CW thread start the monitor sweep on the new samples. */
+  if (cw_state.monitor)
+    chBSemSignal(&cw_spectrum_sem);
 }
 
 /** Query the state of the CW channel sample ram loading.
@@ -107,6 +279,7 @@ void cw_start(float freq_min, float freq_max, float freq_bin_width)
   /* Initialise our cw state struct. */
   cw_state.state = CW_RUNNING;
   cw_state.count = 0;
+  cw_state.sent = 0;
   cw_state.freq = cw_state.freq_min;
 
   /* Write first and second sets of detection parameters (for pipelining). */
@@ -141,10 +314,8 @@ void cw_service_irq()
 
       power = (u64)cs.I*(u64)cs.I + (u64)cs.Q*(u64)cs.Q;
 
-      if (cw_state.count < SPECTRUM_LEN) {
+      if (cw_state.count < SPECTRUM_LEN)
         cw_state.spectrum_power[cw_state.count] = power;
-        cw_send_result(cw_state.freq, power);
-      }
       cw_state.count++;
 
       /*
@@ -165,28 +336,16 @@ void cw_service_irq()
         nap_cw_init_wr_params_blocking(cw_state.freq + cw_state.freq_step);
 			}
 
+      /* Leave sending the results to the lower priority CW thread. */
+      if (cw_state.state == CW_RUNNING_DONE ||
+          (!cw_state.monitor &&
+           cw_state.count % CW_SPECTRUM_BINS_PER_MSG == 0))
+        chBSemSignal(&cw_spectrum_sem);
+
       break;
   }
 }
 
-/** Send results of a CW search point back to the host via the SBP interface.
- *
- * \param freq  Frequency of the CW correlation
- * \param power Magnitude of the CW correlation
- */
-void cw_send_result(float freq, u64 power)
-{
-  struct {
-    float freq;
-    u64 power;
-  } msg;
-
-  msg.freq = freq;
-  msg.power = power;
-
-  sbp_send_msg(MSG_CW_RESULTS, sizeof(msg), (u8*)&msg);
-}
-
 /** Get a point from the CW correlations array
  *
  * \param freq  Pointer to float where frequency correlation index will be put
@@ -20,6 +20,17 @@
 
 #define SPECTRUM_LEN 301
 
+/** Number of spectrum points sent in each MSG_CW_SPECTRUM message. */
+#define CW_SPECTRUM_BINS_PER_MSG 30
+
+/** Frequency range and step of the background interference sweeps. (Hz) */
+#define CW_MONITOR_FREQ_MIN  -10000
+#define CW_MONITOR_FREQ_MAX   10000
+#define CW_MONITOR_FREQ_STEP  100
+/** Width either side of a detected interferer masked from acquisition, (Hz).
+ * Covers the main lobe of the despread tone out to the first null. */
+#define CW_MONITOR_GUARD      1000
+
 /** Status of SwiftNAP CW channel. */
 typedef enum {
   CW_DISABLED = 0,
@@ -37,9 +48,20 @@ typedef struct {
   s32 freq_max;      /**< Highest interference freq to search. */
   s32 freq;          /**< Interference freq of next correlation to be read. */
 	u16 count;         /**< Total number of interference freq points searched. */
+  u16 sent;          /**< Number of points sent to the host so far. */
+  bool monitor;      /**< Search was started by the background monitor. */
 	u64 spectrum_power[SPECTRUM_LEN]; /**< Array of power. */
 } cw_state_t;
 
+/** A block of consecutive points of a CW search, sent to the host. */
+typedef struct __attribute__((packed)) {
+  float freq_start; /**< Frequency of the first point in the block. (Hz) */
+  float freq_step;  /**< Step size between points. (Hz) */
+  u16 index;        /**< Index of the first point in the search. */
+  u8 n;             /**< Number of points in the block. */
+  u64 power[CW_SPECTRUM_BINS_PER_MSG]; /**< Correlation power of each point. */
+} msg_cw_spectrum_t;
+
 /** Struct sent by host to cw_start_callback to start a CW search. */
 typedef struct {
   float freq_min;  /**< Lowest interference freq to search. */
@@ -49,15 +71,28 @@ typedef struct {
 
 /** \} */
 
+/** Build the CW interference monitor in, see the build profiles in
+ * src/Makefile. Without it the calls made from elsewhere do nothing. */
+#ifndef BUILD_CW
+#define BUILD_CW 1
+#endif
+
 void cw_schedule_load(u32 count);
-void cw_service_load_done(void);
 u8 cw_get_load_done(void);
 u8 cw_get_running_done(void);
+void cw_start(float freq_min, float freq_max, float freq_bin_width);
+void cw_get_spectrum_point(float* freq, u64* power, u16 index);
 
+#if BUILD_CW
 void cw_setup(void);
-void cw_start(float freq_min, float freq_max, float freq_bin_width);
+void cw_monitor_arm(void);
 void cw_service_irq(void);
-void cw_send_result(float freq, u64 power);
-void cw_get_spectrum_point(float* freq, u64* power, u16 index);
+void cw_service_load_done(void);
+#else
+static inline void cw_setup(void) {}
+static inline void cw_monitor_arm(void) {}
+static inline void cw_service_irq(void) {}
+static inline void cw_service_load_done(void) {}
+#endif
 
 #endif
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <string.h>
+
+#include <ch.h>
+
+#include "debug_var.h"
+#include "sbp.h"
+#include "sbp_piksi.h"
+#include "settings.h"
+
+/** \defgroup debug_var Debug variables
+ * Batched telemetry of internal variables.
+ * Variables are registered once against an ID, after which
+ * debug_var_set() just stores the latest value. A low priority thread sends
+ * every variable updated since the last batch in a single MSG_DEBUG_VARS,
+ * so instrumenting a loop costs a store rather than a message per sample.
+ * \{ */
+
+#define DEBUG_VAR_THREAD_PRIORITY (LOWPRIO+3)
+#define DEBUG_VAR_THREAD_STACK    1024
+
+/** Entries that fit in one MSG_DEBUG_VARS. */
+#define DEBUG_VAR_PER_MSG (255 / sizeof(msg_debug_vars_entry_t))
+
+/** Milliseconds between batches. */
+static u32 debug_var_period_ms = 100;
+
+static debug_var_t debug_vars[DEBUG_VAR_MAX];
+
+/** Register a debug variable.
+ *
+ * \param id   ID to send the variable under, less than DEBUG_VAR_MAX.
+ * \param name Name reported to the host, must stay valid.
+ */
+void debug_var_register(u8 id, const char *name)
+{
+  if (id >= DEBUG_VAR_MAX)
+    return;
+  chSysLock();
+  debug_vars[id].name = name;
+  debug_vars[id].updated = false;
+  chSysUnlock();
+}
+
+/** Update the value of a debug variable, sent with the next batch.
+ * Must be called from thread context.
+ *
+ * \param id ID the variable was registered with.
+ * \param x  New value.
+ */
+void debug_var_set(u8 id, double x)
+{
+  if (id >= DEBUG_VAR_MAX)
+    return;
+  chSysLock();
+  debug_vars[id].value = x;
+  debug_vars[id].updated = true;
+  chSysUnlock();
+}
+
+static void debug_var_send_names(void)
+{
+  u8 buff[255];
+  msg_debug_var_name_t *msg = (msg_debug_var_name_t *)buff;
+
+  for (u8 i=0; i<DEBUG_VAR_MAX; i++) {
+    if (debug_vars[i].name == NULL)
+      continue;
+    u8 len = MIN(strlen(debug_vars[i].name), sizeof(buff) - sizeof(*msg));
+    msg->id = i;
+    memcpy(msg->name, debug_vars[i].name, len);
+    sbp_send_msg(MSG_DEBUG_VAR_NAME, sizeof(*msg) + len, buff);
+  }
+}
+
+static void debug_var_send_batch(void)
+{
+  msg_debug_vars_entry_t msg[DEBUG_VAR_PER_MSG];
+  u8 n = 0;
+
+  for (u8 i=0; i<DEBUG_VAR_MAX; i++) {
+    chSysLock();
+    bool updated = debug_vars[i].updated && debug_vars[i].name;
+    msg[n].value = debug_vars[i].value;
+    debug_vars[i].updated = false;
+    chSysUnlock();
+
+    if (!updated)
+      continue;
+    msg[n++].id = i;
+    if (n == DEBUG_VAR_PER_MSG) {
+      sbp_send_msg(MSG_DEBUG_VARS, n * sizeof(msg[0]), (u8 *)msg);
+      n = 0;
+    }
+  }
+
+  if (n > 0)
+    sbp_send_msg(MSG_DEBUG_VARS, n * sizeof(msg[0]), (u8 *)msg);
+}
+
+static WORKING_AREA_CCM(wa_debug_var_thread, DEBUG_VAR_THREAD_STACK);
+static msg_t debug_var_thread(void *arg)
+{
+  (void)arg;
+  chRegSetThreadName("debug var");
+
+  u32 n_batches = 0;
+  while (TRUE) {
+    chThdSleepMilliseconds(debug_var_period_ms);
+    if (n_batches++ % DEBUG_VAR_NAME_PERIOD == 0)
+      debug_var_send_names();
+    debug_var_send_batch();
+  }
+
+  return 0;
+}
+
+void debug_var_setup(void)
+{
+  SETTING("debug_var", "period_ms", debug_var_period_ms, TYPE_INT);
+
+  chThdCreateStatic(wa_debug_var_thread, sizeof(wa_debug_var_thread),
+                    DEBUG_VAR_THREAD_PRIORITY, debug_var_thread, NULL);
+}
+
+/** \} */
@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef SWIFTNAV_DEBUG_VAR_H
+#define SWIFTNAV_DEBUG_VAR_H
+
+#include <libswiftnav/common.h>
+
+/** \addtogroup debug_var
+ * \{ */
+
+/** Number of debug variable IDs. */
+#define DEBUG_VAR_MAX 32
+
+/** Send the names of the registered variables once every this many
+ * batches, so a console connecting later still learns them. */
+#define DEBUG_VAR_NAME_PERIOD 50
+
+/** IDs of the variables registered by the firmware. */
+enum {
+  DEBUG_VAR_PVT_ITERATIONS = 0, /**< Warm started PVT iterations, 0 for a
+                                     cold start. */
+  DEBUG_VAR_SOLN_OUT_DROPPED,   /**< Epochs whose solution output was
+                                     dropped, see SOLN_OUT_N. */
+};
+
+/** A registered debug variable. */
+typedef struct {
+  const char *name; /**< Name sent in MSG_DEBUG_VAR_NAME, NULL if unused. */
+  double value;     /**< Latest value. */
+  bool updated;     /**< Set since the last batch was sent. */
+} debug_var_t;
+
+/** \} */
+
+void debug_var_register(u8 id, const char *name);
+void debug_var_set(u8 id, double x);
+void debug_var_setup(void);
+
+#endif  /* SWIFTNAV_DEBUG_VAR_H */
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <ch.h>
+
+#include <libswiftnav/ephemeris.h>
+#include <libswiftnav/gpstime.h>
+
+#include "eph_share.h"
+#include "hotstart.h"
+#include "orbit_cache.h"
+#include "sbp.h"
+#include "sbp_piksi.h"
+#include "settings.h"
+#include "timing.h"
+#include "ttff.h"
+
+/** \defgroup eph_share Ephemeris sharing
+ * Ephemerides passed between receivers over SBP.
+ * A receiver otherwise has to track each satellite for at least three
+ * subframes before it has the ephemeris needed to use it in a solution,
+ * even though a base station next to it already holds the same one. Every
+ * ephemeris the nav msg thread decodes is sent as a MSG_EPHEMERIS, and the
+ * held ephemerides are repeated one PRN every few seconds so a receiver
+ * that starts later catches up. A received ephemeris replaces the one in
+ * es only if it is good at the current time and is a different issue (IODE)
+ * with a later toe, so a satellite's own subframes are never overwritten by
+ * an older copy.
+ * \{ */
+
+extern ephemeris_t es[32];
+extern Mutex es_mutex;
+
+/** Send and accept shared ephemerides. */
+static bool eph_share_enabled = true;
+/** Period between repeats of the held ephemerides, 0 to only send newly
+ * decoded ones, (s). */
+static u16 eph_share_period = EPH_SHARE_PERIOD;
+
+/** Only used by the nav msg thread. */
+static systime_t last_repeat;
+static u8 next_repeat_prn;
+
+/** Send an ephemeris to the other receivers on the link.
+ * \param prn PRN (0-31).
+ * \param e   Ephemeris to send.
+ */
+void eph_share_send(u8 prn, const ephemeris_t *e)
+{
+  if (!eph_share_enabled || !e->valid)
+    return;
+
+  msg_ephemeris_t msg;
+  msg.prn = prn;
+  memcpy(&msg.e, e, sizeof(msg.e));
+  sbp_send_msg(MSG_EPHEMERIS, sizeof(msg), (u8 *)&msg);
+}
+
+/** Repeat the next held ephemeris if one is due, call from the nav msg
+ * thread. */
+void eph_share_poll(void)
+{
+  if (!eph_share_enabled || eph_share_period == 0 ||
+      chTimeNow() - last_repeat < S2ST(eph_share_period))
+    return;
+  last_repeat = chTimeNow();
+
+  static ephemeris_t e;
+  for (u8 i=0; i<32; i++) {
+    u8 prn = next_repeat_prn;
+    next_repeat_prn = (next_repeat_prn + 1) % 32;
+
+    chMtxLock(&es_mutex);
+    memcpy(&e, &es[prn], sizeof(e));
+    chMtxUnlock();
+    if (e.valid && e.healthy) {
+      eph_share_send(prn, &e);
+      return;
+    }
+  }
+}
+
+/** Whether a received ephemeris should replace the one held for its PRN.
+ * Call with es_mutex held. */
+static bool eph_share_accept(u8 prn, const ephemeris_t *e)
+{
+  /* Without the time there is no telling whether it is current. */
+  if (time_quality == TIME_UNKNOWN ||
+      !ephemeris_good(*e, get_current_time()))
+    return false;
+
+  const ephemeris_t *cur = &es[prn];
+  if (!cur->valid)
+    return true;
+  /* Same issue of data, already held. */
+  if (cur->iode == e->iode)
+    return false;
+  return gpsdifftime(e->toe, cur->toe) > 0;
+}
+
+/** Store an ephemeris from another source, e.g. another receiver or an
+ * aiding bundle, if it is newer than the one held for its PRN. Doesn't save
+ * it to flash.
+ * \param prn PRN (0-31).
+ * \param e   Ephemeris.
+ * \return true if the ephemeris was stored.
+ */
+bool eph_share_update(u8 prn, const ephemeris_t *e)
+{
+  if (prn >= 32)
+    return false;
+
+  chMtxLock(&es_mutex);
+  bool accept = eph_share_accept(prn, e);
+  if (accept) {
+    memcpy(&es[prn], e, sizeof(*e));
+    orbit_cache_invalidate(prn);
+  }
+  chMtxUnlock();
+
+  if (accept)
+    ttff_mark(TTFF_EPHEMERIS);
+  return accept;
+}
+
+/** Handle a MSG_EPHEMERIS from another receiver.
+ * Relays it to the host and stores it if it is newer than the ephemeris
+ * held for the PRN. Stored ephemerides aren't sent on again straight away,
+ * the sender already reaches every receiver on the link.
+ */
+static void ephemeris_callback(u16 sender_id, u8 len, u8 msg[], void *context)
+{
+  (void)context;
+
+  /* Sender ID of zero means that the messages are relayed, ignore them. */
+  if (sender_id == 0)
+    return;
+
+  sbp_relay_msg(MSG_EPHEMERIS, len, msg);
+
+  if (!eph_share_enabled || len != sizeof(msg_ephemeris_t))
+    return;
+
+  static msg_ephemeris_t m;
+  memcpy(&m, msg, sizeof(m));
+  if (!eph_share_update(m.prn, &m.e))
+    return;
+
+  printf("Shared ephemeris for PRN %02d from %04X\n", m.prn+1, sender_id);
+  hotstart_save_ephemeris(m.prn, &m.e);
+}
+
+void eph_share_setup(void)
+{
+  SETTING("eph_share", "enabled", eph_share_enabled, TYPE_BOOL);
+  SETTING("eph_share", "period", eph_share_period, TYPE_INT);
+
+  static sbp_msg_callbacks_node_t ephemeris_node;
+  sbp_register_cbk(
+    MSG_EPHEMERIS,
+    &ephemeris_callback,
+    &ephemeris_node
+  );
+}
+
+/** \} */
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef SWIFTNAV_EPH_SHARE_H
+#define SWIFTNAV_EPH_SHARE_H
+
+#include <libswiftnav/common.h>
+#include <libswiftnav/ephemeris.h>
+
+/** \addtogroup eph_share
+ * \{ */
+
+/** Default period between repeats of the held ephemerides, one PRN per
+ * period, (s). */
+#define EPH_SHARE_PERIOD 2
+
+/** Longest the nav msg thread waits for a subframe before checking whether
+ * a repeat is due, (ms). */
+#define EPH_SHARE_POLL_MS 500
+
+/** \} */
+
+void eph_share_setup(void);
+void eph_share_send(u8 prn, const ephemeris_t *e);
+void eph_share_poll(void);
+bool eph_share_update(u8 prn, const ephemeris_t *e);
+
+#endif  /* SWIFTNAV_EPH_SHARE_H */
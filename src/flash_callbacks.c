@@ -11,12 +11,14 @@
  */
 
 #include <string.h>
+#include <ch.h>
 #include <libswiftnav/sbp.h>
 
 #include "sbp.h"
 #include "peripherals/stm_flash.h"
 #include "board/m25_flash.h"
 #include "flash_callbacks.h"
+#include "flash_log.h"
 #include "main.h"
 
 /** Callback to erase a sector of either the STM or M25 flash.
@@ -41,9 +43,12 @@ void flash_erase_sector_callback(u16 sender_id, u8 len, u8 msg[], void* context)
     break;
   case FLASH_M25: ;
     u32 addr = ((u32)sector) << 16;
+    flash_log_stop(addr, M25_SECTOR_LEN);
+    m25_lock();
     m25_write_enable();
     ret = m25_sector_erase(addr);
     m25_write_disable();
+    m25_unlock();
     break;
   default:
     ret = FLASH_INVALID_FLASH;
@@ -89,9 +94,12 @@ void flash_program_callback(u16 sender_id, u8 len, u8 msg[], void* context)
     ret = stm_flash_program(address, data, length);
     break;
   case FLASH_M25:
+    flash_log_stop(address, length);
+    m25_lock();
     m25_write_enable();
     ret = m25_page_program(address, data, length);
     m25_write_disable();
+    m25_unlock();
     break;
   default:
     ret = FLASH_INVALID_FLASH;
@@ -101,6 +109,244 @@ void flash_program_callback(u16 sender_id, u8 len, u8 msg[], void* context)
   sbp_send_msg(MSG_FLASH_DONE, 1, &ret);
 }
 
+/** \defgroup flash_stream Streaming flash programming
+ * Programming without a round trip per chunk.
+ *
+ * Chunks sent with MSG_FLASH_PROGRAM_STREAM carry a sequence number and are
+ * staged into one of two page buffers. Once a page is complete it is handed
+ * to a writer thread which programs it while the next page is received, so
+ * the slow M25 page program no longer holds up the SBP thread. A cumulative
+ * MSG_FLASH_STREAM_ACK is sent every FLASH_STREAM_ACK_INTERVAL chunks, which
+ * lets the host keep up to FLASH_STREAM_WINDOW chunks in flight.
+ * \{ */
+
+#define FLASH_STREAM_THREAD_PRIORITY (HIGHPRIO-23)
+#define FLASH_STREAM_THREAD_STACK    512
+
+typedef struct {
+  u8 flash;
+  u32 addr;
+  u16 len;
+  u16 seq;  /**< Chunks completed once this page has been programmed. */
+  bool ack; /**< Send a cumulative ack after programming. */
+  u8 data[FLASH_STREAM_PAGE_LEN];
+} flash_stream_page_t;
+
+static flash_stream_page_t stream_pages[2];
+static flash_stream_page_t *stream_staging = &stream_pages[0];
+static flash_stream_page_t *stream_writing;
+
+/** Signalled when a page is ready for the writer thread. */
+static BSEMAPHORE_DECL(stream_pending_sem, TRUE);
+/** Taken while the writer thread owns a page. */
+static BSEMAPHORE_DECL(stream_idle_sem, FALSE);
+
+static u16 stream_next_seq;
+static u16 stream_done;
+static u8 stream_chunks;
+static bool stream_nacked;
+static volatile u8 stream_status = FLASH_OK;
+
+static void flash_stream_send_ack(u8 status, u16 seq)
+{
+  msg_flash_stream_ack_t ack = {
+    .status = status,
+    .seq = seq,
+  };
+  sbp_send_msg(MSG_FLASH_STREAM_ACK, sizeof(ack), (u8 *)&ack);
+}
+
+static u8 flash_stream_program_page(flash_stream_page_t *p)
+{
+  u8 ret = FLASH_OK;
+
+  switch (p->flash) {
+  case FLASH_STM:
+    for (u16 i = 0; i < p->len && ret == FLASH_OK; i += FLASH_ADDRS_PER_OP)
+      ret = stm_flash_program(p->addr + i, &p->data[i],
+                              MIN(p->len - i, FLASH_ADDRS_PER_OP));
+    break;
+  case FLASH_M25:
+    flash_log_stop(p->addr, p->len);
+    m25_lock();
+    m25_write_enable();
+    ret = m25_page_program(p->addr, p->data, p->len);
+    m25_write_disable();
+    m25_unlock();
+    break;
+  default:
+    ret = FLASH_INVALID_FLASH;
+    break;
+  }
+
+  return ret;
+}
+
+static WORKING_AREA_CCM(wa_flash_stream_thread, FLASH_STREAM_THREAD_STACK);
+static msg_t flash_stream_thread(void *arg)
+{
+  (void)arg;
+  chRegSetThreadName("flash stream");
+
+  while (TRUE) {
+    chBSemWait(&stream_pending_sem);
+    flash_stream_page_t *p = stream_writing;
+
+    if (stream_status == FLASH_OK) {
+      u8 ret = p->len ? flash_stream_program_page(p) : FLASH_OK;
+      if (ret != FLASH_OK) {
+        stream_status = ret;
+        flash_stream_send_ack(ret, stream_done);
+      } else {
+        stream_done = p->seq;
+        if (p->ack)
+          flash_stream_send_ack(FLASH_OK, stream_done);
+      }
+    }
+
+    chBSemSignal(&stream_idle_sem);
+  }
+
+  return 0;
+}
+
+/** Hand the staging page to the writer thread and start a new one.
+ * Blocks until the writer has finished with the previous page.
+ *
+ * \param seq Chunks completed once the staged page has been programmed
+ * \param ack Send a cumulative ack once the page has been programmed
+ */
+static void flash_stream_submit(u16 seq, bool ack)
+{
+  chBSemWait(&stream_idle_sem);
+
+  stream_staging->seq = seq;
+  stream_staging->ack = ack;
+  stream_writing = stream_staging;
+  chBSemSignal(&stream_pending_sem);
+
+  if (stream_staging == &stream_pages[0])
+    stream_staging = &stream_pages[1];
+  else
+    stream_staging = &stream_pages[0];
+  stream_staging->len = 0;
+}
+
+/** Wait for the writer thread to finish any page it holds. */
+static void flash_stream_wait_idle(void)
+{
+  chBSemWait(&stream_idle_sem);
+  chBSemSignal(&stream_idle_sem);
+}
+
+/** Callback to stream a chunk to be programmed into either the STM or M25
+ * flash. Chunks must arrive in sequence, a chunk with sequence number 0
+ * starts a new stream. A chunk with length 0 flushes the staged page and is
+ * always acknowledged; it does not consume a sequence number.
+ *
+ * \note Sectors containing addresses must be erased before addresses can be
+ * programmed.
+ *
+ * \param buff Array of u8 (length >= 8) :
+ *             - [0]     Flash to program (FLASH_STM or FLASH_M25)
+ *             - [1:2]   Sequence number of this chunk
+ *             - [3:6]   Starting address of set to program
+ *             - [7]     Length of set of addresses to program - counts up
+ *                       from starting address
+ *             - [8:end] Data to program addresses with
+ */
+void flash_program_stream_callback(u16 sender_id, u8 len, u8 msg[], void* context)
+{
+  (void)sender_id; (void) context;
+
+  u8 flash = msg[0];
+  u16 seq = *(u16 *)&msg[1];
+  u32 address = *(u32 *)&msg[3];
+  u8 length = msg[7];
+  u8 *data = &msg[8];
+
+  if (seq == 0) {
+    flash_stream_wait_idle();
+    stream_staging->len = 0;
+    stream_next_seq = 0;
+    stream_done = 0;
+    stream_chunks = 0;
+    stream_nacked = false;
+    stream_status = FLASH_OK;
+  }
+
+  if (seq != stream_next_seq) {
+    /* Lost a chunk, only ask for a resend once per gap. */
+    if (!stream_nacked && stream_status == FLASH_OK)
+      flash_stream_send_ack(FLASH_INVALID_SEQ, stream_next_seq);
+    stream_nacked = true;
+    return;
+  }
+  stream_nacked = false;
+
+  if (length == 0) {
+    if (stream_status == FLASH_OK) {
+      flash_stream_submit(stream_next_seq, true);
+    } else {
+      flash_stream_wait_idle();
+      flash_stream_send_ack(stream_status, stream_done);
+    }
+    return;
+  }
+
+  /* An error has already been reported, wait for the host to restart. */
+  if (stream_status != FLASH_OK)
+    return;
+
+  if (length > FLASH_ADDRS_PER_OP || len < 8 + length) {
+    flash_stream_wait_idle();
+    stream_status = FLASH_INVALID_LEN;
+    flash_stream_send_ack(stream_status, stream_done);
+    return;
+  }
+
+  bool ack = ++stream_chunks >= FLASH_STREAM_ACK_INTERVAL;
+  if (ack)
+    stream_chunks = 0;
+
+  while (length > 0) {
+    flash_stream_page_t *p = stream_staging;
+    if (p->len > 0 && (p->flash != flash || p->addr + p->len != address)) {
+      flash_stream_submit(stream_next_seq, false);
+      p = stream_staging;
+    }
+    if (p->len == 0) {
+      p->flash = flash;
+      p->addr = address;
+    }
+
+    /* Never let a staged page cross a page boundary. */
+    u16 room = FLASH_STREAM_PAGE_LEN - (address % FLASH_STREAM_PAGE_LEN);
+    u8 n = MIN(length, room);
+    memcpy(&p->data[p->len], data, n);
+    p->len += n;
+    address += n;
+    data += n;
+    length -= n;
+
+    if (address % FLASH_STREAM_PAGE_LEN == 0) {
+      if (length > 0) {
+        flash_stream_submit(stream_next_seq, false);
+      } else {
+        /* Chunk ends on a page boundary, the ack can ride on this page. */
+        flash_stream_submit(stream_next_seq + 1, ack);
+        ack = false;
+      }
+    }
+  }
+
+  stream_next_seq++;
+  if (ack)
+    flash_stream_submit(stream_next_seq, true);
+}
+
+/** \} */
+
 /** Callback to read a set of addresses of either the STM or M25 flash.
  * Replies with a MSG_FLASH_READ message containing the read data on success or
  * a MSG_FLASH_DONE message containing the return code FLASH_INVALID_LEN if the
@@ -149,7 +395,9 @@ void flash_read_callback(u16 sender_id, u8 len, u8 msg[], void* context)
     memcpy(&callback_data[5], (const void *)address, length);
     break;
   case FLASH_M25:
+    m25_lock();
     ret = m25_read(address, &callback_data[5], length);
+    m25_unlock();
     break;
   default:
     ret = FLASH_INVALID_FLASH;
@@ -174,9 +422,13 @@ void m25_flash_write_status_callback(u16 sender_id, u8 len, u8 msg[], void* cont
 
   u8 ret = FLASH_OK;
   u8 sr = msg[0];
+  /* Block protect covers the whole flash. */
+  flash_log_stop(0, M25_MAX_ADDR + 1);
+  m25_lock();
   m25_write_enable();
   m25_write_status(sr);
   m25_write_disable();
+  m25_unlock();
   sbp_send_msg(MSG_FLASH_DONE, 1, &ret);
 }
 
@@ -218,12 +470,16 @@ void flash_callbacks_register(void)
   static sbp_msg_callbacks_node_t flash_erase_sector_node;
   static sbp_msg_callbacks_node_t flash_read_node;
   static sbp_msg_callbacks_node_t flash_program_node;
+  static sbp_msg_callbacks_node_t flash_program_stream_node;
 
   static sbp_msg_callbacks_node_t stm_flash_lock_sector_node;
   static sbp_msg_callbacks_node_t stm_flash_unlock_sector_node;
 
   static sbp_msg_callbacks_node_t m25_flash_write_status_node;
 
+  chThdCreateStatic(wa_flash_stream_thread, sizeof(wa_flash_stream_thread),
+                    FLASH_STREAM_THREAD_PRIORITY, flash_stream_thread, NULL);
+
   sbp_register_cbk(MSG_FLASH_ERASE,
                         &flash_erase_sector_callback,
                         &flash_erase_sector_node);
@@ -233,6 +489,9 @@ void flash_callbacks_register(void)
   sbp_register_cbk(MSG_FLASH_PROGRAM,
                         &flash_program_callback,
                         &flash_program_node);
+  sbp_register_cbk(MSG_FLASH_PROGRAM_STREAM,
+                        &flash_program_stream_callback,
+                        &flash_program_stream_node);
 
   sbp_register_cbk(MSG_STM_FLASH_LOCK_SECTOR,
                         &stm_flash_lock_sector_callback,
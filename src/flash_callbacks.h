@@ -13,6 +13,8 @@
 #ifndef SWIFTNAV_FLASH_CALLBACKS_H
 #define SWIFTNAV_FLASH_CALLBACKS_H
 
+#include <libswiftnav/common.h>
+
 #define FLASH_STM 0 /**< Value to pass flash callbacks to use STM Flash */
 #define FLASH_M25 1 /**< Value to pass flash callbacks to use M25 Flash */
 
@@ -22,9 +24,29 @@
 #define FLASH_INVALID_ADDR   3
 #define FLASH_INVALID_RANGE  4
 #define FLASH_INVALID_SECTOR 5
+#define FLASH_INVALID_SEQ    6
 
 #define FLASH_ADDRS_PER_OP 128
 
+/** Size of the pages streamed chunks are staged in before programming. Equal
+ * to the M25 page size so a staged page is a single page program. */
+#define FLASH_STREAM_PAGE_LEN     256
+/** Number of chunks between cumulative MSG_FLASH_STREAM_ACK messages. */
+#define FLASH_STREAM_ACK_INTERVAL 4
+/** Maximum number of unacknowledged chunks the host may have in flight.
+ * Must fit in the USART RX buffer while a page is being programmed. */
+#define FLASH_STREAM_WINDOW       12
+
+/** Cumulative acknowledgement of a programming stream.
+ * With status FLASH_OK all chunks with a sequence number less than seq have
+ * been programmed. With FLASH_INVALID_SEQ a chunk was lost and seq is the
+ * sequence number the host should resume from. Any other status aborts the
+ * stream and seq counts the chunks programmed before the error. */
+typedef struct __attribute__((packed)) {
+  u8 status;
+  u16 seq;
+} msg_flash_stream_ack_t;
+
 void flash_callbacks_register(void);
 void stm_unique_id_callback_register(void);
 
@@ -0,0 +1,516 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include <ch.h>
+
+#include <libswiftnav/edc.h>
+#include <libswiftnav/sbp_messages.h>
+
+#include "board/m25_flash.h"
+#include "flash_log.h"
+#include "sbp.h"
+#include "sbp_piksi.h"
+#include "settings.h"
+
+/** \defgroup flash_log Flash log
+ * On board log of observations and solutions in the M25 flash, so that
+ * nothing is lost while the host or radio link is down.
+ *
+ * Every SBP message with observations, a solution or a baseline that we
+ * send is also appended to a byte ring, by flash_log_msg() from
+ * sbp_send_msg(), before any decimation for the USARTs. That only copies
+ * the message, the sending thread never waits for the flash. A low
+ * priority thread takes the records off the ring and packs them into
+ * 256 byte pages, each programmed in one go and headed with a sequence
+ * number and CRC, see flash_log_page_hdr_t. If the ring fills messages are
+ * dropped and counted in a FLASH_LOG_DROP record.
+ *
+ * The sectors between FLASH_LOG_START and FLASH_LOG_END are used as a ring,
+ * oldest sector erased next, so every sector is erased equally often. The
+ * sector after the one being written is kept erased so that the writer
+ * never has to wait for an erase at a sector boundary. At startup the last
+ * page written is found from the page sequence numbers and the log carries
+ * on from there. A sector whose first page holds anything other than a log
+ * page or erased flash, e.g. the end of a bigger bitstream than expected,
+ * is left out of the ring untouched.
+ *
+ * The log is downloaded with MSG_FLASH_LOG_READ, the pages are streamed
+ * back oldest first in MSG_FLASH_LOG_DATA messages while logging carries
+ * on.
+ *
+ * Every flash operation is made under m25_lock(). The flash callbacks call
+ * flash_log_stop() before touching the log's sectors, logging then stops
+ * until the next reset so that the host's data is never overwritten.
+ * \{ */
+
+#define FLASH_LOG_THREAD_PRIORITY (NORMALPRIO-3)
+#define FLASH_LOG_THREAD_STACK    1024
+
+static bool flash_log_enabled = false;
+
+/** Set once the log region has been scanned and has usable sectors. */
+static volatile bool flash_log_ok = false;
+/** Set by flash_log_stop(), the log's sectors belong to someone else. */
+static volatile bool flash_log_stopped = false;
+
+static u8 flash_log_buff[FLASH_LOG_BUFF_LEN] _CCM;
+/** Index of the next byte to write, only advanced with the kernel locked. */
+static volatile u32 flash_log_head = 0;
+/** Index of the next byte to take, only advanced by the log thread. */
+static volatile u32 flash_log_tail = 0;
+/** Messages lost since the last FLASH_LOG_DROP. */
+static u32 flash_log_dropped = 0;
+
+/** Sectors of the region in the ring, bit n is sector n of the region. */
+static u32 sector_usable = 0;
+/** Sector of the region that has been erased ahead of use, -1 if none. */
+static s8 sector_erased = -1;
+
+/* Where the next page goes. */
+static u8 wr_sector;
+static u16 wr_page;
+static u32 wr_seq;
+
+/** Page being filled, DMA reachable for m25_page_program(). */
+static u8 page[FLASH_LOG_PAGE_LEN] __attribute__((aligned(4)));
+static u8 page_len = 0;
+static u8 page_first = FLASH_LOG_NO_RECORD;
+/** Bytes of the record being copied still to go into the page. */
+static u16 rec_left = 0;
+
+static volatile bool read_req = false;
+static volatile bool erase_req = false;
+
+/* Download in progress. */
+static bool reading = false;
+static u8 rd_sector;
+static u16 rd_page;
+static u8 rd_end_sector;
+static u16 rd_end_page;
+static u8 rd_part;
+
+/** Whether messages of a type are logged. */
+static bool flash_log_wanted(u16 msg_type)
+{
+  switch (msg_type) {
+  case MSG_NEW_OBS:
+  case MSG_PACKED_OBS:
+  case MSG_COMPACT_OBS:
+  case SBP_GPS_TIME:
+  case SBP_POS_LLH:
+  case SBP_POS_ECEF:
+  case SBP_VEL_NED:
+  case SBP_VEL_ECEF:
+  case SBP_DOPS:
+  case SBP_BASELINE_ECEF:
+  case SBP_BASELINE_NED:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/** Copy bytes into the ring at an index, wrapping at the end. */
+static void ring_write(u32 index, const u8 data[], u32 len)
+{
+  u32 i = index & (FLASH_LOG_BUFF_LEN - 1);
+  u32 n = MIN(len, FLASH_LOG_BUFF_LEN - i);
+  memcpy(&flash_log_buff[i], data, n);
+  memcpy(flash_log_buff, &data[n], len - n);
+}
+
+/** Copy bytes out of the ring from an index, wrapping at the end. */
+static void ring_read(u32 index, u8 data[], u32 len)
+{
+  u32 i = index & (FLASH_LOG_BUFF_LEN - 1);
+  u32 n = MIN(len, FLASH_LOG_BUFF_LEN - i);
+  memcpy(data, &flash_log_buff[i], n);
+  memcpy(&data[n], flash_log_buff, len - n);
+}
+
+/** Log a message, called by sbp_send_msg() for every message we send.
+ * Only copies the message into the ring, never waits for the flash.
+ * \param msg_type Message ID
+ * \param len      Length of message data
+ * \param buff     Message data
+ */
+void flash_log_msg(u16 msg_type, u8 len, const u8 buff[])
+{
+  if (!flash_log_enabled || !flash_log_ok || flash_log_stopped ||
+      !flash_log_wanted(msg_type))
+    return;
+
+  u8 hdr[3] = {msg_type & 0xFF, msg_type >> 8, len};
+
+  chSysLock();
+  u32 n_free = FLASH_LOG_BUFF_LEN - (flash_log_head - flash_log_tail);
+  if (flash_log_dropped) {
+    if (n_free < 5u + 3u + len) {
+      flash_log_dropped++;
+      chSysUnlock();
+      return;
+    }
+    u16 dropped = MIN(flash_log_dropped, 0xFFFF);
+    u8 drop[5] = {FLASH_LOG_DROP & 0xFF, FLASH_LOG_DROP >> 8, 2,
+                  dropped & 0xFF, dropped >> 8};
+    ring_write(flash_log_head, drop, sizeof(drop));
+    flash_log_head += sizeof(drop);
+    flash_log_dropped = 0;
+  } else if (n_free < 3u + len) {
+    flash_log_dropped++;
+    chSysUnlock();
+    return;
+  }
+  ring_write(flash_log_head, hdr, sizeof(hdr));
+  ring_write(flash_log_head + sizeof(hdr), buff, len);
+  flash_log_head += sizeof(hdr) + len;
+  chSysUnlock();
+}
+
+static u32 page_addr(u8 sector, u16 pg)
+{
+  return FLASH_LOG_START + sector * M25_SECTOR_LEN + pg * FLASH_LOG_PAGE_LEN;
+}
+
+/** Next sector of the ring after a sector. */
+static u8 sector_next(u8 sector)
+{
+  do {
+    sector = (sector + 1) % FLASH_LOG_N_SECTORS;
+  } while (!(sector_usable & (1u << sector)));
+  return sector;
+}
+
+static void sector_erase(u8 sector)
+{
+  m25_lock();
+  if (!flash_log_stopped) {
+    m25_write_enable();
+    m25_sector_erase(page_addr(sector, 0));
+    m25_write_disable();
+  }
+  m25_unlock();
+}
+
+/** Read a page header.
+ * \return true if the page was written by the log.
+ */
+static bool page_hdr_read(u8 sector, u16 pg, flash_log_page_hdr_t *h)
+{
+  m25_lock();
+  m25_read(page_addr(sector, pg), (u8 *)h, sizeof(*h));
+  m25_unlock();
+  return h->magic == FLASH_LOG_MAGIC;
+}
+
+static bool page_hdr_erased(const flash_log_page_hdr_t *h)
+{
+  const u8 *b = (const u8 *)h;
+  for (u8 i = 0; i < sizeof(*h); i++)
+    if (b[i] != 0xFF)
+      return false;
+  return true;
+}
+
+/** Keep the sector after the one being written erased. */
+static void sector_erase_ahead(void)
+{
+  u8 next = sector_next(wr_sector);
+  if (next == wr_sector || sector_erased == next)
+    return;
+  sector_erase(next);
+  sector_erased = next;
+}
+
+/** Move on to the first page of the next sector of the ring. */
+static void sector_advance(void)
+{
+  wr_sector = sector_next(wr_sector);
+  wr_page = 0;
+  if (sector_erased != wr_sector)
+    sector_erase(wr_sector);
+  sector_erased = -1;
+  sector_erase_ahead();
+}
+
+/** Find the sectors the log may use and where it left off. */
+static void flash_log_scan(void)
+{
+  if (m25_read_status() & (M25_SR_BP2 | M25_SR_BP1 | M25_SR_BP0)) {
+    printf("flash log: M25 flash is write protected, not logging\n");
+    return;
+  }
+
+  flash_log_page_hdr_t h;
+  bool found = false;
+  sector_usable = 0;
+  for (u8 s = 0; s < FLASH_LOG_N_SECTORS; s++) {
+    if (page_hdr_read(s, 0, &h)) {
+      sector_usable |= 1u << s;
+      if (!found || (s32)(h.seq - wr_seq) > 0) {
+        found = true;
+        wr_sector = s;
+        wr_seq = h.seq;
+      }
+    } else if (page_hdr_erased(&h)) {
+      sector_usable |= 1u << s;
+    } else {
+      printf("flash log: sector at 0x%06X is in use, skipped\n",
+             (unsigned int)page_addr(s, 0));
+    }
+  }
+
+  if (!sector_usable) {
+    printf("flash log: no free sectors, not logging\n");
+    return;
+  }
+
+  if (!found) {
+    /* A fresh log, start it at the first usable sector. */
+    wr_sector = __builtin_ctz(sector_usable);
+    wr_page = 0;
+    wr_seq = 0;
+    sector_erase(wr_sector);
+  } else {
+    /* Carry on after the last page written in the newest sector. */
+    for (wr_page = 1; wr_page < FLASH_LOG_PAGES_PER_SECTOR; wr_page++) {
+      if (!page_hdr_read(wr_sector, wr_page, &h))
+        break;
+      wr_seq = h.seq;
+    }
+    wr_seq++;
+    if (wr_page == FLASH_LOG_PAGES_PER_SECTOR) {
+      sector_advance();
+      flash_log_ok = true;
+      return;
+    }
+  }
+  sector_erase_ahead();
+  flash_log_ok = true;
+}
+
+/** Program the page being filled and start the next one. */
+static void page_write(void)
+{
+  flash_log_page_hdr_t *h = (flash_log_page_hdr_t *)page;
+  h->magic = FLASH_LOG_MAGIC;
+  h->seq = wr_seq;
+  h->first = page_first;
+  h->len = page_len;
+  h->crc = crc16_ccitt(&page[sizeof(*h)], page_len, 0);
+  memset(&page[sizeof(*h) + page_len], 0xFF, FLASH_LOG_PAYLOAD_LEN - page_len);
+
+  m25_lock();
+  if (!flash_log_stopped) {
+    m25_write_enable();
+    m25_page_program(page_addr(wr_sector, wr_page), page, FLASH_LOG_PAGE_LEN);
+    m25_write_disable();
+  }
+  m25_unlock();
+
+  wr_seq++;
+  page_len = 0;
+  page_first = FLASH_LOG_NO_RECORD;
+  if (++wr_page == FLASH_LOG_PAGES_PER_SECTOR)
+    sector_advance();
+}
+
+/** Move the records waiting in the ring into pages, programming each page
+ * as it fills. */
+static void flash_log_drain(void)
+{
+  u32 head = flash_log_head;
+  __asm__ __volatile__("" ::: "memory");
+  u32 tail = flash_log_tail;
+
+  /* Whole records are pushed at once, so a record is always complete. */
+  while (tail != head) {
+    if (rec_left == 0) {
+      u8 hdr[3];
+      ring_read(tail, hdr, sizeof(hdr));
+      rec_left = sizeof(hdr) + hdr[2];
+      if (page_first == FLASH_LOG_NO_RECORD)
+        page_first = page_len;
+    }
+    u32 n = MIN(rec_left, FLASH_LOG_PAYLOAD_LEN - page_len);
+    ring_read(tail, &page[sizeof(flash_log_page_hdr_t) + page_len], n);
+    tail += n;
+    page_len += n;
+    rec_left -= n;
+    if (page_len == FLASH_LOG_PAYLOAD_LEN) {
+      /* The page has a copy, let the writers have the space back. */
+      flash_log_tail = tail;
+      page_write();
+    }
+  }
+  flash_log_tail = tail;
+}
+
+/** Program a partly filled page, so that everything logged so far is in
+ * the flash. */
+static void flash_log_flush(void)
+{
+  if (page_len > 0)
+    page_write();
+}
+
+/** Erase the whole log and start it again. */
+static void flash_log_erase(void)
+{
+  for (u8 s = 0; s < FLASH_LOG_N_SECTORS; s++)
+    if (sector_usable & (1u << s))
+      sector_erase(s);
+
+  wr_sector = __builtin_ctz(sector_usable);
+  wr_page = 0;
+  wr_seq = 0;
+  page_len = 0;
+  page_first = FLASH_LOG_NO_RECORD;
+  u8 next = sector_next(wr_sector);
+  sector_erased = next != wr_sector ? next : -1;
+  reading = false;
+}
+
+/** Send the next few pages of a download. */
+static void flash_log_read_step(void)
+{
+  for (u8 i = 0; i < FLASH_LOG_READ_PAGES * FLASH_LOG_PAGE_LEN /
+                     FLASH_LOG_READ_CHUNK_LEN; i++) {
+    if (rd_sector == rd_end_sector && rd_page == rd_end_page) {
+      msg_flash_log_data_t msg = {.addr = page_addr(rd_sector, rd_page)};
+      if (sbp_send_msg(MSG_FLASH_LOG_DATA, sizeof(msg.addr), (u8 *)&msg) == 0)
+        reading = false;
+      return;
+    }
+
+    /* Pages that aren't the log's, e.g. erased ahead, are skipped. */
+    flash_log_page_hdr_t h;
+    if (rd_part == 0 && !page_hdr_read(rd_sector, rd_page, &h)) {
+      rd_part = FLASH_LOG_PAGE_LEN / FLASH_LOG_READ_CHUNK_LEN;
+    } else {
+      msg_flash_log_data_t msg;
+      msg.addr = page_addr(rd_sector, rd_page) +
+                 rd_part * FLASH_LOG_READ_CHUNK_LEN;
+      m25_lock();
+      m25_read(msg.addr, msg.data, FLASH_LOG_READ_CHUNK_LEN);
+      m25_unlock();
+      if (sbp_send_msg(MSG_FLASH_LOG_DATA, sizeof(msg), (u8 *)&msg) != 0)
+        /* Link busy, try again next time. */
+        return;
+      rd_part++;
+    }
+
+    if (rd_part == FLASH_LOG_PAGE_LEN / FLASH_LOG_READ_CHUNK_LEN) {
+      rd_part = 0;
+      if (++rd_page == FLASH_LOG_PAGES_PER_SECTOR) {
+        rd_page = 0;
+        rd_sector = sector_next(rd_sector);
+      }
+    }
+  }
+}
+
+/** Start a download from the oldest page to the last one written. */
+static void flash_log_read_start(void)
+{
+  flash_log_flush();
+  rd_sector = sector_next(wr_sector);
+  if (rd_sector == sector_erased)
+    rd_sector = sector_next(rd_sector);
+  rd_page = 0;
+  rd_end_sector = wr_sector;
+  rd_end_page = wr_page;
+  rd_part = 0;
+  reading = true;
+}
+
+static WORKING_AREA_CCM(wa_flash_log_thread, FLASH_LOG_THREAD_STACK);
+static msg_t flash_log_thread(void *arg)
+{
+  (void)arg;
+  chRegSetThreadName("flash log");
+
+  flash_log_scan();
+  if (!flash_log_ok)
+    return 0;
+
+  while (!flash_log_stopped) {
+    chThdSleepMilliseconds(FLASH_LOG_PERIOD_MS);
+
+    if (erase_req) {
+      erase_req = false;
+      flash_log_erase();
+    }
+
+    flash_log_drain();
+    if (!flash_log_enabled)
+      flash_log_flush();
+
+    if (read_req) {
+      read_req = false;
+      flash_log_read_start();
+    }
+    if (reading)
+      flash_log_read_step();
+  }
+
+  return 0;
+}
+
+/** Stop logging if a flash operation is about to touch the log's sectors.
+ * Called by the flash callbacks before each M25 erase, program or status
+ * write. Once stopped the log doesn't touch the flash again until the next
+ * reset, any page or erase already under way finishes first as the caller
+ * then waits for m25_lock().
+ * \param addr First byte the operation touches
+ * \param len  Number of bytes it touches
+ */
+void flash_log_stop(u32 addr, u32 len)
+{
+  if (addr < FLASH_LOG_END && addr + len > FLASH_LOG_START)
+    flash_log_stopped = true;
+}
+
+static void flash_log_read_callback(u16 sender_id, u8 len, u8 msg[],
+                                    void *context)
+{
+  (void)sender_id; (void)len; (void)msg; (void)context;
+  read_req = true;
+}
+
+static void flash_log_erase_callback(u16 sender_id, u8 len, u8 msg[],
+                                     void *context)
+{
+  (void)sender_id; (void)len; (void)msg; (void)context;
+  erase_req = true;
+}
+
+/** Register the log settings and messages and start the log thread. */
+void flash_log_setup(void)
+{
+  SETTING("flash_log", "enabled", flash_log_enabled, TYPE_BOOL);
+
+  static sbp_msg_callbacks_node_t read_node;
+  sbp_register_cbk(MSG_FLASH_LOG_READ, &flash_log_read_callback, &read_node);
+  static sbp_msg_callbacks_node_t erase_node;
+  sbp_register_cbk(MSG_FLASH_LOG_ERASE, &flash_log_erase_callback,
+                   &erase_node);
+
+  chThdCreateStatic(wa_flash_log_thread, sizeof(wa_flash_log_thread),
+                    FLASH_LOG_THREAD_PRIORITY, flash_log_thread, NULL);
+}
+
+/** \} */
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+
+#ifndef SWIFTNAV_FLASH_LOG_H
+#define SWIFTNAV_FLASH_LOG_H
+
+#include <libswiftnav/common.h>
+
+#include "board/m25_flash.h"
+#include "board/nap/nap_conf.h"
+
+/** \addtogroup flash_log
+ * \{ */
+
+/** First byte of the M25 flash the log may use, sector aligned. Sectors
+ * below this hold the FPGA bitstream. */
+#define FLASH_LOG_START 0x60000
+/** One past the last byte of the flash the log may use, the NAP parameters
+ * and everything above them are left alone. */
+#define FLASH_LOG_END   NAP_FLASH_PARAMS_ADDR
+#define FLASH_LOG_N_SECTORS ((FLASH_LOG_END - FLASH_LOG_START) / M25_SECTOR_LEN)
+
+#define FLASH_LOG_PAGE_LEN 256
+#define FLASH_LOG_PAGES_PER_SECTOR (M25_SECTOR_LEN / FLASH_LOG_PAGE_LEN)
+
+/** "PLOG", marks a page written by the log. */
+#define FLASH_LOG_MAGIC 0x474F4C50
+
+/** Header at the start of every page of the log. */
+typedef struct __attribute__((packed)) {
+  u32 magic;  /**< FLASH_LOG_MAGIC. */
+  u32 seq;    /**< Pages written before this one, orders the ring. */
+  u8 first;   /**< Offset into the payload of the first record that starts
+                   in this page, FLASH_LOG_NO_RECORD if none does. */
+  u8 len;     /**< Payload bytes used, the rest are 0xFF. */
+  u16 crc;    /**< CRC-16 CCITT of the payload bytes used. */
+} flash_log_page_hdr_t;
+
+#define FLASH_LOG_NO_RECORD 0xFF
+#define FLASH_LOG_PAYLOAD_LEN \
+  (FLASH_LOG_PAGE_LEN - sizeof(flash_log_page_hdr_t))
+
+/** Records are SBP messages without the framing, u16 message type, u8
+ * length and the payload, and run on from one page to the next. This
+ * pseudo message type records how many messages were lost, in a u16, when
+ * the log couldn't keep up. */
+#define FLASH_LOG_DROP 0xFFFF
+
+/** Bytes of records waiting to be written, a power of two. Covers a few
+ * seconds of observations at 10 Hz, long enough to ride out a sector
+ * erase. */
+#define FLASH_LOG_BUFF_LEN 8192
+
+/** How often the waiting records are written out. (ms) */
+#define FLASH_LOG_PERIOD_MS 50
+
+/** Bytes of flash sent in each MSG_FLASH_LOG_DATA. */
+#define FLASH_LOG_READ_CHUNK_LEN 128
+/** Pages of the log sent per FLASH_LOG_PERIOD_MS while downloading. */
+#define FLASH_LOG_READ_PAGES 2
+
+/** \} */
+
+void flash_log_setup(void);
+void flash_log_msg(u16 msg_type, u8 len, const u8 buff[]);
+void flash_log_stop(u32 addr, u32 len);
+
+#endif  /* SWIFTNAV_FLASH_LOG_H */
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <ch.h>
+
+#include "board/nap/nap_common.h"
+#include "hotstart.h"
+#include "persist.h"
+#include "timing.h"
+#include "track.h"
+
+#include "cfs/cfs-coffee.h"
+#include "cfs/cfs.h"
+
+/** \defgroup hotstart Hot start
+ * Saves the receiver state needed for a hot start to the filesystem and
+ * restores it at startup. Ephemerides are stored per PRN as they are decoded,
+ * the clock estimate and the set of tracked satellites are saved
+ * periodically by hotstart_save().
+ * \{ */
+
+/** Hot start state file. Coffee keeps COFFEE_NAME_LENGTH bytes of a name,
+ * terminator included, so file names must be no longer than 7 characters. */
+#define HOTSTART_FILE "hotst"
+
+extern ephemeris_t es[32];
+extern Mutex es_mutex;
+
+/** Satellites tracked before the last reset, used as acquisition hints. */
+static u32 hint_mask;
+static float hint_doppler[32];
+
+/** Load the hot start state and ephemerides from file, or create the files
+ * if they do not exist. Must be called after timing_setup().
+ */
+void hotstart_setup(void)
+{
+  int fd = cfs_open("ephem", CFS_READ);
+  if (fd != -1) {
+    static ephemeris_t e[32];
+    u8 n = 0;
+    int n_read = cfs_read(fd, e, sizeof(e)) / (int)sizeof(ephemeris_t);
+    chMtxLock(&es_mutex);
+    for (u8 prn=0; prn<n_read; prn++) {
+      if (e[prn].valid) {
+        memcpy(&es[prn], &e[prn], sizeof(ephemeris_t));
+        n++;
+      }
+    }
+    chMtxUnlock();
+    cfs_close(fd);
+    printf("Loaded %d ephemerides from flash\n", n);
+  } else {
+    printf("No ephemeris file present in flash, create an empty one\n");
+    cfs_coffee_reserve("ephem", 32*sizeof(ephemeris_t));
+    cfs_coffee_configure_log("ephem", 256, sizeof(ephemeris_t));
+    /* Fill with invalid records so that ephemerides can be saved to any
+     * PRN's slot. */
+    static const ephemeris_t e_invalid;
+    fd = cfs_open("ephem", CFS_WRITE);
+    if (fd != -1) {
+      for (u8 prn=0; prn<32; prn++)
+        cfs_write(fd, (void *)&e_invalid, sizeof(e_invalid));
+      cfs_close(fd);
+    }
+  }
+
+  fd = cfs_open(HOTSTART_FILE, CFS_READ);
+  if (fd != -1) {
+    hotstart_state_t s;
+    if (cfs_read(fd, &s, sizeof(s)) == sizeof(s) &&
+        s.version == HOTSTART_VERSION) {
+      clock_state.clock_period = s.clock_period;
+      set_time(TIME_GUESS, s.t);
+      hint_mask = s.prn_mask;
+      memcpy(hint_doppler, s.doppler, sizeof(hint_doppler));
+      printf("Loaded hot start state from flash, %d PRN hints\n",
+             __builtin_popcount(hint_mask));
+    } else {
+      printf("Loaded hot start state from file invalid\n");
+    }
+    cfs_close(fd);
+  } else {
+    printf("No hot start file present in flash, create an empty one\n");
+    cfs_coffee_reserve(HOTSTART_FILE, sizeof(hotstart_state_t));
+    cfs_coffee_configure_log(HOTSTART_FILE, 256, sizeof(hotstart_state_t));
+  }
+}
+
+/** Save the clock estimate and the set of tracked satellites to file.
+ * Only saves once the time is known precisely, otherwise there is nothing
+ * worth keeping. */
+void hotstart_save(void)
+{
+  if (time_quality != TIME_FINE)
+    return;
+
+  hotstart_state_t s;
+  memset(&s, 0, sizeof(s));
+  s.version = HOTSTART_VERSION;
+  s.t = get_current_time();
+  s.clock_period = clock_state.clock_period;
+  for (u8 i=0; i<nap_track_n_channels; i++) {
+    tracking_channel_snapshot_t snap;
+    tracking_channel_snapshot(i, &snap);
+    if (snap.state == TRACKING_RUNNING) {
+      s.prn_mask |= (u32)1 << snap.prn;
+      s.doppler[snap.prn] = snap.carrier_freq;
+    }
+  }
+
+  persist_write(HOTSTART_FILE, 0, &s, sizeof(s));
+}
+
+/** Save a newly decoded ephemeris to file.
+ * \param prn PRN (0-31).
+ * \param e   Ephemeris to save.
+ */
+void hotstart_save_ephemeris(u8 prn, const ephemeris_t *e)
+{
+  persist_write("ephem", prn*sizeof(ephemeris_t), e, sizeof(ephemeris_t));
+}
+
+/** Check if a PRN was being tracked before the last reset.
+ * \param prn     PRN (0-31).
+ * \param doppler Carrier freq the PRN was last tracked at, (Hz).
+ * \return true if the PRN is a hot start acquisition hint.
+ */
+bool hotstart_prn_hint(u8 prn, float *doppler)
+{
+  if (!(hint_mask & ((u32)1 << prn)))
+    return false;
+  *doppler = hint_doppler[prn];
+  return true;
+}
+
+/** Drop the hot start acquisition hint for a PRN once it has been used. */
+void hotstart_clear_hint(u8 prn)
+{
+  hint_mask &= ~((u32)1 << prn);
+}
+
+/** \} */
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef SWIFTNAV_HOTSTART_H
+#define SWIFTNAV_HOTSTART_H
+
+#include <libswiftnav/common.h>
+#include <libswiftnav/ephemeris.h>
+#include <libswiftnav/gpstime.h>
+
+/** \addtogroup hotstart
+ * \{ */
+
+/** Period between hot start state saves, (minutes). */
+#define HOTSTART_SAVE_PERIOD 10
+
+/** Bump when the layout of hotstart_state_t changes. */
+#define HOTSTART_VERSION 1
+
+/** Receiver state saved for a hot start, ephemerides are stored separately. */
+typedef struct {
+  u32 version;           /**< HOTSTART_VERSION of the saved state. */
+  gps_time_t t;          /**< GPS time the state was saved. */
+  double clock_period;   /**< Receiver clock period estimate, (s). */
+  u32 prn_mask;          /**< PRNs being tracked when saved, bit n is PRN n+1. */
+  float doppler[32];     /**< Carrier freq of the tracked PRNs, (Hz). */
+} hotstart_state_t;
+
+/** \} */
+
+void hotstart_setup(void);
+void hotstart_save(void);
+void hotstart_save_ephemeris(u8 prn, const ephemeris_t *e);
+bool hotstart_prn_hint(u8 prn, float *doppler);
+void hotstart_clear_hint(u8 prn);
+
+#endif  /* SWIFTNAV_HOTSTART_H */
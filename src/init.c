@@ -23,6 +23,7 @@
 #include "sbp.h"
 #include "error.h"
 #include "flash_callbacks.h"
+#include "ttff.h"
 
 /** Clock settings for 130.944 MHz from 16.368 MHz HSE. */
 const clock_scale_t hse_16_368MHz_in_130_944MHz_out_3v3 =
@@ -69,7 +70,13 @@ static void reset_callback_register(void)
   );
 }
 
-void init(u8 check_fpga_auth)
+/** First stage of hardware initialization.
+ * Starts the FPGA configuring and brings up the SBP layer so that messages
+ * can be queued while it does. The caller may then do anything that doesn't
+ * need SPI2, the NAP or the final system clock (e.g. reading settings out of
+ * the STM flash) before calling init_finish().
+ */
+void init_start(void)
 {
   /* Delay on start-up as some programmers reset the STM twice. */
   for (u32 i = 0; i < 600000; i++)
@@ -77,14 +84,30 @@ void init(u8 check_fpga_auth)
 
   led_setup();
 
+  nap_conf_start();
+
+  /* Sender ID is filled in once it can be read out of the FPGA flash,
+   * anything sent before then only goes out on the FTDI port. */
+  sbp_setup(0);
+}
+
+/** Second stage of hardware initialization.
+ * Waits for the FPGA to finish configuring and sets up everything that
+ * depends on it.
+ *
+ * \param check_fpga_auth Die if the NAP authentication hash doesn't match
+ */
+void init_finish(u8 check_fpga_auth)
+{
   nap_setup();
+  ttff_nap_configured();
 
   s32 serial_number = nap_conf_rd_serial_number();
   if (serial_number < 0) {
     /* TODO: Handle this properly! */
     serial_number = 0x2222;
   }
-  sbp_setup(serial_number);
+  sbp_set_sender_id(serial_number);
 
   /* Check NAP verification status. */
   if (check_fpga_auth) {
@@ -102,6 +125,14 @@ void init(u8 check_fpga_auth)
   stm_unique_id_callback_register();
 }
 
+/** Piksi hardware initialization, without anything between init_start()
+ * and init_finish(). */
+void init(u8 check_fpga_auth)
+{
+  init_start();
+  init_finish(check_fpga_auth);
+}
+
 /** Our own basic implementation of sbrk().
  * This overrides the version provided by newlib/libnosys which now checks that
  * the heap_end pointer doesn't grow pass the stack pointer. Thats great except
@@ -112,10 +143,11 @@ void init(u8 check_fpga_auth)
  * \todo Re-implement stack pointer checking taking into account our memory
  *       layout.
  */
+extern char end; /* Set by linker.  */
+static char *heap_end;
+
 void *_sbrk (int incr)
 {
-  extern char   end; /* Set by linker.  */
-  static char * heap_end;
   char *        prev_heap_end;
 
   if (heap_end == 0)
@@ -128,3 +160,9 @@ void *_sbrk (int incr)
   return (void *)prev_heap_end;
 }
 
+/** Size the heap has grown to, (bytes). */
+u32 heap_size(void)
+{
+  return heap_end ? heap_end - &end : 0;
+}
+
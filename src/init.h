@@ -20,7 +20,10 @@ extern const clock_scale_t hse_16_368MHz_in_65_472MHz_out_3v3;
 extern const clock_scale_t hse_16_368MHz_in_130_944MHz_out_3v3;
 extern const clock_scale_t hse_16_368MHz_in_120_203MHz_out_3v3;
 
+void init_start(void);
+void init_finish(u8 check_fpga_auth);
 void init(u8 check_fpga_auth);
+u32 heap_size(void);
 
 #endif
 
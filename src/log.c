@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdio.h>
+
+#include <ch.h>
+
+#include "log.h"
+
+/** \defgroup log Deferred logging
+ * Logging from time critical code.
+ * printf() formats with newlib and queues a MSG_PRINT with the kernel locked,
+ * too expensive for the NAP interrupt thread and the acquisition and tracking
+ * loops. Instead LOG_DEFERRED() only stores the format string pointer and the
+ * raw argument words in a ring, reserving an entry with a compare and swap
+ * so it never blocks or disables interrupts. A low priority thread drains the
+ * ring and does the actual printf().
+ * \{ */
+
+#define LOG_THREAD_PRIORITY (LOWPRIO+2)
+#define LOG_THREAD_STACK    1024
+
+static log_entry_t log_ring[LOG_RING_LEN];
+/** Index of the next entry to reserve, advanced by the writers. */
+static volatile u32 log_head = 0;
+/** Index of the next entry to drain, only advanced by the log thread. */
+static volatile u32 log_tail = 0;
+/** Messages lost because the ring was full. */
+static volatile u32 log_dropped = 0;
+
+/** Add a message to the log ring, use the LOG_DEFERRED() macro instead.
+ * If the ring is full the message is dropped and counted.
+ *
+ * \param fmt printf format string, must stay valid until drained.
+ * \param a0  First argument word.
+ * \param a1  Second argument word.
+ * \param a2  Third argument word.
+ * \param a3  Fourth argument word.
+ */
+void log_deferred(const char *fmt, u32 a0, u32 a1, u32 a2, u32 a3)
+{
+  u32 head;
+  do {
+    head = log_head;
+    if (head - log_tail >= LOG_RING_LEN) {
+      __sync_fetch_and_add(&log_dropped, 1);
+      return;
+    }
+  } while (!__sync_bool_compare_and_swap(&log_head, head, head + 1));
+
+  log_entry_t *e = &log_ring[head & (LOG_RING_LEN - 1)];
+  e->args[0] = a0;
+  e->args[1] = a1;
+  e->args[2] = a2;
+  e->args[3] = a3;
+  /* Publish the entry only once its arguments are in place. */
+  __sync_synchronize();
+  e->fmt = fmt;
+}
+
+/** Format and send every complete entry in the log ring. */
+static void log_drain(void)
+{
+  u32 dropped = __sync_lock_test_and_set(&log_dropped, 0);
+  if (dropped)
+    printf("(%u log messages dropped)\n", (unsigned int)dropped);
+
+  while (log_tail != log_head) {
+    log_entry_t *e = &log_ring[log_tail & (LOG_RING_LEN - 1)];
+    const char *fmt = e->fmt;
+    if (fmt == NULL)
+      /* Reserved but still being written, pick it up next time. */
+      break;
+
+    log_entry_t entry = *e;
+    e->fmt = NULL;
+    __sync_synchronize();
+    log_tail++;
+
+    printf(fmt, entry.args[0], entry.args[1], entry.args[2], entry.args[3]);
+  }
+}
+
+static WORKING_AREA_CCM(wa_log_thread, LOG_THREAD_STACK);
+static msg_t log_thread(void *arg)
+{
+  (void)arg;
+  chRegSetThreadName("log");
+
+  while (TRUE) {
+    chThdSleepMilliseconds(LOG_DRAIN_PERIOD_MS);
+    log_drain();
+  }
+
+  return 0;
+}
+
+/** Start the thread that drains the log ring. */
+void log_setup(void)
+{
+  chThdCreateStatic(wa_log_thread, sizeof(wa_log_thread),
+                    LOG_THREAD_PRIORITY, log_thread, NULL);
+}
+
+/** \} */
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef SWIFTNAV_LOG_H
+#define SWIFTNAV_LOG_H
+
+#include <libswiftnav/common.h>
+
+/** \addtogroup log
+ * \{ */
+
+/** Number of entries in the log ring, must be a power of two. */
+#define LOG_RING_LEN 32
+/** Maximum number of arguments to a deferred log message. */
+#define LOG_N_ARGS 4
+
+/** How often the log thread drains the ring. (ms) */
+#define LOG_DRAIN_PERIOD_MS 50
+
+/** A log message waiting to be formatted. */
+typedef struct {
+  const char *fmt;      /**< Format string, NULL while the entry is written. */
+  u32 args[LOG_N_ARGS]; /**< Raw argument words. */
+} log_entry_t;
+
+/** Log a message from a time critical path.
+ * Takes a printf format string literal and up to LOG_N_ARGS integer or
+ * pointer arguments, which are stored as raw words in the log ring. The
+ * message is formatted and sent later by the low priority log thread. Safe to
+ * call from any thread or ISR.
+ *
+ * Floating point arguments aren't supported, convert them to integers first.
+ */
+#define LOG_DEFERRED(...) LOG_DEFERRED_(__VA_ARGS__, 0, 0, 0, 0)
+#define LOG_DEFERRED_(fmt, a0, a1, a2, a3, ...) \
+  log_deferred((fmt), (u32)(a0), (u32)(a1), (u32)(a2), (u32)(a3))
+
+/** \} */
+
+void log_deferred(const char *fmt, u32 a0, u32 a1, u32 a2, u32 a3);
+void log_setup(void);
+
+#endif  /* SWIFTNAV_LOG_H */
@@ -24,22 +24,34 @@
 #include "board/max2769.h"
 #include "sbp.h"
 #include "init.h"
+#include "log.h"
+#include "main.h"
 #include "manage.h"
 #include "track.h"
+#include "corr_trace.h"
 #include "timing.h"
 #include "solution.h"
+#include "rtcm.h"
+#include "cw.h"
+#include "persist.h"
 #include "position.h"
+#include "hotstart.h"
 #include "system_monitor.h"
+#include "debug_var.h"
 #include "simulator.h"
+#include "orbit_cache.h"
+#include "eph_share.h"
+#include "obs_resend.h"
+#include "agnss.h"
+#include "flash_log.h"
 #include "settings.h"
+#include "ttff.h"
 
-#if !defined(SYSTEM_CLOCK)
-#define SYSTEM_CLOCK 130944000
-#endif
-
-/* TODO: Think about thread safety when updating ephemerides. */
+/** Ephemerides indexed by PRN, updated by the nav msg thread.
+ * Hold es_mutex while reading more than a single field so an ephemeris can't
+ * be swapped out part way through. */
 ephemeris_t es[32] _CCM;
-ephemeris_t es_old[32] _CCM;
+MUTEX_DECL(es_mutex);
 
 /* Required by exit() which is called from BLAS/LAPACK. */
 void _fini(void)
@@ -47,62 +59,97 @@ void _fini(void)
   return;
 }
 
+/* Nav message bit decoding, kept out of the NAP ISR thread's 1 kHz updates.
+ * Above the manage threads, which start tracking channels, see
+ * tracking_nav_bits_process(). */
+static WORKING_AREA_CCM(wa_nav_bit_thread, 1000);
+static msg_t nav_bit_thread(void *arg)
+{
+  (void)arg;
+  chRegSetThreadName("nav bit");
+  while (TRUE) {
+    chThdSleepMilliseconds(NAV_BIT_PERIOD_MS);
+    tracking_nav_bits_process();
+  }
+
+  return 0;
+}
+
 static WORKING_AREA_CCM(wa_nav_msg_thread, 3000);
 static msg_t nav_msg_thread(void *arg)
 {
   (void)arg;
   chRegSetThreadName("nav msg");
   while (TRUE) {
-    chThdSleepMilliseconds(1000);
-
-    /* Check if there is a new nav msg subframe to process.
-     * TODO: move this into a function */
-
-    /* TODO: This should be trigged by a semaphore from the tracking loop, not
-     * just ran periodically. */
-
-    memcpy(es_old, es, sizeof(es));
-
-    for (u8 i=0; i<nap_track_n_channels; i++) {
-      if (tracking_channel[i].state == TRACKING_RUNNING &&
-          tracking_channel[i].nav_msg.subframe_start_index) {
-
-        __asm__("CPSID i;");
-        s8 ret = process_subframe(&tracking_channel[i].nav_msg,
-                                  &es[tracking_channel[i].prn]);
-        __asm__("CPSIE i;");
-
-        if (ret < 0)
-          printf("PRN %02d ret %d\n", tracking_channel[i].prn+1, ret);
-
-        if (ret == 1 && !es[tracking_channel[i].prn].healthy)
-          printf("PRN %02d unhealthy\n", tracking_channel[i].prn+1);
-
-        if (memcmp(&es[tracking_channel[i].prn],
-                   &es_old[tracking_channel[i].prn], sizeof(ephemeris_t))) {
-
-          printf("New ephemeris for PRN %02d\n", tracking_channel[i].prn+1);
-
-          /* TODO: This is a janky way to set the time... */
-          gps_time_t t;
-          t.wn = es[tracking_channel[i].prn].toe.wn;
-          t.tow = tracking_channel[i].TOW_ms / 1000.0;
-          if (gpsdifftime(t, es[tracking_channel[i].prn].toe) > 2*24*3600)
-            t.wn--;
-          else if (gpsdifftime(t, es[tracking_channel[i].prn].toe) < 2*24*3600)
-            t.wn++;
-          /*set_time(TIME_COARSE, t);*/
-
-        }
+    eph_share_poll();
+    s8 i = tracking_wait_subframe(MS2ST(EPH_SHARE_POLL_MS));
+    if (i < 0)
+      continue;
+
+    /* The channel may have been dropped since the subframe was received. */
+    tracking_channel_t *chan = &tracking_channel[i];
+    if (chan->state != TRACKING_RUNNING || !chan->nav_msg.subframe_start_index)
+      continue;
+
+    /* No need to mask interrupts whilst decoding, the tracking loop only
+     * appends bits past the end of the ready subframe and won't search for
+     * another preamble until process_subframe() clears subframe_start_index.
+     * Decode into a staging copy so readers never see a half updated
+     * ephemeris. */
+    u8 prn = chan->prn;
+    static ephemeris_t e;
+    memcpy(&e, &es[prn], sizeof(e));
+    s8 ret = process_subframe(&chan->nav_msg, &e);
+
+    if (ret < 0)
+      printf("PRN %02d ret %d\n", prn+1, ret);
+
+    if (ret == 1 && !e.healthy)
+      printf("PRN %02d unhealthy\n", prn+1);
+
+    if (memcmp(&e, &es[prn], sizeof(e))) {
+      chMtxLock(&es_mutex);
+      memcpy(&es[prn], &e, sizeof(e));
+      orbit_cache_invalidate(prn);
+      chMtxUnlock();
+      tracking_events_broadcast(TRACKING_EVENT_EPHEMERIS);
+
+      printf("New ephemeris for PRN %02d\n", prn+1);
+      if (e.valid) {
+        hotstart_save_ephemeris(prn, &e);
+        eph_share_send(prn, &e);
+        ttff_mark(TTFF_EPHEMERIS);
       }
+
+      /* TODO: This is a janky way to set the time... */
+      gps_time_t t;
+      t.wn = e.toe.wn;
+      t.tow = chan->TOW_ms / 1000.0;
+      if (gpsdifftime(t, e.toe) > 2*24*3600)
+        t.wn--;
+      else if (gpsdifftime(t, e.toe) < 2*24*3600)
+        t.wn++;
+      /*set_time(TIME_COARSE, t);*/
     }
   }
 
   return 0;
 }
 
+/** Zero the sections of data placed outside .bss, see STM32F405xG.ld. */
+static void ram_sections_init(void)
+{
+  extern u8 __ccmhot_start__[], __ccmhot_end__[];
+  extern u8 __dmaram_start__[], __dmaram_end__[];
+
+  memset(__ccmhot_start__, 0, __ccmhot_end__ - __ccmhot_start__);
+  memset(__dmaram_start__, 0, __dmaram_end__ - __dmaram_start__);
+}
+
 int main(void)
 {
+  ram_sections_init();
+
   /* Initialise SysTick timer that will be used as the ChibiOS kernel tick
    * timer. */
   STBase->RVR = SYSTEM_CLOCK / CH_FREQUENCY - 1;
@@ -113,10 +160,19 @@ int main(void)
    * is active. */
   chSysInit();
 
-  /* Piksi hardware initialization. */
-  init(1);
+  /* Piksi hardware initialization. Boot is ordered so that whatever doesn't
+   * need SPI2, the NAP or the final clock runs while the FPGA configures. */
+  init_start();
+
+  /* Settings only need the STM flash. Loading them also builds the CFS name
+   * index so later file lookups are cheap. */
   settings_setup();
+
+  init_finish(1);
+
   usarts_setup();
+  log_setup();
+  sbp_rate_setup();
 
 
   static char nap_version_string[64] = {0};
@@ -127,12 +183,25 @@ int main(void)
 
   max2769_setup();
   timing_setup();
+  persist_setup();
+  /* Before position_setup() so that the more recent hot start time is the
+   * one used as the time guess. */
+  hotstart_setup();
   position_setup();
 
   manage_acq_setup();
   manage_track_setup();
+  tracking_setup();
+  corr_trace_setup();
   system_monitor_setup();
+  debug_var_setup();
   solution_setup();
+  eph_share_setup();
+  obs_resend_setup();
+  agnss_setup();
+  flash_log_setup();
+  rtcm_setup();
+  cw_setup();
 
   simulator_setup();
 
@@ -161,6 +230,8 @@ int main(void)
                       TYPE_INT);
   READ_ONLY_PARAMETER("system_info", "nap_taps", nap_acq_n_taps, TYPE_INT);
 
+  chThdCreateStatic(wa_nav_bit_thread, sizeof(wa_nav_bit_thread),
+                    NORMALPRIO+1, nav_bit_thread, NULL);
   chThdCreateStatic(wa_nav_msg_thread, sizeof(wa_nav_msg_thread),
                     NORMALPRIO-1, nav_msg_thread, NULL);
 
@@ -170,6 +241,9 @@ int main(void)
 
   while (1) {
     chThdSleepSeconds(60);
+    DO_EVERY(HOTSTART_SAVE_PERIOD,
+      hotstart_save();
+    );
   }
 }
 
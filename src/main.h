@@ -17,6 +17,11 @@
 
 #define SAMPLE_FREQ 16368000
 
+/** CPU clock, also the rate of the DWT cycle counter. (Hz) */
+#if !defined(SYSTEM_CLOCK)
+#define SYSTEM_CLOCK 130944000
+#endif
+
 /* See http://c-faq.com/cpp/multistmt.html for
  * and explaination of the do {} while(0)
  */
@@ -19,18 +19,27 @@
 #include <libswiftnav/almanac.h>
 #include <libswiftnav/constants.h>
 #include <libswiftnav/coord_system.h>
+#include <libswiftnav/linear_algebra.h>
 #include <libswiftnav/sbp.h>
 
 #include "main.h"
 #include "board/nap/track_channel.h"
 #include "board/nap/acq_channel.h"
 #include "acq.h"
+#include "cw.h"
 #include "track.h"
+#include "timebase.h"
 #include "timing.h"
 #include "position.h"
 #include "manage.h"
+#include "log.h"
+#include "hotstart.h"
+#include "persist.h"
 #include "nmea.h"
 #include "sbp.h"
+#include "settings.h"
+#include "signal.h"
+#include "ttff.h"
 #include "cfs/cfs.h"
 #include "cfs/cfs-coffee.h"
 
@@ -45,8 +54,66 @@
 acq_prn_t acq_prn_param[32];
 almanac_t almanac[32];
 
+extern ephemeris_t es[32];
+extern Mutex es_mutex;
+
 acq_manage_t acq_manage;
 
+/** Re-acquisition cache, updated by manage_track() while a PRN is tracked
+ * with good SNR. Accessed from both manage threads, copy with the system
+ * locked. */
+static acq_reacq_t reacq_cache[32];
+
+/** Almanac prediction for a PRN, see manage_vis_refresh(). */
+typedef struct {
+  bool valid;
+  double az;        /**< Azimuth at vis_t, (rad). */
+  double el;        /**< Elevation at vis_t, (rad). */
+  double dopp;      /**< Carrier Doppler at vis_t, (Hz). */
+  double dopp_rate; /**< Carrier Doppler rate, (Hz/s). */
+} manage_vis_t;
+
+/** Satellite visibility cache. Elevations and Doppler change over minutes so
+ * they are predicted from the almanac every MANAGE_VIS_PERIOD rather than on
+ * every pass of the acquisition manager, the Doppler is extrapolated in
+ * between. Only used by the acquisition thread. */
+static manage_vis_t vis_cache[32];
+/** Time and position the cache was predicted for. */
+static gps_time_t vis_t;
+static double vis_ecef[3];
+static bool vis_valid = false;
+/** PRNs whose almanac has changed since they were predicted, set by
+ * almanac_callback(). */
+static sid_set_t vis_stale;
+/** PRNs with a valid almanac, the ones manage_vis_refresh() predicts. */
+static sid_set_t vis_alm;
+
+/** PRNs in the ACQ_PRN_UNTRIED and ACQ_PRN_TRIED states, so that choosing a
+ * batch only looks at the PRNs that can be searched. Kept in step with
+ * acq_prn_param by manage_prn_state(). Both manage threads change PRN
+ * states, access with the system locked, see manage_prn_set(). */
+static sid_set_t acq_untried;
+static sid_set_t acq_tried;
+
+/** Number of PRNs searched against each acquisition sample ram load. */
+static u8 acq_batch_size = 1;
+/** Run the fine search on the sample ram load used for the coarse search
+ * instead of loading fresh samples. */
+static bool acq_fine_reuse_load = false;
+/** Stop coarse searches once the peak to mean power ratio exceeds this, 0
+ * searches the whole range. */
+static float acq_early_exit_snr = ACQ_EARLY_EXIT_SNR;
+/** Number of extra sample ram loads searched to confirm a marginal PRN, 0
+ * drops PRNs below ACQ_THRESHOLD straight away. */
+static u8 acq_dwell_count = ACQ_DWELL_COUNT;
+/** Favour PRNs that can go straight into a solution, see
+ * manage_acq_choose_batch(). Otherwise PRNs are searched by elevation. */
+static bool acq_score_usable = true;
+
+/** Multi-dwell accumulations for the batch PRNs with acq_manage_cand_t.dwell
+ * set, indexed the same as acq_manage.cands. */
+static acq_dwell_t acq_dwell[ACQ_MANAGE_BATCH_MAX];
+
 sbp_msg_callbacks_node_t almanac_callback_node;
 void almanac_callback(u16 sender_id, u8 len, u8 msg[], void* context)
 {
@@ -54,32 +121,80 @@ void almanac_callback(u16 sender_id, u8 len, u8 msg[], void* context)
 
   almanac_t *new_almanac = (almanac_t*)msg;
 
+  if (!manage_almanac_set(new_almanac))
+    return;
+
   printf("Received alamanc for PRN %02d\n", new_almanac->prn);
-  memcpy(&almanac[new_almanac->prn-1], new_almanac, sizeof(almanac_t));
 
-  int fd = cfs_open("almanac", CFS_WRITE);
-  if (fd != -1) {
-    cfs_seek(fd, (new_almanac->prn-1)*sizeof(almanac_t), CFS_SEEK_SET);
-    if (cfs_write(fd, new_almanac, sizeof(almanac_t)) != sizeof(almanac_t))
-      printf("Error writing to almanac file\n");
-    else
-      printf("Saved almanac to flash\n");
-    cfs_close(fd);
-  } else {
-    printf("Error opening almanac file\n");
-  }
+  persist_write("almanac", (new_almanac->prn-1)*sizeof(almanac_t),
+                new_almanac, sizeof(almanac_t));
+}
+
+/** Move a PRN to a new acquisition state, keeping the state sets in step. */
+static void manage_prn_state(u8 prn, acq_prn_state_t state)
+{
+  u16 i = sid_to_index(sid_from_gps_prn(prn));
+  chSysLock();
+  acq_prn_param[prn].state = state;
+  sid_set_remove(&acq_untried, i);
+  sid_set_remove(&acq_tried, i);
+  if (state == ACQ_PRN_UNTRIED)
+    sid_set_add(&acq_untried, i);
+  else if (state == ACQ_PRN_TRIED)
+    sid_set_add(&acq_tried, i);
+  chSysUnlock();
+}
+
+/** Copy of one of the PRN state sets to loop over. */
+static sid_set_t manage_prn_set(const sid_set_t *s)
+{
+  chSysLock();
+  sid_set_t copy = *s;
+  chSysUnlock();
+  return copy;
+}
+
+/** Replace the almanac for a PRN and mark its visibility prediction stale.
+ * Doesn't save the almanac to flash.
+ * \param a Almanac, with the PRN (1-32) in its prn field.
+ * \return false if the PRN is out of range.
+ */
+bool manage_almanac_set(const almanac_t *a)
+{
+  if (a->prn < 1 || a->prn > NUM_SATS_GPS)
+    return false;
+
+  memcpy(&almanac[a->prn-1], a, sizeof(almanac_t));
+
+  chSysLock();
+  sid_set_add(&vis_stale, sid_to_index(sid_from_gps_prn(a->prn-1)));
+  chSysUnlock();
+  return true;
+}
+
+/** Return every PRN that was searched for without success to the untried
+ * pool, e.g. once new aiding narrows their search windows. */
+void manage_acq_retry_tried(void)
+{
+  sid_set_t tried = manage_prn_set(&acq_tried);
+  SID_SET_FOR_EACH(i, &tried)
+    manage_prn_state(sid_from_index(i).sat, ACQ_PRN_UNTRIED);
 }
 
 static WORKING_AREA_CCM(wa_manage_acq_thread, MANAGE_ACQ_THREAD_STACK);
 static msg_t manage_acq_thread(void *arg)
 {
-  /* TODO: This should be trigged by a semaphore from the acq ISR code, not
-   * just ran periodically. */
   (void)arg;
   chRegSetThreadName("manage acq");
   while (TRUE) {
-    chThdSleepMilliseconds(100);
+    /* The loading and running states block on the acq semaphores so the
+     * state machine advances as soon as the NAP is done, only idle when
+     * there was nothing to start. */
+    acq_manage_state_t prev_state = acq_manage.state;
     manage_acq();
+    if ((prev_state == ACQ_MANAGE_START || prev_state == ACQ_MANAGE_DISABLED) &&
+        prev_state == acq_manage.state)
+      chThdSleepMilliseconds(ACQ_MANAGE_IDLE_MS);
   }
 
   return 0;
@@ -87,8 +202,11 @@ static msg_t manage_acq_thread(void *arg)
 
 void manage_acq_setup()
 {
-  for (u8 prn=0; prn<32; prn++) {
-    acq_prn_param[prn].state = ACQ_PRN_UNTRIED;
+  /* Only use as many channels as the tracking loops can service. */
+  nap_track_n_channels = MIN(nap_track_n_channels, TRACK_MAX_N_CHANNELS);
+
+  for (u8 prn=0; prn<NUM_SATS_GPS; prn++) {
+    manage_prn_state(prn, ACQ_PRN_UNTRIED);
     acq_prn_param[prn].score = 0;
   }
 
@@ -107,6 +225,16 @@ void manage_acq_setup()
     }
   }
 
+  for (u8 prn=0; prn<NUM_SATS_GPS; prn++)
+    if (almanac[prn].valid)
+      sid_set_add(&vis_alm, sid_to_index(sid_from_gps_prn(prn)));
+
+  SETTING("acq", "batch_size", acq_batch_size, TYPE_INT);
+  SETTING("acq", "fine_reuse_load", acq_fine_reuse_load, TYPE_BOOL);
+  SETTING("acq", "early_exit_snr", acq_early_exit_snr, TYPE_FLOAT);
+  SETTING("acq", "dwells", acq_dwell_count, TYPE_INT);
+  SETTING("acq", "score_usable", acq_score_usable, TYPE_BOOL);
+
   sbp_register_cbk(
     MSG_ALMANAC,
     &almanac_callback,
@@ -121,24 +249,75 @@ void manage_acq_setup()
   );
 }
 
+/** Refresh the satellite visibility cache if it is due.
+ * Every PRN is predicted again once the cache is MANAGE_VIS_PERIOD old or
+ * the receiver has moved by more than MANAGE_VIS_MOVE_MAX, PRNs with a new
+ * almanac are predicted again straight away. Only PRNs with an almanac are
+ * visited.
+ *
+ * \param t Current GPS time.
+ */
+static void manage_vis_refresh(gps_time_t t)
+{
+  double dx[3];
+  vector_subtract(3, position_solution.pos_ecef, vis_ecef, dx);
+  bool due = !vis_valid ||
+             fabs(gpsdifftime(t, vis_t)) > MANAGE_VIS_PERIOD ||
+             vector_norm(3, dx) > MANAGE_VIS_MOVE_MAX;
+
+  chSysLock();
+  sid_set_t stale = vis_stale;
+  sid_set_clear(&vis_stale);
+  chSysUnlock();
+  if (due)
+    sid_set_union(&stale, &vis_alm);
+
+  if (due) {
+    vis_t = t;
+    memcpy(vis_ecef, position_solution.pos_ecef, sizeof(vis_ecef));
+    vis_valid = true;
+  }
+
+  SID_SET_FOR_EACH(i, &stale) {
+    u8 prn = sid_from_index(i).sat;
+    manage_vis_t *v = &vis_cache[prn];
+    v->valid = almanac[prn].valid;
+    if (!v->valid) {
+      sid_set_remove(&vis_alm, i);
+      continue;
+    }
+    sid_set_add(&vis_alm, i);
+
+    calc_sat_az_el_almanac(&almanac[prn], vis_t.tow, vis_t.wn-1024, vis_ecef, &v->az, &v->el);
+    v->dopp = -calc_sat_doppler_almanac(&almanac[prn], vis_t.tow, vis_t.wn, vis_ecef);
+    double dopp_1s = -calc_sat_doppler_almanac(&almanac[prn], vis_t.tow + 1, vis_t.wn, vis_ecef);
+    v->dopp_rate = dopp_1s - v->dopp;
+  }
+}
+
+/** Score the PRNs that could be searched next, see
+ * manage_acq_choose_batch(). */
 static void manage_calc_scores(void)
 {
-  double az, el;
   gps_time_t t;
 
-  if (time_quality != TIME_UNKNOWN)
+  if (time_quality != TIME_UNKNOWN &&
+      position_quality != POSITION_UNKNOWN) {
     t = get_current_time();
+    manage_vis_refresh(t);
+  }
 
-  for (u8 prn=0; prn<32; prn++) {
-    if (!almanac[prn].valid ||
+  sid_set_t untried = manage_prn_set(&acq_untried);
+  SID_SET_FOR_EACH(i, &untried) {
+    u8 prn = sid_from_index(i).sat;
+    if (!vis_cache[prn].valid ||
         time_quality == TIME_UNKNOWN ||
         position_quality == POSITION_UNKNOWN) {
       /* No almanac or position/time information, give it the benefit of the
        * doubt. */
       acq_prn_param[prn].score = 0;
     } else {
-      calc_sat_az_el_almanac(&almanac[prn], t.tow, t.wn-1024, position_solution.pos_ecef, &az, &el);
-      acq_prn_param[prn].score = (s8)(el/D2R);
+      acq_prn_param[prn].score = (s8)(vis_cache[prn].el/D2R);
 
       gps_time_t toa;
       toa.wn = almanac[prn].week + 1024;
@@ -159,180 +338,760 @@ static void manage_calc_scores(void)
   }
 }
 
-/** Manages acquisition searches and starts tracking channels after successful acquisitions. */
+/** Get a usable re-acquisition cache entry for a PRN.
+ *
+ * \param prn   PRN (0-31).
+ * \param entry Copy of the cache entry, only valid if true is returned.
+ * \return true if the PRN has a cache entry no older than ACQ_REACQ_MAX_AGE.
+ */
+static bool manage_reacq_get(u8 prn, acq_reacq_t *entry)
+{
+  chSysLock();
+  *entry = reacq_cache[prn];
+  chSysUnlock();
+
+  return entry->valid &&
+         (u32)timebase_now() - entry->sample_count <
+           (u32)ACQ_REACQ_MAX_AGE*SAMPLE_FREQ;
+}
+
+/** Record the current state of a tracking channel in the re-acquisition
+ * cache, estimating the Doppler rate from the previous entry. */
+static void manage_reacq_update(u8 channel)
+{
+  tracking_channel_snapshot_t snap;
+  tracking_channel_snapshot(channel, &snap);
+
+  acq_reacq_t entry;
+  acq_reacq_t prev;
+  bool have_prev = manage_reacq_get(snap.prn, &prev);
+
+  entry.valid = true;
+  entry.sample_count = snap.sample_count;
+  /* Channel samples are counted to an early code rollover, the prompt
+   * (acquisition) code phase is half a chip behind. */
+  entry.code_phase = 1023.0 - 0.5 +
+    (float)snap.code_phase_early / NAP_TRACK_CODE_PHASE_UNITS_PER_CHIP;
+  if (entry.code_phase >= 1023.0)
+    entry.code_phase -= 1023.0;
+  entry.carrier_freq = snap.carrier_freq;
+  entry.carrier_freq_rate = 0;
+  if (have_prev && snap.sample_count != prev.sample_count) {
+    float dt = (float)(snap.sample_count - prev.sample_count) / SAMPLE_FREQ;
+    entry.carrier_freq_rate = (entry.carrier_freq - prev.carrier_freq) / dt;
+  }
+
+  chSysLock();
+  reacq_cache[snap.prn] = entry;
+  chSysUnlock();
+}
+
+/** Ephemeris freshness of every PRN, how soon it could be used in a
+ * solution once acquired.
+ *
+ * \param fresh Set to 1 for an ephemeris at its toe, falling to 0 at the end
+ *              of its fit interval, or -1 if there is no usable ephemeris and
+ *              the PRN would have to be tracked for at least three subframes
+ *              first. An ephemeris with the time unknown counts as 0.
+ * \return Number of tracking channels currently usable in a solution.
+ */
+static u8 manage_eph_fresh(float fresh[NUM_SATS_GPS])
+{
+  bool have_time = time_quality != TIME_UNKNOWN;
+  gps_time_t t;
+  if (have_time)
+    t = get_current_time();
+
+  chMtxLock(&es_mutex);
+  for (u8 prn=0; prn<NUM_SATS_GPS; prn++) {
+    const ephemeris_t *e = &es[prn];
+    fresh[prn] = -1;
+    if (!e->valid || !e->healthy)
+      continue;
+    if (!have_time) {
+      fresh[prn] = 0;
+      continue;
+    }
+    double age = fabs(gpsdifftime(t, e->toe));
+    if (age < EPHEMERIS_FIT_INTERVAL)
+      fresh[prn] = 1 - age / EPHEMERIS_FIT_INTERVAL;
+  }
+  chMtxUnlock();
+
+  u8 n_usable = 0;
+  for (u8 i=0; i<nap_track_n_channels; i++)
+    if (use_tracking_channel(i))
+      n_usable++;
+  return n_usable;
+}
+
+/** Add a PRN's line of sight to a geometry information matrix, G' * G of
+ * the position solution in the local level frame.
+ * \return false if the PRN's direction isn't known.
+ */
+static bool manage_geom_add(double GtG[4][4], u8 prn)
+{
+  const manage_vis_t *v = &vis_cache[prn];
+  if (!v->valid)
+    return false;
+
+  double g[4] = {
+    cos(v->el) * sin(v->az),
+    cos(v->el) * cos(v->az),
+    sin(v->el),
+    1
+  };
+  for (u8 r=0; r<4; r++)
+    for (u8 c=0; c<4; c++)
+      GtG[r][c] += g[r] * g[c];
+  return true;
+}
+
+/** Fraction of the GDOP squared a PRN would remove if added to a geometry,
+ * 0 to 1. With P = inverse(G' * G) and g the PRN's geometry row the
+ * reduction in trace(P) is g' * P * P * g / (1 + g' * P * g).
+ * \return Fraction, or 0 if the PRN's direction isn't known.
+ */
+static float manage_geom_gain(double P[4][4], u8 prn)
+{
+  double GtG[4][4];
+  memset(GtG, 0, sizeof(GtG));
+  if (!manage_geom_add(GtG, prn))
+    return 0;
+
+  /* manage_geom_add() left g * g' with g[3] = 1, so the last column is g. */
+  double Pg[4];
+  double gPg = 0, PgPg = 0, trace = 0;
+  for (u8 r=0; r<4; r++) {
+    Pg[r] = 0;
+    for (u8 c=0; c<4; c++)
+      Pg[r] += P[r][c] * GtG[c][3];
+    gPg += GtG[r][3] * Pg[r];
+    PgPg += Pg[r] * Pg[r];
+    trace += P[r][r];
+  }
+  return PgPg / (1 + gPg) / trace;
+}
+
+/** Choose the next batch of PRNs to search.
+ * Candidates are taken in descending acq_prn_param score order, skipping PRNs
+ * that are already tracked or were already tried, up to the acquisition batch
+ * size or the number of free tracking channels, whichever is smaller. PRNs
+ * with a usable re-acquisition cache entry come first as they only need a
+ * narrow search, followed by PRNs that were tracked before a hot start.
+ *
+ * With acq_score_usable set the elevation score also gains a bonus for PRNs
+ * that could go straight into a solution, scaled by the freshness of their
+ * ephemeris, and one for how much they would improve the GDOP of the PRNs
+ * already tracked or chosen for the batch. The ephemeris bonus dominates the
+ * elevation until ACQ_SCORE_USABLE_MIN channels are usable, so a first fix
+ * isn't held up tracking PRNs whose ephemeris still has to be decoded.
+ *
+ * \param n_free Number of free tracking channels.
+ * \return Number of PRNs placed in the batch.
+ */
+static u8 manage_acq_choose_batch(u8 n_free)
+{
+  u8 n_max = MIN(MIN(MAX(acq_batch_size, 1), ACQ_MANAGE_BATCH_MAX), n_free);
+  u8 n = 0;
+  sid_set_t untried = manage_prn_set(&acq_untried);
+
+  float fresh[NUM_SATS_GPS];
+  float eph_bonus = 0;
+  /* Geometry of the tracked PRNs, with a weak prior in every direction so
+   * the information matrix is invertible before there are four of them. */
+  double GtG[4][4];
+  memset(GtG, 0, sizeof(GtG));
+  if (acq_score_usable) {
+    u8 n_usable = manage_eph_fresh(fresh);
+    eph_bonus = n_usable < ACQ_SCORE_USABLE_MIN ?
+                ACQ_SCORE_EPH_NEEDED : ACQ_SCORE_EPH;
+    for (u8 i=0; i<4; i++)
+      GtG[i][i] = ACQ_SCORE_GEOM_PRIOR;
+    for (u8 i=0; i<nap_track_n_channels; i++)
+      if (tracking_channel[i].state == TRACKING_RUNNING)
+        manage_geom_add(GtG, tracking_channel[i].prn);
+  }
+
+  while (n < n_max) {
+    double P[4][4];
+    bool have_geom = acq_score_usable &&
+      matrix_inverse(4, (const double *)GtG, (double *)P) >= 0;
+
+    s8 best_prn = -1;
+    s16 best_score = -1;
+    SID_SET_FOR_EACH(i, &untried) {
+      u8 prn = sid_from_index(i).sat;
+      if (acq_prn_param[prn].score < 0)
+        continue;
+      acq_reacq_t entry;
+      float hint_dopp;
+      s16 score = acq_prn_param[prn].score;
+      if (acq_score_usable && fresh[prn] >= 0)
+        score += eph_bonus * (0.5 + 0.5 * fresh[prn]);
+      if (have_geom)
+        score += ACQ_SCORE_GEOM * manage_geom_gain(P, prn);
+      if (manage_reacq_get(prn, &entry))
+        score += 256;
+      else if (hotstart_prn_hint(prn, &hint_dopp))
+        score += 128;
+      if (score > best_score) {
+        best_prn = prn;
+        best_score = score;
+      }
+    }
+    if (best_prn < 0)
+      break;
+
+    manage_prn_state(best_prn, ACQ_PRN_ACQUIRING);
+    sid_set_remove(&untried, sid_to_index(sid_from_gps_prn(best_prn)));
+    acq_manage.cands[n++].prn = best_prn;
+    /* Later picks should fill in the sky around this one. */
+    if (acq_score_usable)
+      manage_geom_add(GtG, best_prn);
+  }
+
+  return n;
+}
+
+/** Abandon the current batch and return all of its PRNs to the untried pool. */
+static void manage_acq_abort_batch(void)
+{
+  for (u8 i=0; i<acq_manage.n_cands; i++)
+    manage_prn_state(acq_manage.cands[i].prn, ACQ_PRN_UNTRIED);
+  acq_manage.n_cands = 0;
+  acq_manage.state = ACQ_MANAGE_START;
+}
+
+/** Calculate an almanac aided carrier freq search window for a PRN.
+ * The window is centred on the almanac Doppler corrected for the receiver
+ * oscillator offset estimated from the PVT clock drift. Once the time is
+ * TIME_FINE, or an aiding bundle has given the drift, its width follows the
+ * clock estimate and position uncertainty, otherwise the oscillator offset
+ * is unknown and ACQ_AIDED_CF_WIDTH is used.
+ *
+ * \param prn    PRN (0-31).
+ * \param cf_min Lowest carrier freq to search, (Hz).
+ * \param cf_max Highest carrier freq to search, (Hz).
+ * \return true if an aided window could be calculated.
+ */
+static bool manage_acq_aided_window(u8 prn, float *cf_min, float *cf_max)
+{
+  if (!almanac[prn].valid || position_quality == POSITION_UNKNOWN ||
+      (time_quality != TIME_COARSE && time_quality != TIME_FINE))
+    return false;
+
+  gps_time_t t = rx2gpstime(acq_manage.coarse_timer_count);
+  manage_vis_refresh(t);
+  manage_vis_t *v = &vis_cache[prn];
+  if (!v->valid)
+    return false;
+  double dopp = v->dopp + v->dopp_rate * gpsdifftime(t, vis_t);
+  double width = ACQ_AIDED_CF_WIDTH;
+
+  double clock_sigma;
+  double drift = clock_drift_estimate(&clock_sigma);
+  if (time_quality == TIME_FINE || clock_sigma < ACQ_AIDED_DRIFT_SIGMA_MAX) {
+    /* A fast oscillator pulls every satellite down in frequency. */
+    dopp -= drift * GPS_L1_HZ;
+
+    double sigma_clock = MAX(clock_sigma * GPS_L1_HZ, ACQ_AIDED_CF_SIGMA_CLOCK);
+    double sigma_dopp = (position_quality >= POSITION_STATIC) ?
+                        ACQ_AIDED_CF_SIGMA_FIX : ACQ_AIDED_CF_SIGMA_GUESS;
+    width = 3*sqrt(sigma_clock*sigma_clock + sigma_dopp*sigma_dopp);
+    width = MIN(MAX(width, ACQ_FULL_CF_STEP), ACQ_AIDED_CF_WIDTH);
+  }
+
+  /*printf("Expecting PRN %02d @ %.1f +- %.0f\n", prn+1, dopp, width);*/
+  *cf_min = dopp - width;
+  *cf_max = dopp + width;
+  return true;
+}
+
+/** Start or collect the search for a batch PRN on an acquisition channel.
+ * \param chan Acquisition channel.
+ * \param i    Index into acq_manage.cands.
+ */
+typedef void (*manage_acq_search_fn)(u8 chan, u8 i);
+
+/** Searches of the current stage, see manage_acq_stage_begin(). */
+static struct {
+  manage_acq_search_fn start; /**< Starts a PRN's search. */
+  manage_acq_search_fn done;  /**< Collects a PRN's result, or NULL. */
+  bool dwell_only;            /**< Only search the PRNs being confirmed with
+                                   a multi-dwell search. */
+} acq_stage;
+
+/** Start the coarse search for a batch PRN against the loaded sample ram.
+ * If the PRN was tracked recently its last code phase and Doppler are
+ * propagated to the load time and only a narrow window around them is
+ * searched. A strong enough peak ends the search early, the fine search
+ * that follows refines it. */
+static void manage_acq_start_coarse(u8 chan, u8 i)
+{
+  acq_manage_cand_t *c = &acq_manage.cands[i];
+  acq_reacq_t entry;
+  float cf_min, cf_max;
+
+  nap_acq_code_wr_blocking(chan, c->prn);
+  acq_set_early_exit(acq_early_exit_snr);
+  ttff_acq_attempt(c->prn);
+  c->reacq = manage_reacq_get(c->prn, &entry);
+  if (c->reacq) {
+    u32 n_samples = acq_manage.coarse_timer_count - entry.sample_count;
+    float dt = (float)n_samples / SAMPLE_FREQ;
+    float cf = entry.carrier_freq + entry.carrier_freq_rate*dt;
+    /* Propagate with the mean Doppler over the gap. */
+    float cp = propagate_code_phase(entry.code_phase,
+                                    entry.carrier_freq + 0.5*entry.carrier_freq_rate*dt,
+                                    n_samples);
+    /* The window wraps around the end of the code, see acq_start(). */
+    acq_start(chan, c->prn,
+              cp-ACQ_REACQ_CP_WIDTH,
+              cp+ACQ_REACQ_CP_WIDTH,
+              cf-ACQ_REACQ_CF_WIDTH,
+              cf+ACQ_REACQ_CF_WIDTH, ACQ_FULL_CF_STEP);
+  } else if (manage_acq_aided_window(c->prn, &cf_min, &cf_max)) {
+    acq_start(chan, c->prn, 0, 1023, cf_min, cf_max, ACQ_FULL_CF_STEP);
+  } else if (hotstart_prn_hint(c->prn, &cf_min)) {
+    /* Only try the hot start Doppler once, fall back to a full search if
+     * the satellite isn't there anymore. */
+    hotstart_clear_hint(c->prn);
+    acq_start(chan, c->prn, 0, 1023,
+              cf_min-ACQ_AIDED_CF_WIDTH,
+              cf_min+ACQ_AIDED_CF_WIDTH, ACQ_FULL_CF_STEP);
+  } else {
+    acq_start(chan, c->prn, 0, 1023,
+        ACQ_FULL_CF_MIN,
+        ACQ_FULL_CF_MAX,
+        ACQ_FULL_CF_STEP);
+  }
+}
+
+/** Save the result of a batch PRN's coarse search. */
+static void manage_acq_coarse_done(u8 chan, u8 i)
+{
+  acq_manage_cand_t *c = &acq_manage.cands[i];
+  acq_get_results(chan, &c->coarse_cp, &c->coarse_cf, &c->coarse_snr);
+  LOG_DEFERRED("PRN %d coarse @ %d Hz, %d SNR\n", c->prn + 1,
+                                      (s32)c->coarse_cf,
+                                      (s32)c->coarse_snr);
+}
+
+/** Start the fine search for a batch PRN around its coarse result. */
+static void manage_acq_start_fine(u8 chan, u8 i)
+{
+  acq_manage_cand_t *c = &acq_manage.cands[i];
+  float fine_cp = propagate_code_phase(
+                    c->coarse_cp,
+                    c->coarse_cf,
+                    acq_manage.fine_timer_count - acq_manage.coarse_timer_count
+                  );
+  nap_acq_code_wr_blocking(chan, c->prn);
+  /* The fine search is narrow and looks for the best peak, search it all. */
+  acq_set_early_exit(0);
+  acq_start(chan, c->prn,
+            fine_cp-ACQ_FINE_CP_WIDTH,
+            fine_cp+ACQ_FINE_CP_WIDTH,
+            c->coarse_cf-ACQ_FINE_CF_WIDTH,
+            c->coarse_cf+ACQ_FINE_CF_WIDTH, ACQ_FINE_CF_STEP);
+}
+
+/** Save the result of a batch PRN's fine search. */
+static void manage_acq_fine_done(u8 chan, u8 i)
+{
+  acq_manage_cand_t *c = &acq_manage.cands[i];
+  acq_get_results(chan, &c->fine_cp, &c->fine_cf, &c->fine_snr);
+  LOG_DEFERRED("PRN %d Fine @ %+d Hz,  %d SNR\n", c->prn + 1,
+                                    (s32)c->fine_cf,
+                                    (s32)c->fine_snr);
+}
+
+/** Start one dwell of the multi-dwell search for a marginal batch PRN.
+ * A small window around the coarse peak, propagated to the dwell's load, is
+ * searched and added to the PRN's accumulation. */
+static void manage_acq_start_dwell(u8 chan, u8 i)
+{
+  acq_manage_cand_t *c = &acq_manage.cands[i];
+  float cp = propagate_code_phase(
+               c->coarse_cp,
+               c->coarse_cf,
+               acq_manage.dwell_timer_count - acq_manage.coarse_timer_count
+             );
+  nap_acq_code_wr_blocking(chan, c->prn);
+  acq_set_dwell(&acq_dwell[i]);
+  acq_start(chan, c->prn,
+            cp-ACQ_DWELL_CP_WIDTH,
+            cp+ACQ_DWELL_CP_WIDTH,
+            c->coarse_cf-ACQ_FULL_CF_STEP,
+            c->coarse_cf+ACQ_FULL_CF_STEP, ACQ_FULL_CF_STEP);
+}
+
+/** Start the next unsearched batch PRN of the stage on an acquisition
+ * channel, or mark the channel idle if there are none left. */
+static void manage_acq_stage_fill(u8 chan)
+{
+  u8 i = acq_manage.next;
+  while (i < acq_manage.n_cands &&
+         acq_stage.dwell_only && !acq_manage.cands[i].dwell)
+    i++;
+
+  if (i >= acq_manage.n_cands) {
+    acq_manage.chan_cand[chan] = MANAGE_ACQ_IDLE;
+    return;
+  }
+  acq_manage.next = i + 1;
+  acq_manage.chan_cand[chan] = i;
+  acq_stage.start(chan, i);
+}
+
+/** Start searching the batch PRNs against the loaded sample ram, one on
+ * each acquisition channel. See manage_acq_stage_poll().
+ *
+ * \param start      Starts a PRN's search.
+ * \param done       Collects a PRN's result, or NULL.
+ * \param dwell_only Only search the PRNs being confirmed by a multi-dwell
+ *                   search.
+ */
+static void manage_acq_stage_begin(manage_acq_search_fn start,
+                                   manage_acq_search_fn done,
+                                   bool dwell_only)
+{
+  acq_stage.start = start;
+  acq_stage.done = done;
+  acq_stage.dwell_only = dwell_only;
+  acq_manage.next = 0;
+  for (u8 chan=0; chan<nap_acq_n_channels; chan++)
+    manage_acq_stage_fill(chan);
+}
+
+/** Collect the stage's finished searches and start the remaining PRNs on
+ * the channels that are free, waiting up to ACQ_MANAGE_SEARCH_WAIT_MS for
+ * a search to finish.
+ *
+ * \return true once every PRN of the stage has been searched.
+ */
+static bool manage_acq_stage_poll(void)
+{
+  acq_wait_any_done(MS2ST(ACQ_MANAGE_SEARCH_WAIT_MS));
+
+  bool busy = false;
+  for (u8 chan=0; chan<nap_acq_n_channels; chan++) {
+    u8 i = acq_manage.chan_cand[chan];
+    if (i == MANAGE_ACQ_IDLE)
+      continue;
+    if (!acq_get_done(chan)) {
+      busy = true;
+      continue;
+    }
+    if (acq_stage.done)
+      acq_stage.done(chan, i);
+    manage_acq_stage_fill(chan);
+    if (acq_manage.chan_cand[chan] != MANAGE_ACQ_IDLE)
+      busy = true;
+  }
+  return !busy;
+}
+
+/** Schedule a fresh sample ram load for the next dwell. */
+static void manage_acq_load_dwell(void)
+{
+  acq_manage.state = ACQ_MANAGE_LOADING_DWELL;
+  acq_manage.dwell_timer_count = timebase_now() + 20000;
+  acq_schedule_load(acq_manage.dwell_timer_count);
+}
+
+/** Move on to the fine searches once the batch's PRNs are all found.
+ * \param load_count Sample count of the sample ram's current load, searched
+ *                   again if `acq.fine_reuse_load` is set. */
+static void manage_acq_to_fine(u32 load_count)
+{
+  if (acq_fine_reuse_load) {
+    /* The sample ram still holds the last samples, search them again with
+     * the fine grid. */
+    acq_manage.fine_timer_count = load_count;
+    manage_acq_stage_begin(manage_acq_start_fine, manage_acq_fine_done, false);
+    acq_manage.state = ACQ_MANAGE_RUNNING_FINE;
+    return;
+  }
+  acq_manage.state = ACQ_MANAGE_LOADING_FINE;
+  acq_manage.fine_timer_count = timebase_now() + 20000;
+  acq_schedule_load(acq_manage.fine_timer_count);
+}
+
+/** Choose a busy tracking channel for a newly acquired satellite to take
+ * over. In order of preference, a channel is taken over if it has tracked
+ * for TRACK_PREEMPT_EPH_COUNT without a usable ephemeris, if its satellite
+ * is below TRACK_PREEMPT_ELEVATION and lower than the new one, or if its
+ * SNR is below TRACK_PREEMPT_SNR. Ties go to the weakest channel. Channels
+ * that haven't tracked for TRACK_SNR_INIT_COUNT yet are never taken over.
+ *
+ * \param el Elevation of the new satellite, (rad), NAN if not known.
+ * \return Channel to take over, or MANAGE_NO_CHANNELS_FREE.
+ */
+static u8 manage_track_preempt(double el)
+{
+  u8 best = MANAGE_NO_CHANNELS_FREE;
+  u8 best_rank = 0;
+  float best_snr = 0;
+
+  for (u8 i=0; i<nap_track_n_channels; i++) {
+    tracking_channel_t *ch = &tracking_channel[i];
+    if (ch->state != TRACKING_RUNNING ||
+        ch->update_count < TRACK_SNR_INIT_COUNT)
+      continue;
+
+    u8 prn = ch->prn;
+    float snr = tracking_channel_snr(i);
+    u8 rank = 0;
+    if (ch->update_count > TRACK_PREEMPT_EPH_COUNT &&
+        !(es[prn].valid && es[prn].healthy))
+      rank = 3;
+    else if (vis_cache[prn].valid &&
+             vis_cache[prn].el < TRACK_PREEMPT_ELEVATION*D2R &&
+             vis_cache[prn].el < el)
+      rank = 2;
+    else if (snr < TRACK_PREEMPT_SNR)
+      rank = 1;
+
+    if (rank > best_rank || (rank > 0 && rank == best_rank && snr < best_snr)) {
+      best = i;
+      best_rank = rank;
+      best_snr = snr;
+    }
+  }
+
+  return best;
+}
+
+/** Start tracking channels for every PRN remaining in the batch. */
+static void manage_acq_handoff_batch(void)
+{
+  for (u8 i=0; i<acq_manage.n_cands; i++) {
+    acq_manage_cand_t *c = &acq_manage.cands[i];
+
+    u8 chan = manage_track_new_acq(c->prn, c->fine_snr);
+    if (chan == MANAGE_NO_CHANNELS_FREE) {
+      /* No channels are free to accept our new satellite :( */
+      /* TODO: Perhaps we can try to warm start this one
+       * later using another fine acq.
+       */
+      printf("No channels free :(\n");
+      manage_prn_state(c->prn, ACQ_PRN_TRIED);
+      continue;
+    }
+    /* Transition to tracking. */
+    u32 track_count = timebase_now() + 20000;
+    float track_cp = propagate_code_phase(c->fine_cp, c->fine_cf, track_count - acq_manage.fine_timer_count);
+
+    // Contrive for the timing strobe to occur at or close to a PRN edge (code phase = 0)
+    track_count += 16*(1023.0-track_cp)*(1.0 + c->fine_cf / GPS_L1_HZ);
+
+    tracking_channel_init(chan, c->prn, c->fine_cf, track_count);
+    manage_prn_state(c->prn, ACQ_PRN_TRACKING);
+    ttff_mark(TTFF_TRACK);
+  }
+  acq_manage.n_cands = 0;
+}
+
+/** Manages acquisition searches and starts tracking channels after successful acquisitions.
+ * Each sample ram load is shared by a batch of PRNs, the coarse (and then
+ * fine) searches for the batch are spread over the acquisition channels and
+ * run back to back on each with only the code ram being rewritten in
+ * between. With an `acq.batch_size` of 1 this reduces to one load per PRN
+ * per search stage. If `acq.fine_reuse_load` is set the
+ * fine searches reuse the coarse load and no second load is made.
+ *
+ * PRNs whose coarse peak is between ACQ_DWELL_THRESHOLD and ACQ_THRESHOLD
+ * are neither dropped nor tracked straight away, `acq.dwells` more loads are
+ * searched around the peak with the powers accumulated non-coherently, and
+ * only the PRNs whose accumulated peak clears the level noise reaches with
+ * ACQ_DWELL_FALSE_ALARM probability go on to the fine search. */
 void manage_acq()
 {
-  nap_track_n_channels = 9;
   switch (acq_manage.state) {
     default:
     case ACQ_MANAGE_START: {
       /* Check if there are tracking channels free first. */
-      u8 i;
-      for (i=0; i<nap_track_n_channels; i++) {
+      u8 n_free = 0;
+      for (u8 i=0; i<nap_track_n_channels; i++) {
         if (tracking_channel[i].state == TRACKING_DISABLED)
+          n_free++;
+      }
+      if (n_free == 0) {
+        /* All channels busy, only search for a satellite to replace the most
+         * expendable channel with if there is one. */
+        if (manage_track_preempt(M_PI/2) == MANAGE_NO_CHANNELS_FREE)
           break;
+        n_free = 1;
       }
-      if (i == nap_track_n_channels)
-        /* No tracking channels free :( */
-        break;
 
-      /* Tracking channel is free, decide which PRN
-       * to try and then start it acquiring. */
-      s8 best_prn = -1;
-      s8 best_score = -1;
+      /* Tracking channels are free, decide which PRNs
+       * to try and then start them acquiring. */
       manage_calc_scores();
-      for (u8 prn=0; prn<32; prn++) {
-        if ((acq_prn_param[prn].state != ACQ_PRN_TRACKING) &&
-            (acq_prn_param[prn].state != ACQ_PRN_TRIED) &&
-            (acq_prn_param[prn].score > best_score)) {
-          best_prn = prn;
-          best_score = acq_prn_param[prn].score;
-        }
-      }
+      acq_manage.n_cands = manage_acq_choose_batch(n_free);
 
-      if (best_score < 0) {
+      if (acq_manage.n_cands == 0) {
         /* No good satellites right now. Set all back to untried and try again
          * later. */
-        for (u8 prn=0; prn<32; prn++) {
-          if (acq_prn_param[prn].state == ACQ_PRN_TRIED)
-            acq_prn_param[prn].state = ACQ_PRN_UNTRIED;
-        }
+        manage_acq_retry_tried();
         break;
       }
 
-      /* We have our PRN chosen, now load some fresh data
+      /* We have our PRNs chosen, now load some fresh data
        * into the acquisition ram on the Swift NAP for
        * an initial coarse acquisition.
        */
-      /*printf("Acq choosing PRN: %d\n", best_prn+1);*/
-      acq_manage.prn = best_prn;
-      acq_prn_param[best_prn].state = ACQ_PRN_ACQUIRING;
       acq_manage.state = ACQ_MANAGE_LOADING_COARSE;
-      acq_manage.coarse_timer_count = nap_timing_count() + 20000;
+      acq_manage.coarse_timer_count = timebase_now() + 20000;
+      /* Let a due interference sweep load from the same strobe. */
+      cw_monitor_arm();
       acq_schedule_load(acq_manage.coarse_timer_count);
       break;
     }
 
     case ACQ_MANAGE_LOADING_COARSE:
       /* TODO: Loading should be part of the acq code not the manage code. */
-      if ((u32)nap_timing_count() - acq_manage.coarse_timer_count > 2*SAMPLE_FREQ) {
-        printf("Coarse loading timeout %u %u\n", (unsigned int)nap_timing_count(), (unsigned int)acq_manage.coarse_timer_count);
-        acq_manage.state = ACQ_MANAGE_START;
-        acq_prn_param[acq_manage.prn].state = ACQ_PRN_UNTRIED;
-      }
       /* Wait until we are done loading. */
-      acq_wait_load_done();
-
-      /* Done loading, now lets set that coarse acquisition going. */
-      nap_acq_code_wr_blocking(acq_manage.prn);
-      if (almanac[acq_manage.prn].valid && time_quality == TIME_COARSE) {
-        gps_time_t t = rx2gpstime(acq_manage.coarse_timer_count);
-
-        double dopp = -calc_sat_doppler_almanac(&almanac[acq_manage.prn], t.tow, t.wn, position_solution.pos_ecef);
-        /* TODO: look into accuracy of prediction and possibilities for
-         * improvement, e.g. use clock bias estimated by PVT solution. */
-        /*printf("Expecting PRN %02d @ %.1f\n", acq_manage.prn+1, dopp);*/
-        acq_start(acq_manage.prn, 0, 1023, dopp-4000, dopp+4000, ACQ_FULL_CF_STEP);
-      } else {
-        acq_start(acq_manage.prn, 0, 1023,
-            ACQ_FULL_CF_MIN,
-            ACQ_FULL_CF_MAX,
-            ACQ_FULL_CF_STEP);
+      if (!acq_wait_load_done(MS2ST(ACQ_MANAGE_LOAD_TIMEOUT_MS))) {
+        printf("Coarse loading timeout %u %u\n", (unsigned int)timebase_now(), (unsigned int)acq_manage.coarse_timer_count);
+        manage_acq_abort_batch();
+        break;
       }
+
+      ttff_mark(TTFF_ACQ_LOAD);
+
+      /* Done loading, now lets set the first coarse acquisitions going. */
+      manage_acq_stage_begin(manage_acq_start_coarse, manage_acq_coarse_done,
+                             false);
       acq_manage.state = ACQ_MANAGE_RUNNING_COARSE;
       break;
 
-    case ACQ_MANAGE_RUNNING_COARSE:
-      /* Wait until we are done acquiring. */
-      if (!acq_get_done())
-        break;
-      /* Done with the coarse acquisition, check if we have found a
-       * satellite, if so save the results and start the loading
-       * for the fine acquisition. If not, start again choosing a
-       * different PRN.
+    case ACQ_MANAGE_RUNNING_COARSE: {
+      /* Wait until we are done acquiring. Each finished coarse acquisition
+       * is saved and the channel moves on to the next PRN in the batch,
+       * which reuses the same sample ram.
        */
-      acq_get_results(&acq_manage.coarse_cp,
-                      &acq_manage.coarse_cf,
-                      &acq_manage.coarse_snr);
-      printf("PRN %d coarse @ %d Hz, %d SNR\n", acq_manage.prn + 1,
-                                    (int)acq_manage.coarse_cf,
-                                    (int)acq_manage.coarse_snr);
-      if (acq_manage.coarse_snr < ACQ_THRESHOLD) {
-        /* Didn't find the satellite :( */
-        acq_prn_param[acq_manage.prn].state = ACQ_PRN_TRIED;
+      if (!manage_acq_stage_poll())
+        break;
+
+      /* Whole batch searched, drop the PRNs we didn't find. */
+      u8 n_found = 0;
+      bool any_dwell = false;
+      for (u8 i=0; i<acq_manage.n_cands; i++) {
+        u8 prn = acq_manage.cands[i].prn;
+        acq_manage.cands[i].dwell = false;
+        if (acq_manage.cands[i].coarse_snr < ACQ_THRESHOLD &&
+            acq_manage.cands[i].reacq) {
+          /* Not where we last saw it, forget the cache entry and fall back
+           * to a full search. */
+          chSysLock();
+          reacq_cache[prn].valid = false;
+          chSysUnlock();
+          manage_prn_state(prn, ACQ_PRN_UNTRIED);
+        } else if (acq_manage.cands[i].coarse_snr < ACQ_THRESHOLD &&
+                   acq_manage.cands[i].coarse_snr >= ACQ_DWELL_THRESHOLD &&
+                   acq_dwell_count > 0) {
+          /* Might be there, confirm it with a few more dwells before
+           * giving it a tracking channel. */
+          memset(&acq_dwell[n_found], 0, sizeof(acq_dwell_t));
+          acq_manage.cands[i].dwell = true;
+          any_dwell = true;
+          acq_manage.cands[n_found++] = acq_manage.cands[i];
+        } else if (acq_manage.cands[i].coarse_snr < ACQ_THRESHOLD) {
+          /* Didn't find the satellite :( */
+          manage_prn_state(prn, ACQ_PRN_TRIED);
+        } else {
+          ttff_acq_hit(prn);
+          acq_manage.cands[n_found++] = acq_manage.cands[i];
+        }
+      }
+      acq_manage.n_cands = n_found;
+      if (n_found == 0) {
         acq_manage.state = ACQ_MANAGE_START;
         break;
       }
-      /* Looks like we have a winner! */
-      acq_manage.state = ACQ_MANAGE_LOADING_FINE;
-      acq_manage.fine_timer_count = nap_timing_count() + 20000;
-      acq_schedule_load(acq_manage.fine_timer_count);
+      if (any_dwell) {
+        acq_manage.n_dwells = 0;
+        manage_acq_load_dwell();
+        break;
+      }
+      /* Looks like we have some winners! Sharing the coarse time reference
+       * when reusing the load means propagate_code_phase() leaves the coarse
+       * code phase unchanged. */
+      manage_acq_to_fine(acq_manage.coarse_timer_count);
       break;
+    }
 
-    case ACQ_MANAGE_LOADING_FINE:
-      if ((u32)nap_timing_count() - acq_manage.fine_timer_count > 2*SAMPLE_FREQ) {
-        printf("Fine loading timeout %u %u\n", (unsigned int)nap_timing_count(), (unsigned int)acq_manage.fine_timer_count);
-        acq_manage.state = ACQ_MANAGE_START;
-        acq_prn_param[acq_manage.prn].state = ACQ_PRN_UNTRIED;
+    case ACQ_MANAGE_LOADING_DWELL:
+      if (!acq_wait_load_done(MS2ST(ACQ_MANAGE_LOAD_TIMEOUT_MS))) {
+        printf("Dwell loading timeout %u %u\n", (unsigned int)timebase_now(), (unsigned int)acq_manage.dwell_timer_count);
+        manage_acq_abort_batch();
+        break;
       }
-      /* Wait until we are done loading. */
-      acq_wait_load_done();
-
-      /* Done loading, now lets set the fine acquisition going. */
-      float fine_cp = propagate_code_phase(
-                        acq_manage.coarse_cp,
-                        acq_manage.coarse_cf,
-                        acq_manage.fine_timer_count - acq_manage.coarse_timer_count
-                      );
-      acq_start(acq_manage.prn,
-                fine_cp-ACQ_FINE_CP_WIDTH,
-                fine_cp+ACQ_FINE_CP_WIDTH,
-                acq_manage.coarse_cf-ACQ_FINE_CF_WIDTH,
-                acq_manage.coarse_cf+ACQ_FINE_CF_WIDTH, ACQ_FINE_CF_STEP);
-      acq_manage.state = ACQ_MANAGE_RUNNING_FINE;
+
+      manage_acq_stage_begin(manage_acq_start_dwell, NULL, true);
+      acq_manage.state = ACQ_MANAGE_RUNNING_DWELL;
       break;
 
-    case ACQ_MANAGE_RUNNING_FINE: {
-      /* Wait until we are done acquiring. */
-      if (!acq_get_done())
+    case ACQ_MANAGE_RUNNING_DWELL: {
+      if (!manage_acq_stage_poll())
         break;
-      /* Fine acquisition done, check if we have the satellite still,
-       * if so then transition to tracking, otherwise start again with
-       * a different PRN.
-       */
-      float fine_cp, fine_cf;
-      acq_get_results(&fine_cp, &fine_cf, &acq_manage.fine_snr);
-      printf("PRN %d Fine @ %+.0f Hz,  %.1f SNR\n", acq_manage.prn + 1,
-                                  fine_cf,
-                                  acq_manage.fine_snr);
-      /* BELOW REMOVED - if we found it in coarse then we'll consider it acquired. */
-      // TODO: Change SNR calculation so it is valid for fine then reenable this.
-      //if (acq_manage.fine_snr < ACQ_THRESHOLD) {
-      //  /* Didn't find the satellite :( */
-      //  acq_prn_param[acq_manage.prn].state = ACQ_PRN_TRIED;
-      //  acq_manage.state = ACQ_MANAGE_START;
-      //  break;
-      //}
-      u8 chan = manage_track_new_acq(acq_manage.fine_snr);
-      if (chan == MANAGE_NO_CHANNELS_FREE) {
-        /* No channels are free to accept our new satellite :( */
-        /* TODO: Perhaps we can try to warm start this one
-         * later using another fine acq.
-         */
-        printf("No channels free :(\n");
-        acq_prn_param[acq_manage.prn].state = ACQ_PRN_TRIED;
+      if (++acq_manage.n_dwells < acq_dwell_count) {
+        manage_acq_load_dwell();
+        break;
+      }
+
+      /* All dwells searched, keep the PRNs that built up a peak. */
+      u8 n_found = 0;
+      for (u8 i=0; i<acq_manage.n_cands; i++) {
+        acq_manage_cand_t *c = &acq_manage.cands[i];
+        if (c->dwell) {
+          float snr = acq_dwell_snr(&acq_dwell[i]);
+          float thres = acq_dwell_threshold(&acq_dwell[i],
+                                            ACQ_DWELL_FALSE_ALARM);
+          LOG_DEFERRED("PRN %d dwells %d SNR\n", c->prn + 1, (s32)snr);
+          if (snr < thres) {
+            manage_prn_state(c->prn, ACQ_PRN_TRIED);
+            continue;
+          }
+          c->dwell = false;
+          ttff_acq_hit(c->prn);
+        }
+        acq_manage.cands[n_found++] = *c;
+      }
+      acq_manage.n_cands = n_found;
+      if (n_found == 0) {
         acq_manage.state = ACQ_MANAGE_START;
         break;
       }
-      /* Transition to tracking. */
-      u32 track_count = nap_timing_count() + 20000;
-      float track_cp = propagate_code_phase(fine_cp, fine_cf, track_count - acq_manage.fine_timer_count);
+      manage_acq_to_fine(acq_manage.dwell_timer_count);
+      break;
+    }
 
-      // Contrive for the timing strobe to occur at or close to a PRN edge (code phase = 0)
-      track_count += 16*(1023.0-track_cp)*(1.0 + fine_cf / GPS_L1_HZ);
+    case ACQ_MANAGE_LOADING_FINE:
+      /* Wait until we are done loading. */
+      if (!acq_wait_load_done(MS2ST(ACQ_MANAGE_LOAD_TIMEOUT_MS))) {
+        printf("Fine loading timeout %u %u\n", (unsigned int)timebase_now(), (unsigned int)acq_manage.fine_timer_count);
+        manage_acq_abort_batch();
+        break;
+      }
 
-      tracking_channel_init(chan, acq_manage.prn, fine_cf, track_count);
-      acq_prn_param[acq_manage.prn].state = ACQ_PRN_TRACKING;
+      /* Done loading, now lets set the first fine acquisitions going. */
+      manage_acq_stage_begin(manage_acq_start_fine, manage_acq_fine_done,
+                             false);
+      acq_manage.state = ACQ_MANAGE_RUNNING_FINE;
+      break;
+
+    case ACQ_MANAGE_RUNNING_FINE: {
+      /* Wait until we are done acquiring. */
+      if (!manage_acq_stage_poll())
+        break;
+      /* If we found it in coarse then we'll consider it acquired.
+       * TODO: Change SNR calculation so it is valid for fine and drop PRNs
+       * below ACQ_THRESHOLD here. */
+      /* Fine acquisitions done, transition the whole batch to tracking. */
+      manage_acq_handoff_batch();
       acq_manage.state = ACQ_MANAGE_START;
       break;
     }
@@ -342,15 +1101,17 @@ void manage_acq()
   }
 }
 
-/** Find an available tracking channel to start tracking an acquired PRN with.
+/** Find a tracking channel to start tracking an acquired PRN with.
+ * A free channel is used if there is one, otherwise a sufficiently strong
+ * acquisition takes over the most expendable busy channel, see
+ * manage_track_preempt().
  *
+ * \param prn PRN of the acquisition (0-31).
  * \param snr SNR of the acquisition.
- * \return Index of first unused tracking channel.
+ * \return Index of the tracking channel to use, or MANAGE_NO_CHANNELS_FREE.
  */
-u8 manage_track_new_acq(float snr)
+u8 manage_track_new_acq(u8 prn, float snr)
 {
-  (void)snr;
-
   /* Decide which (if any) tracking channel to put
    * a newly acquired satellite into.
    */
@@ -360,19 +1121,71 @@ u8 manage_track_new_acq(float snr)
     }
   }
 
-  return MANAGE_NO_CHANNELS_FREE;
+  if (snr < ACQ_PREEMPT_THRESHOLD)
+    return MANAGE_NO_CHANNELS_FREE;
+
+  double el = vis_cache[prn].valid ? vis_cache[prn].el : NAN;
+  u8 i = manage_track_preempt(el);
+  if (i == MANAGE_NO_CHANNELS_FREE)
+    return MANAGE_NO_CHANNELS_FREE;
+
+  u8 old_prn = tracking_channel[i].prn;
+  printf("Channel %d PRN %02d taken over by PRN %02d\n",
+         i, old_prn + 1, prn + 1);
+  tracking_channel_disable(i);
+  manage_prn_state(old_prn, ACQ_PRN_TRIED);
+  return i;
+}
+
+/** Disable any tracking channel the tracking loop has flagged as having
+ * lost its satellite, see TRACKING_EVENT_LOST. */
+static void manage_track_lost(void)
+{
+  for (u8 i=0; i<nap_track_n_channels; i++) {
+    if (tracking_channel[i].state == TRACKING_RUNNING &&
+        tracking_channel[i].lock_lost) {
+      printf("Disabling channel %d\n", i);
+      tracking_channel_disable(i);
+      /* Make it eligible straight away if it can be re-acquired with a
+       * narrow search. */
+      acq_reacq_t entry;
+      if (manage_reacq_get(tracking_channel[i].prn, &entry))
+        manage_prn_state(tracking_channel[i].prn, ACQ_PRN_UNTRIED);
+      else
+        manage_prn_state(tracking_channel[i].prn, ACQ_PRN_TRIED);
+    }
+  }
 }
 
+/** Event the manage track thread is signalled with on tracking channel state
+ * transitions, see tracking_events_register(). */
+#define MANAGE_TRACK_TRACKING_EVENT EVENT_MASK(0)
+
 static WORKING_AREA_CCM(wa_manage_track_thread, MANAGE_TRACK_THREAD_STACK);
 static msg_t manage_track_thread(void *arg)
 {
   (void)arg;
   chRegSetThreadName("manage track");
+  static EventListener tracking_el;
+  tracking_events_register(&tracking_el, MANAGE_TRACK_TRACKING_EVENT);
+
+  systime_t deadline = chTimeNow();
   while (TRUE) {
-    chThdSleepMilliseconds(200);
+    /* Channels that lose lock are freed as soon as the tracking loop says
+     * so, in between the periodic work. */
+    deadline += MS2ST(200);
+    systime_t now;
+    while ((s32)(deadline - (now = chTimeNow())) > 0)
+      if (chEvtWaitAnyTimeout(MANAGE_TRACK_TRACKING_EVENT, deadline - now) &&
+          (chEvtGetAndClearFlags(&tracking_el) & TRACKING_EVENT_LOST))
+        manage_track_lost();
+    if ((s32)(now - deadline) > (s32)MS2ST(200))
+      /* Fell behind, don't try to catch up. */
+      deadline = now;
+
     DO_EVERY(5,
       manage_track();
-      nmea_gpgsa(tracking_channel, 0);
+      nmea_gpgsa(0);
     );
     tracking_send_state();
   }
@@ -390,48 +1203,67 @@ void manage_track_setup()
   );
 }
 
-/** Disable any tracking channel whose SNR is below a certain margin. */
+/** Disable any tracking channel that has lost its satellite, in case its
+ * event was missed, and refresh the re-acquisition cache from the others. */
 void manage_track()
 {
+  manage_track_lost();
   for (u8 i=0; i<nap_track_n_channels; i++) {
-    if (tracking_channel[i].state == TRACKING_RUNNING) {
-      if (tracking_channel_snr(i) < TRACK_THRESHOLD) {
-        tracking_channel[i].snr_below_threshold_count =
-          tracking_channel[i].update_count;
-        if (tracking_channel[i].update_count > TRACK_SNR_INIT_COUNT &&
-            tracking_channel[i].update_count -
-              tracking_channel[i].snr_above_threshold_count >
-              TRACK_SNR_THRES_COUNT) {
-          /* This tracking channel has lost its satellite. */
-          printf("Disabling channel %d\n", i);
-          tracking_channel_disable(i);
-          acq_prn_param[tracking_channel[i].prn].state = ACQ_PRN_TRIED;
-        }
-      } else {
-        tracking_channel[i].snr_above_threshold_count =
-          tracking_channel[i].update_count;
-      }
-    }
+    if (tracking_channel[i].state == TRACKING_RUNNING &&
+        tracking_channel_snr(i) >= TRACK_THRESHOLD)
+      manage_reacq_update(i);
   }
 }
 
-extern ephemeris_t es[32];
+/** Check an ephemeris is within its fit interval at a time of week.
+ * Ephemerides restored by a hot start may be stale, even by whole weeks.
+ * The channel only knows the time of week, so the week number is taken from
+ * the receiver time when there is one. Until then only the time of week is
+ * compared.
+ *
+ * \param e      Ephemeris to check.
+ * \param TOW_ms Time of week from the tracking channel, (ms).
+ * \return true if TOW_ms is within EPHEMERIS_FIT_INTERVAL of toe.
+ */
+static bool ephemeris_tow_valid(const ephemeris_t *e, s32 TOW_ms)
+{
+  double dt = TOW_ms / 1000.0 - e->toe.tow;
+  if (time_quality != TIME_UNKNOWN) {
+    gps_time_t now = get_current_time();
+    gps_time_t t = {.wn = now.wn, .tow = TOW_ms / 1000.0};
+    /* Either side of a week rollover from the receiver time. */
+    if (t.tow - now.tow > WEEK_SECS / 2)
+      t.wn--;
+    else if (t.tow - now.tow < -WEEK_SECS / 2)
+      t.wn++;
+    dt = gpsdifftime(t, e->toe);
+  } else if (dt > WEEK_SECS / 2) {
+    dt -= WEEK_SECS;
+  } else if (dt < -WEEK_SECS / 2) {
+    dt += WEEK_SECS;
+  }
+  return fabs(dt) < EPHEMERIS_FIT_INTERVAL;
+}
+
+/** Whether a tracking channel can be used in a solution. The tracking
+ * conditions are kept up to date by the tracking loop, see
+ * tracking_channels_ready_mask(), only the ephemeris is checked here.
+ */
 s8 use_tracking_channel(u8 i)
 {
-  return (tracking_channel[i].state == TRACKING_RUNNING)
+  return ((tracking_channels_ready_mask() >> i) & 1)
       && (es[tracking_channel[i].prn].valid == 1)
       && (es[tracking_channel[i].prn].healthy == 1)
-      && (tracking_channel[i].update_count
-            - tracking_channel[i].snr_below_threshold_count
-            > TRACK_SNR_THRES_COUNT)
-      && (tracking_channel[i].TOW_ms > 0);
+      && ephemeris_tow_valid(&es[tracking_channel[i].prn],
+                             tracking_channel[i].TOW_ms);
 }
 
 u8 tracking_channels_ready()
 {
   u8 n_ready = 0;
-  for (u8 i=0; i<nap_track_n_channels; i++) {
-    if (use_tracking_channel(i)) {
+  u32 ready = tracking_channels_ready_mask();
+  for (u8 i=0; ready >> i; i++) {
+    if (((ready >> i) & 1) && use_tracking_channel(i)) {
       n_ready++;
     }
   }
@@ -14,25 +14,112 @@
 #define SWIFTNAV_MANAGE_H
 
 #include <ch.h>
+#include <libswiftnav/almanac.h>
 #include <libswiftnav/common.h>
 
+#include "board/nap/acq_channel.h"
+
 /** \addtogroup manage
  * \{ */
 
 #define ACQ_THRESHOLD 15.0
-#define TRACK_THRESHOLD 2.0
-#define TRACK_SNR_INIT_COUNT 5000
-#define TRACK_SNR_THRES_COUNT 2000
+/** Default peak to mean power ratio that ends a coarse search early, see
+ * acq_set_early_exit(). Well above ACQ_THRESHOLD so only clear open sky
+ * signals stop the search. */
+#define ACQ_EARLY_EXIT_SNR 40.0
+
+/** Coarse SNR from which a PRN below ACQ_THRESHOLD is confirmed with a
+ * multi-dwell search rather than dropped, see acq_set_dwell(). */
+#define ACQ_DWELL_THRESHOLD    10.0
+/** Probability of noise alone confirming a PRN in a multi-dwell search,
+ * which sets the SNR threshold, see acq_dwell_threshold(). */
+#define ACQ_DWELL_FALSE_ALARM  1e-3
+/** Default number of extra sample ram loads searched for a marginal PRN. */
+#define ACQ_DWELL_COUNT        3
+/** Half width of the code phase window of each dwell, (chips). */
+#define ACQ_DWELL_CP_WIDTH     2
 
 #define ACQ_FULL_CF_MIN  -8500
 #define ACQ_FULL_CF_MAX   8500
 #define ACQ_FULL_CF_STEP  400
+/** Half width of the almanac aided carrier freq search without a receiver
+ * clock estimate, (Hz). */
+#define ACQ_AIDED_CF_WIDTH 4000
+/** Doppler prediction error from almanac, position fix and user dynamics, 1
+ * sigma, (Hz). */
+#define ACQ_AIDED_CF_SIGMA_FIX   100
+/** As ACQ_AIDED_CF_SIGMA_FIX but when the position is only a guess, (Hz). */
+#define ACQ_AIDED_CF_SIGMA_GUESS 300
+/** Clock drift uncertainty below which the drift is used to centre the
+ * aided window before the time is TIME_FINE, e.g. one given by an aiding
+ * bundle. At 1 sigma, tighter than the 1 ppm start up uncertainty. */
+#define ACQ_AIDED_DRIFT_SIGMA_MAX 0.5e-6
+/** Floor on the receiver oscillator offset uncertainty to cover drift since
+ * the last clock update, 1 sigma, (Hz). */
+#define ACQ_AIDED_CF_SIGMA_CLOCK 50
 #define ACQ_FINE_CF_WIDTH 500
 #define ACQ_FINE_CP_WIDTH 20
 #define ACQ_FINE_CF_STEP  50
 
+/** Maximum age of a re-acquisition cache entry, (s). */
+#define ACQ_REACQ_MAX_AGE  30
+/** Half width of the re-acquisition code phase search, (chips). */
+#define ACQ_REACQ_CP_WIDTH 16
+/** Half width of the re-acquisition carrier freq search, (Hz). */
+#define ACQ_REACQ_CF_WIDTH 800
+
+/** Period the almanac visibility cache is refreshed at, (s). */
+#define MANAGE_VIS_PERIOD   20
+/** Receiver movement that forces a visibility cache refresh, (m). */
+#define MANAGE_VIS_MOVE_MAX 10e3
+
+/** Maximum number of PRNs searched against a single sample ram load. */
+#define ACQ_MANAGE_BATCH_MAX 8
+
+/** Maximum time from toe an ephemeris is used for, (s). */
+#define EPHEMERIS_FIT_INTERVAL (4*3600)
+
+/** Usable tracking channels below which PRNs with an ephemeris are searched
+ * ahead of higher PRNs without one. */
+#define ACQ_SCORE_USABLE_MIN 4
+/** Score bonus for a PRN with a fresh ephemeris while there are fewer than
+ * ACQ_SCORE_USABLE_MIN usable channels, half of it at the end of the fit
+ * interval. */
+#define ACQ_SCORE_EPH_NEEDED 100
+/** Score bonus for a PRN with a fresh ephemeris once there are enough usable
+ * channels. */
+#define ACQ_SCORE_EPH        20
+/** Score bonus for a PRN that would remove all of the GDOP squared. */
+#define ACQ_SCORE_GEOM       50
+/** Information in every direction assumed before any PRN is tracked. */
+#define ACQ_SCORE_GEOM_PRIOR 0.1
+
 #define MANAGE_NO_CHANNELS_FREE 255
 
+/** acq_manage_t.chan_cand value of an acquisition channel with nothing to
+ * search. */
+#define MANAGE_ACQ_IDLE 255
+
+/** Minimum acquisition SNR for a new satellite to take over a busy
+ * tracking channel. */
+#define ACQ_PREEMPT_THRESHOLD   20.0
+/** Time a channel may track without a usable ephemeris before it can be
+ * taken over, (ms). */
+#define TRACK_PREEMPT_EPH_COUNT 60000
+/** Elevation below which a channel can be taken over by a higher satellite,
+ * (deg). */
+#define TRACK_PREEMPT_ELEVATION 10
+/** Tracking SNR below which a channel can be taken over. */
+#define TRACK_PREEMPT_SNR       5.0
+
+/** Time to wait for an acquisition sample ram load before giving up, (ms). */
+#define ACQ_MANAGE_LOAD_TIMEOUT_MS 2000
+/** Longest single wait for a running search before the manager re-checks
+ * its state, (ms). */
+#define ACQ_MANAGE_SEARCH_WAIT_MS  100
+/** Idle period when there is nothing to acquire, (ms). */
+#define ACQ_MANAGE_IDLE_MS         100
+
 #define MANAGE_ACQ_THREAD_PRIORITY NORMALPRIO
 #define MANAGE_ACQ_THREAD_STACK    3000
 
@@ -46,30 +133,63 @@ typedef enum {
   ACQ_MANAGE_LOADING_COARSE,
   ACQ_MANAGE_RUNNING_COARSE,
   ACQ_MANAGE_LOADING_FINE,
-  ACQ_MANAGE_RUNNING_FINE
+  ACQ_MANAGE_RUNNING_FINE,
+  ACQ_MANAGE_LOADING_DWELL,
+  ACQ_MANAGE_RUNNING_DWELL
 } acq_manage_state_t;
 
-/** Acquisition management struct. */
+/** Acquisition results for one PRN of an acquisition batch. */
 typedef struct {
-  acq_manage_state_t state; /**< Acquisition management state. */
   u8 prn;                   /**< CA Code (0-31) being searched for. */
-  u32 coarse_timer_count;   /**< Sample count corresponding to first sample in coarse acquisition samples. */
+  bool reacq;               /**< Coarse search was narrowed using the re-acquisition cache. */
+  bool dwell;               /**< Coarse peak was marginal, being confirmed by a multi-dwell search. */
   float coarse_snr;         /**< SNR of highest correlation in coarse search. */
   float coarse_cp;          /**< Code phase of highest correlation in coarse search. */
   float coarse_cf;          /**< Carr freq of highest correlation in coarse search. */
   float fine_snr;           /**< SNR of highest correlation in fine search. */
+  float fine_cp;            /**< Code phase of highest correlation in fine search. */
+  float fine_cf;            /**< Carr freq of highest correlation in fine search. */
+} acq_manage_cand_t;
+
+/** Acquisition management struct.
+ * A batch of up to ACQ_MANAGE_BATCH_MAX PRNs is searched against each
+ * sample ram load. The PRNs are shared out between the acquisition
+ * channels, which are all loaded together, and each channel searches its
+ * PRNs one after another with only the code ram rewritten in between. */
+typedef struct {
+  acq_manage_state_t state; /**< Acquisition management state. */
+  u8 n_cands;               /**< Number of PRNs in the current batch. */
+  u8 next;                  /**< Index of the next batch PRN to start searching in the current stage. */
+  u8 chan_cand[NAP_ACQ_MAX_CHANNELS]; /**< Index of the batch PRN each acquisition channel is searching, or MANAGE_ACQ_IDLE. */
+  acq_manage_cand_t cands[ACQ_MANAGE_BATCH_MAX]; /**< PRNs in the current batch. */
+  u32 coarse_timer_count;   /**< Sample count corresponding to first sample in coarse acquisition samples. */
   u32 fine_timer_count;     /**< Sample count corresponding to first sample in fine acquisition samples. */
+  u32 dwell_timer_count;    /**< Sample count corresponding to first sample in the current dwell's samples. */
+  u8 n_dwells;              /**< Number of dwells searched so far for the marginal PRNs. */
 } acq_manage_t;
 
+/** Last good tracking state of a PRN, used to narrow the search when
+ * re-acquiring a satellite that was recently lost. */
+typedef struct {
+  bool valid;               /**< Entry holds a tracking state. */
+  u32 sample_count;         /**< Receiver sample count the entry refers to. */
+  float code_phase;         /**< Prompt code phase at sample_count, (chips). */
+  float carrier_freq;       /**< Carrier freq at sample_count, (Hz). */
+  float carrier_freq_rate;  /**< Rate of change of carrier freq, (Hz/s). */
+} acq_reacq_t;
+
+/** Management status of a PRN. */
+typedef enum {
+  ACQ_PRN_SKIP = 0,
+  ACQ_PRN_UNTRIED,
+  ACQ_PRN_TRIED,
+  ACQ_PRN_ACQUIRING,
+  ACQ_PRN_TRACKING
+} acq_prn_state_t;
+
 /** Status of acquisition for a particular PRN. */
 typedef struct __attribute__((packed)) {
-  enum {
-    ACQ_PRN_SKIP = 0,
-    ACQ_PRN_UNTRIED,
-    ACQ_PRN_TRIED,
-    ACQ_PRN_ACQUIRING,
-    ACQ_PRN_TRACKING
-  } state;  /**< Management status of PRN. */
+  acq_prn_state_t state;  /**< Management status of PRN. */
   s8 score; /**< Acquisition preference of PRN. */
 } acq_prn_t;
 
@@ -77,9 +197,11 @@ typedef struct __attribute__((packed)) {
 
 void manage_acq_setup(void);
 void manage_acq(void);
+bool manage_almanac_set(const almanac_t *a);
+void manage_acq_retry_tried(void);
 
 void manage_track_setup(void);
-u8 manage_track_new_acq(float snr);
+u8 manage_track_new_acq(u8 prn, float snr);
 void manage_track(void);
 s8 use_tracking_channel(u8 i);
 u8 tracking_channels_ready(void);
@@ -11,9 +11,9 @@
  */
 
 #include <math.h>
-#include <stdio.h>
-#include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
+#include <time.h>
 
 #include <libswiftnav/coord_system.h>
 
@@ -30,24 +30,173 @@
  * Send messages in NMEA format.
  * \{ */
 
+/** Maximum NMEA sentence length, including the "\r\n". The standard limit is
+ * 82 characters but our lat/lon have more precision than it allows for. */
+#define NMEA_MAX_LEN 96
+
+/** State for building an NMEA sentence in a fixed size buffer.
+ * The checksum is accumulated as characters are written so the sentence
+ * never has to be rescanned. */
+typedef struct {
+  char buf[NMEA_MAX_LEN];
+  u8 len;      /**< Number of characters written. */
+  u8 sum;      /**< XOR of characters written after the `$`. */
+  bool ovf;    /**< Set if the sentence didn't fit in the buffer. */
+} nmea_sentence_t;
+
+static const u32 pow10_u32[] = {
+  1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
 /** Output NMEA sentence to all USARTs configured in NMEA mode.
  * \param s The NMEA sentence to output.
+ * \param len Length of the sentence.
  */
-void nmea_output(char *s)
+static void nmea_output(const char *s, u16 len)
 {
-  /* Global interrupt disable to avoid concurrency/reentrancy problems. */
-  __asm__("CPSID i;");
+  u8 ports = 0;
 
   if (ftdi_usart.mode == NMEA)
-    usart_write_dma(&ftdi_tx_state, (u8 *)s, strlen(s));
+    ports |= SBP_TX_FTDI;
 
   if (uarta_usart.mode == NMEA)
-    usart_write_dma(&uarta_tx_state, (u8 *)s, strlen(s));
+    ports |= SBP_TX_UARTA;
 
   if (uartb_usart.mode == NMEA)
-    usart_write_dma(&uartb_tx_state, (u8 *)s, strlen(s));
+    ports |= SBP_TX_UARTB;
+
+  sbp_tx_raw(ports, SBP_TX_PRIO_NORMAL, (const u8 *)s, len);
+}
+
+static void nmea_putc(nmea_sentence_t *ns, char c)
+{
+  if (ns->len >= NMEA_MAX_LEN) {
+    ns->ovf = true;
+    return;
+  }
+  ns->buf[ns->len++] = c;
+  ns->sum ^= c;
+}
+
+static void nmea_puts(nmea_sentence_t *ns, const char *s)
+{
+  while (*s)
+    nmea_putc(ns, *s++);
+}
+
+/** Start a sentence, writes the `$` and the address field, e.g. "GPGGA". */
+static void nmea_start(nmea_sentence_t *ns, const char *addr)
+{
+  ns->buf[0] = '$';
+  ns->len = 1;
+  ns->sum = 0;
+  ns->ovf = false;
+  nmea_puts(ns, addr);
+}
+
+/** Write an unsigned integer, zero padded to at least `width` digits. */
+static void nmea_put_uint(nmea_sentence_t *ns, u32 x, u8 width)
+{
+  char digits[10];
+  u8 n = 0;
+
+  do {
+    digits[n++] = '0' + x % 10;
+    x /= 10;
+  } while (x && n < sizeof(digits));
+
+  while (width > n) {
+    nmea_putc(ns, '0');
+    width--;
+  }
+  while (n)
+    nmea_putc(ns, digits[--n]);
+}
+
+/** Write a fixed point number given as an integer scaled by 10^`dec`, with
+ * the integer part zero padded to at least `int_width` digits. */
+static void nmea_put_scaled(nmea_sentence_t *ns, u32 x, u8 int_width, u8 dec)
+{
+  nmea_put_uint(ns, x / pow10_u32[dec], int_width);
+  if (dec) {
+    nmea_putc(ns, '.');
+    nmea_put_uint(ns, x % pow10_u32[dec], dec);
+  }
+}
 
-  __asm__("CPSIE i;");  /* Re-enable interrupts. */
+/** Write a value rounded to `dec` decimal places. */
+static void nmea_put_fixed(nmea_sentence_t *ns, double x, u8 int_width, u8 dec)
+{
+  if (x < 0) {
+    nmea_putc(ns, '-');
+    x = -x;
+  }
+  double scaled = round(x * pow10_u32[dec]);
+  if (scaled > 4e9)
+    scaled = 4e9;
+  nmea_put_scaled(ns, (u32)scaled, int_width, dec);
+}
+
+/** Write a latitude or longitude as (d)ddmm.mmmmmmm followed by the
+ * hemisphere field. Rounding is done over the whole value so that minutes
+ * can't round up to 60. */
+static void nmea_put_angle(nmea_sentence_t *ns, double rad, u8 deg_width,
+                           char pos, char neg)
+{
+  /* Angle in units of 10^-7 minutes, exact in a double. */
+  double tot = round(fabs(rad) * (180.0 / M_PI) * 60e7);
+  double deg = floor(tot / 60e7);
+
+  nmea_put_uint(ns, (u32)deg, deg_width);
+  nmea_put_scaled(ns, (u32)(tot - deg * 60e7), 2, 7);
+  nmea_putc(ns, ',');
+  nmea_putc(ns, rad < 0 ? neg : pos);
+}
+
+/** Break down a GPS time rounded to the nearest millisecond.
+ * \param t GPS time.
+ * \param tm Set to the broken down time.
+ * \return Milliseconds part of the time.
+ */
+static u16 nmea_time(gps_time_t t, struct tm *tm)
+{
+  double s = floor(t.tow);
+  u16 ms = (u16)round((t.tow - s) * 1000.0);
+  if (ms >= 1000) {
+    ms -= 1000;
+    s += 1;
+  }
+  t.tow = s;
+
+  time_t unix_t = gps2time(t);
+  gmtime_r(&unix_t, tm);
+  return ms;
+}
+
+/** Write the time of day as hhmmss.sss. */
+static void nmea_put_time(nmea_sentence_t *ns, const struct tm *tm, u16 ms)
+{
+  nmea_put_uint(ns, tm->tm_hour, 2);
+  nmea_put_uint(ns, tm->tm_min, 2);
+  nmea_put_uint(ns, tm->tm_sec, 2);
+  nmea_putc(ns, '.');
+  nmea_put_uint(ns, ms, 3);
+}
+
+/** Finish a sentence with its checksum and send it out NMEA USARTs. */
+static void nmea_finish(nmea_sentence_t *ns)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  u8 sum = ns->sum;
+
+  nmea_putc(ns, '*');
+  nmea_putc(ns, hex[sum >> 4]);
+  nmea_putc(ns, hex[sum & 0xF]);
+  nmea_putc(ns, '\r');
+  nmea_putc(ns, '\n');
+
+  if (!ns->ovf)
+    nmea_output(ns->buf, ns->len);
 }
 
 /** Calculate the checksum of an NMEA sentence.
@@ -81,71 +230,60 @@ u8 nmea_checksum(char *s)
  */
 void nmea_gpgga(gnss_solution *soln, dops_t *dops)
 {
-  time_t unix_t;
   struct tm t;
-
-  unix_t = gps2time(soln->time);
-  gmtime_r(&unix_t, &t);
-
-  double frac_s = fmod(soln->time.tow, 1.0);
-
-  s8 lat_deg = (s8)((180.0 / M_PI) * soln->pos_llh[0]);
-  double lat_min = fabs(60 * ((180.0 / M_PI) * soln->pos_llh[0] - lat_deg));
-  s8 lon_deg = (s8)((180.0 / M_PI) * soln->pos_llh[1]);
-  double lon_min = fabs(60 * ((180.0 / M_PI) * soln->pos_llh[1] - lon_deg));
-  lat_deg = abs(lat_deg);
-  lon_deg = abs(lon_deg);
-
-  char lat_dir = soln->pos_llh[0] < 0 ? 'S' : 'N';
-  char lon_dir = soln->pos_llh[1] < 0 ? 'W' : 'E';
+  u16 ms = nmea_time(soln->time, &t);
 
   u8 fix_type = 1;
 
-  char buf[80];
-  u8 n = sprintf(buf,
-                 "$GPGGA,%02d%02d%06.3f,"
-                 "%02d%010.7f,%c,%03d%010.7f,%c,"
-                 "%01d,%02d,%.1f,%1.f,M,,M,,",
-                 t.tm_hour, t.tm_min, t.tm_sec + frac_s,
-                 lat_deg, lat_min, lat_dir, lon_deg, lon_min, lon_dir,
-                 fix_type, soln->n_used, dops->hdop, soln->pos_llh[2]
-                 );
-
-  u8 sum = nmea_checksum(buf);
-
-  sprintf(buf + n, "*%02X\r\n", sum);
-
-  nmea_output(buf);
+  nmea_sentence_t ns;
+  nmea_start(&ns, "GPGGA,");
+  nmea_put_time(&ns, &t, ms);
+  nmea_putc(&ns, ',');
+  nmea_put_angle(&ns, soln->pos_llh[0], 2, 'N', 'S');
+  nmea_putc(&ns, ',');
+  nmea_put_angle(&ns, soln->pos_llh[1], 3, 'E', 'W');
+  nmea_putc(&ns, ',');
+  nmea_put_uint(&ns, fix_type, 1);
+  nmea_putc(&ns, ',');
+  nmea_put_uint(&ns, soln->n_used, 2);
+  nmea_putc(&ns, ',');
+  nmea_put_fixed(&ns, dops->hdop, 1, 1);
+  nmea_putc(&ns, ',');
+  nmea_put_fixed(&ns, soln->pos_llh[2], 1, 0);
+  nmea_puts(&ns, ",M,,M,,");
+  nmea_finish(&ns);
 }
 
 /** Assemble a NMEA GPGSA message and send it out NMEA USARTs.
  * NMEA GPGSA message contains DOP and active satellites.
  *
- * \param chans Pointer to tracking_channel_t struct.
  * \param dops  Pointer to dops_t struct.
  */
-void nmea_gpgsa(tracking_channel_t *chans, dops_t *dops)
+void nmea_gpgsa(dops_t *dops)
 {
-  char buf[80] = "$GPGSA,A,3,";
-  char *bufp = buf + strlen(buf);
+  nmea_sentence_t ns;
+  nmea_start(&ns, "GPGSA,A,3,");
 
   for (u8 i = 0; i < 12; i++) {
-    if (i < nap_track_n_channels && chans[i].state == TRACKING_RUNNING)
-      bufp += sprintf(bufp, "%02d,", chans[i].prn + 1);
-    else
-      *bufp++ = ',';
+    tracking_channel_snapshot_t snap = {.state = TRACKING_DISABLED};
+    if (i < nap_track_n_channels)
+      tracking_channel_snapshot(i, &snap);
+    if (snap.state == TRACKING_RUNNING)
+      nmea_put_uint(&ns, snap.prn + 1, 2);
+    nmea_putc(&ns, ',');
   }
 
-  if (dops)
-    bufp += sprintf(bufp, "%.1f,%.1f,%.1f", dops->pdop, dops->hdop, dops->vdop);
-  else
-    bufp += sprintf(bufp, ",,");
-
-  u8 sum = nmea_checksum(buf);
-
-  sprintf(bufp, "*%02X\r\n", sum);
+  if (dops) {
+    nmea_put_fixed(&ns, dops->pdop, 1, 1);
+    nmea_putc(&ns, ',');
+    nmea_put_fixed(&ns, dops->hdop, 1, 1);
+    nmea_putc(&ns, ',');
+    nmea_put_fixed(&ns, dops->vdop, 1, 1);
+  } else {
+    nmea_puts(&ns, ",,");
+  }
 
-  nmea_output(buf);
+  nmea_finish(&ns);
 }
 
 /** Assemble a NMEA GPGSV message and send it out NMEA USARTs.
@@ -153,47 +291,181 @@ void nmea_gpgsa(tracking_channel_t *chans, dops_t *dops)
  *
  * \param n_used   Number of satellites currently being tracked.
  * \param nav_meas Pointer to navigation_measurement struct.
- * \param soln     Pointer to gnss_solution struct.
+ * \param frame    Frame at the receiver position.
  */
 void nmea_gpgsv(u8 n_used, navigation_measurement_t *nav_meas,
-                gnss_solution *soln)
+                const position_frame_t *frame)
 {
   if (n_used == 0)
     return;
 
   u8 n_mess = (n_used + 3) / 4;
 
-  char buf[80];
-  char *buf0 = buf + sprintf(buf, "$GPGSV,%d,", n_mess);
-  char *bufp = buf0;
-
   u8 n = 0;
   double az, el;
 
   for (u8 i = 0; i < n_mess; i++) {
-    bufp = buf0;
-    bufp += sprintf(bufp, "%d,%d", i + 1, n_used);
+    nmea_sentence_t ns;
+    nmea_start(&ns, "GPGSV,");
+    nmea_put_uint(&ns, n_mess, 1);
+    nmea_putc(&ns, ',');
+    nmea_put_uint(&ns, i + 1, 1);
+    nmea_putc(&ns, ',');
+    nmea_put_uint(&ns, n_used, 1);
 
     for (u8 j = 0; j < 4; j++) {
       if (n < n_used) {
-        wgsecef2azel(nav_meas[n].sat_pos, soln->pos_ecef, &az, &el);
-        bufp += sprintf(
-          bufp, ",%02d,%02d,%03d,%02d",
-          nav_meas[n].prn + 1,
-          (u8)round(el * 180.0 / M_PI),
-          (u16)round(az * 180.0 / M_PI),
-          (u8)(10.0 * nav_meas[n].snr)
-          );
+        position_frame_azel(frame, nav_meas[n].sat_pos, &az, &el);
+        nmea_putc(&ns, ',');
+        nmea_put_uint(&ns, nav_meas[n].prn + 1, 2);
+        nmea_putc(&ns, ',');
+        nmea_put_uint(&ns, (u8)round(el * 180.0 / M_PI), 2);
+        nmea_putc(&ns, ',');
+        nmea_put_uint(&ns, (u16)round(az * 180.0 / M_PI), 3);
+        nmea_putc(&ns, ',');
+        nmea_put_uint(&ns, (u8)(10.0 * nav_meas[n].snr), 2);
       } else {
-        bufp += sprintf(bufp, ",,,,");
+        nmea_puts(&ns, ",,,,");
       }
       n++;
     }
 
-    sprintf(bufp, "*%02X\r\n", nmea_checksum(buf));
-    nmea_output(buf);
+    nmea_finish(&ns);
+  }
+
+}
+
+/** Speed over ground in m/s and course over ground in degrees true. */
+static void nmea_sog_cog(gnss_solution *soln, double *sog, double *cog)
+{
+  *sog = sqrt(soln->vel_ned[0]*soln->vel_ned[0] +
+              soln->vel_ned[1]*soln->vel_ned[1]);
+  *cog = atan2(soln->vel_ned[1], soln->vel_ned[0]) * (180.0 / M_PI);
+  if (*cog < 0)
+    *cog += 360.0;
+}
+
+#define MS2KNOTS 1.943844492
+#define MS2KMH   3.6
+
+/** Assemble a NMEA GPRMC message and send it out NMEA USARTs.
+ * NMEA GPRMC message contains the Recommended Minimum Specific GNSS Data.
+ *
+ * \param soln Pointer to gnss_solution struct.
+ */
+void nmea_gprmc(gnss_solution *soln)
+{
+  struct tm t;
+  u16 ms = nmea_time(soln->time, &t);
+
+  double sog, cog;
+  nmea_sog_cog(soln, &sog, &cog);
+
+  nmea_sentence_t ns;
+  nmea_start(&ns, "GPRMC,");
+  nmea_put_time(&ns, &t, ms);
+  nmea_puts(&ns, ",A,");
+  nmea_put_angle(&ns, soln->pos_llh[0], 2, 'N', 'S');
+  nmea_putc(&ns, ',');
+  nmea_put_angle(&ns, soln->pos_llh[1], 3, 'E', 'W');
+  nmea_putc(&ns, ',');
+  nmea_put_fixed(&ns, sog * MS2KNOTS, 1, 2);
+  nmea_putc(&ns, ',');
+  nmea_put_fixed(&ns, cog, 1, 1);
+  nmea_putc(&ns, ',');
+  nmea_put_uint(&ns, t.tm_mday, 2);
+  nmea_put_uint(&ns, t.tm_mon + 1, 2);
+  nmea_put_uint(&ns, t.tm_year % 100, 2);
+  nmea_puts(&ns, ",,,A");
+  nmea_finish(&ns);
+}
+
+/** Assemble a NMEA GPVTG message and send it out NMEA USARTs.
+ * NMEA GPVTG message contains the Course Over Ground and Ground Speed.
+ *
+ * \param soln Pointer to gnss_solution struct.
+ */
+void nmea_gpvtg(gnss_solution *soln)
+{
+  double sog, cog;
+  nmea_sog_cog(soln, &sog, &cog);
+
+  nmea_sentence_t ns;
+  nmea_start(&ns, "GPVTG,");
+  nmea_put_fixed(&ns, cog, 1, 1);
+  nmea_puts(&ns, ",T,,M,");
+  nmea_put_fixed(&ns, sog * MS2KNOTS, 1, 2);
+  nmea_puts(&ns, ",N,");
+  nmea_put_fixed(&ns, sog * MS2KMH, 1, 2);
+  nmea_puts(&ns, ",K,A");
+  nmea_finish(&ns);
+}
+
+/** Assemble a NMEA GPGST message and send it out NMEA USARTs.
+ * NMEA GPGST message contains the GNSS Pseudorange Error Statistics. The
+ * position error ellipse and standard deviations are found by rotating the
+ * solution's ECEF position covariance into the local NED frame. The RMS of
+ * the pseudorange residuals isn't available so is left empty.
+ *
+ * \param soln  Pointer to gnss_solution struct.
+ * \param frame Frame at the solution position.
+ */
+void nmea_gpgst(gnss_solution *soln, const position_frame_t *frame)
+{
+  struct tm t;
+  u16 ms = nmea_time(soln->time, &t);
+
+  /* err_cov holds the upper triangle of the ECEF position covariance:
+   * xx, xy, xz, yy, yz, zz. */
+  const double *c = soln->err_cov;
+  double cov[3][3] = {
+    {c[0], c[1], c[2]},
+    {c[1], c[3], c[4]},
+    {c[2], c[4], c[5]}
+  };
+
+  const double (*r)[3] = frame->M;
+
+  /* NED covariance, only the north/east block and the down variance are
+   * needed. */
+  double ned[3][3];
+  for (u8 i = 0; i < 3; i++) {
+    for (u8 j = i; j < 3; j++) {
+      double x = 0;
+      for (u8 k = 0; k < 3; k++)
+        for (u8 l = 0; l < 3; l++)
+          x += r[i][k] * cov[k][l] * r[j][l];
+      ned[i][j] = ned[j][i] = x;
+    }
   }
 
+  /* Error ellipse from the eigen decomposition of the north/east block. */
+  double mean = 0.5 * (ned[0][0] + ned[1][1]);
+  double diff = 0.5 * (ned[0][0] - ned[1][1]);
+  double rad = sqrt(diff*diff + ned[0][1]*ned[0][1]);
+  double major = sqrt(fabs(mean + rad));
+  double minor = sqrt(fabs(mean - rad));
+  double orient = 0.5 * atan2(2 * ned[0][1], ned[0][0] - ned[1][1]) *
+                  (180.0 / M_PI);
+  if (orient < 0)
+    orient += 180.0;
+
+  nmea_sentence_t ns;
+  nmea_start(&ns, "GPGST,");
+  nmea_put_time(&ns, &t, ms);
+  nmea_puts(&ns, ",,");
+  nmea_put_fixed(&ns, major, 1, 1);
+  nmea_putc(&ns, ',');
+  nmea_put_fixed(&ns, minor, 1, 1);
+  nmea_putc(&ns, ',');
+  nmea_put_fixed(&ns, orient, 1, 1);
+  nmea_putc(&ns, ',');
+  nmea_put_fixed(&ns, sqrt(fabs(ned[0][0])), 1, 1);
+  nmea_putc(&ns, ',');
+  nmea_put_fixed(&ns, sqrt(fabs(ned[1][1])), 1, 1);
+  nmea_putc(&ns, ',');
+  nmea_put_fixed(&ns, sqrt(fabs(ned[2][2])), 1, 1);
+  nmea_finish(&ns);
 }
 
 /** \} */
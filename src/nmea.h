@@ -16,12 +16,16 @@
 #include <libswiftnav/common.h>
 #include <libswiftnav/pvt.h>
 
+#include "position.h"
 #include "track.h"
 
 void nmea_gpgga(gnss_solution *soln, dops_t *dops);
-void nmea_gpgsa(tracking_channel_t *chans, dops_t *dops);
+void nmea_gpgsa(dops_t *dops);
 void nmea_gpgsv(u8 n_used, navigation_measurement_t *nav_meas,
-                gnss_solution *soln);
+                const position_frame_t *frame);
+void nmea_gprmc(gnss_solution *soln);
+void nmea_gpvtg(gnss_solution *soln);
+void nmea_gpgst(gnss_solution *soln, const position_frame_t *frame);
 
 #endif  /* SWIFTNAV_NMEA_H */
 
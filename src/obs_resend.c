@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+
+#include <math.h>
+#include <string.h>
+
+#include <ch.h>
+
+#include <libswiftnav/gpstime.h>
+
+#include "obs_resend.h"
+#include "sbp.h"
+#include "sbp_piksi.h"
+#include "settings.h"
+#include "solution.h"
+
+/** \defgroup obs_resend Observation resend
+ * Recovery of base station observations lost on the radio link.
+ * A base station keeps its last OBS_RESEND_N epochs of outgoing
+ * observations. A rover that hasn't heard from its base station by a little
+ * after the next epoch was due sends a MSG_OBS_NACK naming the base station
+ * and the epoch, and the base station sends that epoch once more. This
+ * needs a link that carries messages both ways, on a one way link the
+ * requests are simply never heard.
+ *
+ * Epochs are kept, and resent, as MSG_NEW_OBS whichever format the
+ * observations normally go out in. The packed and compact formats code each
+ * epoch against the one sent before it, a resend in one of those would
+ * break the coding for every receiver on the link. The rover only takes
+ * base observations newer than the ones it has (see base_obs_update_start())
+ * so a resend that turns up after the following epoch is dropped rather
+ * than fed to the filters out of order.
+ * \{ */
+
+extern u16 my_sender_id;
+
+/** Keep recent epochs and answer resend requests. */
+static bool obs_resend_enabled = true;
+
+/** One epoch of observations as a MSG_NEW_OBS payload. */
+typedef struct {
+  u8 len;       /**< Payload length, 0 if the slot is empty. */
+  bool resent;  /**< Already resent once, don't do it again. */
+  u8 msg[255];
+} obs_resend_epoch_t;
+
+static obs_resend_epoch_t obs_resend_cache[OBS_RESEND_N] _CCM;
+static u8 obs_resend_next;
+/** Guards the cache between the solution thread storing epochs and the SBP
+ * thread resending them. */
+static Mutex obs_resend_mutex;
+
+/** Keep an epoch of outgoing observations in case it has to be resent.
+ * Called by the solution thread for every epoch sent.
+ * \param len Length of the MSG_NEW_OBS payload.
+ * \param msg MSG_NEW_OBS payload, starting with the gps_time_t of the epoch.
+ */
+void obs_resend_store(u8 len, const u8 msg[])
+{
+  if (!obs_resend_enabled || len < sizeof(gps_time_t))
+    return;
+
+  chMtxLock(&obs_resend_mutex);
+  obs_resend_epoch_t *e = &obs_resend_cache[obs_resend_next];
+  memcpy(e->msg, msg, len);
+  e->len = len;
+  e->resent = false;
+  obs_resend_next = (obs_resend_next + 1) % OBS_RESEND_N;
+  chMtxUnlock();
+}
+
+/** Ask a base station to resend an epoch of observations.
+ * \param base_id Sender ID of the base station.
+ * \param t       GPS time of the missed epoch.
+ */
+void obs_resend_request(u16 base_id, const gps_time_t *t)
+{
+  if (!obs_resend_enabled)
+    return;
+
+  msg_obs_nack_t nack = {
+    .sender_id = base_id,
+    .t = *t,
+  };
+  sbp_send_msg(MSG_OBS_NACK, sizeof(nack), (u8 *)&nack);
+}
+
+static void obs_nack_callback(u16 sender_id, u8 len, u8 msg[], void* context)
+{
+  (void)sender_id; (void)context;
+
+  if (!obs_resend_enabled || len != sizeof(msg_obs_nack_t))
+    return;
+
+  msg_obs_nack_t *nack = (msg_obs_nack_t *)msg;
+  if (nack->sender_id != my_sender_id)
+    return;
+
+  static u8 buff[255];
+  u8 buff_len = 0;
+
+  chMtxLock(&obs_resend_mutex);
+  for (u8 i = 0; i < OBS_RESEND_N; i++) {
+    obs_resend_epoch_t *e = &obs_resend_cache[i];
+    if (e->len == 0 || e->resent)
+      continue;
+    gps_time_t t;
+    memcpy(&t, e->msg, sizeof(t));
+    if (fabs(gpsdifftime(t, nack->t)) < TIME_MATCH_THRESHOLD) {
+      /* Several rovers may miss the same epoch, one resend serves them
+       * all. */
+      e->resent = true;
+      buff_len = e->len;
+      memcpy(buff, e->msg, buff_len);
+      break;
+    }
+  }
+  chMtxUnlock();
+
+  if (buff_len)
+    sbp_send_msg(MSG_NEW_OBS, buff_len, buff);
+}
+
+void obs_resend_setup(void)
+{
+  chMtxInit(&obs_resend_mutex);
+
+  SETTING("solution", "obs_resend", obs_resend_enabled, TYPE_BOOL);
+
+  static sbp_msg_callbacks_node_t obs_nack_node;
+  sbp_register_cbk(
+    MSG_OBS_NACK,
+    &obs_nack_callback,
+    &obs_nack_node
+  );
+}
+
+/** \} */
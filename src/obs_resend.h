@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+
+#ifndef SWIFTNAV_OBS_RESEND_H
+#define SWIFTNAV_OBS_RESEND_H
+
+#include <libswiftnav/common.h>
+#include <libswiftnav/gpstime.h>
+
+/** \addtogroup obs_resend
+ * \{ */
+
+/** Number of recent observation epochs a base station keeps to resend. */
+#define OBS_RESEND_N 4
+
+/** Fraction of the observation period past when the next base observation
+ * was due that the rover waits before asking for it to be resent. */
+#define OBS_RESEND_MARGIN 0.5
+
+/** \} */
+
+void obs_resend_setup(void);
+void obs_resend_store(u8 len, const u8 msg[]);
+void obs_resend_request(u16 base_id, const gps_time_t *t);
+
+#endif  /* SWIFTNAV_OBS_RESEND_H */
@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <math.h>
+
+#include <ch.h>
+
+#include <libswiftnav/ephemeris.h>
+#include <libswiftnav/gpstime.h>
+
+#include "orbit_cache.h"
+
+/** \defgroup orbit_cache Orbit cache
+ * Interpolated satellite states between exact ephemeris evaluations.
+ * Every call to calc_sat_pos(), including the ones libswiftnav's
+ * calc_navigation_measurement() makes, is redirected here by the linker
+ * (`--wrap=calc_sat_pos`, see the Makefiles). Each satellite has a segment
+ * of ORBIT_CACHE_SPAN seconds with the exact state at both ends, positions
+ * and velocities in between come from a cubic Hermite fit, a few dozen
+ * multiply-adds instead of solving Kepler's equation in software double
+ * precision. Segments slide forward as time advances so each satellite only
+ * costs one exact evaluation every ORBIT_CACHE_SPAN seconds.
+ *
+ * The satellite clock correction is the ephemeris polynomial, evaluated
+ * exactly, plus whatever else libswiftnav adds (the relativistic term and
+ * group delay) interpolated linearly, which is good to tens of micrometres.
+ *
+ * Called with es_mutex held, like calc_sat_pos() itself, so the cache needs
+ * no locking of its own.
+ * \{ */
+
+/** Exact satellite state at a segment end. */
+typedef struct {
+  double pos[3];
+  double vel[3];
+  double clock_resid;    /**< Clock error less the af polynomial. (s) */
+  double clock_rate_err;
+} orbit_node_t;
+
+/** Interpolation segment for one satellite. */
+typedef struct {
+  bool valid;
+  /* The ephemeris the segment was fitted to. */
+  gps_time_t toe;
+  double m0;
+  double af0;
+  u8 iode;
+  gps_time_t t0;         /**< Time of node[0], node[1] is ORBIT_CACHE_SPAN
+                              seconds later. */
+  orbit_node_t node[2];
+} orbit_segment_t;
+
+/** Segments indexed the same as es. */
+static orbit_segment_t orbit_cache[32] _CCM;
+
+extern ephemeris_t es[32];
+
+int __real_calc_sat_pos(double pos[3], double vel[3],
+                        double *clock_err, double *clock_rate_err,
+                        const ephemeris_t *ephemeris, gps_time_t time);
+int __wrap_calc_sat_pos(double pos[3], double vel[3],
+                        double *clock_err, double *clock_rate_err,
+                        const ephemeris_t *ephemeris, gps_time_t time);
+
+/** Broadcast clock polynomial at a time. */
+static double orbit_clock_poly(const ephemeris_t *e, gps_time_t t)
+{
+  double dt = gpsdifftime(t, e->toc);
+  return e->af0 + dt * (e->af1 + dt * e->af2);
+}
+
+/** Fill in a node with the exact state at a time.
+ * \return The calc_sat_pos() return value, non-zero on error.
+ */
+static int orbit_node_calc(orbit_node_t *n, const ephemeris_t *e,
+                           gps_time_t t)
+{
+  double clock_err;
+  int ret = __real_calc_sat_pos(n->pos, n->vel, &clock_err,
+                                &n->clock_rate_err, e, t);
+  n->clock_resid = clock_err - orbit_clock_poly(e, t);
+  return ret;
+}
+
+/** Fit a satellite's segment to start at a time.
+ * \return true if the ephemeris could be evaluated at both ends.
+ */
+static bool orbit_segment_fit(orbit_segment_t *seg, const ephemeris_t *e,
+                              gps_time_t t0)
+{
+  gps_time_t t1 = t0;
+  t1.tow += ORBIT_CACHE_SPAN;
+  t1 = normalize_gps_time(t1);
+
+  seg->valid = false;
+  if (orbit_node_calc(&seg->node[0], e, t0) ||
+      orbit_node_calc(&seg->node[1], e, t1))
+    return false;
+
+  seg->toe = e->toe;
+  seg->m0 = e->m0;
+  seg->af0 = e->af0;
+  seg->iode = e->iode;
+  seg->t0 = t0;
+  seg->valid = true;
+  return true;
+}
+
+/** Move a satellite's segment on by one span, reusing its end node.
+ * \return true if the ephemeris could be evaluated at the new end.
+ */
+static bool orbit_segment_slide(orbit_segment_t *seg, const ephemeris_t *e)
+{
+  seg->node[0] = seg->node[1];
+  seg->t0.tow += ORBIT_CACHE_SPAN;
+  seg->t0 = normalize_gps_time(seg->t0);
+
+  gps_time_t t1 = seg->t0;
+  t1.tow += ORBIT_CACHE_SPAN;
+  t1 = normalize_gps_time(t1);
+
+  if (orbit_node_calc(&seg->node[1], e, t1)) {
+    seg->valid = false;
+    return false;
+  }
+  return true;
+}
+
+/** Whether a segment was fitted to an ephemeris. */
+static bool orbit_segment_matches(const orbit_segment_t *seg,
+                                  const ephemeris_t *e)
+{
+  return seg->valid &&
+         seg->toe.wn == e->toe.wn && seg->toe.tow == e->toe.tow &&
+         seg->m0 == e->m0 && seg->af0 == e->af0 && seg->iode == e->iode;
+}
+
+/** Interpolate a satellite's state in its segment.
+ * \param dt Time since the start of the segment, 0 to ORBIT_CACHE_SPAN. (s)
+ */
+static void orbit_segment_eval(const orbit_segment_t *seg, const ephemeris_t *e,
+                               gps_time_t time, double dt,
+                               double pos[3], double vel[3],
+                               double *clock_err, double *clock_rate_err)
+{
+  const orbit_node_t *n0 = &seg->node[0];
+  const orbit_node_t *n1 = &seg->node[1];
+  const double h = ORBIT_CACHE_SPAN;
+  double s = dt / h;
+  double s2 = s * s;
+  double s3 = s2 * s;
+
+  /* Cubic Hermite basis and its derivative. */
+  double h00 = 2*s3 - 3*s2 + 1;
+  double h10 = (s3 - 2*s2 + s) * h;
+  double h01 = -2*s3 + 3*s2;
+  double h11 = (s3 - s2) * h;
+  double d00 = (6*s2 - 6*s) / h;
+  double d10 = 3*s2 - 4*s + 1;
+  double d11 = 3*s2 - 2*s;
+
+  for (u8 i = 0; i < 3; i++) {
+    pos[i] = h00 * n0->pos[i] + h10 * n0->vel[i]
+           + h01 * n1->pos[i] + h11 * n1->vel[i];
+    vel[i] = d00 * (n0->pos[i] - n1->pos[i])
+           + d10 * n0->vel[i] + d11 * n1->vel[i];
+  }
+
+  *clock_err = orbit_clock_poly(e, time) +
+               n0->clock_resid + s * (n1->clock_resid - n0->clock_resid);
+  *clock_rate_err = n0->clock_rate_err +
+                    s * (n1->clock_rate_err - n0->clock_rate_err);
+}
+
+/** Satellite state from the cache, in place of libswiftnav's calc_sat_pos().
+ * Only ephemerides in es are cached, the segment is picked by position in
+ * es rather than by the prn field which not every source fills in. Anything
+ * else, or anything the cache can't hold, falls back to the exact
+ * calculation. Takes and returns the same as calc_sat_pos().
+ */
+int __wrap_calc_sat_pos(double pos[3], double vel[3],
+                        double *clock_err, double *clock_rate_err,
+                        const ephemeris_t *ephemeris, gps_time_t time)
+{
+  if (ephemeris < es || ephemeris >= &es[32])
+    return __real_calc_sat_pos(pos, vel, clock_err, clock_rate_err,
+                               ephemeris, time);
+
+  orbit_segment_t *seg = &orbit_cache[ephemeris - es];
+  double dt = 0;
+  bool ok = false;
+
+  if (orbit_segment_matches(seg, ephemeris)) {
+    dt = gpsdifftime(time, seg->t0);
+    if (dt >= 0 && dt <= ORBIT_CACHE_SPAN) {
+      ok = true;
+    } else if (dt > ORBIT_CACHE_SPAN && dt < 2*ORBIT_CACHE_SPAN) {
+      ok = orbit_segment_slide(seg, ephemeris);
+      dt -= ORBIT_CACHE_SPAN;
+    }
+  }
+
+  if (!ok) {
+    /* Segments start on multiples of the span so that measurements taken a
+     * little apart, e.g. the rover's and a late base station's, share one. */
+    gps_time_t t0 = time;
+    t0.tow = floor(time.tow / ORBIT_CACHE_SPAN) * ORBIT_CACHE_SPAN;
+    if (!orbit_segment_fit(seg, ephemeris, t0))
+      return __real_calc_sat_pos(pos, vel, clock_err, clock_rate_err,
+                                 ephemeris, time);
+    dt = gpsdifftime(time, t0);
+  }
+
+  orbit_segment_eval(seg, ephemeris, time, dt, pos, vel,
+                     clock_err, clock_rate_err);
+  return 0;
+}
+
+/** Drop a satellite's cached orbit, call when its ephemeris changes.
+ * The cache also notices a changed ephemeris by itself, this just makes
+ * sure nothing is kept from an ephemeris that is no longer in use.
+ * Call with es_mutex held.
+ * \param prn PRN, 0-31.
+ */
+void orbit_cache_invalidate(u8 prn)
+{
+  if (prn < 32)
+    orbit_cache[prn].valid = false;
+}
+
+/** \} */
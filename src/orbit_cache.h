@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef SWIFTNAV_ORBIT_CACHE_H
+#define SWIFTNAV_ORBIT_CACHE_H
+
+#include <libswiftnav/common.h>
+
+/** \addtogroup orbit_cache
+ * \{ */
+
+/** Length of each interpolated orbit segment, (s). The cubic Hermite
+ * position error grows as the fourth power of this, at 30 s it is about
+ * 30 um for a GPS orbit. */
+#define ORBIT_CACHE_SPAN 30
+
+/** \} */
+
+void orbit_cache_invalidate(u8 prn);
+
+#endif  /* SWIFTNAV_ORBIT_CACHE_H */
@@ -0,0 +1,431 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <libswiftnav/constants.h>
+
+#include <ch.h>
+
+#include "packed_obs.h"
+#include "sbp.h"
+#include "sbp_piksi.h"
+#include "solution.h"
+
+/** \defgroup packed_obs Packed observations
+ * Compact, multi-part observation messages.
+ * The observations of an epoch are sent in as many MSG_PACKED_OBS parts as
+ * needed, so the number of satellites isn't limited by the SBP length field.
+ * Pseudorange and carrier phase are quantized, and when the same PRN was in
+ * the previous epoch only the change from its quantized value there is
+ * sent. The receiver reassembles the parts of an epoch before passing them
+ * on as the base observations.
+ *
+ * MSG_COMPACT_OBS is a simpler format for slow radio links, along the lines
+ * of RTCM 1002. Every record stands alone: the pseudorange modulo one light
+ * millisecond plus the whole milliseconds, and the carrier phase as its
+ * difference from the pseudorange. An integer number of cycles chosen when
+ * the PRN is first sent keeps that difference small. The lock counter
+ * changes whenever that offset changes, so a receiver knows the carrier
+ * phase isn't continuous.
+ * \{ */
+
+/** Last quantized observation of a PRN, the reference for delta records. */
+typedef struct {
+  bool valid;
+  u8 count;   /**< Epoch counter the observation was in. */
+  u32 P;      /**< Pseudorange in PACKED_OBS_P_UNITS. */
+  s64 L;      /**< Carrier phase in 1/PACKED_OBS_L_SCALE cycles. */
+} packed_obs_ref_t;
+
+static packed_obs_ref_t tx_refs[32];
+static u8 tx_count = 0;
+
+/** Compact observation carrier phase offset for a PRN. */
+typedef struct {
+  bool valid;
+  u8 count;   /**< Epoch counter the PRN was last sent in. */
+  u8 lock;    /**< Lock counter sent with the PRN. */
+  s64 N;      /**< Cycles subtracted from the carrier phase. */
+} compact_obs_ref_t;
+
+static compact_obs_ref_t compact_tx_refs[32];
+static u8 compact_tx_count = 0;
+
+/** Epoch being reassembled from received parts. */
+typedef struct {
+  bool active;
+  u8 count;
+  u8 n_parts;
+  u16 parts;   /**< Bit mask of the parts received so far. */
+  obss_t obss;
+} packed_obs_epoch_t;
+
+/** Receive state for one base station. */
+typedef struct {
+  u16 sender_id;  /**< Zero for an unused slot. */
+  systime_t last_rx;
+  packed_obs_ref_t refs[32];
+  packed_obs_epoch_t epoch;
+  /** Last compact lock counter received for each PRN, bit 8 set once
+   * valid. */
+  u16 compact_lock[32];
+} packed_obs_rx_t;
+
+static packed_obs_rx_t rx_state[BASE_N_MAX];
+
+/** Receive state for a base station. A new base station takes over the
+ * slot that has gone longest without a message, its state is cleared.
+ */
+static packed_obs_rx_t *packed_obs_rx_get(u16 sender_id)
+{
+  packed_obs_rx_t *oldest = &rx_state[0];
+  systime_t now = chTimeNow();
+
+  for (u8 i=0; i<BASE_N_MAX; i++) {
+    packed_obs_rx_t *rx = &rx_state[i];
+    if (rx->sender_id == sender_id) {
+      rx->last_rx = now;
+      return rx;
+    }
+    if (rx->sender_id == 0 ||
+        (oldest->sender_id != 0 &&
+         (now - rx->last_rx) > (now - oldest->last_rx)))
+      oldest = rx;
+  }
+
+  memset(oldest, 0, sizeof(*oldest));
+  oldest->sender_id = sender_id;
+  oldest->last_rx = now;
+  return oldest;
+}
+
+static u8 packed_obs_encode_snr(float snr)
+{
+  if (snr <= 0)
+    return 0;
+  s32 x = lroundf(10.0f * log10f(snr) / PACKED_OBS_SNR_UNITS) + 128;
+  return MAX(0, MIN(255, x));
+}
+
+static float packed_obs_decode_snr(u8 x)
+{
+  return powf(10.0f, ((s32)x - 128) * PACKED_OBS_SNR_UNITS / 10.0f);
+}
+
+/** Code one observation, as a delta record if the receiver can have its
+ * reference. Updates the reference for the next epoch.
+ * \return Length of the record.
+ */
+static u8 packed_obs_encode(const navigation_measurement_t *m, u8 *rec)
+{
+  packed_obs_ref_t *ref = &tx_refs[m->prn];
+  u32 P = lround(m->raw_pseudorange / PACKED_OBS_P_UNITS);
+  s64 L = llround(m->carrier_phase * PACKED_OBS_L_SCALE);
+  u8 snr = packed_obs_encode_snr(m->snr);
+
+  s64 dP = (s64)P - ref->P;
+  s64 dL = L - ref->L;
+  bool delta = ref->valid && ref->count == (u8)(tx_count - 1) &&
+               (tx_count + m->prn) % PACKED_OBS_FULL_PERIOD != 0 &&
+               dP >= INT16_MIN && dP <= INT16_MAX &&
+               dL >= INT32_MIN && dL <= INT32_MAX;
+
+  ref->valid = true;
+  ref->count = tx_count;
+  ref->P = P;
+  ref->L = L;
+
+  if (delta) {
+    msg_packed_obs_delta_t d = {
+      .prn = m->prn | PACKED_OBS_DELTA, .snr = snr, .dP = dP, .dL = dL
+    };
+    memcpy(rec, &d, sizeof(d));
+    return sizeof(d);
+  }
+
+  msg_packed_obs_full_t f = {
+    .prn = m->prn, .snr = snr, .P = P,
+    .L_i = L >> 8, .L_f = L & 0xFF
+  };
+  memcpy(rec, &f, sizeof(f));
+  return sizeof(f);
+}
+
+/** Send the observations of an epoch in MSG_PACKED_OBS messages.
+ * Records are packed greedily into as few parts as possible, a record is
+ * never split between parts.
+ *
+ * \param n Number of observations.
+ * \param t GPS time of the observations.
+ * \param m Observations.
+ */
+void packed_obs_send(u8 n, const gps_time_t *t,
+                     const navigation_measurement_t *m)
+{
+  static u8 recs[32 * sizeof(msg_packed_obs_full_t)];
+  u8 rec_len[32];
+  const u8 max_payload = 255 - sizeof(msg_packed_obs_hdr_t);
+
+  n = MIN(n, 32);
+  tx_count++;
+
+  u16 off = 0;
+  u8 n_parts = 1;
+  u8 part_len = 0;
+  for (u8 i=0; i<n; i++) {
+    rec_len[i] = packed_obs_encode(&m[i], &recs[off]);
+    off += rec_len[i];
+    if (part_len + rec_len[i] > max_payload) {
+      n_parts++;
+      part_len = 0;
+    }
+    part_len += rec_len[i];
+  }
+  if (n_parts > PACKED_OBS_MAX_PARTS)
+    return;
+
+  u8 buff[255];
+  msg_packed_obs_hdr_t *hdr = (msg_packed_obs_hdr_t *)buff;
+  hdr->t = *t;
+  hdr->count = tx_count;
+
+  u8 part = 0;
+  u8 i = 0;
+  off = 0;
+  while (part < n_parts) {
+    u8 len = 0;
+    u16 start = off;
+    while (i < n && len + rec_len[i] <= max_payload) {
+      len += rec_len[i];
+      off += rec_len[i++];
+    }
+    hdr->seq = (n_parts << 4) | part++;
+    memcpy(&buff[sizeof(*hdr)], &recs[start], len);
+    sbp_send_msg(MSG_PACKED_OBS, sizeof(*hdr) + len, buff);
+  }
+}
+
+/** Decode the records of one received part into the epoch of `rx`. */
+static void packed_obs_decode(packed_obs_rx_t *rx, u8 count, u8 len,
+                              const u8 *rec)
+{
+  while (len > 0) {
+    u8 prn = rec[0] & ~PACKED_OBS_DELTA;
+    bool delta = rec[0] & PACKED_OBS_DELTA;
+    u8 rec_len = delta ? sizeof(msg_packed_obs_delta_t)
+                       : sizeof(msg_packed_obs_full_t);
+    if (rec_len > len || prn >= 32)
+      return;
+
+    packed_obs_ref_t *ref = &rx->refs[prn];
+    u8 snr;
+    if (delta) {
+      msg_packed_obs_delta_t d;
+      memcpy(&d, rec, sizeof(d));
+      snr = d.snr;
+      if (ref->valid && ref->count == (u8)(count - 1)) {
+        ref->P += d.dP;
+        ref->L += d.dL;
+        ref->count = count;
+      } else {
+        /* Missed the reference, wait for a full record. */
+        ref->valid = false;
+      }
+    } else {
+      msg_packed_obs_full_t f;
+      memcpy(&f, rec, sizeof(f));
+      snr = f.snr;
+      ref->valid = true;
+      ref->count = count;
+      ref->P = f.P;
+      ref->L = (s64)f.L_i * PACKED_OBS_L_SCALE + f.L_f;
+    }
+    rec += rec_len;
+    len -= rec_len;
+
+    if (!ref->valid)
+      continue;
+    navigation_measurement_t *nm = base_obs_insert(&rx->epoch.obss, prn);
+    if (!nm)
+      continue;
+    nm->raw_pseudorange = ref->P * PACKED_OBS_P_UNITS;
+    nm->carrier_phase = (double)ref->L / PACKED_OBS_L_SCALE;
+    nm->snr = packed_obs_decode_snr(snr);
+  }
+}
+
+/** Handle a MSG_PACKED_OBS from the base station.
+ * Relays the part to the host, then adds it to the epoch being reassembled.
+ * Once every part of the epoch has arrived the observations replace the
+ * base observations. An epoch still missing parts when a part of a newer
+ * one arrives is dropped.
+ */
+void packed_obs_callback(u16 sender_id, u8 len, u8 msg[], void *context)
+{
+  (void)context;
+
+  /* Sender ID of zero means that the messages are relayed observations,
+   * ignore them. */
+  if (sender_id == 0)
+    return;
+
+  sbp_relay_msg(MSG_PACKED_OBS, len, msg);
+
+  if (len < sizeof(msg_packed_obs_hdr_t))
+    return;
+  msg_packed_obs_hdr_t *hdr = (msg_packed_obs_hdr_t *)msg;
+  u8 n_parts = hdr->seq >> 4;
+  u8 part = hdr->seq & 0x0F;
+  if (part >= n_parts)
+    return;
+
+  packed_obs_rx_t *rx = packed_obs_rx_get(sender_id);
+  packed_obs_epoch_t *epoch = &rx->epoch;
+  if (!epoch->active || epoch->count != hdr->count) {
+    epoch->active = true;
+    epoch->count = hdr->count;
+    epoch->n_parts = n_parts;
+    epoch->parts = 0;
+    epoch->obss.t = hdr->t;
+    epoch->obss.n = 0;
+  }
+  if (epoch->parts & (1u << part))
+    return;
+  epoch->parts |= 1u << part;
+
+  packed_obs_decode(rx, hdr->count, len - sizeof(*hdr), &msg[sizeof(*hdr)]);
+
+  if (epoch->parts != (1u << epoch->n_parts) - 1)
+    return;
+  epoch->active = false;
+
+  obss_t *obss = base_obs_update_start(sender_id, &epoch->obss.t);
+  if (!obss)
+    return;
+  obss->n = epoch->obss.n;
+  memcpy(obss->nm, epoch->obss.nm, obss->n * sizeof(obss->nm[0]));
+  base_obs_update_finish();
+}
+
+/** Send the observations of an epoch in a MSG_COMPACT_OBS.
+ * Only as many observations as fit in one message are sent.
+ *
+ * \param n Number of observations.
+ * \param t GPS time of the observations.
+ * \param m Observations.
+ */
+void compact_obs_send(u8 n, const gps_time_t *t,
+                      const navigation_measurement_t *m)
+{
+  const double lms = GPS_C / 1000.0;
+  u8 buff[255];
+  msg_compact_obs_t *obs = (msg_compact_obs_t *)&buff[sizeof(gps_time_t)];
+
+  memcpy(buff, t, sizeof(gps_time_t));
+  n = MIN(n, (sizeof(buff) - sizeof(gps_time_t)) / sizeof(msg_compact_obs_t));
+  compact_tx_count++;
+
+  for (u8 i=0; i<n; i++) {
+    compact_obs_ref_t *ref = &compact_tx_refs[m[i].prn];
+
+    u32 amb = floor(m[i].raw_pseudorange / lms);
+    u32 P = lround((m[i].raw_pseudorange - amb * lms) / COMPACT_OBS_P_UNITS);
+    double P_q = amb * lms + P * COMPACT_OBS_P_UNITS;
+
+    /* Our carrier phase decreases as the pseudorange grows, the sum stays
+     * close to the integer ambiguity. */
+    double cp = m[i].carrier_phase + P_q / GPS_L1_LAMBDA;
+    s64 cpr = ref->valid ?
+      llround((cp - ref->N) * GPS_L1_LAMBDA / COMPACT_OBS_CPR_UNITS) : 0;
+    if (!ref->valid || ref->count != (u8)(compact_tx_count - 1) ||
+        cpr > COMPACT_OBS_CPR_MAX || cpr < -COMPACT_OBS_CPR_MAX) {
+      /* New lock, or the carrier has drifted too far from the code. */
+      ref->valid = true;
+      ref->lock++;
+      ref->N = llround(cp);
+      cpr = llround((cp - ref->N) * GPS_L1_LAMBDA / COMPACT_OBS_CPR_UNITS);
+    }
+    ref->count = compact_tx_count;
+
+    obs[i].prn = m[i].prn;
+    obs[i].amb = amb;
+    obs[i].P[0] = P;
+    obs[i].P[1] = P >> 8;
+    obs[i].P[2] = P >> 16;
+    obs[i].cpr[0] = cpr;
+    obs[i].cpr[1] = cpr >> 8;
+    obs[i].cpr[2] = cpr >> 16;
+    obs[i].lock = ref->lock;
+    obs[i].snr = packed_obs_encode_snr(m[i].snr);
+  }
+
+  sbp_send_msg(MSG_COMPACT_OBS,
+               sizeof(gps_time_t) + n * sizeof(msg_compact_obs_t), buff);
+}
+
+/** Handle a MSG_COMPACT_OBS from the base station.
+ * Relays it to the host and replaces the base observations with its
+ * contents. A PRN whose lock counter changed is marked as slipped.
+ */
+void compact_obs_callback(u16 sender_id, u8 len, u8 msg[], void *context)
+{
+  (void)context;
+  const double lms = GPS_C / 1000.0;
+
+  /* Sender ID of zero means that the messages are relayed observations,
+   * ignore them. */
+  if (sender_id == 0)
+    return;
+
+  sbp_relay_msg(MSG_COMPACT_OBS, len, msg);
+
+  if (len < sizeof(gps_time_t))
+    return;
+  gps_time_t t;
+  memcpy(&t, msg, sizeof(t));
+
+  packed_obs_rx_t *rx = packed_obs_rx_get(sender_id);
+  obss_t *obss = base_obs_update_start(sender_id, &t);
+  if (!obss)
+    return;
+
+  u8 n = (len - sizeof(gps_time_t)) / sizeof(msg_compact_obs_t);
+  msg_compact_obs_t *obs = (msg_compact_obs_t *)&msg[sizeof(gps_time_t)];
+  for (u8 i=0; i<n; i++) {
+    u8 prn = obs[i].prn;
+    if (prn >= 32)
+      continue;
+
+    u32 P = obs[i].P[0] | (obs[i].P[1] << 8) | ((u32)obs[i].P[2] << 16);
+    /* Sign extend from 24 bits. */
+    s32 cpr = (s32)(((u32)obs[i].cpr[0] | (obs[i].cpr[1] << 8) |
+                     ((u32)obs[i].cpr[2] << 16)) << 8) >> 8;
+
+    if (rx->compact_lock[prn] != (0x100 | obs[i].lock))
+      obss->slips |= 1u << prn;
+    rx->compact_lock[prn] = 0x100 | obs[i].lock;
+
+    navigation_measurement_t *nm = base_obs_insert(obss, prn);
+    if (!nm)
+      break;
+    nm->raw_pseudorange = obs[i].amb * lms + P * COMPACT_OBS_P_UNITS;
+    nm->carrier_phase = (cpr * COMPACT_OBS_CPR_UNITS - nm->raw_pseudorange)
+                        / GPS_L1_LAMBDA;
+    nm->snr = packed_obs_decode_snr(obs[i].snr);
+  }
+
+  base_obs_update_finish();
+}
+
+/** \} */
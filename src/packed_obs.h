@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef SWIFTNAV_PACKED_OBS_H
+#define SWIFTNAV_PACKED_OBS_H
+
+#include <libswiftnav/common.h>
+#include <libswiftnav/gpstime.h>
+#include <libswiftnav/track.h>
+
+/** \addtogroup packed_obs
+ * \{ */
+
+/** Each PRN is sent as a full record at least once every this many epochs,
+ * so a receiver that missed a message can pick up the deltas again. */
+#define PACKED_OBS_FULL_PERIOD 10
+
+/** Most parts an epoch can be split into, limited by the seq field. */
+#define PACKED_OBS_MAX_PARTS 15
+
+/** Largest carrier-phase minus pseudorange that can be coded, in
+ * COMPACT_OBS_CPR_UNITS. */
+#define COMPACT_OBS_CPR_MAX ((1 << 23) - 1)
+
+/** \} */
+
+void packed_obs_send(u8 n, const gps_time_t *t,
+                     const navigation_measurement_t *m);
+void packed_obs_callback(u16 sender_id, u8 len, u8 msg[], void *context);
+void compact_obs_send(u8 n, const gps_time_t *t,
+                      const navigation_measurement_t *m);
+void compact_obs_callback(u16 sender_id, u8 len, u8 msg[], void *context);
+
+#endif  /* SWIFTNAV_PACKED_OBS_H */
@@ -16,6 +16,8 @@
 #include <string.h>
 #include "3drradio.h"
 #include "../settings.h"
+#include "../persist.h"
+#include "../cfs/cfs.h"
 
 #define WAIT_FOR_3DR_MS 1200
 #define WAIT_BETWEEN_COMMANDS 500
@@ -23,6 +25,15 @@
 #define RADIO_RETRY_COUNT 1
 #define FINAL_BAUDRATE 115200
 #define MAXLEN 256
+/** A SiK radio only answers the escape sequence once its one second guard
+ * time has passed, so there is no point polling for the reply before this. */
+#define RADIO_GUARD_SLEEP_MS 500
+
+#define RADIO_THREAD_PRIORITY (LOWPRIO+1)
+#define RADIO_THREAD_STACK    1024
+
+/** File caching the last baud rate a radio was found at on each port. */
+#define RADIO_CACHE_FILE "radio"
 
 /* see SiK firmware, serial.c, serial_rates[] */
 static const u32 baud_rates[] = {115200, 57600};//, 230400, 38400, 19200};
@@ -97,74 +108,155 @@ void usart_send_str_blocking(u32 usart, char* str)
   usart_wait_send_ready(usart);
 }
 
-/**
-* This function hooks into the UART setup code before DMA gets enabled,
-* and configures any 3DR radio it finds on the given uart.
-*/
-void radio_preconfigure_hook(u32 usart, u32 default_baud, char* uart_name)
+/** Look for a radio in AT command mode on a USART.
+ * The cached baud rate is tried first, then the rest of baud_rates.
+ *
+ * \param usart  The libopencm3-defined UART base address
+ * \param cached Baud rate to try first, or 0 if none is known
+ * \return       Baud rate the radio was found at, or 0 if none was found
+ */
+static u32 radio_find(u32 usart, u32 cached)
 {
+  u8 n_rates = sizeof(baud_rates)/sizeof(baud_rates[0]);
 
-  /** TODO:
-  * Future features we might consider
-  * - READ THE FIRMWARE
-  * - RESET TO FACTORY DEFAULTS IF WE WANT
-  * - GET RSSI REPORTS
-  */
-
-  bool found_radio = false;
-  u8 tries = 0;
-  u8 baud_index = 0;
-  u32 baud_rate = 0;
-
-  /* First we attempt to find a radio at all possible baudrates */
-
-  while (!found_radio && baud_index < (sizeof(baud_rates)/sizeof(baud_rates[0]))) {
-    tries = 0;
-    baud_rate = baud_rates[baud_index];
-    baud_index++;
+  for (s8 i = -1; i < n_rates; i++) {
+    u32 baud_rate;
+    if (i < 0) {
+      if (cached == 0)
+        continue;
+      baud_rate = cached;
+    } else {
+      baud_rate = baud_rates[i];
+      if (baud_rate == cached)
+        continue;
+    }
 
     /* Configure the UART for the current baudrate */
     usart_set_parameters(usart, baud_rate);
 
     /* Try to get a radio into AT command mode */
-    while (!found_radio && (tries < RADIO_RETRY_COUNT)) {
-      tries++;
+    for (u8 tries = 0; tries < RADIO_RETRY_COUNT; tries++) {
       usart_send_str_blocking(usart, "+++");
-      found_radio = busy_wait_for_str(usart, "OK\r\n", WAIT_FOR_3DR_MS);
+      chThdSleepMilliseconds(RADIO_GUARD_SLEEP_MS);
+      /* Throw away anything that arrived while we slept. */
+      (void)USART_SR(usart);
+      (void)USART_DR(usart);
+      if (busy_wait_for_str(usart, "OK\r\n",
+                            WAIT_FOR_3DR_MS - RADIO_GUARD_SLEEP_MS))
+        return baud_rate;
+    }
+  }
+
+  return 0;
+}
+
+/** Send the configuration string to a radio in AT command mode. */
+static void radio_send_config(u32 usart)
+{
+  char* command = commandstr;
+  while (*command != 0) {
+
+    if (*command == ',') {
+      usart_send_str_blocking(usart, "\r\n");
+      busy_wait_for_str(usart, "OK\r\n", WAIT_BETWEEN_COMMANDS);
+    } else {
+      u16 c = (uint8_t)*command;
+      usart_send_blocking(usart, c);
     }
 
+    command++;
   }
 
-  /* If we found a radio, we send it a configuration string. */
-  if (found_radio) {
-    printf("Telemetry radio found on %s at baudrate %lu, "
-           "sending configuration string.\n", uart_name, baud_rate);
+  usart_send_str_blocking(usart, "\r\n");
+  busy_wait_for_str(usart, "\x00", WAIT_BETWEEN_COMMANDS);
+}
 
-    char* command = commandstr;
-    while (*command != 0) {
+/** Read the cached baud rate for a port, 0 if there is none. */
+static u32 radio_cache_read(u8 port)
+{
+  u32 baud = 0;
+  int fd = cfs_open(RADIO_CACHE_FILE, CFS_READ);
+  if (fd != -1) {
+    cfs_seek(fd, port * sizeof(u32), CFS_SEEK_SET);
+    if (cfs_read(fd, &baud, sizeof(baud)) != sizeof(baud))
+      baud = 0;
+    cfs_close(fd);
+  }
+  return baud;
+}
 
-      if (*command == ',') {
-        usart_send_str_blocking(usart, "\r\n");
-        busy_wait_for_str(usart, "OK\r\n", WAIT_BETWEEN_COMMANDS);
-      } else {
-        u16 c = (uint8_t)*command;
-        usart_send_blocking(usart, c);
-      }
+typedef struct {
+  u32 usart;
+  const char *name;
+  u32 cached_baud;
+  void (*done)(u8 port);
+} radio_port_t;
 
-      command++;
-    }
+static radio_port_t radio_ports[RADIO_N_PORTS];
 
-    usart_send_str_blocking(usart, "\r\n");
-    busy_wait_for_str(usart, "\x00", WAIT_BETWEEN_COMMANDS);
+static WORKING_AREA_CCM(wa_radio_thread_0, RADIO_THREAD_STACK);
+static WORKING_AREA_CCM(wa_radio_thread_1, RADIO_THREAD_STACK);
 
+static msg_t radio_thread(void *arg)
+{
+  u8 port = (u32)arg;
+  radio_port_t *p = &radio_ports[port];
+  chRegSetThreadName("radio");
+
+  /** TODO:
+  * Future features we might consider
+  * - READ THE FIRMWARE
+  * - RESET TO FACTORY DEFAULTS IF WE WANT
+  * - GET RSSI REPORTS
+  */
+
+  u32 cached = p->cached_baud;
+  u32 baud_rate = radio_find(p->usart, cached);
+
+  /* If we found a radio, we send it a configuration string. */
+  if (baud_rate) {
+    printf("Telemetry radio found on %s at baudrate %lu, "
+           "sending configuration string.\n", p->name, baud_rate);
+    radio_send_config(p->usart);
+    if (baud_rate != cached)
+      persist_write(RADIO_CACHE_FILE, port * sizeof(u32),
+                    &baud_rate, sizeof(baud_rate));
   } else {
     printf("No telemetry radio found on %s, skipping configuration.\n",
-           uart_name);
+           p->name);
   }
 
-  /* Reset the UART to the original baudrate. */
-  usart_set_parameters(usart, default_baud);
+  p->done(port);
+
+  return 0;
+}
+
+/** Configure any 3DR radio on a USART in the background.
+ * The USART is driven directly rather than with DMA so the caller must not
+ * set up its DMA until the done callback has been called. The callback is
+ * responsible for putting the USART back to its configured baud rate.
+ *
+ * \param port      Index of the port, less than RADIO_N_PORTS
+ * \param usart     The libopencm3-defined UART base address
+ * \param uart_name Name of the port to print in messages
+ * \param done      Called from the configuration thread when it finishes
+ */
+void radio_configure_start(u8 port, u32 usart, const char *uart_name,
+                           void (*done)(u8 port))
+{
+  static stkalign_t * const wa[RADIO_N_PORTS] = {
+    wa_radio_thread_0, wa_radio_thread_1
+  };
+
+  radio_ports[port].usart = usart;
+  radio_ports[port].name = uart_name;
+  radio_ports[port].done = done;
+  /* Read along with the other boot time CFS reads rather than racing them
+   * from the configuration thread. */
+  radio_ports[port].cached_baud = radio_cache_read(port);
 
+  chThdCreateStatic(wa[port], sizeof(wa_radio_thread_0),
+                    RADIO_THREAD_PRIORITY, radio_thread, (void *)(u32)port);
 }
 
 void radio_setup()
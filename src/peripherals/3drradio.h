@@ -20,7 +20,31 @@ bool usart_wait_recv_ready_with_timeout(uint32_t usart, u32 ms);
 bool busy_wait_for_str(u32 usart, char* str, u32 ms);
 void usart_send_str_blocking(u32 usart, char* str);
 
-void radio_preconfigure_hook(u32 usart, u32 default_baud, char* uart_name);
+/** Build the telemetry radio configuration in, see the build profiles in
+ * src/Makefile. Without it the ports are never searched for radios and the
+ * radio settings are left out. */
+#ifndef BUILD_RADIO
+#define BUILD_RADIO 1
+#endif
+
+/** Largest payload the radio firmware puts in one over the air packet.
+ * Data written to the radio is sent as soon as a packet's worth has
+ * arrived or the serial line goes quiet. (bytes) */
+#define RADIO_PACKET_LEN 252
+
+/** Default number of radio packets in each SBP burst, see
+ * sbp_tx_burst_epoch(). */
+#define RADIO_BURST_PACKETS 4
+
+/** Default time from the solution epoch to sending the SBP burst, long
+ * enough for the solution and observations to have been sent. (ms) */
+#define RADIO_BURST_PHASE 50
+
+/** Number of ports that can be configured at the same time. */
+#define RADIO_N_PORTS 2
+
+void radio_configure_start(u8 port, u32 usart, const char *uart_name,
+                           void (*done)(u8 port));
 void radio_setup();
 
 #endif  /* _SWIFTNAV_3DRRADIO_H_ */
\ No newline at end of file
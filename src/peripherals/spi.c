@@ -30,10 +30,27 @@ extern const u8 dma_irq_lookup[2][8];
 /** \defgroup spi SPI
  * Functions to setup and use STM32F4 SPI peripherals to communicate with the
  * SwiftNAP FPGA, MAX2769 front-end and the M25 configuration flash.
+ *
+ * The FPGA has SPI1 to itself, the flash and the front-end share SPI2, and
+ * each bus has its own lock so nothing on SPI2 ever holds up the tracking
+ * loops. Users hold a bus for one transaction at a time so a higher
+ * priority user gets it at the next transaction boundary.
  * \{ */
 
+/** Lock for SPI1. A semaphore rather than a mutex as the NAP ISR takes it
+ * too, see spi_slave_try_select_i(). */
 static BinarySemaphore spi_sem;
+/** Lock for SPI2. Only ever taken by threads, so a mutex, waiting threads
+ * get the bus in priority order and a holder is raised to the priority of
+ * the highest waiter so it can't be stalled by threads in between. */
+static Mutex spi2_mutex;
 static BinarySemaphore spi_dma_sem;
+static BinarySemaphore spi2_dma_sem;
+
+/* Pool of transfer buffers that DMA can reach. */
+static MemoryPool spi_dma_buff_pool;
+static u8 spi_dma_buff[SPI_DMA_N_BUFF][SPI_DMA_BUFF_LEN]
+  __attribute__((aligned(4))) _DMA;
 
 /** Set up the SPI buses.
  * Set up the SPI peripheral, SPI clocks, SPI pins, and SPI pins' clocks.
@@ -81,6 +98,7 @@ void spi_setup(void)
   spi_enable(SPI2);
 
   chBSemInit(&spi_sem, FALSE);
+  chMtxInit(&spi2_mutex);
 }
 
 /** Deactivate SPI buses.
@@ -115,13 +133,8 @@ void spi_deactivate(void)
   RCC_AHB1ENR &= ~(RCC_AHB1ENR_IOPAEN | RCC_AHB1ENR_IOPBEN);
 }
 
-/** Drive SPI nCS line low for selected peripheral.
- * \param slave Peripheral to drive chip select for.
- */
-void spi_slave_select(u8 slave)
+static void spi_cs_assert(u8 slave)
 {
-  chBSemWait(&spi_sem);
-
   switch (slave) {
   case SPI_SLAVE_FPGA:
     gpio_clear(GPIOA, GPIO4);
@@ -137,17 +150,89 @@ void spi_slave_select(u8 slave)
   }
 }
 
-/** Drive all SPI nCS lines high.
+/** Drive the nCS lines of every peripheral on a slave's bus high. */
+static void spi_cs_release(u8 slave)
+{
+  if (slave == SPI_SLAVE_FPGA) {
+    /* Deselect FPGA CS */
+    gpio_set(GPIOA, GPIO4);
+  } else {
+    /* Deselect configuration flash and front-end CS */
+    gpio_set(GPIOB, GPIO11 | GPIO12);
+  }
+}
+
+/** Take the peripheral's SPI bus and drive its nCS line low.
+ * \param slave Peripheral to drive chip select for.
+ */
+void spi_slave_select(u8 slave)
+{
+  if (slave == SPI_SLAVE_FPGA)
+    chBSemWait(&spi_sem);
+  else
+    chMtxLock(&spi2_mutex);
+  spi_cs_assert(slave);
+}
+
+/** Drive the peripheral's nCS line high and release its SPI bus.
  * Should be called after an SPI transfer is finished.
+ * \param slave Peripheral passed to spi_slave_select().
  */
-void spi_slave_deselect(void)
+void spi_slave_deselect(u8 slave)
 {
-  /* Deselect FPGA CS */
-  gpio_set(GPIOA, GPIO4);
-  /* Deselect configuration flash and front-end CS */
-  gpio_set(GPIOB, GPIO11 | GPIO12);
+  spi_cs_release(slave);
+  if (slave == SPI_SLAVE_FPGA)
+    chBSemSignal(&spi_sem);
+  else
+    chMtxUnlock();
+}
 
-  chBSemSignal(&spi_sem);
+/** Take the SPI bus and select a peripheral from an ISR, if the bus is free.
+ * Never waits, an ISR can't sleep until a thread has finished with the bus.
+ * Only the FPGA's bus can be taken from an ISR.
+ * Must be called with the kernel locked, see chSysLockFromIsr(). The bus
+ * may then be used with the kernel unlocked, but only for polled transfers
+ * as the DMA completion semaphores can't be waited on from an ISR.
+ *
+ * \param slave Peripheral to drive chip select for.
+ * \return true if the bus was taken, false if a thread has it.
+ */
+bool spi_slave_try_select_i(u8 slave)
+{
+  if (slave != SPI_SLAVE_FPGA)
+    return false;
+  if (chBSemGetStateI(&spi_sem))
+    return false;
+  chSemFastWaitI(&spi_sem.bs_sem);
+  spi_cs_assert(slave);
+  return true;
+}
+
+/** Drive all SPI nCS lines high and release a bus taken with
+ * spi_slave_try_select_i(). Must be called with the kernel locked, any
+ * thread that was waiting for the bus runs on leaving the ISR.
+ */
+void spi_slave_deselect_i(void)
+{
+  spi_cs_release(SPI_SLAVE_FPGA);
+  chBSemSignalI(&spi_sem);
+}
+
+/** Start a new SPI frame on the currently selected peripheral.
+ * Pulses the nCS line high and then low again without releasing the bus so
+ * that a sequence of transfers to different registers can be made while only
+ * taking the bus lock once. Must only be called between spi_slave_select()
+ * and spi_slave_deselect().
+ *
+ * \param slave Peripheral that is currently selected.
+ */
+void spi_slave_reselect(u8 slave)
+{
+  spi_cs_release(slave);
+  /* Hold nCS high for a few cycles so the frame boundary is seen. */
+  for (u8 i = 0; i < 8; i++)
+    __asm__("nop");
+  spi_cs_assert(slave);
 }
 
 static void spi_dma_setup_rx(uint32_t spi, uint32_t dma, u8 stream, u8 channel)
@@ -246,23 +331,47 @@ void spi1_dma_setup(void)
   spi_dma_setup_rx(SPI1, DMA2, 0, 3);
   spi_dma_setup_tx(SPI1, DMA2, 3, 3);
   chBSemInit(&spi_dma_sem, TRUE);
+
+  chPoolInit(&spi_dma_buff_pool, SPI_DMA_BUFF_LEN, NULL);
+  chPoolLoadArray(&spi_dma_buff_pool, spi_dma_buff, SPI_DMA_N_BUFF);
 }
 
-void spi1_xfer_dma(u16 n_bytes, u8 data_in[], const u8 data_out[])
+/** Get a DMA reachable SPI transfer buffer from the pool.
+ * Buffers are SPI_DMA_BUFF_LEN bytes long and can be passed straight to
+ * spi1_xfer_dma_inplace(), avoiding the copies made by spi1_xfer_dma().
+ *
+ * \return Pointer to the buffer or NULL if the pool is exhausted.
+ */
+u8 *spi_dma_buff_alloc(void)
 {
-  /* We use a static buffer here for DMA transfers as data_in/data_out
-   * often are on the stack in CCM which is not accessible by DMA.
-   */
-  static volatile u8 spi_dma_buf[128];
+  return chPoolAlloc(&spi_dma_buff_pool);
+}
 
-  memcpy((u8*)spi_dma_buf, data_out, n_bytes);
+/** Return a buffer obtained from spi_dma_buff_alloc() to the pool.
+ * \param buff Buffer to free.
+ */
+void spi_dma_buff_free(u8 *buff)
+{
+  chPoolFree(&spi_dma_buff_pool, buff);
+}
 
+/** Start a DMA transfer on SPI1 without waiting for it to complete.
+ * The contents of buff are replaced with the data read back. The caller can
+ * get on with other work while the transfer is in flight but must call
+ * spi1_xfer_dma_wait() before touching buff or starting another transfer.
+ *
+ * \param n_bytes Number of bytes to transfer.
+ * \param buff    Buffer of data to send and to receive into. Must be
+ *                reachable by DMA, i.e. not in CCM.
+ */
+void spi1_xfer_dma_start(u16 n_bytes, u8 buff[])
+{
   /* Setup transmit stream */
-  DMA_SM0AR(DMA2, 3) = spi_dma_buf;
+  DMA_SM0AR(DMA2, 3) = buff;
   DMA_SNDTR(DMA2, 3) = n_bytes;
 
   /* Setup receive stream */
-  DMA_SM0AR(DMA2, 0) = spi_dma_buf;
+  DMA_SM0AR(DMA2, 0) = buff;
   DMA_SNDTR(DMA2, 0) = n_bytes;
 
   /* We need a memory buffer here to avoid a transfer error */
@@ -272,12 +381,86 @@ void spi1_xfer_dma(u16 n_bytes, u8 data_in[], const u8 data_out[])
   DMA_SCR(DMA2, 0) |= DMA_SxCR_EN;
   /* Enable the transmit channel to begin the transaction */
   DMA_SCR(DMA2, 3) |= DMA_SxCR_EN;
+}
 
+/** Wait for a transfer started with spi1_xfer_dma_start() to complete.
+ * Returns straight away if the transfer has already finished.
+ */
+void spi1_xfer_dma_wait(void)
+{
   /* Yeild the CPU while we wait for the transaction to complete */
   chBSemWait(&spi_dma_sem);
+}
+
+/** Do a DMA transfer on SPI1, replacing the contents of buff with the data
+ * read back.
+ *
+ * \param n_bytes Number of bytes to transfer.
+ * \param buff    Buffer of data to send and to receive into. Must be
+ *                reachable by DMA, i.e. not in CCM.
+ */
+void spi1_xfer_dma_inplace(u16 n_bytes, u8 buff[])
+{
+  spi1_xfer_dma_start(n_bytes, buff);
+  spi1_xfer_dma_wait();
+}
+
+void spi1_xfer_dma(u16 n_bytes, u8 data_in[], const u8 data_out[])
+{
+  /* We use a static buffer here for DMA transfers as data_in/data_out
+   * often are on the stack in CCM which is not accessible by DMA.
+   */
+  static u8 spi_dma_buf[128] _DMA;
+
+  memcpy(spi_dma_buf, data_out, n_bytes);
+
+  spi1_xfer_dma_inplace(n_bytes, spi_dma_buf);
 
   if (data_in != NULL)
-    memcpy(data_in, (u8*)spi_dma_buf, n_bytes);
+    memcpy(data_in, spi_dma_buf, n_bytes);
+}
+
+/** Set up transmit DMA for SPI2.
+ * Only the transmit direction is used, the one stream SPI2_RX can be mapped
+ * to (DMA1 stream 3) is taken by the UARTB transmit DMA.
+ */
+void spi2_dma_setup(void)
+{
+  RCC_AHB1ENR |= RCC_AHB1ENR_DMA1EN;
+  spi_dma_setup_tx(SPI2, DMA1, 4, 0);
+  /* With no receive stream completion is signalled by the transmit stream. */
+  DMA_SCR(DMA1, 4) |= DMA_SxCR_TCIE;
+  chBSemInit(&spi2_dma_sem, TRUE);
+}
+
+/** Write a buffer out on SPI2 using DMA, discarding the data read back.
+ * The calling thread sleeps while the transfer is in progress. The slave
+ * must already be selected with spi_slave_select().
+ *
+ * \param n_bytes Number of bytes to write.
+ * \param buff    Data to write. Must be reachable by DMA, i.e. not in CCM.
+ */
+void spi2_tx_dma(u16 n_bytes, const u8 buff[])
+{
+  if (n_bytes == 0)
+    return;
+
+  DMA_SM0AR(DMA1, 4) = (void *)buff;
+  DMA_SNDTR(DMA1, 4) = n_bytes;
+
+  asm volatile ("dmb");
+
+  DMA_SCR(DMA1, 4) |= DMA_SxCR_EN;
+  chBSemWait(&spi2_dma_sem);
+
+  /* Transfer complete fires once the last byte has been loaded into the
+   * data register, wait for it to be shifted out. */
+  while (!(SPI2_SR & SPI_SR_TXE)) ;
+  while (SPI2_SR & SPI_SR_BSY) ;
+
+  /* Clear the overrun left by not reading back. */
+  (void)SPI2_DR;
+  (void)SPI2_SR;
 }
 
 /** DMA 2 Stream 0 Interrupt Service Routine. (SPI1_RX) */
@@ -313,7 +496,23 @@ void dma2_stream3_isr(void)
   CH_IRQ_EPILOGUE();
 }
 
-/** \} */
+/** DMA 1 Stream 4 Interrupt Service Routine. (SPI2_TX) */
+void dma1_stream4_isr(void)
+{
+  CH_IRQ_PROLOGUE();
+  chSysLockFromIsr();
+
+  if (dma_get_interrupt_flag(DMA1, 4, DMA_TEIF | DMA_DMEIF))
+    screaming_death("DMA SPI2_TX error interrupt");
+
+  dma_clear_interrupt_flags(DMA1, 4, DMA_TCIF | DMA_HTIF);
+
+  chBSemSignalI(&spi2_dma_sem);
+
+  chSysUnlockFromIsr();
+  CH_IRQ_EPILOGUE();
+}
 
 /** \} */
 
+/** \} */
@@ -18,6 +18,7 @@
 
 #define dma2_stream0_isr Vector120
 #define dma2_stream3_isr Vector12C
+#define dma1_stream4_isr Vector7C
 
 /** \addtogroup spi
  * \{ */
@@ -30,14 +31,30 @@
 #define SPI_BUS_FPGA     SPI1 /**< SPI bus that the FPGA is on. */
 #define SPI_BUS_FRONTEND SPI2 /**< SPI bus that the MAX2769 is on. */
 
+/** Length of each of the DMA reachable SPI transfer buffers. Big enough for
+ * a batched read of every tracking channel's CORR register. */
+#define SPI_DMA_BUFF_LEN 320
+/** Number of DMA reachable SPI transfer buffers in the pool. */
+#define SPI_DMA_N_BUFF   4
+
 /** \} */
 
 void spi_setup(void);
 void spi_deactivate(void);
 void spi_slave_select(u8 slave);
-void spi_slave_deselect(void);
+void spi_slave_deselect(u8 slave);
+void spi_slave_reselect(u8 slave);
+bool spi_slave_try_select_i(u8 slave);
+void spi_slave_deselect_i(void);
 void spi1_dma_setup(void);
 void spi1_xfer_dma(u16 n_bytes, u8 data_in[], const u8 data_out[]);
+void spi1_xfer_dma_start(u16 n_bytes, u8 buff[]);
+void spi1_xfer_dma_wait(void);
+void spi1_xfer_dma_inplace(u16 n_bytes, u8 buff[]);
+u8 *spi_dma_buff_alloc(void);
+void spi_dma_buff_free(u8 *buff);
+void spi2_dma_setup(void);
+void spi2_tx_dma(u16 n_bytes, const u8 buff[]);
 
 #endif
 
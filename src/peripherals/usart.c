@@ -41,6 +41,10 @@ usart_settings_t uarta_usart = {
   .baud_rate          = USART_DEFAULT_BAUD_TTL,
   .sbp_message_mask   = 0x40,
   .configure_telemetry_radio_on_boot = 1,
+  .burst              = 0,
+  .burst_packet_size  = RADIO_PACKET_LEN,
+  .burst_packets      = RADIO_BURST_PACKETS,
+  .burst_phase        = RADIO_BURST_PHASE,
 };
 
 usart_settings_t uartb_usart = {
@@ -48,6 +52,10 @@ usart_settings_t uartb_usart = {
   .baud_rate        = USART_DEFAULT_BAUD_TTL,
   .sbp_message_mask = 0xFF00,
   .configure_telemetry_radio_on_boot = 1,
+  .burst             = 0,
+  .burst_packet_size = RADIO_PACKET_LEN,
+  .burst_packets     = RADIO_BURST_PACKETS,
+  .burst_phase       = RADIO_BURST_PHASE,
 };
 
 bool all_uarts_enabled = false;
@@ -68,6 +76,19 @@ usart_tx_dma_state uarta_tx_state;
 usart_rx_dma_state uartb_rx_state;
 usart_tx_dma_state uartb_tx_state;
 
+/* Ring buffers, sized per port in usart.h. */
+static u8 ftdi_rx_buff[USART_FTDI_RX_BUFFER_LEN] _DMA;
+static u8 ftdi_tx_buff[USART_FTDI_TX_BUFFER_LEN] _DMA;
+static u8 uarta_rx_buff[USART_UARTA_RX_BUFFER_LEN] _DMA;
+static u8 uarta_tx_buff[USART_UARTA_TX_BUFFER_LEN] _DMA;
+static u8 uartb_rx_buff[USART_UARTB_RX_BUFFER_LEN] _DMA;
+static u8 uartb_tx_buff[USART_UARTB_TX_BUFFER_LEN] _DMA;
+
+/* Ports being configured by radio_configure_start(), their DMA is left off
+ * until configuration is done. Indexed 0 for UARTA, 1 for UARTB. */
+static bool radio_pending[RADIO_N_PORTS];
+static MUTEX_DECL(usarts_mutex);
+
 /** Set up USART parameters for particular USART.
  * \param usart USART to set up parameters for.
  * \param baud  Baud rate to set.
@@ -94,7 +115,9 @@ void usart_set_parameters(u32 usart, u32 baud)
 void usarts_setup()
 {
 
+#if BUILD_RADIO
   radio_setup();
+#endif
 
   int TYPE_PORTMODE = settings_type_register_enum(portmode_enum, &portmode);
 
@@ -105,15 +128,29 @@ void usarts_setup()
 
   SETTING("uart_uarta", "mode", uarta_usart.mode, TYPE_PORTMODE);
   SETTING("uart_uarta", "sbp_message_mask", uarta_usart.sbp_message_mask, TYPE_INT);
+#if BUILD_RADIO
   SETTING("uart_uarta", "configure_telemetry_radio_on_boot",
           uarta_usart.configure_telemetry_radio_on_boot, TYPE_BOOL);
+  SETTING("uart_uarta", "burst", uarta_usart.burst, TYPE_BOOL);
+  SETTING("uart_uarta", "burst_packet_size", uarta_usart.burst_packet_size,
+          TYPE_INT);
+  SETTING("uart_uarta", "burst_packets", uarta_usart.burst_packets, TYPE_INT);
+  SETTING("uart_uarta", "burst_phase", uarta_usart.burst_phase, TYPE_INT);
+#endif
   SETTING_NOTIFY("uart_uarta", "baudrate", uarta_usart.baud_rate, TYPE_INT,
           baudrate_change_notify);
 
   SETTING("uart_uartb", "mode", uartb_usart.mode, TYPE_PORTMODE);
   SETTING("uart_uartb", "sbp_message_mask", uartb_usart.sbp_message_mask, TYPE_INT);
+#if BUILD_RADIO
   SETTING("uart_uartb", "configure_telemetry_radio_on_boot",
           uartb_usart.configure_telemetry_radio_on_boot, TYPE_BOOL);
+  SETTING("uart_uartb", "burst", uartb_usart.burst, TYPE_BOOL);
+  SETTING("uart_uartb", "burst_packet_size", uartb_usart.burst_packet_size,
+          TYPE_INT);
+  SETTING("uart_uartb", "burst_packets", uartb_usart.burst_packets, TYPE_INT);
+  SETTING("uart_uartb", "burst_phase", uartb_usart.burst_phase, TYPE_INT);
+#endif
   SETTING_NOTIFY("uart_uartb", "baudrate", uartb_usart.baud_rate, TYPE_INT,
           baudrate_change_notify);
 
@@ -127,13 +164,52 @@ void usarts_setup()
 bool baudrate_change_notify(struct setting *s, const char *val)
 {
   if (s->type->from_string(s->type->priv, s->addr, s->len, val)) {
+    chMtxLock(&usarts_mutex);
     usarts_disable();
     usarts_enable(ftdi_usart.baud_rate, uarta_usart.baud_rate, uartb_usart.baud_rate, false);
+    chMtxUnlock();
     return true;
   }
   return false;
 }
 
+static void uarta_enable(u32 baud)
+{
+  usart_set_parameters(USART1, baud);
+  /* UARTA (USART1) TX - DMA2, stream 7, channel 4. */
+  usart_tx_dma_setup(&uarta_tx_state, uarta_tx_buff, sizeof(uarta_tx_buff),
+                     USART1, DMA2, 7, 4);
+  /* UARTA (USART1) RX - DMA2, stream 2, channel 4. */
+  usart_rx_dma_setup(&uarta_rx_state, uarta_rx_buff, sizeof(uarta_rx_buff),
+                     USART1, DMA2, 2, 4);
+}
+
+static void uartb_enable(u32 baud)
+{
+  usart_set_parameters(USART3, baud);
+  /* UARTB (USART3) TX - DMA1, stream 3, channel 4. */
+  usart_tx_dma_setup(&uartb_tx_state, uartb_tx_buff, sizeof(uartb_tx_buff),
+                     USART3, DMA1, 3, 4);
+  /* UARTB (USART3) RX - DMA1, stream 1, channel 4. */
+  usart_rx_dma_setup(&uartb_rx_state, uartb_rx_buff, sizeof(uartb_rx_buff),
+                     USART3, DMA1, 1, 4);
+}
+
+#if BUILD_RADIO
+/** Called from the radio configuration thread once a port is done with.
+ * Puts the port back to its configured baud rate and starts its DMA. */
+static void radio_done(u8 port)
+{
+  chMtxLock(&usarts_mutex);
+  radio_pending[port] = false;
+  if (port == 0)
+    uarta_enable(uarta_usart.baud_rate);
+  else
+    uartb_enable(uartb_usart.baud_rate);
+  chMtxUnlock();
+}
+#endif
+
 
 /** Enable the USART peripherals.
  * USART 6, 1 and 3 peripherals are configured
@@ -174,13 +250,13 @@ void usarts_enable(u32 ftdi_baud, u32 uarta_baud, u32 uartb_baud, bool do_precon
   gpio_set_af(GPIOC, GPIO_AF7, GPIO10 | GPIO11);
 
   usart_set_parameters(USART6, ftdi_baud);
-  usart_set_parameters(USART1, uarta_baud);
-  usart_set_parameters(USART3, uartb_baud);
 
   /* FTDI (USART6) TX - DMA2, stream 6, channel 5. */
-  usart_tx_dma_setup(&ftdi_tx_state, USART6, DMA2, 6, 5);
+  usart_tx_dma_setup(&ftdi_tx_state, ftdi_tx_buff, sizeof(ftdi_tx_buff),
+                     USART6, DMA2, 6, 5);
   /* FTDI (USART6) RX - DMA2, stream 1, channel 5. */
-  usart_rx_dma_setup(&ftdi_rx_state, USART6, DMA2, 1, 5);
+  usart_rx_dma_setup(&ftdi_rx_state, ftdi_rx_buff, sizeof(ftdi_rx_buff),
+                     USART6, DMA2, 1, 5);
 
   if (do_preconfigure_hooks) {
 
@@ -188,23 +264,24 @@ void usarts_enable(u32 ftdi_baud, u32 uarta_baud, u32 uartb_baud, bool do_precon
        "Firmware Version: " GIT_VERSION "\n" \
        "Built: " __DATE__ " " __TIME__ "\n");
 
+#if BUILD_RADIO
+    /* Look for radios in the background so that boot isn't held up when
+     * there aren't any attached. */
     if (uarta_usart.configure_telemetry_radio_on_boot) {
-      radio_preconfigure_hook(USART1, uarta_baud, "UARTA");
+      radio_pending[0] = true;
+      radio_configure_start(0, USART1, "UARTA", radio_done);
     }
     if (uartb_usart.configure_telemetry_radio_on_boot) {
-      radio_preconfigure_hook(USART3, uartb_baud, "UARTB");
+      radio_pending[1] = true;
+      radio_configure_start(1, USART3, "UARTB", radio_done);
     }
+#endif
   }
 
-  /* UARTA (USART1) TX - DMA2, stream 7, channel 4. */
-  usart_tx_dma_setup(&uarta_tx_state, USART1, DMA2, 7, 4);
-  /* UARTA (USART1) RX - DMA2, stream 2, channel 4. */
-  usart_rx_dma_setup(&uarta_rx_state, USART1, DMA2, 2, 4);
-
-  /* UARTB (USART3) TX - DMA1, stream 3, channel 4. */
-  usart_tx_dma_setup(&uartb_tx_state, USART3, DMA1, 3, 4);
-  /* UARTB (USART3) RX - DMA1, stream 1, channel 4. */
-  usart_rx_dma_setup(&uartb_rx_state, USART3, DMA1, 1, 4);
+  if (!radio_pending[0])
+    uarta_enable(uarta_baud);
+  if (!radio_pending[1])
+    uartb_enable(uartb_baud);
 
   all_uarts_enabled = true;
 
@@ -223,13 +300,17 @@ void usarts_disable()
   usart_rx_dma_disable(&ftdi_rx_state);
   usart_disable(USART6);
 
-  usart_tx_dma_disable(&uarta_tx_state);
-  usart_rx_dma_disable(&uarta_rx_state);
-  usart_disable(USART1);
+  if (!radio_pending[0]) {
+    usart_tx_dma_disable(&uarta_tx_state);
+    usart_rx_dma_disable(&uarta_rx_state);
+    usart_disable(USART1);
+  }
 
-  usart_tx_dma_disable(&uartb_tx_state);
-  usart_rx_dma_disable(&uartb_rx_state);
-  usart_disable(USART3);
+  if (!radio_pending[1]) {
+    usart_tx_dma_disable(&uartb_tx_state);
+    usart_rx_dma_disable(&uartb_rx_state);
+    usart_disable(USART3);
+  }
 }
 
 /** DMA 2 Stream 6 Interrupt Service Routine. */
@@ -286,6 +367,33 @@ void dma1_stream1_isr(void)
   chSysUnlockFromIsr();
   CH_IRQ_EPILOGUE();
 }
+/** USART6 Interrupt Service Routine. */
+void usart6_isr(void)
+{
+  CH_IRQ_PROLOGUE();
+  chSysLockFromIsr();
+  usart_rx_idle_isr(&ftdi_rx_state);
+  chSysUnlockFromIsr();
+  CH_IRQ_EPILOGUE();
+}
+/** USART1 Interrupt Service Routine. */
+void usart1_isr(void)
+{
+  CH_IRQ_PROLOGUE();
+  chSysLockFromIsr();
+  usart_rx_idle_isr(&uarta_rx_state);
+  chSysUnlockFromIsr();
+  CH_IRQ_EPILOGUE();
+}
+/** USART3 Interrupt Service Routine. */
+void usart3_isr(void)
+{
+  CH_IRQ_PROLOGUE();
+  chSysLockFromIsr();
+  usart_rx_idle_isr(&uartb_rx_state);
+  chSysUnlockFromIsr();
+  CH_IRQ_EPILOGUE();
+}
 
 /** \} */
 
@@ -14,6 +14,7 @@
 #define SWIFTNAV_USART_H
 
 #include <libswiftnav/common.h>
+#include <ch.h>
 #include "settings.h"
 
 #define dma2_stream6_isr Vector154
@@ -22,6 +23,9 @@
 #define dma2_stream2_isr Vector128
 #define dma1_stream3_isr Vector78
 #define dma1_stream1_isr Vector70
+#define usart6_isr Vector15C
+#define usart1_isr VectorD4
+#define usart3_isr VectorDC
 
 /** \addtogroup io
  * \{ */
@@ -36,6 +40,11 @@ typedef struct {
   u32 baud_rate;
   u32 sbp_message_mask;
   u8  configure_telemetry_radio_on_boot;
+  /* SBP burst mode for telemetry radios, see sbp_tx_burst_epoch(). */
+  u8  burst;             /**< Send SBP in one burst per solution epoch. */
+  u16 burst_packet_size; /**< Radio packet payload length. (bytes) */
+  u8  burst_packets;     /**< Radio packets in each burst. */
+  u16 burst_phase;       /**< Time from the solution epoch to the burst. (ms) */
 } usart_settings_t;
 
 /** Message and baud rate settings for all USARTs. */
@@ -53,8 +62,40 @@ extern usart_settings_t uartb_usart;
 
 #define USART_DMA_ISR_PRIORITY 7
 
-#define USART_TX_BUFFER_LEN 2048
-#define USART_RX_BUFFER_LEN 2048
+/* Ring buffer sizes of each port, can be overridden at build time to put
+ * the capacity where the traffic is. The FTDI port carries most of it. */
+#ifndef USART_FTDI_TX_BUFFER_LEN
+#define USART_FTDI_TX_BUFFER_LEN  4096
+#endif
+#ifndef USART_FTDI_RX_BUFFER_LEN
+#define USART_FTDI_RX_BUFFER_LEN  2048
+#endif
+#ifndef USART_UARTA_TX_BUFFER_LEN
+#define USART_UARTA_TX_BUFFER_LEN 2048
+#endif
+#ifndef USART_UARTA_RX_BUFFER_LEN
+#define USART_UARTA_RX_BUFFER_LEN 2048
+#endif
+#ifndef USART_UARTB_TX_BUFFER_LEN
+#define USART_UARTB_TX_BUFFER_LEN 512
+#endif
+#ifndef USART_UARTB_RX_BUFFER_LEN
+#define USART_UARTB_RX_BUFFER_LEN 512
+#endif
+
+/* Buffer lengths must be powers of two so that the ring index arithmetic
+ * reduces to masks, and a TX buffer must hold at least one whole SBP frame
+ * (263 bytes) with its one spare byte. */
+#define USART_BUFFER_LEN_VALID(len) \
+  ((len) >= 512 && ((len) & ((len) - 1)) == 0)
+#if !USART_BUFFER_LEN_VALID(USART_FTDI_TX_BUFFER_LEN) || \
+    !USART_BUFFER_LEN_VALID(USART_FTDI_RX_BUFFER_LEN) || \
+    !USART_BUFFER_LEN_VALID(USART_UARTA_TX_BUFFER_LEN) || \
+    !USART_BUFFER_LEN_VALID(USART_UARTA_RX_BUFFER_LEN) || \
+    !USART_BUFFER_LEN_VALID(USART_UARTB_TX_BUFFER_LEN) || \
+    !USART_BUFFER_LEN_VALID(USART_UARTB_RX_BUFFER_LEN)
+#error "USART buffer lengths must be powers of two, at least 512 bytes"
+#endif
 
 #define USART_DEFAULT_BAUD_FTDI 1000000
 #define USART_DEFAULT_BAUD_TTL  115200
@@ -63,7 +104,8 @@ extern usart_settings_t uartb_usart;
 typedef struct {
   /** USART RX DMA buffer. DMA xfers from USART to buffer, message processing
    * routine reads out of buffer. */
-  u8 buff[USART_RX_BUFFER_LEN];
+  u8 *buff;
+  u32 len;      /**< Length of buff, a power of two. */
   u32 rd;       /**< Address of next byte to read out of buffer.  */
   /* TODO : is u32 big enough for rd_wraps and wr_wraps? */
   u32 rd_wraps; /**< Number of times rd has wrapped around the buffer. */
@@ -73,12 +115,17 @@ typedef struct {
   u32 usart;    /**< USART peripheral this state serves. */
   u8 stream;    /**< DMA stream for this USART. */
   u8 channel;   /**< DMA channel for this USART. */
+  bool enabled; /**< DMA has been set up, nothing is read until it is. */
+
+  Thread *notify_thread;     /**< Thread to signal when data arrives. */
+  eventmask_t notify_events; /**< Events to signal notify_thread with. */
 } usart_rx_dma_state;
 
 /** USART TX DMA state structure. */
 typedef struct {
   /** USART TX DMA buffer. DMA xfers from buffer to USART_DR. */
-  u8 buff[USART_TX_BUFFER_LEN];
+  u8 *buff;
+  u32 len;      /**< Length of buff, a power of two. */
   u32 rd;       /**< Address of next byte to read out of buffer. */
   u32 wr;       /**< Next buffer address to write to. */
   u32 xfer_len; /**< Number of bytes to DMA from buffer to USART_DR. */
@@ -87,6 +134,18 @@ typedef struct {
   u32 usart;    /**< USART peripheral this state serves. */
   u8 stream;    /**< DMA stream for this USART. */
   u8 channel;   /**< DMA channel for this USART. */
+  bool enabled; /**< DMA has been set up, writes are dropped until it is. */
+  bool batch;   /**< Between usart_tx_batch_begin() and _end(). */
+  u32 batch_len; /**< Bytes committed in the batch, not yet sent. */
+
+  /* Transmit statistics, for throughput testing. Written with interrupts
+   * disabled, may be reset by the reader at any time. */
+  u32 n_short_writes; /**< Writes refused for lack of buffer space. */
+  u32 n_idle_gaps;    /**< Times the buffer ran dry before the next write. */
+  u32 idle_gap_max;   /**< Longest time spent dry. (cycles) */
+  u64 idle_gap_sum;   /**< Total time spent dry. (cycles) */
+  u32 idle_start;     /**< Cycle count when the buffer last ran dry. */
+  bool idle;          /**< Buffer has run dry since the last write. */
 } usart_tx_dma_state;
 
 /** \} */
@@ -110,18 +169,27 @@ void usarts_disable(void);
 
 void usart_set_parameters(u32 usart, u32 baud);
 
-void usart_tx_dma_setup(usart_tx_dma_state* s, u32 usart,
+void usart_tx_dma_setup(usart_tx_dma_state* s, u8 buff[], u32 len, u32 usart,
                         u32 dma, u8 stream, u8 channel);
 void usart_tx_dma_disable(usart_tx_dma_state* s);
 u32 usart_tx_n_free(usart_tx_dma_state* s);
 void usart_tx_dma_isr(usart_tx_dma_state* s);
+u32 usart_tx_span(usart_tx_dma_state* s, u8 **data);
+void usart_tx_commit(usart_tx_dma_state* s, u32 len);
 u32 usart_write_dma(usart_tx_dma_state* s, u8 data[], u32 len);
+void usart_tx_batch_begin(usart_tx_dma_state* s);
+void usart_tx_batch_end(usart_tx_dma_state* s);
+void usart_tx_stats_reset(usart_tx_dma_state* s);
 
-void usart_rx_dma_setup(usart_rx_dma_state* s, u32 usart,
+void usart_rx_dma_setup(usart_rx_dma_state* s, u8 buff[], u32 len, u32 usart,
                         u32 dma, u8 stream, u8 channel);
 void usart_rx_dma_disable(usart_rx_dma_state* s);
 void usart_rx_dma_isr(usart_rx_dma_state* s);
+void usart_rx_idle_isr(usart_rx_dma_state* s);
+void usart_rx_dma_notify(usart_rx_dma_state* s, Thread *tp, eventmask_t events);
 u32 usart_n_read_dma(usart_rx_dma_state* s);
+u32 usart_rx_span(usart_rx_dma_state* s, u8 **data);
+void usart_rx_consume(usart_rx_dma_state* s, u32 len);
 u32 usart_read_dma(usart_rx_dma_state* s, u8 data[], u32 len);
 
 #endif  /* SWIFTNAV_USART_H */
@@ -33,20 +33,45 @@ const u8 dma_irq_lookup[2][8] = {
   { 56, 57, 58, 59, 60, 68, 69, 70 }, /* DMA2 Stream 0..7. */
 };
 
+/** Lookup the NVIC IRQ number of a USART, used for the idle line interrupt.
+ * \return IRQ number or -1 if the USART isn't one we use.
+ */
+static s8 usart_irq_lookup(u32 usart)
+{
+  switch (usart) {
+  case USART1: return 37;
+  case USART3: return 39;
+  case USART6: return 71;
+  default: return -1;
+  }
+}
+
+/** Signal the thread registered with usart_rx_dma_notify(), if any.
+ * Must be called from an ISR with the kernel locked. */
+static void usart_rx_notify_i(usart_rx_dma_state* s)
+{
+  if (s->notify_thread)
+    chEvtSignalI(s->notify_thread, s->notify_events);
+}
+
 /** Setup the USART for receive with DMA.
  * This function sets up the DMA controller and additional USART parameters for
  * DMA receive. The USART must already be configured for normal operation.
  *
  * \param s The USART DMA state structure.
+ * \param buff Ring buffer for the port, must be reachable by DMA.
+ * \param len Length of buff, a power of two.
  * \oaram usart The USART base address.
  * \param dma The DMA controller base address.
  * \param stream The DMA stream number to use.
  * \param channel The DMA channel to use. The stream and channel must
  *                correspond to a USART RX channel.
  */
-void usart_rx_dma_setup(usart_rx_dma_state* s, u32 usart,
+void usart_rx_dma_setup(usart_rx_dma_state* s, u8 buff[], u32 len, u32 usart,
                         u32 dma, u8 stream, u8 channel)
 {
+  s->buff = buff;
+  s->len = len;
   s->dma = dma;
   s->usart = usart;
   s->stream = stream;
@@ -77,8 +102,8 @@ void usart_rx_dma_setup(usart_rx_dma_state* s, u32 usart,
   DMA_SCR(dma, stream) =
     /* Error interrupts. */
     DMA_SxCR_DMEIE | DMA_SxCR_TEIE |
-    /* Transfer complete interrupt. */
-    DMA_SxCR_TCIE |
+    /* Transfer complete and half transfer interrupts. */
+    DMA_SxCR_TCIE | DMA_SxCR_HTIE |
     /* Enable circular buffer mode. */
     DMA_SxCR_CIRC |
     DMA_SxCR_DIR_PERIPHERAL_TO_MEM |
@@ -95,7 +120,7 @@ void usart_rx_dma_setup(usart_rx_dma_state* s, u32 usart,
     DMA_SxCR_CHSEL(channel);
 
   /* Transfer up to the length of the buffer. */
-  DMA_SNDTR(dma, stream) = USART_RX_BUFFER_LEN;
+  DMA_SNDTR(dma, stream) = s->len;
 
   /* DMA from the USART data register... */
   DMA_SPAR(dma, stream) = &USART_DR(usart);
@@ -116,6 +141,15 @@ void usart_rx_dma_setup(usart_rx_dma_state* s, u32 usart,
 
   /* Enable the DMA channel. */
   DMA_SCR(dma, stream) |= DMA_SxCR_EN;
+  s->enabled = true;
+
+  /* Enable the USART idle line interrupt so that the end of a burst of data
+   * is picked up straight away. */
+  s8 irq = usart_irq_lookup(usart);
+  if (irq >= 0) {
+    USART_CR1(usart) |= USART_CR1_IDLEIE;
+    nvicEnableVector(irq, CORTEX_PRIORITY_MASK(USART_DMA_ISR_PRIORITY));
+  }
 }
 
 /** Disable USART RX DMA.
@@ -123,6 +157,15 @@ void usart_rx_dma_setup(usart_rx_dma_state* s, u32 usart,
  */
 void usart_rx_dma_disable(usart_rx_dma_state* s)
 {
+  s->enabled = false;
+
+  /* Disable the idle line interrupt. */
+  s8 irq = usart_irq_lookup(s->usart);
+  if (irq >= 0) {
+    nvicDisableVector(irq);
+    USART_CR1(s->usart) &= ~USART_CR1_IDLEIE;
+  }
+
   /* Disable DMA stream interrupts with the NVIC. */
   if (s->dma == DMA1)
     nvicDisableVector(dma_irq_lookup[0][s->stream]);
@@ -151,7 +194,7 @@ void usart_rx_dma_isr(usart_rx_dma_state* s)
     /* TODO: Handle error interrupts! */
     screaming_death("USART RX DMA error interrupt");
 
-  if (dma_get_interrupt_flag(s->dma, s->stream, DMA_HTIF | DMA_TCIF)) {
+  if (dma_get_interrupt_flag(s->dma, s->stream, DMA_TCIF)) {
     /* Interrupt is Transmit Complete. We are in circular buffer mode so this
      * probably means we just wrapped the buffer. */
 
@@ -160,20 +203,63 @@ void usart_rx_dma_isr(usart_rx_dma_state* s)
 
     /* Increment our write wrap counter. */
     s->wr_wraps++;
+
+    usart_rx_notify_i(s);
+  } else if (dma_get_interrupt_flag(s->dma, s->stream, DMA_HTIF)) {
+    /* Half the buffer has filled up, wake the reader before it overflows. */
+    dma_clear_interrupt_flags(s->dma, s->stream, DMA_HTIF);
+
+    usart_rx_notify_i(s);
   }
 
   /* Note: When DMA is re-enabled after bootloader it appears ISR can get
    * called without any of the bits of DMA_LISR being high */
 }
 
+/** USART interrupt service routine for the RX idle line interrupt.
+ * Should be called from the relevant USART ISR with the kernel locked.
+ * Signals the thread
+ * registered with usart_rx_dma_notify() when the line goes idle after
+ * receiving data, i.e. at the end of a message or burst of messages.
+ * \param s The USART DMA state structure.
+ */
+void usart_rx_idle_isr(usart_rx_dma_state* s)
+{
+  if (USART_SR(s->usart) & USART_SR_IDLE) {
+    /* Clear the idle flag by reading SR followed by DR. The DMA has already
+     * taken the last byte so there isn't any data in DR to lose. */
+    (void)USART_DR(s->usart);
+
+    usart_rx_notify_i(s);
+  }
+}
+
+/** Register a thread to be signalled when data has been received.
+ * The thread is signalled from the USART idle line interrupt and the DMA
+ * half and full transfer interrupts.
+ * \param s      The USART DMA state structure.
+ * \param tp     Thread to signal, or NULL to stop signalling.
+ * \param events Events to signal the thread with.
+ */
+void usart_rx_dma_notify(usart_rx_dma_state* s, Thread *tp, eventmask_t events)
+{
+  chSysLock();
+  s->notify_thread = tp;
+  s->notify_events = events;
+  chSysUnlock();
+}
+
 /** Returns a lower bound on the number of bytes in the DMA receive buffer.
  * Also checks for buffer overrun conditions.
  * \param s The USART DMA state structure.
  */
 u32 usart_n_read_dma(usart_rx_dma_state* s)
 {
-  s32 n_read = s->rd_wraps * USART_RX_BUFFER_LEN + s->rd;
-  s32 n_written = (s->wr_wraps + 1) * USART_RX_BUFFER_LEN - \
+  if (!s->enabled)
+    return 0;
+
+  s32 n_read = s->rd_wraps * s->len + s->rd;
+  s32 n_written = (s->wr_wraps + 1) * s->len - \
                   DMA_SNDTR(s->dma, s->stream);
   s32 n_available = n_written - n_read;
 
@@ -184,13 +270,44 @@ u32 usart_n_read_dma(usart_rx_dma_state* s)
      * (or at some point) the interrupt will have been triggered and the number
      * of bytes available in the buffer will be a sane amount. */
     n_available = 0;
-  else if (n_available > USART_RX_BUFFER_LEN)
+  else if (n_available > (s32)s->len)
     /* If greater than a whole buffer then we have had an overflow. */
     screaming_death("DMA RX buffer overrun");
 
   return n_available;
 }
 
+/** Get the contiguous readable region at the read index of the RX buffer.
+ * Data can be parsed directly out of the region and then released with
+ * usart_rx_consume(). The region ends at the end of the buffer, a second
+ * call after consuming returns any data wrapped around to the start.
+ *
+ * \param s The USART DMA state structure.
+ * \param data Set to point to the start of the readable region.
+ * \return The length of the readable region in bytes.
+ */
+u32 usart_rx_span(usart_rx_dma_state* s, u8 **data)
+{
+  u32 n_available = usart_n_read_dma(s);
+  u32 n_to_end = s->len - s->rd;
+
+  *data = &(s->buff[s->rd]);
+  return (n_available < n_to_end) ? n_available : n_to_end;
+}
+
+/** Release data that has been read from the RX buffer.
+ * \param s The USART DMA state structure.
+ * \param len The number of bytes to release, at most usart_n_read_dma().
+ */
+void usart_rx_consume(usart_rx_dma_state* s, u32 len)
+{
+  s->rd += len;
+  if (s->rd >= s->len) {
+    s->rd &= (s->len - 1);
+    s->rd_wraps++;
+  }
+}
+
 /** Read bytes from the USART RX DMA buffer.
  *
  * \param s The USART DMA state structure.
@@ -200,21 +317,23 @@ u32 usart_n_read_dma(usart_rx_dma_state* s)
  */
 u32 usart_read_dma(usart_rx_dma_state* s, u8 data[], u32 len)
 {
-  u32 n_available = usart_n_read_dma(s);
-  u16 n = (len > n_available) ? n_available : len;
-
-  if (s->rd + n < USART_RX_BUFFER_LEN) {
-    memcpy(data, &(s->buff[s->rd]), n);
-    s->rd += n;
-  } else {
-    s->rd_wraps++;
-    memcpy(&data[0], &(s->buff[s->rd]), USART_RX_BUFFER_LEN - s->rd);
-    memcpy(&data[USART_RX_BUFFER_LEN - s->rd],
-           &(s->buff[0]), n - USART_RX_BUFFER_LEN + s->rd);
-    s->rd = n - USART_RX_BUFFER_LEN + s->rd;
+  u32 n_read = 0;
+
+  /* At most two spans, up to the end of the buffer and then from the
+   * start. */
+  for (u8 i = 0; i < 2 && n_read < len; i++) {
+    u8 *span;
+    u32 n = usart_rx_span(s, &span);
+    if (n == 0)
+      break;
+    if (n > len - n_read)
+      n = len - n_read;
+    memcpy(&data[n_read], span, n);
+    usart_rx_consume(s, n);
+    n_read += n;
   }
 
-  return n;
+  return n_read;
 }
 
 /** \} */
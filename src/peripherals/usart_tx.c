@@ -20,6 +20,7 @@
 #include <libopencm3/stm32/f4/usart.h>
 
 #include "../error.h"
+#include "../probe.h"
 #include "usart.h"
 
 /** \addtogroup peripherals
@@ -33,15 +34,19 @@
  * DMA transmit. The USART must already be configured for normal operation.
  *
  * \param s The USART DMA state structure.
+ * \param buff Ring buffer for the port, must be reachable by DMA.
+ * \param len Length of buff, a power of two.
  * \oaram usart The USART base address.
  * \param dma The DMA controller base address.
  * \param stream The DMA stream number to use.
  * \param channel The DMA channel to use. The stream and channel must
  *                correspond to a USART RX channel.
  */
-void usart_tx_dma_setup(usart_tx_dma_state* s, u32 usart,
+void usart_tx_dma_setup(usart_tx_dma_state* s, u8 buff[], u32 len, u32 usart,
                         u32 dma, u8 stream, u8 channel)
 {
+  s->buff = buff;
+  s->len = len;
   s->dma = dma;
   s->usart = usart;
   s->stream = stream;
@@ -98,6 +103,11 @@ void usart_tx_dma_setup(usart_tx_dma_state* s, u32 usart,
     DMA_SxFCR_FEIE;           /* Enable FIFO error interrupt. */
 
   s->wr = s->rd = 0;  /* Buffer is empty to begin with. */
+  s->batch = false;
+  s->batch_len = 0;
+  s->idle = false;    /* Not idling whilst nothing has been written. */
+  usart_tx_stats_reset(s);
+  s->enabled = true;
 
   /* Enable DMA interrupts for this stream with the NVIC. */
   if (dma == DMA1)
@@ -113,6 +123,8 @@ void usart_tx_dma_setup(usart_tx_dma_state* s, u32 usart,
  */
 void usart_tx_dma_disable(usart_tx_dma_state* s)
 {
+  s->enabled = false;
+
   /* Disable DMA stream interrupts with the NVIC. */
   if (s->dma == DMA1)
     nvicDisableVector(dma_irq_lookup[0][s->stream]);
@@ -129,16 +141,13 @@ void usart_tx_dma_disable(usart_tx_dma_state* s)
 
 /** Calculate the space left in the USART DMA TX buffer.
  * \param s The USART DMA state structure.
- * \return The number of bytes that may be safely written to the buffer.
+ * \return The number of bytes that may be safely written to the buffer,
+ *         after anything already committed in a batch.
  */
 u32 usart_tx_n_free(usart_tx_dma_state* s)
 {
-  /* The calculation for the number of bytes in the buffer depends on whether
-   * or not the write pointer has wrapped around the end of the buffer. */
-  if (s->wr >= s->rd)
-    return USART_TX_BUFFER_LEN - 1 - (s->wr - s->rd);
-  else
-    return (s->rd - s->wr) - 1;
+  /* One byte is always left free to tell a full buffer from an empty one. */
+  return ((s->rd - s->wr - 1) & (s->len - 1)) - s->batch_len;
 }
 
 /** Helper function that schedules a new transfer with the DMA controller if
@@ -161,13 +170,15 @@ static void dma_schedule(usart_tx_dma_state* s)
     s->xfer_len = s->wr - s->rd;
   else
     /* DMA up until the end of the buffer. */
-    s->xfer_len = USART_TX_BUFFER_LEN - s->rd;
+    s->xfer_len = s->len - s->rd;
 
   /* Set the number of datas in the DMA controller. */
   DMA_SNDTR(s->dma, s->stream) = s->xfer_len;
 
-  /* Clear USART_TC flag */
-  USART_SR(s->usart) &= ~USART_SR_TC;
+  /* Clear USART_TC flag. Write rather than read-modify-write, the other
+   * rc_w0 flags are unaffected by writing 1 whereas a read-modify-write can
+   * clear an RXNE that sets in between and lose a byte from the RX DMA. */
+  USART_SR(s->usart) = ~USART_SR_TC;
 
   /* Enable DMA stream to start transfer. */
   DMA_SCR(s->dma, s->stream) |= DMA_SxCR_EN;
@@ -191,11 +202,20 @@ void usart_tx_dma_isr(usart_tx_dma_state* s)
     dma_clear_interrupt_flags(s->dma, s->stream, DMA_HTIF | DMA_TCIF);
 
     /* Now that the transfer has finished we can increment the read index. */
-    s->rd = (s->rd + s->xfer_len) % USART_TX_BUFFER_LEN;
+    s->rd = (s->rd + s->xfer_len) & (s->len - 1);
 
-    if (s->wr != s->rd)
+    /* Chain straight on to whatever was appended during the transfer, or the
+     * rest of a write that wrapped the buffer. The USART data and shift
+     * registers give us about a character time to get the next transfer
+     * going before the line goes idle. */
+    if (s->wr != s->rd) {
       /* Buffer not empty. */
       dma_schedule(s);
+    } else {
+      /* Line goes idle until the next write. */
+      s->idle_start = probe_now();
+      s->idle = true;
+    }
   }
 
   if (dma_get_interrupt_flag(s->dma, s->stream, DMA_FEIF))
@@ -203,39 +223,57 @@ void usart_tx_dma_isr(usart_tx_dma_state* s)
     dma_clear_interrupt_flags(s->dma, s->stream, DMA_HTIF | DMA_FEIF);
 }
 
-/** Write out data over the USART using DMA.
- * Note that this function is not reentrant and does not guard against DMA IRQs
- * running at the same time which will also cause spurious behaviours. Ensure
- * that the calling function prevents this from happening.
+/** Get the contiguous free region at the write index of the TX buffer, or
+ * after the data already committed if a batch is open.
+ * Data can be written directly into the region and then sent with
+ * usart_tx_commit(). The region ends at the end of the buffer or the read
+ * index, a second call after committing returns any space wrapped around
+ * to the start of the buffer.
+ *
+ * There must only be one writer per USART, in the firmware this is the SBP
+ * TX thread. The DMA ISR only ever reads from behind the write index so the
+ * region can be filled with interrupts enabled.
  *
  * \param s The USART DMA state structure.
- * \param data A pointer to the data to write out.
- * \param len  The number of bytes to write.
- * \return The number of bytes that will be written, may be less than len.
+ * \param data Set to point to the start of the free region.
+ * \return The length of the free region in bytes.
  */
-u32 usart_write_dma(usart_tx_dma_state* s, u8 data[], u32 len)
+u32 usart_tx_span(usart_tx_dma_state* s, u8 **data)
 {
-  /* If there is no data to write, just return. */
-  if (len == 0) return 0;
+  if (!s->enabled)
+    return 0;
 
-  /* Check if the write would cause a buffer overflow, if so only write up to
-   * the end of the buffer. */
+  u32 wr = (s->wr + s->batch_len) & (s->len - 1);
   u32 n_free = usart_tx_n_free(s);
-  if (len > n_free)
-    return 0;
+  u32 n_to_end = s->len - wr;
+
+  *data = &(s->buff[wr]);
+  return (n_free < n_to_end) ? n_free : n_to_end;
+}
+
+/** Send data written into the TX buffer.
+ * Inside a batch the data is only added to the batch, it is sent by
+ * usart_tx_batch_end().
+ * \param s The USART DMA state structure.
+ * \param len The number of bytes written at the write index, may run on
+ *            past the end of the buffer into its start as long as it's no
+ *            more than usart_tx_n_free().
+ */
+void usart_tx_commit(usart_tx_dma_state* s, u32 len)
+{
+  static PROBE_DECL(probe_masked_commit, "usart_tx_commit irq");
 
-  u32 old_wr = s->wr;
-  s->wr = (s->wr + len) % USART_TX_BUFFER_LEN;
+  if (len == 0 || !s->enabled) return;
 
-  if (old_wr + len <= USART_TX_BUFFER_LEN)
-    memcpy(&(s->buff[old_wr]), data, len);
-  else {
-    /* Deal with case where write wraps the buffer. */
-    memcpy(&(s->buff[old_wr]), &data[0], USART_TX_BUFFER_LEN - old_wr);
-    memcpy(&(s->buff[0]), &data[USART_TX_BUFFER_LEN - old_wr],
-           len - (USART_TX_BUFFER_LEN - old_wr));
+  if (s->batch) {
+    s->batch_len += len;
+    return;
   }
 
+  u32 t_mask = probe_irq_mask();
+
+  s->wr = (s->wr + len) & (s->len - 1);
+
   /* Check if there is a DMA transfer either in progress or waiting for its
    * interrupt to be serviced. Its very important to also check the interrupt
    * flag as EN will be cleared when the transfer finishes but we really need
@@ -243,12 +281,99 @@ u32 usart_write_dma(usart_tx_dma_state* s, u8 data[], u32 len)
    * transfer. Also, make sure that this is done atomically without a DMA
    * interrupt squeezing in there. */
   if (!((DMA_SCR(s->dma, s->stream) & DMA_SxCR_EN) ||
-        dma_get_interrupt_flag(s->dma, s->stream, DMA_TCIF)))
+        dma_get_interrupt_flag(s->dma, s->stream, DMA_TCIF))) {
+    if (s->idle) {
+      u32 gap = probe_now() - s->idle_start;
+      s->n_idle_gaps++;
+      s->idle_gap_sum += gap;
+      if (gap > s->idle_gap_max)
+        s->idle_gap_max = gap;
+      s->idle = false;
+    }
     dma_schedule(s);
+  }
+
+  probe_irq_unmask(&probe_masked_commit, t_mask);
+}
+
+/** Write out data over the USART using DMA.
+ * Copies the data into the TX buffer and commits it, see usart_tx_span()
+ * for the restrictions on writers.
+ *
+ * \param s The USART DMA state structure.
+ * \param data A pointer to the data to write out.
+ * \param len  The number of bytes to write.
+ * \return The number of bytes that will be written, either len or 0 if
+ *         there isn't enough space in the buffer.
+ */
+u32 usart_write_dma(usart_tx_dma_state* s, u8 data[], u32 len)
+{
+  /* If there is no data to write, or the USART isn't set up yet, just
+   * return. */
+  if (len == 0 || !s->enabled) return 0;
+
+  /* Check if the write would cause a buffer overflow, if so don't write
+   * anything. The ISR can only free up space in the meantime. */
+  if (len > usart_tx_n_free(s)) {
+    s->n_short_writes++;
+    return 0;
+  }
+
+  u8 *span;
+  u32 n = usart_tx_span(s, &span);
+  if (n > len)
+    n = len;
+  memcpy(span, data, n);
+  /* Deal with case where write wraps the buffer. */
+  if (n < len)
+    memcpy(&(s->buff[0]), &data[n], len - n);
+
+  usart_tx_commit(s, len);
 
   return len;
 }
 
+/** Start a batch of writes to go out together.
+ * Writes and commits until usart_tx_batch_end() fill the buffer without
+ * starting any DMA, so that a burst of frames goes out as one transfer
+ * rather than a short transfer for the first frame with the rest chained
+ * on from its transfer complete interrupt. Only the single writer may open
+ * a batch, see usart_tx_span().
+ * \param s The USART DMA state structure.
+ */
+void usart_tx_batch_begin(usart_tx_dma_state* s)
+{
+  s->batch = true;
+}
+
+/** Send everything written since usart_tx_batch_begin().
+ * \param s The USART DMA state structure.
+ */
+void usart_tx_batch_end(usart_tx_dma_state* s)
+{
+  u32 len = s->batch_len;
+  s->batch = false;
+  s->batch_len = 0;
+  usart_tx_commit(s, len);
+}
+
+/** Reset the transmit statistics of a USART.
+ * A gap already in progress is counted from now.
+ * \param s The USART DMA state structure.
+ */
+void usart_tx_stats_reset(usart_tx_dma_state* s)
+{
+  static PROBE_DECL(probe_masked_reset, "usart_tx_stats irq");
+
+  u32 t_mask = probe_irq_mask();
+  s->n_short_writes = 0;
+  s->n_idle_gaps = 0;
+  s->idle_gap_max = 0;
+  s->idle_gap_sum = 0;
+  s->idle_start = probe_now();
+  probe_irq_unmask(&probe_masked_reset, t_mask);
+}
+
 /** \} */
 
 /** \} */
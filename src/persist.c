@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <ch.h>
+
+#include "main.h"
+#include "persist.h"
+
+#include "cfs/cfs.h"
+#include "cfs/cfs-coffee.h"
+
+/** \defgroup persist Persist
+ * Asynchronous writes to the Coffee filesystem.
+ * Producers queue a snapshot of the data with persist_write() and return
+ * straight away, a low priority thread then does the actual file writes so
+ * that a flash sector erase never stalls a time critical thread. Writes to
+ * the same file and offset that are still queued are coalesced and all
+ * queued writes to a file are flushed with a single open.
+ *
+ * Writes larger than PERSIST_RECORD_MAX, e.g. a whole file at once, can be
+ * queued with persist_write_buffer() which writes straight from the
+ * caller's buffer instead of taking a copy.
+ *
+ * After PERSIST_IDLE_MS without any writes the thread also erases a sector
+ * of obsolete pages, if free space is running low (see
+ * cfs_coffee_maintain()), so that the next writes don't have to erase one
+ * first. The erase still stalls the CPU, the flash is a single bank, but
+ * it happens while nothing is waiting on the file system and one sector at
+ * a time.
+ * \{ */
+
+/** A queued write. */
+typedef struct {
+  const char *name;             /**< File name, NULL if the slot is free. */
+  u32 offset;                   /**< Offset in the file to write at. */
+  u16 len;                      /**< Number of bytes to write. */
+  const u8 *buf;                /**< Caller's buffer to write from, NULL to
+                                     write from data. */
+  volatile bool *busy;          /**< Cleared once a buffer write is done. */
+  u8 data[PERSIST_RECORD_MAX];  /**< Snapshot of the data to write. */
+} persist_req_t;
+
+static persist_req_t persist_queue[PERSIST_QUEUE_LEN] _COLD;
+static MUTEX_DECL(persist_mutex);
+static BSEMAPHORE_DECL(persist_sem, TRUE);
+
+/** Queue a write to a file.
+ * The data is copied so the caller may reuse its buffer immediately. A
+ * queued write to the same file and offset is replaced rather than written
+ * twice.
+ *
+ * \param name   Name of the file, must remain valid until the write is done,
+ *               e.g. a string literal.
+ * \param offset Offset in the file to write at.
+ * \param data   Data to write.
+ * \param len    Length of data, at most PERSIST_RECORD_MAX.
+ * \return true if the write was queued, false if the queue is full.
+ */
+bool persist_write(const char *name, u32 offset, const void *data, u16 len)
+{
+  if (len > PERSIST_RECORD_MAX) {
+    printf("persist: %u byte write to %s too large\n", len, name);
+    return false;
+  }
+
+  persist_req_t *req = NULL;
+
+  chMtxLock(&persist_mutex);
+  for (u8 i=0; i<PERSIST_QUEUE_LEN; i++) {
+    persist_req_t *r = &persist_queue[i];
+    if (r->name && !r->buf && r->offset == offset &&
+        strcmp(r->name, name) == 0) {
+      req = r;
+      break;
+    }
+    if (!r->name && !req)
+      req = r;
+  }
+  if (req) {
+    req->name = name;
+    req->offset = offset;
+    req->len = len;
+    req->buf = NULL;
+    req->busy = NULL;
+    memcpy(req->data, data, len);
+  }
+  chMtxUnlock();
+
+  if (!req) {
+    printf("persist: queue full, dropped write to %s\n", name);
+    return false;
+  }
+
+  chBSemSignal(&persist_sem);
+  return true;
+}
+
+/** Queue a write to a file straight from the caller's buffer.
+ * Not coalesced with other writes. The buffer must not be changed while
+ * `*busy` is set, it is set here and cleared once the write is done or
+ * dropped.
+ *
+ * \param name   Name of the file, must remain valid until the write is done.
+ * \param offset Offset in the file to write at.
+ * \param data   Data to write.
+ * \param len    Length of data.
+ * \param busy   Flag to clear once the write is done.
+ * \return true if the write was queued, false if the queue is full.
+ */
+bool persist_write_buffer(const char *name, u32 offset, const void *data,
+                          u16 len, volatile bool *busy)
+{
+  persist_req_t *req = NULL;
+
+  chMtxLock(&persist_mutex);
+  for (u8 i=0; i<PERSIST_QUEUE_LEN; i++) {
+    if (!persist_queue[i].name) {
+      req = &persist_queue[i];
+      req->name = name;
+      req->offset = offset;
+      req->len = len;
+      req->buf = data;
+      req->busy = busy;
+      *busy = true;
+      break;
+    }
+  }
+  chMtxUnlock();
+
+  if (!req) {
+    printf("persist: queue full, dropped write to %s\n", name);
+    return false;
+  }
+
+  chBSemSignal(&persist_sem);
+  return true;
+}
+
+/** Take the next queued write to a file out of the queue.
+ *
+ * \param name File name to look for, or NULL for any file.
+ * \param out  Copy of the queued write.
+ * \return true if a write was found.
+ */
+static bool persist_take(const char *name, persist_req_t *out)
+{
+  bool found = false;
+
+  chMtxLock(&persist_mutex);
+  for (u8 i=0; i<PERSIST_QUEUE_LEN; i++) {
+    persist_req_t *r = &persist_queue[i];
+    if (r->name && (!name || strcmp(r->name, name) == 0)) {
+      out->name = r->name;
+      out->offset = r->offset;
+      out->len = r->len;
+      out->buf = r->buf;
+      out->busy = r->busy;
+      if (!r->buf)
+        memcpy(out->data, r->data, r->len);
+      r->name = NULL;
+      found = true;
+      break;
+    }
+  }
+  chMtxUnlock();
+
+  return found;
+}
+
+static WORKING_AREA_CCM(wa_persist_thread, PERSIST_THREAD_STACK);
+static msg_t persist_thread(void *arg)
+{
+  (void)arg;
+  chRegSetThreadName("persist");
+
+  static persist_req_t req;
+
+  while (TRUE) {
+    if (chBSemWaitTimeout(&persist_sem, MS2ST(PERSIST_IDLE_MS)) ==
+        RDY_TIMEOUT) {
+      if (cfs_coffee_maintain())
+        printf("Erased a flash sector of obsolete files\n");
+      continue;
+    }
+    /* Give bursts (e.g. a full almanac) a chance to arrive so they are
+     * flushed together. */
+    chThdSleepMilliseconds(PERSIST_COALESCE_MS);
+
+    while (persist_take(NULL, &req)) {
+      const char *name = req.name;
+      int fd = cfs_open(name, CFS_WRITE);
+      if (fd == -1) {
+        printf("Error opening %s file\n", name);
+        /* Drop the rest of this file's writes. */
+        do {
+          if (req.busy)
+            *req.busy = false;
+        } while (persist_take(name, &req));
+        continue;
+      }
+      u8 n = 0;
+      do {
+        cfs_seek(fd, req.offset, CFS_SEEK_SET);
+        const u8 *src = req.buf ? req.buf : req.data;
+        if (cfs_write(fd, src, req.len) != req.len)
+          printf("Error writing to %s file\n", name);
+        else
+          n++;
+        if (req.busy)
+          *req.busy = false;
+      } while (persist_take(name, &req));
+      cfs_close(fd);
+      printf("Saved %d record%s to %s\n", n, n == 1 ? "" : "s", name);
+    }
+  }
+
+  return 0;
+}
+
+/** Start the persistence thread. Must be called before any calls to
+ * persist_write(). */
+void persist_setup(void)
+{
+  chThdCreateStatic(
+      wa_persist_thread,
+      sizeof(wa_persist_thread),
+      PERSIST_THREAD_PRIORITY,
+      persist_thread, NULL
+  );
+}
+
+/** \} */
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef SWIFTNAV_PERSIST_H
+#define SWIFTNAV_PERSIST_H
+
+#include <ch.h>
+
+#include <libswiftnav/common.h>
+
+/** \addtogroup persist
+ * \{ */
+
+/** Maximum number of writes waiting to be flushed. */
+#define PERSIST_QUEUE_LEN    40
+/** Maximum size of a single queued write, (bytes). */
+#define PERSIST_RECORD_MAX   256
+/** Time to wait after the first write of a burst before flushing, (ms). */
+#define PERSIST_COALESCE_MS  100
+/** Time without writes after which the file system is tidied up, (ms). */
+#define PERSIST_IDLE_MS      10000
+
+#define PERSIST_THREAD_PRIORITY LOWPRIO
+#define PERSIST_THREAD_STACK    2000
+
+/** \} */
+
+void persist_setup(void);
+bool persist_write(const char *name, u32 offset, const void *data, u16 len);
+bool persist_write_buffer(const char *name, u32 offset, const void *data,
+                          u16 len, volatile bool *busy);
+
+#endif  /* SWIFTNAV_PERSIST_H */
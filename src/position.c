@@ -15,7 +15,11 @@
 #include <string.h>
 
 #include <libswiftnav/linear_algebra.h>
+#include <libswiftnav/coord_system.h>
 
+#include <ch.h>
+
+#include "persist.h"
 #include "position.h"
 #include "timing.h"
 
@@ -28,6 +32,9 @@ gnss_solution position_solution;
 gps_time_t last_time;
 double last_ecef[3];
 
+/** Frame at position_solution, updated once per epoch. */
+static position_frame_t position_frame;
+
 /** \defgroup position Position
  * Maintains the position state of the receiver. Includes functions for saving
  * and loading a position estimate from filesystem.
@@ -62,9 +69,133 @@ void position_setup(void)
   }
 }
 
-/** Save position to file. */
+static void position_frame_build(position_frame_t *f, const double ecef[3],
+                                 const double llh[3])
+{
+  memcpy(f->ecef, ecef, sizeof(f->ecef));
+  memcpy(f->llh, llh, sizeof(f->llh));
+  ecef2ned_matrix(f->llh, f->M);
+}
+
+/** Set up a frame at a position other than the current solution.
+ *
+ * \param f Frame to set up.
+ * \param ecef Origin of the frame in ECEF (m).
+ */
+void position_frame_init(position_frame_t *f, const double ecef[3])
+{
+  double llh[3];
+  wgsecef2llh(ecef, llh);
+  position_frame_build(f, ecef, llh);
+}
+
+/** Take a copy of the frame at the latest position solution.
+ * The copy is consistent even when taken from outside the solution thread.
+ */
+void position_frame_get(position_frame_t *f)
+{
+  chSysLock();
+  memcpy(f, &position_frame, sizeof(*f));
+  chSysUnlock();
+}
+
+/** Rotate a vector from ECEF into the NED axes of a frame.
+ *
+ * \param f Frame.
+ * \param v_ecef Vector in ECEF, e.g. a baseline or velocity.
+ * \param ned Set to the vector in NED.
+ */
+void position_frame_ned(const position_frame_t *f, const double v_ecef[3],
+                        double ned[3])
+{
+  matrix_multiply(3, 3, 1, (const double *)f->M, v_ecef, ned);
+}
+
+/** Azimuth and elevation of a point as seen from the origin of a frame.
+ *
+ * \param f Frame.
+ * \param p_ecef Point in ECEF (m), e.g. a satellite position.
+ * \param az Set to the azimuth, [0, 2pi) from north (rad).
+ * \param el Set to the elevation (rad).
+ */
+void position_frame_azel(const position_frame_t *f, const double p_ecef[3],
+                         double *az, double *el)
+{
+  double d[3], ned[3];
+  vector_subtract(3, p_ecef, f->ecef, d);
+  position_frame_ned(f, d, ned);
+
+  *az = atan2(ned[1], ned[0]);
+  if (*az < 0)
+    *az += 2 * M_PI;
+  *el = asin(-ned[2] / vector_norm(3, ned));
+}
+
+/** Take an approximate position from outside the receiver, e.g. an aiding
+ * bundle. Ignored once there is a position fix, and not saved.
+ *
+ * \param ecef Position in ECEF (m).
+ * \param t    Time the position was valid.
+ */
+void position_set_guess(const double ecef[3], gps_time_t t)
+{
+  if (position_quality >= POSITION_STATIC)
+    return;
+
+  memcpy(position_solution.pos_ecef, ecef, sizeof(position_solution.pos_ecef));
+  wgsecef2llh(position_solution.pos_ecef, position_solution.pos_llh);
+  memset(position_solution.vel_ecef, 0, sizeof(position_solution.vel_ecef));
+  memset(position_solution.vel_ned, 0, sizeof(position_solution.vel_ned));
+  position_solution.time = t;
+  /* As for a position loaded from file, valid but only a guess. */
+  position_solution.valid = 1;
+
+  position_frame_t f;
+  position_frame_build(&f, position_solution.pos_ecef,
+                       position_solution.pos_llh);
+  chSysLock();
+  memcpy(&position_frame, &f, sizeof(f));
+  chSysUnlock();
+
+  position_quality = POSITION_GUESS;
+}
+
+/** Fix the position at a surveyed location, for a base station that
+ * doesn't solve for its position. The solution time is left to the
+ * solution thread.
+ *
+ * \param ecef Position in ECEF (m).
+ */
+void position_set_known(const double ecef[3])
+{
+  memcpy(position_solution.pos_ecef, ecef, sizeof(position_solution.pos_ecef));
+  wgsecef2llh(position_solution.pos_ecef, position_solution.pos_llh);
+  memset(position_solution.vel_ecef, 0, sizeof(position_solution.vel_ecef));
+  memset(position_solution.vel_ned, 0, sizeof(position_solution.vel_ned));
+  position_solution.valid = 1;
+
+  position_frame_t f;
+  position_frame_build(&f, position_solution.pos_ecef,
+                       position_solution.pos_llh);
+  chSysLock();
+  memcpy(&position_frame, &f, sizeof(f));
+  chSysUnlock();
+
+  position_quality = POSITION_STATIC;
+}
+
+/** Save position to file and refresh the frame at the new position. */
 void position_updated(void)
 {
+  /* The solution already has the LLH position, only the rotation needs
+   * building. */
+  position_frame_t f;
+  position_frame_build(&f, position_solution.pos_ecef,
+                       position_solution.pos_llh);
+  chSysLock();
+  memcpy(&position_frame, &f, sizeof(f));
+  chSysUnlock();
+
   double temp[3];
 
   vector_subtract(3, position_solution.pos_ecef, last_ecef, temp);
@@ -73,16 +204,8 @@ void position_updated(void)
   double dt = gpsdifftime(position_solution.time, last_time);
 
   if (dt > 30 * 60 || dx > 10e3) {
-    int fd = cfs_open("posn", CFS_WRITE);
-    if (fd != -1) {
-      if (cfs_write(fd, (void *)&position_solution,
-                    sizeof(position_solution)) != sizeof(position_solution))
-        printf("Error writing to position file\n");
-      else
-        printf("Saved position to flash\n");
-      cfs_close(fd);
-    } else
-      printf("Error opening position file\n");
+    /* Queued so the solution thread doesn't stall on a flash erase. */
+    persist_write("posn", 0, &position_solution, sizeof(position_solution));
     last_time = position_solution.time;
     memcpy(last_ecef, position_solution.pos_ecef, sizeof(last_ecef));
   }
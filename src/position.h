@@ -14,6 +14,7 @@
 #define SWIFTNAV_POSITION_H
 
 #include <libswiftnav/common.h>
+#include <libswiftnav/gpstime.h>
 #include <libswiftnav/pvt.h>
 
 /** \addtogroup position
@@ -26,6 +27,15 @@ typedef enum {
   POSITION_FIX,
 } position_quality_t;
 
+/** Local level frame at a position. Holds what the output formats need to
+ * express quantities relative to the position so that each of them doesn't
+ * rebuild it. */
+typedef struct {
+  double ecef[3];  /**< Origin in ECEF (m). */
+  double llh[3];   /**< Origin in geodetic coordinates (rad, rad, m). */
+  double M[3][3];  /**< Rotation from ECEF to NED. */
+} position_frame_t;
+
 /** \} */
 
 extern position_quality_t position_quality;
@@ -33,6 +43,14 @@ extern gnss_solution position_solution;
 
 void position_setup(void);
 void position_updated(void);
+void position_set_guess(const double ecef[3], gps_time_t t);
+void position_set_known(const double ecef[3]);
+void position_frame_get(position_frame_t *f);
+void position_frame_init(position_frame_t *f, const double ecef[3]);
+void position_frame_ned(const position_frame_t *f, const double v_ecef[3],
+                        double ned[3]);
+void position_frame_azel(const position_frame_t *f, const double p_ecef[3],
+                         double *az, double *el);
 
 #endif  /* SWIFTNAV_POSITION_H */
 
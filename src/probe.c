@@ -0,0 +1,228 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <string.h>
+
+#include "probe.h"
+#include "sbp.h"
+#include "sbp_piksi.h"
+
+/** \defgroup probe Probes
+ * Low overhead cycle count instrumentation of hot paths.
+ * Probes record the duration of a section of code in cycles, keeping the
+ * min, max, mean and a log2 histogram. They can be used from threads and
+ * ISRs alike. All probes that have recorded something are reported
+ * periodically in MSG_PROBE_STATE and then reset.
+ *
+ * Wakeup probes measure the latency from an interrupt to the thread it
+ * wakes running. The worst latency of each period is reported in
+ * MSG_PROBE_WAKEUP with the thread the ISR interrupted and the longest
+ * section with interrupts masked by probe_irq_mask() that overlapped it.
+ * Sections under chSysLock() aren't tracked individually, they show up as
+ * the interrupted thread. Other deadline misses can be blamed the same way
+ * with probe_masked_longest().
+ * \{ */
+
+static probe_t *probe_list = NULL;
+static probe_wakeup_t *probe_wakeup_list = NULL;
+
+/** Recent interrupt masked sections, oldest overwritten first. */
+static struct {
+  const probe_t *p;
+  u32 start;
+  u32 cycles;
+} masked[PROBE_N_MASKED];
+static u8 masked_idx = 0;
+
+/* Save PRIMASK and disable interrupts, works whether or not the caller is
+ * already in a critical section or an ISR. */
+static inline u32 probe_lock(void)
+{
+  u32 primask;
+  __asm__ __volatile__("MRS %0, PRIMASK; CPSID i;"
+                       : "=r" (primask) :: "memory");
+  return primask;
+}
+
+static inline void probe_unlock(u32 primask)
+{
+  __asm__ __volatile__("MSR PRIMASK, %0;" :: "r" (primask) : "memory");
+}
+
+/** Longest remembered masked section overlapping an interval, call with
+ * interrupts masked.
+ * \param from   Start of the interval (cycles).
+ * \param to     End of the interval (cycles).
+ * \param cycles Set to the length of the section (cycles), 0 if none.
+ * \return Probe of the section, NULL if none.
+ */
+static const probe_t *masked_longest(u32 from, u32 to, u32 *cycles)
+{
+  const probe_t *p = NULL;
+  *cycles = 0;
+  for (u8 i = 0; i < PROBE_N_MASKED; i++) {
+    /* Overlaps if it ended after the start and started before the end. */
+    u32 end = masked[i].start + masked[i].cycles;
+    if (masked[i].p &&
+        (s32)(end - from) > 0 && (s32)(to - masked[i].start) > 0 &&
+        masked[i].cycles > *cycles) {
+      p = masked[i].p;
+      *cycles = masked[i].cycles;
+    }
+  }
+  return p;
+}
+
+/** Record a duration.
+ * \param p Probe to record into.
+ * \param cycles Duration in cycles.
+ */
+void probe_record(probe_t *p, u32 cycles)
+{
+  u8 bin = cycles ? 31 - __builtin_clz(cycles) : 0;
+
+  u32 primask = probe_lock();
+
+  if (!p->registered) {
+    p->registered = true;
+    p->next = probe_list;
+    probe_list = p;
+  }
+
+  p->count++;
+  p->sum += cycles;
+  if (cycles < p->min)
+    p->min = cycles;
+  if (cycles > p->max)
+    p->max = cycles;
+  if (p->hist[bin] != 0xFFFF)
+    p->hist[bin]++;
+
+  probe_unlock(primask);
+}
+
+/** Record the end of a section run with interrupts masked.
+ * Called by probe_irq_unmask() before interrupts are unmasked.
+ * \param p  Probe for the section.
+ * \param t0 Cycle count interrupts were masked at.
+ */
+void probe_masked(probe_t *p, u32 t0)
+{
+  u32 cycles = probe_now() - t0;
+  probe_record(p, cycles);
+  masked[masked_idx].p = p;
+  masked[masked_idx].start = t0;
+  masked[masked_idx].cycles = cycles;
+  masked_idx = (masked_idx + 1) % PROBE_N_MASKED;
+}
+
+/** Note an event for a wakeup probe, call from the ISR that wakes the
+ * thread.
+ * \param w       Wakeup probe.
+ * \param t_event Cycle count the event happened at, probe_now() on ISR
+ *                entry or earlier if the hardware says when it fired.
+ */
+void probe_wakeup_isr(probe_wakeup_t *w, u32 t_event)
+{
+  w->t_event = t_event;
+  /* Still the interrupted thread, the ISR hasn't rescheduled yet. */
+  w->isr_thread = chThdSelf()->p_name;
+  w->pending = true;
+}
+
+/** Record the latency to a wakeup probe's pending event, call as soon as
+ * the woken thread resumes. Does nothing if there is no event pending. */
+void probe_wakeup_resume(probe_wakeup_t *w)
+{
+  if (!w->pending)
+    return;
+
+  u32 now = probe_now();
+  u32 latency = now - w->t_event;
+  w->pending = false;
+  probe_record(&w->probe, latency);
+
+  if (latency <= w->worst)
+    return;
+
+  u32 primask = probe_lock();
+  if (!w->registered) {
+    w->registered = true;
+    w->next = probe_wakeup_list;
+    probe_wakeup_list = w;
+  }
+  w->worst = latency;
+  w->worst_thread = w->isr_thread;
+  w->worst_masked = masked_longest(w->t_event, now, &w->worst_masked_cycles);
+  probe_unlock(primask);
+}
+
+/** Longest of the recent interrupt masked sections that ended after a time.
+ * \param since  Cycle count, a value previously returned by probe_now().
+ * \param cycles Set to the length of the section (cycles), 0 if none.
+ * \return Probe of the section, NULL if none.
+ */
+const probe_t *probe_masked_longest(u32 since, u32 *cycles)
+{
+  u32 primask = probe_lock();
+  const probe_t *p = masked_longest(since, probe_now(), cycles);
+  probe_unlock(primask);
+  return p;
+}
+
+/** Send MSG_PROBE_STATE for every probe and MSG_PROBE_WAKEUP for every
+ * wakeup probe, and reset their statistics. */
+void probe_send_all(void)
+{
+  for (probe_wakeup_t *w = probe_wakeup_list; w; w = w->next) {
+    msg_probe_wakeup_t msg;
+    memset(&msg, 0, sizeof(msg));
+
+    u32 primask = probe_lock();
+    msg.worst = w->worst;
+    msg.masked_cycles = w->worst_masked_cycles;
+    const char *thread = w->worst_thread;
+    const probe_t *section = w->worst_masked;
+    w->worst = 0;
+    probe_unlock(primask);
+
+    strncpy(msg.name, w->probe.name, sizeof(msg.name));
+    if (thread)
+      strncpy(msg.thread, thread, sizeof(msg.thread));
+    if (section)
+      strncpy(msg.masked, section->name, sizeof(msg.masked));
+    sbp_send_msg(MSG_PROBE_WAKEUP, sizeof(msg), (u8 *)&msg);
+  }
+
+  for (probe_t *p = probe_list; p; p = p->next) {
+    msg_probe_state_t msg;
+
+    u32 primask = probe_lock();
+    msg.count = p->count;
+    msg.min = p->count ? p->min : 0;
+    msg.max = p->max;
+    msg.mean = p->count ? p->sum / p->count : 0;
+    memcpy(msg.hist, p->hist, sizeof(msg.hist));
+    p->count = 0;
+    p->sum = 0;
+    p->min = 0xFFFFFFFF;
+    p->max = 0;
+    memset(p->hist, 0, sizeof(p->hist));
+    probe_unlock(primask);
+
+    strncpy(msg.name, p->name, sizeof(msg.name));
+    sbp_send_msg(MSG_PROBE_STATE, sizeof(msg), (u8 *)&msg);
+  }
+}
+
+/** \} */
+
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef SWIFTNAV_PROBE_H
+#define SWIFTNAV_PROBE_H
+
+#include <ch.h>
+
+#include <libswiftnav/common.h>
+
+/** \addtogroup probe
+ * \{ */
+
+/** Number of log2 histogram bins, bin n counts durations of
+ * [2^n, 2^(n+1)) cycles. */
+#define PROBE_N_BINS 32
+
+/** Number of recent interrupt masked sections remembered for attributing
+ * wakeup latency, see probe_irq_unmask(). */
+#define PROBE_N_MASKED 8
+
+/** Cycle count statistics for a named section of code. */
+typedef struct probe_s {
+  const char *name;   /**< Name reported in MSG_PROBE_STATE. */
+  u32 count;          /**< Number of durations recorded. */
+  u32 min;            /**< Shortest duration (cycles). */
+  u32 max;            /**< Longest duration (cycles). */
+  u64 sum;            /**< Sum of durations (cycles). */
+  u16 hist[PROBE_N_BINS]; /**< log2 histogram of durations, saturating. */
+  bool registered;    /**< Set once the probe is on the reporting list. */
+  struct probe_s *next;
+} probe_t;
+
+/** Latency from an interrupt to the thread it wakes resuming.
+ * The latencies go into `probe` like any other probe, the worst of each
+ * reporting period is sent in MSG_PROBE_WAKEUP with what it was held up by. */
+typedef struct probe_wakeup_s {
+  probe_t probe;            /**< Event to thread resume latency (cycles). */
+  u32 t_event;              /**< Cycle count of the pending event. */
+  const char *isr_thread;   /**< Thread the pending event's ISR interrupted. */
+  volatile bool pending;    /**< An event is waiting for the thread. */
+  u32 worst;                /**< Worst latency this period (cycles). */
+  const char *worst_thread; /**< Thread interrupted by the worst. */
+  const probe_t *worst_masked; /**< Longest masked section overlapping the
+                                    worst, NULL if none. */
+  u32 worst_masked_cycles;  /**< Length of worst_masked (cycles). */
+  bool registered;          /**< Set once on the reporting list. */
+  struct probe_wakeup_s *next;
+} probe_wakeup_t;
+
+/** Define a probe. */
+#define PROBE_DECL(var, probe_name) \
+  probe_t var = { .name = (probe_name), .min = 0xFFFFFFFF }
+
+/** Define a wakeup latency probe. */
+#define PROBE_WAKEUP_DECL(var, probe_name) \
+  probe_wakeup_t var = { .probe = { .name = (probe_name), .min = 0xFFFFFFFF } }
+
+/** Current cycle count, the DWT cycle counter is enabled by
+ * system_monitor_setup(). */
+static inline u32 probe_now(void)
+{
+  return DWT_CYCCNT;
+}
+
+void probe_record(probe_t *p, u32 cycles);
+void probe_masked(probe_t *p, u32 t0);
+void probe_wakeup_isr(probe_wakeup_t *w, u32 t_event);
+void probe_wakeup_resume(probe_wakeup_t *w);
+const probe_t *probe_masked_longest(u32 since, u32 *cycles);
+
+/** Record the time since `t0`, a value previously returned by probe_now(). */
+static inline void probe_end(probe_t *p, u32 t0)
+{
+  probe_record(p, probe_now() - t0);
+}
+
+/** Mask interrupts, timing how long for.
+ * Use in place of a bare `CPSID i` so the section shows up in its own probe
+ * and can be blamed for wakeup latency, see probe_wakeup_resume().
+ * \return Cycle count to pass to probe_irq_unmask().
+ */
+static inline u32 probe_irq_mask(void)
+{
+  __asm__ __volatile__("CPSID i;" ::: "memory");
+  return probe_now();
+}
+
+/** Unmask interrupts masked by probe_irq_mask().
+ * \param p  Probe for the masked section.
+ * \param t0 Value returned by probe_irq_mask().
+ */
+static inline void probe_irq_unmask(probe_t *p, u32 t0)
+{
+  probe_masked(p, t0);
+  __asm__ __volatile__("CPSIE i;" ::: "memory");
+}
+
+void probe_send_all(void);
+
+/** \} */
+
+#endif  /* SWIFTNAV_PROBE_H */
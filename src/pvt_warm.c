@@ -0,0 +1,302 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <libswiftnav/constants.h>
+#include <libswiftnav/coord_system.h>
+#include <libswiftnav/gpstime.h>
+#include <libswiftnav/linear_algebra.h>
+
+#include "pvt_warm.h"
+
+/** \defgroup pvt_warm Warm started PVT
+ * Single point position, velocity and time seeded from the last solution.
+ * calc_PVT() starts every epoch from scratch, which takes several
+ * Gauss-Newton iterations. Between epochs the receiver has only moved by
+ * its velocity times the epoch interval, so starting from the last fix
+ * propagated by its velocity the solution converges in one or two
+ * iterations. The receiver clock offset isn't propagated, the measurement
+ * code picks a new pseudorange reference every epoch, so it is estimated
+ * afresh from the propagated position before iterating.
+ *
+ * The measurement model, Sagnac correction, velocity solution and sanity
+ * checks (and their error codes) are those of calc_PVT().
+ *
+ * A base station at a surveyed location needs even less, with the position
+ * known only the receiver clock is left to solve for, see
+ * pvt_known_pos_solve().
+ * \{ */
+
+/** Line of sight from the receiver to a satellite, with the satellite
+ * position corrected for the Earth's rotation during the time of flight as
+ * calc_PVT() does.
+ * \param los Set to the line of sight vector (m).
+ * \return Range (m).
+ */
+static double pvt_warm_los(const double rx[3], const double sat_pos[3],
+                           double los[3])
+{
+  double tempv[3];
+  vector_subtract(3, rx, sat_pos, tempv);
+  double wEtau = GPS_OMEGAE_DOT * vector_norm(3, tempv) / GPS_C;
+  double xk_new[3] = {
+    sat_pos[0] + wEtau * sat_pos[1],
+    sat_pos[1] - wEtau * sat_pos[0],
+    sat_pos[2]
+  };
+
+  vector_subtract(3, xk_new, rx, los);
+  return vector_norm(3, los);
+}
+
+/** One Gauss-Newton step on position and clock offset.
+ * \param state Receiver ECEF position and clock offset (m), updated.
+ * \param G     Set to the geometry matrix at `state` before the update.
+ * \param H     Set to inverse(G' * G).
+ * \return Norm of the position update (m), or -1 if the geometry is
+ *         singular.
+ */
+static double pvt_warm_step(u8 n_used,
+                            const navigation_measurement_t nav_meas[],
+                            double state[4], double G[][4], double H[4][4])
+{
+  double GtG[4][4];
+  double Gtomp[4];
+  memset(GtG, 0, sizeof(GtG));
+  memset(Gtomp, 0, sizeof(Gtomp));
+
+  for (u8 j = 0; j < n_used; j++) {
+    double los[3];
+    double p_pred = pvt_warm_los(state, nav_meas[j].sat_pos, los);
+    double omp = nav_meas[j].pseudorange - p_pred - state[3];
+
+    for (u8 i = 0; i < 3; i++)
+      G[j][i] = -los[i] / p_pred;
+    G[j][3] = 1;
+
+    for (u8 r = 0; r < 4; r++) {
+      Gtomp[r] += G[j][r] * omp;
+      for (u8 c = 0; c < 4; c++)
+        GtG[r][c] += G[j][r] * G[j][c];
+    }
+  }
+
+  if (matrix_inverse(4, (const double *)GtG, (double *)H) < 0)
+    return -1;
+
+  double correction[4];
+  matrix_multiply(4, 4, 1, (const double *)H, Gtomp, correction);
+  for (u8 i = 0; i < 4; i++)
+    state[i] += correction[i];
+
+  return vector_norm(3, correction);
+}
+
+/** Solve for receiver velocity and clock drift from the Doppler
+ * measurements, one least squares step at the geometry of the position
+ * solution.
+ * \param vel Set to ECEF velocity (m/s) and clock drift (m/s).
+ */
+static void pvt_warm_vel(u8 n_used, const navigation_measurement_t nav_meas[],
+                         double G[][4], double H[4][4], double vel[4])
+{
+  double Gterr[4] = {0, 0, 0, 0};
+
+  for (u8 j = 0; j < n_used; j++) {
+    /* Range rate due to the satellite's motion alone, the rest is ours. */
+    double pdot_pred = -vector_dot(3, G[j], nav_meas[j].sat_vel);
+    double pr_rate_err = -GPS_L1_LAMBDA * nav_meas[j].doppler - pdot_pred;
+    for (u8 r = 0; r < 4; r++)
+      Gterr[r] += G[j][r] * pr_rate_err;
+  }
+
+  matrix_multiply(4, 4, 1, (const double *)H, Gterr, vel);
+}
+
+/** Dilution of precision from inverse(G' * G) at a position. */
+static void pvt_warm_dops(double H[4][4], const double pos_llh[3],
+                          dops_t *dops)
+{
+  dops->pdop = sqrt(H[0][0] + H[1][1] + H[2][2]);
+  dops->tdop = sqrt(H[3][3]);
+  dops->gdop = sqrt(dops->pdop*dops->pdop + dops->tdop*dops->tdop);
+
+  /* Rotate the position covariance into the local level frame, only the
+   * diagonal is needed. */
+  double M[3][3];
+  ecef2ned_matrix(pos_llh, M);
+  double var_ned[3];
+  for (u8 i = 0; i < 3; i++) {
+    var_ned[i] = 0;
+    for (u8 a = 0; a < 3; a++)
+      for (u8 b = 0; b < 3; b++)
+        var_ned[i] += M[i][a] * H[a][b] * M[i][b];
+  }
+  dops->hdop = sqrt(var_ned[0] + var_ned[1]);
+  dops->vdop = sqrt(var_ned[2]);
+}
+
+/** Calculate a PVT solution, warm started from the previous one if it is
+ * recent enough and falling back to calc_PVT() otherwise.
+ *
+ * \param n_used    Number of measurements.
+ * \param nav_meas  Measurements.
+ * \param max_iters Most iterations of the warm started solver before
+ *                  falling back to a cold start.
+ * \param soln      Previous solution on entry, the new solution on return.
+ * \param dops      Set to the dilution of precision.
+ * \param n_iters   Set to the number of warm started iterations, 0 if the
+ *                  solution was cold started.
+ * \return 0 on success, otherwise the calc_PVT() error code.
+ */
+s8 pvt_warm_solve(u8 n_used, const navigation_measurement_t nav_meas[],
+                  u8 max_iters, gnss_solution *soln, dops_t *dops,
+                  u8 *n_iters)
+{
+  *n_iters = 0;
+
+  if (!soln->valid || n_used < 4)
+    return calc_PVT(n_used, nav_meas, soln, dops);
+
+  /* Receive time from the first measurement and the time of flight to the
+   * previous position, close enough to propagate by. */
+  double tof = vector_distance(3, nav_meas[0].sat_pos, soln->pos_ecef) / GPS_C;
+  gps_time_t t_rx = nav_meas[0].tot;
+  t_rx.tow += tof;
+  double dt = gpsdifftime(t_rx, soln->time);
+  if (fabs(dt) > PVT_WARM_MAX_AGE)
+    return calc_PVT(n_used, nav_meas, soln, dops);
+
+  double state[4];
+  for (u8 i = 0; i < 3; i++)
+    state[i] = soln->pos_ecef[i] + soln->vel_ecef[i] * dt;
+
+  /* Clock offset that best fits the propagated position. */
+  state[3] = 0;
+  for (u8 j = 0; j < n_used; j++)
+    state[3] += nav_meas[j].pseudorange -
+                vector_distance(3, nav_meas[j].sat_pos, state);
+  state[3] /= n_used;
+
+  double G[n_used][4];
+  double H[4][4];
+  u8 iters;
+  for (iters = 1; iters <= max_iters; iters++) {
+    double update = pvt_warm_step(n_used, nav_meas, state, G, H);
+    if (update < 0)
+      return calc_PVT(n_used, nav_meas, soln, dops);
+    if (update < PVT_WARM_CONVERGED)
+      break;
+  }
+  if (iters > max_iters)
+    /* Out of budget, the prior was probably bad. */
+    return calc_PVT(n_used, nav_meas, soln, dops);
+  *n_iters = iters;
+
+  double vel[4];
+  pvt_warm_vel(n_used, nav_meas, G, H, vel);
+
+  soln->valid = 0;
+  soln->n_used = n_used;
+  memcpy(soln->pos_ecef, state, sizeof(soln->pos_ecef));
+  wgsecef2llh(soln->pos_ecef, soln->pos_llh);
+
+  pvt_warm_dops(H, soln->pos_llh, dops);
+  soln->err_cov[0] = H[0][0];
+  soln->err_cov[1] = H[0][1];
+  soln->err_cov[2] = H[0][2];
+  soln->err_cov[3] = H[1][1];
+  soln->err_cov[4] = H[1][2];
+  soln->err_cov[5] = H[2][2];
+  soln->err_cov[6] = dops->gdop;
+
+  if (dops->pdop > 50.0)
+    /* PDOP is too high to yield a good solution. */
+    return -1;
+
+  if (soln->pos_llh[2] < -1e3 || soln->pos_llh[2] > 1e6)
+    /* Altitude unreasonable. */
+    return -2;
+
+  /* ITAR limits, 1000 knots above 60000 feet. */
+  if (vector_norm(3, vel) >= 0.514444444 * 1000 &&
+      soln->pos_llh[2] >= 18288)
+    return -3;
+
+  memcpy(soln->vel_ecef, vel, sizeof(soln->vel_ecef));
+  wgsecef2ned(soln->vel_ecef, soln->pos_ecef, soln->vel_ned);
+
+  /* Time at the receiver is the time of transmission plus the time of
+   * flight, the pseudorange less the clock offset. */
+  soln->time = nav_meas[0].tot;
+  soln->time.tow += (nav_meas[0].pseudorange - state[3]) / GPS_C;
+  soln->time = normalize_gps_time(soln->time);
+
+  soln->clock_offset = state[3] / GPS_C;
+  soln->clock_bias = vel[3] / GPS_C;
+
+  soln->valid = 1;
+  return 0;
+}
+
+/** Calculate the solution of a receiver at a known position, solving only
+ * for its clock offset and drift.
+ *
+ * \param n_used   Number of measurements.
+ * \param nav_meas Measurements.
+ * \param pos_ecef Receiver ECEF position (m).
+ * \param soln     Set to the solution, at pos_ecef with zero velocity.
+ * \return 0 on success, -1 without any measurements.
+ */
+s8 pvt_known_pos_solve(u8 n_used, const navigation_measurement_t nav_meas[],
+                       const double pos_ecef[3], gnss_solution *soln)
+{
+  if (n_used == 0)
+    return -1;
+
+  double offset = 0;
+  double drift = 0;
+  for (u8 j = 0; j < n_used; j++) {
+    double los[3];
+    double p_pred = pvt_warm_los(pos_ecef, nav_meas[j].sat_pos, los);
+    offset += nav_meas[j].pseudorange - p_pred;
+
+    /* The receiver is still, all the range rate not due to the satellite's
+     * motion is the clock drift. */
+    double pdot_pred = vector_dot(3, los, nav_meas[j].sat_vel) / p_pred;
+    drift += -GPS_L1_LAMBDA * nav_meas[j].doppler - pdot_pred;
+  }
+  offset /= n_used;
+  drift /= n_used;
+
+  soln->valid = 0;
+  soln->n_used = n_used;
+  memcpy(soln->pos_ecef, pos_ecef, sizeof(soln->pos_ecef));
+  wgsecef2llh(soln->pos_ecef, soln->pos_llh);
+  memset(soln->vel_ecef, 0, sizeof(soln->vel_ecef));
+  memset(soln->vel_ned, 0, sizeof(soln->vel_ned));
+  memset(soln->err_cov, 0, sizeof(soln->err_cov));
+
+  soln->time = nav_meas[0].tot;
+  soln->time.tow += (nav_meas[0].pseudorange - offset) / GPS_C;
+  soln->time = normalize_gps_time(soln->time);
+
+  soln->clock_offset = offset / GPS_C;
+  soln->clock_bias = drift / GPS_C;
+
+  soln->valid = 1;
+  return 0;
+}
+
+/** \} */
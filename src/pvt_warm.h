@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef SWIFTNAV_PVT_WARM_H
+#define SWIFTNAV_PVT_WARM_H
+
+#include <libswiftnav/common.h>
+#include <libswiftnav/pvt.h>
+#include <libswiftnav/track.h>
+
+/** \addtogroup pvt_warm
+ * \{ */
+
+/** Oldest prior solution that is propagated as a starting point, older
+ * ones cold start. (s) */
+#define PVT_WARM_MAX_AGE 10.0
+
+/** Position update below which the solution has converged. (m) */
+#define PVT_WARM_CONVERGED 1e-3
+
+/** \} */
+
+s8 pvt_warm_solve(u8 n_used, const navigation_measurement_t nav_meas[],
+                  u8 max_iters, gnss_solution *soln, dops_t *dops,
+                  u8 *n_iters);
+s8 pvt_known_pos_solve(u8 n_used, const navigation_measurement_t nav_meas[],
+                       const double pos_ecef[3], gnss_solution *soln);
+
+#endif  /* SWIFTNAV_PVT_WARM_H */
@@ -18,6 +18,14 @@
 #include <math.h>
 #include <libswiftnav/edc.h>
 
+#include <ch.h>
+
+#include "sbp.h"
+#include "settings.h"
+#include "position.h"
+#include "solution.h"
+#include "peripherals/usart.h"
+
 #define RTCM3PREAMB 0xD3  /* rtcm ver.3 frame preamble */
 
 #define ROUND(x)    ((s32)floor((x) + 0.5))
@@ -30,6 +38,10 @@
 #define PRUNIT_GPS  299792.458  /* rtcm ver.3 unit of gps pseudorange (m) */
 #define RANGE_MS    (CLIGHT*0.001)      /* range in 1 ms */
 
+/* rtcm reference stations share the sbp sender id space with the sbp base
+ * stations, offset so that station 0 isn't taken as a relay */
+#define RTCM_SENDER_ID(staid) (0xF000 | (staid))
+
 #define P2_5        0.03125             /* 2^-5 */
 #define P2_6        0.015625            /* 2^-6 */
 #define P2_11       4.882812500000000E-04 /* 2^-11 */
@@ -91,6 +103,116 @@ void setbits(u8 *buff, u32 pos, u32 len, s32 data)
     data &= ~(1 << (len - 1));   /* set sign bit */
   setbitu(buff, pos, len, (u32)data);
 }
+
+/* streaming bit writer --------------------------------------------------------
+* appends bit fields msb first to a byte buffer, bits are collected in a 64 bit
+* accumulator and only flushed to the buffer as whole bytes so each field
+* costs a shift and an or rather than a loop over its bits. the accumulator
+* never holds more than 7 bits between calls so a field of up to 32 bits
+* always fits.
+*-----------------------------------------------------------------------------*/
+typedef struct {
+  u8 *buff;   /* output buffer */
+  u32 nbyte;  /* number of bytes flushed to buffer */
+  u64 acc;    /* bit accumulator, lsb aligned */
+  u32 nacc;   /* number of bits in accumulator */
+} bitwriter_t;
+
+static inline void bw_init(bitwriter_t *bw, u8 *buff, u32 nbyte)
+{
+  bw->buff = buff;
+  bw->nbyte = nbyte;
+  bw->acc = 0;
+  bw->nacc = 0;
+}
+
+static inline void bw_putu(bitwriter_t *bw, u32 len, u32 data)
+{
+  bw->acc = (bw->acc << len) | (data & (0xFFFFFFFFu >> (32 - len)));
+  bw->nacc += len;
+  while (bw->nacc >= 8) {
+    bw->nacc -= 8;
+    bw->buff[bw->nbyte++] = (u8)(bw->acc >> bw->nacc);
+  }
+}
+
+/* two's complement truncated to len bits, sign bit set as in setbits() */
+static inline void bw_puts(bitwriter_t *bw, u32 len, s32 data)
+{
+  u32 sign = 1u << (len - 1);
+  bw_putu(bw, len, (data < 0) ? ((u32)data | sign) : ((u32)data & ~sign));
+}
+
+/* number of bits written so far */
+static inline u32 bw_nbit(const bitwriter_t *bw)
+{
+  return bw->nbyte * 8 + bw->nacc;
+}
+
+/* pad with zeros to a byte boundary */
+static inline void bw_align(bitwriter_t *bw)
+{
+  if (bw->nacc)
+    bw_putu(bw, 8 - bw->nacc, 0);
+}
+
+/* crc-24q parity --------------------------------------------------------------
+* table driven crc-24q (polynomial 0x1864CFB) as used by rtcm v3, gives the
+* same result as libswiftnav crc24q() but one table lookup per byte instead of
+* eight shifts.
+*-----------------------------------------------------------------------------*/
+static const u32 crc24q_tbl[256] = {
+  0x000000, 0x864CFB, 0x8AD50D, 0x0C99F6, 0x93E6E1, 0x15AA1A,
+  0x1933EC, 0x9F7F17, 0xA18139, 0x27CDC2, 0x2B5434, 0xAD18CF,
+  0x3267D8, 0xB42B23, 0xB8B2D5, 0x3EFE2E, 0xC54E89, 0x430272,
+  0x4F9B84, 0xC9D77F, 0x56A868, 0xD0E493, 0xDC7D65, 0x5A319E,
+  0x64CFB0, 0xE2834B, 0xEE1ABD, 0x685646, 0xF72951, 0x7165AA,
+  0x7DFC5C, 0xFBB0A7, 0x0CD1E9, 0x8A9D12, 0x8604E4, 0x00481F,
+  0x9F3708, 0x197BF3, 0x15E205, 0x93AEFE, 0xAD50D0, 0x2B1C2B,
+  0x2785DD, 0xA1C926, 0x3EB631, 0xB8FACA, 0xB4633C, 0x322FC7,
+  0xC99F60, 0x4FD39B, 0x434A6D, 0xC50696, 0x5A7981, 0xDC357A,
+  0xD0AC8C, 0x56E077, 0x681E59, 0xEE52A2, 0xE2CB54, 0x6487AF,
+  0xFBF8B8, 0x7DB443, 0x712DB5, 0xF7614E, 0x19A3D2, 0x9FEF29,
+  0x9376DF, 0x153A24, 0x8A4533, 0x0C09C8, 0x00903E, 0x86DCC5,
+  0xB822EB, 0x3E6E10, 0x32F7E6, 0xB4BB1D, 0x2BC40A, 0xAD88F1,
+  0xA11107, 0x275DFC, 0xDCED5B, 0x5AA1A0, 0x563856, 0xD074AD,
+  0x4F0BBA, 0xC94741, 0xC5DEB7, 0x43924C, 0x7D6C62, 0xFB2099,
+  0xF7B96F, 0x71F594, 0xEE8A83, 0x68C678, 0x645F8E, 0xE21375,
+  0x15723B, 0x933EC0, 0x9FA736, 0x19EBCD, 0x8694DA, 0x00D821,
+  0x0C41D7, 0x8A0D2C, 0xB4F302, 0x32BFF9, 0x3E260F, 0xB86AF4,
+  0x2715E3, 0xA15918, 0xADC0EE, 0x2B8C15, 0xD03CB2, 0x567049,
+  0x5AE9BF, 0xDCA544, 0x43DA53, 0xC596A8, 0xC90F5E, 0x4F43A5,
+  0x71BD8B, 0xF7F170, 0xFB6886, 0x7D247D, 0xE25B6A, 0x641791,
+  0x688E67, 0xEEC29C, 0x3347A4, 0xB50B5F, 0xB992A9, 0x3FDE52,
+  0xA0A145, 0x26EDBE, 0x2A7448, 0xAC38B3, 0x92C69D, 0x148A66,
+  0x181390, 0x9E5F6B, 0x01207C, 0x876C87, 0x8BF571, 0x0DB98A,
+  0xF6092D, 0x7045D6, 0x7CDC20, 0xFA90DB, 0x65EFCC, 0xE3A337,
+  0xEF3AC1, 0x69763A, 0x578814, 0xD1C4EF, 0xDD5D19, 0x5B11E2,
+  0xC46EF5, 0x42220E, 0x4EBBF8, 0xC8F703, 0x3F964D, 0xB9DAB6,
+  0xB54340, 0x330FBB, 0xAC70AC, 0x2A3C57, 0x26A5A1, 0xA0E95A,
+  0x9E1774, 0x185B8F, 0x14C279, 0x928E82, 0x0DF195, 0x8BBD6E,
+  0x872498, 0x016863, 0xFAD8C4, 0x7C943F, 0x700DC9, 0xF64132,
+  0x693E25, 0xEF72DE, 0xE3EB28, 0x65A7D3, 0x5B59FD, 0xDD1506,
+  0xD18CF0, 0x57C00B, 0xC8BF1C, 0x4EF3E7, 0x426A11, 0xC426EA,
+  0x2AE476, 0xACA88D, 0xA0317B, 0x267D80, 0xB90297, 0x3F4E6C,
+  0x33D79A, 0xB59B61, 0x8B654F, 0x0D29B4, 0x01B042, 0x87FCB9,
+  0x1883AE, 0x9ECF55, 0x9256A3, 0x141A58, 0xEFAAFF, 0x69E604,
+  0x657FF2, 0xE33309, 0x7C4C1E, 0xFA00E5, 0xF69913, 0x70D5E8,
+  0x4E2BC6, 0xC8673D, 0xC4FECB, 0x42B230, 0xDDCD27, 0x5B81DC,
+  0x57182A, 0xD154D1, 0x26359F, 0xA07964, 0xACE092, 0x2AAC69,
+  0xB5D37E, 0x339F85, 0x3F0673, 0xB94A88, 0x87B4A6, 0x01F85D,
+  0x0D61AB, 0x8B2D50, 0x145247, 0x921EBC, 0x9E874A, 0x18CBB1,
+  0xE37B16, 0x6537ED, 0x69AE1B, 0xEFE2E0, 0x709DF7, 0xF6D10C,
+  0xFA48FA, 0x7C0401, 0x42FA2F, 0xC4B6D4, 0xC82F22, 0x4E63D9,
+  0xD11CCE, 0x575035, 0x5BC9C3, 0xDD8538
+};
+
+u32 rtcm_crc24q(const u8 *buff, u32 len, u32 crc)
+{
+  for (u32 i = 0; i < len; i++)
+    crc = ((crc << 8) & 0xFFFFFF) ^ crc24q_tbl[(crc >> 16) ^ buff[i]];
+  return crc;
+}
 /*
 static double myfmod(double x, double y)
 {
@@ -126,8 +248,9 @@ static void gen_obs_gps(rtcm_t *rtcm, const navigation_measurement_t *data,
     *pr1 = ROUND((data->raw_pseudorange - *amb * PRUNIT_GPS) / 0.02);
     pr1c = *pr1 * 0.02 + *amb * PRUNIT_GPS;
 
-    /* L1 phaserange - L1 pseudorange */
-    ppr = cp_pr(data->carrier_phase, pr1c / lam1);
+    /* L1 phaserange - L1 pseudorange, our carrier phase has the opposite
+     * sign to the rtcm phaserange */
+    ppr = cp_pr(-data->carrier_phase, pr1c / lam1);
     /*printf("%02d - cp: %g, pr1c: %g, ppr: %g\n", data->prn+1, data->carrier_phase, pr1c/lam1, ppr);*/
     if (ppr1) *ppr1 = ROUND(ppr * lam1 / 0.0005);
   }
@@ -141,33 +264,33 @@ static void gen_obs_gps(rtcm_t *rtcm, const navigation_measurement_t *data,
 
 
 /* encode rtcm header --------------------------------------------------------*/
-static int encode_head(int type, rtcm_t *rtcm, int sync, int nsat)
+static void encode_head(int type, rtcm_t *rtcm, bitwriter_t *bw, int sync,
+                        int nsat)
 {
-  int i = 24, epoch;
+  int epoch;
 
-  setbitu(rtcm->buff, i, 12, type); i += 12;        /* message no */
-  setbitu(rtcm->buff, i, 12, 0);    i += 12;        /* ref station id */
+  bw_putu(bw, 12, type);            /* message no */
+  bw_putu(bw, 12, 0);               /* ref station id */
 
   epoch = ROUND(rtcm->time.tow / 0.001);
-  setbitu(rtcm->buff, i, 30, epoch); i += 30;       /* gps epoch time */
+  bw_putu(bw, 30, epoch);           /* gps epoch time */
 
-  setbitu(rtcm->buff, i, 1, sync); i += 1;          /* synchronous gnss flag */
-  setbitu(rtcm->buff, i, 5, nsat); i += 5;          /* no of satellites */
-  setbitu(rtcm->buff, i, 1, 0);    i += 1;          /* smoothing indicator */
-  setbitu(rtcm->buff, i, 3, 0);    i += 3;          /* smoothing interval */
-  return i;
+  bw_putu(bw, 1, sync);             /* synchronous gnss flag */
+  bw_putu(bw, 5, nsat);             /* no of satellites */
+  bw_putu(bw, 1, 0);                /* smoothing indicator */
+  bw_putu(bw, 3, 0);                /* smoothing interval */
 }
 
 
 
 /* encode type 1002: extended L1-only gps rtk observables --------------------*/
-static int encode_type1002(rtcm_t *rtcm, int sync)
+static int encode_type1002(rtcm_t *rtcm, bitwriter_t *bw, int sync)
 {
-  int i, j;
+  int j;
   int code1, pr1, ppr1, lock1, amb, cnr1;
 
   /* encode header */
-  i = encode_head(1002, rtcm, sync, rtcm->n);
+  encode_head(1002, rtcm, bw, sync, rtcm->n);
 
   for (j = 0; j < rtcm->n; j++) {
 
@@ -175,15 +298,14 @@ static int encode_type1002(rtcm_t *rtcm, int sync)
     gen_obs_gps(rtcm, &(rtcm->obs[j]), &code1, &pr1, &ppr1, &lock1, &amb,
                 &cnr1);
 
-    setbitu(rtcm->buff, i, 6, rtcm->obs[j].prn+1  ); i += 6;
-    setbitu(rtcm->buff, i, 1, code1); i += 1;
-    setbitu(rtcm->buff, i, 24, pr1  ); i += 24;
-    setbits(rtcm->buff, i, 20, ppr1 ); i += 20;
-    setbitu(rtcm->buff, i, 7, lock1); i += 7;
-    setbitu(rtcm->buff, i, 8, amb  ); i += 8;
-    setbitu(rtcm->buff, i, 8, cnr1 ); i += 8;
+    bw_putu(bw, 6, rtcm->obs[j].prn+1);
+    bw_putu(bw, 1, code1);
+    bw_putu(bw, 24, pr1);
+    bw_puts(bw, 20, ppr1);
+    bw_putu(bw, 7, lock1);
+    bw_putu(bw, 8, amb);
+    bw_putu(bw, 8, cnr1);
   }
-  rtcm->nbit = i;
   return 1;
 }
 
@@ -191,11 +313,11 @@ static int encode_type1002(rtcm_t *rtcm, int sync)
 
 
 /* encode type 1019: gps ephemerides -----------------------------------------*/
-static int encode_type1019(rtcm_t *rtcm, int sync)
+static int encode_type1019(rtcm_t *rtcm, bitwriter_t *bw, int sync)
 {
   ephemeris_t *swift_eph;
   unsigned int sqrtA, e;
-  int i = 24, week, toe, toc, i0, OMG0, omg, M0, deln, idot, OMGd, crs,
+  int week, toe, toc, i0, OMG0, omg, M0, deln, idot, OMGd, crs,
       crc;
   int cus, cuc, cis, cic, af0, af1, af2, tgd;
 
@@ -228,89 +350,150 @@ static int encode_type1019(rtcm_t *rtcm, int sync)
 
   /* TODO: Lots of fields missing from ephemeris!! Just hacked in reasonable
     values here. */
-  setbitu(rtcm->buff, i, 12, 1019);  i += 12;
-  setbitu(rtcm->buff, i, 6, rtcm->prn+1);    i += 6;
-  setbitu(rtcm->buff, i, 10, week);  i += 10;
-  setbitu(rtcm->buff, i, 4, 1);      i += 4;
-  setbitu(rtcm->buff, i, 2, 0);      i += 2;
-  setbits(rtcm->buff, i, 14, idot);  i += 14;
-  setbitu(rtcm->buff, i, 8, 1);      i += 8;
-  setbitu(rtcm->buff, i, 16, toc);   i += 16;
-  setbits(rtcm->buff, i, 8, af2);    i += 8;
-  setbits(rtcm->buff, i, 16, af1);   i += 16;
-  setbits(rtcm->buff, i, 22, af0);   i += 22;
-  setbitu(rtcm->buff, i, 10, 1);     i += 10;
-  setbits(rtcm->buff, i, 16, crs);   i += 16;
-  setbits(rtcm->buff, i, 16, deln);  i += 16;
-  setbits(rtcm->buff, i, 32, M0);    i += 32;
-  setbits(rtcm->buff, i, 16, cuc);   i += 16;
-  setbitu(rtcm->buff, i, 32, e);     i += 32;
-  setbits(rtcm->buff, i, 16, cus);   i += 16;
-  setbitu(rtcm->buff, i, 32, sqrtA); i += 32;
-  setbitu(rtcm->buff, i, 16, toe);   i += 16;
-  setbits(rtcm->buff, i, 16, cic);   i += 16;
-  setbits(rtcm->buff, i, 32, OMG0);  i += 32;
-  setbits(rtcm->buff, i, 16, cis);   i += 16;
-  setbits(rtcm->buff, i, 32, i0);    i += 32;
-  setbits(rtcm->buff, i, 16, crc);   i += 16;
-  setbits(rtcm->buff, i, 32, omg);   i += 32;
-  setbits(rtcm->buff, i, 24, OMGd);  i += 24;
-  setbits(rtcm->buff, i, 8, tgd);    i += 8;
-  setbitu(rtcm->buff, i, 6, (swift_eph->healthy) ? 0 : 1 ); i += 6;
-  setbitu(rtcm->buff, i, 1, 0);      i += 1;
-  setbitu(rtcm->buff, i, 1, 1);      i += 1;
-  rtcm->nbit = i;
+  bw_putu(bw, 12, 1019);
+  bw_putu(bw, 6, rtcm->prn+1);
+  bw_putu(bw, 10, week);
+  bw_putu(bw, 4, 1);
+  bw_putu(bw, 2, 0);
+  bw_puts(bw, 14, idot);
+  bw_putu(bw, 8, 1);
+  bw_putu(bw, 16, toc);
+  bw_puts(bw, 8, af2);
+  bw_puts(bw, 16, af1);
+  bw_puts(bw, 22, af0);
+  bw_putu(bw, 10, 1);
+  bw_puts(bw, 16, crs);
+  bw_puts(bw, 16, deln);
+  bw_puts(bw, 32, M0);
+  bw_puts(bw, 16, cuc);
+  bw_putu(bw, 32, e);
+  bw_puts(bw, 16, cus);
+  bw_putu(bw, 32, sqrtA);
+  bw_putu(bw, 16, toe);
+  bw_puts(bw, 16, cic);
+  bw_puts(bw, 32, OMG0);
+  bw_puts(bw, 16, cis);
+  bw_puts(bw, 32, i0);
+  bw_puts(bw, 16, crc);
+  bw_puts(bw, 32, omg);
+  bw_puts(bw, 24, OMGd);
+  bw_puts(bw, 8, tgd);
+  bw_putu(bw, 6, (swift_eph->healthy) ? 0 : 1);
+  bw_putu(bw, 1, 0);
+  bw_putu(bw, 1, 1);
   return 1;
 }
 
 
-#if 0
-/* encode msm 7: full pseudorange, phaserange, phaserangerate and cnr (h-res) */
-static int encode_msm7(rtcm_t *rtcm, int sys, int sync)
+/* encode msm 7: full pseudorange, phaserange, phaserangerate and cnr (h-res)
+ * Only GPS L1 C/A is tracked so there is a single signal per satellite and
+ * the cell mask is all ones. */
+#define MSM_SIG_GPS_L1C 2   /* msm signal id of gps l1 c/a */
+
+static int encode_msm7(rtcm_t *rtcm, bitwriter_t *bw, int sync)
 {
-  double rrng[64], rrate[64], psrng[64], phrng[64], rate[64];
-  float cnr[64];
-  unsigned char info[64], half[64];
-  int i, nsat, ncell, lock[64];
+  u8 idx[64];
+  double rrng[64];
+  u64 sat_mask = 0;
+  int j, nsat = 0;
+  double lam1 = CLIGHT / FREQ1;
+
+  /* satellites must be in order of satellite id in the msm, at most one
+   * observation per prn */
+  for (u32 prn = 0; prn < 64; prn++) {
+    for (j = 0; j < rtcm->n; j++) {
+      if (rtcm->obs[j].prn == prn && rtcm->obs[j].raw_pseudorange != 0.0) {
+        idx[nsat++] = j;
+        sat_mask |= 1ull << (63 - prn);
+        break;
+      }
+    }
+  }
 
   /* encode msm header */
-  if (!(i =
-          encode_msm_head(7, rtcm, sys, sync, &nsat, &ncell, rrng, rrate, info,
-                          psrng,
-                          phrng, rate, lock, half, cnr)))
-    return 0;
+  bw_putu(bw, 12, 1077);            /* message no */
+  bw_putu(bw, 12, 0);               /* ref station id */
+  bw_putu(bw, 30, ROUND(rtcm->time.tow / 0.001)); /* gps epoch time */
+  bw_putu(bw, 1, sync);             /* multiple message bit */
+  bw_putu(bw, 3, 0);                /* issue of data station */
+  bw_putu(bw, 7, 0);                /* reserved */
+  bw_putu(bw, 2, 0);                /* clock steering ind */
+  bw_putu(bw, 2, 0);                /* external clock ind */
+  bw_putu(bw, 1, 0);                /* smoothing indicator */
+  bw_putu(bw, 3, 0);                /* smoothing interval */
+  bw_putu(bw, 32, (u32)(sat_mask >> 32)); /* satellite mask */
+  bw_putu(bw, 32, (u32)sat_mask);
+  bw_putu(bw, 32, 1u << (32 - MSM_SIG_GPS_L1C)); /* signal mask */
+  for (j = 0; j < nsat; j++)        /* cell mask */
+    bw_putu(bw, 1, 1);
+
+  /* rough range, rounded to 2^-10 ms */
+  for (j = 0; j < nsat; j++)
+    rrng[j] = ROUND(rtcm->obs[idx[j]].raw_pseudorange / RANGE_MS / P2_10)
+                * P2_10;
 
   /* encode msm satellite data */
-  i = encode_msm_int_rrng(rtcm, i, rrng, nsat );  /* rough range integer ms */
-  i = encode_msm_info(rtcm, i, info, nsat );      /* extended satellite info */
-  i = encode_msm_mod_rrng(rtcm, i, rrng, nsat );  /* rough range modulo 1 ms */
-  i = encode_msm_rrate(rtcm, i, rrate, nsat );    /* rough phase-range-rate */
+  for (j = 0; j < nsat; j++) {                      /* rough range integer ms */
+    int int_ms = (int)floor(rrng[j]);
+    bw_putu(bw, 8, (int_ms < 0 || int_ms > 254) ? 255 : int_ms);
+  }
+  for (j = 0; j < nsat; j++) {                      /* extended sat info */
+    bw_putu(bw, 4, 0);
+  }
+  for (j = 0; j < nsat; j++) {                      /* rough range mod 1 ms */
+    bw_putu(bw, 10, ROUND((rrng[j] - floor(rrng[j])) / P2_10));
+  }
+  for (j = 0; j < nsat; j++) {                      /* rough phaserange rate */
+    double rate = -rtcm->obs[idx[j]].doppler * lam1;
+    bw_puts(bw, 14, ROUND(rate));
+  }
 
   /* encode msm signal data */
-  i = encode_msm_psrng_ex(rtcm, i, psrng, ncell); /* fine pseudorange ext */
-  i = encode_msm_phrng_ex(rtcm, i, phrng, ncell); /* fine phase-range ext */
-  i = encode_msm_lock_ex(rtcm, i, lock, ncell);   /* lock-time indicator ext */
-  i = encode_msm_half_amb(rtcm, i, half, ncell);  /* half-cycle-amb indicator */
-  i = encode_msm_cnr_ex(rtcm, i, cnr, ncell);     /* signal cnr ext */
-  i = encode_msm_rate(rtcm, i, rate, ncell);      /* fine phase-range-rate */
-  rtcm->nbit = i;
+  for (j = 0; j < nsat; j++) {                      /* fine pseudorange ext */
+    double psrng = rtcm->obs[idx[j]].raw_pseudorange / RANGE_MS - rrng[j];
+    int x = ROUND(psrng / P2_29);
+    if (x < -524287 || x > 524287) x = -524288;     /* invalid */
+    bw_puts(bw, 20, x);
+  }
+  for (j = 0; j < nsat; j++) {                      /* fine phaserange ext */
+    const navigation_measurement_t *o = &rtcm->obs[idx[j]];
+    double ppr = cp_pr(-o->carrier_phase, o->raw_pseudorange / lam1);
+    double phrng = (o->raw_pseudorange + ppr * lam1) / RANGE_MS - rrng[j];
+    int x = ROUND(phrng / P2_31);
+    if (x < -8388607 || x > 8388607) x = -8388608;  /* invalid */
+    bw_puts(bw, 24, x);
+  }
+  for (j = 0; j < nsat; j++) {                      /* lock time ind ext */
+    /* TODO: implement lock time info, see gen_obs_gps(). */
+    bw_putu(bw, 10, 704);
+  }
+  for (j = 0; j < nsat; j++) {                      /* half-cycle amb ind */
+    bw_putu(bw, 1, 0);
+  }
+  for (j = 0; j < nsat; j++) {                      /* signal cnr ext */
+    double cnr = 10.0*log10(rtcm->obs[idx[j]].snr) + 40.0;
+    bw_putu(bw, 10, cnr > 0 ? ROUND(cnr * 16.0) & 0x3FF : 0);
+  }
+  for (j = 0; j < nsat; j++) {                      /* fine phaserange rate */
+    double rate = -rtcm->obs[idx[j]].doppler * lam1;
+    bw_puts(bw, 15, ROUND((rate - ROUND(rate)) / 0.0001));
+  }
   return 1;
 }
-#endif
 
 /* encode rtcm ver.3 message -------------------------------------------------*/
-extern int encode_rtcm3(rtcm_t *rtcm, int type, int sync)
+static int encode_rtcm3(rtcm_t *rtcm, bitwriter_t *bw, int type, int sync)
 {
   int ret = 0;
 
   switch (type) {
-  case 1002: ret = encode_type1002(rtcm, sync); break;
+  case 1002: ret = encode_type1002(rtcm, bw, sync); break;
 
-  case 1019: ret = encode_type1019(rtcm, sync); break;
+  case 1019: ret = encode_type1019(rtcm, bw, sync); break;
 
-  /*case 1077: ret=encode_msm7(rtcm,SYS_GPS,sync); break;*/
+  case 1077: ret = encode_msm7(rtcm, bw, sync); break;
   default:
-    ret = -1;
+    ret = 0;
   }
   return ret;
 }
@@ -326,34 +509,35 @@ extern int encode_rtcm3(rtcm_t *rtcm, int type, int sync)
 *-----------------------------------------------------------------------------*/
 int gen_rtcm3(rtcm_t *rtcm, int type, int sync)
 {
-  unsigned int crc;
-  int i = 0;
+  bitwriter_t bw;
+  u32 crc;
 
   rtcm->nbit = rtcm->len = rtcm->nbyte = 0;
 
-  /* set preamble and reserved */
-  setbitu(rtcm->buff, i, 8, RTCM3PREAMB); i += 8;
-  setbitu(rtcm->buff, i, 6, 0          ); i += 6;
-  setbitu(rtcm->buff, i, 10, 0          ); i += 10;
+  /* preamble, reserved and message length are filled in once the length is
+   * known, encoding starts after them */
+  bw_init(&bw, rtcm->buff, 3);
 
   /* encode rtcm 3 message body */
-  if (!encode_rtcm3(rtcm, type, sync)) return 0;
+  if (!encode_rtcm3(rtcm, &bw, type, sync)) return 0;
 
   /* padding to align 8 bit boundary */
-  for (i = rtcm->nbit; i % 8; i++)
-    setbitu(rtcm->buff, i, 1, 0);
+  rtcm->nbit = bw_nbit(&bw);
+  bw_align(&bw);
   /* message length (header+data) (bytes) */
-  if ((rtcm->len = i / 8) >= 3 + 1024) {
+  if ((rtcm->len = bw.nbyte) >= 3 + 1024) {
     /*trace(2,"generate rtcm 3 message length error len=%d\n",rtcm->len-3);*/
     rtcm->nbit = rtcm->len = 0;
     return 0;
   }
-  /* message length without header and parity */
-  setbitu(rtcm->buff, 14, 10, rtcm->len - 3);
+  /* set preamble, reserved and message length without header and parity */
+  rtcm->buff[0] = RTCM3PREAMB;
+  rtcm->buff[1] = ((rtcm->len - 3) >> 8) & 0x03;
+  rtcm->buff[2] = (rtcm->len - 3) & 0xFF;
 
   /* crc-24q */
-  crc = crc24q(rtcm->buff, rtcm->len, 0);
-  setbitu(rtcm->buff, i, 24, crc);
+  crc = rtcm_crc24q(rtcm->buff, rtcm->len, 0);
+  bw_putu(&bw, 24, crc);
 
   /* length total (bytes) */
   rtcm->nbyte = rtcm->len + 3;
@@ -361,3 +545,309 @@ int gen_rtcm3(rtcm_t *rtcm, int type, int sync)
   return 1;
 }
 
+/** \defgroup rtcm RTCM
+ * RTCM v3 observation output on USARTs in RTCM mode.
+ * \{ */
+
+static const int rtcm_obs_msg_types[] = {1002, 1077};
+static int rtcm_obs_msg = 0;
+
+/** Encode observations as RTCM v3 and send them out any USARTs in RTCM
+ * mode. The observations are encoded directly from the given array.
+ * Only called from the solution thread.
+ *
+ * \param n  Number of observations.
+ * \param t  GPS time of the observations.
+ * \param nm Array of observations.
+ */
+void rtcm_send_obs(u8 n, gps_time_t *t, const navigation_measurement_t *nm)
+{
+  static rtcm_t rtcm;
+  u8 ports = 0;
+
+  if (ftdi_usart.mode == RTCM)
+    ports |= SBP_TX_FTDI;
+
+  if (uarta_usart.mode == RTCM)
+    ports |= SBP_TX_UARTA;
+
+  if (uartb_usart.mode == RTCM)
+    ports |= SBP_TX_UARTB;
+
+  /* Don't bother encoding if nobody is listening. */
+  if (!ports)
+    return;
+
+  rtcm.time = *t;
+  rtcm.n = n;
+  rtcm.obs = nm;
+
+  if (!gen_rtcm3(&rtcm, rtcm_obs_msg_types[rtcm_obs_msg], 0))
+    return;
+
+  sbp_tx_raw(ports, SBP_TX_PRIO_NORMAL, rtcm.buff, rtcm.nbyte);
+}
+
+void rtcm_setup(void)
+{
+  static const char const *rtcm_obs_msg_enum[] = {"1002", "1077", NULL};
+  static struct setting_type rtcm_obs_msg_setting;
+  int TYPE_RTCM_OBS_MSG = settings_type_register_enum(rtcm_obs_msg_enum,
+                                                      &rtcm_obs_msg_setting);
+  SETTING("rtcm", "obs_msg", rtcm_obs_msg, TYPE_RTCM_OBS_MSG);
+}
+
+/* RTCM input --------------------------------------------------------------*/
+
+extern ephemeris_t es[32];
+extern Mutex es_mutex;
+
+/* A received frame is decoded in place in the USART DMA RX buffer, it may
+ * wrap around the end of the buffer so bytes are always accessed through the
+ * buffer mask. */
+static inline u8 rx_byte(const usart_rx_dma_state *rx, u32 i)
+{
+  return rx->buff[(rx->rd + i) & (rx->len - 1)];
+}
+
+/* get unsigned bits from a frame in the rx buffer, len <= 32 */
+static u32 rx_getbitu(const usart_rx_dma_state *rx, u32 pos, u32 len)
+{
+  u32 data = 0;
+
+  while (len) {
+    u32 off = pos % 8;
+    u32 n = (8 - off < len) ? 8 - off : len;
+    u8 b = rx_byte(rx, pos / 8);
+    data = (data << n) | ((b >> (8 - off - n)) & ((1u << n) - 1));
+    pos += n;
+    len -= n;
+  }
+  return data;
+}
+
+static s32 rx_getbits(const usart_rx_dma_state *rx, u32 pos, u32 len)
+{
+  u32 data = rx_getbitu(rx, pos, len);
+  if (len == 32 || !(data & (1u << (len - 1))))
+    return (s32)data;
+  return (s32)(data | (~0u << len));
+}
+
+/* resolve the full week number from a 10 bit (mod 1024) week using the
+ * rover's week as a reference */
+static u16 adjust_week(u32 week)
+{
+  s32 ref = position_solution.time.wn;
+  return week + 1024 * ((ref - (s32)week + 512) / 1024);
+}
+
+/* resolve the 1500 cycle rollover of the phaserange - pseudorange field
+ * against the last value received for the satellite */
+static double adjust_ppr(rtcm_rx_state_t *s, u8 prn, double ppr)
+{
+  if (s->ppr[prn] != 0.0) {
+    if (ppr < s->ppr[prn] - 750.0)
+      ppr += 1500.0;
+    else if (ppr > s->ppr[prn] + 750.0)
+      ppr -= 1500.0;
+  }
+  s->ppr[prn] = ppr;
+  return ppr;
+}
+
+/* decode type 1002/1004: gps rtk observables, L1 only ----------------------*/
+static void decode_type1002(rtcm_rx_state_t *s, const usart_rx_dma_state *rx,
+                            u32 type)
+{
+  u32 i = 24 + 12;
+  double lam1 = CLIGHT / FREQ1;
+  u32 nbit_sat = (type == 1002) ? 74 : 125;
+
+  u32 staid = rx_getbitu(rx, i, 12); i += 12;       /* ref station id */
+  double tow = rx_getbitu(rx, i, 30) * 0.001; i += 30;
+  i += 1;                                           /* synchronous flag */
+  u32 nsat = rx_getbitu(rx, i, 5); i += 5;
+  i += 4;                                           /* smoothing */
+
+  if ((i + nsat * nbit_sat) > (s->len - 3) * 8)
+    return;
+
+  /* resolve the week number against the rover's time */
+  gps_time_t t = {.wn = position_solution.time.wn, .tow = tow};
+  double dt = tow - position_solution.time.tow;
+  if (dt > WEEK_SECS / 2)
+    t.wn--;
+  else if (dt < -WEEK_SECS / 2)
+    t.wn++;
+
+  obss_t *obss = base_obs_update_start(RTCM_SENDER_ID(staid), &t);
+  if (!obss)
+    return;
+
+  for (u32 j = 0; j < nsat; j++, i += nbit_sat) {
+    u32 prn = rx_getbitu(rx, i, 6);
+    u32 pr1 = rx_getbitu(rx, i + 7, 24);
+    s32 ppr1 = rx_getbits(rx, i + 31, 20);
+    u32 amb = rx_getbitu(rx, i + 58, 8);
+    u32 cnr1 = rx_getbitu(rx, i + 66, 8);
+
+    /* gps only, no sbas, and a valid L1 carrier phase */
+    if (prn < 1 || prn > 32 || ppr1 == (s32)0xFFF80000)
+      continue;
+    navigation_measurement_t *nm = base_obs_insert(obss, prn - 1);
+    if (!nm)
+      break;
+    nm->raw_pseudorange = pr1 * 0.02 + amb * PRUNIT_GPS;
+    /* our carrier phase has the opposite sign to the rtcm phaserange */
+    nm->carrier_phase = -(nm->raw_pseudorange / lam1 +
+                          adjust_ppr(s, prn - 1, ppr1 * 0.0005 / lam1));
+    nm->snr = pow(10.0, (cnr1 * 0.25 - 40.0) / 10.0);
+  }
+
+  base_obs_update_finish();
+}
+
+/* decode type 1019: gps ephemerides ----------------------------------------*/
+static void decode_type1019(const rtcm_rx_state_t *s,
+                            const usart_rx_dma_state *rx)
+{
+  ephemeris_t eph;
+  u32 i = 24 + 12;
+
+  if (s->len - 6 < 61)
+    return;
+
+  u32 prn = rx_getbitu(rx, i, 6);            i += 6;
+  u32 week = rx_getbitu(rx, i, 10);          i += 10;
+  i += 4 + 2;                                /* ura, code on L2 */
+  eph.inc_dot = rx_getbits(rx, i, 14) * P2_43 * SC2RAD; i += 14;
+  eph.iode = rx_getbitu(rx, i, 8);           i += 8;
+  double toc = rx_getbitu(rx, i, 16) * 16.0; i += 16;
+  eph.af2 = rx_getbits(rx, i, 8) * P2_55;    i += 8;
+  eph.af1 = rx_getbits(rx, i, 16) * P2_43;   i += 16;
+  eph.af0 = rx_getbits(rx, i, 22) * P2_31;   i += 22;
+  i += 10;                                   /* iodc */
+  eph.crs = rx_getbits(rx, i, 16) * P2_5;    i += 16;
+  eph.dn = rx_getbits(rx, i, 16) * P2_43 * SC2RAD; i += 16;
+  eph.m0 = rx_getbits(rx, i, 32) * P2_31 * SC2RAD; i += 32;
+  eph.cuc = rx_getbits(rx, i, 16) * P2_29;   i += 16;
+  eph.ecc = rx_getbitu(rx, i, 32) * P2_33;   i += 32;
+  eph.cus = rx_getbits(rx, i, 16) * P2_29;   i += 16;
+  eph.sqrta = rx_getbitu(rx, i, 32) * P2_19; i += 32;
+  double toe = rx_getbitu(rx, i, 16) * 16.0; i += 16;
+  eph.cic = rx_getbits(rx, i, 16) * P2_29;   i += 16;
+  eph.omega0 = rx_getbits(rx, i, 32) * P2_31 * SC2RAD; i += 32;
+  eph.cis = rx_getbits(rx, i, 16) * P2_29;   i += 16;
+  eph.inc = rx_getbits(rx, i, 32) * P2_31 * SC2RAD; i += 32;
+  eph.crc = rx_getbits(rx, i, 16) * P2_5;    i += 16;
+  eph.w = rx_getbits(rx, i, 32) * P2_31 * SC2RAD; i += 32;
+  eph.omegadot = rx_getbits(rx, i, 24) * P2_43 * SC2RAD; i += 24;
+  eph.tgd = rx_getbits(rx, i, 8) * P2_31;    i += 8;
+  u32 health = rx_getbitu(rx, i, 6);
+
+  if (prn < 1 || prn > 32)
+    return;
+
+  eph.prn = prn - 1;
+  eph.toe.wn = eph.toc.wn = adjust_week(week);
+  eph.toe.tow = toe;
+  eph.toc.tow = toc;
+  eph.healthy = (health == 0);
+  eph.valid = 1;
+
+  /* Only fill in ephemerides the rover hasn't decoded itself or that are
+   * newer than the rover's. */
+  chMtxLock(&es_mutex);
+  if (!es[eph.prn].valid || gpsdifftime(eph.toe, es[eph.prn].toe) > 0)
+    es[eph.prn] = eph;
+  chMtxUnlock();
+}
+
+static void decode_rtcm3(rtcm_rx_state_t *s, const usart_rx_dma_state *rx)
+{
+  u32 type = rx_getbitu(rx, 24, 12);
+
+  switch (type) {
+  case 1002:
+  case 1004: decode_type1002(s, rx, type); break;
+  case 1019: decode_type1019(s, rx); break;
+  default: break;
+  }
+}
+
+/** Process RTCM v3 messages received through a USART.
+ * Frames are synchronised on the 0xD3 preamble and checked with CRC-24Q
+ * incrementally as bytes arrive. They are left in the DMA RX buffer until
+ * complete and then decoded in place, so a partially received frame costs
+ * nothing until the rest of it turns up. 1002 and 1004 observations are
+ * decoded into the base station observations and 1019 ephemerides into
+ * the ephemeris set.
+ *
+ * \param s  RTCM input state for the USART.
+ * \param rx The USART DMA RX state.
+ */
+void rtcm_process_rx(rtcm_rx_state_t *s, usart_rx_dma_state *rx)
+{
+  u32 n_available;
+
+  while ((n_available = usart_n_read_dma(rx)) > 0) {
+    if (s->n == 0) {
+      /* Hunt for the preamble, dropping everything before it. */
+      u8 *span;
+      u32 n = usart_rx_span(rx, &span);
+      u32 k = 0;
+      while (k < n && span[k] != RTCM3PREAMB)
+        k++;
+      usart_rx_consume(rx, k);
+      if (k == n)
+        continue;
+      s->n = 1;
+      s->len = 0;
+      s->crc = crc24q_tbl[RTCM3PREAMB];
+    }
+
+    /* Check as much of the frame as has arrived. */
+    u32 n_crc = s->len ? s->len - 3 : 3;
+    while (s->n < n_available && s->n < n_crc) {
+      u8 b = rx_byte(rx, s->n++);
+      s->crc = ((s->crc << 8) & 0xFFFFFF) ^ crc24q_tbl[(s->crc >> 16) ^ b];
+      if (s->n == 3) {
+        /* Header complete, six reserved bits must be zero. */
+        if (rx_byte(rx, 1) & 0xFC) {
+          s->n = 0;
+          break;
+        }
+        s->len = (((rx_byte(rx, 1) & 0x03) << 8) | rx_byte(rx, 2)) + 6;
+        if (s->len > rx->len) {
+          /* Can never be held whole in this port's buffer, see usart.h. */
+          s->n = 0;
+          break;
+        }
+        n_crc = s->len - 3;
+      }
+    }
+
+    if (s->n == 0) {
+      /* Not a frame, resync after the false preamble. */
+      usart_rx_consume(rx, 1);
+      continue;
+    }
+
+    if (s->len == 0 || n_available < s->len) {
+      /* Wait for the rest of the frame. */
+      return;
+    }
+
+    u32 crc = rx_getbitu(rx, (s->len - 3) * 8, 24);
+    if (crc == s->crc) {
+      decode_rtcm3(s, rx);
+      usart_rx_consume(rx, s->len);
+    } else {
+      usart_rx_consume(rx, 1);
+    }
+    s->n = 0;
+  }
+}
+
+/** \} */
@@ -18,6 +18,15 @@
 #include <libswiftnav/track.h>
 #include <libswiftnav/ephemeris.h>
 
+#include "peripherals/usart.h"
+
+/** Build RTCM input and output in, see the build profiles in src/Makefile.
+ * Without it rtcm_setup() and rtcm_send_obs() do nothing and a port set to
+ * RTCM mode drops its input. */
+#ifndef BUILD_RTCM
+#define BUILD_RTCM 1
+#endif
+
 typedef struct {
   u32 nbyte;          /* number of bytes in message buffer */
   u32 nbit;           /* number of bits in word buffer */
@@ -26,11 +35,38 @@ typedef struct {
   gps_time_t time;
   u8 n;
   u8 prn;
-  navigation_measurement_t obs[64];
+  const navigation_measurement_t *obs;
   ephemeris_t *eph;
 } rtcm_t;
 
 int gen_rtcm3(rtcm_t *rtcm, int type, int sync);
+u32 rtcm_crc24q(const u8 *buff, u32 len, u32 crc);
+void setbitu(u8 *buff, u32 pos, u32 len, u32 data);
+void setbits(u8 *buff, u32 pos, u32 len, s32 data);
+
+/** RTCM v3 input framing state for one USART. */
+typedef struct {
+  u32 n;             /**< Bytes of the current frame checked so far, 0 while
+                          hunting for the preamble. */
+  u32 len;           /**< Total frame length including header and CRC,
+                          valid once the header has been received. */
+  u32 crc;           /**< CRC-24Q of the first n bytes of the frame. */
+  double ppr[32];    /**< Last phaserange - pseudorange per PRN (cycles),
+                          used to resolve the 1500 cycle rollover. */
+} rtcm_rx_state_t;
+
+void rtcm_process_rx(rtcm_rx_state_t *s, usart_rx_dma_state *rx);
+#if BUILD_RTCM
+void rtcm_send_obs(u8 n, gps_time_t *t, const navigation_measurement_t *nm);
+void rtcm_setup(void);
+#else
+static inline void rtcm_send_obs(u8 n, gps_time_t *t,
+                                 const navigation_measurement_t *nm)
+{
+  (void)n; (void)t; (void)nm;
+}
+static inline void rtcm_setup(void) {}
+#endif
 
 #endif
 
@@ -26,8 +26,11 @@
 #include "board/leds.h"
 #include "board/m25_flash.h"
 #include "error.h"
+#include "flash_log.h"
 #include "peripherals/usart.h"
+#include "probe.h"
 #include "sbp.h"
+#include "rtcm.h"
 #include "settings.h"
 #include "main.h"
 
@@ -47,25 +50,555 @@ sbp_state_t uarta_sbp_state;
 sbp_state_t uartb_sbp_state;
 sbp_state_t ftdi_sbp_state;
 
+/** Receive callbacks hashed by message type. The libswiftnav callback lists
+ * are left empty so sbp_process() returns SBP_OK_CALLBACK_UNDEFINED for
+ * every good frame, which is then dispatched by sbp_dispatch(). Each node is
+ * on exactly one chain, shared by all three USARTs. */
+static sbp_msg_callbacks_node_t *sbp_cbk_table[SBP_CBK_N_BUCKETS];
+
+static inline u8 sbp_cbk_hash(u16 msg_type)
+{
+  return (msg_type ^ (msg_type >> 6)) & (SBP_CBK_N_BUCKETS - 1);
+}
+
+/** Checks if the message should be sent from a particular USART. */
+static inline u32 use_usart(usart_settings_t *us, u16 msg_type)
+{
+  if (us->mode != SBP)
+    /* This USART is not in SBP mode. */
+    return 0;
+
+  if (!(us->sbp_message_mask & msg_type))
+    /* This message type is masked out on this USART. */
+    return 0;
+
+  return 1;
+}
+
+/** A framed SBP message waiting to be transmitted.
+ * One frame is shared between all the USARTs it is queued on. */
+typedef struct sbp_tx_frame_s {
+  /** Used by memory pool implementation, then to link the frame on
+   * sbp_tx_pending until the TX thread queues it. */
+  struct sbp_tx_frame_s *next;
+  u8 refs;           /**< Number of queues holding the frame. */
+  u8 prio;           /**< Transmit priority class, see sbp_tx_prio_t. */
+  u8 ports;          /**< USARTs to queue the frame on, see SBP_TX_UARTA. */
+  u16 len;           /**< Length of framed message. */
+  u8 data[SBP_FRAME_MAX_LEN]; /**< Framed message. */
+} sbp_tx_frame_t;
+
+/** Per USART transmit queue, one FIFO per priority class.
+ * Only the SBP TX thread touches the queues. */
+typedef struct {
+  usart_tx_dma_state *tx;      /**< USART to transmit on. */
+  usart_settings_t *settings;  /**< Settings for the USART. */
+  sbp_tx_frame_t *q[SBP_TX_N_PRIO][SBP_TX_QUEUE_LEN];
+  u8 rd[SBP_TX_N_PRIO];        /**< Index of oldest frame in each class. */
+  u8 n[SBP_TX_N_PRIO];         /**< Number of frames in each class. */
+  u8 n_total;                  /**< Number of frames in all classes. */
+  /** Fires at the burst phase after each solution epoch, see
+   * sbp_tx_burst_epoch(). */
+  VirtualTimer burst_vt;
+  volatile bool burst_due;     /**< The open burst is to be sent. */
+  systime_t burst_start;       /**< When the open burst was started. */
+} sbp_tx_port_t;
+
+/* Indexed the same as msg_uart_state_t uarts and the SBP_TX_UARTA etc.
+ * bits. */
+static sbp_tx_port_t sbp_tx_ports[3] = {
+  { .tx = &uarta_tx_state, .settings = &uarta_usart },
+  { .tx = &uartb_tx_state, .settings = &uartb_usart },
+  { .tx = &ftdi_tx_state,  .settings = &ftdi_usart },
+};
+#define SBP_TX_PORT_FTDI 2
+
+static MemoryPool sbp_tx_frame_pool;
+static BinarySemaphore sbp_tx_sem;
+/** Frames handed over by senders and not yet queued, newest first. Senders
+ * push with a compare and swap and the TX thread takes the whole list at
+ * once, so sending never masks interrupts or locks the kernel beyond the
+ * pool allocation. */
+static sbp_tx_frame_t * volatile sbp_tx_pending = NULL;
+/** A thread's open batch, see sbp_tx_batch_begin(). The thread's frames
+ * are held here, newest first, and only join sbp_tx_pending at the end of
+ * the batch, so other senders are woken for as usual. */
+typedef struct {
+  Thread * volatile thread;      /**< Owner, NULL if the slot is free. */
+  u32 depth;                     /**< Nesting of the owner's batches. */
+  sbp_tx_frame_t * volatile head;
+} sbp_tx_batch_t;
+static sbp_tx_batch_t sbp_tx_batches[SBP_TX_N_BATCHES];
+static bool sbp_tx_running = false;
+
+/** Output rate decimation of a message type on each USART.
+ * Messages in the table are sent on a USART only once in every `div` times,
+ * a divisor of 0 stops the message being sent on that USART at all.
+ * Messages not in the table are always sent. Messages propagated between
+ * solutions are decimated separately, see sbp_send_propagated_msg(). */
+typedef struct {
+  u16 msg_type;
+  bool propagated;   /**< Entry for propagated messages of msg_type. */
+  const char *name;  /**< Setting name in each USART's section. */
+  s16 div[3];        /**< Divisor per USART, indexed as sbp_tx_ports. */
+  s16 count[3];      /**< Messages skipped since the last one was sent. */
+} sbp_rate_t;
+
+#define SBP_RATE(type, setting, d) \
+  { .msg_type = (type), .name = (setting), .div = {(d), (d), (d)} }
+#define SBP_RATE_PROPAGATED(type, setting, d) \
+  { .msg_type = (type), .propagated = true, .name = (setting), \
+    .div = {(d), (d), (d)} }
+
+static sbp_rate_t sbp_rates[] = {
+  SBP_RATE(SBP_GPS_TIME, "gps_time_divisor", 1),
+  SBP_RATE(SBP_POS_LLH, "pos_llh_divisor", 1),
+  SBP_RATE(SBP_POS_ECEF, "pos_ecef_divisor", 1),
+  SBP_RATE(SBP_VEL_NED, "vel_ned_divisor", 1),
+  SBP_RATE(SBP_VEL_ECEF, "vel_ecef_divisor", 1),
+  SBP_RATE(SBP_BASELINE_NED, "baseline_ned_divisor", 1),
+  SBP_RATE(SBP_BASELINE_ECEF, "baseline_ecef_divisor", 1),
+  SBP_RATE(SBP_DOPS, "dops_divisor", 10),
+  SBP_RATE(MSG_IAR_STATE, "iar_state_divisor", 1),
+  SBP_RATE(MSG_TRACKING_STATE, "tracking_state_divisor", 1),
+  SBP_RATE_PROPAGATED(SBP_POS_LLH, "pos_llh_propagated_divisor", 1),
+  SBP_RATE_PROPAGATED(SBP_VEL_NED, "vel_ned_propagated_divisor", 1),
+};
+#define SBP_N_RATES (sizeof(sbp_rates) / sizeof(sbp_rates[0]))
+
+/** Apply the output rate decimation of a message type to a set of USARTs.
+ * Each entry is only used from one thread, propagated messages having
+ * entries of their own, so the counters aren't locked.
+ *
+ * \param msg_type   Message type being sent.
+ * \param propagated Message was propagated between solutions.
+ * \param ports      Bit mask of USARTs the message would be sent on.
+ * \return           Bit mask of USARTs to send the message on this time.
+ */
+static u8 sbp_rate_filter(u16 msg_type, bool propagated, u8 ports)
+{
+  for (u8 i = 0; i < SBP_N_RATES; i++) {
+    sbp_rate_t *r = &sbp_rates[i];
+    if (r->msg_type != msg_type || r->propagated != propagated)
+      continue;
+    for (u8 j = 0; j < 3; j++) {
+      if (!(ports & (1 << j)))
+        continue;
+      if (r->div[j] <= 0 || r->count[j] != 0)
+        ports &= ~(1 << j);
+      if (r->div[j] > 0 && ++r->count[j] >= r->div[j])
+        r->count[j] = 0;
+    }
+    break;
+  }
+  return ports;
+}
+
+/** Register the per USART output rate settings.
+ * Must be called after settings_setup(). */
+void sbp_rate_setup(void)
+{
+  static const char * const sections[3] = {
+    "uart_uarta", "uart_uartb", "uart_ftdi"
+  };
+  static struct setting settings[SBP_N_RATES][3];
+
+  for (u8 i = 0; i < SBP_N_RATES; i++) {
+    for (u8 j = 0; j < 3; j++) {
+      settings[i][j] = (struct setting) {
+        sections[j], sbp_rates[i].name,
+        &sbp_rates[i].div[j], sizeof(sbp_rates[i].div[j]),
+        settings_default_notify, NULL, NULL, false
+      };
+      settings_register(&settings[i][j], TYPE_INT);
+    }
+  }
+}
+
+/** Transmit priority class of a message type. */
+static u8 sbp_tx_priority(u16 msg_type)
+{
+  switch (msg_type) {
+  case SBP_GPS_TIME:
+  case SBP_POS_LLH:
+  case SBP_POS_ECEF:
+  case SBP_BASELINE_NED:
+  case SBP_BASELINE_ECEF:
+  case SBP_VEL_NED:
+  case SBP_VEL_ECEF:
+  case SBP_DOPS:
+  case MSG_NEW_OBS:
+  case MSG_PACKED_OBS:
+  case MSG_COMPACT_OBS:
+  case MSG_IAR_STATE:
+    return SBP_TX_PRIO_HIGH;
+
+  case MSG_PRINT:
+  case MSG_DEBUG_VAR:
+  case MSG_THREAD_STATE:
+  case MSG_THREAD_STATES:
+  case MSG_UART_STATE:
+  case MSG_PROBE_STATE:
+    return SBP_TX_PRIO_LOW;
+
+  default:
+    return SBP_TX_PRIO_NORMAL;
+  }
+}
+
+/** Drop a reference to a frame, freeing it when it's no longer used. */
+static void sbp_tx_frame_unref(sbp_tx_frame_t *f)
+{
+  if (--f->refs == 0)
+    chPoolFree(&sbp_tx_frame_pool, f);
+}
+
+/** Queue a frame on a USART, making space by dropping the oldest frame of
+ * the lowest priority class below the frame's own if the queue is full.
+ * \return true if the frame was queued, false if it was dropped.
+ */
+static bool sbp_tx_enqueue(sbp_tx_port_t *p, sbp_tx_frame_t *f)
+{
+  if (p->n_total == SBP_TX_QUEUE_LEN) {
+    for (u8 c = 0; c < f->prio; c++) {
+      if (p->n[c]) {
+        sbp_tx_frame_unref(p->q[c][p->rd[c]]);
+        p->rd[c] = (p->rd[c] + 1) % SBP_TX_QUEUE_LEN;
+        p->n[c]--;
+        p->n_total--;
+        break;
+      }
+    }
+    if (p->n_total == SBP_TX_QUEUE_LEN)
+      return false;
+  }
+
+  u8 c = f->prio;
+  p->q[c][(p->rd[c] + p->n[c]) % SBP_TX_QUEUE_LEN] = f;
+  p->n[c]++;
+  p->n_total++;
+  f->refs++;
+  return true;
+}
+
+/** Find the batch a thread has open.
+ * \param tp Thread to look for.
+ * \return The thread's batch slot, or NULL if it has no batch open.
+ */
+static sbp_tx_batch_t *sbp_tx_batch_find(Thread *tp)
+{
+  for (u8 i = 0; i < SBP_TX_N_BATCHES; i++)
+    if (sbp_tx_batches[i].thread == tp)
+      return &sbp_tx_batches[i];
+  return NULL;
+}
+
+/** Push a list of frames onto sbp_tx_pending and wake the TX thread.
+ * \param newest First frame of the list, newest first.
+ * \param oldest Last frame of the list, its next is overwritten.
+ */
+static void sbp_tx_hand_over(sbp_tx_frame_t *newest, sbp_tx_frame_t *oldest)
+{
+  sbp_tx_frame_t *head;
+  do {
+    head = sbp_tx_pending;
+    oldest->next = head;
+  } while (!__sync_bool_compare_and_swap(&sbp_tx_pending, head, newest));
+
+  /* The TX thread was already woken for an earlier frame on the list. */
+  if (!head)
+    chBSemSignal(&sbp_tx_sem);
+}
+
+/** Hand a newly built frame to the TX thread.
+ * Takes ownership of the frame. Low priority frames can't displace anything
+ * so are dropped here if all their USART queues are full, letting senders
+ * such as the correlation trace back off. The check reads the queue lengths
+ * without a lock, a frame that gets past it is still dropped by the TX
+ * thread if there turns out to be no room. A frame from a thread with a
+ * batch open is held until the thread calls sbp_tx_batch_end().
+ * \param f     Frame allocated from sbp_tx_frame_pool.
+ * \param ports Bit mask of USARTs to queue the frame on.
+ * \return Number of USARTs the frame was dropped for.
+ */
+static u32 sbp_tx_queue(sbp_tx_frame_t *f, u8 ports)
+{
+  u32 n_dropped = 0;
+
+  if (f->prio == SBP_TX_PRIO_LOW) {
+    for (u8 i = 0; i < 3; i++) {
+      if ((ports & (1 << i)) &&
+          sbp_tx_ports[i].n_total == SBP_TX_QUEUE_LEN) {
+        ports &= ~(1 << i);
+        n_dropped++;
+      }
+    }
+    if (!ports) {
+      chPoolFree(&sbp_tx_frame_pool, f);
+      return n_dropped;
+    }
+  }
+  f->ports = ports;
+
+  sbp_tx_batch_t *b = sbp_tx_batch_find(chThdSelf());
+  if (b) {
+    sbp_tx_frame_t *head;
+    do {
+      head = b->head;
+      f->next = head;
+    } while (!__sync_bool_compare_and_swap(&b->head, head, f));
+  } else {
+    sbp_tx_hand_over(f, f);
+  }
+
+  return n_dropped;
+}
+
+/** Start a burst of messages that should go out together.
+ * Messages the calling thread sends are held back until the matching
+ * sbp_tx_batch_end(), so the TX thread picks the whole burst up at once and
+ * writes it on each USART in a single DMA transfer. Only the caller's own
+ * messages are held, other threads' are sent as usual. Batches may nest and
+ * may be open in up to SBP_TX_N_BATCHES threads at the same time, beyond
+ * that messages are sent unbatched.
+ */
+void sbp_tx_batch_begin(void)
+{
+  Thread *self = chThdSelf();
+  sbp_tx_batch_t *b = sbp_tx_batch_find(self);
+  if (b) {
+    b->depth++;
+    return;
+  }
+  for (u8 i = 0; i < SBP_TX_N_BATCHES; i++) {
+    b = &sbp_tx_batches[i];
+    if (__sync_bool_compare_and_swap(&b->thread, NULL, self)) {
+      b->depth = 1;
+      return;
+    }
+  }
+}
+
+/** End a burst started by sbp_tx_batch_begin(), handing the caller's held
+ * messages to the TX thread. */
+void sbp_tx_batch_end(void)
+{
+  sbp_tx_batch_t *b = sbp_tx_batch_find(chThdSelf());
+  if (!b || --b->depth > 0)
+    return;
+
+  sbp_tx_frame_t *newest = __sync_lock_test_and_set(&b->head, NULL);
+  b->thread = NULL;
+  if (!newest)
+    return;
+
+  sbp_tx_frame_t *oldest = newest;
+  while (oldest->next)
+    oldest = oldest->next;
+  sbp_tx_hand_over(newest, oldest);
+}
+
+/** Move the frames handed over by senders onto the USART queues, oldest
+ * first. */
+static void sbp_tx_collect(void)
+{
+  sbp_tx_frame_t *f = __sync_lock_test_and_set(&sbp_tx_pending, NULL);
+
+  /* The list is newest first, reverse it to keep the send order. */
+  sbp_tx_frame_t *oldest = NULL;
+  while (f) {
+    sbp_tx_frame_t *next = f->next;
+    f->next = oldest;
+    oldest = f;
+    f = next;
+  }
+
+  for (f = oldest; f; f = oldest) {
+    oldest = f->next;
+    f->refs = 1;
+    for (u8 i = 0; i < 3; i++)
+      if (f->ports & (1 << i))
+        sbp_tx_enqueue(&sbp_tx_ports[i], f);
+    sbp_tx_frame_unref(f);
+  }
+}
+
+/** Write out as many queued frames as fit in a USART's DMA buffer, highest
+ * priority first.
+ * \param p        USART to write to.
+ * \param min_prio Lowest priority class to take frames from.
+ * \param limit    Most bytes to leave in an open USART batch, a frame that
+ *                 would take it over is left queued.
+ */
+static void sbp_tx_drain(sbp_tx_port_t *p, u8 min_prio, u32 limit)
+{
+  while (TRUE) {
+    /* Find the oldest frame in the highest priority class. */
+    sbp_tx_frame_t *f = NULL;
+    u8 c = SBP_TX_N_PRIO;
+    while (c-- > min_prio) {
+      if (p->n[c]) {
+        f = p->q[c][p->rd[c]];
+        break;
+      }
+    }
+
+    if (!f)
+      return;
+
+    if (p->tx->batch_len && p->tx->batch_len + f->len > limit)
+      /* Full, the frame waits for the next batch. */
+      return;
+
+    /* This thread is the only writer to the USART DMA buffers so the frame
+     * is copied in with interrupts enabled. */
+    if (!usart_write_dma(p->tx, f->data, f->len))
+      /* No space in the DMA buffer, try again once some has been sent. */
+      return;
+
+    p->rd[c] = (p->rd[c] + 1) % SBP_TX_QUEUE_LEN;
+    p->n[c]--;
+    p->n_total--;
+    sbp_tx_frame_unref(f);
+  }
+}
+
+/** Whether a USART gathers its SBP traffic into bursts. */
+static bool sbp_tx_burst_enabled(sbp_tx_port_t *p)
+{
+  return p->settings->burst && p->settings->mode == SBP;
+}
+
+/** Burst phase timer callback, called from the system tick ISR with the
+ * kernel locked. */
+static void sbp_tx_burst_due(void *arg)
+{
+  ((sbp_tx_port_t *)arg)->burst_due = true;
+  chBSemSignalI(&sbp_tx_sem);
+}
+
+/** Mark a solution epoch, the USARTs in burst mode send their bursts at
+ * their `burst_phase` after it. Called from the solution thread when it
+ * wakes for an epoch.
+ *
+ * In burst mode a USART's traffic is held in its DMA buffer as one USART
+ * batch rather than being written out as it arrives. Solution and
+ * observation messages join the batch straight away, debug and diagnostic
+ * messages only once the burst is due and then only into the space left.
+ * The burst is limited to `burst_packets` radio packets of
+ * `burst_packet_size` bytes, anything more waits for the next epoch (or is
+ * dropped by priority if the queue fills), so the telemetry radio gets one
+ * contiguous write it can send as a few full packets instead of many short
+ * ones split up by the gaps between messages.
+ */
+void sbp_tx_burst_epoch(void)
+{
+  chSysLock();
+  for (u8 i = 0; i < 3; i++) {
+    sbp_tx_port_t *p = &sbp_tx_ports[i];
+    /* An epoch before the last burst went out doesn't move it. */
+    if (sbp_tx_burst_enabled(p) && !chVTIsArmedI(&p->burst_vt))
+      chVTSetI(&p->burst_vt, MAX(MS2ST(p->settings->burst_phase), 1),
+               sbp_tx_burst_due, p);
+  }
+  chSysUnlock();
+}
+
+/** Add a USART's queued frames to its burst, sending the burst if due. */
+static void sbp_tx_burst(sbp_tx_port_t *p)
+{
+  usart_tx_dma_state *tx = p->tx;
+  u32 len = MAX((u32)p->settings->burst_packet_size *
+                p->settings->burst_packets, SBP_FRAME_MAX_LEN);
+
+  /* The batch is also closed if the USART is set up again. */
+  if (!tx->batch) {
+    usart_tx_batch_begin(tx);
+    p->burst_start = chTimeNow();
+  }
+
+  /* Without solution epochs the burst goes out on a timeout instead. */
+  bool due = p->burst_due ||
+             chTimeNow() - p->burst_start >= MS2ST(SBP_TX_BURST_TIMEOUT);
+
+  sbp_tx_drain(p, due ? SBP_TX_PRIO_LOW : SBP_TX_PRIO_NORMAL, len);
+
+  if (due) {
+    p->burst_due = false;
+    usart_tx_batch_end(tx);
+  }
+}
+
+static WORKING_AREA_CCM(wa_sbp_tx_thread, 512);
+static msg_t sbp_tx_thread(void *arg)
+{
+  (void)arg;
+  chRegSetThreadName("SBP TX");
+  while (TRUE) {
+    /* Woken when a frame is queued, otherwise poll for space freed up in the
+     * DMA buffers. */
+    chBSemWaitTimeout(&sbp_tx_sem, MS2ST(10));
+
+    sbp_tx_collect();
+    for (u8 i = 0; i < 3; i++) {
+      if (sbp_tx_burst_enabled(&sbp_tx_ports[i])) {
+        sbp_tx_burst(&sbp_tx_ports[i]);
+      } else {
+        /* Everything collected goes out in one DMA transfer per USART,
+         * including a burst left open when burst mode was turned off. */
+        usart_tx_batch_begin(sbp_tx_ports[i].tx);
+        sbp_tx_drain(&sbp_tx_ports[i], 0, UINT32_MAX);
+        usart_tx_batch_end(sbp_tx_ports[i].tx);
+      }
+      /* A port held by the radio setup has no DMA buffer yet. */
+      if (sbp_tx_ports[i].tx->len > 1)
+        uart_state_msg.uarts[i].tx_buffer_level = MAX(uart_state_msg.uarts[i].tx_buffer_level,
+            255 - (255 * usart_tx_n_free(sbp_tx_ports[i].tx)) / (sbp_tx_ports[i].tx->len - 1));
+    }
+  }
+
+  return 0;
+}
+
+/* RX event per USART, indexed the same as msg_uart_state_t uarts. */
+#define SBP_RX_EVENT(i) EVENT_MASK(i)
+
+static void sbp_process_port(u8 i);
+
 static WORKING_AREA_CCM(wa_sbp_thread, 4096);
 static msg_t sbp_thread(void *arg)
 {
   (void)arg;
   chRegSetThreadName("SBP");
+
+  usart_rx_dma_notify(&uarta_rx_state, chThdSelf(), SBP_RX_EVENT(0));
+  usart_rx_dma_notify(&uartb_rx_state, chThdSelf(), SBP_RX_EVENT(1));
+  usart_rx_dma_notify(&ftdi_rx_state, chThdSelf(), SBP_RX_EVENT(2));
+
+  systime_t last_uart_state = chTimeNow();
+
   while (TRUE) {
-    chThdSleepMilliseconds(50);
-    sbp_process_messages();
-
-    DO_EVERY(50,
-        sbp_send_msg(MSG_UART_STATE, sizeof(msg_uart_state_t),
-                     (u8*)&uart_state_msg);
-        uart_state_msg.uarts[0].tx_buffer_level = 0;
-        uart_state_msg.uarts[0].rx_buffer_level = 0;
-        uart_state_msg.uarts[1].tx_buffer_level = 0;
-        uart_state_msg.uarts[1].rx_buffer_level = 0;
-        uart_state_msg.uarts[2].tx_buffer_level = 0;
-        uart_state_msg.uarts[2].rx_buffer_level = 0;
-    );
+    /* Woken by the USART RX interrupts as soon as data has arrived, the
+     * timeout is just a backstop. */
+    eventmask_t events = chEvtWaitAnyTimeout(ALL_EVENTS, MS2ST(50));
+    if (events == 0)
+      events = ALL_EVENTS;
+
+    for (u8 i = 0; i < 3; i++)
+      if (events & SBP_RX_EVENT(i))
+        sbp_process_port(i);
+
+    if (chTimeNow() - last_uart_state >= MS2ST(2500)) {
+      last_uart_state = chTimeNow();
+      sbp_send_msg(MSG_UART_STATE, sizeof(msg_uart_state_t),
+                   (u8*)&uart_state_msg);
+      uart_state_msg.uarts[0].tx_buffer_level = 0;
+      uart_state_msg.uarts[0].rx_buffer_level = 0;
+      uart_state_msg.uarts[1].tx_buffer_level = 0;
+      uart_state_msg.uarts[1].rx_buffer_level = 0;
+      uart_state_msg.uarts[2].tx_buffer_level = 0;
+      uart_state_msg.uarts[2].rx_buffer_level = 0;
+    }
   }
 
   return 0;
@@ -90,53 +623,80 @@ void sbp_setup(u16 sender_id)
   /*setvbuf(stdin, NULL, _IONBF, 0);*/
   /*setvbuf(stdout, NULL, _IONBF, 0);*/
 
+  /* Enough frames for every transmit queue to be full while others are
+   * still being framed. */
+  static sbp_tx_frame_t sbp_tx_frame_buff[3*SBP_TX_QUEUE_LEN + SBP_TX_N_BUILDING] _CCM;
+  chPoolInit(&sbp_tx_frame_pool, sizeof(sbp_tx_frame_t), NULL);
+  chPoolLoadArray(&sbp_tx_frame_pool, sbp_tx_frame_buff,
+                  3*SBP_TX_QUEUE_LEN + SBP_TX_N_BUILDING);
+  chBSemInit(&sbp_tx_sem, TRUE);
+
+  chThdCreateStatic(wa_sbp_tx_thread, sizeof(wa_sbp_tx_thread),
+                    HIGHPRIO-2, sbp_tx_thread, NULL);
+  sbp_tx_running = true;
+
   chThdCreateStatic(wa_sbp_thread, sizeof(wa_sbp_thread),
                     HIGHPRIO-22, sbp_thread, NULL);
 }
 
-void sbp_register_cbk(u16 msg_type, sbp_msg_callback_t cb, sbp_msg_callbacks_node_t *node)
+/** Set the sender ID outgoing messages are sent with.
+ * Until it is set messages are sent with sender ID 0 and so only on the FTDI
+ * USART.
+ * \param sender_id Sender ID to use
+ */
+void sbp_set_sender_id(u16 sender_id)
 {
-  sbp_register_callback(&uarta_sbp_state, msg_type, cb, 0, node);
-  sbp_register_callback(&uartb_sbp_state, msg_type, cb, 0, node);
-  sbp_register_callback(&ftdi_sbp_state , msg_type, cb, 0, node);
-
+  my_sender_id = sender_id;
 }
 
-/** Disable the SBP interface.
- * Disables the USART peripherals and DMA streams enabled by sbp_setup(). */
-void sbp_disable()
+/** Register a callback for a received message type.
+ * Only one callback can be registered per message type.
+ *
+ * \param msg_type Message type to call `cb` for.
+ * \param cb       Callback, called from the SBP thread.
+ * \param node     Storage for the table entry, must stay valid.
+ */
+void sbp_register_cbk(u16 msg_type, sbp_msg_callback_t cb, sbp_msg_callbacks_node_t *node)
 {
-  usarts_disable();
-}
+  u8 b = sbp_cbk_hash(msg_type);
 
-/** Checks if the message should be sent from a particular USART. */
-static inline u32 use_usart(usart_settings_t *us, u16 msg_type)
-{
-  if (us->mode != SBP)
-    /* This USART is not in SBP mode. */
-    return 0;
+  for (sbp_msg_callbacks_node_t *n = sbp_cbk_table[b]; n; n = n->next) {
+    if (n->msg_type == msg_type) {
+      printf("SBP callback for 0x%04X already registered\n", msg_type);
+      return;
+    }
+  }
 
-  if (!(us->sbp_message_mask & msg_type))
-    /* This message type is masked out on this USART. */
-    return 0;
+  node->msg_type = msg_type;
+  node->cb = cb;
+  node->context = 0;
 
-  return 1;
+  /* Fill in the node before it becomes visible to the SBP thread. */
+  chSysLock();
+  node->next = sbp_cbk_table[b];
+  sbp_cbk_table[b] = node;
+  chSysUnlock();
 }
 
-u32 uarta_write(u8 *buff, u32 n, void *context)
-{
-  (void)context;
-  return usart_write_dma(&uarta_tx_state, buff, n);
-}
-u32 uartb_write(u8 *buff, u32 n, void *context)
+/** Call the registered callback for the frame just decoded by a state.
+ * \param s SBP state sbp_process() returned SBP_OK_CALLBACK_UNDEFINED for.
+ */
+static void sbp_dispatch(sbp_state_t *s)
 {
-  (void)context;
-  return usart_write_dma(&uartb_tx_state, buff, n);
+  for (sbp_msg_callbacks_node_t *n = sbp_cbk_table[sbp_cbk_hash(s->msg_type)];
+       n; n = n->next) {
+    if (n->msg_type == s->msg_type) {
+      n->cb(s->sender_id, s->msg_len, s->msg_buff, n->context);
+      return;
+    }
+  }
 }
-u32 ftdi_write(u8 *buff, u32 n, void *context)
+
+/** Disable the SBP interface.
+ * Disables the USART peripherals and DMA streams enabled by sbp_setup(). */
+void sbp_disable()
 {
-  (void)context;
-  return usart_write_dma(&ftdi_tx_state, buff, n);
+  usarts_disable();
 }
 
 /** Send a SBP message out over all applicable USARTs
@@ -152,47 +712,161 @@ u32 sbp_send_msg(u16 msg_type, u8 len, u8 buff[])
   return sbp_send_msg_(msg_type, len, buff, my_sender_id);
 }
 
+static PROBE_DECL(probe_sbp_send, "sbp_send_msg");
+
+static u32 sbp_send_msg_rated(u16 msg_type, u8 len, u8 buff[], u16 sender_id,
+                              bool propagated);
+static u32 sbp_send_msg_frame(u16 msg_type, u8 len, u8 buff[], u16 sender_id,
+                              bool propagated);
+static u32 sbp_frame_queue(u8 ports, u16 msg_type, u8 len, u8 buff[],
+                           u16 sender_id);
+
+/** Queue a SBP message for transmission on all applicable USARTs.
+ * The message is framed once and the frame shared between the USART
+ * transmit queues, which are drained by the SBP TX thread in priority order.
+ *
+ * \param msg_type  Message ID
+ * \param len       Length of message data
+ * \param buff      Pointer to message data array
+ * \param sender_id Sender ID to send the message with
+ *
+ * \return          0 if handed to the TX thread for all applicable USARTs,
+ *                  otherwise the number of USARTs the message was dropped
+ *                  for
+ */
 u32 sbp_send_msg_(u16 msg_type, u8 len, u8 buff[], u16 sender_id)
 {
-  /* Global interrupt disable to avoid concurrency/reentrancy problems. */
-  __asm__("CPSID i;");
+  return sbp_send_msg_rated(msg_type, len, buff, sender_id, false);
+}
 
-  u16 ret = 0;
+/** Send a position or velocity message propagated between solutions.
+ * The same as sbp_send_msg() but decimated by the message type's
+ * `*_propagated_divisor` settings rather than the ones for messages from
+ * solutions, so that the two don't share rate counters across threads.
+ *
+ * \param msg_type Message ID
+ * \param len      Length of message data
+ * \param buff     Pointer to message data array
+ *
+ * \return         Error code, as sbp_send_msg_()
+ */
+u32 sbp_send_propagated_msg(u16 msg_type, u8 len, u8 buff[])
+{
+  return sbp_send_msg_rated(msg_type, len, buff, my_sender_id, true);
+}
 
-  /* Only send relayed messages (sender_id 0) on the FTDI UART. */
-  if (sender_id != 0) {
+static u32 sbp_send_msg_rated(u16 msg_type, u8 len, u8 buff[], u16 sender_id,
+                              bool propagated)
+{
+  u32 t0 = probe_now();
+  if (sender_id != 0)
+    flash_log_msg(msg_type, len, buff);
+  u32 ret = sbp_send_msg_frame(msg_type, len, buff, sender_id, propagated);
+  probe_end(&probe_sbp_send, t0);
+  return ret;
+}
 
-    if (use_usart(&uarta_usart, msg_type))
-      ret |= sbp_send_message(&uarta_sbp_state, msg_type, sender_id,
-                              len, buff, &uarta_write);
+static u32 sbp_send_msg_frame(u16 msg_type, u8 len, u8 buff[], u16 sender_id,
+                              bool propagated)
+{
+  if (!sbp_tx_running)
+    return 1;
+
+  u8 ports = 0;
+  for (u8 i = 0; i < 3; i++) {
+    /* Only send relayed messages (sender_id 0) on the FTDI UART. */
+    if (sender_id == 0 && i != SBP_TX_PORT_FTDI)
+      continue;
+    if (use_usart(sbp_tx_ports[i].settings, msg_type))
+      ports |= 1 << i;
+  }
 
-    uart_state_msg.uarts[0].tx_buffer_level = MAX(uart_state_msg.uarts[0].tx_buffer_level,
-        255 - (255 * usart_tx_n_free(&uarta_tx_state)) / (USART_TX_BUFFER_LEN-1));
+  /* Decimate before framing so skipped messages cost nothing. */
+  ports = sbp_rate_filter(msg_type, propagated, ports);
+  if (!ports)
+    return 0;
 
-    if (use_usart(&uartb_usart, msg_type))
-      ret |= sbp_send_message(&uartb_sbp_state, msg_type, sender_id,
-                              len, buff, &uartb_write);
+  return sbp_frame_queue(ports, msg_type, len, buff, sender_id);
+}
 
-    uart_state_msg.uarts[1].tx_buffer_level = MAX(uart_state_msg.uarts[1].tx_buffer_level,
-        255 - (255 * usart_tx_n_free(&uartb_tx_state)) / (USART_TX_BUFFER_LEN-1));
+/** Relay a message received from another device to the host.
+ * Relayed messages are only sent on the FTDI USART, with sender ID 0 so
+ * that they aren't mistaken for our own. The payload is framed straight
+ * from the receive buffer into a transmit frame without the port selection
+ * and decimation of sbp_send_msg(), relays are forwarded as they arrive.
+ *
+ * \param msg_type Message ID
+ * \param len      Length of message data
+ * \param buff     Pointer to message data array
+ *
+ * \return         0 if queued, 1 if dropped
+ */
+u32 sbp_relay_msg(u16 msg_type, u8 len, u8 buff[])
+{
+  if (!sbp_tx_running ||
+      !use_usart(sbp_tx_ports[SBP_TX_PORT_FTDI].settings, msg_type))
+    return 0;
 
-  }
+  return sbp_frame_queue(1 << SBP_TX_PORT_FTDI, msg_type, len, buff, 0);
+}
 
-  if (use_usart(&ftdi_usart, msg_type))
-    ret |= sbp_send_message(&ftdi_sbp_state, msg_type, sender_id,
-                            len, buff, &ftdi_write);
+/** Frame a message and queue it on a set of USARTs.
+ * \return 0 if queued on all the USARTs, otherwise the number of USARTs the
+ *         message was dropped for
+ */
+static u32 sbp_frame_queue(u8 ports, u16 msg_type, u8 len, u8 buff[],
+                           u16 sender_id)
+{
+  sbp_tx_frame_t *f = chPoolAlloc(&sbp_tx_frame_pool);
+  if (!f)
+    return 1;
+
+  f->prio = sbp_tx_priority(msg_type);
+
+  f->data[0] = SBP_PREAMBLE;
+  f->data[1] = msg_type & 0xFF;
+  f->data[2] = msg_type >> 8;
+  f->data[3] = sender_id & 0xFF;
+  f->data[4] = sender_id >> 8;
+  f->data[5] = len;
+  memcpy(&f->data[6], buff, len);
+  u16 crc = crc16_ccitt(&f->data[1], 5 + len, 0);
+  f->data[6 + len] = crc & 0xFF;
+  f->data[7 + len] = crc >> 8;
+  f->len = 8 + len;
+
+  return sbp_tx_queue(f, ports);
+}
 
-  uart_state_msg.uarts[2].tx_buffer_level = MAX(uart_state_msg.uarts[2].tx_buffer_level,
-      255 - (255 * usart_tx_n_free(&ftdi_tx_state)) / (USART_TX_BUFFER_LEN-1));
+/** Queue raw bytes for transmission on a set of USARTs.
+ * Used for non-SBP output, e.g. NMEA, so that the SBP TX thread remains the
+ * only writer to the USART DMA buffers.
+ *
+ * \param ports Bit mask of USARTs to send on, see SBP_TX_UARTA etc.
+ * \param prio  Transmit priority class, see sbp_tx_prio_t.
+ * \param data  Data to send.
+ * \param len   Length of data, at most SBP_FRAME_MAX_LEN.
+ *
+ * \return      0 if queued on all the USARTs, otherwise the number of
+ *              USARTs the data was dropped for
+ */
+u32 sbp_tx_raw(u8 ports, u8 prio, const u8 data[], u16 len)
+{
+  if (!ports)
+    return 0;
 
-  if (ret != 3*len) {
-    /* Return error if any sbp_send_message failed. */
-    __asm__("CPSIE i;");  /* Re-enable interrupts */
-    return ret;
-  }
+  if (!sbp_tx_running || len > SBP_FRAME_MAX_LEN)
+    return 1;
 
-  __asm__("CPSIE i;");  // Re-enable interrupts
-  return 0;
+  sbp_tx_frame_t *f = chPoolAlloc(&sbp_tx_frame_pool);
+  if (!f)
+    return 1;
+
+  f->prio = prio;
+  memcpy(f->data, data, len);
+  f->len = len;
+
+  return sbp_tx_queue(f, ports);
 }
 
 u32 uarta_read(u8 *buff, u32 n, void *context)
@@ -211,40 +885,57 @@ u32 ftdi_read(u8 *buff, u32 n, void *context)
   return usart_read_dma(&ftdi_rx_state, buff, n);
 }
 
-/** Process SBP messages received through the USARTs.
- * This function should be called periodically to clear the USART DMA RX
- * buffers and handle the SBP callbacks in them.
+/** Process SBP messages received through one USART.
+ * \param i USART index, the same as msg_uart_state_t uarts.
  */
-void sbp_process_messages()
+static void sbp_process_port(u8 i)
 {
+  static sbp_state_t * const sbp_states[3] = {
+    &uarta_sbp_state, &uartb_sbp_state, &ftdi_sbp_state
+  };
+  static usart_rx_dma_state * const rx_states[3] = {
+    &uarta_rx_state, &uartb_rx_state, &ftdi_rx_state
+  };
+  static u32 (* const reads[3])(u8 *buff, u32 n, void *context) = {
+    &uarta_read, &uartb_read, &ftdi_read
+  };
   s8 ret;
 
-  uart_state_msg.uarts[0].rx_buffer_level = MAX(uart_state_msg.uarts[0].rx_buffer_level,
-      (255 * usart_n_read_dma(&uarta_rx_state)) / USART_RX_BUFFER_LEN);
-
-  while (usart_n_read_dma(&uarta_rx_state) > 0) {
-    ret = sbp_process(&uarta_sbp_state, &uarta_read);
-    if (ret == SBP_CRC_ERROR)
-      uart_state_msg.uarts[0].crc_error_count++;
+  /* The port's DMA hasn't been set up, e.g. it is held by the radio setup,
+   * there is nothing to read. */
+  if (rx_states[i]->len == 0)
+    return;
+
+  uart_state_msg.uarts[i].rx_buffer_level = MAX(uart_state_msg.uarts[i].rx_buffer_level,
+      (255 * usart_n_read_dma(rx_states[i])) / rx_states[i]->len);
+
+  if (sbp_tx_ports[i].settings->mode == RTCM) {
+#if BUILD_RTCM
+    static rtcm_rx_state_t rtcm_states[3];
+    rtcm_process_rx(&rtcm_states[i], rx_states[i]);
+#else
+    usart_rx_consume(rx_states[i], usart_n_read_dma(rx_states[i]));
+#endif
+    return;
   }
 
-  uart_state_msg.uarts[1].rx_buffer_level = MAX(uart_state_msg.uarts[1].rx_buffer_level,
-      (255 * usart_n_read_dma(&uartb_rx_state)) / USART_RX_BUFFER_LEN);
-
-  while (usart_n_read_dma(&uartb_rx_state) > 0) {
-    ret = sbp_process(&uartb_sbp_state, &uartb_read);
-    if (ret == SBP_CRC_ERROR)
-      uart_state_msg.uarts[1].crc_error_count++;
+  while (usart_n_read_dma(rx_states[i]) > 0) {
+    ret = sbp_process(sbp_states[i], reads[i]);
+    if (ret == SBP_OK_CALLBACK_UNDEFINED)
+      sbp_dispatch(sbp_states[i]);
+    else if (ret == SBP_CRC_ERROR)
+      uart_state_msg.uarts[i].crc_error_count++;
   }
+}
 
-  uart_state_msg.uarts[2].rx_buffer_level = MAX(uart_state_msg.uarts[2].rx_buffer_level,
-      (255 * usart_n_read_dma(&ftdi_rx_state)) / USART_RX_BUFFER_LEN);
-
-  while (usart_n_read_dma(&ftdi_rx_state) > 0) {
-    ret = sbp_process(&ftdi_sbp_state, &ftdi_read);
-    if (ret == SBP_CRC_ERROR)
-      uart_state_msg.uarts[2].crc_error_count++;
-  }
+/** Process SBP messages received through the USARTs.
+ * Clears the USART DMA RX buffers and handles the SBP callbacks in them. The
+ * SBP thread calls this for each USART as soon as data arrives.
+ */
+void sbp_process_messages()
+{
+  for (u8 i = 0; i < 3; i++)
+    sbp_process_port(i);
 }
 
 /** Directs printf's output to the SBP interface */
@@ -258,7 +949,7 @@ int _write(int file, char *ptr, int len)
 
   case 22:
     if (len > 255) len = 255;   /* Send maximum of 255 chars at a time */
-    usart_write_dma(&ftdi_tx_state, (u8 *)ptr, len);
+    sbp_tx_raw(SBP_TX_FTDI, SBP_TX_PRIO_LOW, (u8 *)ptr, len);
     return len;
 
   default:
@@ -267,14 +958,20 @@ int _write(int file, char *ptr, int len)
   }
 }
 
+/** Send the value of a variable to the host in a MSG_DEBUG_VAR.
+ * For variables updated in a loop prefer debug_var_set(), which batches
+ * them.
+ *
+ * \param name Name of the variable, truncated to DEBUG_VAR_NAME_LEN.
+ * \param x    Value to send.
+ */
 void debug_variable(char *name, double x)
 {
-  u8 sl = strlen(name);
-  u8* buff = malloc(sl + sizeof(double));
+  u8 buff[sizeof(double) + DEBUG_VAR_NAME_LEN];
+  u8 sl = MIN(strlen(name), DEBUG_VAR_NAME_LEN);
   memcpy(buff, &x, sizeof(double));
-  memcpy(&buff[8], name, sl);
+  memcpy(&buff[sizeof(double)], name, sl);
   sbp_send_msg(MSG_DEBUG_VAR, sl + sizeof(double), buff);
-  free(buff);
 }
 
 /** \} */
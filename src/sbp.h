@@ -20,11 +20,62 @@
 #include "peripherals/usart.h"
 #include "sbp_piksi.h"
 
+/** \addtogroup sbp
+ * \{ */
+
+/** Transmit priority classes, when a USART transmit queue is full frames in
+ * the lowest class are dropped first. */
+typedef enum {
+  SBP_TX_PRIO_LOW = 0, /**< Debug prints and diagnostics. */
+  SBP_TX_PRIO_NORMAL,  /**< Everything not otherwise classified. */
+  SBP_TX_PRIO_HIGH,    /**< Solutions and observations. */
+  SBP_TX_N_PRIO
+} sbp_tx_prio_t;
+
+/** USART bit masks for sbp_tx_raw(). */
+#define SBP_TX_UARTA (1 << 0)
+#define SBP_TX_UARTB (1 << 1)
+#define SBP_TX_FTDI  (1 << 2)
+
+/** Maximum number of frames queued for transmission on each USART. */
+#define SBP_TX_QUEUE_LEN 8
+/** Number of frames that may be being framed by senders at the same time,
+ * before being queued. */
+#define SBP_TX_N_BUILDING 4
+/** Number of threads that may have a batch open at the same time, see
+ * sbp_tx_batch_begin(). */
+#define SBP_TX_N_BATCHES 4
+/** Maximum length of a framed SBP message: preamble, type, sender, length,
+ * payload and CRC. */
+#define SBP_FRAME_MAX_LEN (1 + 2 + 2 + 1 + 255 + 2)
+
+/** Longest a burst is held open without a solution epoch to send it, see
+ * sbp_tx_burst_epoch(). (ms) */
+#define SBP_TX_BURST_TIMEOUT 1000
+
+/** Number of buckets in the receive callback table, a power of two. */
+#define SBP_CBK_N_BUCKETS 64
+
+/** Longest name sent by debug_variable(). */
+#define DEBUG_VAR_NAME_LEN 64
+
+/** \} */
+
+extern msg_uart_state_t uart_state_msg;
+
 void sbp_setup(u16 sender_id);
+void sbp_set_sender_id(u16 sender_id);
+void sbp_rate_setup(void);
 void sbp_register_cbk(u16 msg_type, sbp_msg_callback_t cb, sbp_msg_callbacks_node_t *node);
 void sbp_disable(void);
 u32 sbp_send_msg(u16 msg_type, u8 len, u8 buff[]);
 u32 sbp_send_msg_(u16 msg_type, u8 len, u8 buff[], u16 sender_id);
+u32 sbp_send_propagated_msg(u16 msg_type, u8 len, u8 buff[]);
+u32 sbp_relay_msg(u16 msg_type, u8 len, u8 buff[]);
+u32 sbp_tx_raw(u8 ports, u8 prio, const u8 data[], u16 len);
+void sbp_tx_batch_begin(void);
+void sbp_tx_batch_end(void);
+void sbp_tx_burst_epoch(void);
 void sbp_process_messages(void);
 
 void debug_variable(char *name, double x);
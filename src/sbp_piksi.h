@@ -13,6 +13,8 @@
 #ifndef SWIFTNAV_SBP_PIKSI_H
 #define SWIFTNAV_SBP_PIKSI_H
 
+#include <libswiftnav/almanac.h>
+#include <libswiftnav/ephemeris.h>
 #include <libswiftnav/gpstime.h>
 
 /** \addtogroup sbp
@@ -37,6 +39,7 @@
 
 #define MSG_CW_START                0xC1  /**< Host   -> Piksi */
 #define MSG_CW_RESULTS              0xC0  /**< Piksi  -> Host  */
+#define MSG_CW_SPECTRUM             0xC2  /**< Piksi  -> Host  */
 
 #define MSG_NAP_DEVICE_DNA          0xDD  /**< Host  <-> Piksi */
 
@@ -44,6 +47,20 @@
 #define MSG_FLASH_DONE              0xE0  /**< Piksi  -> Host  */
 #define MSG_FLASH_READ              0xE1  /**< Host  <-> Piksi */
 #define MSG_FLASH_ERASE             0xE2  /**< Host   -> Piksi */
+#define MSG_FLASH_PROGRAM_STREAM    0xE6  /**< Host   -> Piksi */
+#define MSG_FLASH_STREAM_ACK        0xE7  /**< Piksi  -> Host  */
+
+/** Start a download of the on-board log, see flash_log.h. */
+#define MSG_FLASH_LOG_READ          0xE8  /**< Host   -> Piksi */
+/** Part of a page of the on-board log, sent oldest first. A message with
+ * no data ends the download. */
+#define MSG_FLASH_LOG_DATA          0xE9  /**< Piksi  -> Host  */
+typedef struct __attribute__((packed)) {
+  u32 addr;      /**< M25 flash address the data was read from. */
+  u8 data[128];  /**< Up to FLASH_LOG_READ_CHUNK_LEN bytes of the page. */
+} msg_flash_log_data_t;
+/** Erase the on-board log and start it again. */
+#define MSG_FLASH_LOG_ERASE         0xEA  /**< Host   -> Piksi */
 
 #define MSG_STM_UNIQUE_ID           0xE5  /**< Host  <-> Piksi */
 
@@ -58,6 +75,7 @@
 #define MSG_SETTINGS                0xA0  /**< Host  <-> Piksi */
 #define MSG_SETTINGS_SAVE           0xA1  /**< Host   -> Piksi */
 #define MSG_SETTINGS_READ_BY_INDEX  0xA2  /**< Host   -> Piksi */
+#define MSG_SETTINGS_READ_BULK      0xA3  /**< Host  <-> Piksi */
 
 #define MSG_SIMULATION_ENABLED      0xAA  /**< Host  <-> Piksi */
 
@@ -77,7 +95,125 @@ typedef struct __attribute__((packed)) {
   u8 prn;        /**< Satellite number. */
 } msg_obs_t;
 
+/** Observations of one epoch split over several messages, each record coded
+ * either in full or as a delta from the record for the same PRN in the
+ * previous epoch. See packed_obs.c. */
+#define MSG_PACKED_OBS              0x43  /**< Piksi  -> Host  */
+typedef struct __attribute__((packed)) {
+  gps_time_t t; /**< GPS time of observation. */
+  u8 count;     /**< Epoch counter, delta records are relative to count-1. */
+  u8 seq;       /**< Number of parts in the epoch in the upper nibble,
+                     index of this part in the lower nibble. */
+} msg_packed_obs_hdr_t;
+
+/** Set in the prn field of a delta record. */
+#define PACKED_OBS_DELTA      0x80
+/** Units of the coded pseudorange fields. (m) */
+#define PACKED_OBS_P_UNITS    0.02
+/** Carrier phase fields are in 1/PACKED_OBS_L_SCALE cycles. */
+#define PACKED_OBS_L_SCALE    256
+/** Units of the coded SNR, offset by 128. (dB) */
+#define PACKED_OBS_SNR_UNITS  0.5
+
+typedef struct __attribute__((packed)) {
+  u8 prn;        /**< Satellite number. */
+  u8 snr;        /**< Signal-to-Noise ratio. */
+  u32 P;         /**< Pseudorange. */
+  s32 L_i;       /**< Carrier-phase, whole cycles. */
+  u8 L_f;        /**< Carrier-phase, fractional part. */
+} msg_packed_obs_full_t;
+
+typedef struct __attribute__((packed)) {
+  u8 prn;        /**< Satellite number | PACKED_OBS_DELTA. */
+  u8 snr;        /**< Signal-to-Noise ratio. */
+  s16 dP;        /**< Pseudorange change since the previous epoch. */
+  s32 dL;        /**< Carrier-phase change since the previous epoch. */
+} msg_packed_obs_delta_t;
+
+/** Observations of one epoch in a compact form for low rate radio links,
+ * a gps_time_t followed by the records. See packed_obs.c. */
+#define MSG_COMPACT_OBS             0x44  /**< Piksi  -> Host  */
+typedef struct __attribute__((packed)) {
+  u8 prn;        /**< Satellite number. */
+  u8 amb;        /**< Pseudorange, whole light milliseconds. */
+  u8 P[3];       /**< Pseudorange modulo one light millisecond. */
+  u8 cpr[3];     /**< Carrier-phase minus pseudorange, signed. */
+  u8 lock;       /**< Changes whenever the carrier-phase isn't continuous. */
+  u8 snr;        /**< Signal-to-Noise ratio, as in msg_packed_obs_full_t. */
+} msg_compact_obs_t;
+
+/** An ephemeris held by the sender, passed between receivers running the
+ * same firmware so the libswiftnav struct is sent as is. See eph_share.c. */
+#define MSG_EPHEMERIS               0x46  /**< Piksi <-> Piksi */
+typedef struct __attribute__((packed)) {
+  u8 prn;        /**< Satellite number, 0-31. */
+  ephemeris_t e;
+} msg_ephemeris_t;
+
+/** Start of an assisted start bundle, followed by n_eph MSG_AGNSS_EPH and
+ * n_alm MSG_AGNSS_ALM messages with the same id. Nothing is applied until
+ * the whole bundle has arrived. See agnss.c. */
+#define MSG_AGNSS_HDR               0x47  /**< Host   -> Piksi */
+typedef struct __attribute__((packed)) {
+  u8 id;              /**< Bundle identifier, changes with every bundle. */
+  u8 n_eph;           /**< Number of ephemerides to follow. */
+  u8 n_alm;           /**< Number of almanacs to follow. */
+  gps_time_t t;       /**< GPS time when the header was sent. */
+  float t_sigma;      /**< Time uncertainty, 0 if there is no time. (s) */
+  double pos_ecef[3]; /**< Approximate position. (m) */
+  float pos_sigma;    /**< Position uncertainty, 0 if there is no
+                           position. (m) */
+  float drift;        /**< Receiver clock fractional frequency error,
+                           positive if it runs fast. */
+  float drift_sigma;  /**< Clock drift uncertainty, 0 if there is no
+                           drift. */
+} msg_agnss_hdr_t;
+
+#define MSG_AGNSS_EPH               0x48  /**< Host   -> Piksi */
+typedef struct __attribute__((packed)) {
+  u8 id;         /**< Bundle identifier, as in the header. */
+  u8 prn;        /**< Satellite number, 0-31. */
+  ephemeris_t e;
+} msg_agnss_eph_t;
+
+#define MSG_AGNSS_ALM               0x49  /**< Host   -> Piksi */
+typedef struct __attribute__((packed)) {
+  u8 id;         /**< Bundle identifier, as in the header. */
+  almanac_t a;   /**< Almanac, with the PRN (1-32) in its prn field. */
+} msg_agnss_alm_t;
+
+/** Request from a rover for a base station to resend one epoch of
+ * observations it missed, see obs_resend.c. */
+#define MSG_OBS_NACK                0x4A  /**< Piksi <-> Piksi */
+typedef struct __attribute__((packed)) {
+  u16 sender_id; /**< Sender ID of the base station asked to resend. */
+  gps_time_t t;  /**< GPS time of the missed observations. */
+} msg_obs_nack_t;
+
+/** Units of the coded pseudorange. (m) */
+#define COMPACT_OBS_P_UNITS   0.02
+/** Units of the coded carrier-phase minus pseudorange. (m) */
+#define COMPACT_OBS_CPR_UNITS 0.0005
+
 #define MSG_TRACKING_STATE        0x16  /**< Piksi  -> Host  */
+
+/** Deadline misses of one tracking channel, see tracking_send_state_ext().
+ * A miss is the channel's interrupt firing again before the last one was
+ * serviced, as flagged in the NAP error register. */
+#define MSG_TRACKING_STATE_EXT    0x24  /**< Piksi  -> Host  */
+typedef struct __attribute__((packed)) {
+  u8 channel;
+  u8 state;              /**< Tracking channel state. */
+  u8 prn;
+  float cn0;             /**< -1 if the channel isn't running. */
+  u32 miss_count;        /**< Misses since the channel was started. */
+  u32 miss_age;          /**< ms tracked since the last miss. */
+  u8 miss_n_running;     /**< Channels running at the last miss. */
+  char miss_masked[20];  /**< Longest interrupt masked section since the
+                              error register was last read before the last
+                              miss, empty if none. */
+  u32 miss_masked_cycles; /**< Length of that section (cycles). */
+} msg_tracking_state_ext_t;
 #define MSG_IAR_STATE             0x19  /**< Piksi  -> Host  */
 typedef struct __attribute__((packed)) {
   u32 num_hyps;
@@ -90,6 +226,35 @@ typedef struct __attribute__((packed)) {
   u32 stack_free;
 } msg_thread_state_t;
 
+/** Thread states of several threads packed into one message. */
+#define MSG_THREAD_STATES         0x1D  /**< Piksi  -> Host  */
+#define MSG_THREAD_STATES_MAX (255 / sizeof(msg_thread_state_t))
+
+/** CPU load over the last heartbeat period and the load shedding level,
+ * sent every heartbeat. */
+#define MSG_SYSTEM_LOAD           0x1E  /**< Piksi  -> Host  */
+typedef struct __attribute__((packed)) {
+  u16 load;      /**< Time not spent in the idle thread. (0.1 %) */
+  u8 level;      /**< Load shedding level, see system_monitor.h. */
+} msg_system_load_t;
+
+/** Correlation trace records, see corr_trace.h. */
+#define MSG_CORR_TRACE            0x1F  /**< Piksi  -> Host  */
+
+/** Times since boot the startup milestones were reached, see ttff.h. A
+ * time of 0 means the milestone hasn't been reached yet. */
+#define MSG_TTFF                  0x20  /**< Piksi  -> Host  */
+typedef struct __attribute__((packed)) {
+  u32 ms[8];     /**< Indexed by ttff_milestone_t. (ms) */
+} msg_ttff_t;
+
+/** Per PRN acquisition progress since boot, see ttff.h. */
+#define MSG_TTFF_PRN              0x21  /**< Piksi  -> Host  */
+typedef struct __attribute__((packed)) {
+  u32 first_hit_ms[32]; /**< Time of the first coarse hit, 0 if none. (ms) */
+  u16 attempts[32];     /**< Number of coarse searches. */
+} msg_ttff_prn_t;
+
 #define MSG_UART_STATE            0x18  /**< Piksi  -> Host  */
 typedef struct __attribute__((packed)) {
   struct __attribute__((packed)) {
@@ -99,6 +264,51 @@ typedef struct __attribute__((packed)) {
   } uarts[3];
 } msg_uart_state_t;
 
+#define MSG_PROBE_STATE           0x1A  /**< Piksi  -> Host  */
+typedef struct __attribute__((packed)) {
+  char name[20];
+  u32 count;     /**< Number of samples in this reporting period. */
+  u32 min;       /**< Shortest duration (cycles). */
+  u32 max;       /**< Longest duration (cycles). */
+  u32 mean;      /**< Mean duration (cycles). */
+  u16 hist[32];  /**< hist[n] counts durations of [2^n, 2^(n+1)) cycles. */
+} msg_probe_state_t;
+
+/** Worst interrupt to thread wakeup latency of a source over the last
+ * reporting period, see probe_wakeup_t. */
+#define MSG_PROBE_WAKEUP          0x25  /**< Piksi  -> Host  */
+typedef struct __attribute__((packed)) {
+  char name[20];     /**< Name of the wakeup probe. */
+  u32 worst;         /**< Worst latency (cycles). */
+  char thread[16];   /**< Thread running when the interrupt fired. */
+  char masked[20];   /**< Longest masked section overlapping the worst,
+                          empty if none. */
+  u32 masked_cycles; /**< Length of that section (cycles). */
+} msg_probe_wakeup_t;
+
+/** Use of the static arena of the DGNSS filters and of the heap, see
+ * arena.h. */
+#define MSG_ARENA_STATE           0x26  /**< Piksi  -> Host  */
+typedef struct __attribute__((packed)) {
+  u32 size;        /**< Size of the arena (bytes). */
+  u32 in_use;      /**< Bytes of it allocated. */
+  u32 high_water;  /**< Most bytes of it ever allocated. */
+  u32 fallbacks;   /**< Allocations it couldn't hold, taken from the heap. */
+  u32 heap;        /**< Bytes the heap has grown to. */
+} msg_arena_state_t;
+
+#define MSG_DEBUG_VARS            0x1B  /**< Piksi  -> Host  */
+typedef struct __attribute__((packed)) {
+  u8 id;         /**< ID the variable was registered with. */
+  double value;  /**< Latest value. */
+} msg_debug_vars_entry_t;
+
+#define MSG_DEBUG_VAR_NAME        0x1C  /**< Piksi  -> Host  */
+typedef struct __attribute__((packed)) {
+  u8 id;
+  char name[];   /**< Not NULL terminated, runs to the end of the message. */
+} msg_debug_var_name_t;
+
 /** \} */
 
 /** \} */
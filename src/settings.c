@@ -11,18 +11,81 @@
  */
 
 #include "peripherals/usart.h"
+#include "error.h"
 #include "sbp.h"
 #include "settings.h"
-#include "minIni/minIni.h"
+#include "cfs/cfs.h"
 
+#include <ctype.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 
+/** Maximum number of settings that can be registered, registering more is a
+ * fatal error, see settings_register(). About 110 are registered. */
+#define SETTINGS_MAX 192
+
 #define SETTINGS_FILE "config"
+/** Config file space allowed per setting, a `name=value` line plus a share
+ * of the section headers, (bytes). */
+#define SETTINGS_FILE_SETTING_LEN 32
+/** Largest config file that is loaded or saved, room for every registered
+ * setting to have been changed, (bytes). */
+#define SETTINGS_FILE_MAX (SETTINGS_MAX * SETTINGS_FILE_SETTING_LEN)
+/** Maximum number of values loaded from the config file, one per setting. */
+#define SETTINGS_FILE_MAX_VALUES SETTINGS_MAX
+/** Maximum number of distinct sections. */
+#define SETTINGS_MAX_SECTIONS 32
+/** Slots in the section/name hash table, a power of two at least twice
+ * SETTINGS_MAX so probe sequences stay short. */
+#define SETTINGS_HASH_SIZE 512
+
+#if SETTINGS_HASH_SIZE < 2 * SETTINGS_MAX
+#error "SETTINGS_HASH_SIZE must be at least twice SETTINGS_MAX"
+#endif
+
+/** A value loaded from the config file, the strings point into
+ * settings_file_buf. */
+struct setting_value {
+  const char *section;
+  const char *name;
+  const char *value;
+};
+
+/* The config file is read and parsed once in settings_setup(), settings then
+ * look their values up in this table as they are registered. */
+static char settings_file_buf[SETTINGS_FILE_MAX];
+static struct setting_value settings_file_values[SETTINGS_FILE_MAX_VALUES];
+static u16 settings_file_n_values;
+/* Length of the config file on flash, see settings_save_callback(). */
+static int settings_file_len;
 
 
 static struct setting *settings_head;
 
+/* Settings are kept on the settings_head list grouped by section, in the
+ * order the sections were first registered. These tables index the list so
+ * that registering, looking up and reading by index don't have to walk it. */
+
+/** Last setting in each section, where the next setting registered in that
+ * section is inserted. */
+static struct {
+  const char *section;
+  struct setting *tail;
+} settings_sections[SETTINGS_MAX_SECTIONS];
+static u8 settings_n_sections;
+/** Last setting on the list. */
+static struct setting *settings_tail;
+
+/** Settings by position on the list, rebuilt by settings_by_index() after
+ * registering inserts into the middle of the list. */
+static struct setting *settings_index[SETTINGS_MAX];
+static u16 settings_n;
+static bool settings_index_stale;
+
+/** Open addressed hash table of settings keyed by section and name. */
+static struct setting *settings_hash[SETTINGS_HASH_SIZE];
+
 static const char const * bool_enum[] = {"False", "True", NULL};
 static struct setting_type bool_settings_type;
 /* Bool type identifier can't be a constant because its allocated on setup. */
@@ -161,6 +224,104 @@ static const struct setting_type type_int = {
 static void settings_msg_callback(u16 sender_id, u8 len, u8 msg[], void* context);
 static void settings_save_callback(u16 sender_id, u8 len, u8 msg[], void* context);
 static void settings_read_by_index_callback(u16 sender_id, u8 len, u8 msg[], void* context);
+static void settings_read_bulk_callback(u16 sender_id, u8 len, u8 msg[], void* context);
+
+/** FNV-1a hash of a setting's section and name. */
+static u32 settings_hash_key(const char *section, const char *name)
+{
+  u32 h = 2166136261u;
+  for (const char *c = section; *c; c++)
+    h = (h ^ (u8)*c) * 16777619u;
+  h = (h ^ '.') * 16777619u;
+  for (const char *c = name; *c; c++)
+    h = (h ^ (u8)*c) * 16777619u;
+  return h;
+}
+
+/** Strip leading and trailing whitespace from a string in place. */
+static char *settings_strip(char *str)
+{
+  while (isspace((unsigned char)*str))
+    str++;
+  char *end = str + strlen(str);
+  while (end > str && isspace((unsigned char)end[-1]))
+    *--end = '\0';
+  return str;
+}
+
+/** Read the config file and parse it into settings_file_values.
+ * Understands the subset of the INI format written by
+ * settings_save_callback(): `[section]` headers, `name=value` lines and `;`
+ * or `#` comments.
+ */
+static void settings_load_file(void)
+{
+  int fd = cfs_open(SETTINGS_FILE, CFS_READ);
+  if (fd == -1)
+    return;
+  int len = cfs_read(fd, settings_file_buf, sizeof(settings_file_buf));
+  cfs_close(fd);
+  if (len <= 0)
+    return;
+  settings_file_len = len;
+  if (len == (int)sizeof(settings_file_buf)) {
+    /* Keep only the complete lines that fit. */
+    printf("Config file larger than %d bytes, ignoring the rest\n",
+           (int)sizeof(settings_file_buf) - 1);
+    len--;
+    while (len > 0 && settings_file_buf[len - 1] != '\n')
+      len--;
+  }
+  settings_file_buf[len] = '\0';
+
+  const char *section = "";
+  char *line = settings_file_buf;
+  while (line) {
+    char *next = strchr(line, '\n');
+    if (next)
+      *next++ = '\0';
+    line = settings_strip(line);
+
+    if (line[0] == '[') {
+      char *end = strchr(line, ']');
+      if (end) {
+        *end = '\0';
+        section = settings_strip(line + 1);
+      }
+    } else if (line[0] != ';' && line[0] != '#') {
+      char *eq = strchr(line, '=');
+      if (eq) {
+        if (settings_file_n_values == SETTINGS_FILE_MAX_VALUES) {
+          printf("More than %d values in config file, ignoring the rest\n",
+                 SETTINGS_FILE_MAX_VALUES);
+          break;
+        }
+        *eq = '\0';
+        struct setting_value *v =
+          &settings_file_values[settings_file_n_values++];
+        v->section = section;
+        v->name = settings_strip(line);
+        v->value = settings_strip(eq + 1);
+      }
+    }
+    line = next;
+  }
+}
+
+/** Look up a value loaded from the config file.
+ * Names are matched case insensitively, as minIni did.
+ * \return The value string, or NULL if the file has no such value.
+ */
+static const char *settings_file_lookup(const char *section, const char *name)
+{
+  for (u16 i = 0; i < settings_file_n_values; i++) {
+    struct setting_value *v = &settings_file_values[i];
+    if ((strcasecmp(v->section, section) == 0) &&
+        (strcasecmp(v->name, name) == 0))
+      return v->value;
+  }
+  return NULL;
+}
 
 int settings_type_register_enum(const char * const enumnames[], struct setting_type *type)
 {
@@ -181,6 +342,8 @@ void settings_setup(void)
 {
   TYPE_BOOL = settings_type_register_enum(bool_enum, &bool_settings_type);
 
+  settings_load_file();
+
   static sbp_msg_callbacks_node_t settings_msg_node;
   sbp_register_cbk(
     MSG_SETTINGS,
@@ -199,11 +362,78 @@ void settings_setup(void)
     &settings_read_by_index_callback,
     &settings_read_by_index_node
   );
+  static sbp_msg_callbacks_node_t settings_read_bulk_node;
+  sbp_register_cbk(
+    MSG_SETTINGS_READ_BULK,
+    &settings_read_bulk_callback,
+    &settings_read_bulk_node
+  );
+}
+
+/** Insert a setting at the end of its section on the settings_head list,
+ * or at the end of the list if its section is new.
+ * \return false if the section table is full.
+ */
+static bool settings_insert(struct setting *setting)
+{
+  u8 i;
+  for (i = 0; i < settings_n_sections; i++)
+    if (strcmp(settings_sections[i].section, setting->section) == 0)
+      break;
+
+  if (i == settings_n_sections) {
+    if (settings_n_sections == SETTINGS_MAX_SECTIONS)
+      return false;
+    settings_n_sections++;
+    settings_sections[i].section = setting->section;
+    if (settings_tail)
+      settings_tail->next = setting;
+    else
+      settings_head = setting;
+    settings_index[settings_n] = setting;
+  } else {
+    struct setting *prev = settings_sections[i].tail;
+    setting->next = prev->next;
+    prev->next = setting;
+    if (setting->next)
+      settings_index_stale = true;
+    else
+      settings_index[settings_n] = setting;
+  }
+  if (!setting->next)
+    settings_tail = setting;
+  settings_sections[i].tail = setting;
+  settings_n++;
+  return true;
+}
+
+/** Add a setting to the section/name hash table. */
+static void settings_hash_insert(struct setting *setting)
+{
+  u32 h = settings_hash_key(setting->section, setting->name);
+  while (settings_hash[h & (SETTINGS_HASH_SIZE - 1)])
+    h++;
+  settings_hash[h & (SETTINGS_HASH_SIZE - 1)] = setting;
+}
+
+/** Setting at a position on the settings_head list.
+ * \return The setting, or NULL if index is past the end of the list.
+ */
+static struct setting *settings_by_index(u16 index)
+{
+  if (settings_index_stale) {
+    u16 i = 0;
+    for (struct setting *s = settings_head; s; s = s->next)
+      settings_index[i++] = s;
+    settings_index_stale = false;
+  }
+  if (index >= settings_n)
+    return NULL;
+  return settings_index[index];
 }
 
 void settings_register(struct setting *setting, enum setting_types type)
 {
-  struct setting *s;
   const struct setting_type *t = &type_int;
 
   for (int i = 0; t && (i < type); i++, t = t->next)
@@ -211,35 +441,35 @@ void settings_register(struct setting *setting, enum setting_types type)
   /* FIXME Abort if type is NULL */
   setting->type = t;
 
-  if (!settings_head) {
-    settings_head = setting;
-  } else {
-    for (s = settings_head; s->next; s = s->next) {
-      if ((strcmp(s->section, setting->section) == 0) &&
-          (strcmp(s->next->section, setting->section) != 0))
-        break;
-    }
-    setting->next = s->next;
-    s->next = setting;
-  }
-  char buf[128];
-  ini_gets(setting->section, setting->name, "", buf, sizeof(buf), SETTINGS_FILE);
-  if (buf[0] == 0) {
+  /* Registering happens at startup, a setting that doesn't fit would
+   * silently keep its default so stop here where it can't be missed. */
+  if (settings_n == SETTINGS_MAX)
+    screaming_death("Too many settings, increase SETTINGS_MAX");
+  if (!settings_insert(setting))
+    screaming_death("Too many settings sections, increase SETTINGS_MAX_SECTIONS");
+  settings_hash_insert(setting);
+
+  const char *val = settings_file_lookup(setting->section, setting->name);
+  if (val == NULL || val[0] == 0) {
+    char buf[128];
     setting->type->to_string(setting->type->priv, buf, sizeof(buf),
                              setting->addr, setting->len);
     setting->notify(setting, buf);
   } else {
-    *strchr(buf, '\n') = '\0';
-    setting->dirty = setting->notify(setting, buf);
+    setting->dirty = setting->notify(setting, val);
   }
 }
 
 static struct setting *settings_lookup(const char *section, const char *setting)
 {
-  for (struct setting *s = settings_head; s; s = s->next)
+  u32 h = settings_hash_key(section, setting);
+  struct setting *s;
+  while ((s = settings_hash[h & (SETTINGS_HASH_SIZE - 1)])) {
     if ((strcmp(s->section, section)  == 0) &&
         (strcmp(s->name, setting) == 0))
       return s;
+    h++;
+  }
   return NULL;
 }
 
@@ -339,7 +569,6 @@ static void settings_read_by_index_callback(u16 sender_id, u8 len, u8 msg[], voi
 {
   (void)sender_id; (void) context;
 
-  struct setting *s = settings_head;
   char buf[256];
   u8 buflen = 0;
 
@@ -348,9 +577,7 @@ static void settings_read_by_index_callback(u16 sender_id, u8 len, u8 msg[], voi
     return;
   }
   u16 index = (msg[1] << 8) | msg[0];
-
-  for (int i = 0; (i < index) && s; i++, s = s->next)
-    ;
+  struct setting *s = settings_by_index(index);
 
   if (s == NULL) {
     sbp_send_msg(MSG_SETTINGS_READ_BY_INDEX, 0, NULL);
@@ -364,42 +591,99 @@ static void settings_read_by_index_callback(u16 sender_id, u8 len, u8 msg[], voi
   sbp_send_msg(MSG_SETTINGS_READ_BY_INDEX, buflen, (void*)buf);
 }
 
-static void settings_save_callback(u16 sender_id, u8 len, u8 msg[], void* context)
+/** Reply with as many settings as fit in one message, starting from an
+ * index. The request is the u16 index of the first setting, the reply that
+ * index, a u8 count of settings and then each one as in a
+ * MSG_SETTINGS_READ_BY_INDEX reply, always with four null terminated
+ * strings. A count of zero means the index is past the last setting. A
+ * reply of the index alone, without a count, means the setting at the
+ * index is too long for a bulk reply and has to be read with
+ * MSG_SETTINGS_READ_BY_INDEX.
+ */
+static void settings_read_bulk_callback(u16 sender_id, u8 len, u8 msg[], void* context)
 {
-  int f = cfs_open(SETTINGS_FILE, CFS_WRITE);
-  const char *sec = NULL;
-  char buf[128];
-  int i;
+  (void)sender_id; (void) context;
 
-  (void)sender_id; (void) context; (void)len; (void)msg;
+  u8 buf[255];
+  char setting_buf[256];
+  u8 buflen = 3;
 
-  if (f == -1) {
-    printf("Error opening config file!\n");
+  if (len != 2) {
+    printf("Invalid length for settings bulk read!\n");
     return;
   }
+  u16 index = (msg[1] << 8) | msg[0];
+
+  buf[0] = msg[0];
+  buf[1] = msg[1];
+  buf[2] = 0;
+  struct setting *s;
+  while ((s = settings_by_index(index + buf[2]))) {
+    /* Leave room to terminate an empty format type. */
+    int n = settings_format_setting(s, setting_buf, sizeof(setting_buf) - 1);
+    if (s->type->format_type == NULL)
+      setting_buf[n++] = '\0';
+    if (buflen + n > (int)sizeof(buf)) {
+      if (buf[2] == 0) {
+        printf("Setting %s.%s too long for bulk read\n", s->section, s->name);
+        sbp_send_msg(MSG_SETTINGS_READ_BULK, 2, buf);
+        return;
+      }
+      break;
+    }
+    memcpy(&buf[buflen], setting_buf, n);
+    buflen += n;
+    buf[2]++;
+  }
+  sbp_send_msg(MSG_SETTINGS_READ_BULK, buflen, buf);
+}
+
+static void settings_save_callback(u16 sender_id, u8 len, u8 msg[], void* context)
+{
+  /* Format the whole file first so that it goes to flash in one write. */
+  static char buf[SETTINGS_FILE_MAX];
+  const char *sec = NULL;
+  int i = 0;
+
+  (void)sender_id; (void) context; (void)len; (void)msg;
 
   for (struct setting *s = settings_head; s; s = s->next) {
     /* Skip unchanged parameters */
     if (!s->dirty)
       continue;
 
+    /* Leave room for the longest line we might write */
+    if (i > (int)sizeof(buf) - 128) {
+      printf("Config file full, not all settings saved!\n");
+      break;
+    }
+
     if ((sec == NULL) || (strcmp(s->section, sec) != 0)) {
       /* New section, write section header */
       sec = s->section;
-      i = snprintf(buf, sizeof(buf), "[%s]\n", sec);
-      if (cfs_write(f, buf, i) != i)
-        printf("Error writing to config file!\n");
+      i += snprintf(&buf[i], sizeof(buf) - i, "[%s]\n", sec);
     }
 
     /* Write setting */
-    i = snprintf(buf, sizeof(buf), "%s=", s->name);
+    i += snprintf(&buf[i], sizeof(buf) - i, "%s=", s->name);
     i += s->type->to_string(s->type->priv, &buf[i], sizeof(buf) - i - 1, s->addr, s->len);
     buf[i++] = '\n';
-    if (cfs_write(f, buf, i) != i)
-      printf("Error writing to config file!\n");
   }
 
+  /* The file isn't truncated, blank out anything left over from a longer
+   * previous version. */
+  int n = i;
+  while (n < settings_file_len && n < (int)sizeof(buf))
+    buf[n++] = '\n';
+
+  int f = cfs_open(SETTINGS_FILE, CFS_WRITE);
+  if (f == -1) {
+    printf("Error opening config file!\n");
+    return;
+  }
+  if (cfs_write(f, buf, n) != n)
+    printf("Error writing to config file!\n");
   cfs_close(f);
+  settings_file_len = i;
   printf("Wrote settings to config file.\n");
 }
-
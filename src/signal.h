@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef SWIFTNAV_SIGNAL_H
+#define SWIFTNAV_SIGNAL_H
+
+#include <libswiftnav/common.h>
+
+/** \defgroup signal Signals
+ * Identifiers for satellite signals across constellations.
+ * Per-satellite state is kept in arrays indexed by sid_to_index(), which
+ * packs the constellations one after another. Loops that only care about a
+ * few of the satellites, e.g. the ones still to be searched for, keep a
+ * sid_set_t of them and walk just its members with SID_SET_FOR_EACH()
+ * rather than testing every satellite in turn.
+ * \{ */
+
+/** Constellations, in sid_to_index() order. */
+typedef enum {
+  CONSTELLATION_GPS = 0,
+  CONSTELLATION_SBAS,
+  CONSTELLATION_COUNT
+} constellation_t;
+
+#define NUM_SATS_GPS  32
+/** SBAS PRNs 120 to 138. */
+#define NUM_SATS_SBAS 19
+#define SBAS_FIRST_PRN 120
+
+#define NUM_SIGNALS (NUM_SATS_GPS + NUM_SATS_SBAS)
+
+/** A satellite signal. */
+typedef struct {
+  u8 constellation; /**< constellation_t. */
+  u8 sat;           /**< Satellite within the constellation, from 0. For GPS
+                         this is the usual firmware PRN (0-31), for SBAS it
+                         is the PRN less SBAS_FIRST_PRN. */
+} gnss_signal_t;
+
+/** Whether a signal identifier is in range. */
+static inline bool sid_valid(gnss_signal_t sid)
+{
+  switch (sid.constellation) {
+    case CONSTELLATION_GPS: return sid.sat < NUM_SATS_GPS;
+    case CONSTELLATION_SBAS: return sid.sat < NUM_SATS_SBAS;
+    default: return false;
+  }
+}
+
+/** GPS signal from a firmware PRN (0-31). */
+static inline gnss_signal_t sid_from_gps_prn(u8 prn)
+{
+  gnss_signal_t sid = { .constellation = CONSTELLATION_GPS, .sat = prn };
+  return sid;
+}
+
+/** Dense index of a valid signal, 0 to NUM_SIGNALS-1. GPS PRNs map to
+ * their own PRN so GPS only arrays can share the index. */
+static inline u16 sid_to_index(gnss_signal_t sid)
+{
+  if (sid.constellation == CONSTELLATION_SBAS)
+    return NUM_SATS_GPS + sid.sat;
+  return sid.sat;
+}
+
+/** Signal for a dense index, the inverse of sid_to_index(). */
+static inline gnss_signal_t sid_from_index(u16 i)
+{
+  gnss_signal_t sid;
+  if (i < NUM_SATS_GPS) {
+    sid.constellation = CONSTELLATION_GPS;
+    sid.sat = i;
+  } else {
+    sid.constellation = CONSTELLATION_SBAS;
+    sid.sat = i - NUM_SATS_GPS;
+  }
+  return sid;
+}
+
+#define SID_SET_WORDS ((NUM_SIGNALS + 31) / 32)
+
+/** Set of signals, by sid_to_index(). */
+typedef struct {
+  u32 w[SID_SET_WORDS];
+} sid_set_t;
+
+static inline void sid_set_clear(sid_set_t *s)
+{
+  for (u8 i = 0; i < SID_SET_WORDS; i++)
+    s->w[i] = 0;
+}
+
+static inline void sid_set_add(sid_set_t *s, u16 i)
+{
+  s->w[i / 32] |= 1u << (i % 32);
+}
+
+static inline void sid_set_remove(sid_set_t *s, u16 i)
+{
+  s->w[i / 32] &= ~(1u << (i % 32));
+}
+
+static inline bool sid_set_contains(const sid_set_t *s, u16 i)
+{
+  return (s->w[i / 32] >> (i % 32)) & 1;
+}
+
+/** Add every member of `b` to `a`. */
+static inline void sid_set_union(sid_set_t *a, const sid_set_t *b)
+{
+  for (u8 i = 0; i < SID_SET_WORDS; i++)
+    a->w[i] |= b->w[i];
+}
+
+static inline bool sid_set_empty(const sid_set_t *s)
+{
+  for (u8 i = 0; i < SID_SET_WORDS; i++)
+    if (s->w[i])
+      return false;
+  return true;
+}
+
+/** Lowest member of a set above `i`, pass -1 for the first member.
+ * \return Member index, or -1 if there are no more.
+ */
+static inline s16 sid_set_next(const sid_set_t *s, s16 i)
+{
+  i++;
+  for (u16 w = i / 32; w < SID_SET_WORDS; w++) {
+    u32 bits = s->w[w];
+    if (w == i / 32)
+      bits &= ~0u << (i % 32);
+    if (bits)
+      return w * 32 + __builtin_ctz(bits);
+  }
+  return -1;
+}
+
+/** Loop over the members of a set in index order. The current member may be
+ * removed from the set inside the loop. */
+#define SID_SET_FOR_EACH(i, s) \
+  for (s16 i = sid_set_next((s), -1); i >= 0; i = sid_set_next((s), i))
+
+/** \} */
+
+#endif  /* SWIFTNAV_SIGNAL_H */
@@ -38,6 +38,15 @@
 
 u8 sim_enabled;
 
+/** Seed of the simulator's random number generator, the `simulator` /
+ * `seed` setting. The same seed and sequence of steps gives the same
+ * simulated observations. */
+static u32 sim_seed = 1;
+/** State of the simulator's random number generator. */
+static u32 sim_rand_state = 1;
+/** rand_gaussian() has the second of a pair of samples waiting. */
+static bool sim_gaussian_spare = false;
+
 simulation_settings_t sim_settings = {
   .base_ecef = {
     -2700303.10144031,
@@ -107,33 +116,51 @@ struct {
 };
 
 
+/** Generates a uniformly distributed u32 from the simulator's own generator.
+* A 32 bit xorshift, so the simulation doesn't share state with other users
+* of rand() and replays exactly from simulation_seed().
+*/
+static u32 sim_rand(void)
+{
+  u32 x = sim_rand_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return sim_rand_state = x;
+}
+
+/** Generates a sample from the uniform distribution on [0, 1]. */
+static double sim_rand_uniform(void)
+{
+  return sim_rand() / (double)UINT32_MAX;
+}
+
 /** Generates a sample from the normal distribution
 * with given variance.
 *
 * Uses the Box-Muller transform which is insensitive
 * to the long tail of gaussians.
 *
-* Performs a square-root, a sin, a log, and a rand call.
+* Performs a square-root, a sin, a log, and a sim_rand call.
 *
 * \param variance The variance of a zero-mean gaussian to draw a sample from.
 */
 double rand_gaussian(const double variance)
 {
-  static bool hasSpare = false;
   static double rand1, rand2;
 
-  if(hasSpare)
+  if(sim_gaussian_spare)
   {
-    hasSpare = false;
+    sim_gaussian_spare = false;
     return sqrt(variance * rand1) * sin(rand2);
   }
 
-  hasSpare = true;
+  sim_gaussian_spare = true;
 
-  rand1 = rand() / ((double) RAND_MAX);
+  rand1 = sim_rand_uniform();
   if(rand1 < 1e-100) rand1 = 1e-100;
   rand1 = -2 * log(rand1);
-  rand2 = (rand() / ((double) RAND_MAX)) * (M_PI*2.0);
+  rand2 = sim_rand_uniform() * (M_PI*2.0);
 
   return sqrt(variance * rand1) * cos(rand2);
 }
@@ -188,6 +215,20 @@ void simulation_step(void)
   double elapsed = (now_ticks - sim_state.last_update_ticks)/(double)CH_FREQUENCY;
   sim_state.last_update_ticks = now_ticks;
 
+  simulation_step_dt(elapsed);
+
+}
+
+/** Performs a timestep of the simulation of a fixed duration.
+* As simulation_step() but independent of the wall clock, so after
+* simulation_seed() a sequence of steps always simulates the same
+* observations and can be run as fast as the CPU allows.
+*
+* \param elapsed Simulated time to step by, (s).
+*/
+void simulation_step_dt(double elapsed)
+{
+
   /* Update the time */
   sim_state.noisy_solution.time.tow += elapsed;
 
@@ -288,25 +329,16 @@ void simulation_step_tracking_and_observations(double elapsed)
         num_sats_selected < sim_settings.num_sats &&
         num_sats_selected < NAP_MAX_N_TRACK_CHANNELS) {
 
-      /* Generate a code measurement which is just the pseudorange: */
-      double points_to_sat[3];
-      double base_points_to_sat[3];
-
-      vector_subtract(3, simulation_sats_pos[i], sim_state.pos, points_to_sat);
-      vector_subtract(3, simulation_sats_pos[i], sim_settings.base_ecef, base_points_to_sat);
-
-      double distance_to_sat = vector_norm(3, points_to_sat);
-      double base_distance_to_sat = vector_norm(3, base_points_to_sat);
-
       /* Fill out the observation details into the NAV_MEAS structure for this satellite, */
       /* We simulate the pseudorange as a noisy range measurement, and */
       /* the carrier phase as a noisy range in wavelengths + an integer offset. */
 
       populate_nav_meas(&sim_state.nav_meas[num_sats_selected],
-        distance_to_sat, el, i);
+        sim_state.pos, sim_state.noisy_solution.vel_ecef, t, el, i);
 
+      const double base_vel[3] = {0, 0, 0};
       populate_nav_meas(&sim_state.base_nav_meas[num_sats_selected],
-        base_distance_to_sat, el, i);
+        sim_settings.base_ecef, base_vel, t, el, i);
 
       /* As for tracking, we just set each sat consecutively in each channel. */
       /* This will cause weird jumps when a satellite rises or sets. */
@@ -323,15 +355,45 @@ void simulation_step_tracking_and_observations(double elapsed)
 }
 
 /** Populate a navigation_measurement_t structure with simulated data for
-* the almanac_i satellite, currently dist away from simulated point at given elevation.
+* the almanac_i satellite, as seen from a receiver at a given position, with
+* the satellite at a given elevation.
 *
+* The satellite position and velocity are filled in along with the
+* observations so the measurements can be fed straight to calc_PVT() and
+* single_diff().
+*
+* \param nav_meas  Navigation measurement to fill in.
+* \param rx_pos    Receiver position, ECEF (m).
+* \param rx_vel    Receiver velocity, ECEF (m/s).
+* \param t         Time of week of the observation, (s).
+* \param elevation Satellite elevation, (rad).
+* \param almanac_i Index of the satellite in simulation_almanacs.
 */
-void populate_nav_meas(navigation_measurement_t *nav_meas, double dist, double elevation, int almanac_i)
+void populate_nav_meas(navigation_measurement_t *nav_meas,
+                       const double rx_pos[3], const double rx_vel[3],
+                       double t, double elevation, int almanac_i)
 {
+  double los[3];
+  double rel_vel[3];
+  vector_subtract(3, simulation_sats_pos[almanac_i], rx_pos, los);
+  vector_subtract(3, simulation_sats_vel[almanac_i], rx_vel, rel_vel);
+  double dist = vector_norm(3, los);
+  double range_rate = vector_dot(3, los, rel_vel) / dist;
+
   nav_meas->prn             =  simulation_almanacs[almanac_i].prn + SIM_PRN_OFFSET;
 
+  memcpy(nav_meas->sat_pos, simulation_sats_pos[almanac_i], sizeof(nav_meas->sat_pos));
+  memcpy(nav_meas->sat_vel, simulation_sats_vel[almanac_i], sizeof(nav_meas->sat_vel));
+  nav_meas->tot.wn          =  simulation_week_number;
+  nav_meas->tot.tow         =  t - dist / GPS_C;
+  nav_meas->lock_time       =  t;
+
   nav_meas->raw_pseudorange =  dist;
   nav_meas->raw_pseudorange += rand_gaussian(sim_settings.pseudorange_sigma);
+  nav_meas->pseudorange     =  nav_meas->raw_pseudorange;
+
+  nav_meas->raw_doppler     =  -range_rate / (GPS_C / GPS_L1_HZ);
+  nav_meas->doppler         =  nav_meas->raw_doppler;
 
   nav_meas->carrier_phase =    dist / (GPS_C / GPS_L1_HZ);
   nav_meas->carrier_phase +=   simulation_fake_carrier_bias[almanac_i];
@@ -463,11 +525,32 @@ void simulator_setup_almanacs(void)
 {
 
   for (u8 i = 0; i < simulation_num_almanacs; i++) {
-    simulation_fake_carrier_bias[i] = (rand() % 1000) * 10;
+    simulation_fake_carrier_bias[i] = (sim_rand() % 1000) * 10;
   }
 
 }
 
+/** Restart the simulator's random number generator from a seed.
+* The carrier phase biases are drawn again so everything random about the
+* simulation follows from the seed.
+*
+* \param seed Seed, 0 is replaced by 1 as the generator can't start from 0.
+*/
+void simulation_seed(u32 seed)
+{
+  sim_rand_state = seed ? seed : 1;
+  sim_gaussian_spare = false;
+  simulator_setup_almanacs();
+}
+
+static bool seed_notify(struct setting *s, const char *val)
+{
+  if (!s->type->from_string(s->type->priv, s->addr, s->len, val))
+    return false;
+  simulation_seed(sim_seed);
+  return true;
+}
+
 /** Must be called from main() or equivalent function before simulator runs
 */
 void simulator_setup(void)
@@ -483,7 +566,7 @@ void simulator_setup(void)
   sim_state.noisy_solution.time.wn = simulation_week_number;
   sim_state.noisy_solution.time.tow = 0;
 
-  simulator_setup_almanacs();
+  SETTING_NOTIFY("simulator", "seed", sim_seed, TYPE_INT, seed_notify);
 
   SETTING("simulator", "base_ecef_x",       sim_settings.base_ecef[0],      TYPE_FLOAT);
   SETTING("simulator", "base_ecef_y",       sim_settings.base_ecef[1],      TYPE_FLOAT);
@@ -26,13 +26,22 @@
 *
 * Expected usage:
 * First call `simulation_setup()`,
-* To update the simulation, call `simulation_step()`
+* To update the simulation, call `simulation_step()`, or `simulation_step_dt()`
+* to step by a fixed time independent of the wall clock after seeding the
+* random number generator with `simulation_seed()`
 * and to get the current simulated data, call any of the `simulation_current_xxx` functions
 *
  * \{ */
 
 #define SIM_PRN_OFFSET 200
 
+/** Build the simulator in, see the build profiles in src/Makefile. Without
+ * it simulation_enabled() and simulation_enabled_for() are constant false
+ * and simulator_setup() does nothing. */
+#ifndef BUILD_SIMULATOR
+#define BUILD_SIMULATOR 1
+#endif
+
 typedef uint8_t simulation_mode_t; /* Force uint8_t size for simulation_mode */
 
 typedef enum {
@@ -66,13 +75,26 @@ double lerp(double t, double u, double v, double x, double y);
 
 //Running the Simulation:
 void simulation_step(void);
+void simulation_step_dt(double elapsed);
+void simulation_seed(u32 seed);
+#if BUILD_SIMULATOR
 bool simulation_enabled();
 bool simulation_enabled_for(simulation_modes_t mode_mask);
+#else
+static inline bool simulation_enabled(void) { return false; }
+static inline bool simulation_enabled_for(simulation_modes_t mode_mask)
+{
+  (void)mode_mask;
+  return false;
+}
+#endif
 
 //Internals of the simulator
 void simulation_step_position_in_circle(double);
 void simulation_step_tracking_and_observations(double);
-void populate_nav_meas(navigation_measurement_t *, double, double, int);
+void populate_nav_meas(navigation_measurement_t *nav_meas,
+                       const double rx_pos[3], const double rx_vel[3],
+                       double t, double elevation, int almanac_i);
 
 //Sending simulation settings to the outside world
 void sbp_send_simulation_enabled(void);
@@ -85,10 +107,15 @@ double*                    simulation_current_baseline_ecef(void);
 u8                         simulation_current_num_sats(void);
 tracking_state_msg_t       simulation_current_tracking_state(u8 channel);
 navigation_measurement_t*  simulation_current_navigation_measurements(void);
+navigation_measurement_t*  simulation_current_base_navigation_measurements(void);
 
 //Initialization:
 void simulator_setup_almanacs(void);
+#if BUILD_SIMULATOR
 void simulator_setup(void);
+#else
+static inline void simulator_setup(void) {}
+#endif
 
 
 #endif  /* SWIFTNAV_SIMULATOR_H */
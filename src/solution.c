@@ -13,11 +13,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
 
 #include <libswiftnav/sbp_utils.h>
 #include <libswiftnav/pvt.h>
 #include <libswiftnav/ephemeris.h>
 #include <libswiftnav/coord_system.h>
+#include <libswiftnav/linear_algebra.h>
 #include <libswiftnav/single_diff.h>
 #include <libswiftnav/dgnss_management.h>
 #include <libswiftnav/ambiguity_test.h>
@@ -29,27 +31,67 @@
 #include <ch.h>
 
 #include "board/leds.h"
+#include "arena.h"
+#include "corr_trace.h"
+#include "debug_var.h"
 #include "position.h"
+#include "probe.h"
+#include "pvt_warm.h"
 #include "nmea.h"
+#include "obs_resend.h"
+#include "packed_obs.h"
+#include "rtcm.h"
 #include "sbp.h"
 #include "solution.h"
 #include "manage.h"
 #include "simulator.h"
+#include "timebase.h"
+#include "timing.h"
+#include "ttff.h"
 #include "settings.h"
+#include "system_monitor.h"
 
 Mutex base_obs_lock;
 BinarySemaphore base_obs_received;
 MemoryPool obs_buff_pool;
-Mailbox obs_mailbox;
+
+/** Rover observations waiting to be matched with a base observation, indexed
+ * by observation epoch number modulo OBS_N_BUFF, see obs_epoch(). Only
+ * accessed with the kernel locked. */
+static struct {
+  obss_t *obs; /**< Observations, or NULL if the slot is empty. */
+  u32 epoch;   /**< Observation epoch number of obs. */
+  s16 wn;      /**< GPS week number of obs. */
+} rover_obs_ring[OBS_N_BUFF];
 
 dgnss_solution_mode_t dgnss_soln_mode = SOLN_MODE_TIME_MATCHED;
 dgnss_filter_t dgnss_filter = FILTER_FIXED;
 
 double soln_freq = 10.0;
 u32 obs_output_divisor = 5;
+/** Message observations are sent in. MSG_NEW_OBS by default so that
+ * receivers and hosts without the newer decoders keep working, the packed
+ * and compact formats are opt in. */
+obs_format_t obs_format = OBS_FORMAT_FULL;
 
 double known_baseline[3] = {0, 0, 0};
 
+/** Run as a base station at a surveyed position, `solution.base_ecef_*`.
+ * Only the receiver clock is solved for and only observations are output,
+ * none of the position output or DGNSS processing runs. Takes effect at
+ * the next start. */
+static bool base_mode = false;
+static double base_ecef[3] = {0, 0, 0};
+/** base_mode as it was at startup, what the threads were set up for. */
+static bool base_mode_active = false;
+
+/** Rate of the position / velocity output including the messages
+ * propagated between solutions, (Hz). Only used when above soln_freq. */
+static u32 propagated_rate = 0;
+
+/** Lowest solution rate the load governor may go down to, (Hz). */
+static double soln_freq_min = 1.0;
+
 void solution_send_sbp(gnss_solution *soln, dops_t *dops)
 {
   if (soln) {
@@ -80,33 +122,164 @@ void solution_send_sbp(gnss_solution *soln, dops_t *dops)
   }
 
   if (dops) {
-    DO_EVERY(10,
-      sbp_dops_t sbp_dops;
-      sbp_make_dops(&sbp_dops, dops);
-      sbp_send_msg(SBP_DOPS, sizeof(sbp_dops_t), (u8 *) &sbp_dops);
-    );
+    /* Decimated by the SBP output rate table, see sbp_rate_filter(). */
+    sbp_dops_t sbp_dops;
+    sbp_make_dops(&sbp_dops, dops);
+    sbp_send_msg(SBP_DOPS, sizeof(sbp_dops_t), (u8 *) &sbp_dops);
   }
 }
 
 void solution_send_nmea(gnss_solution *soln, dops_t *dops,
-                        u8 n, navigation_measurement_t *nm)
+                        u8 n, navigation_measurement_t *nm,
+                        const position_frame_t *frame)
 {
+  u8 load_level = system_load_level();
+
+  if (load_level >= LOAD_LEVEL_OUTPUT) {
+    static u32 n_skip = 0;
+    if (n_skip++ % LOAD_NMEA_DIVISOR != 0)
+      return;
+  }
+
   nmea_gpgga(soln, dops);
+  nmea_gprmc(soln);
+  nmea_gpvtg(soln);
+  nmea_gpgst(soln, frame);
 
-  DO_EVERY(10,
-    nmea_gpgsv(n, nm, soln);
-  );
+  if (load_level < LOAD_LEVEL_MONITORS) {
+    DO_EVERY(10,
+      nmea_gpgsv(n, nm, frame);
+    );
+  }
+}
+
+/** Number of soln_freq epochs between solutions.
+ * Normally 1, under LOAD_LEVEL_SOLN_RATE the largest factor of
+ * obs_output_divisor keeping the rate at or above `solution.soln_freq_min`.
+ * Being a factor keeps every observation output epoch a solution epoch.
+ */
+static u32 soln_rate_divisor(void)
+{
+  if (system_load_level() < LOAD_LEVEL_SOLN_RATE)
+    return 1;
+
+  for (u32 k = obs_output_divisor; k > 1; k--) {
+    if (obs_output_divisor % k == 0 && soln_freq / k >= soln_freq_min)
+      return k;
+  }
+  return 1;
 }
 
+/** Last solution, the base of the propagated output. */
+static gnss_solution propagate_soln;
+static u32 propagate_seq = 0;
+static BSEMAPHORE_DECL(propagate_sem, TRUE);
+
+/** Start propagating a new solution, see propagate_thread(). */
+static void solution_propagate_start(const gnss_solution *soln)
+{
+  chSysLock();
+  propagate_soln = *soln;
+  propagate_seq++;
+  chBSemSignalI(&propagate_sem);
+  chSchRescheduleS();
+  chSysUnlock();
+}
+
+/** Extrapolate a solution forwards at constant velocity.
+ * Over the short time between solutions LLH can be stepped directly with
+ * the NED velocity using the ellipsoid's radii of curvature, avoiding an
+ * ECEF to LLH conversion.
+ *
+ * \param soln Solution to propagate in place.
+ * \param dt   Time to propagate for, (s).
+ */
+static void solution_propagate(gnss_solution *soln, double dt)
+{
+  double lat = soln->pos_llh[0];
+  double h = soln->pos_llh[2];
+  double sin_lat = sin(lat);
+  double w = 1 - WGS84_E*WGS84_E * sin_lat*sin_lat;
+  double N = WGS84_A / sqrt(w);
+  double M = N * (1 - WGS84_E*WGS84_E) / w;
+
+  soln->pos_llh[0] += dt * soln->vel_ned[0] / (M + h);
+  soln->pos_llh[1] += dt * soln->vel_ned[1] / ((N + h) * cos(lat));
+  soln->pos_llh[2] -= dt * soln->vel_ned[2];
+  for (u8 i=0; i<3; i++)
+    soln->pos_ecef[i] += dt * soln->vel_ecef[i];
+
+  soln->time.tow += dt;
+  soln->time = normalize_gps_time(soln->time);
+}
+
+/** Send propagated position and velocity messages between solutions.
+ * After each solution, round(propagated_rate / soln_freq) - 1 messages are
+ * sent equally spaced until the next solution is due, each extrapolated
+ * from the solution with its velocity (which comes from the TDCP Doppler).
+ * A new solution arriving early cuts the sequence short. The messages are
+ * decimated by their own rate settings, see sbp_send_propagated_msg().
+ */
+static WORKING_AREA_CCM(wa_propagate_thread, 1024);
+static msg_t propagate_thread(void *arg)
+{
+  (void)arg;
+  chRegSetThreadName("propagate");
+
+  while (TRUE) {
+    chBSemWait(&propagate_sem);
+    systime_t t0 = chTimeNow();
+
+    chSysLock();
+    gnss_solution soln = propagate_soln;
+    u32 seq = propagate_seq;
+    chSysUnlock();
+
+    if (propagated_rate <= soln_freq ||
+        system_load_level() >= LOAD_LEVEL_OUTPUT)
+      continue;
+    u32 n = round(propagated_rate / soln_freq);
+    double period = 1.0 / propagated_rate;
+
+    for (u32 i=1; i<n; i++) {
+      systime_t t = t0 + S2ST(i * period);
+      chSysLock();
+      if ((s32)(t - chTimeNow()) > 0)
+        chThdSleepS(t - chTimeNow());
+      chSysUnlock();
+      if (seq != propagate_seq)
+        break;
+
+      gnss_solution p = soln;
+      solution_propagate(&p, i * period);
+
+      sbp_pos_llh_t pos_llh;
+      sbp_make_pos_llh(&pos_llh, &p, SOLN_FLAG_PROPAGATED);
+      sbp_send_propagated_msg(SBP_POS_LLH, sizeof(pos_llh),
+                              (u8 *) &pos_llh);
+
+      sbp_vel_ned_t vel_ned;
+      sbp_make_vel_ned(&vel_ned, &p, SOLN_FLAG_PROPAGATED);
+      sbp_send_propagated_msg(SBP_VEL_NED, sizeof(vel_ned), (u8 *) &vel_ned);
+    }
+  }
+
+  return 0;
+}
+
+/** Send a baseline in ECEF and in the NED axes of the reference frame.
+ *
+ * \param frame Frame at the rover position the baseline is referenced to.
+ */
 void solution_send_baseline(gps_time_t *t, u8 n_sats, double b_ecef[3],
-                            double ref_ecef[3], u8 flags)
+                            const position_frame_t *frame, u8 flags)
 {
   sbp_baseline_ecef_t sbp_ecef;
   sbp_make_baseline_ecef(&sbp_ecef, t, n_sats, b_ecef, flags);
   sbp_send_msg(SBP_BASELINE_ECEF, sizeof(sbp_ecef), (u8 *)&sbp_ecef);
 
   double b_ned[3];
-  wgsecef2ned(b_ecef, ref_ecef, b_ned);
+  position_frame_ned(frame, b_ecef, b_ned);
 
   sbp_baseline_ned_t sbp_ned;
   sbp_make_baseline_ned(&sbp_ned, t, n_sats, b_ned, flags);
@@ -114,71 +287,504 @@ void solution_send_baseline(gps_time_t *t, u8 n_sats, double b_ecef[3],
 }
 
 extern ephemeris_t es[MAX_SATS];
+extern Mutex es_mutex;
 
+static bool init_done = false;
+static bool init_known_base = false;
+static bool reset_iar = false;
+
+/** Observations of the selected base station, used by the DGNSS filters. */
 obss_t base_obss;
+/** Bit mask by PRN of base observations with a valid Doppler estimate. */
+static u32 base_doppler_valid = 0;
+
+/** Observation store for one base station. */
+typedef struct {
+  u16 sender_id;      /**< SBP sender ID, zero for an unused slot. */
+  systime_t last_rx;  /**< System time the last observations arrived. */
+  obss_t obss;        /**< Last observations received. */
+  u32 doppler_valid;  /**< Bit mask by PRN of valid Doppler in obss. */
+  bool pos_valid;     /**< pos_ecef has been calculated. */
+  bool pos_due;       /**< pos_ecef should be recalculated. */
+  systime_t pos_time; /**< System time pos_ecef was last requested. */
+  double pos_ecef[3]; /**< Single point position of the base station. */
+} base_station_t;
+
+static base_station_t bases[BASE_N_MAX];
+/** Base station the DGNSS filters are running on, NULL until one is heard. */
+static base_station_t *base_selected = NULL;
+/** Base station being updated between base_obs_update_start() and
+ * base_obs_update_finish(), and the observations being written. */
+static base_station_t *base_rx = NULL;
+static obss_t base_obss_rx;
+static base_select_t base_select = BASE_SELECT_FRESHEST;
+/** Serialises access to the DGNSS filter state between the solution thread
+ * (low latency mode) and the time matched obs thread. */
+static MUTEX_DECL(dgnss_lock);
+
+/** Observation epoch number of a time, i.e. the count of observation output
+ * periods into the week. */
+static u32 obs_epoch(gps_time_t *t)
+{
+  return (u32)round(t->tow * (soln_freq / obs_output_divisor));
+}
 
-void obs_callback(u16 sender_id, u8 len, u8 msg[], void* context)
+/** Store rover observations in the ring to wait for a base observation.
+ * Takes ownership of the buffer. Any older observation in the same slot has
+ * gone unmatched for OBS_N_BUFF epochs and is freed.
+ */
+static void rover_obs_put(obss_t *obs)
 {
-  (void) context;
+  u32 epoch = obs_epoch(&obs->t);
+  u8 idx = epoch % OBS_N_BUFF;
+
+  chSysLock();
+  obss_t *old = rover_obs_ring[idx].obs;
+  rover_obs_ring[idx].obs = obs;
+  rover_obs_ring[idx].epoch = epoch;
+  rover_obs_ring[idx].wn = obs->t.wn;
+  chSysUnlock();
+
+  if (old)
+    chPoolFree(&obs_buff_pool, old);
+}
 
-  /* Sender ID of zero means that the messages are relayed observations,
-   * ignore them. */
-  if (sender_id == 0)
-    return;
+#if BUILD_DGNSS
+/** Take the rover observation for the epoch of a base observation.
+ * \param t Time of the base observation.
+ * \return Rover observations matching in time, to be returned to
+ *         obs_buff_pool by the caller, or NULL if there are none.
+ */
+static obss_t *rover_obs_take(gps_time_t *t)
+{
+  u32 epoch = obs_epoch(t);
+  u8 idx = epoch % OBS_N_BUFF;
+
+  chSysLock();
+  obss_t *obs = rover_obs_ring[idx].obs;
+  if (obs && rover_obs_ring[idx].epoch == epoch &&
+      rover_obs_ring[idx].wn == t->wn)
+    rover_obs_ring[idx].obs = NULL;
+  else
+    obs = NULL;
+  chSysUnlock();
+
+  /* Rover observations are only ever output aligned to an epoch but check
+   * anyway, now we own the buffer. */
+  if (obs && fabs(gpsdifftime(obs->t, *t)) >= TIME_MATCH_THRESHOLD) {
+    chPoolFree(&obs_buff_pool, obs);
+    obs = NULL;
+  }
 
-  /* Relay observations using sender_if = 0. */
-  sbp_send_msg_(MSG_NEW_OBS, len, msg, 0);
+  return obs;
+}
+#endif
 
-  gps_time_t *t = (gps_time_t *)msg;
+static bool base_stale(const base_station_t *b, systime_t now)
+{
+  return (now - b->last_rx) > MS2ST(BASE_TIMEOUT_MS);
+}
+
+/** Find the store for a base station, allocating one if it is new.
+ * A new base station takes over an unused slot or one whose base has timed
+ * out. Must be called with base_obs_lock held.
+ *
+ * \param sender_id SBP sender ID of the base station.
+ * \return Pointer to the store, or NULL if the table is full.
+ */
+static base_station_t *base_lookup(u16 sender_id)
+{
+  systime_t now = chTimeNow();
+  base_station_t *slot = NULL;
+
+  for (u8 i=0; i<BASE_N_MAX; i++) {
+    base_station_t *b = &bases[i];
+    if (b->sender_id == sender_id)
+      return b;
+    if (!slot && (b->sender_id == 0 || base_stale(b, now)))
+      slot = b;
+  }
+
+  if (slot) {
+    if (slot == base_selected)
+      base_selected = NULL;
+    memset(slot, 0, sizeof(*slot));
+    slot->sender_id = sender_id;
+    slot->last_rx = now;
+  }
+  return slot;
+}
+
+/** Distance from the rover to a base station, infinite if the base
+ * station's position isn't known. */
+static double base_distance(const base_station_t *b)
+{
+  if (!b->pos_valid || !position_solution.valid)
+    return INFINITY;
+  double d[3];
+  vector_subtract(3, b->pos_ecef, position_solution.pos_ecef, d);
+  return vector_norm(3, d);
+}
+
+/** Apply the base station selection policy after observations from `rx`
+ * have arrived. The selection is sticky, it only changes when the selected
+ * base times out or, when selecting the nearest base, another base is
+ * closer by more than BASE_NEAREST_MARGIN. Switching base resets the DGNSS
+ * filters. Must be called with base_obs_lock held.
+ */
+static void base_choose(base_station_t *rx)
+{
+  systime_t now = chTimeNow();
+  base_station_t *best = rx;
+
+  if (base_select == BASE_SELECT_NEAREST) {
+    for (u8 i=0; i<BASE_N_MAX; i++) {
+      base_station_t *b = &bases[i];
+      if (b->sender_id == 0 || base_stale(b, now))
+        continue;
+      if (base_distance(b) < base_distance(best))
+        best = b;
+    }
+  }
+
+  if (base_selected && !base_stale(base_selected, now)) {
+    if (base_select == BASE_SELECT_FRESHEST)
+      return;
+    if (base_distance(best) + BASE_NEAREST_MARGIN >=
+        base_distance(base_selected))
+      return;
+  }
+
+  if (best != base_selected) {
+    printf("Using base station %u\n", best->sender_id);
+    base_selected = best;
+    init_done = false;
+    /* Start from the new base station's last observations. */
+    memcpy(&base_obss, &best->obss, sizeof(base_obss));
+    base_doppler_valid = best->doppler_valid;
+  }
+}
+
+/** Start updating the observations of a base station.
+ * Checks that the observations are aligned with the solution epochs and if
+ * so locks the base station table so that a new set of observations can be
+ * written straight into the returned buffer. Must be followed by
+ * base_obs_update_finish().
+ *
+ * \param sender_id SBP sender ID of the base station.
+ * \param t GPS time of the new base observations.
+ * \return Pointer to the observations with their time set, or NULL if the
+ *         observations should be ignored.
+ */
+obss_t *base_obs_update_start(u16 sender_id, const gps_time_t *t)
+{
   double epoch_count = t->tow * (soln_freq / obs_output_divisor);
 
   if (fabs(epoch_count - round(epoch_count)) > TIME_MATCH_THRESHOLD) {
     printf("Unaligned observation from base station ignored.\n");
-    return;
+    return NULL;
   }
 
-  /* Lock mutex before modifying base_obss. */
+  /* Lock mutex before modifying the base station table. */
   chMtxLock(&base_obs_lock);
 
-  base_obss.t = *t;
-  base_obss.n = (len - sizeof(gps_time_t)) / sizeof(msg_obs_t);
-  msg_obs_t *obs = (msg_obs_t *)(msg + sizeof(gps_time_t));
-  for (u8 i=0; i<base_obss.n; i++) {
-    base_obss.nm[i].prn = obs[i].prn;
-    base_obss.nm[i].raw_pseudorange = obs[i].P;
-    base_obss.nm[i].carrier_phase = obs[i].L;
-    base_obss.nm[i].snr = obs[i].snr;
+  base_rx = base_lookup(sender_id);
+  if (!base_rx) {
+    chMtxUnlock();
+    return NULL;
+  }
+
+  /* Only take epochs newer than the last one from this base station, a
+   * resend (see obs_resend.c) that turns up after the epoch following it
+   * mustn't reach the filters out of order. A base station whose time has
+   * gone back by more than that has probably restarted, take it. */
+  double dt = gpsdifftime(*t, base_rx->obss.t);
+  if (dt < TIME_MATCH_THRESHOLD && dt > -MAX_AGE_OF_DIFFERENTIAL) {
+    base_rx = NULL;
+    chMtxUnlock();
+    return NULL;
+  }
+
+  base_obss_rx.t = *t;
+  base_obss_rx.n = 0;
+  base_obss_rx.slips = 0;
+  return &base_obss_rx;
+}
+
+/** Add an observation to the base station observations being updated.
+ * Makes room for the observation at its place in PRN order, so base_obss
+ * stays sorted without a sort once the update is finished. Must be called
+ * between base_obs_update_start() and base_obs_update_finish().
+ *
+ * \param obss Pointer returned by base_obs_update_start().
+ * \param prn  PRN of the new observation.
+ * \return Pointer to the observation to fill in, with only the PRN set, or
+ *         NULL if obss is full.
+ */
+navigation_measurement_t *base_obs_insert(obss_t *obss, u8 prn)
+{
+  if (obss->n >= MAX_CHANNELS)
+    return NULL;
+
+  u8 i = obss->n++;
+  while (i > 0 && obss->nm[i-1].prn > prn) {
+    obss->nm[i] = obss->nm[i-1];
+    i--;
+  }
+  obss->nm[i].prn = prn;
+  return &obss->nm[i];
+}
+
+/** Finish updating the observations of a base station.
+ * Estimates the Doppler of the new observations and stores them. If they
+ * are from the selected base station they become the base observations and
+ * a base observation is signalled as received. Releases the base station
+ * table.
+ */
+void base_obs_update_finish(void)
+{
+  base_station_t *b = base_rx;
+  obss_t *prev = &b->obss;
+  systime_t now = chTimeNow();
+
+  /* Estimate Doppler from the carrier phase difference to the previous
+   * observation of the same base, used to propagate the base observations
+   * forward in low latency mode. */
+  double dt = gpsdifftime(base_obss_rx.t, prev->t);
+  b->doppler_valid = 0;
+  if (dt > 0 && dt <= MAX_AGE_OF_DIFFERENTIAL) {
+    /* Both sets are sorted by PRN. */
+    u8 j = 0;
+    for (u8 i=0; i<base_obss_rx.n; i++) {
+      navigation_measurement_t *nm = &base_obss_rx.nm[i];
+      while (j < prev->n && prev->nm[j].prn < nm->prn)
+        j++;
+      if (j < prev->n && prev->nm[j].prn == nm->prn &&
+          !(base_obss_rx.slips & (1u << nm->prn))) {
+        nm->doppler = (nm->carrier_phase - prev->nm[j].carrier_phase) / dt;
+        b->doppler_valid |= 1u << nm->prn;
+      }
+    }
+  }
+  memcpy(prev, &base_obss_rx, sizeof(base_obss_rx));
+  b->last_rx = now;
+
+  /* Have the time matched obs thread refresh the base position. */
+  bool pos_due = false;
+  if (base_select == BASE_SELECT_NEAREST && !b->pos_due &&
+      (!b->pos_valid || (now - b->pos_time) > S2ST(BASE_POS_PERIOD))) {
+    b->pos_due = true;
+    b->pos_time = now;
+    pos_due = true;
   }
 
-  /* Ensure observations sorted by PRN. */
-  qsort(base_obss.nm, base_obss.n,
-        sizeof(navigation_measurement_t), nav_meas_cmp);
+  base_choose(b);
+  bool selected = (b == base_selected);
+  if (selected) {
+    memcpy(&base_obss, &b->obss, sizeof(base_obss));
+    base_doppler_valid = b->doppler_valid;
+  }
+  base_rx = NULL;
 
   /* Unlock mutex. */
   chMtxUnlock();
 
   /* Signal that a base observation has been received. */
-  chBSemSignal(&base_obs_received);
+  if (selected || pos_due)
+    chBSemSignal(&base_obs_received);
 }
 
-void send_observations(u8 n, gps_time_t *t, navigation_measurement_t *m)
+/** Calculate the single point position of a base station from its
+ * observations.
+ *
+ * \param obss Observations of the base station, overwritten.
+ * \param pos_ecef Set to the position if it could be calculated.
+ * \return true if the position could be calculated.
+ */
+static bool base_calc_pos(obss_t *obss, double pos_ecef[3])
+{
+  u8 n = 0;
+
+  chMtxLock(&es_mutex);
+  for (u8 i=0; i<obss->n; i++) {
+    navigation_measurement_t *nm = &obss->nm[n];
+    *nm = obss->nm[i];
+    ephemeris_t *e = &es[nm->prn];
+
+    nm->tot = obss->t;
+    nm->tot.tow -= nm->raw_pseudorange / GPS_C;
+    nm->tot = normalize_gps_time(nm->tot);
+    if (!ephemeris_good(*e, nm->tot))
+      continue;
+
+    double clock_err, clock_rate_err;
+    calc_sat_pos(nm->sat_pos, nm->sat_vel, &clock_err, &clock_rate_err,
+                 e, nm->tot);
+    nm->pseudorange = nm->raw_pseudorange + clock_err * GPS_C;
+    nm->doppler = 0;
+    n++;
+  }
+  chMtxUnlock();
+
+  if (n < 4)
+    return false;
+
+  gnss_solution soln;
+  dops_t dops;
+  if (calc_PVT(n, obss->nm, &soln, &dops) != 0)
+    return false;
+
+  memcpy(pos_ecef, soln.pos_ecef, sizeof(soln.pos_ecef));
+  return true;
+}
+
+/** Recalculate the positions of the base stations that are due one. */
+static void base_pos_update(void)
+{
+  static obss_t obss;
+
+  for (u8 i=0; i<BASE_N_MAX; i++) {
+    base_station_t *b = &bases[i];
+
+    chMtxLock(&base_obs_lock);
+    bool due = b->pos_due;
+    u16 sender_id = b->sender_id;
+    if (due)
+      memcpy(&obss, &b->obss, sizeof(obss));
+    b->pos_due = false;
+    chMtxUnlock();
+
+    if (!due)
+      continue;
+
+    double pos_ecef[3];
+    bool valid = base_calc_pos(&obss, pos_ecef);
+
+    chMtxLock(&base_obs_lock);
+    /* The slot may have been taken over while the lock wasn't held. */
+    if (valid && b->sender_id == sender_id) {
+      memcpy(b->pos_ecef, pos_ecef, sizeof(pos_ecef));
+      b->pos_valid = true;
+    }
+    chMtxUnlock();
+  }
+}
+
+void obs_callback(u16 sender_id, u8 len, u8 msg[], void* context)
 {
-  static u8 buff[256];
+  (void) context;
+
+  /* Sender ID of zero means that the messages are relayed observations,
+   * ignore them. */
+  if (sender_id == 0)
+    return;
+
+  /* Relay observations using sender_id = 0. */
+  sbp_relay_msg(MSG_NEW_OBS, len, msg);
 
-  memcpy(buff, t, sizeof(gps_time_t));
-  msg_obs_t *obs = (msg_obs_t *)&buff[sizeof(gps_time_t)];
-  if (n * sizeof(msg_obs_t) > 255 - sizeof(gps_time_t))
-    n = 255 / sizeof(msg_obs_t);
+  obss_t *obss = base_obs_update_start(sender_id, (gps_time_t *)msg);
+  if (!obss)
+    return;
+
+  u8 n = (len - sizeof(gps_time_t)) / sizeof(msg_obs_t);
+  msg_obs_t *obs = (msg_obs_t *)(msg + sizeof(gps_time_t));
   for (u8 i=0; i<n; i++) {
-    obs[i].prn = m[i].prn;
-    obs[i].P = m[i].raw_pseudorange;
-    obs[i].L = m[i].carrier_phase;
-    obs[i].snr = m[i].snr;
+    navigation_measurement_t *nm = base_obs_insert(obss, obs[i].prn);
+    if (!nm)
+      break;
+    nm->raw_pseudorange = obs[i].P;
+    nm->carrier_phase = obs[i].L;
+    nm->snr = obs[i].snr;
+  }
+
+  base_obs_update_finish();
+}
+
+void send_observations(u8 n, gps_time_t *t, navigation_measurement_t *m)
+{
+  /* The wire format differs from navigation_measurement_t so the
+   * observations have to be packed, but do it in place in a message sized
+   * for the maximum number of channels rather than a separate buffer. */
+  struct __attribute__((packed)) {
+    gps_time_t t;
+    msg_obs_t obs[MAX_CHANNELS];
+  } msg;
+
+  u8 n_full = MIN(n, MAX_CHANNELS);
+  if (n_full * sizeof(msg_obs_t) > 255 - sizeof(gps_time_t))
+    n_full = (255 - sizeof(gps_time_t)) / sizeof(msg_obs_t);
+
+  msg.t = *t;
+  for (u8 i=0; i<n_full; i++) {
+    msg.obs[i].prn = m[i].prn;
+    msg.obs[i].P = m[i].raw_pseudorange;
+    msg.obs[i].L = m[i].carrier_phase;
+    msg.obs[i].snr = m[i].snr;
+  }
+  u8 len = sizeof(gps_time_t) + n_full*sizeof(msg_obs_t);
+
+  /* Kept in full whatever the format, see obs_resend.c. */
+  obs_resend_store(len, (u8 *)&msg);
+
+  switch (obs_format) {
+  case OBS_FORMAT_PACKED:
+    packed_obs_send(n, t, m);
+    return;
+  case OBS_FORMAT_COMPACT:
+    compact_obs_send(n, t, m);
+    return;
+  default:
+    break;
+  }
+
+  sbp_send_msg(MSG_NEW_OBS, len, (u8 *)&msg);
+}
+
+/** Propagate the latest base observations forward in time.
+ * Uses the Doppler estimated from consecutive base observations, base
+ * observations without a Doppler estimate are dropped. Must be called with
+ * base_obs_lock held.
+ * \param dt Time to propagate by in seconds.
+ * \param nm Array to write the propagated observations to, sorted by PRN.
+ * \return Number of propagated observations.
+ */
+static u8 propagate_base_obs(double dt, navigation_measurement_t *nm)
+{
+  u8 n = 0;
+  for (u8 i=0; i<base_obss.n; i++) {
+    if (!(base_doppler_valid & (1u << base_obss.nm[i].prn)))
+      continue;
+    nm[n] = base_obss.nm[i];
+    nm[n].raw_pseudorange -= dt * nm[n].doppler * (GPS_C / GPS_L1_HZ);
+    nm[n].carrier_phase += dt * nm[n].doppler;
+    n++;
   }
-  sbp_send_msg(MSG_NEW_OBS, sizeof(gps_time_t) + n*sizeof(msg_obs_t), buff);
+  return n;
 }
 
+static PROBE_DECL(probe_calc_pvt, "calc_PVT");
+
+/** Iteration budget of the warm started PVT solver, see pvt_warm_solve(). */
+static u8 pvt_max_iterations = 3;
+static PROBE_DECL(probe_dgnss_update, "dgnss_update");
+static PROBE_DECL(probe_tim5_entry, "tim5 isr entry");
+static PROBE_WAKEUP_DECL(probe_tim5_latency, "tim5 latency");
+
+/** CPU cycles per TIM5 count, TIM5 runs at half the CPU clock. */
+#define TIM5_CYCLES_PER_COUNT 2
+/** TIM5 counts per second. */
+#define TIM5_FREQ (SYSTEM_CLOCK / TIM5_CYCLES_PER_COUNT)
+
 static Thread *tp = NULL;
+
+/** NAP timing count TIM5 last fired (or is next due to fire) at. */
+static u64 timer_tc = 0;
+/** NAP timing count of the solution epoch the next wakeup is latched to. */
+static u64 epoch_tc = 0;
+/** Set when the next wakeup was scheduled by solution_schedule() against an
+ * exact epoch, cleared once a wakeup has consumed it. */
+static bool epoch_latched = false;
+
 #define tim5_isr Vector108
 #define NVIC_TIM5_IRQ 50
 void tim5_isr()
@@ -186,8 +792,14 @@ void tim5_isr()
   CH_IRQ_PROLOGUE();
   chSysLockFromIsr();
 
+  /* TIM5 counts up from 0 after the update, so the count is how long the
+   * interrupt took to be taken. */
+  u32 entry_cycles = TIM5_CNT * TIM5_CYCLES_PER_COUNT;
+  probe_record(&probe_tim5_entry, entry_cycles);
+
   /* Wake up processing thread */
   if (tp != NULL) {
+    probe_wakeup_isr(&probe_tim5_latency, probe_now() - entry_cycles);
     chSchReadyI(tp);
     tp = NULL;
   }
@@ -198,13 +810,185 @@ void tim5_isr()
   CH_IRQ_EPILOGUE();
 }
 
-static WORKING_AREA_CCM(wa_solution_thread, 5000);
+/** Schedule the solution thread for the epoch at GPS time t.
+ * With fine time the clock model gives the NAP timing count the epoch falls
+ * on. TIM5 is clocked from the same oscillator as the NAP so it can be set
+ * to fire precisely EPOCH_LATCH_MARGIN after that count, and the solution
+ * is then formed at exactly the epoch count rather than at whatever count
+ * the thread happened to wake at. Epochs already too close are skipped in
+ * steps of period.
+ *
+ * Without fine time the thread is woken at about the epoch and the
+ * observations are propagated to it as before.
+ *
+ * \param t      GPS time of the next solution epoch.
+ * \param period Solution period, (s).
+ */
+static void solution_schedule(gps_time_t t, double period)
+{
+  if (time_quality == TIME_FINE && period > 0) {
+    double now = timebase_now();
+    double tc = gps2rxtime(t);
+    while (tc < now + EPOCH_LATCH_MARGIN * SAMPLE_FREQ)
+      tc += period * SAMPLE_FREQ;
+    double fire_tc = tc + EPOCH_LATCH_MARGIN * SAMPLE_FREQ;
+    double dt = (fire_tc - (double)timer_tc) / SAMPLE_FREQ;
+
+    if (dt < 2) {
+      epoch_tc = round(tc);
+      timer_tc = round(fire_tc);
+      epoch_latched = true;
+      timer_set_period(TIM5, round(TIM5_FREQ * dt));
+      return;
+    }
+  }
+
+  double dt = gpsdifftime(t, position_solution.time);
+
+  /* Limit dt to 2 seconds maximum to prevent hang if dt calculated
+   * incorrectly. */
+  if (dt > 2)
+    dt = 2;
+
+  /* Reset timer period with the count that we will estimate will being
+   * us up to the next solution time. */
+  timer_set_period(TIM5, round(TIM5_FREQ * dt));
+}
+
+/** Priority of the solution output thread, below the solution and SBP
+ * threads so output can't hold up a measurement epoch. */
+#define SOLN_OUT_THREAD_PRIORITY (NORMALPRIO+2)
+
+/** One epoch's output, handed from the solution thread to the output thread
+ * so that formatting and sending it doesn't hold up the next epoch. */
+typedef struct {
+  void *next;             /* Used by memory pool implementation. */
+  bool send_soln;         /**< Send soln in SBP and NMEA. */
+  bool send_dops;         /**< Send just the DOPs, the solution failed. */
+  gnss_solution soln;
+  dops_t dops;
+  position_frame_t frame; /**< Frame at the solution, for the NMEA output. */
+  /** Observations of the epoch, owned by the record, or NULL. */
+  obss_t *obs;
+  bool obs_due;           /**< obs is aligned to an observation epoch. */
+} soln_out_t;
+
+static MemoryPool soln_out_pool;
+static msg_t soln_out_mailbox_buff[SOLN_OUT_N];
+static MAILBOX_DECL(soln_out_mailbox, soln_out_mailbox_buff, SOLN_OUT_N);
+
+/** Pass aligned observations on to the time matched obs thread, freeing
+ * any that nothing will match. Takes ownership of obs. */
+static void solution_obs_done(obss_t *obs, bool obs_due)
+{
+  if (obs_due && BUILD_DGNSS && !base_mode_active)
+    /* Ownership has passed to the time matched obs thread. */
+    rover_obs_put(obs);
+  else
+    chPoolFree(&obs_buff_pool, obs);
+}
+
+/** Hand an epoch's output to the output thread.
+ * If the output thread has fallen SOLN_OUT_N epochs behind the epoch's
+ * output is dropped, the observations still go to the time matched obs
+ * thread so the DGNSS filters don't miss an epoch.
+ *
+ * \param send_soln Send position_solution, see soln_out_t.
+ * \param send_dops Send just the DOPs.
+ * \param dops      DOPs of the solution.
+ * \param obs       Observations from obs_buff_pool or NULL, the ownership
+ *                  passes on.
+ * \param obs_due   obs is aligned to an observation output epoch.
+ */
+static void solution_output(bool send_soln, bool send_dops,
+                            const dops_t *dops, obss_t *obs, bool obs_due)
+{
+  soln_out_t *out = chPoolAlloc(&soln_out_pool);
+  if (!out) {
+    static u32 n_dropped = 0;
+    debug_var_set(DEBUG_VAR_SOLN_OUT_DROPPED, ++n_dropped);
+    if (obs)
+      solution_obs_done(obs, obs_due);
+    return;
+  }
+
+  out->send_soln = send_soln;
+  out->send_dops = send_dops;
+  out->soln = position_solution;
+  out->dops = *dops;
+  if (send_soln)
+    position_frame_get(&out->frame);
+  out->obs = obs;
+  out->obs_due = obs_due;
+
+  /* The mailbox holds as many records as the pool, this can't fail. */
+  chMBPost(&soln_out_mailbox, (msg_t)out, TIME_IMMEDIATE);
+}
+
+/** Format and send an epoch's output. */
+static void soln_out_send(soln_out_t *out)
+{
+  obss_t *obs = out->obs;
+
+  if (out->send_soln) {
+    solution_send_sbp(&out->soln, &out->dops);
+    solution_send_nmea(&out->soln, &out->dops, obs ? obs->n : 0,
+                       obs ? obs->nm : NULL, &out->frame);
+  } else if (out->send_dops) {
+    solution_send_sbp(0, &out->dops);
+  }
+
+  if (!obs)
+    return;
+
+  if (out->obs_due && !simulation_enabled()) {
+    send_observations(obs->n, &obs->t, obs->nm);
+    rtcm_send_obs(obs->n, &obs->t, obs->nm);
+  }
+  solution_obs_done(obs, out->obs_due);
+}
+
+/** Output stage of the solution pipeline.
+ * The solution thread takes the measurements, solves and schedules the next
+ * epoch, everything sent about the epoch is formatted here at a lower
+ * priority. Epochs that queued up while the thread was held off go out
+ * together in one SBP batch.
+ */
+static WORKING_AREA_CCM(wa_soln_out_thread, 3000);
+static msg_t soln_out_thread(void *arg)
+{
+  (void)arg;
+  chRegSetThreadName("solution output");
+
+  while (TRUE) {
+    msg_t m;
+    chMBFetch(&soln_out_mailbox, &m, TIME_INFINITE);
+
+    sbp_tx_batch_begin();
+    do {
+      soln_out_t *out = (soln_out_t *)m;
+      soln_out_send(out);
+      chPoolFree(&soln_out_pool, out);
+    } while (chMBFetch(&soln_out_mailbox, &m, TIME_IMMEDIATE) == RDY_OK);
+    sbp_tx_batch_end();
+  }
+
+  return 0;
+}
+
+/* Large enough to run the DGNSS filters in low latency mode. */
+static WORKING_AREA_CCM(wa_solution_thread, 10000);
 static msg_t solution_thread(void *arg)
 {
   (void)arg;
   chRegSetThreadName("solution");
 
-  static navigation_measurement_t nav_meas_old[MAX_CHANNELS];
+  /* Current and previous epoch navigation measurements, the roles swap each
+   * epoch so the previous measurements never need to be copied. */
+  static navigation_measurement_t nav_meas_buff[2][MAX_CHANNELS];
+  static u8 nav_meas_idx = 0;
+  /* Used when obs_buff_pool is empty, see below. */
+  static obss_t obs_scratch;
 
   while (TRUE) {
     /* Waiting for the timer IRQ fire.*/
@@ -213,13 +997,20 @@ static msg_t solution_thread(void *arg)
     chSchGoSleepS(THD_STATE_SUSPENDED);
     chSysUnlock();
 
+    probe_wakeup_resume(&probe_tim5_latency);
+    sbp_tx_burst_epoch();
+
+    bool latched = epoch_latched;
+    epoch_latched = false;
+    if (!latched)
+      timer_tc = timebase_now();
+
     u8 n_ready = 0;
     channel_measurement_t meas[MAX_CHANNELS];
-    for (u8 i=0; i<nap_track_n_channels; i++) {
-      if (use_tracking_channel(i)) {
-        __asm__("CPSID i;");
+    u32 ready = tracking_channels_ready_mask();
+    for (u8 i=0; ready >> i; i++) {
+      if (((ready >> i) & 1) && use_tracking_channel(i)) {
         tracking_update_measurement(i, &meas[n_ready]);
-        __asm__("CPSIE i;");
         n_ready++;
       }
     }
@@ -230,60 +1021,124 @@ static msg_t solution_thread(void *arg)
        * more intelligent with the solution time.
        */
       static u8 n_ready_old = 0;
-      u64 nav_tc = nap_timing_count();
-      static navigation_measurement_t nav_meas[MAX_CHANNELS];
+      /* Latched epochs are solved at the epoch count itself, each channel's
+       * measurement is propagated the short way back to it. */
+      u64 nav_tc = latched ? epoch_tc : nap_timing_count();
+      corr_trace_epoch(nav_tc);
+      navigation_measurement_t *nav_meas = nav_meas_buff[nav_meas_idx];
+      navigation_measurement_t *nav_meas_old = nav_meas_buff[nav_meas_idx ^ 1];
+      chMtxLock(&es_mutex);
       calc_navigation_measurement(n_ready, meas, nav_meas,
                                   (double)((u32)nav_tc)/SAMPLE_FREQ, es);
-
-      static navigation_measurement_t nav_meas_tdcp[MAX_CHANNELS];
-      u8 n_ready_tdcp = tdcp_doppler(n_ready, nav_meas, n_ready_old,
-                                     nav_meas_old, nav_meas_tdcp);
-
-      /* Store current observations for next time for
+      chMtxUnlock();
+
+      /* Work on the observations in place in a buffer from the pool so that
+       * they can be handed to the time matched obs thread without a copy.
+       * If the pool is empty fall back to a scratch buffer so the solution
+       * can still be calculated. */
+      obss_t *obs = chPoolAlloc(&obs_buff_pool);
+      if (obs == NULL)
+        obs = &obs_scratch;
+
+      /* A base station only propagates its observations by the fraction
+       * of a millisecond to the epoch, the tracking loop Doppler is plenty
+       * for that. */
+      u8 n_ready_tdcp = n_ready;
+      if (base_mode_active)
+        memcpy(obs->nm, nav_meas, n_ready * sizeof(nav_meas[0]));
+      else
+        n_ready_tdcp = tdcp_doppler(n_ready, nav_meas, n_ready_old,
+                                    nav_meas_old, obs->nm);
+
+      /* Keep current observations for next time for
        * TDCP Doppler calculation. */
-      memcpy(nav_meas_old, nav_meas, sizeof(nav_meas));
+      nav_meas_idx ^= 1;
       n_ready_old = n_ready;
 
+      obs->n = n_ready_tdcp;
+
       dops_t dops;
+      bool send_soln = false;
+      bool send_dops = false;
+      bool obs_due = false;
       s8 ret;
-      if ((ret = calc_PVT(n_ready_tdcp, nav_meas_tdcp,
-                          &position_solution, &dops)) == 0) {
+      u32 t_pvt = probe_now();
+      u8 pvt_iters = 0;
+      if (base_mode_active) {
+        memset(&dops, 0, sizeof(dops));
+        ret = pvt_known_pos_solve(n_ready_tdcp, obs->nm, base_ecef,
+                                  &position_solution);
+      } else {
+        ret = pvt_warm_solve(n_ready_tdcp, obs->nm, pvt_max_iterations,
+                             &position_solution, &dops, &pvt_iters);
+      }
+      probe_end(&probe_calc_pvt, t_pvt);
+      debug_var_set(DEBUG_VAR_PVT_ITERATIONS, pvt_iters);
+      if (ret == 0) {
+        ttff_mark(TTFF_PVT);
+        u32 soln_div = soln_rate_divisor();
+
+        /* Update global position solution state, a base station's position
+         * never changes. */
+        if (!base_mode_active)
+          position_updated();
+
+        /* Keep the receiver clock estimate referenced to the solution, this
+         * is what lets acquisition predict the oscillator offset. */
+        set_time_fine(nav_tc, position_solution.clock_bias,
+                      position_solution.time);
 
-        /* Update global position solution state. */
-        position_updated();
+        /* Calculate the time of the nearest solution epoch, were we expected
+         * to be and calculate how far we were away from it. */
+        double expected_tow = round(position_solution.time.tow*soln_freq)
+                                / soln_freq;
+        double t_err = expected_tow - position_solution.time.tow;
 
-        if (!simulation_enabled()) {
-          /* Output solution. */
-          solution_send_sbp(&position_solution, &dops);
-          solution_send_nmea(&position_solution, &dops,
-                             n_ready_tdcp, nav_meas_tdcp);
-        }
+        /* Calculate the next desired solution epoch, when the rate is
+         * reduced that is the next multiple of the longer period so
+         * that the observation output epochs are still hit. Done before
+         * anything else so no amount of work on this epoch can delay the
+         * next one. */
+        double soln_period = soln_div / soln_freq;
+        gps_time_t t_next = {
+          .wn = position_solution.time.wn,
+          .tow = soln_period *
+            (floor((expected_tow + 0.5 / soln_freq) / soln_period) + 1),
+        };
+        solution_schedule(normalize_gps_time(t_next), soln_period);
+
+        send_soln = !simulation_enabled() && !base_mode_active;
+        if (send_soln)
+          solution_propagate_start(&position_solution);
 
         /* If we have a recent set of observations from the base station, do a
          * differential solution. */
-        double pdt;
-        chMtxLock(&base_obs_lock);
-        if (base_obss.n > 0) {
-          if ((pdt = gpsdifftime(position_solution.time, base_obss.t))
+        if (BUILD_DGNSS && !base_mode_active &&
+            dgnss_soln_mode == SOLN_MODE_LOW_LATENCY) {
+          static navigation_measurement_t base_nm[MAX_CHANNELS];
+          u8 n_base = 0;
+          double pdt;
+          chMtxLock(&base_obs_lock);
+          if (base_obss.n > 0 &&
+              (pdt = gpsdifftime(position_solution.time, base_obss.t))
                 < MAX_AGE_OF_DIFFERENTIAL) {
-
-            /* Propagate base station observations to the current time and
-             * process a low-latency differential solution. */
-
-            /* Hook in low-latency filter here. */
-            if (dgnss_soln_mode == SOLN_MODE_LOW_LATENCY) {
-              /*solution_send_baseline(t, n_sds, b, position_solution.pos_ecef);*/
-            }
-
+            n_base = propagate_base_obs(pdt, base_nm);
+          }
+          chMtxUnlock();
+
+          /* Process a low-latency differential solution with the base
+           * station observations propagated to the current time. */
+          if (n_base > 0) {
+            static sdiff_t sds[MAX_CHANNELS];
+            u8 n_sds = single_diff(
+                n_ready_tdcp, obs->nm,
+                n_base, base_nm,
+                sds
+            );
+            process_matched_obs(n_sds, &position_solution.time, sds,
+                                soln_div / soln_freq);
           }
         }
-        chMtxUnlock();
-
-        /* Calculate the time of the nearest solution epoch, were we expected
-         * to be and calculate how far we were away from it. */
-        double expected_tow = round(position_solution.time.tow*soln_freq)
-                                / soln_freq;
-        double t_err = expected_tow - position_solution.time.tow;
 
         /* Only send observations that are closely aligned with the desired
          * solution epochs to ensure they haven't been propagated too far. */
@@ -294,61 +1149,17 @@ static msg_t solution_thread(void *arg)
             fabs(t_check - (u32)t_check) < TIME_MATCH_THRESHOLD) {
           /* Propagate observation to desired time. */
           for (u8 i=0; i<n_ready_tdcp; i++) {
-            nav_meas_tdcp[i].pseudorange -= t_err * nav_meas_tdcp[i].doppler *
+            obs->nm[i].pseudorange -= t_err * obs->nm[i].doppler *
               (GPS_C / GPS_L1_HZ);
-            nav_meas_tdcp[i].carrier_phase += t_err * nav_meas_tdcp[i].doppler;
+            obs->nm[i].carrier_phase += t_err * obs->nm[i].doppler;
           }
 
           /* Update observation time. */
-          gps_time_t new_obs_time;
-          new_obs_time.wn = position_solution.time.wn;
-          new_obs_time.tow = expected_tow;
-
-          if (!simulation_enabled()) {
-            send_observations(n_ready_tdcp, &new_obs_time, nav_meas_tdcp);
-          }
-
-          /* TODO: use a buffer from the pool from the start instead of
-           * allocating nav_meas_tdcp as well. Downside, if we don't end up
-           * pushing the message into the mailbox then we just wasted an
-           * observation from the mailbox for no good reason. */
-
-          obss_t *obs = chPoolAlloc(&obs_buff_pool);
-          msg_t ret;
-          if (obs == NULL) {
-            /* Pool is empty, grab a buffer from the mailbox instead, i.e.
-             * overwrite the oldest item in the queue. */
-            ret = chMBFetch(&obs_mailbox, (msg_t *)&obs, TIME_IMMEDIATE);
-            if (ret != RDY_OK) {
-              printf("ERROR: Pool full and mailbox empty!\n");
-            }
-          }
-          obs->t = new_obs_time;
-          obs->n = n_ready_tdcp;
-          memcpy(obs->nm, nav_meas_tdcp, obs->n * sizeof(navigation_measurement_t));
-          ret = chMBPost(&obs_mailbox, (msg_t)obs, TIME_IMMEDIATE);
-          if (ret != RDY_OK) {
-            /* We could grab another item from the mailbox, discard it and then
-             * post our obs again but if the size of the mailbox and the pool
-             * are equal then we should have already handled the case where the
-             * mailbox is full when we handled the case that the pool was full.
-             * */
-            printf("ERROR: Mailbox should have space!\n");
-          }
+          obs->t.wn = position_solution.time.wn;
+          obs->t.tow = expected_tow;
+          obs_due = true;
         }
 
-        /* Calculate time till the next desired solution epoch. */
-        double dt = expected_tow + (1.0/soln_freq) - position_solution.time.tow;
-
-        /* Limit dt to 2 seconds maximum to prevent hang if dt calculated
-         * incorrectly. */
-        if (dt > 2)
-          dt = 2;
-
-        /* Reset timer period with the count that we will estimate will being
-         * us up to the next solution time. */
-        timer_set_period(TIM5, round(65472000 * dt));
-
       } else {
         /* An error occurred with calc_PVT! */
         /* TODO: Move these error messages into libswiftnav. */
@@ -365,23 +1176,34 @@ static msg_t solution_thread(void *arg)
         );
 
         /* Send just the DOPs */
-        solution_send_sbp(0, &dops);
+        send_dops = true;
       }
 
+      if (obs == &obs_scratch) {
+        /* The pool is sized so that this shouldn't happen, see
+         * solution_setup(). */
+        if (obs_due)
+          printf("ERROR: Obs pool empty, observation not buffered!\n");
+        obs = NULL;
+      }
+      solution_output(send_soln, send_dops, &dops, obs, obs_due);
     }
 
+#if BUILD_SIMULATOR
     /* Here we do all the nice simulation-related stuff. */
     if (simulation_enabled()) {
 
       /* Set the timer period appropriately. */
-      timer_set_period(TIM5, round(65472000 * (1.0/soln_freq)));
+      timer_set_period(TIM5, round(TIM5_FREQ * (1.0/soln_freq)));
 
       simulation_step();
 
       if (simulation_enabled_for(SIMULATION_MODE_PVT)) {
         /* Then we send fake messages. */
+        sbp_tx_batch_begin();
         solution_send_sbp(simulation_current_gnss_solution(),
                           simulation_current_dops_solution());
+        sbp_tx_batch_end();
       }
 
       double expected_tow = round(simulation_current_gnss_solution()->time.tow * soln_freq) / soln_freq;
@@ -392,10 +1214,12 @@ static msg_t solution_thread(void *arg)
 
         u8 flags = simulation_enabled_for(SIMULATION_MODE_RTK) ? 1 : 0;
 
+        position_frame_t frame;
+        position_frame_init(&frame, simulation_ref_ecef());
         solution_send_baseline(&simulation_current_gnss_solution()->time,
           simulation_current_num_sats(),
           simulation_current_baseline_ecef(),
-          simulation_ref_ecef(), flags);
+          &frame, flags);
 
         send_observations(simulation_current_num_sats(),
           &simulation_current_gnss_solution()->time,
@@ -407,17 +1231,50 @@ static msg_t solution_thread(void *arg)
         }
       }
     }
+#endif
   }
   return 0;
 }
 
-static bool init_done = false;
-static bool init_known_base = false;
-static bool reset_iar = false;
+/** Maximum number of epochs a filter update may be deferred by. */
+#define DGNSS_MAX_DEFER 10
+
+/** Percentage of each solution epoch the DGNSS filter update may use. */
+static u32 dgnss_budget = 50;
+/** Cycles taken by the last DGNSS filter update. */
+static u32 dgnss_update_cycles = 0;
+/** Epochs (including the current one) since the last filter update. */
+static u8 dgnss_epochs_pending = 0;
+/** Time elapsed since the last filter update. */
+static double dgnss_dt_pending = 0;
+
+/** Decide whether the DGNSS filters should be updated this epoch.
+ *
+ * While the IAR hypothesis set is large (e.g. straight after a reset) a
+ * single update can take several epochs. Rather than letting matched
+ * observations and the baseline output fall behind, the update is spread
+ * out so that its cost averaged over the epochs it covers stays within
+ * `dgnss_budget`. The epochs in between still output a baseline computed
+ * from the current filter state.
+ *
+ * \param dt Time since the previous epoch.
+ * \return true if the update is due.
+ */
+static bool dgnss_update_due(double dt)
+{
+  dgnss_epochs_pending++;
+  dgnss_dt_pending += dt;
+
+  u64 budget = (u64)(dgnss_budget * (SYSTEM_CLOCK / 100) * dt);
+  return (dgnss_epochs_pending >= DGNSS_MAX_DEFER) ||
+         (dgnss_epochs_pending * budget >= dgnss_update_cycles);
+}
 
 void process_matched_obs(u8 n_sds, gps_time_t *t, sdiff_t *sds, double dt)
 {
-  (void)n_sds; (void)sds;
+  chMtxLock(&dgnss_lock);
+  /* The filters' LAPACKE work arrays come from the arena. */
+  arena_begin();
 
   if (init_known_base) {
     if (n_sds > 4) {
@@ -439,102 +1296,163 @@ void process_matched_obs(u8 n_sds, gps_time_t *t, sdiff_t *sds, double dt)
       printf("Initializing DGNSS filters\n");
       dgnss_init(n_sds, sds, position_solution.pos_ecef, dt);
       init_done = 1;
+      dgnss_update_cycles = 0;
+      dgnss_epochs_pending = 0;
+      dgnss_dt_pending = 0;
     }
   } else {
     if (reset_iar) {
       dgnss_reset_iar();
       reset_iar = false;
     }
-    /* Update filters. */
-    dgnss_update(n_sds, sds, position_solution.pos_ecef, dt);
-    /* If we are in time matched mode then calculate and output the baseline
-     * for this observation. */
-    if (dgnss_soln_mode == SOLN_MODE_TIME_MATCHED) {
-      double b[3];
-      u8 num_used;
-      switch (dgnss_filter) {
-      case FILTER_FIXED:
-        /* Calculate least squares solution using ambiguities from IAR. */
-        dgnss_fixed_baseline(n_sds, sds, position_solution.pos_ecef,
-                             &num_used, b);
-        msg_iar_state_t iar_state = { .num_hyps = dgnss_iar_num_hyps() };
-        sbp_send_msg(MSG_IAR_STATE, sizeof(msg_iar_state_t), (u8 *)&iar_state);
-        u8 flags = (dgnss_iar_resolved()) ? 1 : 0;
-        solution_send_baseline(t, num_used, b, position_solution.pos_ecef, flags);
-        break;
-      case FILTER_FLOAT:
-        dgnss_new_float_baseline(n_sds, sds,
-                                 position_solution.pos_ecef, &num_used, b);
-        solution_send_baseline(t, num_used, b, position_solution.pos_ecef, 0);
-        break;
-      case FILTER_OLD_FLOAT:
-        dgnss_float_baseline(&num_used, b);
-        solution_send_baseline(t, num_used, b, position_solution.pos_ecef, 0);
-        break;
-      }
+    /* Update filters, over the whole interval since the last update. */
+    if (dgnss_update_due(dt)) {
+      u32 t_dgnss = probe_now();
+      dgnss_update(n_sds, sds, position_solution.pos_ecef, dgnss_dt_pending);
+      dgnss_update_cycles = probe_now() - t_dgnss;
+      probe_record(&probe_dgnss_update, dgnss_update_cycles);
+      dgnss_epochs_pending = 0;
+      dgnss_dt_pending = 0;
+    }
+    /* Calculate and output the baseline for this observation, only the
+     * thread for the current dgnss_soln_mode calls us. */
+    double b[3];
+    u8 num_used;
+    position_frame_t frame;
+    position_frame_get(&frame);
+    switch (dgnss_filter) {
+    case FILTER_FIXED:
+      /* Calculate least squares solution using ambiguities from IAR. */
+      dgnss_fixed_baseline(n_sds, sds, position_solution.pos_ecef,
+                           &num_used, b);
+      msg_iar_state_t iar_state = { .num_hyps = dgnss_iar_num_hyps() };
+      sbp_send_msg(MSG_IAR_STATE, sizeof(msg_iar_state_t), (u8 *)&iar_state);
+      u8 flags = (dgnss_iar_resolved()) ? 1 : 0;
+      if (flags)
+        ttff_mark(TTFF_FIXED);
+      solution_send_baseline(t, num_used, b, &frame, flags);
+      break;
+    case FILTER_FLOAT:
+      dgnss_new_float_baseline(n_sds, sds,
+                               position_solution.pos_ecef, &num_used, b);
+      solution_send_baseline(t, num_used, b, &frame, 0);
+      break;
+    case FILTER_OLD_FLOAT:
+      dgnss_float_baseline(&num_used, b);
+      solution_send_baseline(t, num_used, b, &frame, 0);
+      break;
+    }
+  }
+  arena_end();
+  chMtxUnlock();
+}
+
+#if BUILD_DGNSS
+/** Wait for a new observation to arrive from the base station.
+ * If the selected base station's next epoch is more than
+ * OBS_RESEND_MARGIN of a period late, ask for it to be resent once. Only the
+ * first missed epoch is asked for, when more go missing the link is down
+ * rather than lossy and the requests would only add to the traffic.
+ */
+static void base_obs_wait(void)
+{
+  /* Only used by the time matched obs thread. */
+  static u32 nack_epoch = 0;
+
+  while (1) {
+    double period_s = obs_output_divisor / soln_freq;
+    systime_t period = MS2ST((u32)(period_s * 1000));
+
+    chMtxLock(&base_obs_lock);
+    bool have_base = base_selected != NULL;
+    u16 base_id = 0;
+    gps_time_t t_next = {0, 0};
+    systime_t due = 0;
+    if (have_base) {
+      base_id = base_selected->sender_id;
+      t_next = base_selected->obss.t;
+      t_next.tow += period_s;
+      t_next = normalize_gps_time(t_next);
+      due = base_selected->last_rx + period +
+            (systime_t)(period * OBS_RESEND_MARGIN);
+    }
+    chMtxUnlock();
+
+    if (!have_base) {
+      chBSemWait(&base_obs_received);
+      return;
+    }
+
+    s32 wait = (s32)(due - chTimeNow());
+    if (wait > 0) {
+      if (chBSemWaitTimeout(&base_obs_received, wait) == RDY_OK)
+        return;
+      continue;
     }
+
+    u32 epoch = obs_epoch(&t_next);
+    if (epoch != nack_epoch && (systime_t)-wait < period) {
+      nack_epoch = epoch;
+      obs_resend_request(base_id, &t_next);
+    }
+    chBSemWait(&base_obs_received);
+    return;
   }
 }
 
+/** Leave out the base observations of PRNs with a cycle slip, see obss_t.
+ * The DGNSS filter sees the satellite drop out for an epoch and its
+ * ambiguity is started again when it comes back. In low latency mode
+ * propagate_base_obs() already leaves them out, a slip leaves no Doppler.
+ * \param obss Base observations, modified in place.
+ */
+static void base_obs_drop_slips(obss_t *obss)
+{
+  u8 n = 0;
+  for (u8 i=0; i<obss->n; i++)
+    if (!(obss->slips & (1u << obss->nm[i].prn)))
+      obss->nm[n++] = obss->nm[i];
+  obss->n = n;
+}
+
 static WORKING_AREA_CCM(wa_time_matched_obs_thread, 10000);
 static msg_t time_matched_obs_thread(void *arg)
 {
   (void)arg;
   chRegSetThreadName("time matched obs");
   while (1) {
-    /* Wait for a new observation to arrive from the base station. */
-    chBSemWait(&base_obs_received);
+    base_obs_wait();
+
+    base_pos_update();
 
     /* Blink red LED for 20ms. */
     systime_t t_blink = chTimeNow() + MS2ST(50);
     led_on(LED_RED);
 
-    obss_t *obss;
-    /* Look through the mailbox (FIFO queue) of locally generated observations
-     * looking for one that matches in time. */
-    while (chMBFetch(&obs_mailbox, (msg_t *)&obss, TIME_IMMEDIATE)
-            == RDY_OK) {
-      chMtxLock(&base_obs_lock);
-
-      double dt = gpsdifftime(obss->t, base_obss.t);
-
-      if (fabs(dt) < TIME_MATCH_THRESHOLD) {
-        /* Times match! Process obs and base_obss */
-        static sdiff_t sds[MAX_CHANNELS];
-        u8 n_sds = single_diff(
-            obss->n, obss->nm,
-            base_obss.n, base_obss.nm,
-            sds
-        );
-        process_matched_obs(n_sds, &obss->t, sds, 1.0 / soln_freq);
-        chPoolFree(&obs_buff_pool, obss);
-        chMtxUnlock();
-        break;
-      } else if (dt > 0) {
-        /* Time of base obs before time of local obs, we must not have a local
-         * observation matching this base observation, break and wait for a new
-         * base observation. */
-
-        /* In practice this should basically never happen so lets make a note
-         * if it does. */
-        printf("Obs Matching: t_base < t_rover (%f)\n", dt);
-
-        /* Return the buffer to the mailbox so we can try it again later. */
-        msg_t ret = chMBPost(&obs_mailbox, (msg_t)obss, TIME_IMMEDIATE);
-        if (ret != RDY_OK) {
-          /* Something went wrong with returning it to the buffer, better just
-           * free it and carry on. */
-          printf("Obs Matching: mailbox full, discarding observation!\n");
-          chPoolFree(&obs_buff_pool, obss);
-        }
-        chMtxUnlock();
-        break;
-      } else {
-        /* Time of base obs later than time of local obs,
-         * keep moving through the mailbox. */
-        chPoolFree(&obs_buff_pool, obss);
-        chMtxUnlock();
-      }
+    /* Take a snapshot of the base observation so that base_obs_lock isn't
+     * held through the filter update. */
+    static obss_t base_obss_copy;
+    chMtxLock(&base_obs_lock);
+    memcpy(&base_obss_copy, &base_obss, sizeof(base_obss));
+    chMtxUnlock();
+
+    /* Look up the locally generated observation for the same epoch. */
+    obss_t *obss = rover_obs_take(&base_obss_copy.t);
+    if (obss && dgnss_soln_mode == SOLN_MODE_LOW_LATENCY) {
+      /* The solution thread is running the filters from propagated base
+       * observations instead. */
+      chPoolFree(&obs_buff_pool, obss);
+    } else if (obss) {
+      /* Times match! Process obs and base_obss */
+      base_obs_drop_slips(&base_obss_copy);
+      static sdiff_t sds[MAX_CHANNELS];
+      u8 n_sds = single_diff(
+          obss->n, obss->nm,
+          base_obss_copy.n, base_obss_copy.nm,
+          sds
+      );
+      process_matched_obs(n_sds, &obss->t, sds, 1.0 / soln_freq);
+      chPoolFree(&obs_buff_pool, obss);
     }
 
     chSysLock();
@@ -547,6 +1465,7 @@ static msg_t time_matched_obs_thread(void *arg)
   }
   return 0;
 }
+#endif
 
 void reset_filters_callback(u16 sender_id, u8 len, u8 msg[], void* context)
 {
@@ -571,6 +1490,18 @@ void init_base_callback(u16 sender_id, u8 len, u8 msg[], void* context)
   init_known_base = true;
 }
 
+#if BUILD_DGNSS
+/* One buffer for each slot in the rover obs ring plus one being filled by
+ * the solution thread, one being processed by the time matched obs thread
+ * and one for each epoch waiting to be output, so the pool never runs
+ * dry. */
+#define OBS_POOL_N (OBS_N_BUFF + 2 + SOLN_OUT_N)
+#else
+/* Only the one being filled by the solution thread and the ones waiting to
+ * be output. */
+#define OBS_POOL_N (1 + SOLN_OUT_N)
+#endif
+
 void solution_setup()
 {
   /* Enable TIM5 clock. */
@@ -581,12 +1512,46 @@ void solution_setup()
   timer_set_mode(TIM5, TIM_CR1_CKD_CK_INT, TIM_CR1_CMS_EDGE, TIM_CR1_DIR_UP);
   timer_set_prescaler(TIM5, 0);
   timer_disable_preload(TIM5);
-  timer_set_period(TIM5, 65472000); /* 1 second. */
+  timer_set_period(TIM5, TIM5_FREQ); /* 1 second. */
   timer_enable_counter(TIM5);
   timer_enable_irq(TIM5, TIM_DIER_UIE);
 
   SETTING("solution", "soln_freq", soln_freq, TYPE_FLOAT);
   SETTING("solution", "output_every_n_obs", obs_output_divisor, TYPE_INT);
+  SETTING("solution", "propagated_rate", propagated_rate, TYPE_INT);
+  SETTING("solution", "soln_freq_min", soln_freq_min, TYPE_FLOAT);
+  SETTING("solution", "pvt_max_iterations", pvt_max_iterations, TYPE_INT);
+  debug_var_register(DEBUG_VAR_PVT_ITERATIONS, "pvt_iterations");
+  debug_var_register(DEBUG_VAR_SOLN_OUT_DROPPED, "soln_out_dropped");
+
+  static const char const *obs_format_enum[] = {
+    "Full",
+    "Packed",
+    "Compact",
+    NULL
+  };
+  static struct setting_type obs_format_setting;
+  int TYPE_OBS_FORMAT = settings_type_register_enum(obs_format_enum,
+                                                    &obs_format_setting);
+  SETTING("solution", "obs_format", obs_format, TYPE_OBS_FORMAT);
+
+  SETTING("solution", "base_mode", base_mode, TYPE_BOOL);
+  SETTING("solution", "base_ecef_x", base_ecef[0], TYPE_FLOAT);
+  SETTING("solution", "base_ecef_y", base_ecef[1], TYPE_FLOAT);
+  SETTING("solution", "base_ecef_z", base_ecef[2], TYPE_FLOAT);
+
+#if BUILD_DGNSS
+  SETTING("solution", "dgnss_budget", dgnss_budget, TYPE_INT);
+
+  static const char const *base_select_enum[] = {
+    "Freshest",
+    "Nearest",
+    NULL
+  };
+  static struct setting_type base_select_setting;
+  int TYPE_BASE_SELECT = settings_type_register_enum(base_select_enum,
+                                                     &base_select_setting);
+  SETTING("solution", "base_select", base_select, TYPE_BASE_SELECT);
 
   static const char const *dgnss_soln_mode_enum[] = {
     "Low Latency",
@@ -628,18 +1593,47 @@ void solution_setup()
   SETTING("old_kf", "int_trans_var", dgnss_settings.int_trans_var, TYPE_FLOAT);
   SETTING("old_kf", "pos_init_var", dgnss_settings.pos_init_var, TYPE_FLOAT);
   SETTING("old_kf", "vel_init_var", dgnss_settings.vel_init_var, TYPE_FLOAT);
+#endif
 
   chMtxInit(&base_obs_lock);
   chBSemInit(&base_obs_received, TRUE);
-  static msg_t obs_mailbox_buff[OBS_N_BUFF];
-  chMBInit(&obs_mailbox, obs_mailbox_buff, OBS_N_BUFF);
   chPoolInit(&obs_buff_pool, sizeof(obss_t), NULL);
-  static obss_t obs_buff[OBS_N_BUFF] _CCM;
-  chPoolLoadArray(&obs_buff_pool, obs_buff, OBS_N_BUFF);
+  static obss_t obs_buff[OBS_POOL_N] _CCM;
+  chPoolLoadArray(&obs_buff_pool, obs_buff, OBS_POOL_N);
+  chPoolInit(&soln_out_pool, sizeof(soln_out_t), NULL);
+  static soln_out_t soln_out_buff[SOLN_OUT_N] _CCM;
+  chPoolLoadArray(&soln_out_pool, soln_out_buff, SOLN_OUT_N);
+
+  if (base_mode) {
+    /* Anywhere near the surface of the Earth, a position that was never
+     * set is all zeros. */
+    if (vector_norm(3, base_ecef) > 6e6) {
+      base_mode_active = true;
+      position_set_known(base_ecef);
+      printf("Base station mode at %.3f %.3f %.3f\n",
+             base_ecef[0], base_ecef[1], base_ecef[2]);
+    } else {
+      printf("Base station mode needs solution.base_ecef_*, not enabled\n");
+    }
+  }
 
+  chThdCreateStatic(wa_soln_out_thread, sizeof(wa_soln_out_thread),
+                    SOLN_OUT_THREAD_PRIORITY, soln_out_thread, NULL);
   chThdCreateStatic(wa_solution_thread, sizeof(wa_solution_thread),
                     HIGHPRIO-1, solution_thread, NULL);
 
+  /* A base station neither outputs positions nor takes observations from
+   * other receivers, none of the DGNSS side is started. */
+  if (base_mode_active)
+    return;
+
+  /* Below the NAP interrupt thread, which must never wait for it, and level
+   * with the solution thread. While the DGNSS filters run a propagated
+   * output is held back at most one CH_TIME_QUANTUM. */
+  chThdCreateStatic(wa_propagate_thread, sizeof(wa_propagate_thread),
+                    HIGHPRIO-1, propagate_thread, NULL);
+
+#if BUILD_DGNSS
   chThdCreateStatic(wa_time_matched_obs_thread, sizeof(wa_time_matched_obs_thread),
                     LOWPRIO, time_matched_obs_thread, NULL);
 
@@ -650,6 +1644,20 @@ void solution_setup()
     &obs_node
   );
 
+  static sbp_msg_callbacks_node_t packed_obs_node;
+  sbp_register_cbk(
+    MSG_PACKED_OBS,
+    &packed_obs_callback,
+    &packed_obs_node
+  );
+
+  static sbp_msg_callbacks_node_t compact_obs_node;
+  sbp_register_cbk(
+    MSG_COMPACT_OBS,
+    &compact_obs_callback,
+    &compact_obs_node
+  );
+
   static sbp_msg_callbacks_node_t reset_filters_node;
   sbp_register_cbk(
     MSG_RESET_FILTERS,
@@ -663,5 +1671,6 @@ void solution_setup()
     &init_base_callback,
     &init_base_node
   );
+#endif
 }
 
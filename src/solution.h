@@ -18,25 +18,48 @@
 #include <libswiftnav/pvt.h>
 #include <libswiftnav/track.h>
 #include <libswiftnav/gpstime.h>
+#include <libswiftnav/single_diff.h>
+
+#include "position.h"
 
 typedef struct {
   void *next; /* Used by memory pool implementation. */
   gps_time_t t;
   u8 n;
   navigation_measurement_t nm[MAX_CHANNELS];
+  u32 slips; /* PRNs whose carrier phase isn't continuous with the last set. */
 } obss_t;
 
+typedef enum {
+  OBS_FORMAT_FULL,
+  OBS_FORMAT_PACKED,
+  OBS_FORMAT_COMPACT
+} obs_format_t;
+
 typedef enum {
   SOLN_MODE_LOW_LATENCY,
   SOLN_MODE_TIME_MATCHED
 } dgnss_solution_mode_t;
 
+typedef enum {
+  BASE_SELECT_FRESHEST,
+  BASE_SELECT_NEAREST
+} base_select_t;
+
 typedef enum {
   FILTER_FLOAT,
   FILTER_OLD_FLOAT,
   FILTER_FIXED,
 } dgnss_filter_t;
 
+/** Build the DGNSS side in, see the build profiles in src/Makefile. Without
+ * it the receiver only takes its own observations, the time matched obs
+ * thread and the base observation callbacks and settings are left out, and
+ * solution.base_mode is the way to run a base station. */
+#ifndef BUILD_DGNSS
+#define BUILD_DGNSS 1
+#endif
+
 /** Maximum difference between observation times to consider them matched. */
 #define TIME_MATCH_THRESHOLD 1e-6
 /** Maximum time that an observation will be propagated for to align it with a
@@ -45,14 +68,45 @@ typedef enum {
 
 #define MAX_AGE_OF_DIFFERENTIAL 1.0
 
+/** Time after a solution epoch the solution thread is woken at when the
+ * epoch is latched, see solution_schedule(). Every tracking channel has
+ * published a snapshot past the epoch by then, so the measurements are
+ * only ever propagated a fraction of a millisecond to it. (s) */
+#define EPOCH_LATCH_MARGIN 1.5e-3
+
+/** Set in the flags of SBP_POS_LLH and SBP_VEL_NED messages extrapolated
+ * from the last solution rather than calculated. */
+#define SOLN_FLAG_PROPAGATED 0x80
+
+/** Maximum number of base stations tracked at once. Observations from further
+ * senders are ignored until one of the tracked bases times out. */
+#define BASE_N_MAX 3
+/** Time after which a base station that has stopped sending is dropped. */
+#define BASE_TIMEOUT_MS 3000
+/** Period at which the position of each base station is recalculated when
+ * selecting the nearest base (s). */
+#define BASE_POS_PERIOD 10
+/** Distance another base station must be closer by before the nearest base
+ * selection switches to it (m). */
+#define BASE_NEAREST_MARGIN 1000.0
+
+/** Number of epochs the solution output thread may fall behind the solution
+ * thread by before output is dropped. */
+#define SOLN_OUT_N 2
+
 #define OBS_N_BUFF 5
 #define OBS_BUFF_SIZE (OBS_N_BUFF * sizeof(obss_t))
 
 void solution_send_sbp(gnss_solution *soln, dops_t *dops);
 void solution_send_nmea(gnss_solution *soln, dops_t *dops,
-                        u8 n, navigation_measurement_t *nm);
+                        u8 n, navigation_measurement_t *nm,
+                        const position_frame_t *frame);
 void solution_send_baseline(gps_time_t *t, u8 n_sats, double b_ecef[3],
-                            double ref_ecef[3], u8 flags);
+                            const position_frame_t *frame, u8 flags);
+obss_t *base_obs_update_start(u16 sender_id, const gps_time_t *t);
+navigation_measurement_t *base_obs_insert(obss_t *obss, u8 prn);
+void base_obs_update_finish(void);
+void process_matched_obs(u8 n_sds, gps_time_t *t, sdiff_t *sds, double dt);
 void solution_setup(void);
 
 #endif
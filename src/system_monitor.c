@@ -18,13 +18,19 @@
 #include <libswiftnav/sbp_messages.h>
 
 #include "board/nap/nap_common.h"
+#include "board/nap/nap_exti.h"
 #include "board/leds.h"
+#include "arena.h"
 #include "main.h"
 #include "sbp.h"
 #include "sbp_piksi.h"
 #include "manage.h"
+#include "probe.h"
 #include "simulator.h"
 #include "system_monitor.h"
+#include "timebase.h"
+#include "track.h"
+#include "ttff.h"
 
 
 /* Time between sending system monitor and heartbeat messages in milliseconds */
@@ -33,35 +39,172 @@ uint32_t heartbeat_period_milliseconds = 1000;
 /* Global CPU time accumulator, used to measure thread CPU usage. */
 u64 g_ctime = 0;
 
+/** Load over which the load governor sheds work, (%). */
+static u8 load_max = 90;
+/** Load under which shed work is gradually restored, (%). */
+static u8 load_min = 70;
+/** Highest load shedding level the governor may go to. */
+static u8 load_level_max = LOAD_LEVEL_MAX;
+/** Current load shedding level, see system_load_level(). */
+static u8 load_level = LOAD_LEVEL_NONE;
+
+/** Maximum number of threads whose stack high-water marks are cached. */
+#define N_STACK_MARKS 32
+
+/** Free stack words below the high-water mark of a thread, as found by the
+ * last call to check_stack_free(). */
+static struct {
+  Thread *tp;
+  u32 free_words;
+} stack_marks[N_STACK_MARKS];
+
+/** Find the number of bytes of a thread's stack that have never been used.
+ * The stack is filled with 0x55 when the thread is created and grows down
+ * towards p_stklimit. The first call for a thread scans up from the limit to
+ * the first overwritten word, later calls resume from the cached mark and
+ * only walk down over words used since, usually just one read.
+ */
 u32 check_stack_free(Thread *tp)
 {
   u32 *stack = (u32 *)tp->p_stklimit;
   u32 i;
-  for (i=0; i<65536/sizeof(u32); i++) {
-    if (stack[i] != 0x55555555)
+
+  u8 m;
+  for (m=0; m<N_STACK_MARKS; m++) {
+    if (stack_marks[m].tp == tp || stack_marks[m].tp == NULL)
       break;
   }
-  return 4 * (i - 1);
+
+  if (m < N_STACK_MARKS && stack_marks[m].tp == tp) {
+    i = stack_marks[m].free_words;
+    while (i > 0 && stack[i-1] != 0x55555555)
+      i--;
+  } else {
+    for (i=0; i<65536/sizeof(u32); i++) {
+      if (stack[i] != 0x55555555)
+        break;
+    }
+  }
+
+  if (m < N_STACK_MARKS) {
+    stack_marks[m].tp = tp;
+    stack_marks[m].free_words = i;
+  }
+
+  return i ? 4 * (i - 1) : 0;
 }
 
-void send_thread_states()
+#if STACK_PROFILE
+/* Interrupt stack, from the linker script. */
+extern u32 __main_stack_base__[];
+extern u32 __main_stack_end__[];
+
+/** Print the free stack of every thread and of the interrupt stack, see
+ * STACK_PROFILE. Each thread is identified by its stack limit, which
+ * scripts/stack_report.py looks up in the firmware's symbols to find its
+ * working area.
+ */
+static void stack_profile_report(void)
+{
+  u32 *irq = __main_stack_base__;
+  while (irq < __main_stack_end__ && *irq == 0x55555555)
+    irq++;
+  printf("STACK irq 0x%08X %u\n", (unsigned int)__main_stack_base__,
+         (unsigned int)(4 * (irq - __main_stack_base__)));
+
+  for (Thread *tp = chRegFirstThread(); tp; tp = chRegNextThread(tp))
+    printf("STACK %s 0x%08X %u\n", chRegGetThreadName(tp),
+           (unsigned int)tp->p_stklimit, (unsigned int)check_stack_free(tp));
+}
+#endif
+
+/** Send the CPU usage and free stack of every thread, packed into as few
+ * MSG_THREAD_STATES as possible, then reset the CPU time counters.
+ *
+ * \return Time not spent in the idle thread since the last call, (0.1 %).
+ */
+u16 send_thread_states()
 {
+  static msg_thread_state_t states[MSG_THREAD_STATES_MAX];
+  u8 n = 0;
+  u16 load = 1000;
+
   Thread *tp = chRegFirstThread();
   while (tp) {
-    msg_thread_state_t tp_state;
+    msg_thread_state_t *tp_state = &states[n++];
     u16 cpu = 1000.0f * tp->p_ctime / (float)g_ctime;
-    tp_state.cpu = cpu;
-    tp_state.stack_free = check_stack_free(tp);
-    strncpy(tp_state.name, chRegGetThreadName(tp), sizeof(tp_state.name));
-    sbp_send_msg(MSG_THREAD_STATE, sizeof(tp_state), (u8 *)&tp_state);
+    tp_state->cpu = cpu;
+    if (tp == chSysGetIdleThread())
+      load = cpu < 1000 ? 1000 - cpu : 0;
+    tp_state->stack_free = check_stack_free(tp);
+    strncpy(tp_state->name, chRegGetThreadName(tp), sizeof(tp_state->name));
 
     /* This works because chThdGetTicks is actually a define that pulls out a
      * value from a struct, hopefully if that fact changes then this statement
      * will no longer compile. */
     tp->p_ctime = 0;
     tp = chRegNextThread(tp);
+
+    if (n == MSG_THREAD_STATES_MAX || (tp == NULL && n > 0)) {
+      sbp_send_msg(MSG_THREAD_STATES, n * sizeof(states[0]), (u8 *)states);
+      n = 0;
+    }
   }
   g_ctime = 0;
+
+  return load;
+}
+
+/** Current load shedding level.
+ * Modules consult this when scheduling optional work, the LOAD_LEVEL_
+ * defines in system_monitor.h list what is shed at each level.
+ */
+u8 system_load_level(void)
+{
+  return load_level;
+}
+
+/** Step the load shedding level once per heartbeat period.
+ * Over `system_monitor.load_max` the level goes up straight away, it only
+ * comes back down after LOAD_RECOVER_PERIODS periods in a row under
+ * `system_monitor.load_min` so that restoring work doesn't immediately
+ * push the load back over.
+ *
+ * \param load CPU load over the last period, (0.1 %).
+ */
+static void load_governor_update(u16 load)
+{
+  static u8 n_low = 0;
+  u8 level = load_level;
+
+  if (load > 10 * load_max) {
+    n_low = 0;
+    if (level < load_level_max)
+      level++;
+  } else if (load < 10 * load_min) {
+    if (level > 0 && ++n_low >= LOAD_RECOVER_PERIODS) {
+      n_low = 0;
+      level--;
+    }
+  } else {
+    n_low = 0;
+  }
+
+  /* The bound may have been lowered since the level was raised. */
+  if (level > load_level_max)
+    level = load_level_max;
+
+  if (level != load_level) {
+    printf("CPU load %u.%u%%, load shedding level %u -> %u\n",
+           load / 10, load % 10, load_level, level);
+    load_level = level;
+  }
+
+  msg_system_load_t msg = {
+    .load = load,
+    .level = load_level,
+  };
+  sbp_send_msg(MSG_SYSTEM_LOAD, sizeof(msg), (u8 *)&msg);
 }
 
 static WORKING_AREA_CCM(wa_track_status_thread, 128);
@@ -105,9 +248,18 @@ static msg_t system_monitor_thread(void *arg)
 
     u32 status_flags = 0;
     sbp_send_msg(SBP_HEARTBEAT, sizeof(status_flags), (u8 *)&status_flags);
-    send_thread_states();
+    load_governor_update(send_thread_states());
+    probe_send_all();
+    ttff_send();
+    arena_send_state();
+
+    tracking_send_state_ext();
+
+#if STACK_PROFILE
+    DO_EVERY(STACK_PROFILE_PERIOD, stack_profile_report());
+#endif
 
-    u32 err = nap_error_rd_blocking();
+    u32 err = nap_error_take();
     if (err)
       printf("Error: 0x%08X\n", (unsigned int)err);
   }
@@ -121,8 +273,13 @@ void system_monitor_setup()
   SCS_DEMCR |= 0x01000000;
   DWT_CYCCNT = 0; /* Reset the counter. */
   DWT_CTRL |= 1 ; /* Enable the counter. */
+  /* Anchor the timebase to the counter as it now is. */
+  timebase_sync();
 
   SETTING("system_monitor", "heartbeat_period_milliseconds", heartbeat_period_milliseconds, TYPE_INT);
+  SETTING("system_monitor", "load_max", load_max, TYPE_INT);
+  SETTING("system_monitor", "load_min", load_min, TYPE_INT);
+  SETTING("system_monitor", "load_level_max", load_level_max, TYPE_INT);
 
   chThdCreateStatic(
       wa_system_monitor_thread,
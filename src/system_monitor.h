@@ -15,6 +15,33 @@
 
 #include <libswiftnav/common.h>
 
+/** \defgroup load_levels Load shedding levels
+ * Each level sheds the work of the levels below it as well.
+ * \{ */
+#define LOAD_LEVEL_NONE      0 /**< Everything runs at its configured rate. */
+#define LOAD_LEVEL_MONITORS  1 /**< GSV and CW monitor sweeps suspended. */
+#define LOAD_LEVEL_OUTPUT    2 /**< NMEA decimated, no propagated output. */
+#define LOAD_LEVEL_SOLN_RATE 3 /**< Solution rate reduced. */
+#define LOAD_LEVEL_MAX       LOAD_LEVEL_SOLN_RATE
+/** \} */
+
+/** Heartbeat periods the load has to stay low for before a level is
+ * restored. */
+#define LOAD_RECOVER_PERIODS 5
+/** NMEA output decimation at LOAD_LEVEL_OUTPUT and above. */
+#define LOAD_NMEA_DIVISOR    5
+
+/** Build with `make STACK_PROFILE=yes` to print the stack high-water mark of
+ * every thread, and of the interrupt stack, every STACK_PROFILE_PERIOD
+ * heartbeats. Run the worst case load while capturing them with
+ * scripts/stack_report.py, which suggests working area sizes from them. */
+#ifndef STACK_PROFILE
+#define STACK_PROFILE 0
+#endif
+/** Heartbeats between stack profile reports. */
+#define STACK_PROFILE_PERIOD 10
+
 void system_monitor_setup(void);
+u8 system_load_level(void);
 
 #endif
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+
+#include <ch.h>
+
+#include "board/nap/nap_common.h"
+#include "probe.h"
+#include "timebase.h"
+
+/** \defgroup timebase Timebase
+ * The NAP timing count without the SPI transfer.
+ * Reading the count from the NAP takes the SPI bus and a blocking transfer,
+ * which adds up for something asked as often as "what time is it". The CPU
+ * clock is an exact multiple of the sample clock, so once the count has
+ * been read alongside the DWT cycle counter (see probe_now()) the count at
+ * any later time follows from the cycles since then divided by
+ * TIMEBASE_CYCLES_PER_SAMPLE. Anchors are
+ * refreshed from the hardware every TIMEBASE_SYNC_PERIOD, which bounds both
+ * any drift between the two clocks and the cycle counter wrapping.
+ *
+ * An anchor pairs the count with the cycle count half way through the
+ * transfer it was read in, so the interpolated count is good to half a
+ * transfer, around a microsecond. Anything that has to hit a particular
+ * sample, like waiting out a timing strobe, still reads the hardware with
+ * nap_timing_count().
+ * \{ */
+
+static MUTEX_DECL(timebase_mutex);
+
+/** Last anchor, the timing count at a cycle count. Written under
+ * chSysLock(). */
+static struct {
+  bool valid;
+  u64 tc;
+  u32 cycles;
+} anchor;
+
+/** Largest count returned, so the count never goes backwards across a new
+ * anchor. */
+static u64 timebase_last = 0;
+
+/** Read the NAP timing count from the hardware and anchor the timebase to
+ * it. Called by timebase_now() as needed, call directly to force a read.
+ *
+ * \return NAP timing count, extended to 64 bits.
+ */
+u64 timebase_sync(void)
+{
+  chMtxLock(&timebase_mutex);
+
+  u32 c0 = probe_now();
+  u64 tc = nap_timing_count();
+  u32 c1 = probe_now();
+
+  chSysLock();
+  /* No anchor until system_monitor_setup() has started the cycle counter,
+   * until then every call reads the hardware. */
+  if ((DWT_CTRL & 1) && c1 - c0 < TIMEBASE_SYNC_MAX_CYCLES) {
+    anchor.tc = tc;
+    anchor.cycles = c0 + (c1 - c0) / 2;
+    anchor.valid = true;
+  }
+  if (tc > timebase_last)
+    timebase_last = tc;
+  chSysUnlock();
+
+  chMtxUnlock();
+  return tc;
+}
+
+/** Current NAP timing count, interpolated from the last anchor.
+ * Only reads the hardware if the anchor is older than TIMEBASE_SYNC_PERIOD.
+ * Call from threads only.
+ *
+ * \return NAP timing count, extended to 64 bits.
+ */
+u64 timebase_now(void)
+{
+  chSysLock();
+  u32 dc = probe_now() - anchor.cycles;
+  if (!anchor.valid || dc > TIMEBASE_SYNC_PERIOD) {
+    chSysUnlock();
+    return timebase_sync();
+  }
+  u64 tc = anchor.tc + dc / TIMEBASE_CYCLES_PER_SAMPLE;
+  if (tc < timebase_last)
+    tc = timebase_last;
+  timebase_last = tc;
+  chSysUnlock();
+
+  return tc;
+}
+
+/** \} */
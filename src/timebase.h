@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+
+#ifndef SWIFTNAV_TIMEBASE_H
+#define SWIFTNAV_TIMEBASE_H
+
+#include <libswiftnav/common.h>
+
+#include "main.h"
+
+/** \addtogroup timebase
+ * \{ */
+
+/** DWT cycle counter ticks per NAP sample, SYSTEM_CLOCK / SAMPLE_FREQ. */
+#define TIMEBASE_CYCLES_PER_SAMPLE 8
+
+/** Longest timebase_now() interpolates for before reading the hardware
+ * again, well inside the 32 s the cycle counter takes to wrap. (cycles) */
+#define TIMEBASE_SYNC_PERIOD  (SYSTEM_CLOCK / 2)
+
+/** Longest timing count read accepted as an anchor, a longer one was
+ * preempted part way through. (cycles) */
+#define TIMEBASE_SYNC_MAX_CYCLES  (SYSTEM_CLOCK / 50000)
+
+/** \} */
+
+u64 timebase_now(void);
+u64 timebase_sync(void);
+
+#endif  /* SWIFTNAV_TIMEBASE_H */
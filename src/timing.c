@@ -15,12 +15,12 @@
 #include <string.h>
 #include <time.h>
 
-#include <libswiftnav/linear_algebra.h>
 #include <libswiftnav/sbp.h>
 
 #include "board/nap/nap_common.h"
 #include "main.h"
 #include "sbp.h"
+#include "timebase.h"
 #include "timing.h"
 
 /** \defgroup timing Timing
@@ -52,7 +52,7 @@ void set_time(time_quality_t quality, gps_time_t t)
 {
   if (quality > time_quality) {
     clock_state.t0_gps = t;
-    clock_state.t0_gps.tow -= nap_timing_count() * RX_DT_NOMINAL;
+    clock_state.t0_gps.tow -= timebase_now() * RX_DT_NOMINAL;
     clock_state.t0_gps = normalize_gps_time(clock_state.t0_gps);
 
     time_quality = quality;
@@ -101,61 +101,109 @@ void clock_est_update(clock_est_state_t *s, gps_time_t meas_gpst,
                       double meas_clock_period, double localt, double q,
                       double r_gpst, double r_clock_period)
 {
-  double temp[2][2];
+  /* The model of the comment above written out for two states, with
+   * phi = [1 localt; 0 1] and P kept symmetric. */
+  double p00 = s->P[0][0] + q;
+  double p01 = s->P[0][1];
+  double p11 = s->P[1][1];
 
-  double phi_t_0[2][2] = {{1, localt}, {0, 1}};
-  double phi_t_0_tr[2][2];
-  matrix_transpose(2, 2, (const double *)phi_t_0, (double *)phi_t_0_tr);
-
-  double P_[2][2];
-  memcpy(P_, s->P, sizeof(P_));
-  P_[0][0] += q;
-
-  double y[2];
   gps_time_t pred_gpst = s->t0_gps;
   pred_gpst.tow += localt * s->clock_period;
   pred_gpst = normalize_gps_time(pred_gpst);
-  y[0] = gpsdifftime(meas_gpst, pred_gpst);
-  y[1] = meas_clock_period - s->clock_period;
-
-  double S[2][2];
-  matrix_multiply(2, 2, 2, (const double *)phi_t_0, (const double *)P_, (double *)temp);
-  matrix_multiply(2, 2, 2, (const double *)temp, (const double *)phi_t_0_tr, (double *)S);
-  S[0][0] += r_gpst;
-  S[1][1] += r_clock_period;
-  double Sinv[2][2];
-  matrix_inverse(2, (const double *)S, (double *)Sinv);
-
-  double K[2][2];
-  matrix_multiply(2, 2, 2, (const double *)P_, (const double *)phi_t_0_tr, (double *)temp);
-  matrix_multiply(2, 2, 2, (const double *)temp, (const double *)Sinv, (double *)K);
-
-  double dx[2];
-  matrix_multiply(2, 2, 1, (const double *)K, (const double *)y, (double *)dx);
-  s->t0_gps.tow += dx[0];
+  double y0 = gpsdifftime(meas_gpst, pred_gpst);
+  double y1 = meas_clock_period - s->clock_period;
+
+  /* P_ * phi' */
+  double m00 = p00 + localt * p01;
+  double m10 = p01 + localt * p11;
+
+  /* S = phi * P_ * phi' + R */
+  double s00 = m00 + localt * m10 + r_gpst;
+  double s01 = m10;
+  double s11 = p11 + r_clock_period;
+  double det = s00 * s11 - s01 * s01;
+
+  /* K = P_ * phi' * inverse(S) */
+  double k00 = (m00 * s11 - p01 * s01) / det;
+  double k01 = (p01 * s00 - m00 * s01) / det;
+  double k10 = (m10 * s11 - p11 * s01) / det;
+  double k11 = (p11 * s00 - m10 * s01) / det;
+
+  s->t0_gps.tow += k00 * y0 + k01 * y1;
   s->t0_gps = normalize_gps_time(s->t0_gps);
-  s->clock_period += dx[1];
-
-  matrix_multiply(2, 2, 2, (const double *)K, (const double *)phi_t_0, (double *)temp);
-  temp[0][0] = 1 - temp[0][0];
-  temp[0][1] = -temp[0][1];
-  temp[1][1] = 1 - temp[1][1];
-  temp[1][0] = -temp[1][0];
-  matrix_multiply(2, 2, 2, (const double *)temp, (const double *)P_, (double *)s->P);
-
+  s->clock_period += k10 * y0 + k11 * y1;
+
+  /* P = (I - K * phi) * P_ */
+  double a00 = 1 - k00;
+  double a01 = -(k00 * localt + k01);
+  double a10 = -k10;
+  double a11 = 1 - (k10 * localt + k11);
+  s->P[0][0] = a00 * p00 + a01 * p01;
+  s->P[0][1] = a00 * p01 + a01 * p11;
+  s->P[1][0] = s->P[0][1];
+  s->P[1][1] = a10 * p01 + a11 * p11;
 }
 
 /** Update GPS time estimate precisely referenced to the local receiver time.
  *
- * \param tc SwiftNAP timing count.
- * \param t GPS time estimate associated with timing count.
+ * \param tc    SwiftNAP timing count.
+ * \param drift Receiver clock drift relative to the nominal sample period,
+ *              e.g. the clock bias rate from the PVT solution (s/s).
+ * \param t     GPS time estimate associated with timing count.
  */
 void set_time_fine(double tc, double drift, gps_time_t t)
 {
-  clock_est_update(&clock_state, t, 1-drift, tc, 1e-18, 1e-6, 1e-6);
+  if (time_quality != TIME_FINE) {
+    /* Coming from a guess, start the time estimate off at the measurement
+     * rather than filtering in an arbitrarily large error. The clock period
+     * estimate is kept as it may have been restored by a hot start. */
+    clock_state.P[0][0] = 500e-3;
+    clock_state.P[0][1] = 0;
+    clock_state.P[1][0] = 0;
+    clock_state.t0_gps = t;
+    clock_state.t0_gps.tow -= tc * RX_DT_NOMINAL;
+    clock_state.t0_gps = normalize_gps_time(clock_state.t0_gps);
+  }
+  clock_est_update(&clock_state, t, RX_DT_NOMINAL * (1 - drift), tc, 1e-18,
+                   1e-6, CLOCK_DRIFT_MEAS_VAR * RX_DT_NOMINAL * RX_DT_NOMINAL);
   time_quality = TIME_FINE;
 }
 
+/** Set the receiver clock drift from outside the receiver, e.g. an aiding
+ * bundle. Ignored once the time is TIME_FINE, the PVT solution measures the
+ * drift from then on.
+ *
+ * \param drift Fractional frequency error of the receiver clock, positive if
+ *              it runs fast, as returned by clock_drift_estimate().
+ * \param sigma Standard deviation of drift.
+ */
+void set_clock_drift(double drift, double sigma)
+{
+  if (time_quality == TIME_FINE)
+    return;
+
+  clock_state.clock_period = RX_DT_NOMINAL * (1 - drift);
+  clock_state.P[0][1] = 0;
+  clock_state.P[1][0] = 0;
+  clock_state.P[1][1] = RX_DT_NOMINAL * sigma * RX_DT_NOMINAL * sigma;
+}
+
+/** Get the receiver clock frequency error estimate.
+ * The sample clock and the RF front end LO share an oscillator so a
+ * fractional frequency error of the sample clock also appears as a carrier
+ * frequency offset of -(error * GPS_L1_HZ) on every satellite.
+ *
+ * \param sigma Standard deviation of the estimate, may be NULL.
+ * \return Fractional frequency error of the receiver clock, positive if it
+ *         runs fast.
+ */
+double clock_drift_estimate(double *sigma)
+{
+  if (sigma)
+    *sigma = sqrt(clock_state.P[1][1]) / RX_DT_NOMINAL;
+  return 1 - clock_state.clock_period / RX_DT_NOMINAL;
+}
+
 /** Get current GPS time.
  *
  * \note The GPS time may only be a guess or completely unknown. time_quality
@@ -164,15 +212,14 @@ void set_time_fine(double tc, double drift, gps_time_t t)
  *
  * This function should be used only for approximate timing purposes as simply
  * calling this function does not give a well defined instant at which the GPS
- * time is queried.
+ * time is queried. It doesn't access the NAP, see timebase_now().
  *
  * \return Current GPS time.
  */
 gps_time_t get_current_time(void)
 {
   /* TODO: Return invalid when TIME_UNKNOWN. */
-  /* TODO: Think about what happens when nap_timing_count overflows. */
-  u64 tc = nap_timing_count();
+  u64 tc = timebase_now();
   gps_time_t t = rx2gpstime(tc);
 
   return t;
@@ -225,8 +272,6 @@ static void set_time_callback(u16 sender_id, u8 len, u8 msg[], void* context)
  * host. */
 void timing_setup(void)
 {
-  /* TODO: Perhaps setup something to check for nap_timing_count overflows
-   * periodically. */
   static sbp_msg_callbacks_node_t set_time_node;
 
   sbp_register_cbk(MSG_SET_TIME, &set_time_callback, &set_time_node);
@@ -44,11 +44,15 @@ extern time_quality_t time_quality;
 extern clock_est_state_t clock_state;
 
 #define RX_DT_NOMINAL (1.0 / SAMPLE_FREQ)
+/** Variance of a clock drift measurement from the PVT solution, (s/s)^2. */
+#define CLOCK_DRIFT_MEAS_VAR 1e-18
 
 void timing_setup(void);
 gps_time_t get_current_time(void);
 void set_time(time_quality_t quality, gps_time_t t);
-void set_time_fine(double tc, double, gps_time_t t);
+void set_time_fine(double tc, double drift, gps_time_t t);
+void set_clock_drift(double drift, double sigma);
+double clock_drift_estimate(double *sigma);
 gps_time_t rx2gpstime(double tc);
 double gps2rxtime(gps_time_t t);
 
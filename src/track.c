@@ -19,8 +19,13 @@
 
 #include "board/nap/track_channel.h"
 #include "sbp.h"
+#include "sbp_piksi.h"
 #include "track.h"
+#include "corr_trace.h"
+#include "log.h"
 #include "simulator.h"
+#include "settings.h"
+#include "ttff.h"
 
 #include <libswiftnav/constants.h>
 
@@ -40,7 +45,138 @@
 /* Initialiser actually not needed, static array inits to zero
  * and TRACKING_DISABLED = 0.
  */
-tracking_channel_t tracking_channel[NAP_MAX_N_TRACK_CHANNELS];
+tracking_channel_t tracking_channel[NAP_MAX_N_TRACK_CHANNELS] _HOT;
+
+/** Coherent integration period used by the loop filters once a channel has
+ * bit sync, must divide TRACK_INT_MS_MAX, (ms). */
+static u8 track_int_ms = 5;
+
+/** Prompt I samples from a channel, written by tracking_channel_process()
+ * and read by tracking_nav_bits_process(). Sample n is the prompt I of
+ * update_count n+1. head is only written by the NAP ISR thread and tail only
+ * by the decoder, so the ring needs no lock. */
+typedef struct {
+  s32 I[NAV_BIT_RING_LEN];
+  volatile u32 head;  /**< Samples written, by the NAP ISR thread. */
+  u32 tail;           /**< Samples consumed, by the decoder. */
+} nav_bit_ring_t;
+
+static nav_bit_ring_t nav_bit_ring[NAP_MAX_N_TRACK_CHANNELS] _CCM;
+
+/** Channel state transitions, see tracking_events_register(). */
+static EVENTSOURCE_DECL(tracking_events);
+/** TRACKING_EVENT_* flags raised since tracking_events was last broadcast.
+ * Set by the NAP ISR thread, or with the kernel locked. */
+static u32 tracking_events_pending;
+/** Channels ready to be used in a solution, bit n is channel n, see
+ * tracking_channels_ready_mask(). */
+static volatile u32 tracking_ready;
+
+/** Channels with a nav msg subframe ready to be processed.
+ * Each channel posts once, on the edge where its subframe becomes ready, and
+ * not again until the subframe has been processed so the mailbox can't fill
+ * up in normal operation. A post that does find it full is logged and
+ * retried, see tracking_nav_bits_process(). */
+static msg_t subframe_mailbox_buff[NAP_MAX_N_TRACK_CHANNELS];
+static MAILBOX_DECL(subframe_mailbox, subframe_mailbox_buff,
+                    NAP_MAX_N_TRACK_CHANNELS);
+
+#if TRACK_LOOP_FILTER == TRACK_LOOP_FILTER_SP
+
+/* NAP register unit conversions in single precision. */
+#define CARRIER_FREQ_UNITS_PER_HZ_F    ((float)NAP_TRACK_CARRIER_FREQ_UNITS_PER_HZ)
+#define CODE_PHASE_RATE_UNITS_PER_HZ_F ((float)NAP_TRACK_CODE_PHASE_RATE_UNITS_PER_HZ)
+
+/** Calculate PI loop filter gains for a second order loop.
+ * Uses the bilinear transform of the analog loop filter, see Kaplan &
+ * Hegarty, "Understanding GPS", section 5.6.
+ *
+ * \param s         Loop filter state to set the gains of.
+ * \param bw        Noise bandwidth in Hz.
+ * \param zeta      Damping ratio.
+ * \param k         Loop gain.
+ * \param loop_freq Loop update frequency in Hz.
+ * \param y0        Initial filter output.
+ */
+static void sp_lf_init(track_sp_lf_state_t *s, float bw, float zeta, float k,
+                       float loop_freq, float y0)
+{
+  float omega_n = 8.0f*bw*zeta / (4.0f*zeta*zeta + 1.0f);
+  float T = 1.0f / loop_freq;
+  float denominator = k*(4.0f + 4.0f*zeta*omega_n*T + omega_n*omega_n*T*T);
+
+  s->pgain = 8.0f*zeta*omega_n*T / denominator;
+  s->igain = 4.0f*omega_n*omega_n*T*T / denominator;
+  s->prev_error = 0.0f;
+  s->y = y0;
+}
+
+static float sp_lf_update(track_sp_lf_state_t *s, float error)
+{
+  s->y += s->pgain * (error - s->prev_error) + s->igain * error;
+  s->prev_error = error;
+  return s->y;
+}
+
+/** Initialise the single precision tracking loop.
+ * Takes the same parameters as comp_tl_init().
+ *
+ * \param tau   Time constant of the complementary filter, (s).
+ * \param cpc   Carrier cycles per code chip.
+ * \param sched Updates of the code loop alone before carrier aiding starts.
+ */
+static void sp_tl_init(track_sp_tl_state_t *s, float loop_freq,
+                       float code_freq, float code_bw, float code_zeta,
+                       float code_k, float carr_freq, float carr_bw,
+                       float carr_zeta, float carr_k,
+                       float tau, float cpc, u32 sched)
+{
+  s->carr_freq = carr_freq;
+  sp_lf_init(&s->carr_filt, carr_bw, carr_zeta, carr_k, loop_freq, carr_freq);
+
+  s->code_freq = code_freq;
+  sp_lf_init(&s->code_filt, code_bw, code_zeta, code_k, loop_freq, code_freq);
+
+  s->n = 0;
+  s->sched = sched;
+  s->carr_to_code = 1.0f / cpc;
+  s->A = 1.0f - (1.0f / (loop_freq * tau));
+}
+
+/** Update the single precision tracking loop from one set of correlations.
+ * The same loop as comp_tl_update(): Costas discriminator for the carrier
+ * loop, half the normalised early minus late envelope for the code loop.
+ * The code loop runs alone for the first sched updates, after that its
+ * output is blended with the carrier aiding by the complementary filter.
+ */
+static void sp_tl_update(track_sp_tl_state_t *s, const corr_t cs[3])
+{
+  float I_p = (float)cs[1].I;
+  float Q_p = (float)cs[1].Q;
+  float carr_error = (I_p == 0.0f) ? 0.0f
+                                   : atanf(Q_p / I_p) * (float)(1.0/(2*M_PI));
+  s->carr_freq = sp_lf_update(&s->carr_filt, carr_error);
+
+  float early_mag = sqrtf((float)cs[0].I*cs[0].I + (float)cs[0].Q*cs[0].Q);
+  float late_mag = sqrtf((float)cs[2].I*cs[2].I + (float)cs[2].Q*cs[2].Q);
+  float code_error = 0.0f;
+  if (early_mag + late_mag > 0.0f)
+    code_error = 0.5f * (early_mag - late_mag) / (early_mag + late_mag);
+  /* The code filter gives the change in code frequency. */
+  s->code_filt.y = 0.0f;
+  float code_update = sp_lf_update(&s->code_filt, -code_error);
+
+  if (s->n > s->sched) {
+    s->code_freq = s->A * s->code_freq +
+                   s->A * code_update +
+                   (1.0f - s->A) * s->carr_to_code * s->carr_freq;
+  } else {
+    s->code_freq += code_update;
+  }
+  s->n++;
+}
+
+#endif
 
 /** Calculate the future code phase after N samples.
  * Calculate the expected code phase in N samples time with carrier aiding.
@@ -76,6 +212,64 @@ float propagate_code_phase(float code_phase, float carrier_freq, u32 n_samples)
   return (float)((u32)(propagated_code_phase >> 28) % (1023*16)) / 16.0;
 }
 
+/** Publish a tracking channel's measurement parameters to its snapshot.
+ * The sequence count is odd while the snapshot is being written so readers
+ * can detect a torn copy and retry, see tracking_channel_snapshot(). Must be
+ * called either from the NAP ISR thread or with the kernel locked, so that a
+ * reader can never preempt a half finished write.
+ * \param chan Tracking channel to publish.
+ */
+static void tracking_channel_publish(tracking_channel_t *chan)
+{
+  tracking_channel_snapshot_t *snap = &chan->snapshot;
+
+  chan->snapshot_seq++;
+  __asm__ __volatile__("" ::: "memory");
+
+  snap->state = chan->state;
+  snap->prn = chan->prn;
+  snap->inverted = chan->nav_msg.inverted;
+  snap->TOW_ms = chan->TOW_ms;
+  snap->sample_count = chan->sample_count;
+  snap->code_phase_early = chan->code_phase_early;
+  snap->code_phase_rate = chan->code_phase_rate;
+  snap->carrier_phase = chan->carrier_phase;
+  snap->carrier_freq = chan->carrier_freq;
+  snap->I_filter = chan->I_filter;
+  snap->Q_filter = chan->Q_filter;
+
+  __asm__ __volatile__("" ::: "memory");
+  chan->snapshot_seq++;
+}
+
+/** Update a channel's bit of the ready mask, raising TRACKING_EVENT_READY
+ * if it changes. Call from the NAP ISR thread or with the kernel locked. */
+static void tracking_channel_ready_set(tracking_channel_t *chan, bool ready)
+{
+  u32 bit = 1u << (chan - tracking_channel);
+  if (ready == !!(tracking_ready & bit))
+    return;
+  if (ready)
+    tracking_ready |= bit;
+  else
+    tracking_ready &= ~bit;
+  tracking_events_pending |= TRACKING_EVENT_READY;
+}
+
+/** Broadcast the channel state transitions raised since the last broadcast.
+ * Call from thread context once the channels have been serviced. */
+static void tracking_events_flush(void)
+{
+  chSysLock();
+  u32 flags = tracking_events_pending;
+  tracking_events_pending = 0;
+  if (flags) {
+    chEvtBroadcastFlagsI(&tracking_events, flags);
+    chSchRescheduleS();
+  }
+  chSysUnlock();
+}
+
 /** Initialises a tracking channel.
  * Initialises a tracking channel on the Swift NAP. The start_sample_count
  * must be contrived to be at or close to a PRN edge (PROMPT code phase = 0).
@@ -87,6 +281,8 @@ float propagate_code_phase(float code_phase, float carrier_freq, u32 n_samples)
  */
 void tracking_channel_init(u8 channel, u8 prn, float carrier_freq, u32 start_sample_count)
 {
+  corr_trace_init(channel, prn, carrier_freq, start_sample_count);
+
   /* Calculate code phase rate with carrier aiding. */
   float code_phase_rate = (1 + carrier_freq/GPS_L1_HZ) * GPS_CA_CHIPPING_RATE;
 
@@ -105,11 +301,24 @@ void tracking_channel_init(u8 channel, u8 prn, float carrier_freq, u32 start_sam
   tracking_channel[channel].TOW_ms = -1;
   tracking_channel[channel].snr_above_threshold_count = 0;
   tracking_channel[channel].snr_below_threshold_count = 0;
+  tracking_channel[channel].lock_lost = false;
+  tracking_channel[channel].miss_count = 0;
+  tracking_channel[channel].miss_masked = NULL;
+  tracking_channel[channel].miss_masked_cycles = 0;
 
+#if TRACK_LOOP_FILTER == TRACK_LOOP_FILTER_SP
+  sp_tl_init(&(tracking_channel[channel].tl_state), 1e3,
+             code_phase_rate-1.023e6, TRACK_CODE_BW, 0.7, 1,
+             carrier_freq, TRACK_CARR_BW, 0.7, 1,
+             1, 1540, 5000);
+#else
   comp_tl_init(&(tracking_channel[channel].tl_state), 1e3,
-               code_phase_rate-1.023e6, 1, 0.7, 1,
-               carrier_freq, 25, 0.7, 1,
+               code_phase_rate-1.023e6, TRACK_CODE_BW, 0.7, 1,
+               carrier_freq, TRACK_CARR_BW, 0.7, 1,
                1, 1540, 5000);
+#endif
+  tracking_channel[channel].int_ms = 1;
+  tracking_channel[channel].int_count = 0;
 
   tracking_channel[channel].I_filter = 0;
   tracking_channel[channel].Q_filter = 0;
@@ -123,7 +332,20 @@ void tracking_channel_init(u8 channel, u8 prn, float carrier_freq, u32 start_sam
   tracking_channel[channel].carrier_freq_fp_prev = tracking_channel[channel].carrier_freq_fp;
   tracking_channel[channel].sample_count = start_sample_count;
 
+  /* Locked so the decoder sees the nav msg and its samples start afresh
+   * together, it runs above the threads that start channels so it can't be
+   * part way through a batch here. */
+  chSysLock();
   nav_msg_init(&tracking_channel[channel].nav_msg);
+  tracking_channel[channel].subframe_post_pending = false;
+  tracking_channel[channel].nav_TOW_pending = false;
+  nav_bit_ring[channel].head = 0;
+  nav_bit_ring[channel].tail = 0;
+  tracking_channel_ready_set(&tracking_channel[channel], false);
+  tracking_events_pending |= TRACKING_EVENT_STARTED;
+  tracking_channel_publish(&tracking_channel[channel]);
+  chSysUnlock();
+  tracking_events_flush();
 
   /* Starting carrier phase is set to zero as we don't
    * know the carrier freq well enough to calculate it.
@@ -163,6 +385,210 @@ void tracking_channel_get_corrs(u8 channel)
   }
 }
 
+/** Change the coherent integration period of a channel's loop filters.
+ * The filters are set up again for the new update rate starting from their
+ * current frequencies. The carrier loop bandwidth is narrowed if needed to
+ * keep it stable at the longer update period.
+ * \param chan   Tracking channel state.
+ * \param int_ms New integration period, (ms).
+ */
+static void tracking_channel_set_int(tracking_channel_t *chan, u8 int_ms)
+{
+  float loop_freq = 1e3f / int_ms;
+  float carr_bw = MIN(TRACK_CARR_BW, TRACK_CARR_BW_T_MAX * loop_freq);
+
+  /* Keep the carrier aiding schedule where it had got to. */
+  u32 n = chan->tl_state.n;
+#if TRACK_LOOP_FILTER == TRACK_LOOP_FILTER_SP
+  sp_tl_init(&chan->tl_state, loop_freq,
+             chan->tl_state.code_freq, TRACK_CODE_BW, 0.7, 1,
+             chan->tl_state.carr_freq, carr_bw, 0.7, 1,
+             1, 1540, 5000 / int_ms);
+#else
+  comp_tl_init(&chan->tl_state, loop_freq,
+               chan->tl_state.code_freq, TRACK_CODE_BW, 0.7, 1,
+               chan->tl_state.carr_freq, carr_bw, 0.7, 1,
+               1, 1540, 5000 / int_ms);
+#endif
+  chan->tl_state.n = n / int_ms;
+
+  chan->int_ms = int_ms;
+  chan->int_count = 0;
+}
+
+/** Run the loop filters on the correlations accumulated over a coherent
+ * integration and set the new code / carrier frequencies to be written to
+ * the SwiftNAP.
+ * \param chan Tracking channel state.
+ */
+static void tracking_channel_filter(tracking_channel_t *chan)
+{
+  corr_t *cs = chan->cs_acc;
+
+#if TRACK_LOOP_FILTER == TRACK_LOOP_FILTER_SP
+  /* Same correlation order as passed to comp_tl_update() below. */
+  corr_t cs2[3] = { cs[2], cs[1], cs[0] };
+  sp_tl_update(&(chan->tl_state), cs2);
+#else
+  /* TODO: Make this more elegant. */
+  correlation_t cs2[3];
+  for (u32 i = 0; i < 3; i++) {
+    cs2[i].I = cs[2-i].I;
+    cs2[i].Q = cs[2-i].Q;
+  }
+  comp_tl_update(&(chan->tl_state), cs2);
+#endif
+  chan->carrier_freq = chan->tl_state.carr_freq;
+  chan->code_phase_rate = chan->tl_state.code_freq + 1.023e6;
+
+#if TRACK_LOOP_FILTER == TRACK_LOOP_FILTER_SP
+  /* Only the offset from the nominal rate goes through single precision so
+   * no resolution is lost in the large nominal code phase rate. */
+  chan->code_phase_rate_fp = NAP_TRACK_NOMINAL_CODE_PHASE_RATE +
+    (s32)(chan->tl_state.code_freq * CODE_PHASE_RATE_UNITS_PER_HZ_F);
+  chan->carrier_freq_fp =
+    (s32)(chan->tl_state.carr_freq * CARRIER_FREQ_UNITS_PER_HZ_F);
+#else
+  chan->code_phase_rate_fp = chan->code_phase_rate*NAP_TRACK_CODE_PHASE_RATE_UNITS_PER_HZ;
+  chan->carrier_freq_fp = chan->carrier_freq*NAP_TRACK_CARRIER_FREQ_UNITS_PER_HZ;
+#endif
+}
+
+/** Take the TOW decoded from the nav message.
+ * \param chan   Tracking channel state.
+ * \param TOW_ms TOW at the current update, (ms).
+ */
+static void tracking_channel_set_tow(tracking_channel_t *chan, s32 TOW_ms)
+{
+  /* TODO: check TOW_ms = 0 case is correct, 0 is a valid TOW. */
+  if (TOW_ms > 0 && chan->TOW_ms != TOW_ms) {
+    if (chan->TOW_ms > 0) {
+      LOG_DEFERRED("PRN %d TOW mismatch: %d, %u\n", chan->prn + 1, chan->TOW_ms, TOW_ms);
+    } else {
+      tracking_events_pending |= TRACKING_EVENT_TOW;
+    }
+    chan->TOW_ms = TOW_ms;
+    ttff_mark_sample_count(TTFF_TOW, chan->sample_count);
+  }
+}
+
+/** Process the correlations of one ms for a running tracking channel.
+ * Update update_count, sample_count and TOW, buffer the prompt for the nav
+ * message decoder, and run the loop filters at the end of each coherent
+ * integration, leaving the code / carrier frequencies to write to the
+ * SwiftNAP in the channel state. The frequencies are held between loop
+ * filter updates, the UPDATE register must still be written after every
+ * process call, see nap_track_update_wr_blocking().
+ * \param chan Tracking channel state to update.
+ */
+static void tracking_channel_process(tracking_channel_t *chan)
+{
+  corr_trace_corr(chan - tracking_channel, chan->corr_sample_count, chan->cs);
+
+  chan->update_count++;
+  chan->sample_count += chan->corr_sample_count;
+  /* TODO: check TOW_ms = 0 case is correct, 0 is a valid TOW. */
+  if (chan->TOW_ms > 0) {
+    chan->TOW_ms++;
+    if (chan->TOW_ms == 7*24*60*60*1000)
+      chan->TOW_ms = 0;
+  }
+
+  chan->code_phase_early = (u64)chan->code_phase_early + (u64)chan->corr_sample_count*chan->code_phase_rate_fp_prev;
+  chan->carrier_phase += chan->carrier_freq_fp_prev * chan->corr_sample_count;
+  /* TODO: Fix this in the FPGA - first integration is one sample short. */
+  if (chan->update_count == 1)
+    chan->carrier_phase -= chan->carrier_freq_fp_prev;
+
+  /* Correlations should already be in chan->cs thanks to
+   * tracking_channel_get_corrs.
+   */
+  corr_t* cs = chan->cs;
+
+  /* Update I and Q magnitude filters for SNR calculation.
+   * filter = (1 - 2^-FILTER_COEFF)*filter + correlation_magnitude
+   * If filters are uninitialised (=0) then initialise them with the
+   * first set of correlations.
+   */
+  if (chan->I_filter == 0 && chan->Q_filter == 0) {
+    chan->I_filter = abs(cs[1].I) << I_FILTER_COEFF;
+    chan->Q_filter = abs(cs[1].Q) << Q_FILTER_COEFF;
+  } else {
+    chan->I_filter -= chan->I_filter >> I_FILTER_COEFF;
+    chan->I_filter += abs(cs[1].I);
+    chan->Q_filter -= chan->Q_filter >> Q_FILTER_COEFF;
+    chan->Q_filter += abs(cs[1].Q);
+  }
+
+  /* Lock detector, the filtered prompt SNR of tracking_channel_snr()
+   * compared without the division. */
+  if ((float)(chan->I_filter >> I_FILTER_COEFF) <
+      (float)TRACK_THRESHOLD * (chan->Q_filter >> Q_FILTER_COEFF)) {
+    chan->snr_below_threshold_count = chan->update_count;
+    if (!chan->lock_lost && chan->update_count > TRACK_SNR_INIT_COUNT &&
+        chan->update_count - chan->snr_above_threshold_count >
+          TRACK_SNR_THRES_COUNT) {
+      chan->lock_lost = true;
+      tracking_events_pending |= TRACKING_EVENT_LOST;
+    }
+  } else {
+    chan->snr_above_threshold_count = chan->update_count;
+  }
+
+  /* Leave the prompt for the nav bit decoder. */
+  nav_bit_ring_t *ring = &nav_bit_ring[chan - tracking_channel];
+  ring->I[ring->head % NAV_BIT_RING_LEN] = cs[1].I;
+  __asm__ __volatile__("" ::: "memory");
+  ring->head++;
+
+  /* The decoder found the TOW a few ms ago, bring it up to this ms. */
+  if (chan->nav_TOW_pending) {
+    chan->nav_TOW_pending = false;
+    s32 TOW_ms = (chan->nav_TOW_ms +
+                  (s32)(chan->update_count - chan->nav_TOW_count)) %
+                 (7*24*60*60*1000);
+    tracking_channel_set_tow(chan, TOW_ms);
+  }
+
+  /* The NAP keeps running at the frequencies last written, these take
+   * effect one integration after they are written. */
+  chan->code_phase_rate_fp_prev = chan->code_phase_rate_fp;
+  chan->carrier_freq_fp_prev = chan->carrier_freq_fp;
+
+  /* Once the TOW is known so are the nav bit edges, switch to integrating
+   * coherently over several ms within each bit. */
+  u8 int_ms = (chan->TOW_ms > 0 && track_int_ms > 0 &&
+               TRACK_INT_MS_MAX % track_int_ms == 0) ? track_int_ms : 1;
+  if (int_ms != chan->int_ms)
+    tracking_channel_set_int(chan, int_ms);
+
+  for (u8 i = 0; i < 3; i++) {
+    if (chan->int_count == 0) {
+      chan->cs_acc[i] = cs[i];
+    } else {
+      chan->cs_acc[i].I += cs[i].I;
+      chan->cs_acc[i].Q += cs[i].Q;
+    }
+  }
+  chan->int_count++;
+
+  /* TOW_ms is the time at the end of this integration, the loop filters run
+   * when it reaches a multiple of int_ms so that no integration spans a bit
+   * edge. A partial first integration is discarded. */
+  if (chan->int_ms == 1 || chan->TOW_ms % chan->int_ms == 0) {
+    if (chan->int_count == chan->int_ms)
+      tracking_channel_filter(chan);
+    chan->int_count = 0;
+  }
+
+  tracking_channel_ready_set(chan,
+    !chan->lock_lost && chan->TOW_ms > 0 &&
+    chan->update_count - chan->snr_below_threshold_count >
+      TRACK_SNR_THRES_COUNT);
+
+  tracking_channel_publish(chan);
+}
+
 /** Update tracking channels after the end of an integration period.
  * Update update_count, sample_count, TOW, run loop filters and update
  * SwiftNAP tracking channel frequencies.
@@ -175,75 +601,13 @@ void tracking_channel_update(u8 channel)
   switch(chan->state)
   {
     case TRACKING_RUNNING:
-    {
-      chan->update_count++;
-      chan->sample_count += chan->corr_sample_count;
-      /* TODO: check TOW_ms = 0 case is correct, 0 is a valid TOW. */
-      if (chan->TOW_ms > 0) {
-        chan->TOW_ms++;
-        if (chan->TOW_ms == 7*24*60*60*1000)
-          chan->TOW_ms = 0;
-      }
-
-      chan->code_phase_early = (u64)chan->code_phase_early + (u64)chan->corr_sample_count*chan->code_phase_rate_fp_prev;
-      chan->carrier_phase += chan->carrier_freq_fp_prev * chan->corr_sample_count;
-      /* TODO: Fix this in the FPGA - first integration is one sample short. */
-      if (chan->update_count == 1)
-        chan->carrier_phase -= chan->carrier_freq_fp_prev;
-
-      /* Correlations should already be in chan->cs thanks to
-       * tracking_channel_get_corrs.
-       */
-      corr_t* cs = chan->cs;
-
-      /* Update I and Q magnitude filters for SNR calculation.
-       * filter = (1 - 2^-FILTER_COEFF)*filter + correlation_magnitude
-       * If filters are uninitialised (=0) then initialise them with the
-       * first set of correlations.
-       */
-      if (chan->I_filter == 0 && chan->Q_filter == 0) {
-        chan->I_filter = abs(cs[1].I) << I_FILTER_COEFF;
-        chan->Q_filter = abs(cs[1].Q) << Q_FILTER_COEFF;
-      } else {
-        chan->I_filter -= chan->I_filter >> I_FILTER_COEFF;
-        chan->I_filter += abs(cs[1].I);
-        chan->Q_filter -= chan->Q_filter >> Q_FILTER_COEFF;
-        chan->Q_filter += abs(cs[1].Q);
-      }
-
-      /* Run the loop filters. */
-
-      /* TODO: Make this more elegant. */
-      correlation_t cs2[3];
-      for (u32 i = 0; i < 3; i++) {
-        cs2[i].I = cs[2-i].I;
-        cs2[i].Q = cs[2-i].Q;
-      }
-      comp_tl_update(&(chan->tl_state), cs2);
-      chan->carrier_freq = chan->tl_state.carr_freq;
-      chan->code_phase_rate = chan->tl_state.code_freq + 1.023e6;
-
-      /* TODO: check TOW_ms = 0 case is correct, 0 is a valid TOW. */
-      s32 TOW_ms = nav_msg_update(&chan->nav_msg, cs[1].I);
-
-      if (TOW_ms > 0 && chan->TOW_ms != TOW_ms) {
-        if (chan->TOW_ms > 0) {
-          printf("PRN %d TOW mismatch: %ld, %u\n",(int)chan->prn + 1, chan->TOW_ms, (unsigned int)TOW_ms);
-        }
-        chan->TOW_ms = TOW_ms;
-      }
-
-      chan->code_phase_rate_fp_prev = chan->code_phase_rate_fp;
-      chan->code_phase_rate_fp = chan->code_phase_rate*NAP_TRACK_CODE_PHASE_RATE_UNITS_PER_HZ;
-
-      chan->carrier_freq_fp_prev = chan->carrier_freq_fp;
-      chan->carrier_freq_fp = chan->carrier_freq*NAP_TRACK_CARRIER_FREQ_UNITS_PER_HZ;
-
+      tracking_channel_process(chan);
       nap_track_update_wr_blocking(channel, \
                          chan->carrier_freq_fp, \
                          chan->code_phase_rate_fp);
+      tracking_events_flush();
       break;
-    }
+
     case TRACKING_DISABLED:
     default:
       /* TODO: WTF? */
@@ -252,6 +616,152 @@ void tracking_channel_update(u8 channel)
   }
 }
 
+/* Called for each channel as its correlations arrive, while the read for the
+ * next channel is still in flight. */
+static void tracking_channel_corr_cb(u8 channel, u16 sample_count,
+                                     corr_t corrs[], void *context)
+{
+  (void)context;
+  tracking_channel_t* chan = &tracking_channel[channel];
+
+  chan->corr_sample_count = sample_count;
+  memcpy(chan->cs, corrs, sizeof(chan->cs));
+  tracking_channel_process(chan);
+}
+
+/** Sort the channels in a tracking interrupt mask into those whose
+ * correlations are to be read and those whose UPDATE registers need
+ * writing.
+ * \param channel_mask Bit mask of tracking channels to service.
+ * \param running      Set to the channels that are running.
+ * \param n_running    Set to the number of running channels.
+ * \param update       Set to all the channels in the mask.
+ * \return Number of channels in the mask.
+ */
+static u8 tracking_channels_pending(u32 channel_mask, u8 running[],
+                                    u8 *n_running, u8 update[])
+{
+  u8 n_update = 0;
+
+  *n_running = 0;
+  for (u8 n = 0; n < nap_track_n_channels && (channel_mask >> n); n++) {
+    if (!((channel_mask >> n) & 1))
+      continue;
+    if (tracking_channel[n].state == TRACKING_RUNNING)
+      running[(*n_running)++] = n;
+    update[n_update++] = n;
+  }
+  return n_update;
+}
+
+/** Get the frequencies to write to the UPDATE registers of the serviced
+ * channels once their correlations have been processed.
+ * \param n_update           Number of channels serviced.
+ * \param update             Channels serviced, the channels to write.
+ * \param carrier_freq_fp    Set to the carrier frequencies to write.
+ * \param code_phase_rate_fp Set to the code phase rates to write.
+ * \return Number of channels to write.
+ */
+static u8 tracking_channels_writes(u8 n_update, u8 update[],
+                                   s32 carrier_freq_fp[],
+                                   u32 code_phase_rate_fp[])
+{
+  /* Every serviced channel's UPDATE register is written, even when its loop
+   * filters didn't run this time, or the NAP flags a missed deadline. Running
+   * channels are sent the frequencies held from their last loop filter
+   * update. */
+  for (u8 i = 0; i < n_update; i++) {
+    tracking_channel_t* chan = &tracking_channel[update[i]];
+    if (chan->state == TRACKING_RUNNING) {
+      carrier_freq_fp[i] = chan->carrier_freq_fp;
+      code_phase_rate_fp[i] = chan->code_phase_rate_fp;
+    } else {
+      /* Write zero frequencies to stop the channel raising interrupts, see
+       * tracking_channel_disable(). */
+      chan->state = TRACKING_DISABLED;
+      tracking_channel_publish(chan);
+      carrier_freq_fp[i] = 0;
+      code_phase_rate_fp[i] = 0;
+    }
+  }
+  return n_update;
+}
+
+/** Service a set of tracking channels after the end of an integration period.
+ * Equivalent to calling tracking_channel_get_corrs() and
+ * tracking_channel_update() for each channel in the mask, but the
+ * correlation reads are pipelined so that each channel's loop filter runs
+ * while the next channel's correlations are being read, and the UPDATE
+ * registers are written in one batch at the end.
+ * \param channel_mask Bit mask of tracking channels to service, bit n is
+ *                     channel n.
+ */
+void tracking_channels_update(u32 channel_mask)
+{
+  u8 running[NAP_MAX_N_TRACK_CHANNELS];
+  u8 n_running;
+  u8 update[NAP_MAX_N_TRACK_CHANNELS];
+  s32 carrier_freq_fp[NAP_MAX_N_TRACK_CHANNELS];
+  u32 code_phase_rate_fp[NAP_MAX_N_TRACK_CHANNELS];
+
+  u8 n_update = tracking_channels_pending(channel_mask, running, &n_running,
+                                          update);
+  if (n_update == 0)
+    return;
+
+  nap_track_corr_rd_pipelined_blocking(n_running, running,
+                                       &tracking_channel_corr_cb, NULL);
+
+  u8 n_write = tracking_channels_writes(n_update, update, carrier_freq_fp,
+                                        code_phase_rate_fp);
+  if (n_write > 0)
+    nap_track_update_wr_batch_blocking(n_write, update,
+                                       carrier_freq_fp, code_phase_rate_fp);
+
+  tracking_events_flush();
+}
+
+/** Service a set of tracking channels from the NAP ISR, see
+ * NAP_TRACK_IN_ISR. The same as tracking_channels_update() but every
+ * register access is polled, nothing here sleeps or takes a lock. The SPI
+ * bus must already be held with spi_slave_try_select_i().
+ * \param channel_mask Bit mask of tracking channels to service, bit n is
+ *                     channel n.
+ */
+void tracking_channels_update_polled(u32 channel_mask)
+{
+  u8 running[NAP_MAX_N_TRACK_CHANNELS];
+  u8 n_running;
+  u8 update[NAP_MAX_N_TRACK_CHANNELS];
+  s32 carrier_freq_fp[NAP_MAX_N_TRACK_CHANNELS];
+  u32 code_phase_rate_fp[NAP_MAX_N_TRACK_CHANNELS];
+
+  u8 n_update = tracking_channels_pending(channel_mask, running, &n_running,
+                                          update);
+  if (n_update == 0)
+    return;
+
+  for (u8 i = 0; i < n_running; i++) {
+    u16 sample_count;
+    corr_t corrs[3];
+    nap_track_corr_rd_polled(running[i], &sample_count, corrs);
+    tracking_channel_corr_cb(running[i], sample_count, corrs, NULL);
+  }
+
+  u8 n_write = tracking_channels_writes(n_update, update, carrier_freq_fp,
+                                        code_phase_rate_fp);
+  for (u8 i = 0; i < n_write; i++)
+    nap_track_update_wr_polled(update[i], carrier_freq_fp[i],
+                               code_phase_rate_fp[i]);
+
+  chSysLockFromIsr();
+  if (tracking_events_pending) {
+    chEvtBroadcastFlagsI(&tracking_events, tracking_events_pending);
+    tracking_events_pending = 0;
+  }
+  chSysUnlockFromIsr();
+}
+
 /** Disable tracking channel.
  * Change tracking channel state to TRACKING_DISABLED and write 0 to SwiftNAP
  * tracking channel code / carrier frequencies to stop channel from raising
@@ -260,28 +770,203 @@ void tracking_channel_update(u8 channel)
  */
 void tracking_channel_disable(u8 channel)
 {
+  corr_trace_disable(channel);
   nap_track_update_wr_blocking(channel, 0, 0);
   tracking_channel[channel].state = TRACKING_DISABLED;
+
+  chSysLock();
+  tracking_channel_ready_set(&tracking_channel[channel], false);
+  tracking_events_pending |= TRACKING_EVENT_LOST;
+  tracking_channel_publish(&tracking_channel[channel]);
+  chSysUnlock();
+
+  tracking_events_flush();
+}
+
+/** Listen for tracking channel state transitions.
+ * The listening thread is signalled with `events` as soon as any channel
+ * makes one of the TRACKING_EVENT_* transitions, chEvtGetAndClearFlags()
+ * on the listener says which. The flags don't say which channels, look at
+ * the channels that could have made the transition, e.g. the lock_lost ones
+ * for TRACKING_EVENT_LOST, or at tracking_channels_ready_mask().
+ * \param el     Listener, must remain valid while registered.
+ * \param events Events to signal the calling thread with.
+ */
+void tracking_events_register(EventListener *el, eventmask_t events)
+{
+  chEvtRegisterMask(&tracking_events, el, events);
+}
+
+/** Raise a transition from outside the tracking loop, e.g.
+ * TRACKING_EVENT_EPHEMERIS. Call from thread context.
+ * \param flags TRACKING_EVENT_* flags to broadcast.
+ */
+void tracking_events_broadcast(u32 flags)
+{
+  chSysLock();
+  tracking_events_pending |= flags;
+  chSysUnlock();
+  tracking_events_flush();
+}
+
+/** Channels ready to be used in a solution as far as tracking goes, i.e.
+ * running, with a TOW and with the SNR above TRACK_THRESHOLD for at least
+ * TRACK_SNR_THRES_COUNT. Kept up to date by the tracking loop, changes
+ * raise TRACKING_EVENT_READY.
+ * \return Bit mask of channels, bit n is channel n.
+ */
+u32 tracking_channels_ready_mask(void)
+{
+  return tracking_ready;
+}
+
+/** Count missed UPDATE deadlines.
+ * Called by the NAP thread, or the NAP ISR with NAP_TRACK_IN_ISR, with the
+ * tracking channel bits of the NAP error register, see nap_exti.c. A channel
+ * missed if its interrupt fired again before the last one was serviced, so
+ * its UPDATE register wasn't written in time either.
+ * \param channel_mask  Channels that missed, bit n is channel n.
+ * \param masked        Name of the longest interrupt masked section since
+ *                      the error register was last read, NULL if none.
+ * \param masked_cycles Length of that section (cycles).
+ */
+void tracking_channels_missed(u32 channel_mask, const char *masked,
+                              u32 masked_cycles)
+{
+  u8 n_running = 0;
+  for (u8 i = 0; i < nap_track_n_channels; i++)
+    if (tracking_channel[i].state == TRACKING_RUNNING)
+      n_running++;
+
+  for (u8 n = 0; n < nap_track_n_channels && (channel_mask >> n); n++) {
+    if (!((channel_mask >> n) & 1))
+      continue;
+    tracking_channel_t *chan = &tracking_channel[n];
+    chan->miss_count++;
+    chan->miss_update_count = chan->update_count;
+    chan->miss_n_running = n_running;
+    chan->miss_masked = masked;
+    chan->miss_masked_cycles = masked_cycles;
+  }
+}
+
+/** Decode the nav message from the prompt I samples the tracking channels
+ * have buffered since the last call.
+ * Bit sync, preamble search and subframe assembly used to run on every
+ * 1 ms update in the NAP ISR thread, here they run on up to
+ * NAV_BIT_RING_LEN ms at a time from a lower priority thread, see main.c.
+ * Must be called at least every NAV_BIT_RING_LEN ms, a channel that has
+ * overrun its buffer starts decoding again from scratch. Must run above the
+ * threads that start tracking channels, see tracking_channel_init().
+ */
+void tracking_nav_bits_process(void)
+{
+  for (u8 i = 0; i < nap_track_n_channels; i++) {
+    tracking_channel_t *chan = &tracking_channel[i];
+    nav_bit_ring_t *ring = &nav_bit_ring[i];
+    if (chan->state != TRACKING_RUNNING)
+      continue;
+
+    u32 head = ring->head;
+    __asm__ __volatile__("" ::: "memory");
+    if (head - ring->tail > NAV_BIT_RING_LEN) {
+      LOG_DEFERRED("PRN %d nav bits overrun\n", chan->prn + 1);
+      nav_msg_init(&chan->nav_msg);
+      ring->tail = head;
+      continue;
+    }
+
+    for (; ring->tail != head; ring->tail++) {
+      bool subframe_ready = chan->nav_msg.subframe_start_index != 0;
+      s32 TOW_ms = nav_msg_update(&chan->nav_msg,
+                                  ring->I[ring->tail % NAV_BIT_RING_LEN]);
+
+      /* Wake the nav msg thread when a new subframe has been received. */
+      if (!subframe_ready && chan->nav_msg.subframe_start_index) {
+        chan->subframe_post_pending =
+          chMBPost(&subframe_mailbox, i, TIME_IMMEDIATE) != RDY_OK;
+        if (chan->subframe_post_pending)
+          LOG_DEFERRED("PRN %d subframe mailbox full\n", chan->prn + 1);
+      }
+
+      if (TOW_ms > 0) {
+        chSysLock();
+        chan->nav_TOW_ms = TOW_ms;
+        chan->nav_TOW_count = ring->tail + 1;
+        chan->nav_TOW_pending = true;
+        chSysUnlock();
+      }
+    }
+
+    /* Retry a post that found the mailbox full for as long as the subframe
+     * is still waiting to be processed. */
+    if (!chan->nav_msg.subframe_start_index)
+      chan->subframe_post_pending = false;
+    else if (chan->subframe_post_pending &&
+             chMBPost(&subframe_mailbox, i, TIME_IMMEDIATE) == RDY_OK)
+      chan->subframe_post_pending = false;
+  }
+}
+
+/** Wait for a tracking channel to receive a new nav msg subframe.
+ * \param timeout Maximum time to wait, or TIME_INFINITE.
+ * \return Channel number with a subframe ready to process, or -1 on timeout.
+ */
+s8 tracking_wait_subframe(systime_t timeout)
+{
+  msg_t channel;
+  if (chMBFetch(&subframe_mailbox, &channel, timeout) != RDY_OK)
+    return -1;
+  return channel;
+}
+
+/** Take a consistent copy of a tracking channel's last published parameters.
+ * Lock free, if the NAP ISR thread publishes new parameters part way through
+ * the copy it is simply retried.
+ * \param channel Tracking channel to read.
+ * \param snap Pointer to tracking_channel_snapshot_t where the copy will be put.
+ */
+void tracking_channel_snapshot(u8 channel, tracking_channel_snapshot_t *snap)
+{
+  tracking_channel_t* chan = &tracking_channel[channel];
+  u32 seq;
+
+  do {
+    seq = chan->snapshot_seq;
+    __asm__ __volatile__("" ::: "memory");
+    memcpy(snap, &chan->snapshot, sizeof(*snap));
+    __asm__ __volatile__("" ::: "memory");
+  } while ((seq & 1) || seq != chan->snapshot_seq);
+}
+
+/** Calculate SNR from a tracking channel snapshot. */
+static float snapshot_snr(const tracking_channel_snapshot_t *snap)
+{
+  /* Calculate SNR from I and Q filtered magnitudes. */
+  return (float)(snap->I_filter >> I_FILTER_COEFF) / \
+                (snap->Q_filter >> Q_FILTER_COEFF);
 }
 
 /** Update channel measurement for a tracking channel.
+ * Safe to call from any thread without masking interrupts.
  * \param channel Tracking channel to update measurement from.
  * \param meas Pointer to channel_measurement_t where measurement will be put.
  */
 void tracking_update_measurement(u8 channel, channel_measurement_t *meas)
 {
-  tracking_channel_t* chan = &tracking_channel[channel];
+  tracking_channel_snapshot_t snap;
+  tracking_channel_snapshot(channel, &snap);
 
   /* Update our channel measurement. */
-  meas->prn = chan->prn;
-  meas->code_phase_chips = (double)chan->code_phase_early / NAP_TRACK_CODE_PHASE_UNITS_PER_CHIP;
-  meas->code_phase_rate = chan->code_phase_rate;
-  meas->carrier_phase = chan->carrier_phase / (double)(1<<24);
-  meas->carrier_freq = chan->carrier_freq;
-  meas->time_of_week_ms = chan->TOW_ms;
-  meas->receiver_time = (double)chan->sample_count / SAMPLE_FREQ;
-  meas->snr = tracking_channel_snr(channel);
-  if (chan->nav_msg.inverted) {
+  meas->prn = snap.prn;
+  meas->code_phase_chips = (double)snap.code_phase_early / NAP_TRACK_CODE_PHASE_UNITS_PER_CHIP;
+  meas->code_phase_rate = snap.code_phase_rate;
+  meas->carrier_phase = snap.carrier_phase / (double)(1<<24);
+  meas->carrier_freq = snap.carrier_freq;
+  meas->time_of_week_ms = snap.TOW_ms;
+  meas->receiver_time = (double)snap.sample_count / SAMPLE_FREQ;
+  meas->snr = snapshot_snr(&snap);
+  if (snap.inverted) {
     meas->carrier_phase += 0.5;
   }
 }
@@ -291,9 +976,9 @@ void tracking_update_measurement(u8 channel, channel_measurement_t *meas)
  */
 float tracking_channel_snr(u8 channel)
 {
-  /* Calculate SNR from I and Q filtered magnitudes. */
-  return (float)(tracking_channel[channel].I_filter >> I_FILTER_COEFF) / \
-                (tracking_channel[channel].Q_filter >> Q_FILTER_COEFF);
+  tracking_channel_snapshot_t snap;
+  tracking_channel_snapshot(channel, &snap);
+  return snapshot_snr(&snap);
 }
 
 /** Send tracking state SBP message.
@@ -302,8 +987,9 @@ float tracking_channel_snr(u8 channel)
 void tracking_send_state()
 {
 
-  tracking_state_msg_t states[nap_track_n_channels];
+  tracking_state_msg_t states[NAP_MAX_N_TRACK_CHANNELS];
 
+#if BUILD_SIMULATOR
   if (simulation_enabled_for(SIMULATION_MODE_TRACKING)) {
 
     u8 num_sats = simulation_current_num_sats();
@@ -318,13 +1004,17 @@ void tracking_send_state()
       }
     }
 
-  } else {
+  } else
+#endif
+  {
 
     for (u8 i=0; i<nap_track_n_channels; i++) {
-      states[i].state = tracking_channel[i].state;
-      states[i].prn = tracking_channel[i].prn;
-      if (tracking_channel[i].state == TRACKING_RUNNING)
-        states[i].cn0 = tracking_channel_snr(i);
+      tracking_channel_snapshot_t snap;
+      tracking_channel_snapshot(i, &snap);
+      states[i].state = snap.state;
+      states[i].prn = snap.prn;
+      if (snap.state == TRACKING_RUNNING)
+        states[i].cn0 = snapshot_snr(&snap);
       else
         states[i].cn0 = -1;
     }
@@ -335,4 +1025,52 @@ void tracking_send_state()
 
 }
 
+/** Send MSG_TRACKING_STATE_EXT for every channel that is running or has
+ * missed a deadline since it was started. */
+void tracking_send_state_ext(void)
+{
+  for (u8 i = 0; i < nap_track_n_channels; i++) {
+    tracking_channel_t *chan = &tracking_channel[i];
+    tracking_channel_snapshot_t snap;
+    tracking_channel_snapshot(i, &snap);
+
+    msg_tracking_state_ext_t msg;
+    memset(&msg, 0, sizeof(msg));
+
+    chSysLock();
+    msg.miss_count = chan->miss_count;
+    msg.miss_age = chan->update_count - chan->miss_update_count;
+    msg.miss_n_running = chan->miss_n_running;
+    const char *masked = chan->miss_masked;
+    msg.miss_masked_cycles = chan->miss_masked_cycles;
+    chSysUnlock();
+
+    if (snap.state != TRACKING_RUNNING && msg.miss_count == 0)
+      continue;
+
+    msg.channel = i;
+    msg.state = snap.state;
+    msg.prn = snap.prn;
+    msg.cn0 = snap.state == TRACKING_RUNNING ? snapshot_snr(&snap) : -1;
+    if (msg.miss_count == 0)
+      msg.miss_age = 0;
+    if (masked)
+      strncpy(msg.miss_masked, masked, sizeof(msg.miss_masked));
+    sbp_send_msg(MSG_TRACKING_STATE_EXT, sizeof(msg), (u8 *)&msg);
+  }
+}
+
+/** Coherent integration period the loop filters switch to once a channel
+ * has bit sync, the `track` / `int_ms` setting. (ms) */
+u8 tracking_int_ms(void)
+{
+  return track_int_ms;
+}
+
+/** Register the tracking settings. */
+void tracking_setup(void)
+{
+  SETTING("track", "int_ms", track_int_ms, TYPE_INT);
+}
+
 /** \} */
@@ -17,6 +17,8 @@
 #include <libswiftnav/nav_msg.h>
 #include <libswiftnav/track.h>
 
+#include <ch.h>
+
 #include "board/nap/nap_common.h"
 #include "board/nap/track_channel.h"
 
@@ -29,6 +31,76 @@
 #define TRACKING_DISABLED 0 /**< Tracking channel disabled state. */
 #define TRACKING_RUNNING  1 /**< Tracking channel running state. */
 
+/* Tracking loop filter parameters. */
+#define TRACK_CODE_BW   1   /**< Code loop noise bandwidth, (Hz). */
+#define TRACK_CARR_BW   25  /**< Carrier loop noise bandwidth, (Hz). */
+/** Largest carrier loop noise bandwidth times loop update period used with
+ * long coherent integrations, keeps the loop stable as the period grows. */
+#define TRACK_CARR_BW_T_MAX 0.1f
+/** Longest coherent integration, one nav bit, (ms). */
+#define TRACK_INT_MS_MAX 20
+
+/* Tracking channel state transitions, the event flags broadcast to
+ * listeners registered with tracking_events_register(). */
+#define TRACKING_EVENT_STARTED   (1 << 0) /**< A channel was started. */
+#define TRACKING_EVENT_TOW       (1 << 1) /**< A channel found bit sync and
+                                               its TOW. */
+#define TRACKING_EVENT_READY     (1 << 2) /**< tracking_channels_ready_mask()
+                                               changed. */
+#define TRACKING_EVENT_EPHEMERIS (1 << 3) /**< An ephemeris changed. */
+#define TRACKING_EVENT_LOST      (1 << 4) /**< A channel lost lock or was
+                                               disabled. */
+
+/** SNR below which a channel may have lost its satellite. */
+#define TRACK_THRESHOLD 2.0
+/** Updates after starting before a channel can be taken to have lost lock. */
+#define TRACK_SNR_INIT_COUNT 5000
+/** Updates below TRACK_THRESHOLD after which a channel has lost lock, and
+ * that a channel has to be back above it for before it is used again. */
+#define TRACK_SNR_THRES_COUNT 2000
+
+/** Prompt I samples buffered per channel for the nav bit decoder, must be a
+ * power of two. Covers a few decoder periods of delay. */
+#define NAV_BIT_RING_LEN  64
+/** Period the nav bit decoder drains the buffers at, (ms). */
+#define NAV_BIT_PERIOD_MS 10
+
+/* Tracking loop filter implementations, select one with TRACK_LOOP_FILTER. */
+/** libswiftnav comp_tl_update() on libswiftnav correlation_t. */
+#define TRACK_LOOP_FILTER_COMP_TL 0
+/** Single precision port of comp_tl_update() working directly on corr_t. */
+#define TRACK_LOOP_FILTER_SP      1
+
+#ifndef TRACK_LOOP_FILTER
+#define TRACK_LOOP_FILTER TRACK_LOOP_FILTER_COMP_TL
+#endif
+
+/** Max number of tracking channels used, whichever loop filter is built.
+ * The 9 that manage_acq() has always set, the channel count the tracking
+ * loops are known to keep up with at 1 kHz. */
+#define TRACK_MAX_N_CHANNELS 9
+
+/** Single precision PI loop filter state. */
+typedef struct {
+  float pgain;      /**< Proportional gain. */
+  float igain;      /**< Integral gain. */
+  float prev_error; /**< Previous discriminator output. */
+  float y;          /**< Filter output. */
+} track_sp_lf_state_t;
+
+/** Single precision complementary tracking loop state, the same fields as
+ * libswiftnav's comp_tl_state_t. */
+typedef struct {
+  float carr_freq;              /**< Carrier frequency in Hz. */
+  float code_freq;              /**< Code frequency offset from nominal in Hz. */
+  track_sp_lf_state_t carr_filt; /**< Carrier loop filter state. */
+  track_sp_lf_state_t code_filt; /**< Code loop filter state. */
+  u32 n;                        /**< Updates since initialisation. */
+  u32 sched;                    /**< Updates before carrier aiding starts. */
+  float carr_to_code;           /**< Code to carrier frequency ratio. */
+  float A;                      /**< Complementary filter coefficient. */
+} track_sp_tl_state_t;
+
 /** Message struct for SBP tracking state message. */
 typedef struct __attribute__((packed)) {
   u8 state;  /**< State of the tracking channel. */
@@ -36,6 +108,25 @@ typedef struct __attribute__((packed)) {
   float cn0; /**< SNR of the tracking channel. */
 } tracking_state_msg_t;
 
+/** Copy of the tracking channel parameters needed to form a measurement.
+ * Published by the NAP ISR thread at the end of each update so that other
+ * threads can read a consistent set without masking interrupts, see
+ * tracking_channel_snapshot().
+ */
+typedef struct {
+  u8 state;                    /**< Tracking channel state. */
+  u8 prn;                      /**< CA Code (0-31) channel is tracking. */
+  u8 inverted;                 /**< Nav msg polarity is inverted. */
+  s32 TOW_ms;                  /**< TOW in ms. */
+  u32 sample_count;            /**< Total num samples channel has tracked for. */
+  u32 code_phase_early;        /**< Early code phase. */
+  double code_phase_rate;      /**< Code phase rate in chips/s. */
+  s64 carrier_phase;           /**< Carrier phase in NAP register units. */
+  double carrier_freq;         /**< Carrier frequency Hz. */
+  u32 I_filter;                /**< Filtered Prompt I correlations. */
+  u32 Q_filter;                /**< Filtered Prompt Q correlations. */
+} tracking_channel_snapshot_t;
+
 /** Tracking channel parameters as of end of last correlation period. */
 typedef struct {
   u8 state;                    /**< Tracking channel state. */
@@ -44,10 +135,17 @@ typedef struct {
   s32 TOW_ms;                  /**< TOW in ms. */
   u32 snr_above_threshold_count;     /**< update_count value when SNR was last above a certain margin. */
   u32 snr_below_threshold_count;     /**< update_count value when SNR was last below a certain margin. */
+  bool lock_lost;              /**< SNR has been below TRACK_THRESHOLD for
+                                    TRACK_SNR_THRES_COUNT, see
+                                    TRACKING_EVENT_LOST. */
   u8 prn;                      /**< CA Code (0-31) channel is tracking. */
   u32 sample_count;            /**< Total num samples channel has tracked for. */
   u32 code_phase_early;        /**< Early code phase. */
+#if TRACK_LOOP_FILTER == TRACK_LOOP_FILTER_SP
+  track_sp_tl_state_t tl_state; /**< Tracking loop filter state. */
+#else
   comp_tl_state_t tl_state;    /**< Tracking loop filter state. */
+#endif
   double code_phase_rate;      /**< Code phase rate in chips/s. */
   u32 code_phase_rate_fp;      /**< Code phase rate in NAP register units. */
   u32 code_phase_rate_fp_prev; /**< Previous code phase rate in NAP register units. */
@@ -59,7 +157,29 @@ typedef struct {
   u32 Q_filter;                /**< Filtered Prompt Q correlations. */
   u16 corr_sample_count;       /**< Number of samples in correlation period. */
   corr_t cs[3];                /**< EPL correlation results in correlation period. */
-  nav_msg_t nav_msg;           /**< Navigation message of channel SV. */
+  u8 int_ms;                   /**< Loop filter coherent integration period, ms. */
+  u8 int_count;                /**< Number of ms accumulated in cs_acc. */
+  corr_t cs_acc[3];            /**< EPL correlations accumulated over int_ms. */
+  nav_msg_t nav_msg;           /**< Navigation message of channel SV, owned by
+                                    the nav bit decoder, see
+                                    tracking_nav_bits_process(). */
+  bool nav_TOW_pending;        /**< The decoder has found the TOW. */
+  s32 nav_TOW_ms;              /**< TOW the decoder found, (ms). */
+  u32 nav_TOW_count;           /**< update_count of the sample nav_TOW_ms is
+                                    the TOW at. */
+  bool subframe_post_pending;  /**< Subframe ready but the mailbox was full
+                                    when it was posted, owned by the nav bit
+                                    decoder. */
+  u32 miss_count;              /**< UPDATE deadlines missed since the channel
+                                    was started, see
+                                    tracking_channels_missed(). */
+  u32 miss_update_count;       /**< update_count at the last miss. */
+  u8 miss_n_running;           /**< Channels running at the last miss. */
+  const char *miss_masked;     /**< Longest interrupt masked section around
+                                    the last miss, NULL if none. */
+  u32 miss_masked_cycles;      /**< Length of miss_masked (cycles). */
+  volatile u32 snapshot_seq;   /**< Snapshot sequence count, odd while being written. */
+  tracking_channel_snapshot_t snapshot; /**< Last published parameters. */
 } tracking_channel_t;
 
 /** \} */
@@ -74,9 +194,22 @@ void tracking_channel_init(u8 channel, u8 prn, float carrier_freq, u32 start_sam
 
 void tracking_channel_get_corrs(u8 channel);
 void tracking_channel_update(u8 channel);
+void tracking_channels_update(u32 channel_mask);
+void tracking_channels_update_polled(u32 channel_mask);
 void tracking_channel_disable(u8 channel);
+void tracking_channels_missed(u32 channel_mask, const char *masked,
+                              u32 masked_cycles);
+void tracking_nav_bits_process(void);
+s8 tracking_wait_subframe(systime_t timeout);
+void tracking_events_register(EventListener *el, eventmask_t events);
+void tracking_events_broadcast(u32 flags);
+u32 tracking_channels_ready_mask(void);
+void tracking_channel_snapshot(u8 channel, tracking_channel_snapshot_t *snap);
 void tracking_update_measurement(u8 channel, channel_measurement_t *meas);
 float tracking_channel_snr(u8 channel);
 void tracking_send_state(void);
+void tracking_send_state_ext(void);
+u8 tracking_int_ms(void);
+void tracking_setup(void);
 
 #endif
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <ch.h>
+
+#include "board/nap/nap_common.h"
+#include "main.h"
+#include "sbp.h"
+#include "timebase.h"
+#include "ttff.h"
+
+/** \defgroup ttff Time to first fix
+ * Records when each of the startup milestones is first reached, and the
+ * acquisition effort spent on each PRN, and reports them in MSG_TTFF and
+ * MSG_TTFF_PRN.
+ *
+ * Milestones are timestamped with the NAP timing count, which only runs once
+ * the FPGA is configured. The kernel time at that point ties the NAP counts
+ * back to boot, all times are reported in ms since chSysInit().
+ * \{ */
+
+/** Kernel time the NAP was configured at. (ms) */
+static u32 nap_conf_ms = 0;
+/** NAP timing count the NAP was configured at. */
+static u64 nap_conf_tc = 0;
+
+static msg_ttff_t ttff;
+static msg_ttff_prn_t ttff_prn;
+
+/** Milestones reached in the NAP ISR thread, waiting for ttff_send() to
+ * extend their sample counts to a full NAP timing count. */
+static volatile bool pending[TTFF_N_MILESTONES];
+static volatile u32 pending_sample_count[TTFF_N_MILESTONES];
+
+/** Something has changed since the last send. */
+static bool dirty = false;
+
+static u32 tc_to_ms(u64 tc)
+{
+  return nap_conf_ms + (s64)(tc - nap_conf_tc) * 1000 / SAMPLE_FREQ;
+}
+
+/** Record the FPGA finishing configuring. Call as soon as the NAP has been
+ * set up, nothing is recorded before this. */
+void ttff_nap_configured(void)
+{
+  nap_conf_ms = chTimeNow() * 1000 / CH_FREQUENCY;
+  nap_conf_tc = timebase_now();
+  /* A milestone time of 0 means not reached yet. */
+  ttff.ms[TTFF_NAP_CONF] = nap_conf_ms ? nap_conf_ms : 1;
+  dirty = true;
+}
+
+/** Record a milestone being reached now, if it hasn't been already.
+ * Uses timebase_now() so only call from a thread. For the NAP ISR
+ * thread use ttff_mark_sample_count(). */
+void ttff_mark(ttff_milestone_t m)
+{
+  if (!ttff.ms[TTFF_NAP_CONF] || ttff.ms[m])
+    return;
+  ttff.ms[m] = tc_to_ms(timebase_now());
+  dirty = true;
+}
+
+/** Record a milestone being reached at a sample count, if it hasn't been
+ * already. Doesn't make any NAP accesses so is safe from the NAP ISR
+ * thread, the time is filled in by the next ttff_send().
+ * \param m            Milestone reached.
+ * \param sample_count Low 32 bits of the NAP timing count it was reached at.
+ */
+void ttff_mark_sample_count(ttff_milestone_t m, u32 sample_count)
+{
+  if (ttff.ms[m] || pending[m])
+    return;
+  pending_sample_count[m] = sample_count;
+  __asm__ __volatile__("" ::: "memory");
+  pending[m] = true;
+}
+
+/** Count a coarse acquisition search for a PRN. */
+void ttff_acq_attempt(u8 prn)
+{
+  if (ttff_prn.attempts[prn] < 0xFFFF)
+    ttff_prn.attempts[prn]++;
+  dirty = true;
+}
+
+/** Record a coarse acquisition above threshold for a PRN. */
+void ttff_acq_hit(u8 prn)
+{
+  ttff_mark(TTFF_ACQ_HIT);
+  if (!ttff_prn.first_hit_ms[prn] && ttff.ms[TTFF_NAP_CONF]) {
+    ttff_prn.first_hit_ms[prn] = tc_to_ms(timebase_now());
+    dirty = true;
+  }
+}
+
+/** Send the milestones if anything has changed, or every
+ * TTFF_SEND_PERIOD_MS regardless. Call periodically from a thread. */
+void ttff_send(void)
+{
+  static systime_t last_send = 0;
+
+  if (ttff.ms[TTFF_NAP_CONF]) {
+    u64 now = 0;
+    for (u8 m = 0; m < TTFF_N_MILESTONES; m++) {
+      if (!pending[m])
+        continue;
+      if (!now)
+        now = timebase_now();
+      /* Sample counts wrap every 262 s, much longer than this is called. */
+      u64 tc = now - (u32)((u32)now - pending_sample_count[m]);
+      if (!ttff.ms[m])
+        ttff.ms[m] = tc_to_ms(tc);
+      pending[m] = false;
+      dirty = true;
+    }
+  }
+
+  if (!dirty && chTimeNow() - last_send < MS2ST(TTFF_SEND_PERIOD_MS))
+    return;
+
+  sbp_send_msg(MSG_TTFF, sizeof(ttff), (u8 *)&ttff);
+  sbp_send_msg(MSG_TTFF_PRN, sizeof(ttff_prn), (u8 *)&ttff_prn);
+  dirty = false;
+  last_send = chTimeNow();
+}
+
+/** \} */
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef SWIFTNAV_TTFF_H
+#define SWIFTNAV_TTFF_H
+
+#include <libswiftnav/common.h>
+
+/** \addtogroup ttff
+ * \{ */
+
+/** Startup milestones, in the order they are normally reached. Boot is the
+ * origin all the times are relative to. */
+typedef enum {
+  TTFF_NAP_CONF = 0,  /**< FPGA configured, NAP set up. */
+  TTFF_ACQ_LOAD,      /**< First acquisition sample ram load done. */
+  TTFF_ACQ_HIT,       /**< First coarse acquisition above threshold. */
+  TTFF_TRACK,         /**< First tracking channel started. */
+  TTFF_TOW,           /**< First bit sync, a channel's TOW is known. */
+  TTFF_EPHEMERIS,     /**< First valid ephemeris decoded. */
+  TTFF_PVT,           /**< First successful calc_PVT(). */
+  TTFF_FIXED,         /**< First fixed RTK baseline. */
+  TTFF_N_MILESTONES
+} ttff_milestone_t;
+
+/** Longest time between sends of the milestones when nothing changes. (ms) */
+#define TTFF_SEND_PERIOD_MS 10000
+
+/** \} */
+
+void ttff_nap_configured(void);
+void ttff_mark(ttff_milestone_t m);
+void ttff_mark_sample_count(ttff_milestone_t m, u32 sample_count);
+void ttff_acq_attempt(u8 prn);
+void ttff_acq_hit(u8 prn);
+void ttff_send(void);
+
+#endif  /* SWIFTNAV_TTFF_H */
@@ -73,11 +73,11 @@ int main(void)
     acq_schedule_load(nap_timing_count() + 1000);
     while(!(acq_get_load_done()));
 
-    nap_acq_code_wr_blocking(prn);
-    acq_start(prn, 0, 1023, -7000, 7000, 300);
-    while(!(acq_get_done()));
+    nap_acq_code_wr_blocking(0, prn);
+    acq_start(0, prn, 0, 1023, -7000, 7000, 300);
+    while(!(acq_get_done(0)));
 
-    acq_get_results(&code_phase, &carrier_freq, &snr);
+    acq_get_results(0, &code_phase, &carrier_freq, &snr);
     acq_send_result(prn, snr, code_phase, carrier_freq);
 
     printf("PRN %2u - CP: %7.2f, CF: % 7.1f, SNR: %5.2f", prn+1, code_phase, carrier_freq, snr);
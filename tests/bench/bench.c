@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdio.h>
+#include <libopencm3/cm3/scs.h>
+
+#include "init.h"
+#include "bench.h"
+
+ephemeris_t es[32];
+MUTEX_DECL(es_mutex);
+
+/* Bring the board up, print the banner and start the DWT cycle counter the
+ * probes time with. */
+void bench_init(const char *title)
+{
+  init(1);
+
+  printf("\n\nFirmware info - git: " GIT_VERSION ", built: " __DATE__ " " __TIME__ "\n");
+  printf("--- %s ---\n", title);
+
+  SCS_DEMCR |= 0x01000000;
+  DWT_CYCCNT = 0;
+  DWT_CTRL |= 1;
+}
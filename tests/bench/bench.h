@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef SWIFTNAV_BENCH_H
+#define SWIFTNAV_BENCH_H
+
+#include <libswiftnav/common.h>
+#include <libswiftnav/ephemeris.h>
+
+#include <ch.h>
+
+/* Set up the board for a benchmark, shared by the benches in tests/bench
+ * and tests/sim_bench. The firmware's own es and es_mutex live in main.c
+ * which the benches don't link. */
+
+extern ephemeris_t es[32];
+extern Mutex es_mutex;
+
+void bench_init(const char *title);
+
+#endif  /* SWIFTNAV_BENCH_H */
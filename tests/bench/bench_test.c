@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* Cycle counts of the firmware hot paths on canned data.
+ *
+ * Each function is timed call by call with the DWT cycle counter into a
+ * probe, and every round the probes are sent as MSG_PROBE_STATE, see
+ * bench_test.py for a host side reader. The minimum is the number to
+ * compare between builds, the mean and maximum include time spent in
+ * interrupts. */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <libswiftnav/coord_system.h>
+#include <libswiftnav/linear_algebra.h>
+#include <libswiftnav/pvt.h>
+#include <libswiftnav/single_diff.h>
+
+#include "bench.h"
+#include "main.h"
+#include "sbp.h"
+#include "acq.h"
+#include "track.h"
+#include "nmea.h"
+#include "rtcm.h"
+#include "position.h"
+#include "probe.h"
+#include "solution.h"
+#include "board/leds.h"
+#include "board/nap/acq_channel.h"
+#include "board/nap/track_channel.h"
+
+#define N_SATS 8
+#define N_ITER 100
+/* calc_PVT and the DGNSS filters take milliseconds, fewer calls keep a
+ * round short. */
+#define N_ITER_SLOW 20
+
+/* Payload message type for timing sbp_send_msg_(), not otherwise used. */
+#define MSG_BENCH_PAYLOAD 0x2F
+
+extern acq_state_t acq_state[NAP_ACQ_MAX_CHANNELS];
+
+static PROBE_DECL(probe_track_update, "track_update");
+static PROBE_DECL(probe_corr_unpack, "corr_unpack");
+static PROBE_DECL(probe_acq_irq, "acq_service_irq");
+static PROBE_DECL(probe_sbp_send, "sbp_send_msg_");
+static PROBE_DECL(probe_rtcm_1002, "gen_rtcm3 1002");
+static PROBE_DECL(probe_gpgga, "nmea_gpgga");
+static PROBE_DECL(probe_pvt, "calc_PVT");
+static PROBE_DECL(probe_matched_obs, "process_matched_obs");
+
+static navigation_measurement_t rover_nm[N_SATS];
+static navigation_measurement_t base_nm[N_SATS];
+static sdiff_t sds[N_SATS];
+
+/** Fill in an epoch observed from a receiver on the roof and a base 10 m
+ * to its east, with the satellites spread over the sky and the receiver
+ * clock 1 ms fast. */
+static void fill_epoch(gps_time_t t)
+{
+  const double llh[3] = {37.7749*D2R, -122.4194*D2R, 60.0};
+  const double el[N_SATS] = {80, 60, 45, 30, 20, 15, 50, 35};
+  const double az[N_SATS] = {0, 45, 100, 160, 210, 260, 300, 340};
+  const double base_ned[3] = {0, 10, 0};
+  const double lam = GPS_C / GPS_L1_HZ;
+  double rover[3], base[3], b_ecef[3];
+
+  wgsllh2ecef(llh, rover);
+  wgsned2ecef(base_ned, rover, b_ecef);
+  for (u8 j = 0; j < 3; j++)
+    base[j] = rover[j] + b_ecef[j];
+
+  for (u8 i = 0; i < N_SATS; i++) {
+    double ned[3] = {
+      cos(el[i]*D2R) * cos(az[i]*D2R),
+      cos(el[i]*D2R) * sin(az[i]*D2R),
+      -sin(el[i]*D2R),
+    };
+    double los[3];
+    wgsned2ecef(ned, rover, los);
+
+    navigation_measurement_t *r = &rover_nm[i];
+    navigation_measurement_t *b = &base_nm[i];
+    memset(r, 0, sizeof(*r));
+    r->prn = 3*i + 1;
+    for (u8 j = 0; j < 3; j++)
+      r->sat_pos[j] = rover[j] + 21e6 * los[j];
+    r->snr = 1000.0 + 100.0 * i;
+    r->tot = t;
+    r->lock_time = 100;
+    *b = *r;
+
+    r->raw_pseudorange = vector_distance(3, r->sat_pos, rover) + 1e-3 * GPS_C;
+    b->raw_pseudorange = vector_distance(3, b->sat_pos, base) + 1e-3 * GPS_C;
+    r->pseudorange = r->raw_pseudorange;
+    b->pseudorange = b->raw_pseudorange;
+    /* Integer ambiguities of a few thousand cycles. */
+    r->carrier_phase = -r->raw_pseudorange / lam + 1000 * i;
+    b->carrier_phase = -b->raw_pseudorange / lam - 500 * i;
+  }
+}
+
+int main(void)
+{
+  bench_init("FIRMWARE HOT PATH BENCHMARK");
+
+  gps_time_t t = {.wn = 1780, .tow = 345600};
+  fill_epoch(t);
+
+  /* A channel in the state of a locked one, its correlations are canned.
+   * The NAP channel is never started so the UPDATE write just lands. */
+  tracking_channel_t *chan = &tracking_channel[0];
+  memset(chan, 0, sizeof(*chan));
+  chan->state = TRACKING_RUNNING;
+  chan->int_ms = 1;
+  chan->TOW_ms = -1;
+  chan->code_phase_rate = GPS_CA_CHIPPING_RATE;
+  const corr_t cs[3] = {{3000, 100}, {6000, 150}, {2900, 120}};
+
+  u8 packed[NAP_TRACK_CORR_N_BYTES];
+  for (u8 i = 0; i < sizeof(packed); i++)
+    packed[i] = 37 * i + 11;
+
+  static rtcm_t rtcm;
+  rtcm.time = t;
+  rtcm.n = N_SATS;
+  rtcm.obs = rover_nm;
+
+  u8 payload[64];
+  for (u8 i = 0; i < sizeof(payload); i++)
+    payload[i] = i;
+
+  gnss_solution soln;
+  dops_t dops;
+  s8 ret = calc_PVT(N_SATS, rover_nm, &soln, &dops);
+  if (ret < 0)
+    printf("calc_PVT failed on the canned epoch (%d)\n", ret);
+  position_solution = soln;
+  position_updated();
+
+  while (1) {
+    for (u32 n = 0; n < N_ITER; n++) {
+      memcpy(chan->cs, cs, sizeof(chan->cs));
+      u32 t0 = probe_now();
+      tracking_channel_update(0);
+      probe_end(&probe_track_update, t0);
+    }
+
+    for (u32 n = 0; n < N_ITER; n++) {
+      u16 sample_count;
+      corr_t corrs[3];
+      u32 t0 = probe_now();
+      nap_track_corr_unpack(packed, &sample_count, corrs);
+      probe_end(&probe_corr_unpack, t0);
+    }
+
+    /* Mid search, so every call reads a correlation and writes the
+     * pipelined parameters. */
+    for (u32 n = 0; n < N_ITER; n++) {
+      acq_state[0].state = ACQ_RUNNING;
+      acq_state[0].cp_min = 0;
+      acq_state[0].cp_max = 1023;
+      acq_state[0].code_phase = 0;
+      acq_state[0].cf_min = -100;
+      acq_state[0].cf_max = 100;
+      acq_state[0].cf_step = 10;
+      acq_state[0].n_cf = 21;
+      acq_state[0].cf_centre = 10;
+      acq_state[0].cf_idx = 0;
+      acq_state[0].carrier_freq = 0;
+      acq_state[0].early_snr = 0;
+      acq_state[0].dwell = NULL;
+      u32 t0 = probe_now();
+      acq_service_irq(0);
+      probe_end(&probe_acq_irq, t0);
+    }
+    nap_acq_init_wr_disable_blocking(0);
+    acq_state[0].state = ACQ_DISABLED;
+
+    for (u32 n = 0; n < N_ITER; n++) {
+      u32 t0 = probe_now();
+      sbp_send_msg_(MSG_BENCH_PAYLOAD, sizeof(payload), payload, 0x42);
+      probe_end(&probe_sbp_send, t0);
+    }
+
+    for (u32 n = 0; n < N_ITER; n++) {
+      u32 t0 = probe_now();
+      gen_rtcm3(&rtcm, 1002, 0);
+      probe_end(&probe_rtcm_1002, t0);
+    }
+
+    for (u32 n = 0; n < N_ITER; n++) {
+      u32 t0 = probe_now();
+      nmea_gpgga(&soln, &dops);
+      probe_end(&probe_gpgga, t0);
+    }
+
+    for (u32 n = 0; n < N_ITER_SLOW; n++) {
+      gnss_solution s;
+      dops_t d;
+      u32 t0 = probe_now();
+      calc_PVT(N_SATS, rover_nm, &s, &d);
+      probe_end(&probe_pvt, t0);
+    }
+
+    /* The first call initialises the filters, after that each call is an
+     * update as it would be running. */
+    u8 n_sds = single_diff(N_SATS, rover_nm, N_SATS, base_nm, sds);
+    for (u32 n = 0; n < N_ITER_SLOW; n++) {
+      t.tow += 0.1;
+      u32 t0 = probe_now();
+      process_matched_obs(n_sds, &t, sds, 0.1);
+      probe_end(&probe_matched_obs, t0);
+    }
+
+    probe_send_all();
+
+    led_toggle(LED_GREEN);
+    for (u32 d = 0; d < 20000000; d++)
+      __asm__("nop");
+  }
+
+  return 0;
+}
@@ -42,11 +42,11 @@ int main(void)
     float coarse_acq_code_phase;
     float coarse_acq_carrier_freq;
     float coarse_snr;
-    nap_acq_load_wr_enable_blocking();
+    nap_acq_load_wr_enable_blocking(0);
     u32 coarse_acq_cnt = nap_timing_count() + 1000;
     nap_timing_strobe(coarse_acq_cnt);
     wait_for_nap_exti();
-    nap_acq_load_wr_disable_blocking();
+    nap_acq_load_wr_disable_blocking(0);
 
     do_acq(PRN-1, 0, 1023, -7000, 7000, 300, &coarse_acq_code_phase, &coarse_acq_carrier_freq, &coarse_snr);
     printf("Coarse:\n  Code phase: %7.2f, Carrier freq % 7.1f, SNR %5.2f\n", coarse_acq_code_phase, coarse_acq_carrier_freq, coarse_snr);
@@ -61,11 +61,11 @@ int main(void)
     float fine_acq_code_phase;
     float fine_acq_carrier_freq;
     float fine_snr;
-    nap_acq_load_wr_enable_blocking();
+    nap_acq_load_wr_enable_blocking(0);
     u32 fine_acq_cnt = nap_timing_count() + 2000;
     nap_timing_strobe(fine_acq_cnt);
     wait_for_nap_exti();
-    nap_acq_load_wr_disable_blocking();
+    nap_acq_load_wr_disable_blocking(0);
 
     float fine_cp = propagate_code_phase(coarse_acq_code_phase, coarse_acq_carrier_freq, fine_acq_cnt - coarse_acq_cnt);
 
@@ -80,11 +80,11 @@ int main(void)
     float fine2_acq_code_phase;
     float fine2_acq_carrier_freq;
     float fine2_snr;
-    nap_acq_load_wr_enable_blocking();
+    nap_acq_load_wr_enable_blocking(0);
     u32 fine2_acq_cnt = nap_timing_count() + 2000;
     nap_timing_strobe(fine2_acq_cnt);
     wait_for_nap_exti();
-    nap_acq_load_wr_disable_blocking();
+    nap_acq_load_wr_disable_blocking(0);
 
     float fine2_cp = propagate_code_phase(fine_acq_code_phase, fine_acq_carrier_freq, fine2_acq_cnt - fine_acq_cnt);
 
@@ -0,0 +1,288 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* Replay a correlation trace through the tracking loops and the measurement
+ * and PVT steps of the solution thread, as fast as the host can go.
+ *
+ *   replay [-t] trace_file
+ *
+ * Prints one comma separated line per measurement epoch on stdout:
+ *
+ *   tc,n_used,ret,lat,lon,height,clock_bias,gdop
+ *
+ * and with -t one line per tracking channel update before it:
+ *
+ *   trk,channel,prn,update_count,carrier_freq,code_phase_rate,I_p,Q_p,TOW_ms
+ *
+ * The trace only holds what the NAP returned, the loop filters, nav message
+ * decoding and measurement code run here again. The loops run open loop, the
+ * correlations don't respond to the frequencies replayed loops write, so
+ * results match the target exactly only while the loop code is unchanged.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libswiftnav/constants.h>
+#include <libswiftnav/ephemeris.h>
+#include <libswiftnav/nav_msg.h>
+#include <libswiftnav/pvt.h>
+#include <libswiftnav/track.h>
+
+#include "board/nap/track_channel.h"
+#include "corr_trace.h"
+#include "main.h"
+#include "manage.h"
+#include "track.h"
+
+#include "replay.h"
+
+static ephemeris_t es[32];
+static bool print_tracking = false;
+
+static u64 first_tc = 0;
+static u64 last_tc = 0;
+static u32 n_epochs = 0;
+static u32 n_solutions = 0;
+
+/** As ephemeris_tow_valid() in src/manage.c. */
+static bool ephemeris_tow_valid(const ephemeris_t *e, s32 TOW_ms)
+{
+  double dt = TOW_ms / 1000.0 - e->toe.tow;
+  if (dt > WEEK_SECS / 2)
+    dt -= WEEK_SECS;
+  else if (dt < -WEEK_SECS / 2)
+    dt += WEEK_SECS;
+  return fabs(dt) < EPHEMERIS_FIT_INTERVAL;
+}
+
+/** As use_tracking_channel() in src/manage.c. */
+static bool use_channel(u8 i)
+{
+  tracking_channel_t *chan = &tracking_channel[i];
+  return ((tracking_channels_ready_mask() >> i) & 1)
+      && (es[chan->prn].valid == 1)
+      && (es[chan->prn].healthy == 1)
+      && ephemeris_tow_valid(&es[chan->prn], chan->TOW_ms);
+}
+
+/** Decode the nav bits the tracking loops have buffered and any subframes
+ * they complete, as the nav bit and nav msg threads in src/main.c do. */
+static void process_subframes(void)
+{
+  tracking_nav_bits_process();
+
+  s8 i;
+  while ((i = tracking_wait_subframe(TIME_IMMEDIATE)) >= 0) {
+    tracking_channel_t *chan = &tracking_channel[i];
+    if (chan->state != TRACKING_RUNNING || !chan->nav_msg.subframe_start_index)
+      continue;
+
+    u8 prn = chan->prn;
+    s8 ret = process_subframe(&chan->nav_msg, &es[prn]);
+    if (ret < 0)
+      fprintf(stderr, "PRN %02d ret %d\n", prn+1, ret);
+    else if (ret == 1)
+      fprintf(stderr, "New ephemeris for PRN %02d\n", prn+1);
+  }
+}
+
+/** Take measurements at a NAP timing count and solve, as the solution
+ * thread in src/solution.c does before its Doppler smoothing. */
+static void epoch(u64 tc)
+{
+  channel_measurement_t meas[MAX_CHANNELS];
+  navigation_measurement_t nav_meas[MAX_CHANNELS];
+  u8 n_ready = 0;
+
+  if (!n_epochs++)
+    first_tc = tc;
+  last_tc = tc;
+  replay_set_timing_count(tc);
+
+  for (u8 i = 0; i < nap_track_n_channels && n_ready < MAX_CHANNELS; i++) {
+    if (use_channel(i))
+      tracking_update_measurement(i, &meas[n_ready++]);
+  }
+
+  if (n_ready < 4) {
+    printf("%llu,%u,,,,,,\n", (unsigned long long)tc, n_ready);
+    return;
+  }
+
+  calc_navigation_measurement(n_ready, meas, nav_meas,
+                              (double)((u32)tc)/SAMPLE_FREQ, es);
+
+  gnss_solution soln;
+  dops_t dops;
+  s8 ret = calc_PVT(n_ready, nav_meas, &soln, &dops);
+  if (ret == 0)
+    n_solutions++;
+  printf("%llu,%u,%d,%.9f,%.9f,%.3f,%.9f,%.2f\n", (unsigned long long)tc,
+         n_ready, ret, soln.pos_llh[0] * R2D, soln.pos_llh[1] * R2D,
+         soln.pos_llh[2], soln.clock_bias, dops.gdop);
+}
+
+/** Run a channel's loop filters on correlations from the trace. */
+static void corr(u8 channel, const u8 raw[])
+{
+  tracking_channel_t *chan = &tracking_channel[channel];
+
+  if (chan->state != TRACKING_RUNNING) {
+    fprintf(stderr, "Correlations for channel %d which isn't running\n",
+            channel);
+    return;
+  }
+
+  replay_stage_corr(channel, raw);
+  tracking_channels_update(1 << channel);
+  process_subframes();
+
+  if (print_tracking)
+    printf("trk,%u,%u,%u,%.3f,%.3f,%d,%d,%d\n", channel, chan->prn,
+           chan->update_count, chan->carrier_freq, chan->code_phase_rate,
+           chan->cs[1].I, chan->cs[1].Q, chan->TOW_ms);
+}
+
+/** Replay the records in one MSG_CORR_TRACE payload.
+ * \return false if the payload is malformed.
+ */
+static bool payload(const u8 msg[], u8 len)
+{
+  u8 i = 2;
+
+  while (i < len) {
+    const u8 *r = &msg[i];
+    u8 n = corr_trace_record_len(r[0]);
+    if (n == 0 || i + n > len) {
+      fprintf(stderr, "Bad record type 0x%02X\n", r[0]);
+      return false;
+    }
+    i += n;
+
+    switch (r[0]) {
+    case CORR_TRACE_CORR:
+      if (r[1] >= NAP_MAX_N_TRACK_CHANNELS)
+        return false;
+      corr(r[1], &r[2]);
+      break;
+
+    case CORR_TRACE_INIT: {
+      float carrier_freq;
+      u32 start_sample_count;
+      if (r[1] >= NAP_MAX_N_TRACK_CHANNELS)
+        return false;
+      memcpy(&carrier_freq, &r[3], 4);
+      memcpy(&start_sample_count, &r[7], 4);
+      if (r[1] >= nap_track_n_channels)
+        nap_track_n_channels = r[1] + 1;
+      tracking_channel_init(r[1], r[2], carrier_freq, start_sample_count);
+      break;
+    }
+
+    case CORR_TRACE_DISABLE:
+      if (r[1] >= NAP_MAX_N_TRACK_CHANNELS)
+        return false;
+      tracking_channel_disable(r[1]);
+      break;
+
+    case CORR_TRACE_EPOCH: {
+      u64 tc;
+      memcpy(&tc, &r[1], 8);
+      epoch(tc);
+      break;
+    }
+
+    case CORR_TRACE_DROP:
+      fprintf(stderr, "%u records dropped on target\n", r[1] | (r[2] << 8));
+      break;
+
+    case CORR_TRACE_CONFIG:
+      if (r[1] != TRACK_LOOP_FILTER)
+        fprintf(stderr, "Trace used TRACK_LOOP_FILTER %u, replay built "
+                        "with %u\n", r[1], TRACK_LOOP_FILTER);
+      replay_setting_set("track", "int_ms", r[2]);
+      break;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "t")) != -1) {
+    switch (opt) {
+    case 't':
+      print_tracking = true;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-t] trace_file\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "Usage: %s [-t] trace_file\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  FILE *f = fopen(argv[optind], "rb");
+  if (!f) {
+    perror(argv[optind]);
+    return EXIT_FAILURE;
+  }
+
+  tracking_setup();
+
+  printf("tc,n_used,ret,lat,lon,height,clock_bias,gdop\n");
+
+  clock_t t0 = clock();
+  u32 n_msgs = 0;
+  u32 n_lost = 0;
+  u16 seq = 0;
+  int c;
+  while ((c = fgetc(f)) != EOF) {
+    u8 len = c;
+    u8 msg[255];
+    if (len < 2 || fread(msg, 1, len, f) != len) {
+      fprintf(stderr, "Truncated trace\n");
+      break;
+    }
+
+    u16 msg_seq = msg[0] | (msg[1] << 8);
+    if (n_msgs && msg_seq != (u16)(seq + 1)) {
+      fprintf(stderr, "%u messages lost\n", (u16)(msg_seq - seq - 1));
+      n_lost += (u16)(msg_seq - seq - 1);
+    }
+    seq = msg_seq;
+    n_msgs++;
+
+    if (!payload(msg, len)) {
+      fprintf(stderr, "Malformed message %u\n", n_msgs);
+      break;
+    }
+  }
+  fclose(f);
+
+  double cpu_time = (double)(clock() - t0) / CLOCKS_PER_SEC;
+  double trace_time = (double)(last_tc - first_tc) / SAMPLE_FREQ;
+  fprintf(stderr, "%u messages, %u lost, %u epochs, %u solutions\n",
+          n_msgs, n_lost, n_epochs, n_solutions);
+  fprintf(stderr, "%.1f s of trace in %.2f s, %.0fx real time\n",
+          trace_time, cpu_time, cpu_time > 0 ? trace_time / cpu_time : 0);
+
+  return n_lost ? EXIT_FAILURE : EXIT_SUCCESS;
+}
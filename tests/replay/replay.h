@@ -0,0 +1,22 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <libswiftnav/common.h>
+
+void replay_stage_corr(u8 channel, const u8 raw[]);
+void replay_set_timing_count(u64 tc);
+bool replay_setting_set(const char *section, const char *name, s32 value);
+
+#endif  /* REPLAY_H */
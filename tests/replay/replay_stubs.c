@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* Stand ins for the firmware the replayed code calls into. NAP CORR register
+ * reads return the bytes staged from the trace for that channel, all other
+ * NAP writes are dropped. */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "board/nap/nap_common.h"
+#include "board/nap/track_channel.h"
+#include "peripherals/spi.h"
+#include "corr_trace.h"
+#include "log.h"
+#include "sbp.h"
+#include "settings.h"
+#include "simulator.h"
+#include "ttff.h"
+
+#include "replay.h"
+
+static u8 staged_corr[NAP_MAX_N_TRACK_CHANNELS][NAP_TRACK_CORR_N_BYTES];
+static u64 timing_count = 0;
+
+/** Set the bytes the next read of a channel's CORR register returns. */
+void replay_stage_corr(u8 channel, const u8 raw[])
+{
+  memcpy(staged_corr[channel], raw, NAP_TRACK_CORR_N_BYTES);
+}
+
+/** Set the value nap_timing_count() returns. */
+void replay_set_timing_count(u64 tc)
+{
+  timing_count = tc;
+}
+
+/** Fill in a register read, only track channel CORR registers have data. */
+static void reg_read(u8 reg_id, u16 n_bytes, u8 data_in[])
+{
+  if (reg_id < NAP_REG_TRACK_BASE)
+    return;
+  u8 channel = (reg_id - NAP_REG_TRACK_BASE) / NAP_TRACK_N_REGS;
+  u8 offset = (reg_id - NAP_REG_TRACK_BASE) % NAP_TRACK_N_REGS;
+  if (channel >= NAP_MAX_N_TRACK_CHANNELS ||
+      offset != NAP_REG_TRACK_CORR_OFFSET ||
+      n_bytes != NAP_TRACK_CORR_N_BYTES)
+    return;
+  memcpy(data_in, staged_corr[channel], n_bytes);
+}
+
+void nap_xfer_blocking(u8 reg_id, u16 n_bytes, u8 data_in[],
+                       const u8 data_out[])
+{
+  (void)data_out;
+  if (data_in)
+    reg_read(reg_id, n_bytes, data_in);
+}
+
+void nap_xfer_inplace_blocking(u8 reg_id, u16 n_bytes, u8 buff[])
+{
+  reg_read(reg_id, n_bytes, buff);
+}
+
+void nap_xfer_batch_blocking(u8 n_xfers, const u8 reg_ids[], u16 n_bytes,
+                             u8 buff[])
+{
+  for (u8 i = 0; i < n_xfers; i++)
+    reg_read(reg_ids[i], n_bytes, &buff[i * n_bytes]);
+}
+
+void nap_xfer_pipelined_blocking(u8 n_xfers, const u8 reg_ids[], u16 n_bytes,
+                                 u8 buff[], nap_xfer_cb_t cb, void *context)
+{
+  for (u8 i = 0; i < n_xfers; i++) {
+    reg_read(reg_ids[i], n_bytes, buff);
+    cb(i, buff, context);
+  }
+}
+
+void nap_xfer_polled(u8 reg_id, u16 n_bytes, u8 buff[])
+{
+  reg_read(reg_id, n_bytes, buff);
+}
+
+u8 *spi_dma_buff_alloc(void)
+{
+  static u8 buff[SPI_DMA_BUFF_LEN];
+  return buff;
+}
+
+void spi_dma_buff_free(u8 *buff)
+{
+  (void)buff;
+}
+
+u64 nap_timing_count(void)
+{
+  return timing_count;
+}
+
+void nap_timing_strobe(u32 falling_edge_count)
+{
+  (void)falling_edge_count;
+}
+
+/* The replayed trace isn't traced again. */
+void corr_trace_corr(u8 channel, u16 sample_count, const corr_t corrs[])
+{
+  (void)channel; (void)sample_count; (void)corrs;
+}
+
+void corr_trace_init(u8 channel, u8 prn, float carrier_freq,
+                     u32 start_sample_count)
+{
+  (void)channel; (void)prn; (void)carrier_freq; (void)start_sample_count;
+}
+
+void corr_trace_disable(u8 channel)
+{
+  (void)channel;
+}
+
+void ttff_mark_sample_count(ttff_milestone_t m, u32 sample_count)
+{
+  (void)m; (void)sample_count;
+}
+
+/* Settings are only kept so the replay can set them from the trace. */
+static struct setting *settings_head = NULL;
+
+void settings_register(struct setting *s, enum setting_types type)
+{
+  (void)type;
+  s->next = settings_head;
+  settings_head = s;
+}
+
+bool settings_default_notify(struct setting *s, const char *val)
+{
+  (void)s; (void)val;
+  return true;
+}
+
+/** Set an integer setting registered by the replayed code.
+ * \return false if no such setting has been registered.
+ */
+bool replay_setting_set(const char *section, const char *name, s32 value)
+{
+  for (struct setting *s = settings_head; s; s = s->next) {
+    if (strcmp(s->section, section) || strcmp(s->name, name))
+      continue;
+    switch (s->len) {
+    case 1: *(u8 *)s->addr = value; break;
+    case 2: *(u16 *)s->addr = value; break;
+    case 4: *(u32 *)s->addr = value; break;
+    default: return false;
+    }
+    return true;
+  }
+  return false;
+}
+
+void log_deferred(const char *fmt, u32 a0, u32 a1, u32 a2, u32 a3)
+{
+  fprintf(stderr, fmt, a0, a1, a2, a3);
+}
+
+u32 sbp_send_msg(u16 msg_type, u8 len, u8 buff[])
+{
+  (void)msg_type; (void)len; (void)buff;
+  return 0;
+}
+
+bool simulation_enabled_for(simulation_modes_t mode_mask)
+{
+  (void)mode_mask;
+  return false;
+}
+
+u8 simulation_current_num_sats(void)
+{
+  return 0;
+}
+
+tracking_state_msg_t simulation_current_tracking_state(u8 channel)
+{
+  (void)channel;
+  tracking_state_msg_t state = {0};
+  return state;
+}
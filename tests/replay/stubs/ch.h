@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* The parts of the ChibiOS API used by the code the replay harness links.
+ * The replay is single threaded so locking is a no-op and mailboxes are
+ * plain ring buffers that never block. */
+
+#ifndef REPLAY_CH_H
+#define REPLAY_CH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef int32_t msg_t;
+typedef uint32_t systime_t;
+typedef uint32_t eventmask_t;
+typedef struct { int dummy; } Thread;
+
+#define TRUE  1
+#define FALSE 0
+
+#define RDY_OK      0
+#define RDY_TIMEOUT -1
+
+#define TIME_IMMEDIATE ((systime_t)0)
+#define TIME_INFINITE  ((systime_t)-1)
+
+#define chSysLock()   do {} while (0)
+#define chSysUnlock() do {} while (0)
+#define chSysLockFromIsr()   do {} while (0)
+#define chSysUnlockFromIsr() do {} while (0)
+
+#define chSchRescheduleS()   do {} while (0)
+
+typedef struct { int dummy; } EventSource;
+typedef struct { int dummy; } EventListener;
+
+#define EVENTSOURCE_DECL(name) EventSource name = {0}
+#define chEvtRegisterMask(esp, elp, mask) \
+  do { (void)(esp); (void)(elp); (void)(mask); } while (0)
+#define chEvtBroadcastFlagsI(esp, flags) \
+  do { (void)(esp); (void)(flags); } while (0)
+
+/* Memory placement, see src/chconf.h. */
+#define _CCM
+#define _HOT
+#define _DMA
+#define _COLD
+
+typedef struct {
+  msg_t *buff;
+  uint32_t size;
+  uint32_t rd;
+  uint32_t wr;
+} Mailbox;
+
+#define MAILBOX_DECL(name, buffer, size) Mailbox name = {(buffer), (size), 0, 0}
+
+static inline msg_t chMBPost(Mailbox *mbp, msg_t msg, systime_t timeout)
+{
+  (void)timeout;
+  if (mbp->wr - mbp->rd >= mbp->size)
+    return RDY_TIMEOUT;
+  mbp->buff[mbp->wr++ % mbp->size] = msg;
+  return RDY_OK;
+}
+
+static inline msg_t chMBFetch(Mailbox *mbp, msg_t *msgp, systime_t timeout)
+{
+  (void)timeout;
+  if (mbp->wr == mbp->rd)
+    return RDY_TIMEOUT;
+  *msgp = mbp->buff[mbp->rd++ % mbp->size];
+  return RDY_OK;
+}
+
+#endif  /* REPLAY_CH_H */
@@ -0,0 +1,4 @@
+/* Empty, the replay harness makes no peripheral accesses. */
+#ifndef REPLAY_LIBOPENCM3_CM3_NVIC_H
+#define REPLAY_LIBOPENCM3_CM3_NVIC_H
+#endif
@@ -0,0 +1,4 @@
+/* Empty, the replay harness makes no peripheral accesses. */
+#ifndef REPLAY_LIBOPENCM3_STM32_EXTI_H
+#define REPLAY_LIBOPENCM3_STM32_EXTI_H
+#endif
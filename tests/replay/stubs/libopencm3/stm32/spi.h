@@ -0,0 +1,4 @@
+/* Empty, the replay harness makes no peripheral accesses. */
+#ifndef REPLAY_LIBOPENCM3_STM32_SPI_H
+#define REPLAY_LIBOPENCM3_STM32_SPI_H
+#endif
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <libopencm3/cm3/scs.h>
+#include <libswiftnav/edc.h>
+
+#include "init.h"
+#include "main.h"
+#include "rtcm.h"
+#include "error.h"
+#include "board/leds.h"
+
+#define N_SATS 12
+#define N_ITER 100
+
+/* Reference 1002 encoder using the bit at a time setbitu() / setbits() and
+ * the byte at a time libswiftnav crc24q(), i.e. the encoder before the
+ * streaming bit writer was added. Mirrors encode_type1002() field for
+ * field. */
+static u32 ref_gen_1002(rtcm_t *rtcm)
+{
+  const double lam1 = 299792458.0 / 1.57542E9;
+  u32 i = 0;
+
+  memset(rtcm->buff, 0, sizeof(rtcm->buff));
+  setbitu(rtcm->buff, i, 8, 0xD3); i += 8;
+  setbitu(rtcm->buff, i, 6, 0);    i += 6;
+  setbitu(rtcm->buff, i, 10, 0);   i += 10;
+
+  setbitu(rtcm->buff, i, 12, 1002); i += 12;
+  setbitu(rtcm->buff, i, 12, 0);    i += 12;
+  setbitu(rtcm->buff, i, 30, (u32)floor(rtcm->time.tow / 0.001 + 0.5));
+  i += 30;
+  setbitu(rtcm->buff, i, 1, 0);       i += 1;
+  setbitu(rtcm->buff, i, 5, rtcm->n); i += 5;
+  setbitu(rtcm->buff, i, 1, 0);       i += 1;
+  setbitu(rtcm->buff, i, 3, 0);       i += 3;
+
+  for (u8 j = 0; j < rtcm->n; j++) {
+    const navigation_measurement_t *o = &rtcm->obs[j];
+    s32 amb = (s32)floor(o->raw_pseudorange / 299792.458);
+    s32 pr1 = (s32)floor((o->raw_pseudorange - amb * 299792.458) / 0.02 + 0.5);
+    double pr1c = pr1 * 0.02 + amb * 299792.458;
+    double ppr = fmod(-o->carrier_phase - pr1c / lam1 + 1500.0, 3000.0);
+    if (ppr < 0)
+      ppr += 3000;
+    ppr -= 1500.0;
+    s32 ppr1 = (s32)floor(ppr * lam1 / 0.0005 + 0.5);
+    u8 cnr1 = (u8)((10.0*log10(o->snr) + 40.0) * 4.0);
+
+    setbitu(rtcm->buff, i, 6, o->prn + 1); i += 6;
+    setbitu(rtcm->buff, i, 1, 0);          i += 1;
+    setbitu(rtcm->buff, i, 24, pr1);       i += 24;
+    setbits(rtcm->buff, i, 20, ppr1);      i += 20;
+    setbitu(rtcm->buff, i, 7, 127);        i += 7;
+    setbitu(rtcm->buff, i, 8, amb);        i += 8;
+    setbitu(rtcm->buff, i, 8, cnr1);       i += 8;
+  }
+
+  for (; i % 8; i++)
+    setbitu(rtcm->buff, i, 1, 0);
+  u32 len = i / 8;
+  setbitu(rtcm->buff, 14, 10, len - 3);
+  setbitu(rtcm->buff, i, 24, crc24q(rtcm->buff, len, 0));
+
+  return len + 3;
+}
+
+static void fill_epoch(navigation_measurement_t *nm, ephemeris_t *eph)
+{
+  memset(nm, 0, N_SATS * sizeof(navigation_measurement_t));
+  for (u8 i = 0; i < N_SATS; i++) {
+    nm[i].prn = 2*i + 1;
+    nm[i].raw_pseudorange = 20e6 + 123456.789 * i;
+    nm[i].carrier_phase = -105e6 - 654321.123 * i;
+    nm[i].snr = 1000.0 + 100.0 * i;
+    nm[i].doppler = -3000.0 + 550.5 * i;
+  }
+
+  memset(eph, 0, sizeof(ephemeris_t));
+  eph->toe.wn = 1780;
+  eph->toe.tow = 345600;
+  eph->toc.tow = 345600;
+  eph->sqrta = 5153.6;
+  eph->ecc = 0.01;
+  eph->inc = 0.95;
+  eph->m0 = -1.2;
+  eph->af0 = -1e-5;
+  eph->valid = 1;
+  eph->healthy = 1;
+}
+
+static u32 cycles(void)
+{
+  return DWT_CYCCNT;
+}
+
+int main(void)
+{
+  init(1);
+
+  printf("\n\nFirmware info - git: " GIT_VERSION ", built: " __DATE__ " " __TIME__ "\n");
+  printf("--- RTCM ENCODER BENCHMARK ---\n");
+
+  SCS_DEMCR |= 0x01000000;
+  DWT_CYCCNT = 0;
+  DWT_CTRL |= 1;
+
+  static navigation_measurement_t nm[N_SATS];
+  static ephemeris_t eph;
+  static rtcm_t rtcm, ref;
+  fill_epoch(nm, &eph);
+
+  rtcm.time.tow = ref.time.tow = 123456.7;
+  rtcm.n = ref.n = N_SATS;
+  rtcm.obs = ref.obs = nm;
+  rtcm.eph = &eph;
+
+  /* The streaming encoder must give exactly the same frame as the bit at a
+   * time reference. */
+  u32 ref_len = ref_gen_1002(&ref);
+  if (!gen_rtcm3(&rtcm, 1002, 0))
+    screaming_death("gen_rtcm3 1002 failed");
+  if (rtcm.nbyte != ref_len || memcmp(rtcm.buff, ref.buff, ref_len))
+    screaming_death("1002 frame differs from reference encoder");
+  if (rtcm_crc24q(ref.buff, ref_len - 3, 0) != crc24q(ref.buff, ref_len - 3, 0))
+    screaming_death("rtcm_crc24q differs from crc24q");
+
+  while (1) {
+    u32 t0 = cycles();
+    for (u32 n = 0; n < N_ITER; n++)
+      ref_gen_1002(&ref);
+    u32 t_ref_1002 = (cycles() - t0) / N_ITER;
+
+    t0 = cycles();
+    for (u32 n = 0; n < N_ITER; n++)
+      gen_rtcm3(&rtcm, 1002, 1);
+    u32 t_1002 = (cycles() - t0) / N_ITER;
+
+    t0 = cycles();
+    for (u32 n = 0; n < N_ITER; n++)
+      gen_rtcm3(&rtcm, 1019, 0);
+    u32 t_1019 = (cycles() - t0) / N_ITER;
+
+    t0 = cycles();
+    for (u32 n = 0; n < N_ITER; n++)
+      crc24q(rtcm.buff, rtcm.len, 0);
+    u32 t_crc_ref = (cycles() - t0) / N_ITER;
+
+    t0 = cycles();
+    for (u32 n = 0; n < N_ITER; n++)
+      rtcm_crc24q(rtcm.buff, rtcm.len, 0);
+    u32 t_crc = (cycles() - t0) / N_ITER;
+
+    printf("%u sat epoch (cycles per message):\n", N_SATS);
+    printf("  1002 reference: %6u  streaming: %6u\n",
+           (unsigned)t_ref_1002, (unsigned)t_1002);
+    printf("  1019 streaming: %6u\n", (unsigned)t_1019);
+    printf("  crc24q (%u bytes) reference: %6u  table: %6u\n",
+           (unsigned)rtcm.len, (unsigned)t_crc_ref, (unsigned)t_crc);
+
+    led_toggle(LED_GREEN);
+    for (u32 d = 0; d < 20000000; d++)
+      __asm__("nop");
+  }
+
+  return 0;
+}
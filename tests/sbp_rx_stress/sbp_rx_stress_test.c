@@ -10,11 +10,19 @@
  * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
  */
 
-#include <stdlib.h>
+/* Sustained SBP receive throughput.
+ *
+ * The host asks for a step with MSG_STRESS_STEP: a baud rate, a set of
+ * USARTs and a duration. Once the USARTs are at the new baud rate an empty
+ * MSG_STRESS_REPORT is sent, the host then sends MSG_STRESS_PAYLOAD frames
+ * on every USART in the set as fast as it can for the duration, and a
+ * MSG_STRESS_REPORT with what was received on each USART follows. The
+ * host sends the frames on each USART with the USART's index in
+ * msg_uart_state_t as sender ID. See sbp_rx_stress_test.py for the host
+ * side, which sweeps payload length, USART set and baud rate. */
+
 #include <stdio.h>
-#include <libopencm3/stm32/f4/rcc.h>
-#include <libopencm3/stm32/f4/timer.h>
-#include <libopencm3/cm3/nvic.h>
+#include <string.h>
 #include <libswiftnav/sbp.h>
 
 #include "init.h"
@@ -24,81 +32,147 @@
 #include "board/leds.h"
 #include "peripherals/usart.h"
 
-u8 guard_below[30];
-u8 buff_in[256];
-u8 guard_above[30];
-
-u32 ok_packets = 0;
-u32 ok_bytes = 0;
-
-void timer_setup() {
-  RCC_APB1ENR |= RCC_APB1ENR_TIM2EN;
-  timer_set_prescaler(TIM2, 1);
-  timer_set_period(TIM2, rcc_ppre1_frequency);
-  timer_enable_irq(TIM2, TIM_DIER_UIE);
+/* Test messages, from a range of IDs not used by the firmware. */
+#define MSG_STRESS_PAYLOAD 0xF8 /**< Host -> Piksi, byte n of payload is n. */
+#define MSG_STRESS_STEP    0xF9 /**< Host -> Piksi */
+#define MSG_STRESS_REPORT  0xFA /**< Piksi -> Host */
+
+/* Frames still in the host's and Piksi's buffers at the end of the step
+ * are given this long to be counted. */
+#define STEP_GRACE_MS 500
+
+typedef struct __attribute__((packed)) {
+  u32 baud;        /**< Baud rate of the USARTs under test. */
+  u16 duration_ms; /**< Length of the step. */
+  u8 ports;        /**< USARTs under test, see SBP_TX_UARTA etc. */
+  u8 len;          /**< Unused. */
+} msg_stress_step_t;
+
+/** Indexed as msg_uart_state_t uarts. */
+typedef struct __attribute__((packed)) {
+  u32 baud;
+  u16 duration_ms; /**< 0 when ready to receive. */
+  u8 ports;
+  struct __attribute__((packed)) {
+    u32 frames;      /**< Frames received intact. */
+    u32 bytes;       /**< Framed bytes received intact. */
+    u32 bad;         /**< Frames with a good CRC but a wrong payload. */
+    u16 crc_errors;  /**< SBP receive CRC errors. */
+  } ports_stats[3];
+} msg_stress_report_t;
+
+static msg_stress_step_t step;
+static BSEMAPHORE_DECL(step_sem, TRUE);
+
+/* Written by the SBP thread, read once it has stopped receiving. */
+static u32 rx_frames[3];
+static u32 rx_bytes[3];
+static u32 rx_bad[3];
+
+static void step_callback(u16 sender_id, u8 len, u8 msg[], void* context)
+{
+  (void)sender_id; (void)context;
 
-  TIM2_CNT = 0;
-  timer_enable_counter(TIM2);
-  nvic_enable_irq(NVIC_TIM2_IRQ);
+  if (len != sizeof(step)) {
+    printf("Bad MSG_STRESS_STEP length %u\n", len);
+    return;
+  }
+  memcpy(&step, msg, sizeof(step));
+  chBSemSignal(&step_sem);
 }
 
-void tim2_isr() {
-  timer_clear_flag(TIM2, TIM_SR_UIF);
-  led_toggle(LED_GREEN);
-
-  static u32 old_ok_bytes = 0;
+static void payload_callback(u16 sender_id, u8 len, u8 msg[], void* context)
+{
+  (void)context;
 
-  printf("%u Messages (%.2f kB) %.2f kB/s\n",
-         (unsigned int)ok_packets,
-         ok_bytes / 1024.0,
-         (ok_bytes - old_ok_bytes) / 1024.0);
+  if (sender_id >= 3)
+    return;
 
-  old_ok_bytes = ok_bytes;
+  for (u8 i = 0; i < len; i++) {
+    if (msg[i] != i) {
+      rx_bad[sender_id]++;
+      return;
+    }
+  }
+  rx_frames[sender_id]++;
+  rx_bytes[sender_id] += 8 + len;
 }
 
-void callback(u16 sender_id, u8 len, u8 msg[], void* context)
+/** Set the baud rate of the USARTs under test, the others are put back to
+ * their defaults so that the host keeps its link on the FTDI port when that
+ * isn't being tested. */
+static void set_baud(u32 baud, u8 ports)
 {
-  (void)sender_id; (void)len; (void) context;
-
-  // Check this shit out
-  ok_packets++;
-  ok_bytes += 25;
-  for (u8 i=0; i<22; i++)
-    if (msg[i] != i)
-      screaming_death("Test packet not received correctly");
+  u32 ftdi_baud = (ports & SBP_TX_FTDI) ? baud : USART_DEFAULT_BAUD_FTDI;
+  u32 uarta_baud = (ports & SBP_TX_UARTA) ? baud : USART_DEFAULT_BAUD_TTL;
+  u32 uartb_baud = (ports & SBP_TX_UARTB) ? baud : USART_DEFAULT_BAUD_TTL;
+
+  if (ftdi_baud == ftdi_usart.baud_rate &&
+      uarta_baud == uarta_usart.baud_rate &&
+      uartb_baud == uartb_usart.baud_rate)
+    return;
+
+  /* Let anything still queued go out at the old rate. */
+  chThdSleepMilliseconds(200);
+
+  ftdi_usart.baud_rate = ftdi_baud;
+  uarta_usart.baud_rate = uarta_baud;
+  uartb_usart.baud_rate = uartb_baud;
+  usarts_disable();
+  usarts_enable(ftdi_baud, uarta_baud, uartb_baud, false);
+
+  /* Give the host time to reopen its port. */
+  chThdSleepMilliseconds(1000);
 }
 
 int main(void)
 {
   init(1);
 
+  /* The radio search would hold on to the TTL USARTs. */
+  uarta_usart.configure_telemetry_radio_on_boot = 0;
+  uartb_usart.configure_telemetry_radio_on_boot = 0;
+  usarts_enable(ftdi_usart.baud_rate, uarta_usart.baud_rate,
+                uartb_usart.baud_rate, true);
+
   printf("\n\nFirmware info - git: " GIT_VERSION ", built: " __DATE__ " " __TIME__ "\n");
   printf("--- SWIFT BINARY PROTOCOL RX STRESS TEST ---\n");
 
-  static sbp_msg_callbacks_node_t callback_node;
-  sbp_register_cbk(0x22, &callback, &callback_node);
+  static sbp_msg_callbacks_node_t step_node;
+  sbp_register_cbk(MSG_STRESS_STEP, &step_callback, &step_node);
+  static sbp_msg_callbacks_node_t payload_node;
+  sbp_register_cbk(MSG_STRESS_PAYLOAD, &payload_callback, &payload_node);
 
-  for (u8 i=0; i<30; i++) {
-    guard_below[i] = 0;
-    guard_above[i] = 0;
-  }
+  while (1) {
+    chBSemWait(&step_sem);
+    led_toggle(LED_GREEN);
 
-  while(1) {
-    /* Check the guards for buffer over/underrun. */
-    for (u8 i=0; i<30; i++) {
-      if (guard_below[i] != 0)
-        screaming_death("Detected buffer underrun in guard area\n");
-      if (guard_above[i] != 0)
-        screaming_death("Detected buffer overrun in guard area\n");
+    set_baud(step.baud, step.ports);
+
+    static msg_stress_report_t report;
+    memset(&report, 0, sizeof(report));
+    report.baud = step.baud;
+    report.ports = step.ports;
+
+    u16 crc_errors[3];
+    for (u8 i = 0; i < 3; i++) {
+      rx_frames[i] = rx_bytes[i] = rx_bad[i] = 0;
+      crc_errors[i] = uart_state_msg.uarts[i].crc_error_count;
     }
+    sbp_send_msg(MSG_STRESS_REPORT, sizeof(report), (u8 *)&report);
 
-    sbp_process_messages();
+    chThdSleepMilliseconds(step.duration_ms + STEP_GRACE_MS);
 
-    //for (u32 i = 0; i < 1000; i++)
-    //  __asm__("nop");
+    report.duration_ms = step.duration_ms;
+    for (u8 i = 0; i < 3; i++) {
+      report.ports_stats[i].frames = rx_frames[i];
+      report.ports_stats[i].bytes = rx_bytes[i];
+      report.ports_stats[i].bad = rx_bad[i];
+      report.ports_stats[i].crc_errors =
+        uart_state_msg.uarts[i].crc_error_count - crc_errors[i];
+    }
+    sbp_send_msg(MSG_STRESS_REPORT, sizeof(report), (u8 *)&report);
   }
-while (1);
 
-	return 0;
+  return 0;
 }
-
@@ -1,21 +1,139 @@
 #!/usr/bin/env python
 
-import sys, os, time
+# Sweep the SBP RX stress test over payload length, set of USARTs and baud
+# rate, printing one comma separated line per USART under test each step:
+#
+#   baud,len,port,frames_sent,frames,kB/s,host_kB/s,lost,bad,crc_errors
+#
+# kB/s is what the Piksi received intact, host_kB/s what was sent from here.
+# The FTDI port carries the test control, the TTL USARTs are loaded through
+# serial ports given as e.g. -u uarta=/dev/ttyUSB1.
+
+import sys, os, struct, time
+import argparse
+import threading
 sys.path.append(os.path.join(os.path.dirname(__file__), '..', '..', 'scripts'))
+
 import serial_link
 
-link = serial_link.SerialLink()
+MSG_STRESS_PAYLOAD = 0xF8
+MSG_STRESS_STEP = 0xF9
+MSG_STRESS_REPORT = 0xFA
+
+PORT_NAMES = ['uarta', 'uartb', 'ftdi']
+FTDI = 2
+TTL_DEFAULT_BAUD = 115200
+
+parser = argparse.ArgumentParser(description='SBP RX throughput sweep.')
+parser.add_argument('-p', '--port', default=serial_link.DEFAULT_PORT,
+                    help='serial port of the Piksi FTDI USART.')
+parser.add_argument('-u', '--usart', action='append', default=[],
+                    help='serial port connected to a TTL USART, '
+                         'e.g. uarta=/dev/ttyUSB1, may be repeated.')
+parser.add_argument('-s', '--sets', default='ftdi',
+                    help='sets of USARTs to load at the same time, '
+                         'e.g. ftdi,ftdi+uarta+uartb')
+parser.add_argument('-b', '--bauds', default='1000000',
+                    help='comma separated baud rates to sweep.')
+parser.add_argument('-l', '--lens', default='0,16,64,128,255',
+                    help='comma separated payload lengths to sweep.')
+parser.add_argument('-d', '--duration', type=float, default=5.0,
+                    help='length of each step in seconds.')
+args = parser.parse_args()
+
+serial_ports = {FTDI: args.port}
+for u in args.usart:
+  name, port = u.split('=')
+  serial_ports[PORT_NAMES.index(name)] = port
+
+reports = []
+report_event = threading.Event()
+
+def report_cb(data):
+  reports.append(data)
+  report_event.set()
 
-link.add_callback(serial_link.MSG_PRINT, serial_link.default_print_callback)
+links = {}
+link_bauds = {}
 
-data = ''.join(map(chr, range(0, 22)))
+def set_baud(i, baud):
+  """(Re)open the serial port on USART i at a baud rate."""
+  if link_bauds.get(i) == baud:
+    return
+  if i in links:
+    links[i].close()
+  link = serial_link.SerialLink(serial_ports[i], baud)
+  if i == FTDI:
+    link.add_callback(serial_link.MSG_PRINT, serial_link.default_print_callback)
+    link.add_callback(MSG_STRESS_REPORT, report_cb)
+  links[i] = link
+  link_bauds[i] = baud
 
+def wait_report(timeout):
+  report_event.wait(timeout)
+  report_event.clear()
+  if not reports:
+    return None
+  return reports.pop(0)
+
+def sender(i, length, end, sent):
+  data = ''.join(map(chr, range(length)))
+  while time.time() < end:
+    links[i].send_message(MSG_STRESS_PAYLOAD, data, sender_id=i)
+    sent[i] += 1
+
+def run_step(baud, ports, length):
+  links[FTDI].send_message(MSG_STRESS_STEP,
+                           struct.pack('<IHBB', baud, int(args.duration * 1000),
+                                       ports, length))
+  # The Piksi changes the baud rates before it's ready.
+  time.sleep(0.1)
+  for i in serial_ports:
+    if ports & (1 << i):
+      set_baud(i, baud)
+    else:
+      set_baud(i, serial_link.DEFAULT_BAUD if i == FTDI else TTL_DEFAULT_BAUD)
+  if wait_report(5) is None:
+    print >> sys.stderr, "Piksi not ready for baud %d, len %d" % (baud, length)
+    return
+
+  sent = [0, 0, 0]
+  end = time.time() + args.duration
+  threads = [threading.Thread(target=sender, args=(i, length, end, sent))
+             for i in range(3) if ports & (1 << i)]
+  for t in threads:
+    t.start()
+  for t in threads:
+    t.join()
+
+  report = wait_report(args.duration + 5)
+  if report is None:
+    print >> sys.stderr, "No report for baud %d, len %d" % (baud, length)
+    return
+  baud_, duration_ms, ports_ = struct.unpack('<IHB', report[:7])
+  for i in range(3):
+    frames, nbytes, bad, crc_errors = struct.unpack(
+      '<IIIH', report[7 + 14*i:7 + 14*(i+1)])
+    if not ports & (1 << i):
+      continue
+    rate = nbytes / (duration_ms / 1000.0) / 1024.0
+    host_rate = sent[i] * (length + 8) / args.duration / 1024.0
+    print "%d,%d,%s,%d,%d,%.2f,%.2f,%d,%d,%d" % (
+      baud_, length, PORT_NAMES[i], sent[i], frames, rate, host_rate,
+      sent[i] - frames - bad, bad, crc_errors)
+  sys.stdout.flush()
+
+set_baud(FTDI, serial_link.DEFAULT_BAUD)
+
+print "baud,len,port,frames_sent,frames,kB/s,host_kB/s,lost,bad,crc_errors"
 try:
-  while True:
-    time.sleep(0.02)
-    link.send_message(0x22, data)
+  for baud in map(int, args.bauds.split(',')):
+    for s in args.sets.split(','):
+      ports = sum(1 << PORT_NAMES.index(u) for u in s.split('+'))
+      for length in map(int, args.lens.split(',')):
+        run_step(baud, ports, length)
 except KeyboardInterrupt:
   pass
 finally:
-  link.close()
-
+  for link in links.values():
+    link.close()
@@ -10,11 +10,19 @@
  * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
  */
 
-#include <stdlib.h>
+/* Sustained SBP transmit throughput.
+ *
+ * The host asks for a step with MSG_STRESS_STEP: a baud rate, a set of
+ * USARTs and a payload length. Frames of that length are then queued on
+ * all the USARTs in the set as fast as their transmit queues take them for
+ * the length of the step, after which a MSG_STRESS_REPORT is sent with what
+ * was achieved on each USART. See sbp_tx_stress_test.py for the host side,
+ * which sweeps payload length, USART set and baud rate. */
+
 #include <stdio.h>
-#include <libopencm3/stm32/f4/rcc.h>
-#include <libopencm3/stm32/f4/timer.h>
-#include <libopencm3/cm3/nvic.h>
+#include <string.h>
+#include <libswiftnav/edc.h>
+#include <libswiftnav/sbp.h>
 
 #include "init.h"
 #include "main.h"
@@ -23,69 +31,177 @@
 #include "board/leds.h"
 #include "peripherals/usart.h"
 
-u8 guard_below[30];
-u8 buff_out[256];
-u8 guard_above[30];
+/* Test messages, from a range of IDs not used by the firmware. */
+#define MSG_STRESS_PAYLOAD 0xF8 /**< Piksi -> Host, byte n of payload is n. */
+#define MSG_STRESS_STEP    0xF9 /**< Host -> Piksi */
+#define MSG_STRESS_REPORT  0xFA /**< Piksi -> Host */
+
+typedef struct __attribute__((packed)) {
+  u32 baud;        /**< Baud rate of the USARTs under test. */
+  u16 duration_ms; /**< Length of the step. */
+  u8 ports;        /**< USARTs under test, see SBP_TX_UARTA etc. */
+  u8 len;          /**< Payload length. */
+} msg_stress_step_t;
+
+/** Indexed as msg_uart_state_t uarts. */
+typedef struct __attribute__((packed)) {
+  u32 baud;
+  u16 duration_ms;
+  u8 ports;
+  u8 len;
+  struct __attribute__((packed)) {
+    u32 frames;        /**< Frames queued. */
+    u32 bytes;         /**< Framed bytes queued. */
+    u32 drops;         /**< Frames refused by the transmit queue. */
+    u32 short_writes;  /**< usart_write_dma() calls refused. */
+    u32 idle_gaps;     /**< Times the DMA buffer ran dry. */
+    u32 idle_gap_max;  /**< Longest time dry. (cycles) */
+    u64 idle_gap_sum;  /**< Total time dry. (cycles) */
+    u16 crc_errors;    /**< SBP receive CRC errors. */
+  } ports_stats[3];
+} msg_stress_report_t;
+
+static usart_tx_dma_state * const tx_states[3] = {
+  &uarta_tx_state, &uartb_tx_state, &ftdi_tx_state
+};
+
+static msg_stress_step_t step;
+static BSEMAPHORE_DECL(step_sem, TRUE);
+
+static void step_callback(u16 sender_id, u8 len, u8 msg[], void* context)
+{
+  (void)sender_id; (void)context;
 
-void timer_setup() {
-  RCC_APB1ENR |= RCC_APB1ENR_TIM2EN;
-  timer_set_prescaler(TIM2, 1);
-  timer_set_period(TIM2, rcc_ppre1_frequency / 100);
-  timer_enable_irq(TIM2, TIM_DIER_UIE);
+  if (len != sizeof(step)) {
+    printf("Bad MSG_STRESS_STEP length %u\n", len);
+    return;
+  }
+  memcpy(&step, msg, sizeof(step));
+  chBSemSignal(&step_sem);
+}
 
-  TIM2_CNT = 0;
-  timer_enable_counter(TIM2);
-  nvic_enable_irq(NVIC_TIM2_IRQ);
+/** Frame the test payload as sender `sender_id`. */
+static u16 frame_payload(u8 frame[], u8 len, u16 sender_id)
+{
+  frame[0] = SBP_PREAMBLE;
+  frame[1] = MSG_STRESS_PAYLOAD & 0xFF;
+  frame[2] = MSG_STRESS_PAYLOAD >> 8;
+  frame[3] = sender_id & 0xFF;
+  frame[4] = sender_id >> 8;
+  frame[5] = len;
+  for (u16 i = 0; i < len; i++)
+    frame[6 + i] = (u8)i;
+  u16 crc = crc16_ccitt(&frame[1], 5 + len, 0);
+  frame[6 + len] = crc & 0xFF;
+  frame[7 + len] = crc >> 8;
+  return 8 + len;
 }
 
-void tim2_isr() {
-  timer_clear_flag(TIM2, TIM_SR_UIF);
-  led_toggle(LED_GREEN);
+/** Set the baud rate of the USARTs under test, the others are put back to
+ * their defaults so that the host keeps its link on the FTDI port when that
+ * isn't being tested. */
+static void set_baud(u32 baud, u8 ports)
+{
+  u32 ftdi_baud = (ports & SBP_TX_FTDI) ? baud : USART_DEFAULT_BAUD_FTDI;
+  u32 uarta_baud = (ports & SBP_TX_UARTA) ? baud : USART_DEFAULT_BAUD_TTL;
+  u32 uartb_baud = (ports & SBP_TX_UARTB) ? baud : USART_DEFAULT_BAUD_TTL;
+
+  if (ftdi_baud == ftdi_usart.baud_rate &&
+      uarta_baud == uarta_usart.baud_rate &&
+      uartb_baud == uartb_usart.baud_rate)
+    return;
+
+  /* Let anything still queued go out at the old rate. */
+  chThdSleepMilliseconds(200);
+
+  ftdi_usart.baud_rate = ftdi_baud;
+  uarta_usart.baud_rate = uarta_baud;
+  uartb_usart.baud_rate = uartb_baud;
+  usarts_disable();
+  usarts_enable(ftdi_baud, uarta_baud, uartb_baud, false);
+
+  /* Give the host time to reopen its port. */
+  chThdSleepMilliseconds(1000);
+}
 
-  /* Random transmit length. */
-  u32 len = (u32)rand() % 256;
-  if(sbp_send_msg(0x22, len, buff_out))
-    screaming_death("sbp_send_msg failed in tim2_isr");
+static void run_step(msg_stress_report_t *r)
+{
+  static u8 frame[SBP_FRAME_MAX_LEN];
+  u16 frame_len = frame_payload(frame, step.len, 0x42);
+  u16 crc_errors[3];
+
+  memset(r, 0, sizeof(*r));
+  r->baud = step.baud;
+  r->ports = step.ports;
+  r->len = step.len;
+
+  for (u8 i = 0; i < 3; i++) {
+    usart_tx_stats_reset(tx_states[i]);
+    crc_errors[i] = uart_state_msg.uarts[i].crc_error_count;
+  }
+
+  systime_t start = chTimeNow();
+  while (chTimeNow() - start < MS2ST(step.duration_ms)) {
+    bool queued = false;
+    for (u8 i = 0; i < 3; i++) {
+      if (!(step.ports & (1 << i)))
+        continue;
+      if (sbp_tx_raw(1 << i, SBP_TX_PRIO_NORMAL, frame, frame_len)) {
+        r->ports_stats[i].drops++;
+      } else {
+        r->ports_stats[i].frames++;
+        r->ports_stats[i].bytes += frame_len;
+        queued = true;
+      }
+    }
+    /* Every queue is full, wait for the TX thread to make some room. */
+    if (!queued)
+      chThdSleep(1);
+  }
+  r->duration_ms = (chTimeNow() - start) * 1000 / CH_FREQUENCY;
+
+  for (u8 i = 0; i < 3; i++) {
+    usart_tx_dma_state *s = tx_states[i];
+    chSysLock();
+    r->ports_stats[i].short_writes = s->n_short_writes;
+    r->ports_stats[i].idle_gaps = s->n_idle_gaps;
+    r->ports_stats[i].idle_gap_max = s->idle_gap_max;
+    r->ports_stats[i].idle_gap_sum = s->idle_gap_sum;
+    chSysUnlock();
+    r->ports_stats[i].crc_errors =
+      uart_state_msg.uarts[i].crc_error_count - crc_errors[i];
+  }
 }
 
 int main(void)
 {
   init(1);
 
+  /* The radio search would hold on to the TTL USARTs. */
+  uarta_usart.configure_telemetry_radio_on_boot = 0;
+  uartb_usart.configure_telemetry_radio_on_boot = 0;
+  usarts_enable(ftdi_usart.baud_rate, uarta_usart.baud_rate,
+                uartb_usart.baud_rate, true);
+
   printf("\n\nFirmware info - git: " GIT_VERSION ", built: " __DATE__ " " __TIME__ "\n");
   printf("--- SWIFT BINARY PROTOCOL TX STRESS TEST ---\n");
 
-  u32 len;
+  static sbp_msg_callbacks_node_t step_node;
+  sbp_register_cbk(MSG_STRESS_STEP, &step_callback, &step_node);
 
-  for (u8 i=0; i<30; i++) {
-    guard_below[i] = 0;
-    guard_above[i] = 0;
-  }
-
-  for (u32 i=0; i<256; i++)
-    buff_out[i] = (u8)i;
+  while (1) {
+    chBSemWait(&step_sem);
+    led_toggle(LED_GREEN);
 
-  while(1) {
-    /* Random transmit length. */
-    len = (u32)rand() % 256;
-    while(sbp_send_msg(0x22, len, buff_out));
+    set_baud(step.baud, step.ports);
 
-    /* Check the guards for buffer over/underrun. */
-    for (u8 i=0; i<30; i++) {
-      if (guard_below[i] != 0)
-        screaming_death("Detected buffer underrun in guard area\n");
-      if (guard_above[i] != 0)
-        screaming_death("Detected buffer overrun in guard area\n");
-    }
+    static msg_stress_report_t report;
+    run_step(&report);
 
-    /* Introduce some timing jitter. */
-    u32 jitter_delay = ((u32)rand() % 20000);
-    for (u32 i = 0; i < jitter_delay; i++)
-    /*for (u32 i = 0; i < 1000; i++)*/
-      __asm__("nop");
+    /* Let the queues empty so the report isn't dropped. */
+    chThdSleepMilliseconds(200);
+    sbp_send_msg(MSG_STRESS_REPORT, sizeof(report), (u8 *)&report);
   }
-while (1);
 
-	return 0;
+  return 0;
 }
-
@@ -1,43 +1,126 @@
 #!/usr/bin/env python
 
-import sys, os, time
-import binascii
+# Sweep the SBP TX stress test over payload length, set of USARTs and baud
+# rate, printing one comma separated line per USART under test each step:
+#
+#   baud,len,port,frames,kB/s,host_kB/s,drops,short_writes,idle_gaps,
+#   idle_gap_max_us,idle_gap_mean_us,crc_errors
+#
+# kB/s is what was queued on the Piksi, host_kB/s what arrived intact here
+# and is only measured on the FTDI port. The other USARTs should have
+# something on the other end reading them, or the FTDI pins looped back.
+
+import sys, os, struct, time
+import argparse
+import threading
 sys.path.append(os.path.join(os.path.dirname(__file__), '..', '..', 'scripts'))
 
 import serial_link
 
-ok_count = 0
-ok_byte_count = 0
-def foo_cb(data):
-  global ok_count
-  global ok_byte_count
+MSG_STRESS_PAYLOAD = 0xF8
+MSG_STRESS_STEP = 0xF9
+MSG_STRESS_REPORT = 0xFA
+
+PORTS = {'uarta': 1 << 0, 'uartb': 1 << 1, 'ftdi': 1 << 2}
+PORT_NAMES = ['uarta', 'uartb', 'ftdi']
+
+CPU_FREQ = 130944000.0
+
+parser = argparse.ArgumentParser(description='SBP TX throughput sweep.')
+parser.add_argument('-p', '--port', default=serial_link.DEFAULT_PORT,
+                    help='serial port of the Piksi FTDI USART.')
+parser.add_argument('-b', '--bauds', default='1000000',
+                    help='comma separated baud rates to sweep.')
+parser.add_argument('-l', '--lens', default='0,16,64,128,255',
+                    help='comma separated payload lengths to sweep.')
+parser.add_argument('-u', '--usarts', default='ftdi',
+                    help='sets of USARTs to load at the same time, '
+                         'e.g. ftdi,ftdi+uarta+uartb')
+parser.add_argument('-d', '--duration', type=float, default=5.0,
+                    help='length of each step in seconds.')
+args = parser.parse_args()
 
-  for n, d in enumerate(data):
-    if ord(d) != ((n) % 256):
-      print n
-      print binascii.hexlify(data)[:2*n]
-      print binascii.hexlify(data)[2*n:]
-      print "EIT!"
-      return
-  ok_count += 1
-  ok_byte_count += len(data)
+rx_lock = threading.Lock()
+rx_frames = 0
+rx_bytes = 0
+rx_bad = 0
+report = None
+report_event = threading.Event()
 
-link = serial_link.SerialLink()
+def payload_cb(data):
+  global rx_frames, rx_bytes, rx_bad
+  with rx_lock:
+    for n, d in enumerate(data):
+      if ord(d) != n % 256:
+        rx_bad += 1
+        return
+    rx_frames += 1
+    rx_bytes += len(data) + 8
 
-link.add_callback(serial_link.MSG_PRINT, serial_link.default_print_callback)
+def report_cb(data):
+  global report
+  report = data
+  report_event.set()
 
-link.add_callback(0x22, foo_cb)
+def open_link(baud):
+  link = serial_link.SerialLink(args.port, baud)
+  link.add_callback(serial_link.MSG_PRINT, serial_link.default_print_callback)
+  link.add_callback(MSG_STRESS_PAYLOAD, payload_cb)
+  link.add_callback(MSG_STRESS_REPORT, report_cb)
+  return link
 
+def run_step(link, link_baud, baud, ports, length):
+  global rx_frames, rx_bytes, rx_bad
+  report_event.clear()
+  link.send_message(MSG_STRESS_STEP,
+                    struct.pack('<IHBB', baud, int(args.duration * 1000),
+                                ports, length))
+  # The Piksi changes the FTDI baud rate before starting the step.
+  ftdi_baud = baud if ports & PORTS['ftdi'] else serial_link.DEFAULT_BAUD
+  if ftdi_baud != link_baud:
+    time.sleep(0.1)
+    link.close()
+    link = open_link(ftdi_baud)
+    link_baud = ftdi_baud
+  with rx_lock:
+    rx_frames = rx_bytes = rx_bad = 0
+  t0 = time.time()
+  if not report_event.wait(args.duration + 5):
+    print >> sys.stderr, "No report for baud %d, len %d" % (baud, length)
+    return link, link_baud
+  host_rate = rx_bytes / (time.time() - t0) / 1024.0
+
+  baud_, duration_ms, ports_, length_ = struct.unpack('<IHBB', report[:8])
+  for i in range(3):
+    (frames, nbytes, drops, short_writes, idle_gaps, idle_gap_max,
+     idle_gap_sum, crc_errors) = struct.unpack('<IIIIIIQH',
+                                               report[8 + 34*i:8 + 34*(i+1)])
+    if not ports & (1 << i):
+      continue
+    rate = nbytes / (duration_ms / 1000.0) / 1024.0
+    idle_mean = idle_gap_sum / idle_gaps if idle_gaps else 0
+    print "%d,%d,%s,%d,%.2f,%s,%d,%d,%d,%.1f,%.1f,%d" % (
+      baud_, length_, PORT_NAMES[i], frames, rate,
+      "%.2f" % host_rate if i == 2 else "",
+      drops, short_writes, idle_gaps,
+      idle_gap_max * 1e6 / CPU_FREQ, idle_mean * 1e6 / CPU_FREQ, crc_errors)
+  if ports & PORTS['ftdi'] and rx_bad:
+    print >> sys.stderr, "%d corrupt payloads received" % rx_bad
+  sys.stdout.flush()
+  return link, link_baud
+
+link_baud = serial_link.DEFAULT_BAUD
+link = open_link(link_baud)
+
+print "baud,len,port,frames,kB/s,host_kB/s,drops,short_writes,idle_gaps," \
+      "idle_gap_max_us,idle_gap_mean_us,crc_errors"
 try:
-  old = 0
-  while True:
-    time.sleep(1)
-    kbs = (ok_byte_count - old) / 1024.0
-    if ok_byte_count != old:
-      print "%d Messages (%d kB) %.2f kB/s" % (ok_count, ok_byte_count/1024, kbs)
-    old = ok_byte_count
+  for baud in map(int, args.bauds.split(',')):
+    for usarts in args.usarts.split(','):
+      ports = sum(PORTS[u] for u in usarts.split('+'))
+      for length in map(int, args.lens.split(',')):
+        link, link_baud = run_step(link, link_baud, baud, ports, length)
 except KeyboardInterrupt:
   pass
 finally:
   link.close()
-
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Fergus Noble <fergus@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* Throughput of the solution pipeline on simulated observations.
+ *
+ * The simulator is seeded and stepped a fixed SIM_BENCH_DT at a time, as
+ * fast as the CPU allows, and each epoch's rover and base observations are
+ * run through calc_PVT(), single_diff() and process_matched_obs() as the
+ * solution thread does. Every SIM_BENCH_N_EPOCHS epochs the rate achieved
+ * is printed and the per stage cycle counts are sent as MSG_PROBE_STATE,
+ * see sim_bench_test.py. The same seed always gives the same solutions, as
+ * printed with the rate. */
+
+#include <stdio.h>
+#include <string.h>
+#include <libswiftnav/constants.h>
+#include <libswiftnav/pvt.h>
+#include <libswiftnav/single_diff.h>
+
+#include "../bench/bench.h"
+#include "main.h"
+#include "sbp.h"
+#include "position.h"
+#include "probe.h"
+#include "simulator.h"
+#include "solution.h"
+#include "board/leds.h"
+
+/** Seed of the simulated observations. */
+#define SIM_BENCH_SEED 1
+/** Simulated time between epochs, (s). */
+#define SIM_BENCH_DT 0.1
+/** Epochs between reports. */
+#define SIM_BENCH_N_EPOCHS 100
+
+static PROBE_DECL(probe_sim_step, "simulation_step_dt");
+static PROBE_DECL(probe_pvt, "calc_PVT");
+static PROBE_DECL(probe_single_diff, "single_diff");
+static PROBE_DECL(probe_matched_obs, "process_matched_obs");
+static PROBE_DECL(probe_epoch, "epoch");
+
+int main(void)
+{
+  bench_init("SOLUTION PIPELINE SIMULATION BENCHMARK");
+
+  simulator_setup();
+  simulation_seed(SIM_BENCH_SEED);
+
+  u32 n_epochs = 0;
+  u32 n_failed = 0;
+  u32 t_report = probe_now();
+  u64 report_cycles = 0;
+
+  while (1) {
+    u32 t_epoch = probe_now();
+
+    u32 t0 = probe_now();
+    simulation_step_dt(SIM_BENCH_DT);
+    probe_end(&probe_sim_step, t0);
+
+    u8 n = simulation_current_num_sats();
+    navigation_measurement_t *rover_nm = simulation_current_navigation_measurements();
+    navigation_measurement_t *base_nm = simulation_current_base_navigation_measurements();
+    gps_time_t t = simulation_current_gnss_solution()->time;
+
+    gnss_solution soln;
+    dops_t dops;
+    t0 = probe_now();
+    s8 ret = calc_PVT(n, rover_nm, &soln, &dops);
+    probe_end(&probe_pvt, t0);
+
+    if (ret < 0) {
+      n_failed++;
+    } else {
+      position_solution = soln;
+      position_updated();
+
+      /* single_diff() expects the observations sorted by PRN, the
+       * simulator fills them in almanac order which already is. */
+      static sdiff_t sds[MAX_CHANNELS];
+      t0 = probe_now();
+      u8 n_sds = single_diff(n, rover_nm, n, base_nm, sds);
+      probe_end(&probe_single_diff, t0);
+
+      t0 = probe_now();
+      process_matched_obs(n_sds, &t, sds, SIM_BENCH_DT);
+      probe_end(&probe_matched_obs, t0);
+    }
+
+    u32 epoch_cycles = probe_now() - t_epoch;
+    probe_record(&probe_epoch, epoch_cycles);
+    n_epochs++;
+
+    if (n_epochs % SIM_BENCH_N_EPOCHS == 0) {
+      report_cycles = probe_now() - t_report;
+      printf("%lu epochs, %lu failed, %lu.%01lu epochs/s, "
+             "pos %ld %ld %ld mm\n",
+             (unsigned long)n_epochs, (unsigned long)n_failed,
+             (unsigned long)(SIM_BENCH_N_EPOCHS * (u64)SYSTEM_CLOCK
+                             / report_cycles),
+             (unsigned long)(10 * SIM_BENCH_N_EPOCHS
+                             * (u64)SYSTEM_CLOCK / report_cycles
+                             % 10),
+             (long)(position_solution.pos_ecef[0] * 1e3),
+             (long)(position_solution.pos_ecef[1] * 1e3),
+             (long)(position_solution.pos_ecef[2] * 1e3));
+      probe_send_all();
+      led_toggle(LED_GREEN);
+      /* Restart the timing after the report has been queued. */
+      t_report = probe_now();
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,30 @@
+#!/usr/bin/env python
+
+# Print the cycle counts reported by the solution pipeline simulation
+# benchmark, one line per probe each round, as comma separated
+# name,count,min,mean,max. The epoch rate is printed by the Piksi.
+
+import sys, os, struct, time
+sys.path.append(os.path.join(os.path.dirname(__file__), '..', '..', 'scripts'))
+
+import serial_link
+import sbp_piksi
+
+def probe_state_cb(data):
+  name, count, min_, max_, mean = struct.unpack('<20sIIII', data[:36])
+  print "%s,%d,%d,%d,%d" % (name.rstrip('\0'), count, min_, mean, max_)
+  sys.stdout.flush()
+
+link = serial_link.SerialLink()
+
+link.add_callback(serial_link.MSG_PRINT, serial_link.default_print_callback)
+link.add_callback(sbp_piksi.PROBE_STATE, probe_state_cb)
+
+print "name,count,min,mean,max"
+try:
+  while True:
+    time.sleep(1)
+except KeyboardInterrupt:
+  pass
+finally:
+  link.close()